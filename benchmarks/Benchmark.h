@@ -0,0 +1,75 @@
+#ifndef Benchmark_h
+#define Benchmark_h
+
+#include <stdint.h>
+#include <functional>
+
+// A small harness for timing hot paths:
+//
+//     RCT_BENCHMARK(StringAppend)
+//     {
+//         String out;
+//         for (uint64_t i = 0; i < state.iterations(); ++i)
+//             out += 'a';
+//         Benchmark::doNotOptimize(out);
+//     }
+//
+// The function is called with more iterations until a run takes long
+// enough to be measured, then the run is repeated and the median time per
+// iteration is reported. Setup that shouldn't count goes before
+// state.start(), otherwise timing starts when the function is called.
+namespace Benchmark {
+
+class State
+{
+public:
+    State(uint64_t iterations);
+
+    uint64_t iterations() const { return mIterations; }
+
+    // excludes what happened before from the time
+    void start();
+    // excludes what happens after from the time
+    void stop();
+
+    // counted per iteration in the results, as items/s and bytes/s
+    void setItemsProcessed(uint64_t items) { mItems = items; }
+    void setBytesProcessed(uint64_t bytes) { mBytes = bytes; }
+
+    // ns, of the clock and the CPU time of the process
+    uint64_t elapsed() const;
+    uint64_t cpuTime() const;
+    uint64_t items() const { return mItems; }
+    uint64_t bytes() const { return mBytes; }
+
+private:
+    const uint64_t mIterations;
+    uint64_t mStart, mStop, mCpuStart, mCpuStop, mItems, mBytes;
+};
+
+typedef std::function<void(State &state)> Function;
+
+struct Registration
+{
+    Registration(const char *name, Function &&function);
+};
+
+template <typename T>
+inline void doNotOptimize(const T &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// monotonic ns
+uint64_t now();
+// ns of CPU used by the process
+uint64_t cpuNow();
+
+}
+
+#define RCT_BENCHMARK(name)                                             \
+    static void name(Benchmark::State &state);                          \
+    static Benchmark::Registration name##Registration(#name, name);     \
+    static void name(Benchmark::State &state)
+
+#endif
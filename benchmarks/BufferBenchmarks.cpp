@@ -0,0 +1,48 @@
+#include <string.h>
+
+#include <rct/Buffer.h>
+
+#include "Benchmark.h"
+
+RCT_BENCHMARK(BufferPoolAcquireRelease)
+{
+    BufferPool pool;
+    for (uint64_t i = 0; i < state.iterations(); ++i) {
+        Buffer buffer = pool.acquire(4096);
+        Benchmark::doNotOptimize(buffer.data());
+        pool.release(std::move(buffer));
+    }
+}
+
+RCT_BENCHMARK(BufferResize)
+{
+    for (uint64_t i = 0; i < state.iterations(); ++i) {
+        Buffer buffer;
+        for (size_t size = 64; size <= 16384; size *= 2)
+            buffer.resize(size);
+        Benchmark::doNotOptimize(buffer.data());
+    }
+}
+
+// how Connection reads messages out of what the socket delivered
+RCT_BENCHMARK(BuffersPushRead)
+{
+    enum { Chunk = 1024, Chunks = 16, Message = 100 };
+    std::shared_ptr<BufferPool> pool = std::make_shared<BufferPool>();
+    Buffers buffers;
+    buffers.setPool(pool);
+    char out[Message];
+    state.start();
+    for (uint64_t i = 0; i < state.iterations(); ++i) {
+        for (int c = 0; c < Chunks; ++c) {
+            Buffer buffer = pool->acquire(Chunk);
+            buffer.resize(Chunk);
+            memset(buffer.data(), c, Chunk);
+            buffers.push(std::move(buffer));
+        }
+        while (buffers.size())
+            buffers.read(out, sizeof(out));
+        Benchmark::doNotOptimize(out);
+    }
+    state.setBytesProcessed(static_cast<uint64_t>(Chunk) * Chunks * state.iterations());
+}
@@ -0,0 +1,40 @@
+#include <sys/socket.h>
+
+#include <rct/Connection.h>
+#include <rct/EventLoop.h>
+#include <rct/SocketClient.h>
+
+#include "Benchmark.h"
+
+// a ResponseMessage there and back over a socketpair, both ends on one loop
+RCT_BENCHMARK(ConnectionRoundTrip)
+{
+    EventLoop::SharedPtr loop(new EventLoop);
+    loop->init();
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+        return;
+    std::shared_ptr<Connection> client = Connection::create(std::make_shared<SocketClient>(fds[0], SocketClient::Unix));
+    std::shared_ptr<Connection> server = Connection::create(std::make_shared<SocketClient>(fds[1], SocketClient::Unix));
+    const ResponseMessage message(String(64, 'x'));
+    server->newMessage().connect([&message](const std::shared_ptr<Message> &, const std::shared_ptr<Connection> &connection) {
+            connection->send(message);
+        });
+    uint64_t count = 0;
+    const uint64_t iterations = state.iterations();
+    client->newMessage().connect([&count, &message, iterations, loop](const std::shared_ptr<Message> &,
+                                                                      const std::shared_ptr<Connection> &connection) {
+            if (++count == iterations) {
+                loop->quit();
+            } else {
+                connection->send(message);
+            }
+        });
+    state.start();
+    client->send(message);
+    loop->exec();
+    state.stop();
+    state.setItemsProcessed(iterations);
+    client->close();
+    server->close();
+}
@@ -0,0 +1,67 @@
+#include <atomic>
+#include <thread>
+
+#include <rct/EventLoop.h>
+#include <rct/SignalSlot.h>
+
+#include "Benchmark.h"
+
+RCT_BENCHMARK(EventLoopPost)
+{
+    EventLoop::SharedPtr loop(new EventLoop);
+    loop->init();
+    uint64_t count = 0;
+    const uint64_t iterations = state.iterations();
+    state.start();
+    for (uint64_t i = 0; i < iterations; ++i) {
+        loop->callLater([&count, iterations, loop]() {
+                if (++count == iterations)
+                    loop->quit();
+            });
+    }
+    loop->exec();
+    state.stop();
+    state.setItemsProcessed(iterations);
+}
+
+RCT_BENCHMARK(EventLoopPostFromThread)
+{
+    EventLoop::SharedPtr loop(new EventLoop);
+    loop->init();
+    uint64_t count = 0;
+    const uint64_t iterations = state.iterations();
+    state.start();
+    std::thread poster([&count, iterations, loop]() {
+            for (uint64_t i = 0; i < iterations; ++i) {
+                loop->callLater([&count, iterations, loop]() {
+                        if (++count == iterations)
+                            loop->quit();
+                    });
+            }
+        });
+    loop->exec();
+    state.stop();
+    poster.join();
+    state.setItemsProcessed(iterations);
+}
+
+RCT_BENCHMARK(SignalEmit)
+{
+    Signal<std::function<void(int)> > signal;
+    int sum = 0;
+    signal.connect([&sum](int value) { sum += value; });
+    for (uint64_t i = 0; i < state.iterations(); ++i)
+        signal(1);
+    Benchmark::doNotOptimize(sum);
+}
+
+RCT_BENCHMARK(SignalEmit4)
+{
+    Signal<std::function<void(int)> > signal;
+    int sum = 0;
+    for (int i = 0; i < 4; ++i)
+        signal.connect([&sum](int value) { sum += value; });
+    for (uint64_t i = 0; i < state.iterations(); ++i)
+        signal(1);
+    Benchmark::doNotOptimize(sum);
+}
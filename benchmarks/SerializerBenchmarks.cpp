@@ -0,0 +1,73 @@
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/Serializer.h>
+#include <rct/String.h>
+
+#include "Benchmark.h"
+
+struct Record
+{
+    String name;
+    uint64_t id;
+    List<String> tags;
+    Map<String, int> counts;
+};
+
+static Serializer &operator<<(Serializer &s, const Record &record)
+{
+    s << record.name << record.id << record.tags << record.counts;
+    return s;
+}
+
+static Deserializer &operator>>(Deserializer &s, Record &record)
+{
+    s >> record.name >> record.id >> record.tags >> record.counts;
+    return s;
+}
+
+static Record record()
+{
+    Record ret;
+    ret.name = "/home/user/src/project/source/file.cpp";
+    ret.id = 0x123456789ULL;
+    for (int i = 0; i < 10; ++i) {
+        ret.tags.append(String::format<32>("tag%d", i));
+        ret.counts[String::format<32>("count%d", i)] = i * 1000;
+    }
+    return ret;
+}
+
+RCT_BENCHMARK(SerializerEncode)
+{
+    const Record r = record();
+    String out;
+    size_t bytes = 0;
+    state.start();
+    for (uint64_t i = 0; i < state.iterations(); ++i) {
+        out.clear();
+        {
+            Serializer serializer(out);
+            serializer << r;
+        }
+        bytes += out.size();
+    }
+    Benchmark::doNotOptimize(out);
+    state.setBytesProcessed(bytes);
+}
+
+RCT_BENCHMARK(SerializerDecode)
+{
+    String data;
+    {
+        Serializer serializer(data);
+        serializer << record();
+    }
+    state.start();
+    for (uint64_t i = 0; i < state.iterations(); ++i) {
+        Deserializer deserializer(data);
+        Record r;
+        deserializer >> r;
+        Benchmark::doNotOptimize(r.id);
+    }
+    state.setBytesProcessed(data.size() * state.iterations());
+}
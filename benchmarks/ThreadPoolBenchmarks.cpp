@@ -0,0 +1,31 @@
+#include <vector>
+
+#include <rct/ThreadPool.h>
+
+#include "Benchmark.h"
+
+static void submit(Benchmark::State &state, ThreadPool::Scheduling scheduling)
+{
+    ThreadPool pool(ThreadPool::idealThreadCount(), Thread::Normal, 0, scheduling);
+    std::vector<Future<uint64_t> > futures;
+    futures.reserve(state.iterations());
+    state.start();
+    for (uint64_t i = 0; i < state.iterations(); ++i)
+        futures.push_back(pool.submit([i]() { return i; }));
+    uint64_t sum = 0;
+    for (Future<uint64_t> &future : futures)
+        sum += future.get();
+    state.stop();
+    Benchmark::doNotOptimize(sum);
+    state.setItemsProcessed(state.iterations());
+}
+
+RCT_BENCHMARK(ThreadPoolSubmitShared)
+{
+    submit(state, ThreadPool::SharedQueue);
+}
+
+RCT_BENCHMARK(ThreadPoolSubmitStealing)
+{
+    submit(state, ThreadPool::WorkStealing);
+}
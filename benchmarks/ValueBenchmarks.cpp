@@ -0,0 +1,40 @@
+#include <rct/Value.h>
+
+#include "Benchmark.h"
+
+static String document()
+{
+    String json = "[";
+    for (int i = 0; i < 200; ++i) {
+        if (i)
+            json += ',';
+        json.appendFormat("{\"id\":%d,\"name\":\"item %d\",\"path\":\"/usr/include/c++/%d/vector\","
+                          "\"score\":%d.25,\"enabled\":%s,\"tags\":[\"a\",\"b\",\"c\"]}",
+                          i, i, i, i, i % 2 ? "true" : "false");
+    }
+    json += ']';
+    return json;
+}
+
+RCT_BENCHMARK(ValueFromJSON)
+{
+    const String json = document();
+    state.start();
+    for (uint64_t i = 0; i < state.iterations(); ++i) {
+        const Value value = Value::fromJSON(json);
+        Benchmark::doNotOptimize(value.count());
+    }
+    state.setBytesProcessed(json.size() * state.iterations());
+}
+
+RCT_BENCHMARK(ValueToJSON)
+{
+    const Value value = Value::fromJSON(document());
+    size_t bytes = 0;
+    state.start();
+    for (uint64_t i = 0; i < state.iterations(); ++i) {
+        const String json = value.toJSON();
+        bytes += json.size();
+    }
+    state.setBytesProcessed(bytes);
+}
@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+"""Compares two runs of rct_bench --json.
+
+    compare.py [--threshold percent] baseline.json current.json
+
+Prints the change in time per iteration of every benchmark the two have in
+common and exits with 1 if any got slower by more than the threshold, 5%
+unless it's given.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    return {b["name"]: b for b in data.get("benchmarks", [])}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compares two runs of rct_bench --json")
+    parser.add_argument("--threshold", type=float, default=5.0,
+                        help="percent a benchmark may get slower before it counts as a regression")
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    current = load(args.current)
+
+    regressions = 0
+    print("%-40s %14s %14s %9s" % ("Benchmark", "Baseline (ns)", "Current (ns)", "Change"))
+    for name in sorted(set(baseline) | set(current)):
+        if name not in baseline or name not in current:
+            print("%-40s %s" % (name, "only in current" if name in current else "only in baseline"))
+            continue
+        before = baseline[name]["real_time"]
+        after = current[name]["real_time"]
+        change = (after - before) * 100.0 / before if before else 0.0
+        mark = ""
+        if change > args.threshold:
+            mark = " slower"
+            regressions += 1
+        elif change < -args.threshold:
+            mark = " faster"
+        print("%-40s %14.1f %14.1f %+8.1f%%%s" % (name, before, after, change, mark))
+
+    if regressions:
+        print("%d benchmark%s got slower by more than %g%%" % (regressions, "" if regressions == 1 else "s", args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,450 @@
+// Drives client Connections against an echo server and reports throughput
+// and latency
+//
+//     rct-loadgen [--unix path | --tcp [host:]port] [--server | --connect]
+//                 [--connections n] [--size bytes] [--depth n] [--rate n]
+//                 [--duration s] [--warmup s] [--compression none|zlib|lz4|zstd]
+//                 [--random] [--server-loops n] [--client-loops n] [--json file]
+//
+// Without --server or --connect the server runs in the same process, on
+// its own loops with --server-loops. Each connection keeps up to --depth
+// messages in flight. With --rate, messages per second over all
+// connections, messages are due on a fixed schedule and their latency is
+// measured from when they were due rather than from when they could be
+// sent, so a stall counts against every message it held up instead of
+// only the one that was waiting (coordinated omission). Without a rate
+// every response is answered with the next message right away and the
+// latency is the round trip. With --compression both sides ask for it, a
+// client's message keeps its compressed encoding so it's the server that
+// compresses every message.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include <rct/Connection.h>
+#include <rct/EventLoop.h>
+#include <rct/EventLoopGroup.h>
+#include <rct/Log.h>
+#include <rct/Message.h>
+#include <rct/Metrics.h>
+#include <rct/SocketServer.h>
+#include <rct/String.h>
+#include <rct/Timer.h>
+
+class LoadMessage : public Message
+{
+public:
+    enum { MessageId = 100 };
+
+    LoadMessage(uint8_t flags = None, const String &data = String())
+        : Message(MessageId, flags), mData(data)
+    {}
+
+    const String &data() const { return mData; }
+
+    RCT_MESSAGE_FIELDS(mData)
+private:
+    String mData;
+};
+
+struct Options
+{
+    Options()
+        : port(0), server(false), connect(false), connections(4), size(64), depth(1), rate(0),
+          duration(5), warmup(1), flags(Message::None), random(false), serverLoops(0), clientLoops(1), json(0)
+    {}
+
+    Path path;
+    String host;
+    uint16_t port;
+    bool server, connect;
+    int connections;
+    size_t size;
+    size_t depth;
+    double rate;
+    double duration, warmup;
+    uint8_t flags;
+    bool random;
+    int serverLoops, clientLoops;
+    const char *json;
+};
+
+static uint64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// ns, responses to messages due before the start or received after the
+// end aren't counted
+static std::atomic<uint64_t> sMeasureStart(~0ULL), sMeasureEnd(~0ULL);
+
+struct Stats
+{
+    Stats()
+        : latency(metrics.histogram("latency_ns")), messages(metrics.counter("messages")),
+          bytes(metrics.counter("bytes")), errors(metrics.counter("errors"))
+    {}
+
+    Metrics metrics;
+    Metrics::Histogram &latency;
+    Metrics::Counter &messages, &bytes, &errors;
+};
+
+// lives on the thread of its loop
+struct Client
+{
+    Client(const LoadMessage &m)
+        : message(m), next(0), interval(0), timer(0)
+    {}
+
+    EventLoop::SharedPtr loop;
+    // its own since a message caches its encoding
+    const LoadMessage message;
+    std::shared_ptr<Connection> connection;
+    // when the messages in flight were due, responses come back in order
+    std::deque<uint64_t> inFlight;
+    uint64_t next, interval;
+    int timer;
+};
+
+static void pump(Client *client, const Options &options, Stats &stats)
+{
+    if (!client->connection || !client->connection->isConnected())
+        return;
+    const uint64_t time = now();
+    while (client->inFlight.size() < options.depth && (!client->interval || client->next <= time)) {
+        if (!client->connection->send(client->message)) {
+            stats.errors.add();
+            return;
+        }
+        if (client->interval) {
+            client->inFlight.push_back(client->next);
+            client->next += client->interval;
+        } else {
+            client->inFlight.push_back(time);
+        }
+    }
+    // wakes up when the next one is due, a full pipeline is pumped by
+    // the responses
+    if (client->interval && !client->timer && client->inFlight.size() < options.depth) {
+        const uint64_t us = (client->next - time + 999) / 1000;
+        client->timer = client->loop->registerTimerUs([client, &options, &stats](int) {
+                client->timer = 0;
+                pump(client, options, stats);
+            }, us, Timer::SingleShot);
+    }
+}
+
+static void startClient(Client *client, const Options &options, Stats &stats)
+{
+    std::shared_ptr<Connection> connection = Connection::create();
+    client->connection = connection;
+    connection->connected().connect([client, &options, &stats](const std::shared_ptr<Connection> &) {
+            client->next = now();
+            pump(client, options, stats);
+        });
+    connection->newMessage().connect([client, &options, &stats](const std::shared_ptr<Message> &response,
+                                                                const std::shared_ptr<Connection> &) {
+            const uint64_t time = now();
+            if (client->inFlight.empty() || response->messageId() != LoadMessage::MessageId) {
+                stats.errors.add();
+                return;
+            }
+            const uint64_t due = client->inFlight.front();
+            client->inFlight.pop_front();
+            if (due >= sMeasureStart.load(std::memory_order_relaxed) && time <= sMeasureEnd.load(std::memory_order_relaxed)) {
+                stats.latency.observe(time - due);
+                stats.messages.add();
+                stats.bytes.add(static_cast<const LoadMessage *>(response.get())->data().size());
+            }
+            pump(client, options, stats);
+        });
+    connection->disconnected().connect([&stats](const std::shared_ptr<Connection> &) {
+            if (now() < sMeasureEnd.load(std::memory_order_relaxed))
+                stats.errors.add();
+        });
+    const bool ok = options.path.isEmpty() ? connection->connectTcp(options.host, options.port, 5000)
+                                           : connection->connectUnix(options.path, 5000);
+    if (!ok) {
+        error() << "Couldn't connect to" << (options.path.isEmpty() ? options.host : options.path);
+        stats.errors.add();
+    }
+}
+
+static void stopClient(Client *client)
+{
+    if (client->timer)
+        client->loop->unregisterTimer(client->timer);
+    if (std::shared_ptr<Connection> connection = client->connection) {
+        connection->connected().disconnect();
+        connection->newMessage().disconnect();
+        connection->disconnected().disconnect();
+        if (connection->client())
+            connection->close();
+    }
+    client->connection.reset();
+}
+
+// echoes every LoadMessage
+static void serve(const SocketClient::SharedPtr &socket, uint8_t flags)
+{
+    std::shared_ptr<Connection> connection = Connection::create(socket);
+    connection->newMessage().connect([flags](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &c) {
+            if (message->messageId() == LoadMessage::MessageId)
+                c->send(LoadMessage(flags, static_cast<const LoadMessage *>(message.get())->data()));
+        });
+    // kept alive by its own slot until the peer goes away
+    connection->disconnected().connect([connection](const std::shared_ptr<Connection> &) {
+            connection->newMessage().disconnect();
+            connection->disconnected().disconnect();
+        });
+}
+
+static bool listen(const SocketServer::SharedPtr &server, const Options &options)
+{
+    if (!options.path.isEmpty()) {
+        Path::rm(options.path);
+        return server->listen(options.path);
+    }
+    return server->listen(options.port);
+}
+
+static void usage(FILE *f, const char *argv0)
+{
+    fprintf(f, "Usage: %s [--unix path | --tcp [host:]port] [--server | --connect]\n"
+            "    [--connections n] [--size bytes] [--depth n] [--rate messages/s]\n"
+            "    [--duration s] [--warmup s] [--compression none|zlib|lz4|zstd] [--random]\n"
+            "    [--server-loops n] [--client-loops n] [--json file]\n", argv0);
+}
+
+static bool parse(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; ++i) {
+        const bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--unix") && hasValue) {
+            options.path = argv[++i];
+        } else if (!strcmp(argv[i], "--tcp") && hasValue) {
+            const String address = argv[++i];
+            const size_t colon = address.lastIndexOf(':');
+            if (colon != String::npos)
+                options.host = address.left(colon);
+            options.port = static_cast<uint16_t>(atoi(address.constData() + (colon == String::npos ? 0 : colon + 1)));
+            if (!options.port)
+                return false;
+        } else if (!strcmp(argv[i], "--server")) {
+            options.server = true;
+        } else if (!strcmp(argv[i], "--connect")) {
+            options.connect = true;
+        } else if (!strcmp(argv[i], "--connections") && hasValue) {
+            options.connections = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--size") && hasValue) {
+            options.size = strtoull(argv[++i], 0, 10);
+        } else if (!strcmp(argv[i], "--depth") && hasValue) {
+            options.depth = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--rate") && hasValue) {
+            options.rate = std::max(0.0, atof(argv[++i]));
+        } else if (!strcmp(argv[i], "--duration") && hasValue) {
+            options.duration = std::max(0.1, atof(argv[++i]));
+        } else if (!strcmp(argv[i], "--warmup") && hasValue) {
+            options.warmup = std::max(0.0, atof(argv[++i]));
+        } else if (!strcmp(argv[i], "--compression") && hasValue) {
+            const char *codec = argv[++i];
+            if (!strcmp(codec, "zlib")) {
+                options.flags = Message::Compressed;
+            } else if (!strcmp(codec, "lz4")) {
+                options.flags = Message::Compressed|Message::Lz4;
+            } else if (!strcmp(codec, "zstd")) {
+                options.flags = Message::Compressed|Message::Zstd;
+            } else if (strcmp(codec, "none")) {
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--random")) {
+            options.random = true;
+        } else if (!strcmp(argv[i], "--server-loops") && hasValue) {
+            options.serverLoops = std::max(0, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--client-loops") && hasValue) {
+            options.clientLoops = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--json") && hasValue) {
+            options.json = argv[++i];
+        } else {
+            return false;
+        }
+    }
+    return !(options.server && options.connect);
+}
+
+static String payload(const Options &options)
+{
+    String ret(options.size, ' ');
+    if (options.random) {
+        srand(static_cast<unsigned int>(now()));
+        for (size_t i = 0; i < ret.size(); ++i)
+            ret[i] = static_cast<char>(rand());
+    } else {
+        static const char text[] = "The quick brown fox jumps over the lazy dog. ";
+        for (size_t i = 0; i < ret.size(); ++i)
+            ret[i] = text[i % (sizeof(text) - 1)];
+    }
+    return ret;
+}
+
+static bool report(const Options &options, Stats &stats, double seconds)
+{
+    Metrics::HistogramSnapshot latency;
+    for (const Metrics::Sample &sample : stats.metrics.snapshot()) {
+        if (sample.type == Metrics::HistogramType)
+            latency = sample.histogram;
+    }
+    const uint64_t messages = stats.messages.value(), bytes = stats.bytes.value(), errors = stats.errors.value();
+    const double throughput = messages / seconds, mbs = bytes / seconds / 1e6;
+    const double p50 = latency.percentile(.5) / 1e3, p99 = latency.percentile(.99) / 1e3;
+    const double p999 = latency.percentile(.999) / 1e3, max = latency.max / 1e3;
+    const double mean = latency.count ? static_cast<double>(latency.sum) / latency.count / 1e3 : 0;
+
+    FILE *out = options.json && !strcmp(options.json, "-") ? stderr : stdout;
+    fprintf(out, "%d connections, %zu bytes, depth %zu, %s\n", options.connections, options.size, options.depth,
+            options.rate ? String::format<64>("%.0f messages/s due", options.rate).constData() : "closed loop");
+    fprintf(out, "%-12s %14.0f messages/s %10.3f MB/s\n", "Throughput", throughput, mbs);
+    fprintf(out, "%-12s %10.1f us mean %10.1f us p50 %10.1f us p99 %10.1f us p999 %10.1f us max\n",
+            "Latency", mean, p50, p99, p999, max);
+    if (errors)
+        fprintf(out, "%-12s %14llu\n", "Errors", static_cast<unsigned long long>(errors));
+    if (options.rate && throughput < options.rate * .95)
+        fprintf(out, "Fell behind the rate, the server or the client is saturated\n");
+
+    if (!options.json)
+        return true;
+    FILE *f = strcmp(options.json, "-") ? fopen(options.json, "w") : stdout;
+    if (!f) {
+        fprintf(stderr, "Can't open %s for writing\n", options.json);
+        return false;
+    }
+    fprintf(f, "{\n  \"connections\": %d,\n  \"size\": %zu,\n  \"depth\": %zu,\n  \"rate\": %.3f,\n"
+            "  \"seconds\": %.3f,\n  \"messages\": %llu,\n  \"errors\": %llu,\n"
+            "  \"messages_per_second\": %.3f,\n  \"bytes_per_second\": %.3f,\n"
+            "  \"latency_us\": { \"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f }\n}\n",
+            options.connections, options.size, options.depth, options.rate, seconds,
+            static_cast<unsigned long long>(messages), static_cast<unsigned long long>(errors),
+            throughput, bytes / seconds, mean, p50, p99, p999, max);
+    return f == stdout ? !fflush(f) : !fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (argc > 1 && (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h"))) {
+        usage(stdout, argv[0]);
+        return 0;
+    }
+    if (!parse(argc, argv, options)) {
+        usage(stderr, argv[0]);
+        return 1;
+    }
+    if (options.path.isEmpty() && !options.port) {
+        if (options.connect || options.server) {
+            fprintf(stderr, "--server and --connect need --unix or --tcp\n");
+            return 1;
+        }
+        options.path = String::format<64>("/tmp/rct-loadgen-%d.sock", getpid());
+    }
+    if (options.host.isEmpty())
+        options.host = "127.0.0.1";
+
+    initLogging(argv[0], LogStderr, LogLevel::Error);
+    Message::registerMessage<LoadMessage>();
+
+    EventLoop::SharedPtr loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop|EventLoop::EnableSigIntHandler|EventLoop::EnableSigTermHandler);
+
+    SocketServer::SharedPtr server;
+    std::shared_ptr<EventLoopGroup> serverLoops;
+    if (!options.connect) {
+        server.reset(new SocketServer);
+        if (options.serverLoops) {
+            serverLoops = std::make_shared<EventLoopGroup>();
+            serverLoops->start(options.serverLoops);
+            server->setEventLoopGroup(serverLoops);
+        }
+        const uint8_t flags = options.flags;
+        server->newConnection().connect([flags](SocketServer *s) {
+                while (SocketClient::SharedPtr socket = s->nextConnection())
+                    serve(socket, flags);
+            });
+        server->newClient().connect([flags](SocketServer *, const SocketClient::SharedPtr &socket) {
+                serve(socket, flags);
+            });
+        if (!listen(server, options)) {
+            fprintf(stderr, "Can't listen on %s\n", options.path.isEmpty() ? String::number(options.port).constData()
+                                                                          : options.path.constData());
+            return 1;
+        }
+    }
+    if (options.server) {
+        loop->exec();
+        server.reset();
+        return 0;
+    }
+
+    Stats stats;
+    const LoadMessage message(options.flags, payload(options));
+    EventLoopGroup clientLoops;
+    clientLoops.start(options.clientLoops, EventLoop::EnableHighResTimers);
+    std::vector<std::unique_ptr<Client> > clients;
+    for (int i = 0; i < options.connections; ++i) {
+        Client *client = new Client(message);
+        clients.emplace_back(client);
+        client->loop = clientLoops.loop(i % clientLoops.size());
+        if (options.rate)
+            client->interval = static_cast<uint64_t>(1e9 * options.connections / options.rate);
+        client->loop->callLater([client, &options, &stats]() { startClient(client, options, stats); });
+    }
+
+    const uint64_t start = now() + static_cast<uint64_t>(options.warmup * 1e9);
+    sMeasureStart = start;
+    const uint64_t end = start + static_cast<uint64_t>(options.duration * 1e9);
+    loop->registerTimer([loop, end](int) {
+            if (now() >= end)
+                loop->quit();
+        }, 10);
+    loop->exec();
+    sMeasureEnd = std::min(end, now());
+    const double seconds = (sMeasureEnd - start) / 1e9;
+
+    std::vector<std::future<void> > stopped;
+    for (const std::unique_ptr<Client> &c : clients) {
+        Client *client = c.get();
+        std::shared_ptr<std::promise<void> > promise = std::make_shared<std::promise<void> >();
+        stopped.push_back(promise->get_future());
+        client->loop->callLater([client, promise]() {
+                stopClient(client);
+                promise->set_value();
+            });
+    }
+    for (std::future<void> &future : stopped)
+        future.wait();
+    clientLoops.stop();
+
+    if (server) {
+        // lets the server see the clients go
+        loop->exec(100);
+        server->close();
+        if (serverLoops)
+            serverLoops->stop();
+        if (!options.path.isEmpty())
+            Path::rm(options.path);
+    }
+
+    if (seconds <= 0) {
+        fprintf(stderr, "Interrupted during the warmup\n");
+        return 1;
+    }
+    return report(options, stats, seconds) ? 0 : 1;
+}
@@ -0,0 +1,230 @@
+// Runs the benchmarks registered with RCT_BENCHMARK()
+//
+//     rct_bench [--filter text] [--min-time ms] [--repetitions n] [--json file] [--list]
+//
+// The JSON has the layout of Google Benchmark's so tools for that read
+// it, compare.py compares two of them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include <rct/Log.h>
+#include <rct/String.h>
+
+#include "Benchmark.h"
+
+namespace Benchmark {
+
+struct Entry
+{
+    const char *name;
+    Function function;
+};
+
+static std::vector<Entry> &entries()
+{
+    static std::vector<Entry> ret;
+    return ret;
+}
+
+Registration::Registration(const char *name, Function &&function)
+{
+    Entry entry = { name, std::move(function) };
+    entries().push_back(std::move(entry));
+}
+
+uint64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t cpuNow()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts))
+        return 0;
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+State::State(uint64_t iterations)
+    : mIterations(iterations), mStart(now()), mStop(0), mCpuStart(cpuNow()), mCpuStop(0), mItems(0), mBytes(0)
+{
+}
+
+void State::start()
+{
+    mStart = now();
+    mCpuStart = cpuNow();
+}
+
+void State::stop()
+{
+    mStop = now();
+    mCpuStop = cpuNow();
+}
+
+uint64_t State::elapsed() const
+{
+    return (mStop ? mStop : now()) - mStart;
+}
+
+uint64_t State::cpuTime() const
+{
+    return (mCpuStop ? mCpuStop : cpuNow()) - mCpuStart;
+}
+
+}
+
+struct Result
+{
+    String name;
+    uint64_t iterations;
+    // ns per iteration, the median of the repetitions and the fastest
+    double time, fastest;
+    // of the repetition with the median time
+    double cpuTime;
+    double itemsPerSecond, bytesPerSecond;
+};
+
+static Result run(const Benchmark::Entry &entry, uint64_t minTime, int repetitions)
+{
+    // more iterations until one run takes minTime
+    uint64_t iterations = 1, elapsed = 0;
+    for (;;) {
+        Benchmark::State state(iterations);
+        entry.function(state);
+        elapsed = state.elapsed();
+        if (elapsed >= minTime || iterations >= (1ULL << 40))
+            break;
+        const double factor = elapsed ? std::min(10.0, std::max(1.5, minTime * 1.2 / elapsed)) : 10.0;
+        iterations = static_cast<uint64_t>(iterations * factor) + 1;
+    }
+
+    // time and CPU time per iteration
+    std::vector<std::pair<double, double> > times;
+    uint64_t items = 0, bytes = 0;
+    for (int i = 0; i < repetitions; ++i) {
+        Benchmark::State state(iterations);
+        entry.function(state);
+        const uint64_t time = state.elapsed(), cpuTime = state.cpuTime();
+        times.push_back(std::make_pair(static_cast<double>(time) / iterations, static_cast<double>(cpuTime) / iterations));
+        items = state.items();
+        bytes = state.bytes();
+    }
+    std::sort(times.begin(), times.end());
+
+    Result result;
+    result.name = entry.name;
+    result.iterations = iterations;
+    result.time = times[times.size() / 2].first;
+    result.cpuTime = times[times.size() / 2].second;
+    result.fastest = times.front().first;
+    result.itemsPerSecond = items ? items * 1e9 / (result.time * iterations) : 0;
+    result.bytesPerSecond = bytes ? bytes * 1e9 / (result.time * iterations) : 0;
+    return result;
+}
+
+static bool writeJSON(const char *file, const std::vector<Result> &results, int repetitions)
+{
+    FILE *f = strcmp(file, "-") ? fopen(file, "w") : stdout;
+    if (!f) {
+        fprintf(stderr, "Can't open %s for writing\n", file);
+        return false;
+    }
+    char host[256] = { 0 };
+    gethostname(host, sizeof(host) - 1);
+    const time_t t = time(0);
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+    fprintf(f, "{\n  \"context\": {\n    \"date\": \"%s\",\n    \"host_name\": \"%s\",\n"
+            "    \"num_cpus\": %ld,\n    \"repetitions\": %d\n  },\n  \"benchmarks\": [",
+            date, host, sysconf(_SC_NPROCESSORS_ONLN), repetitions);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        fprintf(f, "%s\n    {\n      \"name\": \"%s\",\n      \"iterations\": %llu,\n"
+                "      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n      \"fastest_time\": %.3f,\n"
+                "      \"time_unit\": \"ns\"",
+                i ? "," : "", r.name.constData(), static_cast<unsigned long long>(r.iterations),
+                r.time, r.cpuTime, r.fastest);
+        if (r.itemsPerSecond)
+            fprintf(f, ",\n      \"items_per_second\": %.3f", r.itemsPerSecond);
+        if (r.bytesPerSecond)
+            fprintf(f, ",\n      \"bytes_per_second\": %.3f", r.bytesPerSecond);
+        fprintf(f, "\n    }");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    return f == stdout ? !fflush(f) : !fclose(f);
+}
+
+static void usage(FILE *f, const char *argv0)
+{
+    fprintf(f, "Usage: %s [--filter text] [--min-time ms] [--repetitions n] [--json file] [--list]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = 0, *json = 0;
+    uint64_t minTime = 200;
+    int repetitions = 5;
+    bool list = false;
+    for (int i = 1; i < argc; ++i) {
+        const bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--filter") && hasValue) {
+            filter = argv[++i];
+        } else if (!strcmp(argv[i], "--min-time") && hasValue) {
+            minTime = strtoull(argv[++i], 0, 10);
+        } else if (!strcmp(argv[i], "--repetitions") && hasValue) {
+            repetitions = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--json") && hasValue) {
+            json = argv[++i];
+        } else if (!strcmp(argv[i], "--list")) {
+            list = true;
+        } else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+            usage(stdout, argv[0]);
+            return 0;
+        } else {
+            usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+
+    // without outputs every debug message would be printed and timed
+    initLogging(argv[0], LogStderr, LogLevel::Error);
+
+    std::vector<Benchmark::Entry> &entries = Benchmark::entries();
+    std::sort(entries.begin(), entries.end(), [](const Benchmark::Entry &a, const Benchmark::Entry &b) {
+            return strcmp(a.name, b.name) < 0;
+        });
+    std::vector<Result> results;
+    // the table goes to stderr when the JSON goes to stdout
+    FILE *out = json && !strcmp(json, "-") ? stderr : stdout;
+    if (!list)
+        fprintf(out, "%-40s %14s %14s %14s\n", "Benchmark", "Time (ns)", "Fastest (ns)", "Iterations");
+    for (const Benchmark::Entry &entry : entries) {
+        if (filter && !strstr(entry.name, filter))
+            continue;
+        if (list) {
+            printf("%s\n", entry.name);
+            continue;
+        }
+        const Result result = run(entry, minTime * 1000000, repetitions);
+        fprintf(out, "%-40s %14.1f %14.1f %14llu", result.name.constData(), result.time, result.fastest,
+                static_cast<unsigned long long>(result.iterations));
+        if (result.itemsPerSecond)
+            fprintf(out, " %12.3fM items/s", result.itemsPerSecond / 1e6);
+        if (result.bytesPerSecond)
+            fprintf(out, " %12.3f MB/s", result.bytesPerSecond / 1e6);
+        fprintf(out, "\n");
+        fflush(out);
+        results.push_back(result);
+    }
+    if (json && !list && !writeJSON(json, results, repetitions))
+        return 1;
+    return 0;
+}
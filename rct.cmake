@@ -29,15 +29,54 @@ check_cxx_symbol_exists(CLOCK_MONOTONIC_RAW "time.h" HAVE_CLOCK_MONOTONIC_RAW)
 check_cxx_symbol_exists(CLOCK_MONOTONIC "time.h" HAVE_CLOCK_MONOTONIC)
 check_cxx_symbol_exists(mach_absolute_time "mach/mach.h;mach/mach_time.h" HAVE_MACH_ABSOLUTE_TIME)
 check_cxx_symbol_exists(inotify_init "sys/inotify.h" HAVE_INOTIFY)
+check_cxx_symbol_exists(FAN_REPORT_DFID_NAME "sys/fanotify.h" HAVE_FANOTIFY)
 check_cxx_symbol_exists(kqueue "sys/types.h;sys/event.h" HAVE_KQUEUE)
 check_cxx_symbol_exists(epoll_wait "sys/epoll.h" HAVE_EPOLL)
+check_cxx_symbol_exists(eventfd "sys/eventfd.h" HAVE_EVENTFD)
+check_cxx_symbol_exists(timerfd_create "sys/timerfd.h" HAVE_TIMERFD)
+check_cxx_symbol_exists(IORING_FEAT_EXT_ARG "linux/io_uring.h" HAVE_IO_URING_H)
+check_cxx_symbol_exists(__NR_io_uring_enter "sys/syscall.h" HAVE_IO_URING_SYSCALL)
+if (HAVE_EPOLL AND HAVE_IO_URING_H AND HAVE_IO_URING_SYSCALL)
+  set(HAVE_IO_URING 1)
+endif ()
 check_cxx_symbol_exists(select "sys/select.h" HAVE_SELECT)
 check_cxx_symbol_exists(FD_CLOEXEC "fcntl.h" HAVE_CLOEXEC)
+check_cxx_symbol_exists(pipe2 "fcntl.h;unistd.h" HAVE_PIPE2)
+check_cxx_symbol_exists(SYS_pidfd_open "sys/syscall.h" HAVE_PIDFD_OPEN)
+check_cxx_symbol_exists(posix_spawn "spawn.h" HAVE_POSIX_SPAWN)
+check_cxx_symbol_exists(posix_spawn_file_actions_addchdir_np "spawn.h" HAVE_POSIX_SPAWN_ADDCHDIR)
 check_cxx_symbol_exists(SO_NOSIGPIPE "sys/types.h;sys/socket.h" HAVE_NOSIGPIPE)
 check_cxx_symbol_exists(MSG_NOSIGNAL "sys/types.h;sys/socket.h" HAVE_NOSIGNAL)
+check_cxx_symbol_exists(sendfile "sys/sendfile.h" HAVE_SENDFILE)
+if (CMAKE_SYSTEM_NAME MATCHES "Darwin")
+  check_cxx_symbol_exists(sendfile "sys/types.h;sys/socket.h;sys/uio.h" HAVE_DARWIN_SENDFILE)
+endif ()
+check_cxx_symbol_exists(accept4 "sys/types.h;sys/socket.h" HAVE_ACCEPT4)
+check_cxx_symbol_exists(recvmmsg "sys/types.h;sys/socket.h" HAVE_RECVMMSG)
+check_cxx_symbol_exists(sendmmsg "sys/types.h;sys/socket.h" HAVE_SENDMMSG)
+check_cxx_symbol_exists(SO_REUSEPORT "sys/types.h;sys/socket.h" HAVE_REUSEPORT)
 check_cxx_symbol_exists(GetLogicalProcessorInformation "windows.h" HAVE_PROCESSORINFORMATION)
 check_cxx_symbol_exists(SCHED_IDLE "pthread.h" HAVE_SCHEDIDLE)
+check_cxx_symbol_exists(pthread_setaffinity_np "pthread.h" HAVE_PTHREAD_SETAFFINITY)
+check_cxx_symbol_exists(pthread_setname_np "pthread.h" HAVE_PTHREAD_SETNAME)
+check_cxx_symbol_exists(sched_getcpu "sched.h" HAVE_SCHED_GETCPU)
 check_cxx_symbol_exists(SHM_DEST "sys/types.h;sys/ipc.h;sys/shm.h" HAVE_SHMDEST)
+check_cxx_symbol_exists(mallinfo2 "malloc.h" HAVE_MALLINFO2)
+check_cxx_symbol_exists(memfd_create "sys/mman.h" HAVE_MEMFD_CREATE)
+
+if (NOT DEFINED RCT_EVENTLOOP_LOCKFREE_POST)
+  set(RCT_EVENTLOOP_LOCKFREE_POST 1)
+endif ()
+
+if (NOT DEFINED RCT_TRACE)
+  set(RCT_TRACE 1)
+endif ()
+
+# replaces operator new and delete to count allocations by subsystem, see
+# rct/Allocations.h. Off by default, every allocation pays for it.
+if (NOT DEFINED RCT_ALLOCATION_PROFILING)
+  set(RCT_ALLOCATION_PROFILING 0)
+endif ()
 
 if (CYGWIN)
   message("-- Using win32 FileSystemWatcher")
@@ -82,6 +121,24 @@ if (ZLIB_FOUND)
 else ()
     message("ZLIB Can't be found. Rct configured without zlib support")
 endif ()
+find_path(LZ4_INCLUDE_DIR lz4.h)
+find_library(LZ4_LIBRARY lz4)
+if (LZ4_INCLUDE_DIR AND LZ4_LIBRARY)
+    set(LZ4_FOUND TRUE)
+    set(RCT_DEFINITIONS ${RCT_DEFINITIONS} -DRCT_HAVE_LZ4)
+    list(APPEND RCT_INCLUDE_DIRS ${LZ4_INCLUDE_DIR})
+else ()
+    message("LZ4 Can't be found. Rct configured without lz4 support")
+endif ()
+find_path(ZSTD_INCLUDE_DIR zstd.h)
+find_library(ZSTD_LIBRARY zstd)
+if (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+    set(ZSTD_FOUND TRUE)
+    set(RCT_DEFINITIONS ${RCT_DEFINITIONS} -DRCT_HAVE_ZSTD)
+    list(APPEND RCT_INCLUDE_DIRS ${ZSTD_INCLUDE_DIR})
+else ()
+    message("ZSTD Can't be found. Rct configured without zstd support")
+endif ()
 find_package(OpenSSL)
 if (OPENSSL_FOUND)
     set(RCT_DEFINITIONS ${RCT_DEFINITIONS} -DRCT_HAVE_OPENSSL)
@@ -95,31 +152,53 @@ list(APPEND RCT_INCLUDE_DIRS ${CMAKE_CURRENT_LIST_DIR} ${RCT_INCLUDE_DIR})
 
 set(RCT_SOURCES
   ${RCT_SOURCES}
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Allocations.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Arena.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Atom.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/BinaryLog.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Buffer.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/ChunkFile.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Config.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Connection.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/ConnectionPool.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/CpuUsage.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/DataFileWriter.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Date.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/DnsResolver.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/EventLoop.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/EventLoopGroup.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/FileSnapshot.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/FileSystemWatcher.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/JSONWriter.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Log.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/MappedFile.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/MemoryMonitor.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Message.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/MessageQueue.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Metrics.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Parallel.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Path.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Plugin.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Process.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/ProcessPool.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Rct.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/ReadWriteLock.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Semaphore.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/SharedMutex.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SharedMemory.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/SharedMemoryChannel.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SocketClient.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SocketServer.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/String.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/TaskGraph.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/TableFile.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Thread.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/ThreadPool.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Timer.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/TimerWheel.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Trace.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Value.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/ValueView.cpp
   ${CMAKE_CURRENT_LIST_DIR}/cJSON/cJSON.c)
 
 if (HAVE_INOTIFY EQUAL 1)
@@ -132,6 +211,10 @@ elseif (HAVE_CHANGENOTIFICATION EQUAL 1)
   list(APPEND RCT_SOURCES ${CMAKE_CURRENT_LIST_DIR}/rct/FileSystemWatcher_win32.cpp)
 endif ()
 
+if (HAVE_IO_URING)
+  list(APPEND RCT_SOURCES ${CMAKE_CURRENT_LIST_DIR}/rct/IoUring.cpp)
+endif ()
+
 
 if (RCT_BUILD_SCRIPTENGINE)
   set(CMAKE_MODULE_PATH ${CMAKE_MODULE_PATH} "${CMAKE_CURRENT_LIST_DIR}/cmake/")
@@ -163,6 +246,10 @@ set(RCT_DEFINITIONS ${RCT_DEFINITIONS} -DOS_${CMAKE_SYSTEM_NAME})
 if (RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE)
   set(RCT_DEFINITIONS ${RCT_DEFINITIONS} -DRCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE=1)
 endif ()
+if (RCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD)
+  set(RCT_DEFINITIONS ${RCT_DEFINITIONS} "-DRCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD=${RCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD}")
+endif ()
+
 add_definitions(${RCT_DEFINITIONS})
 if (NOT RCT_NO_LIBRARY)
     include_directories(${RCT_INCLUDE_DIRS})
@@ -173,10 +260,6 @@ if (NOT RCT_NO_LIBRARY)
     endif ()
 endif ()
 
-if (RCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD)
-  set(RCT_DEFINITIONS ${RCT_DEFINITIONS} "-DRCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD=${RCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD}")
-endif ()
-
 if (CMAKE_SYSTEM_NAME MATCHES "Darwin")
   find_library(CORESERVICES_LIBRARY CoreServices)
   find_path(CORESERVICES_INCLUDE "CoreServices/CoreServices.h")
@@ -187,6 +270,12 @@ endif ()
 if(ZLIB_FOUND)
     list(APPEND RCT_LIBRARIES ${ZLIB_LIBRARY})
 endif()
+if(LZ4_FOUND)
+    list(APPEND RCT_LIBRARIES ${LZ4_LIBRARY})
+endif()
+if(ZSTD_FOUND)
+    list(APPEND RCT_LIBRARIES ${ZSTD_LIBRARY})
+endif()
 if(OPENSSL_FOUND)
     list(APPEND RCT_LIBRARIES ${OPENSSL_CRYPTO_LIBRARY})
 endif()
@@ -262,22 +351,43 @@ if (NOT RCT_NO_INSTALL)
   install(FILES
     ${CMAKE_CURRENT_BINARY_DIR}/include/rct/rct-config.h
     rct/AES256CBC.h
+    rct/Allocations.h
     rct/Apply.h
+    rct/Arena.h
+    rct/Atom.h
+    rct/BinaryLog.h
     rct/Buffer.h
+    rct/ChunkFile.h
     rct/Config.h
     rct/Connection.h
+    rct/ConnectionPool.h
+    rct/Coroutine.h
+    rct/DataFileWriter.h
+    rct/DnsResolver.h
     rct/EventLoop.h
+    rct/EventLoopGroup.h
+    rct/FileSnapshot.h
     rct/FileSystemWatcher.h
+    rct/FlatHash.h
+    rct/FlatMap.h
+    rct/FlatSet.h
+    rct/JSONWriter.h
     rct/List.h
+    rct/LRUCache.h
     rct/Log.h
     rct/Map.h
+    rct/MappedFile.h
     rct/MemoryMonitor.h
     rct/Message.h
     rct/MessageQueue.h
+    rct/Metrics.h
+    rct/Parallel.h
     rct/Path.h
     rct/Plugin.h
     rct/Point.h
+    rct/Pool.h
     rct/Process.h
+    rct/ProcessPool.h
     rct/Rct.h
     rct/ReadLocker.h
     rct/ReadWriteLock.h
@@ -285,20 +395,33 @@ if (NOT RCT_NO_INSTALL)
     rct/ResponseMessage.h
     rct/SHA256.h
     rct/Semaphore.h
+    rct/SeqLock.h
     rct/Serializer.h
     rct/Set.h
+    rct/Span.h
     rct/SharedMemory.h
+    rct/SharedMemoryChannel.h
+    rct/SharedMutex.h
+    rct/Snapshot.h
     rct/SignalSlot.h
     rct/Size.h
+    rct/SmallList.h
     rct/SocketClient.h
     rct/SocketServer.h
     rct/StopWatch.h
     rct/String.h
+    rct/StringView.h
+    rct/TableFile.h
+    rct/TaskGraph.h
     rct/Thread.h
     rct/ThreadLocal.h
     rct/ThreadPool.h
     rct/Timer.h
+    rct/TimerWheel.h
+    rct/Trace.h
     rct/Value.h
+    rct/ValueBinder.h
+    rct/ValueView.h
     rct/WriteLocker.h
     DESTINATION include/rct)
 
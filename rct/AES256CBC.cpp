@@ -1,43 +1,198 @@
 #include "AES256CBC.h"
 
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
 #ifdef OS_Darwin
 #include <CommonCrypto/CommonCryptor.h>
 #else
 #include <openssl/evp.h>
-#include <openssl/aes.h>
 #endif
 
 #include "rct/Log.h"
+#include "Parallel.h"
 #include "SHA256.h"
 
-class AES256CBCPrivate
-{
-public:
-    AES256CBCPrivate() : inited(false) { }
-    ~AES256CBCPrivate();
+enum {
+    // EVP takes int sizes
+    MaxUpdate = 1024 * 1024 * 1024,
+    // Decrypting more than this is spread over threads in chunks, the iv
+    // of a chunk is the last cipher block before it. Encrypting can't be,
+    // every block needs the one before.
+    ParallelThreshold = 4 * 1024 * 1024,
+    ParallelChunk = 512 * 1024
+};
 
-    bool inited;
-    unsigned char iv[32];
 #ifdef OS_Darwin
-    CCCryptorRef ectx, dctx;
+typedef CCCryptorRef Cipher;
 #else
-    EVP_CIPHER_CTX ectx, dctx;
+typedef EVP_CIPHER_CTX *Cipher;
 #endif
-};
 
-AES256CBCPrivate::~AES256CBCPrivate()
+static Cipher createCipher(AES256CBC::Direction direction, const unsigned char *key, const unsigned char *iv, bool padding)
+{
+#ifdef OS_Darwin
+    CCCryptorRef ret = 0;
+    if (CCCryptorCreate(direction == AES256CBC::Encrypt ? kCCEncrypt : kCCDecrypt, kCCAlgorithmAES128,
+                        padding ? kCCOptionPKCS7Padding : 0, key, kCCKeySizeAES256, iv, &ret) != kCCSuccess) {
+        return 0;
+    }
+    return ret;
+#else
+    EVP_CIPHER_CTX *ret = EVP_CIPHER_CTX_new();
+    if (!ret)
+        return 0;
+    if (!EVP_CipherInit_ex(ret, EVP_aes_256_cbc(), NULL, key, iv, direction == AES256CBC::Encrypt)) {
+        EVP_CIPHER_CTX_free(ret);
+        return 0;
+    }
+    EVP_CIPHER_CTX_set_padding(ret, padding);
+    return ret;
+#endif
+}
+
+static void releaseCipher(Cipher cipher)
 {
-    if (!inited)
+    if (!cipher)
         return;
 #ifdef OS_Darwin
-    CCCryptorRelease(ectx);
-    CCCryptorRelease(dctx);
+    CCCryptorRelease(cipher);
 #else
-    EVP_CIPHER_CTX_cleanup(&ectx);
-    EVP_CIPHER_CTX_cleanup(&dctx);
+    EVP_CIPHER_CTX_free(cipher);
 #endif
 }
 
+// back to the start of a message
+static bool resetCipher(Cipher cipher, const unsigned char *iv)
+{
+#ifdef OS_Darwin
+    return CCCryptorReset(cipher, iv) == kCCSuccess;
+#else
+    return EVP_CipherInit_ex(cipher, NULL, NULL, NULL, iv, -1);
+#endif
+}
+
+static ssize_t cipherUpdate(Cipher cipher, const char *in, size_t size, char *out)
+{
+    size_t written = 0;
+    while (size) {
+        const size_t piece = std::min<size_t>(size, MaxUpdate);
+#ifdef OS_Darwin
+        size_t moved;
+        if (CCCryptorUpdate(cipher, in, piece, out + written, piece + AES256CBC::BlockSize, &moved) != kCCSuccess)
+            return -1;
+#else
+        int moved;
+        if (!EVP_CipherUpdate(cipher, reinterpret_cast<unsigned char *>(out + written), &moved,
+                              reinterpret_cast<const unsigned char *>(in), piece)) {
+            return -1;
+        }
+#endif
+        written += moved;
+        in += piece;
+        size -= piece;
+    }
+    return written;
+}
+
+static ssize_t cipherFinal(Cipher cipher, char *out)
+{
+#ifdef OS_Darwin
+    size_t moved;
+    if (CCCryptorFinal(cipher, out, AES256CBC::BlockSize, &moved) != kCCSuccess)
+        return -1;
+#else
+    int moved;
+    if (!EVP_CipherFinal_ex(cipher, reinterpret_cast<unsigned char *>(out), &moved))
+        return -1;
+#endif
+    return moved;
+}
+
+static inline size_t paddedSize(size_t size)
+{
+    return size + AES256CBC::BlockSize - size % AES256CBC::BlockSize;
+}
+
+// Whole messages go through ciphers without padding, the PKCS7 padding
+// is added and checked here. That way every update is whole blocks and
+// out can be the input, and decryption can be split up.
+class AES256CBCPrivate
+{
+public:
+    AES256CBCPrivate() : inited(false), ectx(0), dctx(0), stream(0) { }
+    ~AES256CBCPrivate();
+
+    // out has room for paddedSize(size), the encrypted size
+    bool encrypt(const char *in, size_t size, char *out);
+    // the decrypted size
+    ssize_t decrypt(const char *in, size_t size, char *out);
+
+    bool inited;
+    unsigned char key[32], iv[32];
+    Cipher ectx, dctx;
+    // begin() to finish()
+    Cipher stream;
+};
+
+AES256CBCPrivate::~AES256CBCPrivate()
+{
+    releaseCipher(ectx);
+    releaseCipher(dctx);
+    releaseCipher(stream);
+    memset(key, 0, sizeof(key));
+}
+
+bool AES256CBCPrivate::encrypt(const char *in, size_t size, char *out)
+{
+    const size_t aligned = size - size % AES256CBC::BlockSize;
+    const size_t tail = size - aligned;
+    char last[AES256CBC::BlockSize];
+    memcpy(last, in + aligned, tail);
+    memset(last + tail, AES256CBC::BlockSize - tail, AES256CBC::BlockSize - tail);
+    return (resetCipher(ectx, iv)
+            && cipherUpdate(ectx, in, aligned, out) == static_cast<ssize_t>(aligned)
+            && cipherUpdate(ectx, last, AES256CBC::BlockSize, out + aligned) == AES256CBC::BlockSize);
+}
+
+ssize_t AES256CBCPrivate::decrypt(const char *in, size_t size, char *out)
+{
+    if (!size || size % AES256CBC::BlockSize)
+        return -1;
+    if (size < ParallelThreshold) {
+        if (!resetCipher(dctx, iv) || cipherUpdate(dctx, in, size, out) != static_cast<ssize_t>(size))
+            return -1;
+    } else {
+        const size_t chunks = (size + ParallelChunk - 1) / ParallelChunk;
+        // taken before decrypting in place overwrites them
+        std::unique_ptr<unsigned char[]> ivs(new unsigned char[chunks * AES256CBC::BlockSize]);
+        memcpy(ivs.get(), iv, AES256CBC::BlockSize);
+        for (size_t i = 1; i < chunks; ++i)
+            memcpy(ivs.get() + i * AES256CBC::BlockSize, in + i * ParallelChunk - AES256CBC::BlockSize, AES256CBC::BlockSize);
+        std::atomic<bool> ok(true);
+        Rct::parallelChunks(chunks, [&](size_t i) {
+                const size_t offset = i * ParallelChunk;
+                const size_t length = std::min<size_t>(ParallelChunk, size - offset);
+                Cipher cipher = createCipher(AES256CBC::Decrypt, key, ivs.get() + i * AES256CBC::BlockSize, false);
+                if (!cipher || cipherUpdate(cipher, in + offset, length, out + offset) != static_cast<ssize_t>(length))
+                    ok.store(false, std::memory_order_relaxed);
+                releaseCipher(cipher);
+            });
+        if (!ok.load(std::memory_order_relaxed))
+            return -1;
+    }
+    const unsigned char pad = out[size - 1];
+    if (!pad || pad > AES256CBC::BlockSize)
+        return -1;
+    for (size_t i = 2; i <= pad; ++i) {
+        if (static_cast<unsigned char>(out[size - i]) != pad)
+            return -1;
+    }
+    return size - pad;
+}
+
 static void deriveKey(const String& key, unsigned char* outkey,
                       unsigned char* outiv, int rounds,
                       const unsigned char* salt)
@@ -65,22 +220,12 @@ static void deriveKey(const String& key, unsigned char* outkey,
 AES256CBC::AES256CBC(const String& key, const unsigned char* salt)
     : priv(new AES256CBCPrivate)
 {
-    unsigned char outkey[32];
-
-    deriveKey(key, outkey, priv->iv, 100, salt);
-#ifdef OS_Darwin
-    CCCryptorCreate(kCCEncrypt, kCCAlgorithmAES128, kCCOptionPKCS7Padding,
-                    outkey, kCCKeySizeAES256, priv->iv, &priv->ectx);
-    CCCryptorCreate(kCCDecrypt, kCCAlgorithmAES128, kCCOptionPKCS7Padding,
-                    outkey, kCCKeySizeAES256, priv->iv, &priv->dctx);
-#else
-    EVP_CIPHER_CTX_init(&priv->ectx);
-    EVP_EncryptInit_ex(&priv->ectx, EVP_aes_256_cbc(), NULL, outkey, priv->iv);
-    EVP_CIPHER_CTX_init(&priv->dctx);
-    EVP_DecryptInit_ex(&priv->dctx, EVP_aes_256_cbc(), NULL, outkey, priv->iv);
-#endif
-
-    priv->inited = true;
+    deriveKey(key, priv->key, priv->iv, 100, salt);
+    priv->ectx = createCipher(Encrypt, priv->key, priv->iv, false);
+    priv->dctx = createCipher(Decrypt, priv->key, priv->iv, false);
+    priv->inited = priv->ectx && priv->dctx;
+    if (!priv->inited)
+        error("AES256CBC: couldn't create the ciphers");
 }
 
 AES256CBC::~AES256CBC()
@@ -89,47 +234,79 @@ AES256CBC::~AES256CBC()
 }
 
 String AES256CBC::encrypt(const String& data)
+{
+    return encrypt(Span<const char>(data.constData(), data.size()));
+}
+
+String AES256CBC::encrypt(Span<const char> data)
 {
     if (!priv->inited)
         return String();
-#ifdef OS_Darwin
-    size_t flen;
-    String out(data.size() + kCCBlockSizeAES128, '\0');
-    CCCryptorUpdate(priv->ectx, data.constData(), data.size(), out.data(), out.size(), &flen);
-    CCCryptorFinal(priv->ectx, out.data(), flen, &flen);
-    CCCryptorReset(priv->ectx, priv->iv);
-    out.resize(flen);
-#else
-    int elen = data.size() + AES_BLOCK_SIZE, flen;
-    String out(elen, '\0');
-    EVP_EncryptInit_ex(&priv->ectx, NULL, NULL, NULL, NULL);
-    EVP_EncryptUpdate(&priv->ectx, reinterpret_cast<unsigned char*>(out.data()), &elen,
-                      reinterpret_cast<const unsigned char*>(data.constData()), data.size());
-    EVP_EncryptFinal_ex(&priv->ectx, reinterpret_cast<unsigned char*>(out.data()) + elen, &flen);
-    out.resize(elen + flen);
-#endif
+    String out(paddedSize(data.size()), '\0');
+    if (!priv->encrypt(data.data(), data.size(), out.data()))
+        return String();
     return out;
 }
 
+String AES256CBC::encrypt(String&& data)
+{
+    if (!priv->inited)
+        return String();
+    const size_t size = data.size();
+    data.resize(paddedSize(size));
+    if (!priv->encrypt(data.constData(), size, data.data()))
+        return String();
+    return std::move(data);
+}
+
 String AES256CBC::decrypt(const String& data)
+{
+    return decrypt(Span<const char>(data.constData(), data.size()));
+}
+
+String AES256CBC::decrypt(Span<const char> data)
 {
     if (!priv->inited)
         return String();
-#ifdef OS_Darwin
-    size_t flen;
-    String out(data.size() + kCCBlockSizeAES128, '\0');
-    CCCryptorUpdate(priv->dctx, data.constData(), data.size(), out.data(), out.size(), &flen);
-    CCCryptorFinal(priv->dctx, out.data(), flen, &flen);
-    CCCryptorReset(priv->dctx, priv->iv);
-    out.resize(flen);
-#else
-    int dlen = data.size(), flen;
-    String out(dlen + AES_BLOCK_SIZE, '\0');
-    EVP_DecryptInit_ex(&priv->dctx, NULL, NULL, NULL, NULL);
-    EVP_DecryptUpdate(&priv->dctx, reinterpret_cast<unsigned char*>(out.data()), &dlen,
-                      reinterpret_cast<const unsigned char*>(data.constData()), data.size());
-    EVP_DecryptFinal_ex(&priv->dctx, reinterpret_cast<unsigned char*>(out.data()) + dlen, &flen);
-    out.resize(dlen + flen);
-#endif
+    String out(data.size(), '\0');
+    const ssize_t size = priv->decrypt(data.data(), data.size(), out.data());
+    if (size < 0)
+        return String();
+    out.resize(size);
     return out;
 }
+
+String AES256CBC::decrypt(String&& data)
+{
+    if (!priv->inited)
+        return String();
+    const ssize_t size = priv->decrypt(data.constData(), data.size(), data.data());
+    if (size < 0)
+        return String();
+    data.resize(size);
+    return std::move(data);
+}
+
+bool AES256CBC::begin(Direction direction)
+{
+    releaseCipher(priv->stream);
+    priv->stream = createCipher(direction, priv->key, priv->iv, true);
+    return priv->stream;
+}
+
+ssize_t AES256CBC::update(Span<const char> in, char* out)
+{
+    if (!priv->stream)
+        return -1;
+    return cipherUpdate(priv->stream, in.data(), in.size(), out);
+}
+
+ssize_t AES256CBC::finish(char* out)
+{
+    if (!priv->stream)
+        return -1;
+    const ssize_t ret = cipherFinal(priv->stream, out);
+    releaseCipher(priv->stream);
+    priv->stream = 0;
+    return ret;
+}
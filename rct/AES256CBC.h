@@ -1,21 +1,47 @@
 #ifndef AES256CBC_H
 #define AES256CBC_H
 
+#include <sys/types.h>
+
+#include <rct/Span.h>
 #include <rct/String.h>
 
 class AES256CBCPrivate;
 
+// The cipher is OpenSSL's, CommonCrypto's on Darwin, which use AES-NI or
+// the ARMv8 AES instructions where the CPU has them.
 class AES256CBC
 {
 public:
     AES256CBC(const String& key, const unsigned char* salt = 0);
     ~AES256CBC();
 
+    enum { BlockSize = 16 };
+
+    // empty on failure, like a wrong key when decrypting
     String encrypt(const String& data);
+    String encrypt(Span<const char> data);
     String decrypt(const String& data);
+    String decrypt(Span<const char> data);
+    // in data's own memory, encrypting grows it by up to BlockSize bytes
+    String encrypt(String&& data);
+    String decrypt(String&& data);
+
+    // Streaming, for data that comes in pieces. begin() starts a message,
+    // update() takes the next piece and finish() ends it. out needs room
+    // for in.size() + BlockSize bytes, finish() writes at most
+    // BlockSize. When encrypting pieces that are a multiple of BlockSize
+    // out may be in.data(). Both return the bytes written, -1 on failure.
+    enum Direction { Encrypt, Decrypt };
+    bool begin(Direction direction);
+    ssize_t update(Span<const char> in, char* out);
+    ssize_t finish(char* out);
 
 private:
     AES256CBCPrivate* priv;
+
+    AES256CBC(const AES256CBC &) = delete;
+    AES256CBC &operator=(const AES256CBC &) = delete;
 };
 
 #endif
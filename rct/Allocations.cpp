@@ -0,0 +1,122 @@
+#include "Allocations.h"
+
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+thread_local Allocations::Subsystem Allocations::tCurrent = Allocations::NoSubsystem;
+
+const char *Allocations::name(Subsystem subsystem)
+{
+    static const char *names[] = { "other", "eventloop", "threadpool", "connection", "serializer", "value", "log" };
+    static_assert(sizeof(names) / sizeof(names[0]) == SubsystemCount, "a name for every subsystem");
+    return subsystem >= 0 && subsystem < SubsystemCount ? names[subsystem] : "";
+}
+
+#ifdef RCT_ALLOCATION_PROFILING
+
+namespace {
+// Sharded like Metrics::Counter. Zero initialized and never constructed
+// so they can be used before static constructors have run.
+enum { ShardCount = 16 };
+struct Shard
+{
+    std::atomic<uint64_t> allocations, frees, allocatedBytes, freedBytes;
+    char pad[64 - 4 * sizeof(std::atomic<uint64_t>)];
+};
+Shard sShards[Allocations::SubsystemCount][ShardCount];
+
+// in front of every allocation, keeps the alignment malloc() gives
+struct Header
+{
+    size_t size;
+    size_t subsystem;
+};
+static_assert(sizeof(Header) == 16, "allocations stay 16 byte aligned");
+
+inline Shard &shard(size_t subsystem)
+{
+    static std::atomic<unsigned int> next(0);
+    static thread_local unsigned int tShard = next.fetch_add(1, std::memory_order_relaxed) % ShardCount;
+    return sShards[subsystem][tShard];
+}
+
+void *allocate(size_t size)
+{
+    Header *header = static_cast<Header *>(malloc(sizeof(Header) + size));
+    if (!header)
+        return 0;
+    header->size = size;
+    header->subsystem = Allocations::current();
+    Shard &s = shard(header->subsystem);
+    s.allocations.fetch_add(1, std::memory_order_relaxed);
+    s.allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    return header + 1;
+}
+
+void *allocateOrThrow(size_t size)
+{
+    for (;;) {
+        if (void *ret = allocate(size))
+            return ret;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void release(void *ptr)
+{
+    if (!ptr)
+        return;
+    Header *header = static_cast<Header *>(ptr) - 1;
+    Shard &s = shard(header->subsystem);
+    s.frees.fetch_add(1, std::memory_order_relaxed);
+    s.freedBytes.fetch_add(header->size, std::memory_order_relaxed);
+    free(header);
+}
+}
+
+void *operator new(size_t size) { return allocateOrThrow(size); }
+void *operator new[](size_t size) { return allocateOrThrow(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return allocate(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return allocate(size); }
+void operator delete(void *ptr) noexcept { release(ptr); }
+void operator delete[](void *ptr) noexcept { release(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { release(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { release(ptr); }
+
+bool Allocations::isEnabled()
+{
+    return true;
+}
+
+Allocations::Stats Allocations::stats(Subsystem subsystem)
+{
+    Stats ret = { 0, 0, 0, 0 };
+    if (subsystem < 0 || subsystem >= SubsystemCount)
+        return ret;
+    for (const Shard &s : sShards[subsystem]) {
+        ret.allocations += s.allocations.load(std::memory_order_relaxed);
+        ret.frees += s.frees.load(std::memory_order_relaxed);
+        ret.allocatedBytes += s.allocatedBytes.load(std::memory_order_relaxed);
+        ret.freedBytes += s.freedBytes.load(std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+#else
+
+bool Allocations::isEnabled()
+{
+    return false;
+}
+
+Allocations::Stats Allocations::stats(Subsystem)
+{
+    const Stats ret = { 0, 0, 0, 0 };
+    return ret;
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef Allocations_h
+#define Allocations_h
+
+#include <stdint.h>
+
+#include <rct/rct-config.h>
+
+// Counts allocations by the rct subsystem that made them. Built with
+// RCT_ALLOCATION_PROFILING the global operator new and delete are
+// replaced, every allocation of the program is counted against the
+// innermost RCT_ALLOCATION_SCOPE() of its thread and every free against
+// the subsystem that allocated it:
+//
+//     RCT_ALLOCATION_SCOPE(Allocations::ValueSubsystem);
+//
+// A scope covers what's called from it, so allocations of a slot that
+// Connection emits count as Connection's. EventLoop callbacks, ThreadPool
+// jobs, Connection, message serialization, Value and logging have scopes.
+// Metrics::instance() exports the numbers as rct_allocations_total,
+// rct_allocated_bytes_total and rct_allocated_live_bytes. malloc() isn't
+// counted, neither is what an Arena hands out, only its blocks.
+//
+// Without RCT_ALLOCATION_PROFILING the scopes compile to nothing and
+// stats() are 0.
+class Allocations
+{
+public:
+    enum Subsystem {
+        NoSubsystem,
+        EventLoopSubsystem,
+        ThreadPoolSubsystem,
+        ConnectionSubsystem,
+        SerializerSubsystem,
+        ValueSubsystem,
+        LogSubsystem,
+        SubsystemCount
+    };
+    static const char *name(Subsystem subsystem);
+
+    static bool isEnabled();
+
+    struct Stats
+    {
+        uint64_t allocations, frees;
+        uint64_t allocatedBytes, freedBytes;
+    };
+    static Stats stats(Subsystem subsystem);
+
+    static Subsystem current() { return tCurrent; }
+
+private:
+    static thread_local Subsystem tCurrent;
+
+    friend class AllocationScope;
+};
+
+class AllocationScope
+{
+public:
+    AllocationScope(Allocations::Subsystem subsystem)
+        : mPrevious(Allocations::tCurrent)
+    {
+        Allocations::tCurrent = subsystem;
+    }
+    ~AllocationScope()
+    {
+        Allocations::tCurrent = mPrevious;
+    }
+
+private:
+    const Allocations::Subsystem mPrevious;
+
+    AllocationScope(const AllocationScope &) = delete;
+    AllocationScope &operator=(const AllocationScope &) = delete;
+};
+
+#define RCT_ALLOCATION_CONCAT_(a, b) a##b
+#define RCT_ALLOCATION_CONCAT(a, b) RCT_ALLOCATION_CONCAT_(a, b)
+#ifdef RCT_ALLOCATION_PROFILING
+#define RCT_ALLOCATION_SCOPE(subsystem)                                         \
+    AllocationScope RCT_ALLOCATION_CONCAT(rctAllocationScope, __LINE__)(subsystem)
+#else
+#define RCT_ALLOCATION_SCOPE(subsystem)
+#endif
+
+#endif
@@ -0,0 +1,95 @@
+#include "Arena.h"
+
+#include <algorithm>
+#include <assert.h>
+
+Arena::Arena(size_t blockSize)
+    : mBlockSize(std::max<size_t>(blockSize, 256)), mBlocks(0), mBlockStart(0), mPos(0), mEnd(0),
+      mUsed(0), mReserved(0), mDestructors(0)
+{
+}
+
+Arena::~Arena()
+{
+    runDestructors();
+    freeBlocks();
+}
+
+void Arena::use(Block *block)
+{
+    mBlockStart = mPos = reinterpret_cast<char *>(block + 1);
+    mEnd = mBlockStart + block->size;
+}
+
+void *Arena::allocateSlow(size_t size, size_t alignment)
+{
+    const size_t needed = size + alignment;
+    // big ones get a block of their own behind the current one, so the
+    // rest of the current block isn't wasted
+    if (mBlocks && needed > mBlockSize / 4) {
+        Block *block = static_cast<Block *>(::operator new(sizeof(Block) + needed));
+        block->size = needed;
+        block->next = mBlocks->next;
+        mBlocks->next = block;
+        mReserved += needed;
+        mUsed += needed;
+        const uintptr_t pos = reinterpret_cast<uintptr_t>(block + 1);
+        return reinterpret_cast<void *>((pos + alignment - 1) & ~(uintptr_t(alignment) - 1));
+    }
+    const size_t blockSize = std::max(mBlockSize, needed);
+    Block *block = static_cast<Block *>(::operator new(sizeof(Block) + blockSize));
+    block->size = blockSize;
+    block->next = mBlocks;
+    mBlocks = block;
+    mReserved += blockSize;
+    mUsed += mPos - mBlockStart;
+    use(block);
+    void *ret = allocate(size, alignment);
+    assert(ret);
+    return ret;
+}
+
+void Arena::addDestructor(void *object, void (*destructor)(void *))
+{
+    Destructor *entry = static_cast<Destructor *>(allocate(sizeof(Destructor), alignof(Destructor)));
+    entry->destroy = destructor;
+    entry->object = object;
+    entry->next = mDestructors;
+    mDestructors = entry;
+}
+
+void Arena::runDestructors()
+{
+    // newest first, like the stack
+    while (Destructor *destructor = mDestructors) {
+        mDestructors = destructor->next;
+        destructor->destroy(destructor->object);
+    }
+}
+
+void Arena::freeBlocks()
+{
+    while (Block *block = mBlocks) {
+        mBlocks = block->next;
+        ::operator delete(block);
+    }
+    mBlockStart = mPos = mEnd = 0;
+    mUsed = mReserved = 0;
+}
+
+void Arena::reset()
+{
+    runDestructors();
+    if (mBlocks && mBlocks->next) {
+        const size_t size = mReserved;
+        freeBlocks();
+        Block *block = static_cast<Block *>(::operator new(sizeof(Block) + size));
+        block->size = size;
+        block->next = 0;
+        mBlocks = block;
+        mReserved = size;
+    }
+    mUsed = 0;
+    if (mBlocks)
+        use(mBlocks);
+}
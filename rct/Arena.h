@@ -0,0 +1,132 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// A bump allocator. Memory comes from big blocks, handing some out is
+// a pointer increment and giving it back is a no-op, everything is
+// freed at once by reset() or when the arena is destroyed. Meant for
+// structures that are built, used and then thrown away as a whole, like
+// everything decoded for one request:
+//
+//     Arena arena;
+//     std::vector<Entry, ArenaAllocator<Entry> > entries(ArenaAllocator<Entry>(&arena));
+//     Node *node = arena.create<Node>(name);
+//     ...
+//     arena.reset();
+//
+// Not thread safe.
+class Arena
+{
+public:
+    enum { DefaultBlockSize = 64 * 1024 };
+
+    explicit Arena(size_t blockSize = DefaultBlockSize);
+    ~Arena();
+
+    void *allocate(size_t size, size_t alignment = alignof(max_align_t))
+    {
+        uintptr_t pos = (reinterpret_cast<uintptr_t>(mPos) + alignment - 1) & ~(uintptr_t(alignment) - 1);
+        if (pos + size > reinterpret_cast<uintptr_t>(mEnd))
+            return allocateSlow(size, alignment);
+        mPos = reinterpret_cast<char *>(pos + size);
+        return reinterpret_cast<void *>(pos);
+    }
+
+    // T is destroyed by reset() or the destructor unless it's trivially
+    // destructible
+    template <typename T, typename... Args>
+    T *create(Args &&...args)
+    {
+        void *memory = allocate(sizeof(T), alignof(T));
+        T *t = new (memory) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value)
+            addDestructor(t, &destroy<T>);
+        return t;
+    }
+
+    // Destroys what create() made and makes all memory available again.
+    // Memory that took more than one block comes back as one block big
+    // enough for all of it, so the next round of the same work doesn't
+    // need any new blocks.
+    void reset();
+
+    // bytes handed out since the last reset, with alignment padding
+    size_t used() const { return mUsed + (mPos - mBlockStart); }
+    // bytes held in blocks
+    size_t reserved() const { return mReserved; }
+
+private:
+    struct Block
+    {
+        Block *next;
+        size_t size;
+    };
+    struct Destructor
+    {
+        void (*destroy)(void *);
+        void *object;
+        Destructor *next;
+    };
+
+    template <typename T>
+    static void destroy(void *t)
+    {
+        static_cast<T *>(t)->~T();
+    }
+
+    void *allocateSlow(size_t size, size_t alignment);
+    void addDestructor(void *object, void (*destructor)(void *));
+    void runDestructors();
+    void freeBlocks();
+    void use(Block *block);
+
+    const size_t mBlockSize;
+    Block *mBlocks;
+    char *mBlockStart, *mPos, *mEnd;
+    // bytes used in the blocks before the current one
+    size_t mUsed, mReserved;
+    Destructor *mDestructors;
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+};
+
+// Standard allocator on an Arena, for std containers and std::allocate_shared.
+// Deallocation does nothing, the memory comes back with the arena.
+template <typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    ArenaAllocator(Arena *arena)
+        : mArena(arena)
+    {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other)
+        : mArena(other.arena())
+    {}
+
+    T *allocate(size_t count)
+    {
+        return static_cast<T *>(mArena->allocate(count * sizeof(T), alignof(T)));
+    }
+    void deallocate(T *, size_t) {}
+
+    Arena *arena() const { return mArena; }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &other) const { return mArena == other.arena(); }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const { return mArena != other.arena(); }
+
+private:
+    Arena *mArena;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include "Atom.h"
+
+Atom::Atom(const StringView &string, AtomTable *table)
+    : mEntry(0)
+{
+    if (!string.isEmpty())
+        *this = (table ? table : AtomTable::global())->intern(string);
+}
+
+const String &Atom::string() const
+{
+    static const String empty;
+    return mEntry ? mEntry->string : empty;
+}
+
+AtomTable *AtomTable::global()
+{
+    // never destroyed, atoms may outlive static destruction
+    static AtomTable *table = new AtomTable;
+    return table;
+}
+
+// 64 bit FNV-1a
+size_t AtomTable::hash(const StringView &view)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (char ch : view) {
+        hash ^= static_cast<unsigned char>(ch);
+        hash *= 1099511628211ULL;
+    }
+    return static_cast<size_t>(hash);
+}
+
+Atom AtomTable::intern(const StringView &string)
+{
+    if (string.isEmpty())
+        return Atom();
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mLookup.find(string);
+    if (it != mLookup.end())
+        return Atom(it->second);
+    mEntries.push_back(Atom::Entry());
+    Atom::Entry &entry = mEntries.back();
+    entry.string = string.toString();
+    entry.hash = hash(string);
+    entry.id = mEntries.size();
+    entry.table = this;
+    mLookup[StringView(entry.string)] = &entry;
+    return Atom(&entry);
+}
+
+Atom AtomTable::atom(uint32_t id) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!id || id > mEntries.size())
+        return Atom();
+    return Atom(&mEntries[id - 1]);
+}
+
+size_t AtomTable::size() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mEntries.size();
+}
+
+Serializer &operator<<(Serializer &s, const AtomTable &table)
+{
+    const uint32_t size = table.size();
+    s << size;
+    for (uint32_t id = 1; id <= size; ++id)
+        s << table.atom(id).string();
+    return s;
+}
+
+Deserializer &operator>>(Deserializer &s, AtomTable &table)
+{
+    uint32_t size;
+    s >> size;
+    String string;
+    for (uint32_t i = 0; i < size; ++i) {
+        s >> string;
+        table.intern(string);
+    }
+    return s;
+}
@@ -0,0 +1,135 @@
+#ifndef ATOM_H
+#define ATOM_H
+
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+
+#include <rct/Path.h>
+#include <rct/Serializer.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+
+class AtomTable;
+
+// An interned string. Every distinct string is stored once per table,
+// atoms refer to it, so duplicates cost a pointer and comparing or
+// hashing an atom never looks at the characters. Meant for keys that
+// repeat a lot, like the paths of a file index:
+//
+//     Hash<Atom, FileInfo> files;
+//     files[Atom(path)] = info;
+//
+// Atoms of different tables are never equal. Strings stay in their table
+// until it's destroyed, the global table lives forever.
+class Atom
+{
+public:
+    Atom()
+        : mEntry(0)
+    {}
+    // interns string in table, AtomTable::global() when 0. The empty
+    // string is the null atom.
+    explicit Atom(const StringView &string, AtomTable *table = 0);
+
+    bool isNull() const { return !mEntry; }
+    bool isEmpty() const { return !mEntry; }
+
+    const String &string() const;
+    Path path() const { return string(); }
+    const char *constData() const { return string().constData(); }
+    size_t size() const { return string().size(); }
+
+    size_t hash() const { return mEntry ? mEntry->hash : 0; }
+    // stable within its table, 0 for the null atom
+    uint32_t id() const { return mEntry ? mEntry->id : 0; }
+    AtomTable *table() const { return mEntry ? mEntry->table : 0; }
+
+    bool operator==(const Atom &other) const { return mEntry == other.mEntry; }
+    bool operator!=(const Atom &other) const { return mEntry != other.mEntry; }
+    // in string order so maps of atoms iterate like maps of strings
+    bool operator<(const Atom &other) const
+    {
+        return mEntry != other.mEntry && string() < other.string();
+    }
+
+private:
+    struct Entry
+    {
+        String string;
+        size_t hash;
+        uint32_t id;
+        AtomTable *table;
+    };
+    explicit Atom(const Entry *entry)
+        : mEntry(entry)
+    {}
+
+    const Entry *mEntry;
+
+    friend class AtomTable;
+};
+
+// A set of interned strings, thread safe. Tables can be scoped to an
+// index or a parse so their memory goes away with it.
+class AtomTable
+{
+public:
+    AtomTable() {}
+
+    static AtomTable *global();
+
+    Atom intern(const StringView &string);
+    // the atom with id, the null atom if there's none
+    Atom atom(uint32_t id) const;
+    size_t size() const;
+
+private:
+    struct ViewHash
+    {
+        size_t operator()(const StringView &view) const { return AtomTable::hash(view); }
+    };
+    static size_t hash(const StringView &view);
+
+    mutable std::mutex mMutex;
+    // deque so entries never move, the views point into them
+    std::deque<Atom::Entry> mEntries;
+    std::unordered_map<StringView, const Atom::Entry *, ViewHash> mLookup;
+
+    AtomTable(const AtomTable &) = delete;
+    AtomTable &operator=(const AtomTable &) = delete;
+
+    friend class Atom;
+};
+
+namespace std
+{
+template <> struct hash<Atom>
+{
+    size_t operator()(const Atom &atom) const { return atom.hash(); }
+};
+}
+
+// Atoms serialize as their string, interchangeable with a String, and
+// are interned in the global table when read back. For compact output
+// write the table once and then id() for every atom, reading the table
+// into an empty AtomTable gives the same ids.
+inline Serializer &operator<<(Serializer &s, const Atom &atom)
+{
+    s << atom.string();
+    return s;
+}
+
+inline Deserializer &operator>>(Deserializer &s, Atom &atom)
+{
+    String string;
+    s >> string;
+    atom = Atom(string);
+    return s;
+}
+
+Serializer &operator<<(Serializer &s, const AtomTable &table);
+Deserializer &operator>>(Deserializer &s, AtomTable &table);
+
+#endif
@@ -0,0 +1,541 @@
+#include "BinaryLog.h"
+
+#include <errno.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+
+#include "StackBuffer.h"
+
+enum {
+    Magic = 0x42544352, // "RCTB"
+    Version = 1
+};
+
+// every record starts with one of these. The numbers after it are
+// varints, times are the difference to the record before, zigzag encoded.
+enum RecordType {
+    // at the start of every run, format ids from before don't apply
+    // after it: magic and version as 32 bit, time as 64 bit
+    StartRecord = 1,
+    // id, line, file size, format size, file, format
+    FormatRecord = 2,
+    // level, id, thread, time, args size, args
+    MessageRecord = 3,
+    // thread, time, size, text
+    TextRecord = 4
+};
+
+static std::atomic<uint32_t> sNextFormatId(0);
+static std::atomic<uint32_t> sNextThread(1);
+// numbered in the order they first log
+static thread_local uint32_t tThread = 0;
+
+static inline uint32_t currentThread()
+{
+    if (!tThread)
+        tThread = sNextThread.fetch_add(1);
+    return tThread;
+}
+
+static inline uint64_t currentTime()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+template <typename T>
+static inline void put(char *&out, T value)
+{
+    memcpy(out, &value, sizeof(value));
+    out += sizeof(value);
+}
+
+static inline void putVarint(char *&out, uint64_t value)
+{
+    while (value >= 0x80) {
+        *out++ = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<char>(value);
+}
+
+static inline bool getVarint(const char *&pos, const char *end, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; pos != end && shift < 64; shift += 7) {
+        const unsigned char byte = *pos++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static inline uint64_t zigzag(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+BinaryLogFormat::BinaryLogFormat(const char *format, const char *file, int line)
+    : mId(sNextFormatId.fetch_add(1)), mFormat(format), mFile(file), mLine(line)
+{
+}
+
+void BinaryLogFormat::write(LogLevel level, const Arg *args, size_t count) const
+{
+    // the type and a varint, or the bits of a double, or the size and the
+    // text
+    enum { MaxVarint = 10 };
+    size_t max = 0;
+    for (size_t i = 0; i < count; ++i)
+        max += 1 + MaxVarint + (args[i].type == Text ? args[i].len : 0);
+
+    StackBuffer<512> buf(max);
+    char *out = buf;
+    for (size_t i = 0; i < count; ++i) {
+        const Arg &arg = args[i];
+        *out++ = arg.type;
+        switch (arg.type) {
+        case Text:
+            putVarint(out, arg.len);
+            memcpy(out, arg.str, arg.len);
+            out += arg.len;
+            break;
+        case Double:
+            put(out, arg.d);
+            break;
+        case Signed:
+            putVarint(out, zigzag(arg.i));
+            break;
+        default:
+            putVarint(out, arg.u);
+            break;
+        }
+    }
+    const size_t size = out - buf;
+
+    const uint64_t time = currentTime();
+    bool any = false, text = false;
+    ::log([&](const std::shared_ptr<LogOutput> &output) {
+            if (output->testLog(level)) {
+                any = true;
+                if (!output->logBinary(level, *this, time, buf, size))
+                    text = true;
+            }
+        });
+    // without outputs it goes to stdout
+    if (text || !any) {
+        logDirect(level, render(mFormat, buf, size), LogOutput::DefaultFlags | LogOutput::BinaryLogged);
+    } else {
+        countLogMessage(level);
+    }
+}
+
+String BinaryLogFormat::render(const char *format, const char *args, size_t size)
+{
+    struct Value
+    {
+        char type;
+        union {
+            int64_t i;
+            uint64_t u;
+            double d;
+        };
+        const char *str;
+        uint32_t len;
+    };
+    const char *end = args + size;
+    auto next = [&args, end](Value &value) {
+        if (args == end)
+            return false;
+        value.type = *args++;
+        switch (value.type) {
+        case Text: {
+            uint64_t len;
+            if (!getVarint(args, end, len) || static_cast<uint64_t>(end - args) < len)
+                return false;
+            value.str = args;
+            value.len = len;
+            args += len;
+            break; }
+        case Double:
+            if (end - args < 8)
+                return false;
+            memcpy(&value.d, args, sizeof(value.d));
+            args += sizeof(value.d);
+            break;
+        case Signed:
+            if (!getVarint(args, end, value.u))
+                return false;
+            value.i = unzigzag(value.u);
+            break;
+        default:
+            if (!getVarint(args, end, value.u))
+                return false;
+            break;
+        }
+        return true;
+    };
+    auto toInt = [](const Value &value) -> long long {
+        switch (value.type) {
+        case Double: return static_cast<long long>(value.d);
+        case Signed: return value.i;
+        default: return static_cast<long long>(value.u);
+        }
+    };
+    auto toDouble = [](const Value &value) -> double {
+        switch (value.type) {
+        case Double: return value.d;
+        case Signed: return static_cast<double>(value.i);
+        default: return static_cast<double>(value.u);
+        }
+    };
+
+    String ret;
+    ret.reserve(strlen(format) + size);
+    const char *f = format;
+    while (*f) {
+        if (*f != '%') {
+            const char *start = f;
+            while (*f && *f != '%')
+                ++f;
+            ret.append(start, f - start);
+            continue;
+        }
+        if (f[1] == '%') {
+            ret.append('%');
+            f += 2;
+            continue;
+        }
+
+        // the conversion without its length modifier, that's added back
+        // for the type that was logged
+        char spec[32];
+        size_t specLength = 0;
+        auto add = [&spec, &specLength](char ch) {
+            if (specLength < sizeof(spec) - 4)
+                spec[specLength++] = ch;
+        };
+        // flags, width and precision are cut short to leave room for this
+        auto finish = [&spec, &specLength](const char *suffix) -> const char * {
+            strcpy(spec + specLength, suffix);
+            return spec;
+        };
+        auto addStar = [&](const Value &value) {
+            char num[24];
+            const int n = snprintf(num, sizeof(num), "%lld", toInt(value));
+            for (int i = 0; i < n; ++i)
+                add(num[i]);
+        };
+        Value value;
+        add(*f++);
+        while (*f && strchr("-+ #0'", *f))
+            add(*f++);
+        if (*f == '*') {
+            ++f;
+            if (next(value))
+                addStar(value);
+        }
+        while (isdigit(*f))
+            add(*f++);
+        if (*f == '.') {
+            add(*f++);
+            if (*f == '*') {
+                ++f;
+                if (next(value))
+                    addStar(value);
+            }
+            while (isdigit(*f))
+                add(*f++);
+        }
+        while (*f && strchr("hlLqjzt", *f))
+            ++f;
+        const char conversion = *f;
+        if (!conversion)
+            break;
+        ++f;
+        if (conversion == 'n')
+            continue;
+        if (!next(value)) {
+            ret.append("<missing>");
+            continue;
+        }
+
+        if (value.type == Text) {
+            // whatever the conversion was
+            const String str(value.str, value.len);
+            ret.appendFormat(finish("s"), str.constData());
+            continue;
+        }
+        switch (conversion) {
+        case 'd':
+        case 'i':
+            ret.appendFormat(finish("lld"), toInt(value));
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X': {
+            const char suffix[] = { 'l', 'l', conversion, '\0' };
+            ret.appendFormat(finish(suffix), static_cast<unsigned long long>(toInt(value)));
+            break; }
+        case 'c':
+            ret.appendFormat(finish("c"), static_cast<int>(toInt(value)));
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A': {
+            const char suffix[] = { conversion, '\0' };
+            ret.appendFormat(finish(suffix), toDouble(value));
+            break; }
+        case 'p':
+            ret.appendFormat(finish("p"), reinterpret_cast<void *>(static_cast<uintptr_t>(value.u)));
+            break;
+        default:
+            // %s and unknown conversions of numbers
+            if (value.type == Double) {
+                ret.appendFormat("%g", value.d);
+            } else if (value.type == Signed) {
+                ret.appendFormat("%lld", static_cast<long long>(value.i));
+            } else if (value.type == Pointer) {
+                ret.appendFormat("%p", reinterpret_cast<void *>(static_cast<uintptr_t>(value.u)));
+            } else {
+                ret.appendFormat("%llu", static_cast<unsigned long long>(value.u));
+            }
+            break;
+        }
+    }
+    return ret;
+}
+
+BinaryLogOutput::BinaryLogOutput(LogLevel level, FILE *f)
+    : LogOutput(level), mFile(f), mTime(0)
+{
+    setvbuf(mFile, 0, _IOFBF, 64 * 1024);
+    mTime = currentTime();
+    char header[17];
+    char *out = header;
+    put<uint8_t>(out, StartRecord);
+    put<uint32_t>(out, Magic);
+    put<uint32_t>(out, Version);
+    put<uint64_t>(out, mTime);
+    fwrite(header, sizeof(header), 1, mFile);
+}
+
+BinaryLogOutput::~BinaryLogOutput()
+{
+    if (mFile)
+        fclose(mFile);
+}
+
+void BinaryLogOutput::writeRecord(const char *header, size_t headerSize, const char *data, size_t size)
+{
+    fwrite(header, headerSize, 1, mFile);
+    if (size)
+        fwrite(data, size, 1, mFile);
+}
+
+void BinaryLogOutput::log(Flags<LogOutput::LogFlag> flags, const char *msg, int len)
+{
+    // this one was logged in logBinary()
+    if (flags & BinaryLogged)
+        return;
+    const uint32_t thread = currentThread();
+    const uint64_t time = currentTime();
+    char header[32];
+    char *out = header;
+    std::lock_guard<std::mutex> lock(mMutex);
+    put<uint8_t>(out, TextRecord);
+    putVarint(out, thread);
+    putVarint(out, zigzag(time - mTime));
+    putVarint(out, len);
+    mTime = time;
+    writeRecord(header, out - header, msg, len);
+    fflush(mFile);
+}
+
+bool BinaryLogOutput::logBinary(LogLevel level, const BinaryLogFormat &format, uint64_t time,
+                                const char *args, size_t size)
+{
+    const uint32_t thread = currentThread();
+    char header[64];
+    char *out = header;
+    std::lock_guard<std::mutex> lock(mMutex);
+    const uint32_t id = format.id();
+    if (id >= mFormats.size())
+        mFormats.resize(id + 1);
+    if (!mFormats[id]) {
+        mFormats[id] = true;
+        const size_t fileSize = strlen(format.file()), formatSize = strlen(format.format());
+        put<uint8_t>(out, FormatRecord);
+        putVarint(out, id);
+        putVarint(out, format.line());
+        putVarint(out, fileSize);
+        putVarint(out, formatSize);
+        writeRecord(header, out - header, format.file(), fileSize);
+        fwrite(format.format(), formatSize, 1, mFile);
+        out = header;
+    }
+
+    put<uint8_t>(out, MessageRecord);
+    put<int8_t>(out, level.toInt());
+    putVarint(out, id);
+    putVarint(out, thread);
+    // threads can get here in a different order than they got the time
+    putVarint(out, zigzag(time - mTime));
+    putVarint(out, size);
+    mTime = time;
+    writeRecord(header, out - header, args, size);
+    if (level <= LogLevel::Warning)
+        fflush(mFile);
+    return true;
+}
+
+void BinaryLogOutput::flush()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    fflush(mFile);
+}
+
+BinaryLogReader::BinaryLogReader()
+    : mPos(0), mTime(0)
+{
+}
+
+bool BinaryLogReader::open(const Path &file)
+{
+    mPos = 0;
+    mTime = 0;
+    mFormats.clear();
+    mError.clear();
+    if (!mFile.open(file)) {
+        mError = String::format<128>("Can't open %s (%d)", file.constData(), errno);
+        return false;
+    }
+    if (!mFile.size() || *mFile.data() != StartRecord) {
+        mError = String::format<128>("%s is not a binary log", file.constData());
+        mFile.close();
+        return false;
+    }
+    return true;
+}
+
+bool BinaryLogReader::read(void *out, size_t size)
+{
+    if (mFile.size() - mPos < size)
+        return false;
+    memcpy(out, mFile.data() + mPos, size);
+    mPos += size;
+    return true;
+}
+
+bool BinaryLogReader::readVarint(uint64_t &value)
+{
+    const char *pos = mFile.data() + mPos;
+    if (!getVarint(pos, mFile.data() + mFile.size(), value))
+        return false;
+    mPos = pos - mFile.data();
+    return true;
+}
+
+bool BinaryLogReader::readTime()
+{
+    uint64_t delta;
+    if (!readVarint(delta))
+        return false;
+    mTime += unzigzag(delta);
+    return true;
+}
+
+bool BinaryLogReader::next(Entry &entry)
+{
+    while (mPos < mFile.size()) {
+        const size_t start = mPos;
+        uint8_t type;
+        read(&type, sizeof(type));
+        bool ok = false;
+        switch (type) {
+        case StartRecord: {
+            uint32_t header[2];
+            if (!read(header, sizeof(header)) || !read(&mTime, sizeof(mTime)))
+                break;
+            if (header[0] != Magic || header[1] != Version) {
+                mError = String::format<64>("Wrong magic or version %x/%u at %zu", header[0], header[1], start);
+                return false;
+            }
+            mFormats.clear();
+            ok = true;
+            break; }
+        case FormatRecord: {
+            uint64_t id, line, fileSize, formatSize;
+            if (!readVarint(id) || !readVarint(line) || !readVarint(fileSize) || !readVarint(formatSize)
+                || mFile.size() - mPos < fileSize + formatSize) {
+                break;
+            }
+            if (id >= mFormats.size())
+                mFormats.resize(id + 1);
+            Format &format = mFormats[id];
+            format.line = line;
+            format.file.assign(mFile.data() + mPos, fileSize);
+            mPos += fileSize;
+            format.format.assign(mFile.data() + mPos, formatSize);
+            mPos += formatSize;
+            ok = true;
+            break; }
+        case MessageRecord: {
+            int8_t level;
+            uint64_t id, thread, size;
+            if (!read(&level, sizeof(level)) || !readVarint(id) || !readVarint(thread) || !readTime()
+                || !readVarint(size) || mFile.size() - mPos < size) {
+                break;
+            }
+            const char *args = mFile.data() + mPos;
+            mPos += size;
+            entry.level = LogLevel(level);
+            entry.time = mTime;
+            entry.thread = thread;
+            if (id < mFormats.size() && !mFormats[id].format.isEmpty()) {
+                const Format &format = mFormats[id];
+                entry.file = format.file;
+                entry.line = format.line;
+                entry.message = BinaryLogFormat::render(format.format.constData(), args, size);
+            } else {
+                entry.file.clear();
+                entry.line = 0;
+                entry.message = String::format<64>("<unknown format %llu>", static_cast<unsigned long long>(id));
+            }
+            return true; }
+        case TextRecord: {
+            uint64_t thread, size;
+            if (!readVarint(thread) || !readTime() || !readVarint(size) || mFile.size() - mPos < size)
+                break;
+            entry.level = LogLevel::None;
+            entry.time = mTime;
+            entry.thread = thread;
+            entry.file.clear();
+            entry.line = 0;
+            entry.message.assign(mFile.data() + mPos, size);
+            mPos += size;
+            return true; }
+        default:
+            mError = String::format<64>("Unknown record type %u at %zu", type, start);
+            return false;
+        }
+        if (!ok) {
+            // what was being written when the process died
+            mError = String::format<64>("Truncated record at %zu", start);
+            return false;
+        }
+    }
+    return false;
+}
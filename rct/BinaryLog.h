@@ -0,0 +1,191 @@
+#ifndef BinaryLog_h
+#define BinaryLog_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <rct/Log.h>
+#include <rct/MappedFile.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+
+// Logs a printf-style message without formatting it when it goes to a
+// BinaryLogOutput. The output writes the id of the call site, a timestamp,
+// the thread and the arguments as they are, and rct-logdecode turns that
+// into text later. Outputs that want text get the message formatted like
+// log() would.
+//
+//     RCT_BINARY_LOG(LogLevel::Debug, "indexed %s in %d ms", path, ms);
+//
+// Integers, floating point, enums, pointers, const char * and String are
+// logged. format has to be a literal, it's only looked at once per call
+// site.
+#define RCT_BINARY_LOG(level, format, ...)                              \
+    do {                                                                \
+        if (testLog(level)) {                                           \
+            static const BinaryLogFormat rctBinaryLogFormat(format, __FILE__, __LINE__); \
+            rctBinaryLogFormat.log(level, ##__VA_ARGS__);               \
+        }                                                               \
+    } while (0)
+
+class BinaryLogFormat
+{
+public:
+    BinaryLogFormat(const char *format, const char *file, int line);
+
+    uint32_t id() const { return mId; }
+    const char *format() const { return mFormat; }
+    const char *file() const { return mFile; }
+    int line() const { return mLine; }
+
+    template <typename... Args>
+    void log(LogLevel level, const Args &...args) const
+    {
+        // the last one is so this isn't empty without arguments
+        const Arg list[] = { Arg(args)..., Arg() };
+        write(level, list, sizeof...(Args));
+    }
+
+    // formats args, as written by a BinaryLogOutput, like printf would
+    static String render(const char *format, const char *args, size_t size);
+
+    enum ArgType {
+        Signed = 'i',
+        Unsigned = 'u',
+        Double = 'd',
+        Pointer = 'p',
+        Text = 's'
+    };
+private:
+    struct Arg
+    {
+        Arg()
+            : type(0), u(0), len(0)
+        {}
+        template <typename T, typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, int>::type = 0>
+        Arg(T t)
+            : type(std::is_signed<T>::value || std::is_enum<T>::value ? Signed : Unsigned), len(0)
+        {
+            if (type == Signed) {
+                i = static_cast<int64_t>(t);
+            } else {
+                u = static_cast<uint64_t>(t);
+            }
+        }
+        Arg(float f)
+            : type(Double), d(f), len(0)
+        {}
+        Arg(double f)
+            : type(Double), d(f), len(0)
+        {}
+        Arg(long double f)
+            : type(Double), d(static_cast<double>(f)), len(0)
+        {}
+        Arg(const char *string)
+            : type(Text), str(string ? string : "(null)"), len(strlen(str))
+        {}
+        Arg(const String &string)
+            : type(Text), str(string.constData()), len(string.size())
+        {}
+        Arg(const std::string &string)
+            : type(Text), str(string.c_str()), len(string.size())
+        {}
+        template <typename T>
+        Arg(const T *ptr)
+            : type(Pointer), u(reinterpret_cast<uintptr_t>(ptr)), len(0)
+        {}
+
+        char type;
+        union {
+            int64_t i;
+            uint64_t u;
+            double d;
+            const char *str;
+        };
+        size_t len;
+    };
+    void write(LogLevel level, const Arg *args, size_t count) const;
+
+    const uint32_t mId;
+    const char *mFormat, *mFile;
+    const int mLine;
+
+    BinaryLogFormat(const BinaryLogFormat &) = delete;
+    BinaryLogFormat &operator=(const BinaryLogFormat &) = delete;
+};
+
+// Writes the binary log. Messages from RCT_BINARY_LOG() are written as
+// they are and other messages as text. Nothing is flushed for debug
+// messages so what's logged last before a crash may be lost without a
+// flushLogs().
+class BinaryLogOutput : public LogOutput
+{
+public:
+    // takes ownership of f
+    BinaryLogOutput(LogLevel level, FILE *f);
+    ~BinaryLogOutput();
+
+    virtual void log(Flags<LogOutput::LogFlag> flags, const char *msg, int len) override;
+    virtual bool logBinary(LogLevel level, const BinaryLogFormat &format, uint64_t time,
+                           const char *args, size_t size) override;
+    virtual void flush() override;
+
+private:
+    void writeRecord(const char *header, size_t headerSize, const char *data, size_t size);
+
+    std::mutex mMutex;
+    FILE *mFile;
+    // of the last record, the next one has the difference
+    uint64_t mTime;
+    // the formats that have been written, by id
+    std::vector<bool> mFormats;
+};
+
+// Reads what a BinaryLogOutput wrote, for rct-logdecode.
+class BinaryLogReader
+{
+public:
+    BinaryLogReader();
+
+    bool open(const Path &file);
+    String error() const { return mError; }
+
+    struct Entry
+    {
+        Entry()
+            : level(LogLevel::Error), time(0), thread(0), line(0)
+        {}
+        LogLevel level;
+        uint64_t time; // ns since the epoch
+        uint32_t thread;
+        // empty for messages that were written as text
+        String file;
+        int line;
+        String message;
+    };
+    // false at the end or if the rest of the file is damaged, error()
+    // tells which
+    bool next(Entry &entry);
+
+private:
+    struct Format
+    {
+        String format, file;
+        int line;
+    };
+    bool read(void *out, size_t size);
+    bool readVarint(uint64_t &value);
+    bool readTime();
+
+    MappedFile mFile;
+    size_t mPos;
+    uint64_t mTime;
+    std::vector<Format> mFormats;
+    String mError;
+};
+
+#endif
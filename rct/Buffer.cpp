@@ -1,7 +1,50 @@
 #include "Buffer.h"
 
+#include <atomic>
 #include <stdio.h>
 
+static std::atomic<size_t> sGrowthLimit(16 * 1024 * 1024);
+
+size_t Buffer::growthLimit()
+{
+    return sGrowthLimit.load(std::memory_order_relaxed);
+}
+
+void Buffer::setGrowthLimit(size_t limit)
+{
+    sGrowthLimit.store(limit, std::memory_order_relaxed);
+}
+
+void Buffer::grow(size_t sz)
+{
+    bufferHighWater = std::max(bufferHighWater, sz);
+    const size_t growth = std::min(bufferReserved / 2, growthLimit());
+    reallocate(std::max(sz, bufferReserved + growth));
+}
+
+void Buffer::reallocate(size_t sz)
+{
+    assert(sz > bufferReserved);
+    if (!bufferData && sz <= InlineSize) {
+        bufferData = bufferInline;
+        bufferReserved = InlineSize;
+        return;
+    }
+    if (!bufferData || isInline()) {
+        unsigned char* data = static_cast<unsigned char*>(malloc(sz));
+        if (!data)
+            abort();
+        if (bufferData)
+            memcpy(data, bufferInline, bufferSize);
+        bufferData = data;
+    } else {
+        bufferData = static_cast<unsigned char*>(realloc(bufferData, sz));
+        if (!bufferData)
+            abort();
+    }
+    bufferReserved = sz;
+}
+
 bool Buffer::load(const String& filename)
 {
     clear();
@@ -31,3 +74,59 @@ bool Buffer::load(const String& filename)
     fclose(f);
     return true;
 }
+
+Buffer BufferPool::acquire(size_t size)
+{
+    size_t bucketSize = MinimumSize;
+    int bucket = 0;
+    while (bucketSize < size && bucket < BucketCount) {
+        bucketSize <<= 1;
+        ++bucket;
+    }
+    Buffer buffer;
+    if (bucket < BucketCount) {
+        std::vector<Buffer> &buffers = mBuckets[bucket];
+        if (!buffers.empty()) {
+            buffer = std::move(buffers.back());
+            buffers.pop_back();
+            mCached -= buffer.capacity();
+            return buffer;
+        }
+        // round up so the buffer goes back into this bucket
+        size = bucketSize;
+    }
+    buffer.reserve(size);
+    return buffer;
+}
+
+void BufferPool::release(Buffer &&buffer)
+{
+    Buffer released(std::move(buffer));
+    const size_t capacity = released.capacity();
+    if (capacity < MinimumSize || mCached + capacity > mMaxCached)
+        return;
+    int bucket = 0;
+    while (bucket + 1 < BucketCount && (static_cast<size_t>(MinimumSize) << (bucket + 1)) <= capacity)
+        ++bucket;
+    if (capacity >= (static_cast<size_t>(MinimumSize) << BucketCount))
+        return;
+    released.resize(0);
+    if (!released.capacity())
+        return;
+    mCached += capacity;
+    mBuckets[bucket].push_back(std::move(released));
+}
+
+void BufferPool::setMaxCached(size_t maxCached)
+{
+    mMaxCached = maxCached;
+    if (mCached > mMaxCached)
+        clear();
+}
+
+void BufferPool::clear()
+{
+    for (int i = 0; i < BucketCount; ++i)
+        std::vector<Buffer>().swap(mBuckets[i]);
+    mCached = 0;
+}
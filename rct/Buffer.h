@@ -2,81 +2,89 @@
 #define BUFFER_H
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
 
-#include <rct/LinkedList.h>
 #include <rct/String.h>
 
+// Small payloads, up to InlineSize bytes, live in the Buffer itself.
+// Bigger ones are on the heap, growing geometrically as they're
+// resized, and clear() keeps the allocation as long as recent uses
+// needed a good part of it. capacity() is 0 until something is reserved
+// and again after the buffer has been moved from.
 class Buffer
 {
 public:
+    enum {
+        InlineSize = 256,
+        // clear() only gives back capacity beyond this
+        ShrinkMinimum = 256 * 1024
+    };
+
     Buffer()
-        : bufferData(0), bufferSize(0), bufferReserved(0)
+        : bufferData(0), bufferSize(0), bufferReserved(0), bufferHighWater(0)
     {
     }
     Buffer(Buffer&& other)
+        : bufferData(0), bufferSize(0), bufferReserved(0), bufferHighWater(0)
     {
-        bufferData = other.bufferData;
-        bufferSize = other.bufferSize;
-        bufferReserved = other.bufferReserved;
-        other.bufferData = 0;
-        other.bufferSize = 0;
-        other.bufferReserved = 0;
+        take(other);
     }
     ~Buffer()
     {
-        if (bufferData)
+        if (bufferData && !isInline())
             free(bufferData);
     }
 
     Buffer& operator=(Buffer&& other)
     {
-        bufferData = other.bufferData;
-        bufferSize = other.bufferSize;
-        bufferReserved = other.bufferReserved;
-        other.bufferData = 0;
-        other.bufferSize = 0;
-        other.bufferReserved = 0;
+        if (this != &other) {
+            if (bufferData && !isInline())
+                free(bufferData);
+            take(other);
+        }
         return *this;
     }
 
     bool isEmpty() const { return !bufferSize; }
 
+    // Keeps the memory unless it's above ShrinkMinimum and more than
+    // twice what the buffer held at its fullest recently. The high-water
+    // mark loses a quarter every clear() so one big burst doesn't pin
+    // its memory forever.
     void clear()
     {
-        enum { ClearThreshold = 1024 * 512 };
-        if (bufferSize >= ClearThreshold) {
+        bufferHighWater = std::max(bufferSize, bufferHighWater - bufferHighWater / 4);
+        bufferSize = 0;
+        if (bufferReserved > ShrinkMinimum && bufferReserved / 2 > bufferHighWater && !isInline()) {
             free(bufferData);
             bufferData = 0;
             bufferReserved = 0;
         }
-        bufferSize = 0;
     }
 
+    // exactly sz bytes if it has to allocate
     void reserve(size_t sz)
     {
-        if (sz <= bufferReserved)
-            return;
-        bufferData = static_cast<unsigned char*>(realloc(bufferData, sz));
-        if (!bufferData)
-            abort();
-        bufferReserved = sz;
+        if (sz > bufferReserved)
+            reallocate(sz);
     }
 
+    // Grows the capacity by at least half, at most by growthLimit(), when
+    // sz doesn't fit. Shrinking never reallocates.
     void resize(size_t sz)
     {
         if (!sz) {
             clear();
             return;
         }
-        if (sz >= bufferSize && sz <= bufferReserved) {
-            bufferSize = sz;
-            return;
-        }
-        bufferData = static_cast<unsigned char*>(realloc(bufferData, sz));
-        if (!bufferData)
-            abort();
-        bufferSize = bufferReserved = sz;
+        if (sz > bufferReserved)
+            grow(sz);
+        bufferSize = sz;
     }
 
     size_t size() const { return bufferSize; }
@@ -88,69 +96,204 @@ public:
 
     bool load(const String& filename);
 
+    // the most resize() grows a buffer by beyond what was asked for,
+    // for all buffers, 16MB by default
+    static size_t growthLimit();
+    static void setGrowthLimit(size_t limit);
+
 private:
+    bool isInline() const { return bufferData == bufferInline; }
+    void take(Buffer& other)
+    {
+        bufferSize = other.bufferSize;
+        bufferReserved = other.bufferReserved;
+        bufferHighWater = other.bufferHighWater;
+        if (other.isInline()) {
+            memcpy(bufferInline, other.bufferInline, other.bufferSize);
+            bufferData = bufferInline;
+        } else {
+            bufferData = other.bufferData;
+        }
+        other.bufferData = 0;
+        other.bufferSize = 0;
+        other.bufferReserved = 0;
+        other.bufferHighWater = 0;
+    }
+    void grow(size_t sz);
+    void reallocate(size_t sz);
+
     unsigned char* bufferData;
-    size_t bufferSize, bufferReserved;
+    size_t bufferSize, bufferReserved, bufferHighWater;
+    unsigned char bufferInline[InlineSize];
 
 private:
     Buffer(const Buffer& other) = delete;
     Buffer& operator=(const Buffer& other) = delete;
 };
 
+// Keeps the memory of buffers that are done with for the next ones. Each
+// event loop has one, see EventLoop::bufferPool(). Sockets read into
+// buffers from it and Connection gives them back once it has consumed
+// them. Not thread safe, only use a loop's pool on the loop's thread.
+class BufferPool
+{
+public:
+    enum { MinimumSize = 1024, MaximumSize = 256 * 1024 };
+
+    BufferPool(size_t maxCached = 4 * 1024 * 1024)
+        : mCached(0), mMaxCached(maxCached)
+    {}
+
+    // an empty buffer with at least size bytes reserved
+    Buffer acquire(size_t size);
+    // empties the buffer and keeps its memory unless the pool is full or
+    // the buffer is smaller than MinimumSize or a lot bigger than
+    // MaximumSize
+    void release(Buffer &&buffer);
+
+    // bytes reserved by the buffers in the pool
+    size_t cached() const { return mCached; }
+    size_t maxCached() const { return mMaxCached; }
+    void setMaxCached(size_t maxCached);
+    void clear();
+
+private:
+    // bucket i holds buffers with at least MinimumSize << i bytes
+    enum { BucketCount = 9 };
+    std::vector<Buffer> mBuckets[BucketCount];
+    size_t mCached, mMaxCached;
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+};
+
+// The received data of a connection, in the buffers it arrived in. The
+// buffers are kept in a ring that only reallocates when it grows, so
+// pushing and consuming don't allocate. chunks() is an iovec style view
+// of what's there, skip() consumes it, frames are parsed in place no
+// matter how the input was split up.
 class Buffers
 {
 public:
+    typedef std::pair<const char *, size_t> Chunk;
+
     Buffers()
-        : mBufferOffset(0)
+        : mHead(0), mCount(0), mBufferOffset(0), mSize(0)
     {}
     void push(Buffer &&buf)
     {
-        mBuffers.append(std::forward<Buffer>(buf));
+        if (buf.isEmpty())
+            return;
+        if (mCount == mRing.size())
+            grow();
+        mSize += buf.size();
+        at(mCount++) = std::move(buf);
     }
-    size_t size() const
+    size_t size() const { return mSize; }
+    bool isEmpty() const { return !mSize; }
+    // consumed buffers go back to the pool
+    const std::shared_ptr<BufferPool> &pool() const { return mPool; }
+    void setPool(const std::shared_ptr<BufferPool> &pool) { mPool = pool; }
+    size_t read(void *outPtr, size_t size)
     {
-        size_t ret = 0;
-        for (const auto &buf : mBuffers)
-            ret += buf.size();
-        return ret - mBufferOffset;
+        size = copy(outPtr, std::min(size, mSize));
+        return skip(size);
     }
-    size_t read(void *outPtr, size_t size)
+    // the next size bytes if they're all in the first buffer, 0 otherwise
+    const char *contiguous(size_t size) const
     {
-        if (!size)
+        if (!mCount || at(0).size() - mBufferOffset < size)
             return 0;
-
-        unsigned char *out = static_cast<unsigned char *>(outPtr);
-        size_t read = 0, remaining = size;
-        while (!mBuffers.empty()) {
-            const auto &buf = mBuffers.front();
-            const size_t bufferSize = buf.size() - mBufferOffset;
-
-            if (remaining <= bufferSize) {
-                memcpy(out + read, buf.data() + mBufferOffset, remaining);
-                if (remaining == bufferSize) {
-                    mBufferOffset = 0;
-                    mBuffers.pop_front();
-                } else {
-                    mBufferOffset = remaining + mBufferOffset;
-                }
-                read += remaining;
+        return reinterpret_cast<const char *>(at(0).data()) + mBufferOffset;
+    }
+    // the next size bytes without consuming them, in place if they're
+    // contiguous, copied to scratch otherwise. 0 if there aren't that
+    // many.
+    const char *peek(size_t size, void *scratch) const
+    {
+        if (size > mSize)
+            return 0;
+        if (const char *data = contiguous(size))
+            return data;
+        copy(scratch, size);
+        return static_cast<const char *>(scratch);
+    }
+    // the next size bytes as pointers into the buffers, valid until
+    // they're read or skipped
+    void chunks(size_t size, std::vector<Chunk> &out) const
+    {
+        out.clear();
+        size_t offset = mBufferOffset;
+        for (size_t i = 0; size && i < mCount; ++i) {
+            const Buffer &buf = at(i);
+            const size_t chunk = std::min(buf.size() - offset, size);
+            out.push_back(Chunk(reinterpret_cast<const char *>(buf.data()) + offset, chunk));
+            size -= chunk;
+            offset = 0;
+        }
+    }
+    // consumes up to size bytes
+    size_t skip(size_t size)
+    {
+        size_t skipped = 0;
+        while (size && mCount) {
+            const size_t bufferSize = at(0).size() - mBufferOffset;
+            if (size < bufferSize) {
+                mBufferOffset += size;
+                skipped += size;
                 break;
             }
-            memcpy(out + read, buf.data() + mBufferOffset, bufferSize);
-            read += bufferSize;
+            skipped += bufferSize;
+            size -= bufferSize;
             mBufferOffset = 0;
-            remaining -= bufferSize;
-            assert(!mBuffers.isEmpty());
-            mBuffers.pop_front();
+            popFront();
         }
-        return read;
+        mSize -= skipped;
+        return skipped;
     }
 private:
+    Buffer &at(size_t index) { return mRing[(mHead + index) & (mRing.size() - 1)]; }
+    const Buffer &at(size_t index) const { return mRing[(mHead + index) & (mRing.size() - 1)]; }
+    size_t copy(void *outPtr, size_t size) const
+    {
+        unsigned char *out = static_cast<unsigned char *>(outPtr);
+        size_t offset = mBufferOffset, copied = 0;
+        for (size_t i = 0; copied < size && i < mCount; ++i) {
+            const Buffer &buf = at(i);
+            const size_t chunk = std::min(buf.size() - offset, size - copied);
+            memcpy(out + copied, buf.data() + offset, chunk);
+            copied += chunk;
+            offset = 0;
+        }
+        return copied;
+    }
+    // the ring's size is a power of two
+    void grow()
+    {
+        std::vector<Buffer> ring(mRing.empty() ? 4 : mRing.size() * 2);
+        for (size_t i = 0; i < mCount; ++i)
+            ring[i] = std::move(at(i));
+        mRing.swap(ring);
+        mHead = 0;
+    }
+    void popFront()
+    {
+        Buffer &front = at(0);
+        if (mPool) {
+            mPool->release(std::move(front));
+        } else {
+            front = Buffer();
+        }
+        mHead = (mHead + 1) & (mRing.size() - 1);
+        --mCount;
+    }
+
     Buffers(const Buffers &) = delete;
     Buffers &operator=(const Buffers &) = delete;
 
-    LinkedList<Buffer> mBuffers;
-    size_t mBufferOffset;
+    std::shared_ptr<BufferPool> mPool;
+    std::vector<Buffer> mRing;
+    size_t mHead, mCount, mBufferOffset, mSize;
 };
 
 #endif
@@ -0,0 +1,455 @@
+#include "ChunkFile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Rct.h"
+
+// The file is a 16 byte header, the magic, the format, the version and a
+// reserved word, followed by records. Every record is a type, an id, the
+// size of its data and the CRC32C of the data, then the data. A commit
+// appends a table record with an entry of id, size, crc, a reserved word
+// and offset per chunk, and an end record with the offset of the table,
+// so the end record is always the last 24 bytes of a complete file.
+// Everything is in the byte order of the machine, like DataFile.
+
+ChunkFile::ChunkFile(const Path &path, int version)
+    : mPath(path), mVersion(version), mMode(Read), mFd(-1), mMapped(0), mSize(0), mDirty(false)
+{
+}
+
+ChunkFile::~ChunkFile()
+{
+    if (mDirty)
+        commit();
+    close();
+}
+
+void ChunkFile::close()
+{
+    if (mMapped) {
+        munmap(const_cast<char *>(mMapped), mSize);
+        mMapped = 0;
+    }
+    if (mFd != -1) {
+        ::close(mFd);
+        mFd = -1;
+    }
+    if (!mTempFilePath.isEmpty()) {
+        Path::rm(mTempFilePath);
+        mTempFilePath.clear();
+    }
+}
+
+void ChunkFile::setError(const char *what)
+{
+    mError = String::format<128>("%s failure %d (%s)", what, errno, Rct::strerror().constData());
+}
+
+bool ChunkFile::open(Mode mode)
+{
+    assert(mFd == -1);
+    mMode = mode;
+    mChunks.clear();
+    mError.clear();
+    mDirty = false;
+    if (mode == Write) {
+        mFd = createTemp(mTempFilePath);
+        if (mFd == -1) {
+            mTempFilePath.clear();
+            return false;
+        }
+        mSize = HeaderSize;
+        // an empty file is written too
+        mDirty = true;
+        return true;
+    }
+
+    if (mode == Append && !Path::mkdir(mPath.parentDir()))
+        return false;
+    mFd = ::open(mPath.constData(), (mode == Read ? O_RDONLY : O_RDWR | O_CREAT) | O_CLOEXEC, 0644);
+    if (mFd == -1) {
+        if (errno != ENOENT)
+            setError("open");
+        return false;
+    }
+    struct stat st;
+    if (fstat(mFd, &st)) {
+        setError("fstat");
+        close();
+        return false;
+    }
+    if (mode == Append && !st.st_size) {
+        if (!writeHeader(mFd)) {
+            close();
+            return false;
+        }
+        mSize = HeaderSize;
+        return true;
+    }
+    if (!load(st.st_size)) {
+        close();
+        return false;
+    }
+    if (mode == Append) {
+        // drops whatever an unfinished commit left behind
+        if (mSize != static_cast<uint64_t>(st.st_size) && ftruncate(mFd, mSize)) {
+            setError("ftruncate");
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    // the tail of an unfinished commit isn't mapped
+    void *mapped = mmap(0, mSize, PROT_READ, MAP_PRIVATE, mFd, 0);
+    if (mapped == MAP_FAILED) {
+        setError("mmap");
+        close();
+        return false;
+    }
+    madvise(mapped, mSize, MADV_RANDOM);
+    mMapped = static_cast<const char *>(mapped);
+    ::close(mFd);
+    mFd = -1;
+    return true;
+}
+
+bool ChunkFile::load(uint64_t size)
+{
+    uint32_t header[4];
+    if (size < HeaderSize || !readAt(0, header, sizeof(header)) || header[0] != Magic) {
+        mError = String::format<128>("%s is not a chunk file", mPath.constData());
+        return false;
+    }
+    if (header[1] != Format) {
+        mError = String::format<128>("Unknown chunk file format %u for %s", header[1], mPath.constData());
+        return false;
+    }
+    const int version = static_cast<int>(header[2]);
+    if ((version ^ mVersion) & ~Serializer::CompactVersion) {
+        mError = String::format<128>("Wrong database version. Expected %d, got %d for %s.",
+                                     mVersion, version, mPath.constData());
+        return false;
+    }
+
+    // a complete file ends with an end record
+    uint32_t end[EndRecordSize / sizeof(uint32_t)];
+    if (size >= HeaderSize + EndRecordSize && readAt(size - EndRecordSize, end, sizeof(end))) {
+        uint64_t tableOffset;
+        memcpy(&tableOffset, end + 4, sizeof(tableOffset));
+        if (end[0] == EndRecord && end[2] == sizeof(tableOffset)
+            && end[3] == Rct::crc32c(&tableOffset, sizeof(tableOffset))
+            && readTable(tableOffset, size - EndRecordSize)) {
+            mSize = size;
+            return true;
+        }
+    }
+
+    // otherwise the last commit that made it is the last end record that's
+    // right after a table
+    uint64_t pos = HeaderSize, table = 0;
+    mSize = HeaderSize;
+    mChunks.clear();
+    uint32_t record[4];
+    while (pos + RecordHeaderSize <= size && readAt(pos, record, sizeof(record))) {
+        const uint64_t next = pos + RecordHeaderSize + record[2];
+        if (next > size)
+            break;
+        if (record[0] == TableRecord) {
+            table = pos;
+        } else if (record[0] == EndRecord) {
+            uint64_t tableOffset;
+            if (record[2] != sizeof(tableOffset) || !readAt(pos + RecordHeaderSize, &tableOffset, sizeof(tableOffset))
+                || record[3] != Rct::crc32c(&tableOffset, sizeof(tableOffset)) || tableOffset != table) {
+                break;
+            }
+            Map<uint32_t, Chunk> committed;
+            std::swap(committed, mChunks);
+            if (!readTable(table, pos)) {
+                std::swap(committed, mChunks);
+                break;
+            }
+            mSize = next;
+        } else if (record[0] != ChunkRecord) {
+            break;
+        }
+        pos = next;
+    }
+    if (mMode == Read && mSize == HeaderSize) {
+        mError = String::format<128>("%s seems to be corrupted. It has no complete commit", mPath.constData());
+        return false;
+    }
+    return true;
+}
+
+bool ChunkFile::readTable(uint64_t offset, uint64_t end)
+{
+    uint32_t record[4];
+    if (offset < HeaderSize || offset + RecordHeaderSize > end || !readAt(offset, record, sizeof(record))
+        || record[0] != TableRecord || offset + RecordHeaderSize + record[2] != end || record[2] % TableEntrySize) {
+        return false;
+    }
+    String table(record[2], '\0');
+    if (!readAt(offset + RecordHeaderSize, table.data(), table.size())
+        || Rct::crc32c(table.constData(), table.size()) != record[3]) {
+        return false;
+    }
+    mChunks.clear();
+    for (const char *entry = table.constData(); entry != table.constData() + table.size(); entry += TableEntrySize) {
+        uint32_t id;
+        Chunk chunk;
+        memcpy(&id, entry, sizeof(id));
+        memcpy(&chunk.size, entry + 4, sizeof(chunk.size));
+        memcpy(&chunk.crc, entry + 8, sizeof(chunk.crc));
+        memcpy(&chunk.offset, entry + 16, sizeof(chunk.offset));
+        if (chunk.offset < HeaderSize + RecordHeaderSize || chunk.offset + chunk.size > offset)
+            return false;
+        chunk.verified = false;
+        mChunks[id] = chunk;
+    }
+    return true;
+}
+
+bool ChunkFile::readAt(uint64_t offset, void *data, size_t size) const
+{
+    if (mMapped) {
+        memcpy(data, mMapped + offset, size);
+        return true;
+    }
+    char *out = static_cast<char *>(data);
+    while (size) {
+        const ssize_t r = pread(mFd, out, size, offset);
+        if (r <= 0) {
+            if (r == -1 && errno == EINTR)
+                continue;
+            return false;
+        }
+        out += r;
+        offset += r;
+        size -= r;
+    }
+    return true;
+}
+
+bool ChunkFile::writeAt(int fd, uint64_t offset, const void *data, size_t size)
+{
+    const char *in = static_cast<const char *>(data);
+    while (size) {
+        const ssize_t w = pwrite(fd, in, size, offset);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            setError("write");
+            return false;
+        }
+        in += w;
+        offset += w;
+        size -= w;
+    }
+    return true;
+}
+
+bool ChunkFile::writeRecord(int fd, uint64_t &pos, uint32_t type, uint32_t id, const void *data, size_t size)
+{
+    assert(size <= UINT32_MAX);
+    const uint32_t header[4] = { type, id, static_cast<uint32_t>(size), Rct::crc32c(data, size) };
+    if (!writeAt(fd, pos, header, sizeof(header)) || !writeAt(fd, pos + sizeof(header), data, size))
+        return false;
+    pos += sizeof(header) + size;
+    return true;
+}
+
+bool ChunkFile::writeHeader(int fd)
+{
+    const uint32_t header[4] = { Magic, Format, static_cast<uint32_t>(mVersion), 0 };
+    return writeAt(fd, 0, header, sizeof(header));
+}
+
+bool ChunkFile::writeTable(int fd, uint64_t &pos, const Map<uint32_t, Chunk> &chunks)
+{
+    String table(chunks.size() * TableEntrySize, '\0');
+    char *entry = table.data();
+    for (const auto &chunk : chunks) {
+        memcpy(entry, &chunk.first, sizeof(chunk.first));
+        memcpy(entry + 4, &chunk.second.size, sizeof(chunk.second.size));
+        memcpy(entry + 8, &chunk.second.crc, sizeof(chunk.second.crc));
+        memcpy(entry + 16, &chunk.second.offset, sizeof(chunk.second.offset));
+        entry += TableEntrySize;
+    }
+    uint64_t tableOffset = pos;
+    return (writeRecord(fd, pos, TableRecord, 0, table.constData(), table.size())
+            && writeRecord(fd, pos, EndRecord, 0, &tableOffset, sizeof(tableOffset)));
+}
+
+int ChunkFile::createTemp(Path &path)
+{
+    if (!Path::mkdir(mPath.parentDir()))
+        return -1;
+    path = mPath + "XXXXXX";
+    const int fd = mkostemp(&path[0], O_CLOEXEC);
+    if (fd == -1) {
+        setError("mkstemp");
+        return -1;
+    }
+    if (!writeHeader(fd)) {
+        ::close(fd);
+        Path::rm(path);
+        return -1;
+    }
+    return fd;
+}
+
+int64_t ChunkFile::chunkSize(uint32_t id) const
+{
+    const auto it = mChunks.find(id);
+    return it == mChunks.end() ? -1 : static_cast<int64_t>(it->second.size);
+}
+
+bool ChunkFile::fetch(uint32_t id, StringView &data, String &storage) const
+{
+    const auto it = mChunks.find(id);
+    if (it == mChunks.end())
+        return false;
+    const Chunk &chunk = it->second;
+    if (mMapped) {
+        data = StringView(mMapped + chunk.offset, chunk.size);
+    } else {
+        storage.resize(chunk.size);
+        if (!readAt(chunk.offset, storage.data(), chunk.size))
+            return false;
+        data = storage;
+        chunk.verified = false;
+    }
+    if (!chunk.verified) {
+        if (Rct::crc32c(data.data(), data.size()) != chunk.crc)
+            return false;
+        chunk.verified = true;
+    }
+    return true;
+}
+
+bool ChunkFile::read(uint32_t id, String &data) const
+{
+    StringView view;
+    if (!fetch(id, view, data))
+        return false;
+    if (view.data() != data.constData())
+        data.assign(view.data(), view.size());
+    return true;
+}
+
+StringView ChunkFile::view(uint32_t id) const
+{
+    assert(mMapped);
+    StringView data;
+    String storage;
+    if (!fetch(id, data, storage))
+        return StringView();
+    return data;
+}
+
+bool ChunkFile::write(uint32_t id, const char *data, size_t size)
+{
+    assert(mFd != -1 && mMode != Read);
+    uint64_t pos = mSize;
+    if (!writeRecord(mFd, pos, ChunkRecord, id, data, size))
+        return false;
+    Chunk &chunk = mChunks[id];
+    chunk.offset = mSize + RecordHeaderSize;
+    chunk.size = static_cast<uint32_t>(size);
+    chunk.crc = Rct::crc32c(data, size);
+    chunk.verified = false;
+    mSize = pos;
+    mDirty = true;
+    return true;
+}
+
+bool ChunkFile::remove(uint32_t id)
+{
+    assert(mMode != Read);
+    if (!mChunks.remove(id))
+        return false;
+    mDirty = true;
+    return true;
+}
+
+bool ChunkFile::commit()
+{
+    if (mFd == -1 || mMode == Read)
+        return false;
+    mDirty = false;
+    if (!writeTable(mFd, mSize, mChunks))
+        return false;
+    if (!mTempFilePath.isEmpty()) {
+        if (rename(mTempFilePath.constData(), mPath.constData())) {
+            setError("rename");
+            return false;
+        }
+        // the fd is the file now, later commits append to it
+        mTempFilePath.clear();
+        mMode = Append;
+    }
+    return true;
+}
+
+uint64_t ChunkFile::wastedSize() const
+{
+    uint64_t used = HeaderSize + RecordHeaderSize + mChunks.size() * TableEntrySize + EndRecordSize;
+    for (const auto &chunk : mChunks)
+        used += RecordHeaderSize + chunk.second.size;
+    return mSize > used ? mSize - used : 0;
+}
+
+bool ChunkFile::compact()
+{
+    assert(mMode != Read);
+    if (mFd == -1)
+        return false;
+    // a new file has to be in place first
+    if (!mTempFilePath.isEmpty() && !commit())
+        return false;
+    Path temp;
+    const int fd = createTemp(temp);
+    if (fd == -1)
+        return false;
+    Map<uint32_t, Chunk> chunks;
+    uint64_t pos = HeaderSize;
+    String data;
+    bool ok = true;
+    for (const auto &chunk : mChunks) {
+        data.resize(chunk.second.size);
+        ok = readAt(chunk.second.offset, data.data(), data.size());
+        if (!ok || Rct::crc32c(data.constData(), data.size()) != chunk.second.crc) {
+            mError = String::format<128>("%s has a corrupted chunk %u", mPath.constData(), chunk.first);
+            ok = false;
+            break;
+        }
+        Chunk &copy = chunks[chunk.first];
+        copy = chunk.second;
+        copy.offset = pos + RecordHeaderSize;
+        if (!(ok = writeRecord(fd, pos, ChunkRecord, chunk.first, data.constData(), data.size())))
+            break;
+    }
+    if (ok)
+        ok = writeTable(fd, pos, chunks);
+    if (ok && rename(temp.constData(), mPath.constData())) {
+        setError("rename");
+        ok = false;
+    }
+    if (!ok) {
+        ::close(fd);
+        Path::rm(temp);
+        return false;
+    }
+    ::close(mFd);
+    mFd = fd;
+    mChunks = std::move(chunks);
+    mSize = pos;
+    mDirty = false;
+    return true;
+}
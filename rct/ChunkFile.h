@@ -0,0 +1,147 @@
+#ifndef ChunkFile_h
+#define ChunkFile_h
+
+#include <stdint.h>
+
+#include <rct/Map.h>
+#include <rct/Path.h>
+#include <rct/Serializer.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+
+// A file of independently checksummed chunks, looked up by id through a
+// table at the end. Unlike DataFile, which rewrites everything on every
+// save, changes are appended: write() adds a chunk that replaces any older
+// one with that id and commit() appends a new table that makes them
+// visible. The space that replaced and removed chunks take is given back
+// by compact().
+//
+//     ChunkFile file(path, Version);
+//     if (file.open(ChunkFile::Append)) {
+//         file.serialize(fileId, symbols);
+//         file.commit();
+//     }
+//
+// Readers validate the table when the file is opened and each chunk's
+// CRC32C when it's read, so only the chunks that are used get loaded. A
+// commit that didn't make it out completely, like after a crash, is
+// ignored and the file reads like it did after the commit before.
+class ChunkFile
+{
+public:
+    ChunkFile(const Path &path, int version);
+    ~ChunkFile();
+
+    Path path() const { return mPath; }
+
+    enum Mode {
+        // mapped, the chunks are loaded as they're read
+        Read,
+        // a new file, it replaces the old one on the first commit()
+        Write,
+        // adds to the file, or creates it
+        Append
+    };
+    bool open(Mode mode);
+    String error() const { return mError; }
+
+    List<uint32_t> chunks() const { return mChunks.keys(); }
+    bool contains(uint32_t id) const { return mChunks.contains(id); }
+    // size of the chunk, -1 if there's none
+    int64_t chunkSize(uint32_t id) const;
+
+    // false if there's no such chunk or its checksum doesn't match
+    bool read(uint32_t id, String &data) const;
+    // points into the mapping, Read mode only. An empty view if there's no
+    // such chunk or its checksum doesn't match.
+    StringView view(uint32_t id) const;
+    template <typename T> bool deserialize(uint32_t id, T &t) const;
+
+    bool write(uint32_t id, const char *data, size_t size);
+    bool write(uint32_t id, const String &data) { return write(id, data.constData(), data.size()); }
+    template <typename T> bool serialize(uint32_t id, const T &t);
+    bool remove(uint32_t id);
+    // writes the table, the destructor commits changes that haven't been
+    bool commit();
+
+    // bytes of the file that no chunk in the table uses
+    uint64_t wastedSize() const;
+    // rewrites the file with only the chunks that are in the table, when
+    // wastedSize() is a big enough part of fileSize() to be worth it
+    bool compact();
+    uint64_t fileSize() const { return mSize; }
+
+private:
+    enum {
+        Magic = 0x43544352, // "RCTC"
+        Format = 1,
+        HeaderSize = 16,
+        RecordHeaderSize = 16,
+        TableEntrySize = 24,
+        EndRecordSize = RecordHeaderSize + 8
+    };
+    enum RecordType {
+        ChunkRecord = 1,
+        TableRecord = 2,
+        EndRecord = 3
+    };
+    struct Chunk
+    {
+        uint64_t offset; // of the data
+        uint32_t size, crc;
+        mutable bool verified;
+    };
+
+    bool load(uint64_t size);
+    bool readTable(uint64_t offset, uint64_t end);
+    bool readAt(uint64_t offset, void *data, size_t size) const;
+    bool writeAt(int fd, uint64_t offset, const void *data, size_t size);
+    bool writeRecord(int fd, uint64_t &pos, uint32_t type, uint32_t id, const void *data, size_t size);
+    bool writeHeader(int fd);
+    bool writeTable(int fd, uint64_t &pos, const Map<uint32_t, Chunk> &chunks);
+    // a new file next to mPath with the header written, -1 on failure
+    int createTemp(Path &path);
+    bool fetch(uint32_t id, StringView &data, String &storage) const;
+    void setError(const char *what);
+    void close();
+
+    Path mPath, mTempFilePath;
+    const int mVersion;
+    Mode mMode;
+    int mFd;
+    const char *mMapped;
+    uint64_t mSize;
+    bool mDirty;
+    Map<uint32_t, Chunk> mChunks;
+    String mError;
+
+    ChunkFile(const ChunkFile &) = delete;
+    ChunkFile &operator=(const ChunkFile &) = delete;
+};
+
+template <typename T>
+inline bool ChunkFile::deserialize(uint32_t id, T &t) const
+{
+    StringView data;
+    String storage;
+    if (!fetch(id, data, storage))
+        return false;
+    Deserializer deserializer(data.data(), static_cast<int>(data.size()));
+    deserializer.setCompact(mVersion & Serializer::CompactVersion);
+    deserializer >> t;
+    return true;
+}
+
+template <typename T>
+inline bool ChunkFile::serialize(uint32_t id, const T &t)
+{
+    String data;
+    {
+        Serializer serializer(data);
+        serializer.setCompact(mVersion & Serializer::CompactVersion);
+        serializer << t;
+    }
+    return write(id, data);
+}
+
+#endif
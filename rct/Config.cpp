@@ -4,12 +4,24 @@
 #include "StackBuffer.h"
 
 List<Config::OptionBase*> Config::sOptions;
+FlatHash<StringView, Config::OptionBase*, Config::NameHash> Config::sOptionsByName;
+FlatHash<char, Config::OptionBase*> Config::sShortOptions;
 bool Config::sAllowsFreeArgs = false;
 List<Value> Config::sFreeArgs;
 
 static inline Value createValue(Value::Type type, const char *val, bool *ok)
 {
-    return Value::create(val).convert(type, ok);
+    return Value(val).convert(type, ok);
+}
+
+void Config::addOption(OptionBase *option)
+{
+    sOptions.append(option);
+    if (option->name)
+        sOptionsByName.insert(StringView(option->name), option);
+    if (option->shortOption)
+        sShortOptions.insert(option->shortOption, option);
+    option->update();
 }
 
 bool Config::parse(int argc, char **argv, const List<Path> &rcFiles)
@@ -129,7 +141,6 @@ bool Config::parse(int argc, char **argv, const List<Path> &rcFiles)
                     }
                     ++optind;
                 }
-                opt->value = vals;
                 if (opt->listCount && vals.size() != opt->listCount) {
                     ok = false;
                     error = String::format<128>("Too few values specified for %s. Wanted %zu, got %zu",
@@ -137,8 +148,9 @@ bool Config::parse(int argc, char **argv, const List<Path> &rcFiles)
 
                     goto done;
                 }
+                opt->value = std::move(vals);
             } else {
-                opt->value = val;
+                opt->value = std::move(val);
             }
             if (!opt->validate(error)) {
                 ok = false;
@@ -164,6 +176,9 @@ done:
         free(a[i]);
     }
 
+    for (OptionBase *opt : sOptions)
+        opt->update();
+
     if (!ok) {
         if (!error.isEmpty()) {
             showHelp(stderr);
@@ -208,6 +223,8 @@ void Config::showHelp(FILE *f)
 void Config::clear()
 {
     sOptions.deleteAll();
+    sOptionsByName.clear();
+    sShortOptions.clear();
     sAllowsFreeArgs = false;
     sFreeArgs.clear();
 }
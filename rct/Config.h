@@ -4,14 +4,42 @@
 #include <getopt.h>
 #include <stdio.h>
 
+#include <rct/FlatHash.h>
 #include <rct/Path.h>
 #include <rct/String.h>
+#include <rct/StringView.h>
 #include <rct/Value.h>
 
 
 class Config
 {
+    struct OptionBase;
 public:
+    // Reads an option without looking it up, for code that reads it
+    // often. Valid until clear().
+    //
+    //     static const Config::Handle<int> jobs = Config::handle<int>("jobs");
+    //     const int j = jobs.value();
+    template <typename T>
+    class Handle
+    {
+    public:
+        Handle()
+            : mOption(0)
+        {}
+
+        bool isValid() const { return mOption; }
+        T value(bool *ok = 0) const { return Config::read<T>(mOption, ok); }
+        int isEnabled() const { return Config::enabled(mOption); }
+    private:
+        Handle(const OptionBase *option)
+            : mOption(option)
+        {}
+
+        const OptionBase *mOption;
+        friend class Config;
+    };
+
     static bool parse(int argc, char **argv, const List<Path> &rcFiles = List<Path>());
 
     template<typename T, int listCount = 0>
@@ -30,7 +58,7 @@ public:
         option->type = type;
         option->count = 0;
         option->listCount = listCount;
-        sOptions.append(option);
+        addOption(option);
     }
 
     template <typename T>
@@ -50,24 +78,22 @@ public:
         option->type = def.type();
         option->count = 0;
         option->listCount = 0;
-        sOptions.append(option);
+        addOption(option);
     }
 
     static int isEnabled(const char *name)
     {
-        const OptionBase *opt = findOption(name);
-        if (opt && opt->value.toBool()) {
-            return opt->count;
-        }
-        return 0;
+        return enabled(findOption(name));
     }
 
     template <typename T> static T value(const char *name, const T & defaultValue, bool *ok = 0)
     {
         const OptionBase *opt = findOption(name);
-        if (opt && !opt->value.isNull()) {
+        if (opt && opt->isSet) {
             if (ok)
                 *ok = true;
+            if (const T *t = cached<T>(opt))
+                return *t;
             return opt->value.convert<T>();
         }
         if (ok)
@@ -77,21 +103,13 @@ public:
 
     template <typename T> static T value(const char *name, bool *ok = 0)
     {
-        const OptionBase *opt = findOption(name);
-        if (opt) {
-            if (opt->value.isNull()) {
-                T ret;
-                convert(opt->defaultValue, ret, ok);
-                return ret;
-            } else {
-                T ret;
-                convert(opt->value, ret, ok);
-                return ret;
-            }
-        }
-        if (ok)
-            *ok = false;
-        return T();
+        return read<T>(findOption(name), ok);
+    }
+
+    // an invalid handle if there's no such option
+    template <typename T> static Handle<T> handle(const char *name)
+    {
+        return Handle<T>(findOption(name));
     }
     static void showHelp(FILE *f);
     static void setAllowsFreeArguments(bool on) { sAllowsFreeArgs = on; }
@@ -124,7 +142,7 @@ private:
     static void convert(const Value &value, T &t, bool *ok = 0, typename std::enable_if<is_list<T>::value, T>::type * = 0)
     {
         typedef typename ListType<T>::type K;
-        List<Value> values = value.convert<List<Value> >();
+        const List<Value> &values = value.listRef();
         t.reserve(values.size());
         for (const Value &val : values) {
             bool o;
@@ -147,7 +165,17 @@ private:
     }
     Config();
     ~Config();
+    // an address per type, to tell the type of the cached value
+    template <typename T> static const void *typeId()
+    {
+        static const char id = 0;
+        return &id;
+    }
+
     struct OptionBase {
+        OptionBase()
+            : typedType(0), typedValue(0), typedOk(false), isSet(false)
+        {}
         virtual ~OptionBase() {}
         const char *name;
         char shortOption;
@@ -156,10 +184,26 @@ private:
         Value value;
         Value::Type type;
         size_t count, listCount;
+        // value, or defaultValue if it isn't set, converted to the type
+        // the option was registered with by update()
+        const void *typedType;
+        const void *typedValue;
+        bool typedOk, isSet;
         virtual bool validate(String &err) = 0;
+        virtual void update() = 0;
     };
     template <typename T>
     struct Option : public OptionBase {
+        Option()
+        {
+            typedType = typeId<T>();
+            typedValue = &typed;
+        }
+        virtual void update() override
+        {
+            isSet = !value.isNull();
+            Config::convert(isSet ? value : defaultValue, typed, &typedOk);
+        }
         virtual bool validate(String &err) override
         {
             if (validator) {
@@ -172,14 +216,25 @@ private:
             return true;
         }
         std::function<bool(const T &, String &err)> validator;
+        T typed;
     };
 
     template <typename T>
     struct ListOption : public OptionBase {
+        ListOption()
+        {
+            typedType = typeId<List<T> >();
+            typedValue = &typed;
+        }
+        virtual void update() override
+        {
+            isSet = !value.isNull();
+            Config::convert(isSet ? value : defaultValue, typed, &typedOk);
+        }
         virtual bool validate(String &err) override
         {
             if (validator) {
-                const List<Value> t = value.convert<List<Value> >();
+                const List<Value> &t = value.listRef();
                 List<T> converted(t.size());
                 for (int i=0; i<t.size(); ++i) {
                     converted[i] = t.at(i).convert<T>();
@@ -192,19 +247,71 @@ private:
             return true;
         }
         std::function<bool(const List<T> &, String &err)> validator;
+        List<T> typed;
     };
 
+    template <typename T> static const T *cached(const OptionBase *opt)
+    {
+        return opt->typedType == typeId<T>() ? static_cast<const T *>(opt->typedValue) : 0;
+    }
+
+    template <typename T> static T read(const OptionBase *opt, bool *ok)
+    {
+        if (opt) {
+            if (const T *t = cached<T>(opt)) {
+                if (ok)
+                    *ok = opt->typedOk;
+                return *t;
+            }
+            T ret;
+            convert(opt->isSet ? opt->value : opt->defaultValue, ret, ok);
+            return ret;
+        }
+        if (ok)
+            *ok = false;
+        return T();
+    }
+
+    static int enabled(const OptionBase *opt)
+    {
+        if (opt && opt->value.toBool()) {
+            return opt->count;
+        }
+        return 0;
+    }
+
+    struct NameHash
+    {
+        // 64 bit FNV-1a
+        size_t operator()(const StringView &name) const
+        {
+            uint64_t hash = 14695981039346656037ULL;
+            for (char ch : name) {
+                hash ^= static_cast<unsigned char>(ch);
+                hash *= 1099511628211ULL;
+            }
+            return static_cast<size_t>(hash);
+        }
+    };
+
+    static void addOption(OptionBase *option);
+
     static List<OptionBase*> sOptions;
+    // the first option registered with a name or short option
+    static FlatHash<StringView, OptionBase*, NameHash> sOptionsByName;
+    static FlatHash<char, OptionBase*> sShortOptions;
     static bool sAllowsFreeArgs;
     static List<Value> sFreeArgs;
     static const OptionBase *findOption(const char *name)
     {
         assert(name);
-        const int len = strlen(name);
-        for (size_t i=0; i<sOptions.size(); ++i) {
-            if (!strcmp(sOptions.at(i)->name, name) || (len == 1 && *name == sOptions.at(i)->shortOption)) {
-                return sOptions.at(i);
-            }
+        const auto it = sOptionsByName.find(StringView(name));
+        if (it != sOptionsByName.end())
+            return it->second;
+        if (name[0] && !name[1]) {
+            const auto shortIt = sShortOptions.find(name[0]);
+            if (shortIt != sShortOptions.end())
+                return shortIt->second;
         }
         return 0;
     }
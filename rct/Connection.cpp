@@ -1,17 +1,19 @@
 #include "Connection.h"
 
 #include <assert.h>
+#include <limits.h>
 
+#include "Allocations.h"
 #include "Connection.h"
 #include "EventLoop.h"
 #include "Message.h"
 #include "Serializer.h"
-#include "StackBuffer.h"
 #include "Timer.h"
+#include "Trace.h"
 
 Connection::Connection(int version)
     : mPendingRead(0), mPendingWrite(0), mTimeoutTimer(0), mCheckTimer(0), mFinishStatus(0),
-      mVersion(version), mSilent(false), mIsConnected(false), mWarned(false)
+      mVersion(version), mSilent(false), mIsConnected(false), mWarned(false), mNextRequestId(1)
 {
 }
 
@@ -47,7 +49,7 @@ void Connection::connect(const SocketClient::SharedPtr &client)
     mSocketClient->readyRead().connect(std::bind(&Connection::onDataAvailable, this, std::placeholders::_1, std::placeholders::_2));
     mSocketClient->bytesWritten().connect(std::bind(&Connection::onDataWritten, this, std::placeholders::_1, std::placeholders::_2));
     mSocketClient->error().connect(std::bind(&Connection::onSocketError, this, std::placeholders::_1, std::placeholders::_2));
-    mCheckTimer = EventLoop::eventLoop()->registerTimer([this](int) { checkData(); }, 0, Timer::SingleShot);
+    mCheckTimer = EventLoop::eventLoop()->registerTimer([this](int) { mCheckTimer = 0; checkData(); }, 0, Timer::SingleShot);
 }
 
 void Connection::checkData()
@@ -111,8 +113,14 @@ int Connection::pendingWrite() const
     return mPendingWrite;
 }
 
-void Connection::onDataAvailable(const SocketClient::SharedPtr&, Buffer&& buf)
+void Connection::onDataAvailable(const SocketClient::SharedPtr &client, Buffer&& buf)
 {
+    RCT_TRACE_SCOPE("Connection", "onDataAvailable");
+    RCT_ALLOCATION_SCOPE(Allocations::ConnectionSubsystem);
+    // a slot may drop the last reference to us
+    auto that = shared_from_this();
+    if (!mBuffers.pool())
+        mBuffers.setPool(client->bufferPool());
     while (true) {
         if (!buf.isEmpty())
             mBuffers.push(std::forward<Buffer>(buf));
@@ -123,11 +131,12 @@ void Connection::onDataAvailable(const SocketClient::SharedPtr&, Buffer&& buf)
         if (!mPendingRead) {
             if (available < static_cast<int>(sizeof(uint32_t)))
                 break;
-            union {
-                unsigned char buf[sizeof(uint32_t)];
-                int pending;
-            };
-            const int read = mBuffers.read(buf, 4);
+            char scratch[sizeof(uint32_t)];
+            const char *header = mBuffers.peek(sizeof(uint32_t), scratch);
+            assert(header);
+            int pending;
+            memcpy(&pending, header, sizeof(pending));
+            const int read = mBuffers.skip(sizeof(uint32_t));
             assert(read == 4);
             mPendingRead = pending;
             assert(mPendingRead > 0);
@@ -137,14 +146,23 @@ void Connection::onDataAvailable(const SocketClient::SharedPtr&, Buffer&& buf)
         if (available < static_cast<unsigned int>(mPendingRead))
             break;
 
-        StackBuffer<1024 * 16> buffer(mPendingRead);
-        const int read = mBuffers.read(buffer.buffer(), mPendingRead);
+        // decode straight out of the received buffers
+        std::shared_ptr<Message> message;
+        if (const char *data = mBuffers.contiguous(mPendingRead)) {
+            message = Message::create(mVersion, data, mPendingRead);
+        } else {
+            mBuffers.chunks(mPendingRead, mChunks);
+            message = Message::create(mVersion, mChunks.data(), mChunks.size());
+            mChunks.clear();
+        }
+        const int read = mBuffers.skip(mPendingRead);
         assert(read == mPendingRead);
         mPendingRead = 0;
-        std::shared_ptr<Message> message = Message::create(mVersion, buffer, read);
         if (message) {
-            auto that = shared_from_this();
-            if (message->messageId() == FinishMessage::MessageId) {
+            RCT_TRACE_SCOPE("Connection", "message");
+            if (message->mIsResponse) {
+                onResponse(message);
+            } else if (message->messageId() == FinishMessage::MessageId) {
                 mFinishStatus = std::static_pointer_cast<FinishMessage>(message)->status();
                 mFinished(that, mFinishStatus);
             } else {
@@ -169,33 +187,61 @@ void Connection::onDataWritten(const SocketClient::SharedPtr&, int bytes)
     }
 }
 
-class SocketClientBuffer : public Serializer::Buffer
+bool Connection::send(const Message &message)
 {
-public:
-    SocketClientBuffer(const SocketClient::SharedPtr &client)
-        : mClient(client), mWritten(0)
-    {}
+    return sendTagged(message, 0, 0);
+}
 
-    virtual bool write(const void *data, int len) override
-    {
-        if (mClient->write(data, len)) {
-            mWritten += len;
-            return true;
-        }
-        return false;
+uint32_t Connection::request(const Message &message, ResponseCallback &&onResponse, FinishedCallback &&onFinished)
+{
+    uint32_t id = mNextRequestId++;
+    while (!id || mRequests.contains(id))
+        id = mNextRequestId++;
+    if (!sendTagged(message, Message::RequestFlag, id))
+        return 0;
+    Request &request = mRequests[id];
+    request.onResponse = std::move(onResponse);
+    request.onFinished = std::move(onFinished);
+    return id;
+}
+
+bool Connection::respond(uint32_t requestId, const Message &message)
+{
+    assert(requestId);
+    return sendTagged(message, Message::ResponseFlag, requestId);
+}
+
+void Connection::onResponse(const std::shared_ptr<Message> &message)
+{
+    auto it = mRequests.find(message->requestId());
+    if (it == mRequests.end()) {
+        ::warning("Response for unknown request %u (%d)", message->requestId(), message->messageId());
+    } else if (message->messageId() == FinishMessage::MessageId) {
+        const FinishedCallback onFinished = std::move(it->second.onFinished);
+        mRequests.erase(it);
+        if (onFinished)
+            onFinished(std::static_pointer_cast<FinishMessage>(message)->status());
+    } else if (it->second.onResponse) {
+        // the callback may start other requests
+        const ResponseCallback onResponse = it->second.onResponse;
+        onResponse(message);
     }
+}
 
-    virtual int pos() const override
-    {
-        return mWritten;
+void Connection::abortRequests()
+{
+    Hash<uint32_t, Request> requests;
+    std::swap(requests, mRequests);
+    for (const auto &request : requests) {
+        if (request.second.onFinished)
+            request.second.onFinished(-1);
     }
-private:
-    SocketClient::SharedPtr mClient;
-    int mWritten;
-};
+}
 
-bool Connection::send(const Message &message)
+bool Connection::sendTagged(const Message &message, uint8_t tag, uint32_t requestId)
 {
+    RCT_TRACE_SCOPE("Connection", "send");
+    RCT_ALLOCATION_SCOPE(Allocations::ConnectionSubsystem);
     // ::error() << getpid() << "sending message" << static_cast<int>(message.messageId());
     if (!mSocketClient || !mSocketClient->isConnected()) {
         if (!mWarned) {
@@ -210,20 +256,126 @@ bool Connection::send(const Message &message)
 #ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
     const size_t size = String::npos;
 #else
-    const size_t size = message.encodedSize();
+    // encodedSize() is only exact for the default format
+    const size_t size = Message::isCompact(mVersion) ? String::npos : message.encodedSize();
 #endif
 
-    if (size == String::npos || message.mFlags & Message::MessageCache) {
+    if (size == String::npos || message.mFlags & (Message::MessageCache|Message::Compressed)) {
         String header, value;
-        message.prepare(mVersion, header, value);
+        const uint8_t flags = message.prepare(mVersion, header, value);
+        if (tag) {
+            header.clear();
+            Serializer serializer(header);
+            message.encodeHeader(serializer, value.size(), mVersion, flags | tag, requestId);
+        }
         mPendingWrite += header.size() + value.size();
-        assert(size == String::npos || size == (header.size() + value.size() - 4));
-        return (mSocketClient->write(header) && (value.isEmpty() || mSocketClient->write(value)));
+        assert(size == String::npos || message.mFlags & Message::Compressed
+               || size == (header.size() + value.size() - Message::headerExtra(tag) - 4));
+        const iovec vectors[] = {
+            { const_cast<char *>(header.constData()), header.size() },
+            { const_cast<char *>(value.constData()), value.size() }
+        };
+        return mSocketClient->write(vectors, value.isEmpty() ? 1 : 2);
     } else {
-        mPendingWrite += (size + Message::HeaderExtra) + sizeof(int);
-        Serializer serializer(std::unique_ptr<SocketClientBuffer>(new SocketClientBuffer(mSocketClient)));
-        message.encodeHeader(serializer, size, mVersion);
+        const size_t total = (size + Message::headerExtra(tag)) + sizeof(int);
+        mPendingWrite += total;
+        // serialized in one go and written with a single call
+        String data;
+        RCT_ALLOCATION_SCOPE(Allocations::SerializerSubsystem);
+        Serializer serializer(data, total);
+        message.encodeHeader(serializer, size, mVersion, (message.mFlags & ~(Message::Compressed|Message::Lz4|Message::Zstd)) | tag, requestId);
         message.encode(serializer);
-        return !serializer.hasError();
+        if (serializer.hasError())
+            return false;
+        assert(data.size() == total);
+        return mSocketClient->write(data);
+    }
+}
+
+bool Connection::send(const std::shared_ptr<const EncodedMessage> &message)
+{
+    RCT_TRACE_SCOPE("Connection", "send");
+    RCT_ALLOCATION_SCOPE(Allocations::ConnectionSubsystem);
+    if (!mSocketClient || !mSocketClient->isConnected()) {
+        if (!mWarned) {
+            mWarned = true;
+            warning("Trying to send message to unconnected client (%d)", message->messageId());
+        }
+        return false;
+    }
+    if (message->version() != mVersion) {
+        ::error("Message encoded for version %d, connection is version %d (%d)",
+                message->version(), mVersion, message->messageId());
+        return false;
+    }
+    const String &data = message->data();
+    mPendingWrite += data.size();
+    return mSocketClient->write(message, data.constData(), data.size());
+}
+
+bool Connection::sendFile(const Path &path, off_t offset, size_t length)
+{
+    if (!mSocketClient || !mSocketClient->isConnected())
+        return false;
+    if (mSilent)
+        return true;
+    const int64_t fileSize = path.fileSize();
+    if (fileSize < 0 || offset < 0 || offset > fileSize)
+        return false;
+    if (length == String::npos) {
+        length = fileSize - offset;
+    } else if (length > static_cast<uint64_t>(fileSize - offset)) {
+        return false;
+    }
+    // the frame size is read as an int
+    if (length > static_cast<size_t>(INT_MAX) - 64)
+        return false;
+
+    // header and size of the String the peer decodes, the file follows
+    const ResponseMessage message;
+    String prefix;
+    {
+        Serializer serializer(prefix);
+        serializer.setCompact(Message::isCompact(mVersion));
+        serializer << static_cast<uint32_t>(length);
+    }
+    String header;
+    Serializer serializer(header);
+    message.encodeHeader(serializer, prefix.size() + length, mVersion);
+    serializer.write(prefix);
+    mPendingWrite += header.size() + length;
+    if (!mSocketClient->write(header))
+        return false;
+    if (!mSocketClient->sendFile(path, offset, length)) {
+        // the peer would take what's sent next as the rest of the file
+        mSocketClient->close();
+        return false;
+    }
+    return true;
+}
+
+size_t Connection::broadcast(const Message &message, const List<std::shared_ptr<Connection> > &connections)
+{
+    // hardly ever more than one version
+    List<std::shared_ptr<const EncodedMessage> > encoded;
+    size_t sent = 0;
+    for (const auto &connection : connections) {
+        if (!connection->mSocketClient || !connection->mSocketClient->isConnected())
+            continue;
+        std::shared_ptr<const EncodedMessage> frame;
+        for (const auto &e : encoded) {
+            if (e->version() == connection->mVersion) {
+                frame = e;
+                break;
+            }
+        }
+        if (!frame) {
+            frame = message.encoded(connection->mVersion);
+            encoded.append(frame);
+        }
+        connection->mAboutToSend(connection, &message);
+        if (connection->send(frame))
+            ++sent;
     }
+    return sent;
 }
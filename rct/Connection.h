@@ -3,6 +3,9 @@
 
 #include "FinishMessage.h"
 #include <rct/Buffer.h>
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/Message.h>
 #include <rct/ResponseMessage.h>
 #include <rct/SignalSlot.h>
 #include <rct/SocketClient.h>
@@ -10,7 +13,6 @@
 
 class ConnectionPrivate;
 class Event;
-class Message;
 class SocketClient;
 class Connection : public std::enable_shared_from_this<Connection>
 {
@@ -39,6 +41,12 @@ public:
     int pendingWrite() const;
 
     bool send(const Message &message);
+    // queues the frame itself rather than a copy, it's released once
+    // written. aboutToSend() isn't emitted.
+    bool send(const std::shared_ptr<const EncodedMessage> &message);
+    // encodes the message once per protocol version in use and sends it
+    // to all of the connected connections, returns how many it was sent to
+    static size_t broadcast(const Message &message, const List<std::shared_ptr<Connection> > &connections);
     template <int StaticBufSize>
     bool write(const char *format, ...) RCT_PRINTF_WARNING(2, 3);
     bool write(const String &out, ResponseMessage::Type type = ResponseMessage::Stdout)
@@ -48,6 +56,11 @@ public:
         return send(ResponseMessage(out, type));
     }
 
+    // sends length bytes of the file from offset, npos for all of it, as
+    // the data of a ResponseMessage without reading it into memory, see
+    // SocketClient::sendFile(). aboutToSend() isn't emitted.
+    bool sendFile(const Path &path, off_t offset = 0, size_t length = String::npos);
+
     void finish(int status = 0) { send(FinishMessage(status)); }
     template <int StaticBufSize>
     void finish(const char *format, ...) RCT_PRINTF_WARNING(2, 3);
@@ -60,6 +73,21 @@ public:
 
     int finishStatus() const { return mFinishStatus; }
 
+    // Multiplexed requests. request() sends the message tagged with a new
+    // id and returns it, 0 if it couldn't be sent. Whatever the peer sends
+    // back with respond() for that id goes to onResponse, independent of
+    // other requests in flight, until finishRequest() ends it with
+    // onFinished(status), or onFinished(-1) if the connection goes away
+    // first. Incoming requests are emitted by newMessage() with
+    // Message::requestId() set.
+    typedef std::function<void(const std::shared_ptr<Message> &)> ResponseCallback;
+    typedef std::function<void(int)> FinishedCallback;
+    uint32_t request(const Message &message, ResponseCallback &&onResponse,
+                     FinishedCallback &&onFinished = FinishedCallback());
+    bool respond(uint32_t requestId, const Message &message);
+    void finishRequest(uint32_t requestId, int status = 0) { respond(requestId, FinishMessage(status)); }
+    size_t pendingRequests() const { return mRequests.size(); }
+
     void close() { assert(mSocketClient); mSocketClient->close(); }
 
     bool isConnected() const { return mSocketClient->isConnected(); }
@@ -78,23 +106,41 @@ private:
     void disconnect();
     void connect(const SocketClient::SharedPtr &client);
     void onClientConnected(const SocketClient::SharedPtr&) { mIsConnected = true; mConnected(shared_from_this()); }
-    void onClientDisconnected(const SocketClient::SharedPtr&) { mIsConnected = false; mDisconnected(shared_from_this()); }
+    void onClientDisconnected(const SocketClient::SharedPtr&)
+    {
+        mIsConnected = false;
+        abortRequests();
+        mDisconnected(shared_from_this());
+    }
     void onDataAvailable(const SocketClient::SharedPtr&, Buffer&& buffer);
     void onDataWritten(const SocketClient::SharedPtr&, int);
     void onSocketError(const SocketClient::SharedPtr&, SocketClient::Error error)
     {
         ::warning() << "Socket error" << error << errno << Rct::strerror();
         mError(shared_from_this());
+        abortRequests();
         mDisconnected(shared_from_this());
     }
     void checkData();
+    bool sendTagged(const Message &message, uint8_t tag, uint32_t requestId);
+    void onResponse(const std::shared_ptr<Message> &message);
+    void abortRequests();
 
     SocketClient::SharedPtr mSocketClient;
     Buffers mBuffers;
+    std::vector<Buffers::Chunk> mChunks;
     int mPendingRead, mPendingWrite, mTimeoutTimer, mCheckTimer, mFinishStatus, mVersion;
 
     bool mSilent, mIsConnected, mWarned;
 
+    struct Request
+    {
+        ResponseCallback onResponse;
+        FinishedCallback onFinished;
+    };
+    Hash<uint32_t, Request> mRequests;
+    uint32_t mNextRequestId;
+
     Signal<std::function<void(std::shared_ptr<Message>, std::shared_ptr<Connection>)> > mNewMessage;
     Signal<std::function<void(std::shared_ptr<Connection>)> > mConnected, mDisconnected, mError, mSendFinished;
     Signal<std::function<void(std::shared_ptr<Connection>, int)> > mFinished;
@@ -108,9 +154,9 @@ bool Connection::write(const char *format, ...)
         return isConnected();
     va_list args;
     va_start(args, format);
-    const String ret = String::format<StaticBufSize>(format, args);
+    String ret = String::format<StaticBufSize>(format, args);
     va_end(args);
-    return send(ResponseMessage(ret));
+    return send(ResponseMessage(std::move(ret)));
 }
 
 template <int StaticBufSize>
@@ -119,9 +165,9 @@ void Connection::finish(const char *format, ...)
     if (!mSilent) {
         va_list args;
         va_start(args, format);
-        const String ret = String::format<StaticBufSize>(format, args);
+        String ret = String::format<StaticBufSize>(format, args);
         va_end(args);
-        send(ResponseMessage(ret));
+        send(ResponseMessage(std::move(ret)));
     }
     send(FinishMessage(0));
 }
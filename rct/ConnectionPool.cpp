@@ -0,0 +1,268 @@
+#include "ConnectionPool.h"
+
+#include "EventLoop.h"
+#include "Rct.h"
+
+enum {
+    DefaultMaxConnections = 8,
+    DefaultMaxIdle = 4,
+    DefaultIdleTimeout = 30 * 1000
+};
+
+ConnectionPool::ConnectionPool(int version)
+    : mVersion(version), mMaxConnections(DefaultMaxConnections), mMaxIdle(DefaultMaxIdle),
+      mIdleTimeout(DefaultIdleTimeout), mIdleTimer(0)
+{
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    if (mIdleTimer) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+            loop->unregisterTimer(mIdleTimer);
+    }
+    for (auto &connecting : mConnecting) {
+        connecting.second.connection->connected().disconnect(connecting.second.connectedKey);
+        connecting.second.connection->disconnected().disconnect(connecting.second.disconnectedKey);
+    }
+    clear();
+}
+
+void ConnectionPool::acquireUnix(const Path &socketFile, Callback &&callback, int timeout)
+{
+    const String key = "unix:" + socketFile;
+    Endpoint &endpoint = mEndpoints[key];
+    endpoint.path = socketFile;
+    acquire(key, endpoint, std::move(callback), timeout);
+}
+
+void ConnectionPool::acquireTcp(const String &host, uint16_t port, Callback &&callback, int timeout)
+{
+    const String key = String::format<128>("tcp:%s:%u", host.constData(), port);
+    Endpoint &endpoint = mEndpoints[key];
+    endpoint.host = host;
+    endpoint.port = port;
+    acquire(key, endpoint, std::move(callback), timeout);
+}
+
+void ConnectionPool::acquire(const String &key, Endpoint &endpoint, Callback &&callback, int timeout)
+{
+    Waiter waiter = { std::move(callback), timeout };
+    endpoint.waiters.push_back(std::move(waiter));
+    serve(key);
+}
+
+void ConnectionPool::serve(const String &key)
+{
+    // callbacks may acquire and release, the endpoint stays put in the hash
+    Endpoint &endpoint = mEndpoints[key];
+    while (!endpoint.waiters.empty()) {
+        if (!endpoint.idle.empty()) {
+            // the most recently used one is the least likely to have been
+            // closed by the peer
+            Idle idle = endpoint.idle.back();
+            endpoint.idle.pop_back();
+            forget(idle);
+            Waiter waiter = std::move(endpoint.waiters.front());
+            endpoint.waiters.pop_front();
+            ++endpoint.pending;
+            mActive[idle.connection.get()] = key;
+            waiter.callback(idle.connection);
+        } else if (!mMaxConnections || endpoint.pending < mMaxConnections) {
+            Waiter waiter = std::move(endpoint.waiters.front());
+            endpoint.waiters.pop_front();
+            open(key, endpoint, std::move(waiter));
+        } else {
+            break;
+        }
+    }
+}
+
+void ConnectionPool::open(const String &key, Endpoint &endpoint, Waiter &&waiter)
+{
+    ++endpoint.pending;
+    const std::shared_ptr<Connection> connection = Connection::create(mVersion);
+    Connection *raw = connection.get();
+    WeakPtr weak = shared_from_this();
+
+    Connecting &connecting = mConnecting[raw];
+    connecting.connection = connection;
+    connecting.callback = std::move(waiter.callback);
+    connecting.connectedKey = connection->connected().connect([weak, key, raw](const std::shared_ptr<Connection> &) {
+            if (SharedPtr pool = weak.lock())
+                pool->opened(key, raw);
+        });
+    connecting.disconnectedKey = connection->disconnected().connect([weak, key, raw](const std::shared_ptr<Connection> &) {
+            if (SharedPtr pool = weak.lock())
+                pool->failed(key, raw);
+        });
+
+    const bool ok = endpoint.path.isEmpty()
+        ? connection->connectTcp(endpoint.host, endpoint.port, waiter.timeout)
+        : connection->connectUnix(endpoint.path, waiter.timeout);
+    if (!ok)
+        failed(key, raw);
+}
+
+void ConnectionPool::opened(const String &key, Connection *connection)
+{
+    auto it = mConnecting.find(connection);
+    if (it == mConnecting.end())
+        return;
+    Connecting connecting = std::move(it->second);
+    mConnecting.erase(it);
+    connecting.connection->connected().disconnect(connecting.connectedKey);
+    connecting.connection->disconnected().disconnect(connecting.disconnectedKey);
+    mActive[connection] = key;
+    connecting.callback(connecting.connection);
+}
+
+void ConnectionPool::failed(const String &key, Connection *connection)
+{
+    auto it = mConnecting.find(connection);
+    if (it == mConnecting.end())
+        return;
+    Connecting connecting = std::move(it->second);
+    mConnecting.erase(it);
+    connecting.connection->connected().disconnect(connecting.connectedKey);
+    connecting.connection->disconnected().disconnect(connecting.disconnectedKey);
+    --mEndpoints[key].pending;
+    connecting.callback(std::shared_ptr<Connection>());
+    // we're likely in one of its emissions, keep it alive until that's done
+    if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+        std::shared_ptr<Connection> doomed = connecting.connection;
+        loop->callLater([doomed]() {});
+    }
+    serve(key);
+}
+
+void ConnectionPool::release(const std::shared_ptr<Connection> &connection)
+{
+    auto it = mActive.find(connection.get());
+    if (it == mActive.end())
+        return;
+    const String key = it->second;
+    mActive.erase(it);
+    Endpoint &endpoint = mEndpoints[key];
+    --endpoint.pending;
+
+    const bool reuse = (connection->client() && connection->isConnected()
+                        && !connection->pendingRequests() && !connection->pendingWrite()
+                        && (!mMaxIdle || endpoint.idle.size() < mMaxIdle));
+    if (reuse) {
+        Idle idle;
+        idle.connection = connection;
+        idle.since = Rct::monoCoarseMs();
+        // anything happening on an idle connection makes it unusable, it
+        // goes once the signal is done with it
+        WeakPtr weak = shared_from_this();
+        Connection *raw = connection.get();
+        auto dropLater = [weak, key, raw]() {
+            if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+                loop->callLater([weak, key, raw]() {
+                        if (SharedPtr pool = weak.lock())
+                            pool->drop(key, raw);
+                    });
+            }
+        };
+        idle.disconnectedKey = connection->disconnected().connect([dropLater](const std::shared_ptr<Connection> &) { dropLater(); });
+        idle.messageKey = connection->newMessage().connect([dropLater](const std::shared_ptr<Message> &, const std::shared_ptr<Connection> &) { dropLater(); });
+        endpoint.idle.push_back(idle);
+
+        if (!mIdleTimer && mIdleTimeout > 0) {
+            if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+                mIdleTimer = loop->registerTimer([weak](int) {
+                        if (SharedPtr pool = weak.lock())
+                            pool->evict();
+                    }, mIdleTimeout);
+            }
+        }
+    } else if (connection->client()) {
+        connection->close();
+    }
+    serve(key);
+}
+
+void ConnectionPool::drop(const String &key, Connection *connection)
+{
+    std::vector<Idle> &idle = mEndpoints[key].idle;
+    for (auto it = idle.begin(); it != idle.end(); ++it) {
+        if (it->connection.get() == connection) {
+            forget(*it);
+            if (it->connection->client())
+                it->connection->close();
+            idle.erase(it);
+            break;
+        }
+    }
+}
+
+void ConnectionPool::forget(Idle &idle)
+{
+    idle.connection->disconnected().disconnect(idle.disconnectedKey);
+    idle.connection->newMessage().disconnect(idle.messageKey);
+}
+
+void ConnectionPool::setIdleTimeout(int ms)
+{
+    mIdleTimeout = ms;
+    if (mIdleTimer) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+            loop->unregisterTimer(mIdleTimer);
+        mIdleTimer = 0;
+    }
+    if (mIdleTimeout > 0 && idleCount()) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+            WeakPtr weak = shared_from_this();
+            mIdleTimer = loop->registerTimer([weak](int) {
+                    if (SharedPtr pool = weak.lock())
+                        pool->evict();
+                }, mIdleTimeout);
+        }
+    }
+}
+
+void ConnectionPool::evict()
+{
+    const uint64_t now = Rct::monoCoarseMs();
+    bool remaining = false;
+    for (auto &endpoint : mEndpoints) {
+        std::vector<Idle> &idle = endpoint.second.idle;
+        for (auto it = idle.begin(); it != idle.end(); ) {
+            if (it->since + mIdleTimeout <= now) {
+                forget(*it);
+                if (it->connection->client())
+                    it->connection->close();
+                it = idle.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        remaining = remaining || !idle.empty();
+    }
+    if (!remaining && mIdleTimer) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+            loop->unregisterTimer(mIdleTimer);
+        mIdleTimer = 0;
+    }
+}
+
+size_t ConnectionPool::idleCount() const
+{
+    size_t count = 0;
+    for (const auto &endpoint : mEndpoints)
+        count += endpoint.second.idle.size();
+    return count;
+}
+
+void ConnectionPool::clear()
+{
+    for (auto &endpoint : mEndpoints) {
+        for (Idle &idle : endpoint.second.idle) {
+            forget(idle);
+            if (idle.connection->client())
+                idle.connection->close();
+        }
+        endpoint.second.idle.clear();
+    }
+}
@@ -0,0 +1,114 @@
+#ifndef CONNECTIONPOOL_H
+#define CONNECTIONPOOL_H
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <rct/Connection.h>
+#include <rct/Hash.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+
+// Keeps outbound Connections open once they're released and hands them
+// out again for the same endpoint, so short request round trips don't pay
+// for a connect each time. Idle connections that disconnect or receive
+// anything are dropped, those idle for longer than idleTimeout() are
+// closed. A pool belongs to the loop of the thread that created it.
+class ConnectionPool : public std::enable_shared_from_this<ConnectionPool>
+{
+public:
+    typedef std::shared_ptr<ConnectionPool> SharedPtr;
+    typedef std::weak_ptr<ConnectionPool> WeakPtr;
+
+    static SharedPtr create(int version = 0)
+    {
+        return SharedPtr(new ConnectionPool(version));
+    }
+    ~ConnectionPool();
+
+    // Calls callback with a connected Connection for the endpoint, an idle
+    // one if there is one, or a null one if connecting failed. When
+    // maxConnections() are out for the endpoint it waits for a release().
+    // timeout is passed to Connection::connectUnix()/connectTcp().
+    typedef std::function<void(const std::shared_ptr<Connection> &)> Callback;
+    void acquireUnix(const Path &socketFile, Callback &&callback, int timeout = 0);
+    void acquireTcp(const String &host, uint16_t port, Callback &&callback, int timeout = 0);
+    // Gives an acquired connection back. It's closed instead of kept if
+    // it's disconnected, has requests or writes pending, or the endpoint
+    // already has maxIdle() idle ones.
+    void release(const std::shared_ptr<Connection> &connection);
+
+    // per endpoint, 0 means no limit
+    void setMaxConnections(size_t max) { mMaxConnections = max; }
+    size_t maxConnections() const { return mMaxConnections; }
+    void setMaxIdle(size_t max) { mMaxIdle = max; }
+    size_t maxIdle() const { return mMaxIdle; }
+    // idle connections are closed between one and two timeouts after
+    // they're released, 0 keeps them
+    void setIdleTimeout(int ms);
+    int idleTimeout() const { return mIdleTimeout; }
+
+    size_t idleCount() const;
+    size_t activeCount() const { return mActive.size(); }
+    // closes the idle connections
+    void clear();
+
+private:
+    ConnectionPool(int version);
+
+    struct Idle
+    {
+        std::shared_ptr<Connection> connection;
+        uint64_t since;
+        unsigned int disconnectedKey, messageKey;
+    };
+    struct Waiter
+    {
+        Callback callback;
+        int timeout;
+    };
+    struct Connecting
+    {
+        std::shared_ptr<Connection> connection;
+        Callback callback;
+        unsigned int connectedKey, disconnectedKey;
+    };
+    struct Endpoint
+    {
+        Endpoint()
+            : port(0), pending(0)
+        {}
+
+        Path path;
+        String host;
+        uint16_t port;
+        std::vector<Idle> idle;
+        // handed out or connecting
+        size_t pending;
+        std::deque<Waiter> waiters;
+    };
+
+    void acquire(const String &key, Endpoint &endpoint, Callback &&callback, int timeout);
+    void serve(const String &key);
+    void open(const String &key, Endpoint &endpoint, Waiter &&waiter);
+    void opened(const String &key, Connection *connection);
+    void failed(const String &key, Connection *connection);
+    void drop(const String &key, Connection *connection);
+    void evict();
+    static void forget(Idle &idle);
+
+    const int mVersion;
+    size_t mMaxConnections, mMaxIdle;
+    int mIdleTimeout, mIdleTimer;
+    Hash<String, Endpoint> mEndpoints;
+    // the endpoint of each connection that's out
+    Hash<Connection*, String> mActive;
+    Hash<Connection*, Connecting> mConnecting;
+
+    ConnectionPool(const ConnectionPool &) = delete;
+    ConnectionPool &operator=(const ConnectionPool &) = delete;
+};
+
+#endif
@@ -0,0 +1,411 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+// Coroutines on top of EventLoop, SocketClient and Connection. rct itself
+// is built as C++11, this header is only available to code compiled with
+// coroutine support (C++20). The awaitables resume the coroutine directly
+// from the timer or socket callback that completes them, there's no
+// posted event in between.
+//
+//     Task<> echo(SocketClient::SharedPtr client)
+//     {
+//         SocketReader reader(client);
+//         for (;;) {
+//             Buffer data = co_await reader.read();
+//             if (data.isEmpty())
+//                 co_return;
+//             co_await Delay(10);
+//             if (!co_await WriteAll(client, data.data(), data.size()))
+//                 co_return;
+//         }
+//     }
+//
+//     echo(client).start();
+//
+// A suspended coroutine must not be destroyed, the callback it is waiting
+// on still refers to it.
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <string.h>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
+
+#include <rct/Buffer.h>
+#include <rct/Connection.h>
+#include <rct/EventLoop.h>
+#include <rct/Message.h>
+#include <rct/SocketClient.h>
+#include <rct/String.h>
+#include <rct/Timer.h>
+
+template<typename T> class Task;
+
+class TaskPromiseBase
+{
+public:
+    struct FinalAwaiter
+    {
+        bool await_ready() const noexcept { return false; }
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            TaskPromiseBase &promise = handle.promise();
+            if (promise.mContinuation)
+                return promise.mContinuation;
+            if (promise.mDetached)
+                handle.destroy();
+            return std::noop_coroutine();
+        }
+        void await_resume() const noexcept { }
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception()
+    {
+        // nobody is left to see it
+        if (mDetached)
+            std::terminate();
+        mException = std::current_exception();
+    }
+
+protected:
+    void rethrow()
+    {
+        if (mException)
+            std::rethrow_exception(mException);
+    }
+
+private:
+    std::coroutine_handle<> mContinuation;
+    std::exception_ptr mException;
+    bool mDetached = false;
+
+    template<typename T> friend class Task;
+};
+
+template<typename T>
+class TaskPromise : public TaskPromiseBase
+{
+public:
+    template<typename U>
+    void return_value(U &&value) { mValue.emplace(std::forward<U>(value)); }
+    T result()
+    {
+        rethrow();
+        return std::move(*mValue);
+    }
+
+private:
+    std::optional<T> mValue;
+};
+
+template<>
+class TaskPromise<void> : public TaskPromiseBase
+{
+public:
+    void return_void() const { }
+    void result() { rethrow(); }
+};
+
+// Lazily started coroutine. Awaiting a task runs it and resumes the
+// awaiting coroutine when it's done, start() runs it on its own and
+// frees it when it finishes.
+template<typename T = void>
+class Task
+{
+public:
+    class promise_type : public TaskPromise<T>
+    {
+    public:
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    Task(Task &&other) noexcept
+        : mHandle(std::exchange(other.mHandle, {}))
+    {
+    }
+    Task &operator=(Task &&other) noexcept
+    {
+        if (this != &other) {
+            if (mHandle)
+                mHandle.destroy();
+            mHandle = std::exchange(other.mHandle, {});
+        }
+        return *this;
+    }
+    ~Task()
+    {
+        if (mHandle)
+            mHandle.destroy();
+    }
+
+    bool isDone() const { return !mHandle || mHandle.done(); }
+
+    void start()
+    {
+        std::coroutine_handle<promise_type> handle = std::exchange(mHandle, {});
+        handle.promise().mDetached = true;
+        handle.resume();
+    }
+
+    bool await_ready() const noexcept { return isDone(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        mHandle.promise().mContinuation = awaiting;
+        return mHandle;
+    }
+    T await_resume() { return mHandle.promise().result(); }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : mHandle(handle)
+    {
+    }
+
+    std::coroutine_handle<promise_type> mHandle;
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+};
+
+// Resumes after timeout ms, or microseconds with fromUs(), from the timer
+// callback of the current thread's loop or the given one
+class Delay
+{
+public:
+    Delay(int timeout, const EventLoop::SharedPtr &loop = EventLoop::SharedPtr())
+        : mTimeoutUs(timeout > 0 ? timeout * 1000ULL : 0), mLoop(loop)
+    {
+    }
+    static Delay fromUs(uint64_t timeout, const EventLoop::SharedPtr &loop = EventLoop::SharedPtr())
+    {
+        Delay delay(0, loop);
+        delay.mTimeoutUs = timeout;
+        return delay;
+    }
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        EventLoop::SharedPtr loop = mLoop ? mLoop : EventLoop::eventLoop();
+        if (!loop)
+            return false;
+        loop->registerTimerUs([handle](int) { handle.resume(); }, mTimeoutUs, Timer::SingleShot);
+        return true;
+    }
+    void await_resume() const noexcept { }
+
+private:
+    uint64_t mTimeoutUs;
+    EventLoop::SharedPtr mLoop;
+};
+
+// Queues what the client reads so nothing is lost while the coroutine
+// waits on something else. read() resumes with everything read since the
+// last read(), or an empty buffer once the peer has disconnected.
+class SocketReader
+{
+public:
+    SocketReader(const SocketClient::SharedPtr &client)
+        : mClient(client), mDisconnected(!client->isConnected())
+    {
+        mReadKey = mClient->readyRead().connect([this](const SocketClient::SharedPtr &, Buffer &&buffer) {
+                if (!mBuffer.capacity()) {
+                    mBuffer = std::move(buffer);
+                } else {
+                    const size_t size = mBuffer.size();
+                    mBuffer.reserve(size + buffer.size());
+                    memcpy(mBuffer.end(), buffer.data(), buffer.size());
+                    mBuffer.resize(size + buffer.size());
+                }
+                wake();
+            });
+        mDisconnectedKey = mClient->disconnected().connect([this](const SocketClient::SharedPtr &) {
+                mDisconnected = true;
+                wake();
+            });
+    }
+    ~SocketReader()
+    {
+        mClient->readyRead().disconnect(mReadKey);
+        mClient->disconnected().disconnect(mDisconnectedKey);
+    }
+
+    class Read
+    {
+    public:
+        bool await_ready() const { return !mReader->mBuffer.isEmpty() || mReader->mDisconnected; }
+        void await_suspend(std::coroutine_handle<> handle) { mReader->mWaiting = handle; }
+        Buffer await_resume() { return std::move(mReader->mBuffer); }
+
+    private:
+        explicit Read(SocketReader *reader)
+            : mReader(reader)
+        {
+        }
+
+        SocketReader *mReader;
+
+        friend class SocketReader;
+    };
+    Read read() { return Read(this); }
+
+    const SocketClient::SharedPtr &client() const { return mClient; }
+
+private:
+    void wake()
+    {
+        if (mWaiting)
+            std::exchange(mWaiting, {}).resume();
+    }
+
+    SocketClient::SharedPtr mClient;
+    unsigned int mReadKey, mDisconnectedKey;
+    Buffer mBuffer;
+    bool mDisconnected;
+    std::coroutine_handle<> mWaiting;
+
+    SocketReader(const SocketReader &) = delete;
+    SocketReader &operator=(const SocketReader &) = delete;
+};
+
+// Writes the data and resumes once all of it, and everything queued
+// before it, has been written to the socket. false if the write failed
+// or the peer disconnected first
+class WriteAll
+{
+public:
+    WriteAll(const SocketClient::SharedPtr &client, const void *data, unsigned int size)
+        : mClient(client), mData(data), mSize(size), mRemaining(0),
+          mWrittenKey(0), mDisconnectedKey(0), mSuspended(false), mDone(false), mResult(false)
+    {
+    }
+    WriteAll(const SocketClient::SharedPtr &client, const String &data)
+        : WriteAll(client, data.constData(), data.size())
+    {
+    }
+
+    bool await_ready() const { return !mSize; }
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        mHandle = handle;
+        mRemaining = mClient->pendingWrite() + mSize;
+        mWrittenKey = mClient->bytesWritten().connect([this](const SocketClient::SharedPtr &, int bytes) {
+                if (static_cast<size_t>(bytes) < mRemaining) {
+                    mRemaining -= bytes;
+                } else {
+                    finish(true);
+                }
+            });
+        mDisconnectedKey = mClient->disconnected().connect([this](const SocketClient::SharedPtr &) { finish(false); });
+        // synchronous writes and writes that fit in the socket buffer
+        // are done by the time write() returns
+        const bool ok = mClient->write(mData, mSize);
+        if (!ok)
+            finish(false);
+        if (mDone)
+            return false;
+        mSuspended = true;
+        return true;
+    }
+    bool await_resume() const { return mSize ? mResult : mClient->isConnected(); }
+
+private:
+    void finish(bool result)
+    {
+        if (mDone)
+            return;
+        mDone = true;
+        mResult = result;
+        mClient->bytesWritten().disconnect(mWrittenKey);
+        mClient->disconnected().disconnect(mDisconnectedKey);
+        if (mSuspended)
+            mHandle.resume();
+    }
+
+    SocketClient::SharedPtr mClient;
+    const void *mData;
+    unsigned int mSize;
+    size_t mRemaining;
+    std::coroutine_handle<> mHandle;
+    unsigned int mWrittenKey, mDisconnectedKey;
+    bool mSuspended, mDone, mResult;
+};
+
+// Queues the messages received on a connection. next() resumes with the
+// oldest one, or null once the connection is gone and the queue is empty.
+class MessageReader
+{
+public:
+    MessageReader(const std::shared_ptr<Connection> &connection)
+        : mConnection(connection), mDisconnected(connection->client() && !connection->isConnected())
+    {
+        mMessageKey = mConnection->newMessage().connect([this](std::shared_ptr<Message> message, std::shared_ptr<Connection>) {
+                mMessages.push_back(std::move(message));
+                wake();
+            });
+        mDisconnectedKey = mConnection->disconnected().connect([this](std::shared_ptr<Connection>) {
+                mDisconnected = true;
+                wake();
+            });
+    }
+    ~MessageReader()
+    {
+        mConnection->newMessage().disconnect(mMessageKey);
+        mConnection->disconnected().disconnect(mDisconnectedKey);
+    }
+
+    class Next
+    {
+    public:
+        bool await_ready() const { return !mReader->mMessages.empty() || mReader->mDisconnected; }
+        void await_suspend(std::coroutine_handle<> handle) { mReader->mWaiting = handle; }
+        std::shared_ptr<Message> await_resume()
+        {
+            if (mReader->mMessages.empty())
+                return std::shared_ptr<Message>();
+            std::shared_ptr<Message> message = std::move(mReader->mMessages.front());
+            mReader->mMessages.pop_front();
+            return message;
+        }
+
+    private:
+        explicit Next(MessageReader *reader)
+            : mReader(reader)
+        {
+        }
+
+        MessageReader *mReader;
+
+        friend class MessageReader;
+    };
+    Next next() { return Next(this); }
+
+    const std::shared_ptr<Connection> &connection() const { return mConnection; }
+
+private:
+    void wake()
+    {
+        if (mWaiting)
+            std::exchange(mWaiting, {}).resume();
+    }
+
+    std::shared_ptr<Connection> mConnection;
+    unsigned int mMessageKey, mDisconnectedKey;
+    std::deque<std::shared_ptr<Message> > mMessages;
+    bool mDisconnected;
+    std::coroutine_handle<> mWaiting;
+
+    MessageReader(const MessageReader &) = delete;
+    MessageReader &operator=(const MessageReader &) = delete;
+};
+
+#endif
+
+#endif
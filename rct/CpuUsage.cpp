@@ -1,9 +1,13 @@
 #include "CpuUsage.h"
 
 #include <assert.h>
+#include <time.h>
 #include <mutex>
 #include <thread>
 #include <unistd.h>
+#ifdef OS_Linux
+#include <sys/syscall.h>
+#endif
 #ifdef OS_Darwin
 #include <mach/mach.h>
 #include <mach/mach_host.h>
@@ -19,6 +23,21 @@
 
 #define SLEEP_TIME 1000000 // one second
 
+struct ThreadData
+{
+    pthread_t thread;
+    String name;
+    uint64_t id;
+#if defined(OS_Darwin)
+    mach_port_t port;
+#elif defined(_POSIX_THREAD_CPUTIME)
+    clockid_t clock;
+#endif
+    // CPU ns and monoMs() of the last sample
+    uint64_t time, sampled;
+    float usage;
+};
+
 struct CpuData
 {
     std::mutex mutex;
@@ -33,11 +52,73 @@ struct CpuData
     float hz;
     uint32_t cores;
 #endif
+
+    // registered threads, each removes itself when it exits
+    List<ThreadData> threads;
 };
 
-static CpuData sData;
+// never destroyed, threads may unregister after static destructors ran
+static CpuData &sData = *new CpuData;
 static std::once_flag sFlag;
 
+static uint64_t threadCpuTime(const ThreadData &data)
+{
+#if defined(OS_Darwin)
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+    if (thread_info(data.port, THREAD_BASIC_INFO, reinterpret_cast<thread_info_t>(&info), &count) != KERN_SUCCESS)
+        return 0;
+    return (static_cast<uint64_t>(info.user_time.seconds + info.system_time.seconds) * 1000000000ULL
+            + static_cast<uint64_t>(info.user_time.microseconds + info.system_time.microseconds) * 1000);
+#elif defined(_POSIX_THREAD_CPUTIME)
+    struct timespec ts;
+    if (clock_gettime(data.clock, &ts))
+        return 0;
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+#else
+    (void)data;
+    return 0;
+#endif
+}
+
+static void sampleThreads(uint64_t now)
+{
+    for (ThreadData &data : sData.threads) {
+        const uint64_t time = threadCpuTime(data);
+        if (now > data.sampled) {
+            data.usage = time >= data.time ? (time - data.time) / 1000000.0 / (now - data.sampled) : 0;
+            data.time = time;
+            data.sampled = now;
+        }
+    }
+}
+
+static void unregisterThread(pthread_t thread)
+{
+    std::lock_guard<std::mutex> locker(sData.mutex);
+    for (size_t i = 0; i < sData.threads.size(); ++i) {
+        if (pthread_equal(sData.threads[i].thread, thread)) {
+            sData.threads.removeAt(i);
+            break;
+        }
+    }
+}
+
+// unregisters the thread when it exits, even if it's cancelled
+struct ThreadRegistration
+{
+    ThreadRegistration()
+        : registered(false)
+    {}
+    ~ThreadRegistration()
+    {
+        if (registered)
+            unregisterThread(pthread_self());
+    }
+    bool registered;
+};
+static thread_local ThreadRegistration tRegistration;
+
 static int64_t currentUsage()
 {
 #if defined(OS_Linux)
@@ -114,35 +195,37 @@ static void collectData()
 {
     for (;;) {
         const int64_t usage = currentUsage();
-        if (usage == -1)
-            break;
         const uint64_t time = Rct::monoMs();
 
         {
             std::lock_guard<std::mutex> locker(sData.mutex);
-            assert(sData.lastTime < time);
-            if (sData.lastTime > 0) {
-                // did we wrap? if so, make load be 1 for now
-                if (sData.lastUsage > usage) {
-                    sData.usage = 0;
-                } else {
+            sampleThreads(time);
+            // threads are sampled even where the process can't be
+            if (usage != -1) {
+                assert(sData.lastTime < time);
+                if (sData.lastTime > 0) {
+                    // did we wrap? if so, make load be 1 for now
+                    if (sData.lastUsage > usage) {
+                        sData.usage = 0;
+                    } else {
 #if defined(OS_Linux) || defined(OS_Darwin) || defined(OS_FreeBSD)
-                    const uint32_t deltaUsage = usage - sData.lastUsage;
-                    const uint64_t deltaTime = time - sData.lastTime;
-                    const float timeRatio = deltaTime / (SLEEP_TIME / 1000);
-                    sData.usage = (deltaUsage / sData.hz / sData.cores) / timeRatio;
+                        const uint32_t deltaUsage = usage - sData.lastUsage;
+                        const uint64_t deltaTime = time - sData.lastTime;
+                        const float timeRatio = deltaTime / (SLEEP_TIME / 1000);
+                        sData.usage = (deltaUsage / sData.hz / sData.cores) / timeRatio;
 #endif
+                    }
                 }
+                sData.lastUsage = usage;
+                sData.lastTime = time;
             }
-            sData.lastUsage = usage;
-            sData.lastTime = time;
         }
 
         usleep(SLEEP_TIME);
     }
 }
 
-float CpuUsage::usage()
+static void init()
 {
     std::call_once(sFlag, []() {
             std::lock_guard<std::mutex> locker(sData.mutex);
@@ -155,7 +238,92 @@ float CpuUsage::usage()
 #endif
             sData.thread = std::thread(collectData);
         });
+}
 
+float CpuUsage::usage()
+{
+    init();
     std::lock_guard<std::mutex> locker(sData.mutex);
     return 1. - sData.usage;
 }
+
+void CpuUsage::registerThread(const String &name)
+{
+    const pthread_t self = pthread_self();
+    if (tRegistration.registered) {
+        setThreadName(self, name);
+        return;
+    }
+    ThreadData data;
+    data.thread = self;
+    data.name = name;
+#if defined(OS_Linux)
+    data.id = syscall(SYS_gettid);
+#elif defined(OS_Darwin)
+    pthread_threadid_np(0, &data.id);
+#else
+    data.id = 0;
+#endif
+#if defined(OS_Darwin)
+    data.port = pthread_mach_thread_np(self);
+#elif defined(_POSIX_THREAD_CPUTIME)
+    if (pthread_getcpuclockid(self, &data.clock))
+        data.clock = CLOCK_THREAD_CPUTIME_ID;
+#endif
+    data.time = threadCpuTime(data);
+    data.sampled = Rct::monoMs();
+    data.usage = -1;
+    tRegistration.registered = true;
+    std::lock_guard<std::mutex> locker(sData.mutex);
+    sData.threads.append(data);
+}
+
+void CpuUsage::setThreadName(pthread_t thread, const String &name)
+{
+    std::lock_guard<std::mutex> locker(sData.mutex);
+    for (ThreadData &data : sData.threads) {
+        if (pthread_equal(data.thread, thread)) {
+            data.name = name;
+            break;
+        }
+    }
+}
+
+List<CpuUsage::ThreadUsage> CpuUsage::threadUsage()
+{
+    init();
+    List<ThreadUsage> ret;
+    std::lock_guard<std::mutex> locker(sData.mutex);
+    ret.reserve(sData.threads.size());
+    for (const ThreadData &data : sData.threads) {
+        const ThreadUsage usage = { data.name, data.id, threadCpuTime(data), data.usage };
+        ret.append(usage);
+    }
+    return ret;
+}
+
+Map<String, float> CpuUsage::usageByName()
+{
+    Map<String, float> ret;
+    for (const ThreadUsage &usage : threadUsage()) {
+        if (usage.usage >= 0)
+            ret[usage.name] += usage.usage;
+    }
+    return ret;
+}
+
+uint64_t CpuUsage::threadTime()
+{
+#if defined(OS_Darwin)
+    ThreadData data;
+    data.port = pthread_mach_thread_np(pthread_self());
+    return threadCpuTime(data);
+#elif defined(_POSIX_THREAD_CPUTIME)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return 0;
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
@@ -2,14 +2,52 @@
 #define CPUUSAGE_H
 
 #include <cstdint>
+#include <pthread.h>
+
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/String.h>
 
 // CPU usage over the last couple of seconds, range from 0 (idle) to 1 (100%)
+//
+// Registered threads are sampled along with the process so it's possible
+// to tell which of them are busy. Every Thread registers under its name(),
+// the threads of a ThreadPool share the pool's name. Other threads can
+// register themselves:
+//
+//     CpuUsage::registerThread("main");
+//     ...
+//     for (const auto &it : CpuUsage::usageByName())
+//         error() << it.first << it.second;
 
 class CpuUsage
 {
 public:
     static float usage();
 
+    // Tags the calling thread with name until it exits. Registering again
+    // renames it.
+    static void registerThread(const String &name);
+    static void setThreadName(pthread_t thread, const String &name);
+
+    struct ThreadUsage
+    {
+        String name;
+        // the kernel's id for the thread, what top -H shows on Linux
+        uint64_t id;
+        // ns of CPU the thread has used
+        uint64_t time;
+        // CPU used over the last sample, 1 is a core all the time, -1
+        // until it's been sampled
+        float usage;
+    };
+    static List<ThreadUsage> threadUsage();
+    // usage of the threads added up by name, so pools show as one
+    static Map<String, float> usageByName();
+
+    // ns of CPU the calling thread has used, 0 if that can't be told
+    static uint64_t threadTime();
+
 private:
     CpuUsage() = delete;
     CpuUsage(const CpuUsage&) = delete;
@@ -1,8 +1,13 @@
 #ifndef DataFile_h
 #define DataFile_h
 
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "DataFileWriter.h"
 #include "Path.h"
 #include "Serializer.h"
 
@@ -10,13 +15,16 @@ class DataFile
 {
 public:
     DataFile(const Path &path, int version)
-        : mFile(0), mSizeOffset(-1), mSerializer(0), mDeserializer(0), mPath(path), mVersion(version)
+        : mFile(0), mSizeOffset(-1), mSerializer(0), mDeserializer(0), mMapped(0), mMappedSize(0),
+          mPath(path), mVersion(version)
     {}
 
     ~DataFile()
     {
         delete mDeserializer;
-        if (mFile)
+        if (mMapped)
+            munmap(mMapped, mMappedSize);
+        if (mSerializer)
             flush();
     }
 
@@ -24,17 +32,35 @@ public:
 
     bool flush()
     {
-        if (!mFile)
+        if (!mSerializer)
             return false;
+        if (!mFile) {
+            // Async, the size goes where the placeholder is
+            delete mSerializer;
+            mSerializer = 0;
+            const int size = static_cast<int>(mContents.size());
+            memcpy(mContents.data() + mSizeOffset, &size, sizeof(size));
+            DataFileWriter::instance()->save(mPath, std::move(mContents), std::move(mCallback));
+            mContents.clear();
+            return true;
+        }
+        mSerializer->flush();
         const int size = ftell(mFile);
         assert(mSizeOffset != -1);
         fseek(mFile, mSizeOffset, SEEK_SET);
+        mSerializer->setCompact(false);
         operator<<(size);
 
-        fclose(mFile);
-        mFile = 0;
+        const bool ok = mSerializer->flush();
         delete mSerializer;
         mSerializer = 0;
+        fclose(mFile);
+        mFile = 0;
+        if (!ok) {
+            Path::rm(mTempFilePath);
+            mError = String::format<128>("write error: %d %s", errno, Rct::strerror().constData());
+            return false;
+        }
         if (rename(mTempFilePath.constData(), mPath.constData())) {
             Path::rm(mTempFilePath);
             mError = String::format<128>("rename error: %d %s", errno, Rct::strerror().constData());
@@ -45,12 +71,28 @@ public:
 
     enum Mode {
         Read,
-        Write
+        Write,
+        // Read without reading the file in, pages are loaded as they're
+        // deserialized and can be dropped again under memory pressure.
+        // The file must not be changed in place while it's open, flush()
+        // replaces it with a new one so that's safe.
+        Map,
+        // Write into memory, flush() hands the contents to
+        // DataFileWriter, which writes, syncs and renames them on its
+        // own thread. Failures are only reported to the callback.
+        Async
+    };
+    // how a Map file is going to be read, passed on to the kernel
+    enum Access {
+        Sequential,
+        Random
     };
     String error() const { return mError; }
-    bool open(Mode mode)
+    // called with the outcome of an Async flush(), see DataFileWriter::save()
+    void setCallback(DataFileWriter::Callback &&callback) { mCallback = std::move(callback); }
+    bool open(Mode mode, Access access = Sequential)
     {
-        assert(!mFile);
+        assert(!mFile && !mDeserializer);
         if (mode == Write) {
             if (!Path::mkdir(mPath.parentDir()))
                 return false;
@@ -68,9 +110,42 @@ public:
             }
             mSerializer = new Serializer(mFile);
             operator<<(mVersion);
-            mSizeOffset = ftell(mFile);
+            mSizeOffset = mSerializer->pos();
+            operator<<(static_cast<int>(0));
+            mSerializer->setCompact(mVersion & Serializer::CompactVersion);
+            return true;
+        } else if (mode == Async) {
+            mContents.clear();
+            mSerializer = new Serializer(mContents);
+            operator<<(mVersion);
+            mSizeOffset = mSerializer->pos();
             operator<<(static_cast<int>(0));
+            mSerializer->setCompact(mVersion & Serializer::CompactVersion);
             return true;
+        } else if (mode == Map) {
+            const int fd = ::open(mPath.constData(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                if (errno != ENOENT)
+                    mError = String::format<128>("open failure %d (%s)", errno, Rct::strerror().constData());
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) || !st.st_size) {
+                mError = "Read error " + mPath;
+                ::close(fd);
+                return false;
+            }
+            void *mapped = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (mapped == MAP_FAILED) {
+                mError = String::format<128>("mmap failure %d (%s)", errno, Rct::strerror().constData());
+                return false;
+            }
+            madvise(mapped, st.st_size, access == Random ? MADV_RANDOM : MADV_SEQUENTIAL);
+            mMapped = mapped;
+            mMappedSize = st.st_size;
+            // StringView and Span point into the mapping
+            return readHeader(static_cast<const char *>(mapped), st.st_size);
         } else {
             mContents = mPath.readAll();
             if (mContents.isEmpty()) {
@@ -78,22 +153,8 @@ public:
                     mError = "Read error " + mPath;
                 return false;
             }
-            mDeserializer = new Deserializer(mContents);
-            int version;
-            (*mDeserializer) >> version;
-            if (version != mVersion) {
-                mError = String::format<128>("Wrong database version. Expected %d, got %d for %s.",
-                                             mVersion, version, mPath.constData());
-                return false;
-            }
-            int fs;
-            (*mDeserializer) >> fs;
-            if (static_cast<size_t>(fs) != mContents.size()) {
-                mError = String::format<128>("%s seems to be corrupted. Size should have been %zu but was %d",
-                                             mPath.constData(), mContents.size(), fs);
-                return false;
-            }
-            return true;
+            // StringView and Span point into mContents
+            return readHeader(mContents.constData(), mContents.size());
         }
     }
 
@@ -110,13 +171,43 @@ public:
         return *this;
     }
 private:
+    bool readHeader(const char *data, size_t size)
+    {
+        if (size < 2 * sizeof(int)) {
+            mError = String::format<128>("%s seems to be corrupted. It's only %zu bytes", mPath.constData(), size);
+            return false;
+        }
+        mDeserializer = new Deserializer(data, size);
+        int version;
+        (*mDeserializer) >> version;
+        // files written in the other format of the same version are
+        // fine, the rest of the file is read in the one it has
+        if ((version ^ mVersion) & ~Serializer::CompactVersion) {
+            mError = String::format<128>("Wrong database version. Expected %d, got %d for %s.",
+                                         mVersion, version, mPath.constData());
+            return false;
+        }
+        int fs;
+        (*mDeserializer) >> fs;
+        if (static_cast<size_t>(fs) != size) {
+            mError = String::format<128>("%s seems to be corrupted. Size should have been %zu but was %d",
+                                         mPath.constData(), size, fs);
+            return false;
+        }
+        mDeserializer->setCompact(version & Serializer::CompactVersion);
+        return true;
+    }
+
     FILE *mFile;
     int mSizeOffset;
     Serializer *mSerializer;
     Deserializer *mDeserializer;
     Path mPath, mTempFilePath;
     String mContents;
+    void *mMapped;
+    size_t mMappedSize;
     String mError;
+    DataFileWriter::Callback mCallback;
     const int mVersion;
 };
 #endif
@@ -0,0 +1,168 @@
+#include "DataFileWriter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "EventLoop.h"
+#include "Rct.h"
+#include "Set.h"
+
+DataFileWriter::DataFileWriter()
+    : mWriting(false), mBatchDelay(0)
+{
+    mThread = std::thread(std::bind(&DataFileWriter::run, this));
+}
+
+DataFileWriter *DataFileWriter::instance()
+{
+    // saves may still be queued when the process exits, never deleted.
+    // flush() before exiting to wait for them.
+    static DataFileWriter *writer = new DataFileWriter;
+    return writer;
+}
+
+void DataFileWriter::save(const Path &path, String &&contents, Callback &&callback)
+{
+    Callback done;
+    if (callback) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+            EventLoop::WeakPtr weak = loop;
+            done = [weak, callback](const Path &p, bool ok, const String &error) {
+                if (EventLoop::SharedPtr l = weak.lock())
+                    l->callLater([callback, p, ok, error]() { callback(p, ok, error); });
+            };
+        } else {
+            done = std::move(callback);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mPending.contains(path))
+        mOrder.append(path);
+    Pending &pending = mPending[path];
+    pending.contents = std::move(contents);
+    if (done)
+        pending.callbacks.append(std::move(done));
+    mCondition.notify_one();
+}
+
+void DataFileWriter::setBatchDelay(int ms)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mBatchDelay = ms;
+}
+
+int DataFileWriter::batchDelay() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBatchDelay;
+}
+
+void DataFileWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mWriting || !mOrder.isEmpty())
+        mFlushed.wait(lock);
+}
+
+void DataFileWriter::run()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+        while (mOrder.isEmpty())
+            mCondition.wait(lock);
+        if (mBatchDelay > 0)
+            mCondition.wait_for(lock, std::chrono::milliseconds(mBatchDelay), [this]() { return false; });
+
+        List<Job> batch(mOrder.size());
+        for (size_t i = 0; i < mOrder.size(); ++i) {
+            Job &job = batch[i];
+            job.path = mOrder[i];
+            job.pending = std::move(mPending[job.path]);
+            job.fd = -1;
+        }
+        mOrder.clear();
+        mPending.clear();
+        mWriting = true;
+        lock.unlock();
+
+        write(batch);
+        for (const Job &job : batch) {
+            for (const Callback &callback : job.pending.callbacks)
+                callback(job.path, job.error.isEmpty(), job.error);
+        }
+
+        lock.lock();
+        mWriting = false;
+        if (mOrder.isEmpty())
+            mFlushed.notify_all();
+    }
+}
+
+static String failure(const char *what)
+{
+    const int error = errno;
+    return String::format<128>("%s failure %d (%s)", what, error, Rct::strerror(error).constData());
+}
+
+void DataFileWriter::write(List<Job> &batch)
+{
+    // everything goes to the page cache first so the syncs below are one
+    // stream of I/O rather than a write, a sync and a wait per file
+    for (Job &job : batch) {
+        if (!Path::mkdir(job.path.parentDir())) {
+            job.error = failure("mkdir");
+            continue;
+        }
+        job.tempFilePath = job.path + "XXXXXX";
+        job.fd = mkostemp(&job.tempFilePath[0], O_CLOEXEC);
+        if (job.fd == -1) {
+            job.error = failure("mkstemp");
+            continue;
+        }
+        const char *data = job.pending.contents.constData();
+        size_t size = job.pending.contents.size();
+        while (size) {
+            const ssize_t w = ::write(job.fd, data, size);
+            if (w == -1) {
+                if (errno == EINTR)
+                    continue;
+                job.error = failure("write");
+                break;
+            }
+            data += w;
+            size -= w;
+        }
+        job.pending.contents.clear();
+    }
+
+    Set<Path> dirs;
+    for (Job &job : batch) {
+        if (job.fd == -1)
+            continue;
+        if (job.error.isEmpty() && fdatasync(job.fd))
+            job.error = failure("fdatasync");
+        if (::close(job.fd) && job.error.isEmpty())
+            job.error = failure("close");
+        job.fd = -1;
+        if (job.error.isEmpty() && rename(job.tempFilePath.constData(), job.path.constData()))
+            job.error = failure("rename");
+        if (job.error.isEmpty()) {
+            dirs.insert(job.path.parentDir());
+        } else {
+            Path::rm(job.tempFilePath);
+        }
+    }
+
+    // and the renames
+    for (const Path &dir : dirs) {
+        const int fd = ::open(dir.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd != -1) {
+            fsync(fd);
+            ::close(fd);
+        }
+    }
+}
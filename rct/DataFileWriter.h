@@ -0,0 +1,74 @@
+#ifndef DataFileWriter_h
+#define DataFileWriter_h
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+
+// Writes whole files on a thread of its own, so saving doesn't stall the
+// event loop: each file goes to a temp file that is fdatasync'ed and
+// renamed over the old one, so readers see either the old or the new
+// contents. DataFile hands its contents here in Async mode.
+//
+// Saves of a path that are queued while an earlier one hasn't started are
+// merged, only the last contents are written and every callback gets that
+// result. Everything queued while a batch is written goes into the next
+// batch, whose files are written before any of them is synced so the
+// syncs go out together.
+class DataFileWriter
+{
+public:
+    static DataFileWriter *instance();
+
+    // called on the EventLoop of the thread that called save(), or on the
+    // writer thread if there's no loop
+    typedef std::function<void(const Path &path, bool ok, const String &error)> Callback;
+    void save(const Path &path, String &&contents, Callback &&callback = Callback());
+
+    // how long the writer waits for more saves before it starts a batch,
+    // 0 by default
+    void setBatchDelay(int ms);
+    int batchDelay() const;
+
+    // blocks until everything saved so far is on disk, e.g. before exiting
+    void flush();
+
+private:
+    DataFileWriter();
+
+    struct Pending
+    {
+        String contents;
+        List<Callback> callbacks;
+    };
+    struct Job
+    {
+        Path path, tempFilePath;
+        Pending pending;
+        int fd;
+        String error;
+    };
+
+    void run();
+    void write(List<Job> &batch);
+
+    mutable std::mutex mMutex;
+    std::condition_variable mCondition, mFlushed;
+    // by the path, in the order they were first saved
+    Hash<Path, Pending> mPending;
+    List<Path> mOrder;
+    bool mWriting;
+    int mBatchDelay;
+    std::thread mThread;
+
+    DataFileWriter(const DataFileWriter &) = delete;
+    DataFileWriter &operator=(const DataFileWriter &) = delete;
+};
+
+#endif
@@ -0,0 +1,253 @@
+#include "DnsResolver.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include "EventLoop.h"
+#include "Rct.h"
+#include "ThreadPool.h"
+
+enum {
+    DefaultCacheTtl = 60 * 1000,
+    DefaultNegativeCacheTtl = 5 * 1000,
+    DefaultConcurrentLookups = 4,
+    MaxCacheEntries = 4096
+};
+
+void DnsResolver::Address::setPort(uint16_t port)
+{
+    if (storage.ss_family == AF_INET) {
+        reinterpret_cast<sockaddr_in*>(&storage)->sin_port = htons(port);
+    } else if (storage.ss_family == AF_INET6) {
+        reinterpret_cast<sockaddr_in6*>(&storage)->sin6_port = htons(port);
+    }
+}
+
+class DnsResolver::LookupJob : public ThreadPool::Job
+{
+public:
+    LookupJob(DnsResolver *resolver, const String &host)
+        : mResolver(resolver), mHost(host)
+    {
+    }
+
+protected:
+    virtual void run() override
+    {
+        mResolver->finished(mHost, DnsResolver::lookup(mHost));
+    }
+
+private:
+    DnsResolver *mResolver;
+    const String mHost;
+};
+
+DnsResolver::DnsResolver()
+    : mCacheTtl(DefaultCacheTtl), mNegativeCacheTtl(DefaultNegativeCacheTtl),
+      mPool(new ThreadPool(DefaultConcurrentLookups))
+{
+}
+
+DnsResolver *DnsResolver::instance()
+{
+    // lookups may still be running when the process exits, never deleted
+    static DnsResolver *resolver = new DnsResolver;
+    return resolver;
+}
+
+static bool parseLiteral(const String &host, DnsResolver::Address &address)
+{
+    memset(&address.storage, 0, sizeof(address.storage));
+    sockaddr_in *addr4 = reinterpret_cast<sockaddr_in*>(&address.storage);
+    if (inet_pton(AF_INET, host.constData(), &addr4->sin_addr) == 1) {
+        addr4->sin_family = AF_INET;
+        address.size = sizeof(sockaddr_in);
+        return true;
+    }
+    sockaddr_in6 *addr6 = reinterpret_cast<sockaddr_in6*>(&address.storage);
+    if (inet_pton(AF_INET6, host.constData(), &addr6->sin6_addr) == 1) {
+        addr6->sin6_family = AF_INET6;
+        address.size = sizeof(sockaddr_in6);
+        return true;
+    }
+    return false;
+}
+
+DnsResolver::Addresses DnsResolver::lookup(const String &host)
+{
+    Addresses addresses;
+    Address address;
+    if (parseLiteral(host, address)) {
+        addresses.push_back(address);
+        return addresses;
+    }
+
+    addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.constData(), NULL, &hints, &res) != 0)
+        return addresses;
+
+    for (addrinfo *p = res; p; p = p->ai_next) {
+        if ((p->ai_family == AF_INET || p->ai_family == AF_INET6) && p->ai_addrlen <= sizeof(address.storage)) {
+            memset(&address.storage, 0, sizeof(address.storage));
+            memcpy(&address.storage, p->ai_addr, p->ai_addrlen);
+            address.size = p->ai_addrlen;
+            addresses.push_back(address);
+        }
+    }
+    freeaddrinfo(res);
+    return addresses;
+}
+
+DnsResolver::Addresses DnsResolver::filter(const Addresses &addresses, int family)
+{
+    if (family == AF_UNSPEC)
+        return addresses;
+    Addresses ret;
+    for (const Address &address : addresses) {
+        if (address.family() == family)
+            ret.push_back(address);
+    }
+    return ret;
+}
+
+bool DnsResolver::cached(const String &host, Addresses &addresses, int family)
+{
+    Address address;
+    if (parseLiteral(host, address)) {
+        addresses.clear();
+        if (family == AF_UNSPEC || address.family() == family)
+            addresses.push_back(address);
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mCache.find(host);
+    if (it == mCache.end())
+        return false;
+    if (it->second.expires <= Rct::monoCoarseMs()) {
+        mCache.erase(it);
+        return false;
+    }
+    addresses = filter(it->second.addresses, family);
+    return true;
+}
+
+void DnsResolver::store(const String &host, const Addresses &addresses)
+{
+    const int ttl = addresses.empty() ? mNegativeCacheTtl : mCacheTtl;
+    if (ttl <= 0)
+        return;
+    const uint64_t now = Rct::monoCoarseMs();
+    if (mCache.size() >= MaxCacheEntries) {
+        for (auto it = mCache.begin(); it != mCache.end(); ) {
+            if (it->second.expires <= now) {
+                it = mCache.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (mCache.size() >= MaxCacheEntries)
+            mCache.clear();
+    }
+    Entry &entry = mCache[host];
+    entry.addresses = addresses;
+    entry.expires = now + ttl;
+}
+
+void DnsResolver::resolve(const String &host, Callback &&callback, int family)
+{
+    Addresses addresses;
+    if (cached(host, addresses, family)) {
+        callback(host, addresses);
+        return;
+    }
+
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop) {
+        callback(host, resolveNow(host, family));
+        return;
+    }
+
+    EventLoop::WeakPtr weak = loop;
+    std::function<void(const Addresses &)> waiter = [weak, host, family, callback](const Addresses &all) {
+        if (EventLoop::SharedPtr l = weak.lock()) {
+            const Addresses filtered = filter(all, family);
+            l->callLater([host, filtered, callback]() { callback(host, filtered); });
+        }
+    };
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::vector<std::function<void(const Addresses &)> > &waiters = mPending[host];
+    waiters.push_back(std::move(waiter));
+    if (waiters.size() == 1)
+        mPool->start(std::make_shared<LookupJob>(this, host));
+}
+
+DnsResolver::Addresses DnsResolver::resolveNow(const String &host, int family)
+{
+    Addresses addresses;
+    if (cached(host, addresses, family))
+        return addresses;
+    addresses = lookup(host);
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        store(host, addresses);
+    }
+    return filter(addresses, family);
+}
+
+void DnsResolver::finished(const String &host, const Addresses &addresses)
+{
+    std::vector<std::function<void(const Addresses &)> > waiters;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        store(host, addresses);
+        auto it = mPending.find(host);
+        if (it != mPending.end()) {
+            waiters = std::move(it->second);
+            mPending.erase(it);
+        }
+    }
+    for (const auto &waiter : waiters)
+        waiter(addresses);
+}
+
+void DnsResolver::setCacheTtl(int ms)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCacheTtl = ms;
+}
+
+int DnsResolver::cacheTtl() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mCacheTtl;
+}
+
+void DnsResolver::setNegativeCacheTtl(int ms)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mNegativeCacheTtl = ms;
+}
+
+int DnsResolver::negativeCacheTtl() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mNegativeCacheTtl;
+}
+
+void DnsResolver::clearCache()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCache.clear();
+}
+
+void DnsResolver::setConcurrentLookups(int count)
+{
+    mPool->setConcurrentJobs(count);
+}
@@ -0,0 +1,86 @@
+#ifndef DNSRESOLVER_H
+#define DNSRESOLVER_H
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <vector>
+
+#include <rct/Hash.h>
+#include <rct/String.h>
+
+class ThreadPool;
+
+// Resolves host names with getaddrinfo() on a few worker threads and
+// calls back on the event loop that asked, so a slow DNS server doesn't
+// stall the loop. Results are cached. getaddrinfo() doesn't expose the
+// records' TTLs, so entries live for cacheTtl() milliseconds, failures
+// for negativeCacheTtl().
+class DnsResolver
+{
+public:
+    struct Address
+    {
+        sockaddr_storage storage;
+        socklen_t size;
+
+        int family() const { return storage.ss_family; }
+        const sockaddr *addr() const { return reinterpret_cast<const sockaddr*>(&storage); }
+        sockaddr *addr() { return reinterpret_cast<sockaddr*>(&storage); }
+        // sets the port of an AF_INET or AF_INET6 address
+        void setPort(uint16_t port);
+    };
+    typedef std::vector<Address> Addresses;
+
+    static DnsResolver *instance();
+
+    // IPv4 and IPv6 addresses of host, in getaddrinfo()'s order. family is
+    // AF_UNSPEC, AF_INET or AF_INET6. callback is called on the current
+    // thread's EventLoop with no addresses if the lookup failed, or
+    // right away when there's no loop or the result is cached.
+    typedef std::function<void(const String &host, const Addresses &addresses)> Callback;
+    void resolve(const String &host, Callback &&callback, int family = AF_UNSPEC);
+    // blocks unless the result is cached
+    Addresses resolveNow(const String &host, int family = AF_UNSPEC);
+    bool cached(const String &host, Addresses &addresses, int family = AF_UNSPEC);
+
+    void setCacheTtl(int ms);
+    int cacheTtl() const;
+    void setNegativeCacheTtl(int ms);
+    int negativeCacheTtl() const;
+    void clearCache();
+
+    // lookups running at once, the rest wait for a thread
+    void setConcurrentLookups(int count);
+
+private:
+    DnsResolver();
+
+    struct Entry
+    {
+        Addresses addresses;
+        uint64_t expires;
+    };
+    static Addresses lookup(const String &host);
+    static Addresses filter(const Addresses &addresses, int family);
+    void store(const String &host, const Addresses &addresses);
+    void finished(const String &host, const Addresses &addresses);
+
+    class LookupJob;
+    friend class LookupJob;
+
+    mutable std::mutex mMutex;
+    Hash<String, Entry> mCache;
+    // the callbacks waiting for each lookup in flight, a host is only
+    // looked up once at a time
+    Hash<String, std::vector<std::function<void(const Addresses &)> > > mPending;
+    int mCacheTtl, mNegativeCacheTtl;
+    std::unique_ptr<ThreadPool> mPool;
+
+    DnsResolver(const DnsResolver &) = delete;
+    DnsResolver &operator=(const DnsResolver &) = delete;
+};
+
+#endif
@@ -2,6 +2,7 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
@@ -15,28 +16,43 @@
 #include <algorithm>
 #include <atomic>
 #include <set>
-#ifdef HAVE_MACH_ABSOLUTE_TIME
-#  include <mach/mach.h>
-#  include <mach/mach_time.h>
+#ifdef HAVE_EVENTFD
+#  include <sys/eventfd.h>
+#endif
+#ifdef HAVE_TIMERFD
+#  include <sys/timerfd.h>
+#endif
+#ifdef HAVE_IO_URING
+#  include <poll.h>
+#  include "IoUring.h"
 #endif
 
+#include "Allocations.h"
+#include "Buffer.h"
 #include "Rct.h"
 #include "SocketClient.h"
 #include "Timer.h"
-#if defined(RCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD) && RCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD > 0
-#  include "Log.h"
-#  include "StopWatch.h"
-#define CALLBACK(op)                                                \
-    do {                                                            \
-        StopWatch sw;                                               \
-        op;                                                         \
-        if (sw.elapsed() >= RCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD)  \
-            ::error() << "callback took" << sw.elapsed()            \
-                      << "ms\n" << Rct::backtrace();                \
+#include "Log.h"
+#include "Metrics.h"
+#include "StopWatch.h"
+#include "Trace.h"
+
+// what the sources' slices are called in traces
+static const char *const sTraceNames[] = { "socket", "timer", "posted", "io" };
+
+// flow is the trace flow that ends in the callback, if any
+#define CALLBACK(source, id, flow, op)                                          \
+    do {                                                                        \
+        RCT_TRACE_FLOW_SCOPE("EventLoop", sTraceNames[Statistics::source], flow); \
+        RCT_ALLOCATION_SCOPE(Allocations::EventLoopSubsystem);                  \
+        if (mInstrumentation.load(std::memory_order_relaxed)) {                 \
+            const uint64_t started = StopWatch::current(StopWatch::Microsecond); \
+            op;                                                                 \
+            recordCallback(Statistics::source, id, started);                    \
+        } else {                                                                \
+            op;                                                                 \
+        }                                                                       \
     } while (0)
-#else
-#define CALLBACK(op) op
-#endif
 
 // EPOLL compitability hacks.
 // (see: https://github.com/kr/beanstalkd/issues/92).
@@ -58,56 +74,175 @@ EventLoop::WeakPtr EventLoop::sMainLoop;
 std::mutex EventLoop::mMainMutex;
 static std::atomic<int> sMainEventPipe;
 static std::once_flag sMainOnce;
-static pthread_key_t sEventLoopKey;
 
-// sadly GCC < 4.8 doesn't support thread_local
-// fall back to pthread instead in order to support 4.7
+#if defined(HAVE_EVENTFD)
+// eventfd counters add up, anything at or above this value means that
+// the signal handler asked us to quit
+static const uint64_t EventFdQuit = 0x100000000ULL;
+#endif
 
-static EventLoop::WeakPtr& localEventLoop()
+// The loop of this thread. A loop may be destroyed while static objects
+// are, after the thread locals of the main thread, so it remembers
+// when it's gone.
+static thread_local bool tLocalEventLoopGone = false;
+struct LocalEventLoop
 {
-    EventLoop::WeakPtr* ptr = static_cast<EventLoop::WeakPtr*>(pthread_getspecific(sEventLoopKey));
-    if (!ptr) {
-        ptr = new EventLoop::WeakPtr;
-        pthread_setspecific(sEventLoopKey, ptr);
-    }
-    return *ptr;
+    LocalEventLoop() : raw(0) {}
+    ~LocalEventLoop() { tLocalEventLoopGone = true; }
+
+    EventLoop::WeakPtr weak;
+    EventLoop* raw;
+};
+static thread_local LocalEventLoop tLocalEventLoop;
+
+static inline LocalEventLoop* localEventLoop()
+{
+    return tLocalEventLoopGone ? 0 : &tLocalEventLoop;
 }
 
 static void signalHandler(int /*sig*/)
 {
+#if defined(HAVE_EVENTFD)
+    const uint64_t b = EventFdQuit;
+#else
     char b = 'q';
+#endif
     int w;
     const int pipe = sMainEventPipe;
     if (pipe != -1)
-        eintrwrap(w, ::write(pipe, &b, 1));
+        eintrwrap(w, ::write(pipe, &b, sizeof(b)));
+}
+
+// the fd in the low and the registration generation in the high bits,
+// stored as the user data of the native event
+static inline uint64_t socketKey(int fd, uint32_t generation)
+{
+    return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+}
+
+#if defined(HAVE_IO_URING)
+// The user data of io_uring entries. Polls use the socketKey() layout
+// with an arm sequence instead of the generation so that completions of
+// polls that were removed or replaced can be told apart, sequence 0 is
+// the wakeup fd. I/O operations store their pointer with the top bit set.
+static const uint64_t UringOperation = 1ULL << 63;
+static const uint64_t UringIgnore = 1ULL << 62;
+enum { UringSequenceMask = 0x3fffffff, UringEntries = 256 };
+// how long cleanup() waits for canceled I/O operations, in us, before it
+// leaks them
+enum { UringCancelTimeout = 100000, UringCancelAttempts = 10 };
+
+struct EventLoop::IoOperation
+{
+    IoCallback callback;
+    Buffer buffer;
+    size_t offset;
+    int fd;
+    bool write;
+    int transferred;
+};
+
+static bool preparePoll(IoUring* uring, int fd, uint32_t sequence, unsigned int mode)
+{
+    io_uring_sqe* sqe = uring->prepare();
+    if (!sqe)
+        return false;
+    uint32_t events = 0;
+    if (mode & EventLoop::SocketRead)
+        events |= POLLIN|POLLRDHUP;
+    if (mode & EventLoop::SocketWrite)
+        events |= POLLOUT;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events = (events << 16) | (events >> 16);
+#endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = socketKey(fd, sequence);
+    uring->commit();
+    return true;
+}
+#endif
+
+// microseconds
+static inline uint64_t currentTimeUs()
+{
+    return Rct::monoUs();
 }
 
+// the loop time of the innermost exec() on this thread
+static thread_local const std::atomic<uint64_t> *tLoopTime = 0;
+
 EventLoop::EventLoop()
-    :
+    : mWakeupPending(false), mFreeCells(0), mSharedCells(0),
+    mReleasedCells(0), mReleasedLast(0), mReleasedCount(0), mEventSlabCount(0),
 #if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
     mPollFd(-1),
 #endif
-    mNextTimerId(0), mStop(false), mTimeout(false), mFlags(0), mInactivityTimeout(0)
+    mSocketCount(0),
+    mNextTimerId(0), mBufferPool(new BufferPool), mLoopTime(0), mExecLevel(0),
+#if defined(HAVE_TIMERFD)
+    mTimerFd(-1), mTimerFdDeadline(0),
+#endif
+#if defined(HAVE_IO_URING)
+    mUringSequence(0),
+#endif
+    mPostedBudget(0), mTimerBudget(0), mSocketBudget(0), mBusyPoll(0),
+#if defined(RCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD) && RCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD > 0
+    mInstrumentation(true), mSlowCallbackThreshold(RCT_EVENTLOOP_CALLBACK_TIME_THRESHOLD),
+#else
+    mInstrumentation(false), mSlowCallbackThreshold(0),
+#endif
+    mStatistics(), mMetricsCollector(0),
+    mStop(false), mTimeout(false), mFlags(0), mInactivityTimeout(0)
 {
+#if defined(RCT_EVENTLOOP_LOCKFREE_POST)
+    for (int i = 0; i < PriorityCount; ++i) {
+        mPostedEvents[i] = 0;
+        mDeferredEvents[i] = mDeferredLast[i] = 0;
+    }
+#endif
     std::call_once(sMainOnce, [this](){
-            atexit(&EventLoop::cleanupLocalEventLoop);
             sMainEventPipe = -1;
-            pthread_key_create(&sEventLoopKey, 0);
             signal(SIGPIPE, SIG_IGN);
         });
+
+    static std::atomic<int> sLoops(0);
+    const String loop = String::number(sLoops.fetch_add(1));
+    mMetricsCollector = Metrics::instance().addCollector([this, loop](List<Metrics::Sample> &samples) {
+            static const char *sources[] = { "socket", "timer", "posted", "io" };
+            const Statistics stats = statistics();
+            const Metrics::Labels labels = { { "loop", loop } };
+            samples.append(Metrics::sample("rct_eventloop_iterations_total", Metrics::CounterType, stats.iterations, labels));
+            samples.append(Metrics::sample("rct_eventloop_blocked_us_total", Metrics::CounterType, stats.blockedUs, labels));
+            samples.append(Metrics::sample("rct_eventloop_slow_callbacks_total", Metrics::CounterType, stats.slowCallbacks, labels));
+            const std::pair<const char *, uint64_t> budgets[] = {
+                { "posted", stats.postedBudgetHits }, { "timer", stats.timerBudgetHits }, { "socket", stats.socketBudgetHits }
+            };
+            for (const auto &budget : budgets) {
+                samples.append(Metrics::sample("rct_eventloop_budget_hits_total", Metrics::CounterType, budget.second,
+                                               { { "loop", loop }, { "budget", budget.first } }));
+            }
+            for (int i = 0; i < Statistics::SourceCount; ++i) {
+                if (stats.histograms[i].count) {
+                    samples.append(Metrics::histogramSample("rct_eventloop_callback_us", stats.histograms[i], Statistics::BucketCount,
+                                                   { { "loop", loop }, { "source", sources[i] } }));
+                }
+            }
+        });
 }
 
 EventLoop::~EventLoop()
 {
+    Metrics::instance().removeCollector(mMetricsCollector);
     cleanup();
 }
 
 void EventLoop::cleanupLocalEventLoop()
 {
-    EventLoop::WeakPtr* ptr = static_cast<EventLoop::WeakPtr*>(pthread_getspecific(sEventLoopKey));
-    if (!ptr) {
-        delete ptr;
-        pthread_setspecific(sEventLoopKey, 0);
+    if (LocalEventLoop* local = localEventLoop()) {
+        local->weak.reset();
+        local->raw = 0;
     }
 }
 
@@ -117,6 +252,17 @@ void EventLoop::init(unsigned int flags)
     mFlags = flags;
 
     threadId = std::this_thread::get_id();
+    updateTime();
+    if (flags & EnableTimerWheel)
+        mTimerWheel.reset(new TimerWheel(timerTime()));
+#if defined(HAVE_EVENTFD)
+    int e = ::eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    mEventPipe[0] = mEventPipe[1] = e;
+    if (e == -1) {
+        cleanup();
+        return;
+    }
+#else
     int e = ::pipe(mEventPipe);
     if (e == -1) {
         mEventPipe[0] = -1;
@@ -128,7 +274,20 @@ void EventLoop::init(unsigned int flags)
         cleanup();
         return;
     }
+#endif
 
+#if defined(HAVE_IO_URING)
+    if (flags & EnableIoUring) {
+        mUring.reset(new IoUring);
+        if (!mUring->init(UringEntries)) {
+            // not supported by this kernel, use epoll
+            mUring.reset();
+        }
+    }
+    if (mUring) {
+        e = preparePoll(mUring.get(), mEventPipe[0], 0, SocketRead) ? 0 : -1;
+    } else {
+#endif
 #if defined(HAVE_EPOLL)
     mPollFd = epoll_create1(0);
 #elif defined(HAVE_KQUEUE)
@@ -151,14 +310,30 @@ void EventLoop::init(unsigned int flags)
 #if defined(HAVE_EPOLL)
     memset(&ev, 0, sizeof(ev));
     ev.events = EPOLLIN | EPOLLET;
-    ev.data.fd = mEventPipe[0];
+    ev.data.u64 = socketKey(mEventPipe[0], 0);
     e = epoll_ctl(mPollFd, EPOLL_CTL_ADD, mEventPipe[0], &ev);
+#if defined(HAVE_TIMERFD)
+    if (e != -1 && flags & EnableHighResTimers) {
+        // a failure here just leaves us with millisecond waits
+        mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        if (mTimerFd != -1) {
+            ev.data.u64 = socketKey(mTimerFd, 0);
+            if (epoll_ctl(mPollFd, EPOLL_CTL_ADD, mTimerFd, &ev) == -1) {
+                ::close(mTimerFd);
+                mTimerFd = -1;
+            }
+        }
+    }
+#endif
 #elif defined(HAVE_KQUEUE)
     memset(&ev, '\0', sizeof(struct kevent));
     ev.ident = mEventPipe[0];
     ev.flags = EV_ADD|EV_ENABLE;
     ev.filter = EVFILT_READ;
     eintrwrap(e, kevent(mPollFd, &ev, 1, 0, 0, 0));
+#endif
+#if defined(HAVE_IO_URING)
+    }
 #endif
     if (e == -1) {
         cleanup();
@@ -189,7 +364,10 @@ void EventLoop::init(unsigned int flags)
     }
 
     std::shared_ptr<EventLoop> that = shared_from_this();
-    localEventLoop() = that;
+    if (LocalEventLoop* local = localEventLoop()) {
+        local->weak = that;
+        local->raw = this;
+    }
     if (flags & MainEventLoop) {
         std::lock_guard<std::mutex> l(mMainMutex);
         sMainLoop = that;
@@ -199,13 +377,36 @@ void EventLoop::init(unsigned int flags)
 void EventLoop::cleanup()
 {
     std::lock_guard<std::mutex> locker(mMutex);
-    localEventLoop().reset();
+    // loops of an EventLoopGroup may be destroyed on another thread,
+    // don't clear that thread's loop
+    LocalEventLoop* local = localEventLoop();
+    if (local && (local->raw == this || local->weak.expired())) {
+        local->weak.reset();
+        local->raw = 0;
+    }
 
-    while (!mEvents.empty()) {
-        delete mEvents.front();
-        mEvents.pop();
+    for (int priority = 0; priority < PriorityCount; ++priority) {
+#if defined(RCT_EVENTLOOP_LOCKFREE_POST)
+        Event* lists[] = { mPostedEvents[priority].exchange(0), mDeferredEvents[priority] };
+        mDeferredEvents[priority] = mDeferredLast[priority] = 0;
+        for (Event* event : lists) {
+            while (event) {
+                Event* next = event->mNext;
+                releaseEvent(event);
+                event = next;
+            }
+        }
+#else
+        std::queue<Event*>& events = mEvents[priority];
+        while (!events.empty()) {
+            releaseEvent(events.front());
+            events.pop();
+        }
+#endif
     }
 
+    if (mTimerWheel)
+        mTimerWheel->clear();
     for (auto timer : mTimersById) {
         delete timer;
     }
@@ -231,10 +432,47 @@ void EventLoop::cleanup()
     if (mPollFd != -1)
         ::close(mPollFd);
 #endif
+#if defined(HAVE_TIMERFD)
+    if (mTimerFd != -1) {
+        ::close(mTimerFd);
+        mTimerFd = -1;
+    }
+#endif
+#if defined(HAVE_IO_URING)
+    if (mUring) {
+        // the kernel may write into the buffer of an operation until its
+        // completion is posted, even while the ring is being closed
+        for (auto op : mIoOperations) {
+            if (io_uring_sqe* sqe = mUring->prepare()) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = reinterpret_cast<uintptr_t>(op) | UringOperation;
+                sqe->user_data = UringIgnore;
+                mUring->commit();
+            }
+        }
+        for (int i = 0; !mIoOperations.empty() && i < UringCancelAttempts; ++i) {
+            if (mUring->wait(UringCancelTimeout) == -1)
+                break;
+            while (const io_uring_cqe* cqe = mUring->peek()) {
+                const uint64_t data = cqe->user_data;
+                mUring->seen();
+                if (!(data & UringOperation))
+                    continue;
+                IoOperation* op = reinterpret_cast<IoOperation*>(static_cast<uintptr_t>(data & ~UringOperation));
+                if (mIoOperations.erase(op))
+                    delete op;
+            }
+        }
+        if (!mIoOperations.empty())
+            ::error("EventLoop: leaking %zu I/O operations that didn't complete", mIoOperations.size());
+        mIoOperations.clear();
+        mUring.reset();
+    }
+#endif
 
     if (mEventPipe[0] != -1)
         ::close(mEventPipe[0]);
-    if (mEventPipe[1] != -1)
+    if (mEventPipe[1] != -1 && mEventPipe[1] != mEventPipe[0])
         ::close(mEventPipe[1]);
     if (mFlags & MainEventLoop)
         sMainLoop.reset();
@@ -246,12 +484,30 @@ void EventLoop::cleanup()
 
 EventLoop::SharedPtr EventLoop::eventLoop()
 {
-    EventLoop::SharedPtr loop = localEventLoop().lock();
-    if (!loop) {
-        std::lock_guard<std::mutex> locker(mMainMutex);
-        loop = sMainLoop.lock();
+    if (LocalEventLoop* local = localEventLoop()) {
+        if (local->raw) {
+            if (EventLoop::SharedPtr loop = local->weak.lock())
+                return loop;
+        }
+    }
+    std::lock_guard<std::mutex> locker(mMainMutex);
+    return sMainLoop.lock();
+}
+
+EventLoop* EventLoop::current()
+{
+    LocalEventLoop* local = localEventLoop();
+    return local && local->raw && !local->weak.expired() ? local->raw : 0;
+}
+
+EventLoop::WeakPtr EventLoop::weakEventLoop()
+{
+    if (LocalEventLoop* local = localEventLoop()) {
+        if (local->raw && !local->weak.expired())
+            return local->weak;
     }
-    return loop;
+    std::lock_guard<std::mutex> locker(mMainMutex);
+    return sMainLoop;
 }
 
 
@@ -261,21 +517,220 @@ void EventLoop::error(const char* err)
     abort();
 }
 
-void EventLoop::post(Event* event)
+void EventLoop::post(Event* event, Priority priority)
 {
+    RCT_TRACE_SCOPE("EventLoop", "post");
+    event->mTraceFlow = RCT_TRACE_FLOW_START();
+#if defined(RCT_EVENTLOOP_LOCKFREE_POST)
+    std::atomic<Event*>& posted = mPostedEvents[priority];
+    Event* head = posted.load(std::memory_order_relaxed);
+    do {
+        event->mNext = head;
+    } while (!posted.compare_exchange_weak(head, event, std::memory_order_release, std::memory_order_relaxed));
+#else
     std::lock_guard<std::mutex> locker(mMutex);
-    mEvents.push(event);
+    mEvents[priority].push(event);
+#endif
     wakeup();
 }
 
+uint32_t EventLoop::allocateSlab()
+{
+    // returns the first index of a chain of EventSlabSize cells or 0
+    std::lock_guard<std::mutex> locker(mCellMutex);
+    if (mEventSlabCount == MaxEventSlabs)
+        return 0;
+    EventCell* slab = new EventCell[EventSlabSize];
+    const uint32_t first = mEventSlabCount * EventSlabSize + 1;
+    for (int i = 0; i < EventSlabSize - 1; ++i)
+        slab[i].next = first + i + 1;
+    slab[EventSlabSize - 1].next = 0;
+    // published to other threads by the release in pushSharedCells()
+    mEventSlabs[mEventSlabCount++].reset(slab);
+    return first;
+}
+
+void EventLoop::pushSharedCells(uint32_t first, uint32_t last)
+{
+    EventCell* tail = eventCell(last);
+    uint64_t head = mSharedCells.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+        __atomic_store_n(&tail->next, static_cast<uint32_t>(head), __ATOMIC_RELAXED);
+        next = (((head >> 32) + 1) << 32) | first;
+    } while (!mSharedCells.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void EventLoop::flushReleasedCells()
+{
+    if (mReleasedCells) {
+        pushSharedCells(mReleasedCells, mReleasedLast);
+        mReleasedCells = mReleasedLast = mReleasedCount = 0;
+    }
+}
+
+void* EventLoop::allocateEvent(size_t size, unsigned char& allocation, uint32_t& cell)
+{
+    cell = 0;
+    if (size <= sizeof(EventCell)) {
+        if (std::this_thread::get_id() == threadId) {
+            if (!mFreeCells)
+                mFreeCells = allocateSlab();
+            if (mFreeCells) {
+                cell = mFreeCells;
+                mFreeCells = eventCell(cell)->next;
+                allocation = Event::LocalCell;
+            }
+        } else {
+            uint64_t head = mSharedCells.load(std::memory_order_acquire);
+            for (;;) {
+                cell = static_cast<uint32_t>(head);
+                if (!cell) {
+                    // keep the first cell of a new slab, share the rest
+                    cell = allocateSlab();
+                    if (cell)
+                        pushSharedCells(cell + 1, cell + EventSlabSize - 1);
+                    break;
+                }
+                // the cell may be taken and reused under us, then the
+                // counter has moved on and the exchange fails
+                const uint32_t next = __atomic_load_n(&eventCell(cell)->next, __ATOMIC_RELAXED);
+                if (mSharedCells.compare_exchange_weak(head, (((head >> 32) + 1) << 32) | next,
+                                                       std::memory_order_acquire, std::memory_order_acquire)) {
+                    break;
+                }
+            }
+            allocation = Event::SharedCell;
+        }
+        if (cell)
+            return eventCell(cell);
+    }
+    allocation = Event::Heap;
+    return ::operator new(size);
+}
+
+// called on the loop thread
+void EventLoop::releaseEvent(Event* event)
+{
+    const unsigned char allocation = event->mAllocation;
+    if (allocation == Event::New) {
+        delete event;
+        return;
+    }
+    const uint32_t cell = event->mCell;
+    event->~Event();
+    switch (allocation) {
+    case Event::Heap:
+        ::operator delete(event);
+        break;
+    case Event::LocalCell:
+        eventCell(cell)->next = mFreeCells;
+        mFreeCells = cell;
+        break;
+    case Event::SharedCell:
+        eventCell(cell)->next = mReleasedCells;
+        if (!mReleasedCells)
+            mReleasedLast = cell;
+        mReleasedCells = cell;
+        if (++mReleasedCount == EventSlabSize)
+            flushReleasedCells();
+        break;
+    }
+}
+
 void EventLoop::wakeup()
 {
     if (std::this_thread::get_id() == threadId)
         return;
 
+    // only the first wakeup since the last drain needs to hit the fd
+    if (mWakeupPending.exchange(true))
+        return;
+
+#if defined(HAVE_EVENTFD)
+    const uint64_t b = 1;
+#else
     char b = 'w';
+#endif
     int w;
-    eintrwrap(w, ::write(mEventPipe[1], &b, 1));
+    eintrwrap(w, ::write(mEventPipe[1], &b, sizeof(b)));
+}
+
+// returns Success if the signal handler asked us to quit
+unsigned int EventLoop::drainWakeup()
+{
+    int e;
+#if defined(HAVE_EVENTFD)
+    uint64_t value;
+    eintrwrap(e, ::read(mEventPipe[0], &value, sizeof(value)));
+    if (e == sizeof(value) && value >= EventFdQuit) {
+        // signal caught, we need to shut down
+        return Success;
+    }
+#else
+    char q;
+    do {
+        eintrwrap(e, ::read(mEventPipe[0], &q, 1));
+        if (e == 1 && q == 'q') {
+            // signal caught, we need to shut down
+            return Success;
+        }
+    } while (e == 1);
+#endif
+    // clear after reading so that a wakeup racing with us writes again
+    mWakeupPending = false;
+    // Posters push and then check the flag, we clear it and then check
+    // what's posted. Without a full fence our loads of mPostedEvents can
+    // be done before the store is visible, a poster sees the flag still
+    // set and doesn't write, we see nothing posted and sleep with an
+    // event pending.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (e == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        // error
+        fprintf(stderr, "Error reading from event pipe: %d (%s)\n", errno, Rct::strerror().constData());
+        return GeneralError;
+    }
+    return 0;
+}
+
+void EventLoop::recordCallback(Statistics::Source source, int id, uint64_t started)
+{
+    const uint64_t elapsed = StopWatch::current(StopWatch::Microsecond) - started;
+    int bucket = 0;
+    while (bucket < Statistics::BucketCount - 1 && elapsed >= (1ULL << bucket))
+        ++bucket;
+    const int threshold = mSlowCallbackThreshold.load(std::memory_order_relaxed);
+    const bool slow = threshold > 0 && elapsed >= threshold * 1000ULL;
+    {
+        std::lock_guard<std::mutex> locker(mStatisticsMutex);
+        Statistics::Histogram& histogram = mStatistics.histograms[source];
+        ++histogram.count;
+        histogram.totalUs += elapsed;
+        histogram.maxUs = std::max(histogram.maxUs, elapsed);
+        ++histogram.buckets[bucket];
+        if (slow)
+            ++mStatistics.slowCallbacks;
+    }
+    if (slow) {
+        static const char* names[] = { "socket", "timer", "posted event", "io" };
+        Log log = ::warning();
+        log << names[source];
+        if (id != -1)
+            log << id;
+        log << "callback took" << (elapsed / 1000) << "ms\n" << Rct::backtrace();
+    }
+}
+
+EventLoop::Statistics EventLoop::statistics() const
+{
+    std::lock_guard<std::mutex> locker(mStatisticsMutex);
+    return mStatistics;
+}
+
+void EventLoop::resetStatistics()
+{
+    std::lock_guard<std::mutex> locker(mStatisticsMutex);
+    mStatistics = Statistics();
 }
 
 void EventLoop::quit()
@@ -285,61 +740,141 @@ void EventLoop::quit()
     wakeup();
 }
 
-inline bool EventLoop::sendPostedEvents()
+void EventLoop::setSchedulingPolicy(const SchedulingPolicy& policy)
 {
-    std::unique_lock<std::mutex> locker(mMutex);
-    if (mEvents.empty())
-        return false;
-    while (!mEvents.empty()) {
-        auto event = mEvents.front();
-        mEvents.pop();
-        locker.unlock();
-        event->exec();
-        delete event;
-        locker.lock();
-    }
-    return true;
+    mPostedBudget.store(policy.postedBudget, std::memory_order_relaxed);
+    mTimerBudget.store(policy.timerBudget, std::memory_order_relaxed);
+    mSocketBudget.store(policy.socketBudget, std::memory_order_relaxed);
+    wakeup();
 }
 
-// milliseconds
-static inline uint64_t currentTime()
+EventLoop::SchedulingPolicy EventLoop::schedulingPolicy() const
 {
-#if defined(HAVE_CLOCK_MONOTONIC_RAW) || defined(HAVE_CLOCK_MONOTONIC)
-    timespec now;
-#if defined(HAVE_CLOCK_MONOTONIC_RAW)
-    if (clock_gettime(CLOCK_MONOTONIC_RAW, &now) == -1)
-        return 0;
-#elif defined(HAVE_CLOCK_MONOTONIC)
-    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
-        return 0;
-#endif
-    const uint64_t t = (now.tv_sec * 1000LLU) + (now.tv_nsec / 1000000LLU);
-#elif defined(HAVE_MACH_ABSOLUTE_TIME)
-    static mach_timebase_info_data_t info;
-    static bool first = true;
-    uint64_t t = mach_absolute_time();
-    if (first) {
-        first = false;
-        mach_timebase_info(&info);
-    }
-    t = t * info.numer / (info.denom * 1000); // microseconds
-    t /= 1000; // milliseconds
+    SchedulingPolicy policy;
+    policy.postedBudget = mPostedBudget.load(std::memory_order_relaxed);
+    policy.timerBudget = mTimerBudget.load(std::memory_order_relaxed);
+    policy.socketBudget = mSocketBudget.load(std::memory_order_relaxed);
+    return policy;
+}
+
+inline bool EventLoop::sendPostedEvents(unsigned int& budget)
+{
+    bool sent = false;
+#if defined(RCT_EVENTLOOP_LOCKFREE_POST)
+    for (int priority = UrgentPriority; priority < PriorityCount; ++priority) {
+        std::atomic<Event*>& posted = mPostedEvents[priority];
+        Event* newest = posted.load(std::memory_order_relaxed) ? posted.exchange(0, std::memory_order_acquire) : 0;
+        if (newest) {
+            // the list is newest first, reverse it
+            Event* const last = newest;
+            Event* ordered = 0;
+            while (newest) {
+                Event* next = newest->mNext;
+                newest->mNext = ordered;
+                ordered = newest;
+                newest = next;
+            }
+            if (mDeferredEvents[priority]) {
+                mDeferredLast[priority]->mNext = ordered;
+            } else {
+                mDeferredEvents[priority] = ordered;
+            }
+            mDeferredLast[priority] = last;
+        }
+        // the list is a member, an exec() from a callback continues
+        // where we are
+        while (Event* event = mDeferredEvents[priority]) {
+            if (priority != UrgentPriority) {
+                if (!budget)
+                    break;
+                --budget;
+            }
+            mDeferredEvents[priority] = event->mNext;
+            if (!event->mNext)
+                mDeferredLast[priority] = 0;
+            CALLBACK(PostedSource, -1, event->mTraceFlow, event->exec());
+            releaseEvent(event);
+            sent = true;
+        }
+    }
 #else
-#error No time getting mechanism
+    std::unique_lock<std::mutex> locker(mMutex);
+    for (int priority = UrgentPriority; priority < PriorityCount; ++priority) {
+        std::queue<Event*>& events = mEvents[priority];
+        while (!events.empty()) {
+            if (priority != UrgentPriority) {
+                if (!budget)
+                    break;
+                --budget;
+            }
+            auto event = events.front();
+            events.pop();
+            locker.unlock();
+            CALLBACK(PostedSource, -1, event->mTraceFlow, event->exec());
+            releaseEvent(event);
+            sent = true;
+            locker.lock();
+        }
+    }
+    locker.unlock();
 #endif
-    return t;
+    if (sent)
+        flushReleasedCells();
+    return sent;
+}
+
+uint64_t EventLoop::now() const
+{
+    // mExecLevel belongs to the loop thread, don't read it from others
+    if (std::this_thread::get_id() == threadId && mExecLevel)
+        return mLoopTime.load(std::memory_order_relaxed);
+    return currentTimeUs();
+}
+
+uint64_t EventLoop::threadNow()
+{
+    if (const std::atomic<uint64_t> *time = tLoopTime)
+        return time->load(std::memory_order_relaxed);
+    return currentTimeUs();
+}
+
+void EventLoop::updateTime()
+{
+    mLoopTime.store(currentTimeUs(), std::memory_order_relaxed);
+}
+
+uint64_t EventLoop::timerTime() const
+{
+    const uint64_t time = now();
+    return mFlags & EnableHighResTimers ? time : time / 1000;
 }
 
 int EventLoop::registerTimer(std::function<void(int)>&& func, int timeout, unsigned int flags)
+{
+    const uint64_t interval = std::max(timeout, 0);
+    return addTimer(std::move(func), mFlags & EnableHighResTimers ? interval * 1000 : interval, flags);
+}
+
+int EventLoop::registerTimerUs(std::function<void(int)>&& func, uint64_t timeout, unsigned int flags)
+{
+    return addTimer(std::move(func), mFlags & EnableHighResTimers ? timeout : (timeout + 999) / 1000, flags);
+}
+
+int EventLoop::addTimer(std::function<void(int)>&& func, uint64_t timeout, unsigned int flags)
 {
     std::lock_guard<std::mutex> locker(mMutex);
+    if (mTimerWheel) {
+        const int id = mTimerWheel->add(timerTime() + timeout, flags, timeout, std::move(func));
+        wakeup();
+        return id;
+    }
     {
         TimerData data;
         do {
             data.id = ++mNextTimerId;
         } while (mTimersById.count(&data));
     }
-    TimerData* timer = new TimerData(currentTime() + timeout, mNextTimerId, flags, timeout, std::forward<std::function<void(int)> >(func));
+    TimerData* timer = new TimerData(timerTime() + timeout, mNextTimerId, flags, timeout, std::forward<std::function<void(int)> >(func));
     mTimersByTime.insert(timer);
     mTimersById.insert(timer);
     assert(mTimersById.count(timer) == 1);
@@ -356,6 +891,10 @@ void EventLoop::unregisterTimer(int id)
 
 void EventLoop::clearTimer(int id)
 {
+    if (mTimerWheel) {
+        mTimerWheel->remove(id);
+        return;
+    }
     TimerData* t = 0;
     {
         TimerData data;
@@ -387,12 +926,46 @@ void EventLoop::clearTimer(int id)
     abort();
 }
 
-inline bool EventLoop::sendTimers()
+inline bool EventLoop::sendWheelTimers(unsigned int& budget)
+{
+    std::unique_lock<std::mutex> locker(mMutex);
+    mTimerWheel->advance(timerTime());
+    bool fired = false;
+    // timers rescheduled while firing land in the wheel's expired list
+    // and wait for the next round, same as the fired set below. Those
+    // over budget stay due.
+    while (budget) {
+        TimerWheel::Node* node = mTimerWheel->takeDue();
+        if (!node)
+            break;
+        --budget;
+        const int id = node->id;
+        std::function<void(int)> cb;
+        if (node->flags & Timer::SingleShot) {
+            cb = std::move(node->callback);
+            mTimerWheel->release(node);
+        } else {
+            node->when += node->interval;
+            cb = node->callback;
+            mTimerWheel->readd(node);
+        }
+        fired = true;
+
+        locker.unlock();
+        CALLBACK(TimerSource, id, 0, cb(id));
+        locker.lock();
+    }
+    return fired;
+}
+
+inline bool EventLoop::sendTimers(unsigned int& budget)
 {
+    if (mTimerWheel)
+        return sendWheelTimers(budget);
     std::set<uint64_t> fired;
     std::unique_lock<std::mutex> locker(mMutex);
-    const uint64_t now = currentTime();
-    for (;;) {
+    const uint64_t now = timerTime();
+    while (budget) {
         auto timer = mTimersByTime.begin();
         if (timer == mTimersByTime.end())
             return !fired.empty();
@@ -408,6 +981,7 @@ inline bool EventLoop::sendTimers()
         }
         if (timerData->when > now)
             return !fired.empty();
+        --budget;
         if (timerData->flags & Timer::SingleShot) {
             // remove the timer before firing
             std::function<void(int)> func = std::move(timerData->callback);
@@ -418,7 +992,7 @@ inline bool EventLoop::sendTimers()
 
             // fire
             locker.unlock();
-            CALLBACK(func(currentId));
+            CALLBACK(TimerSource, currentId, 0, func(currentId));
             locker.lock();
         } else {
             // silly std::set/multiset doesn't have a way of forcing a resort.
@@ -442,7 +1016,7 @@ inline bool EventLoop::sendTimers()
 
             // fire
             locker.unlock();
-            CALLBACK(cb(currentId));
+            CALLBACK(TimerSource, currentId, 0, cb(currentId));
             locker.lock();
         }
     }
@@ -452,7 +1026,25 @@ inline bool EventLoop::sendTimers()
 bool EventLoop::registerSocket(int fd, unsigned int mode, std::function<void(int, unsigned int)>&& func)
 {
     std::lock_guard<std::mutex> locker(mMutex);
-    mSockets[fd] = std::make_pair(mode, std::forward<std::function<void(int, unsigned int)> >(func));
+    assert(fd >= 0);
+    if (static_cast<size_t>(fd) >= mSockets.size())
+        mSockets.resize(fd + 1);
+    SocketData& socket = mSockets[fd];
+    if (!socket.callback) {
+        // a new registration, events for the previous one are stale
+        ++socket.generation;
+        ++mSocketCount;
+    }
+    socket.mode = mode;
+    socket.callback = std::make_shared<std::function<void(int, unsigned int)> >(std::move(func));
+
+#if defined(HAVE_IO_URING)
+    if (mUring) {
+        disarmUring(fd, socket);
+        armUring(fd, socket);
+        return true;
+    }
+#endif
 
     int e;
 #if defined(HAVE_EPOLL)
@@ -467,7 +1059,7 @@ bool EventLoop::registerSocket(int fd, unsigned int mode, std::function<void(int
         ev.events |= EPOLLOUT;
     if (mode & SocketOneShot)
         ev.events |= EPOLLONESHOT;
-    ev.data.fd = fd;
+    ev.data.u64 = socketKey(fd, socket.generation);
     e = epoll_ctl(mPollFd, EPOLL_CTL_ADD, fd, &ev);
 #elif defined(HAVE_KQUEUE)
     e = 0;
@@ -486,6 +1078,7 @@ bool EventLoop::registerSocket(int fd, unsigned int mode, std::function<void(int
         if (mode & SocketOneShot)
             ev.flags |= EV_ONESHOT;
         ev.filter = flags[i].kf;
+        ev.udata = reinterpret_cast<void*>(static_cast<uintptr_t>(socket.generation));
         eintrwrap(e, kevent(mPollFd, &ev, 1, 0, 0, 0));
     }
 #elif defined(HAVE_SELECT)
@@ -505,15 +1098,26 @@ bool EventLoop::registerSocket(int fd, unsigned int mode, std::function<void(int
 bool EventLoop::updateSocket(int fd, unsigned int mode)
 {
     std::lock_guard<std::mutex> locker(mMutex);
-    auto socket = mSockets.find(fd);
-    if (socket == mSockets.end()) {
+    SocketData* socket = socketData(fd);
+    if (!socket) {
         fprintf(stderr, "Unable to find socket to update %d\n", fd);
         return false;
     }
 #if defined(HAVE_KQUEUE)
-    const int oldMode = socket->second.first;
+    const int oldMode = socket->mode;
+#endif
+#if defined(HAVE_IO_URING)
+    if (mUring) {
+        // SocketClient asks for the same one shot mode over and over
+        if (socket->mode != mode || !socket->armed) {
+            socket->mode = mode;
+            disarmUring(fd, *socket);
+            armUring(fd, *socket);
+        }
+        return true;
+    }
 #endif
-    socket->second.first = mode;
+    socket->mode = mode;
 
     int e;
 #if defined(HAVE_EPOLL)
@@ -528,7 +1132,7 @@ bool EventLoop::updateSocket(int fd, unsigned int mode)
         ev.events |= EPOLLOUT;
     if (mode & SocketOneShot)
         ev.events |= EPOLLONESHOT;
-    ev.data.fd = fd;
+    ev.data.u64 = socketKey(fd, socket->generation);
     e = epoll_ctl(mPollFd, EPOLL_CTL_MOD, fd, &ev);
 #elif defined(HAVE_KQUEUE)
     e = 0;
@@ -547,6 +1151,7 @@ bool EventLoop::updateSocket(int fd, unsigned int mode)
             ev.flags = EV_ADD|EV_ENABLE;
             if (mode & SocketOneShot)
                 ev.flags |= EV_ONESHOT;
+            ev.udata = reinterpret_cast<void*>(static_cast<uintptr_t>(socket->generation));
         } else {
             assert(oldMode & flags[i].rf);
             ev.flags = EV_DELETE|EV_DISABLE;
@@ -571,13 +1176,21 @@ bool EventLoop::updateSocket(int fd, unsigned int mode)
 void EventLoop::unregisterSocket(int fd)
 {
     std::lock_guard<std::mutex> locker(mMutex);
-    auto socket = mSockets.find(fd);
-    if (socket == mSockets.end())
+    SocketData* socket = socketData(fd);
+    if (!socket)
         return;
 #ifdef HAVE_KQUEUE
-    const int mode = socket->second.first;
+    const int mode = socket->mode;
+#endif
+    socket->callback.reset();
+    --mSocketCount;
+
+#if defined(HAVE_IO_URING)
+    if (mUring) {
+        disarmUring(fd, *socket);
+        return;
+    }
 #endif
-    mSockets.erase(socket);
 
     int e;
 #if defined(HAVE_EPOLL)
@@ -613,8 +1226,255 @@ void EventLoop::unregisterSocket(int fd)
     }
 }
 
+#if defined(HAVE_IO_URING)
+// called with mMutex held
+void EventLoop::armUring(int fd, SocketData& socket)
+{
+    if (!(socket.mode & (SocketRead|SocketWrite)))
+        return;
+    mUringSequence = (mUringSequence + 1) & UringSequenceMask;
+    if (!mUringSequence)
+        mUringSequence = 1;
+    if (!preparePoll(mUring.get(), fd, mUringSequence, socket.mode)) {
+        fprintf(stderr, "Unable to register socket %d with mode %x: io_uring queue full\n", fd, socket.mode);
+        return;
+    }
+    socket.armed = mUringSequence;
+    // the loop thread submits in batches when it goes back to wait
+    if (std::this_thread::get_id() != threadId)
+        mUring->submit();
+}
+
+// called with mMutex held
+void EventLoop::disarmUring(int fd, SocketData& socket)
+{
+    if (!socket.armed)
+        return;
+    if (io_uring_sqe* sqe = mUring->prepare()) {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = socketKey(fd, socket.armed);
+        sqe->user_data = UringIgnore;
+        mUring->commit();
+        if (std::this_thread::get_id() != threadId)
+            mUring->submit();
+    }
+    // a completion of the old poll no longer matches and is dropped
+    socket.armed = 0;
+}
+
+// Waits for completions and turns poll completions into epoll events
+// for processSocketEvents(). I/O operations complete right here.
+int EventLoop::waitUring(NativeEvent* events, int maxEvents, int64_t timeoutUs, bool& idle)
+{
+    if (mUring->wait(timeoutUs) == -1)
+        return -1;
+    int eventCount = 0;
+    while (eventCount < maxEvents) {
+        const io_uring_cqe* cqe = mUring->peek();
+        if (!cqe)
+            break;
+        const uint64_t data = cqe->user_data;
+        const int res = cqe->res;
+        mUring->seen();
+        if (data & UringOperation) {
+            idle = false;
+            completeIo(reinterpret_cast<IoOperation*>(static_cast<uintptr_t>(data & ~UringOperation)), res);
+            continue;
+        }
+        if (data & UringIgnore)
+            continue;
+        const int fd = static_cast<int>(data & 0xffffffff);
+        const uint32_t sequence = static_cast<uint32_t>(data >> 32);
+        uint32_t generation = 0;
+        if (sequence) {
+            std::lock_guard<std::mutex> locker(mMutex);
+            SocketData* socket = socketData(fd);
+            if (!socket || socket->armed != sequence)
+                continue;
+            socket->armed = 0;
+            generation = socket->generation;
+        }
+        // poll(2) and epoll share the event bits
+        memset(&events[eventCount], 0, sizeof(NativeEvent));
+        events[eventCount].events = res < 0 ? EPOLLERR : static_cast<uint32_t>(res);
+        events[eventCount].data.u64 = socketKey(fd, generation);
+        ++eventCount;
+    }
+    return eventCount;
+}
+
+// io_uring polls are one shot, arm them again unless the callback
+// already did or the socket asked for SocketOneShot
+void EventLoop::rearmUring(const NativeEvent* events, int eventCount)
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    for (int i = 0; i < eventCount; ++i) {
+        const int fd = static_cast<int>(events[i].data.u64 & 0xffffffff);
+        const uint32_t generation = static_cast<uint32_t>(events[i].data.u64 >> 32);
+        if (fd == mEventPipe[0]) {
+            preparePoll(mUring.get(), fd, 0, SocketRead);
+            continue;
+        }
+        SocketData* socket = socketData(fd);
+        if (socket && socket->generation == generation && !socket->armed && !(socket->mode & SocketOneShot))
+            armUring(fd, *socket);
+    }
+}
+
+bool EventLoop::submitIo(IoOperation* op)
+{
+    io_uring_sqe* sqe = mUring->prepare();
+    if (!sqe)
+        return false;
+    sqe->fd = op->fd;
+    sqe->off = static_cast<uint64_t>(-1);
+    if (op->write) {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = reinterpret_cast<uintptr_t>(op->buffer.data() + op->offset);
+        sqe->len = op->buffer.size() - op->offset;
+    } else {
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = reinterpret_cast<uintptr_t>(op->buffer.end());
+        sqe->len = op->buffer.capacity() - op->buffer.size();
+    }
+    sqe->user_data = reinterpret_cast<uintptr_t>(op) | UringOperation;
+    mUring->commit();
+    if (std::this_thread::get_id() != threadId)
+        mUring->submit();
+    return true;
+}
+
+void EventLoop::completeIo(IoOperation* op, int result)
+{
+    std::unique_lock<std::mutex> locker(mMutex);
+    if (op->callback && result > 0) {
+        if (!op->write) {
+            op->buffer.resize(op->buffer.size() + result);
+        } else {
+            op->transferred += result;
+            op->offset += result;
+            // short write, send the rest
+            if (op->offset < op->buffer.size() && submitIo(op))
+                return;
+        }
+    }
+    mIoOperations.erase(op);
+    IoCallback callback = std::move(op->callback);
+    locker.unlock();
+    if (callback) {
+        if (op->write && result > 0)
+            result = op->transferred;
+        CALLBACK(IoSource, op->fd, 0, callback(result, std::move(op->buffer)));
+    }
+    delete op;
+}
+#endif
+
+bool EventLoop::hasIoUring() const
+{
+#if defined(HAVE_IO_URING)
+    return mUring.get() != 0;
+#else
+    return false;
+#endif
+}
+
+uint64_t EventLoop::submitRead(int fd, Buffer&& buffer, IoCallback&& callback)
+{
+#if defined(HAVE_IO_URING)
+    std::lock_guard<std::mutex> locker(mMutex);
+    if (!mUring)
+        return 0;
+    IoOperation* op = new IoOperation;
+    op->callback = std::move(callback);
+    op->buffer = std::move(buffer);
+    op->offset = 0;
+    op->fd = fd;
+    op->write = false;
+    op->transferred = 0;
+    assert(op->buffer.capacity() > op->buffer.size());
+    if (!submitIo(op)) {
+        buffer = std::move(op->buffer);
+        delete op;
+        return 0;
+    }
+    mIoOperations.insert(op);
+    return reinterpret_cast<uintptr_t>(op);
+#else
+    (void)fd;
+    (void)buffer;
+    (void)callback;
+    return 0;
+#endif
+}
+
+uint64_t EventLoop::submitWrite(int fd, Buffer&& buffer, size_t offset, IoCallback&& callback)
+{
+#if defined(HAVE_IO_URING)
+    std::lock_guard<std::mutex> locker(mMutex);
+    if (!mUring)
+        return 0;
+    IoOperation* op = new IoOperation;
+    op->callback = std::move(callback);
+    op->buffer = std::move(buffer);
+    op->offset = offset;
+    op->fd = fd;
+    op->write = true;
+    op->transferred = 0;
+    assert(offset < op->buffer.size());
+    if (!submitIo(op)) {
+        buffer = std::move(op->buffer);
+        delete op;
+        return 0;
+    }
+    mIoOperations.insert(op);
+    return reinterpret_cast<uintptr_t>(op);
+#else
+    (void)fd;
+    (void)buffer;
+    (void)offset;
+    (void)callback;
+    return 0;
+#endif
+}
+
+void EventLoop::cancelIo(uint64_t id)
+{
+#if defined(HAVE_IO_URING)
+    std::lock_guard<std::mutex> locker(mMutex);
+    IoOperation* op = reinterpret_cast<IoOperation*>(static_cast<uintptr_t>(id));
+    if (!mUring || !mIoOperations.count(op))
+        return;
+    op->callback = IoCallback();
+    if (io_uring_sqe* sqe = mUring->prepare()) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = reinterpret_cast<uintptr_t>(op) | UringOperation;
+        sqe->user_data = UringIgnore;
+        mUring->commit();
+        if (std::this_thread::get_id() != threadId)
+            mUring->submit();
+    }
+#else
+    (void)id;
+#endif
+}
+
+size_t EventLoop::socketCount() const
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    return mSocketCount;
+}
+
 unsigned int EventLoop::processSocket(int fd, int timeout)
 {
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+    uint32_t generation = 0;
+    {
+        std::lock_guard<std::mutex> locker(mMutex);
+        if (const SocketData* socket = socketData(fd))
+            generation = socket->generation;
+    }
+#endif
     int eventCount;
 #if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
     enum { MaxEvents = 2 };
@@ -627,7 +1487,7 @@ unsigned int EventLoop::processSocket(int fd, int timeout)
     epoll_event ev;
     memset(&ev, 0, sizeof(ev));
     ev.events = EPOLLET|EPOLLRDHUP|EPOLLIN|EPOLLOUT;
-    ev.data.fd = fd;
+    ev.data.u64 = socketKey(fd, generation);
     epoll_ctl(processFd, EPOLL_CTL_ADD, fd, &ev);
 
     eintrwrap(eventCount, epoll_wait(processFd, events, MaxEvents, timeout));
@@ -645,6 +1505,7 @@ unsigned int EventLoop::processSocket(int fd, int timeout)
         ev.ident = fd;
         ev.flags = EV_ADD|EV_ENABLE;
         ev.filter = flags[i].kf;
+        ev.udata = reinterpret_cast<void*>(static_cast<uintptr_t>(generation));
         eintrwrap(e, kevent(processFd, &ev, 1, 0, 0, 0));
     }
 
@@ -684,14 +1545,17 @@ unsigned int EventLoop::processSocket(int fd, int timeout)
     return processSocketEvents(events, eventCount);
 }
 
-unsigned int EventLoop::fireSocket(int fd, unsigned int mode)
+unsigned int EventLoop::fireSocket(int fd, uint32_t generation, unsigned int mode)
 {
     std::unique_lock<std::mutex> locker(mMutex);
-    const auto socket = mSockets.find(fd);
-    if (socket != mSockets.end()) {
-        const auto callback = socket->second.second;
+    const SocketData* socket = socketData(fd);
+    // the socket may have been unregistered, and the fd reused, by a
+    // callback earlier in this batch
+    if (socket && socket->generation == generation) {
+        // keep the callback alive even if it unregisters itself
+        const std::shared_ptr<std::function<void(int, unsigned int)> > callback = socket->callback;
         locker.unlock();
-        CALLBACK(callback(fd, mode));
+        CALLBACK(SocketSource, fd, 0, (*callback)(fd, mode));
         return mode;
     }
     return 0;
@@ -700,14 +1564,18 @@ unsigned int EventLoop::fireSocket(int fd, unsigned int mode)
 unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
 {
     unsigned int all = 0;
+#if defined(HAVE_EPOLL)
     int e;
+#endif
 
 #if defined(HAVE_SELECT)
-    std::map<int, std::pair<unsigned int, std::function<void(int, unsigned int)> > > local;
+    std::vector<std::pair<int, uint32_t> > local;
     {
-#warning this is not optimal
         std::lock_guard<std::mutex> locker(mMutex);
-        local = mSockets;
+        for (size_t fd = 0; fd < mSockets.size(); ++fd) {
+            if (mSockets[fd].callback)
+                local.push_back(std::make_pair(static_cast<int>(fd), mSockets[fd].generation));
+        }
     }
     auto socket = local.begin();
     if (socket == local.end()) {
@@ -720,13 +1588,17 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
         unsigned int mode = 0;
 #if defined(HAVE_EPOLL)
         const uint32_t ev = events[i].events;
-        const int fd = events[i].data.fd;
+        const int fd = static_cast<int>(events[i].data.u64 & 0xffffffff);
+        const uint32_t generation = static_cast<uint32_t>(events[i].data.u64 >> 32);
         if (ev & (EPOLLERR|EPOLLHUP) && !(ev & EPOLLRDHUP)) {
             // bad, take the fd out
             epoll_ctl(mPollFd, EPOLL_CTL_DEL, fd, &events[i]);
             {
                 std::lock_guard<std::mutex> locker(mMutex);
-                mSockets.erase(fd);
+                if (SocketData* socket = socketData(fd)) {
+                    socket->callback.reset();
+                    --mSocketCount;
+                }
             }
             if (ev & EPOLLERR) {
                 int err;
@@ -750,7 +1622,7 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
                 }
             }
 
-            all |= fireSocket(fd, mode);
+            all |= fireSocket(fd, generation, mode);
             continue;
         }
         if (ev & (EPOLLIN|EPOLLRDHUP)) {
@@ -765,6 +1637,7 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
         const int16_t filter = events[i].filter;
         const uint16_t flags = events[i].flags;
         const int fd = events[i].ident;
+        const uint32_t generation = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(events[i].udata));
         if (flags & EV_ERROR) {
             // bad, take the fd out
             struct kevent& kev = events[i];
@@ -773,11 +1646,14 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
             kevent(mPollFd, &kev, 1, 0, 0, 0);
             {
                 std::lock_guard<std::mutex> locker(mMutex);
-                mSockets.erase(fd);
+                if (SocketData* socket = socketData(fd)) {
+                    socket->callback.reset();
+                    --mSocketCount;
+                }
             }
             fprintf(stderr, "Error on socket %d, removing: %d (%s)\n", fd, err, Rct::strerror().constData());
 
-            all |= fireSocket(fd, SocketError);
+            all |= fireSocket(fd, generation, SocketError);
             continue;
         }
         if (filter == EVFILT_READ)
@@ -787,11 +1663,13 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
 #elif defined(HAVE_SELECT)
         // iterate through the sockets until we find one in either fd_set
         int fd = -1;
+        uint32_t generation = 0;
         //assert(socket != local.end());
         while (socket != local.end()) {
             if (FD_ISSET(socket->first, events->rdfd)) {
                 // go
                 fd = socket->first;
+                generation = socket->second;
                 mode |= SocketRead;
                 ++socket;
                 break;
@@ -799,6 +1677,7 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
             if (events->wrfd && FD_ISSET(socket->first, events->wrfd)) {
                 // go
                 fd = socket->first;
+                generation = socket->second;
                 mode |= SocketWrite;
                 ++socket;
                 break;
@@ -815,22 +1694,18 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
 #endif
         if (mode) {
             if (fd == mEventPipe[0]) {
-                // drain the pipe
-                char q;
-                do {
-                    eintrwrap(e, ::read(mEventPipe[0], &q, 1));
-                    if (e == 1 && q == 'q') {
-                        // signal caught, we need to shut down
-                        return Success;
-                    }
-                } while (e == 1);
-                if (e == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                    // error
-                    fprintf(stderr, "Error reading from event pipe: %d (%s)\n", errno, Rct::strerror().constData());
-                    return GeneralError;
-                }
+                if (const unsigned int ret = drainWakeup())
+                    return ret;
+#if defined(HAVE_TIMERFD)
+            } else if (fd == mTimerFd) {
+                // the timers themselves fire from exec()
+                uint64_t expirations;
+                ssize_t count;
+                eintrwrap(count, ::read(mTimerFd, &expirations, sizeof(expirations)));
+                mTimerFdDeadline = 0;
+#endif
             } else {
-                all |= fireSocket(fd, mode);
+                all |= fireSocket(fd, generation, mode);
             }
         }
     }
@@ -850,12 +1725,40 @@ unsigned int EventLoop::exec(int timeoutTime)
     NativeEvent events[MaxEvents];
 #endif
 
+    ++mExecLevel;
+    const std::atomic<uint64_t> *outerLoopTime = tLoopTime;
+    tLoopTime = &mLoopTime;
+    updateTime();
     for (;;) {
+        unsigned int postedBudget = mPostedBudget.load(std::memory_order_relaxed);
+        unsigned int timerBudget = mTimerBudget.load(std::memory_order_relaxed);
+        if (!postedBudget)
+            postedBudget = UINT_MAX;
+        if (!timerBudget)
+            timerBudget = UINT_MAX;
         for (;;) {
-            if (!sendPostedEvents() && !sendTimers())
+            const bool posted = sendPostedEvents(postedBudget);
+            const bool timers = sendTimers(timerBudget);
+            if (!postedBudget || !timerBudget || (!posted && !timers))
                 break;
         }
-        int waitUntil = -1;
+        // out of budget, there may be more to do once the sockets have
+        // had their turn
+        const bool yield = !postedBudget || !timerBudget;
+        if (yield) {
+            std::lock_guard<std::mutex> locker(mStatisticsMutex);
+            if (!postedBudget)
+                ++mStatistics.postedBudgetHits;
+            if (!timerBudget)
+                ++mStatistics.timerBudgetHits;
+        }
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+        const unsigned int socketBudget = mSocketBudget.load(std::memory_order_relaxed);
+        const int maxEvents = socketBudget && socketBudget < MaxEvents ? static_cast<int>(socketBudget) : MaxEvents;
+#endif
+        updateTime();
+        // microseconds
+        int64_t waitUs = -1;
         bool waitingForInactivityTimeout = false;
         {
             std::lock_guard<std::mutex> locker(mMutex);
@@ -872,37 +1775,93 @@ unsigned int EventLoop::exec(int timeoutTime)
                 break;
             }
 
-            const auto timer = mTimersByTime.begin();
-            if (timer != mTimersByTime.end()) {
-                const uint64_t now = currentTime();
-                waitUntil = std::max<int>((*timer)->when - now, 0);
+            // in timer units
+            int64_t waitUntil = -1;
+            if (mTimerWheel) {
+                waitUntil = mTimerWheel->nextTimeout(timerTime());
+            } else {
+                const auto timer = mTimersByTime.begin();
+                if (timer != mTimersByTime.end()) {
+                    const uint64_t now = timerTime();
+                    waitUntil = (*timer)->when > now ? (*timer)->when - now : 0;
+                }
             }
-
-            if (mInactivityTimeout > 0) {
-                if (waitUntil < 0) {
-                    waitUntil = mInactivityTimeout;
+            if (waitUntil >= 0)
+                waitUs = mFlags & EnableHighResTimers ? waitUntil : waitUntil * 1000;
+
+            if (yield) {
+                waitUs = 0;
+            } else if (mInactivityTimeout > 0) {
+                if (waitUs < 0) {
+                    waitUs = mInactivityTimeout * 1000LL;
                     waitingForInactivityTimeout = true;
                 }
             }
         }
+        const bool instrumented = mInstrumentation.load(std::memory_order_relaxed);
+        const uint64_t waitStarted = instrumented ? StopWatch::current(StopWatch::Microsecond) : 0;
         int eventCount;
+#if defined(HAVE_IO_URING)
+        if (mUring) {
+            eventCount = waitUring(events, maxEvents, waitUs, waitingForInactivityTimeout);
+        } else
+#endif
 #if defined(HAVE_EPOLL)
-        eintrwrap(eventCount, epoll_wait(mPollFd, events, MaxEvents, waitUntil));
+        {
+            // round up, waking early would just spin
+            int timeout = waitUs < 0 ? -1 : static_cast<int>(std::min<int64_t>((waitUs + 999) / 1000, INT_MAX));
+#if defined(HAVE_TIMERFD)
+            if (mTimerFd != -1 && waitUs > 0 && !waitingForInactivityTimeout) {
+                const uint64_t deadline = mLoopTime.load(std::memory_order_relaxed) + waitUs;
+                if (deadline != mTimerFdDeadline) {
+                    itimerspec spec;
+                    memset(&spec, 0, sizeof(spec));
+                    spec.it_value.tv_sec = waitUs / 1000000;
+                    spec.it_value.tv_nsec = (waitUs % 1000000) * 1000;
+                    if (timerfd_settime(mTimerFd, 0, &spec, 0) == 0)
+                        mTimerFdDeadline = deadline;
+                }
+                if (deadline == mTimerFdDeadline)
+                    timeout = -1;
+            }
+#endif
+            eventCount = 0;
+            const int64_t busyPoll = mBusyPoll.load(std::memory_order_relaxed);
+            if (busyPoll > 0 && waitUs != 0) {
+                const uint64_t spinStarted = StopWatch::current(StopWatch::Microsecond);
+                const int64_t spinUs = waitUs < 0 ? busyPoll : std::min(busyPoll, waitUs);
+                int64_t spun = 0;
+                do {
+                    eintrwrap(eventCount, epoll_wait(mPollFd, events, maxEvents, 0));
+                    spun = StopWatch::current(StopWatch::Microsecond) - spinStarted;
+                } while (!eventCount && spun < spinUs);
+                if (eventCount > 0) {
+                    std::lock_guard<std::mutex> locker(mStatisticsMutex);
+                    ++mStatistics.busyPollHits;
+                } else if (!eventCount && timeout > 0) {
+                    // the timerfd deadline doesn't move, only what's left
+                    // of the wait
+                    timeout = static_cast<int>(std::max<int64_t>((waitUs - spun + 999) / 1000, 0));
+                }
+            }
+            if (!eventCount)
+                eintrwrap(eventCount, epoll_wait(mPollFd, events, maxEvents, timeout));
+        }
 #elif defined(HAVE_KQUEUE)
         timespec timeout;
         timespec* timeptr = 0;
-        if (waitUntil != -1) {
-            timeout.tv_sec = waitUntil / 1000;
-            timeout.tv_nsec = (waitUntil % 1000LLU) * 1000000;
+        if (waitUs != -1) {
+            timeout.tv_sec = waitUs / 1000000;
+            timeout.tv_nsec = (waitUs % 1000000) * 1000;
             timeptr = &timeout;
         }
-        eintrwrap(eventCount, kevent(mPollFd, 0, 0, events, MaxEvents, timeptr));
+        eintrwrap(eventCount, kevent(mPollFd, 0, 0, events, maxEvents, timeptr));
 #elif defined(HAVE_SELECT)
         timeval timeout;
         timeval* timeptr = 0;
-        if (waitUntil != -1) {
-            timeout.tv_sec = waitUntil / 1000;
-            timeout.tv_usec = (waitUntil % 1000LLU) * 1000;
+        if (waitUs != -1) {
+            timeout.tv_sec = waitUs / 1000000;
+            timeout.tv_usec = waitUs % 1000000;
             timeptr = &timeout;
         }
 
@@ -914,29 +1873,42 @@ unsigned int EventLoop::exec(int timeoutTime)
         FD_SET(max, &rdfd);
         {
             std::lock_guard<std::mutex> locker(mMutex);
-            auto s = mSockets.begin();
-            const auto e = mSockets.end();
-            while (s != e) {
-                if (s->second.first & SocketRead) {
-                    FD_SET(s->first, &rdfd);
+            for (int fd = 0; fd < static_cast<int>(mSockets.size()); ++fd) {
+                const SocketData& s = mSockets[fd];
+                if (!s.callback)
+                    continue;
+                if (s.mode & SocketRead) {
+                    FD_SET(fd, &rdfd);
                 }
-                if (s->second.first & SocketWrite) {
+                if (s.mode & SocketWrite) {
                     if (!wrfdp)
                         wrfdp = &wrfd;
-                    FD_SET(s->first, wrfdp);
+                    FD_SET(fd, wrfdp);
                 }
-                max = std::max(max, s->first);
-                ++s;
+                max = std::max(max, fd);
             }
         }
 
         eintrwrap(eventCount, select(max + 1, &rdfd, wrfdp, 0, timeptr));
 #endif
+        updateTime();
+        if (instrumented) {
+            const uint64_t blocked = StopWatch::current(StopWatch::Microsecond) - waitStarted;
+            std::lock_guard<std::mutex> locker(mStatisticsMutex);
+            ++mStatistics.iterations;
+            mStatistics.blockedUs += blocked;
+        }
         if (eventCount < 0) {
             // bad
             ret = GeneralError;
             break;
         } else if (eventCount) {
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+            if (eventCount == maxEvents && maxEvents < MaxEvents) {
+                std::lock_guard<std::mutex> locker(mStatisticsMutex);
+                ++mStatistics.socketBudgetHits;
+            }
+#endif
 #if defined(HAVE_SELECT)
             NativeEvent event;
             event.rdfd = &rdfd;
@@ -944,6 +1916,10 @@ unsigned int EventLoop::exec(int timeoutTime)
             NativeEvent* events = &event;
 #endif
             ret = processSocketEvents(events, eventCount);
+#if defined(HAVE_IO_URING)
+            if (mUring)
+                rearmUring(events, eventCount);
+#endif
             if (ret & (Success|GeneralError|Timeout))
                 break;
         } else if (eventCount == 0 && waitingForInactivityTimeout) {
@@ -952,6 +1928,8 @@ unsigned int EventLoop::exec(int timeoutTime)
         }
     }
 
+    tLoopTime = outerLoopTime;
+    --mExecLevel;
     if (quitTimerId != -1)
         clearTimer(quitTimerId);
     return ret;
@@ -1,9 +1,11 @@
 #ifndef EVENTLOOP_H // -*- mode:c++ -*-
 #define EVENTLOOP_H
 
+#include <atomic>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <queue>
 #include <set>
 #include <thread>
@@ -12,6 +14,7 @@
 #include <vector>
 
 #include <rct/Apply.h>
+#include <rct/TimerWheel.h>
 #include <rct/rct-config.h>
 #if defined(HAVE_EPOLL)
 #  include <sys/epoll.h>
@@ -23,11 +26,31 @@
 #  include <sys/select.h>
 #endif
 
+class Buffer;
+class BufferPool;
+#if defined(HAVE_IO_URING)
+class IoUring;
+#endif
+
 class Event
 {
 public:
+    Event() : mNext(0), mAllocation(New), mCell(0), mTraceFlow(0) { }
     virtual ~Event() { }
     virtual void exec() = 0;
+
+private:
+    // intrusive link for EventLoop's posted event queue
+    Event* mNext;
+    // events created by EventLoop's post templates come from its cell
+    // pool, those passed to post(Event*) are deleted
+    enum Allocation { New, Heap, LocalCell, SharedCell };
+    unsigned char mAllocation;
+    uint32_t mCell;
+    // from post() to exec() while tracing
+    uint64_t mTraceFlow;
+
+    friend class EventLoop;
 };
 
 template<typename Object, typename... Args>
@@ -88,12 +111,28 @@ public:
         None = 0x0,
         MainEventLoop = 0x1,
         EnableSigIntHandler = 0x2,
-        EnableSigTermHandler = 0x4
+        EnableSigTermHandler = 0x4,
+        EnableTimerWheel = 0x8,
+        // poll and do I/O through io_uring, falls back to epoll if the
+        // kernel doesn't support it
+        EnableIoUring = 0x10,
+        // timers with microsecond resolution, epoll waits for them with
+        // a timerfd
+        EnableHighResTimers = 0x20
     };
     enum PostType {
         Move = 1,
         Async
     };
+    enum Priority {
+        // runs before other posted events and isn't limited by the
+        // scheduling policy's postedBudget
+        UrgentPriority,
+        NormalPriority,
+        // runs once there are no normal events left
+        BulkPriority,
+        PriorityCount
+    };
 
     void init(unsigned int flags = None);
 
@@ -102,8 +141,10 @@ public:
     template<typename T>
     static void deleteLater(T* del)
     {
-        if (EventLoop::SharedPtr loop = eventLoop()) {
-            loop->post(new DeleteLaterEvent<T>(del));
+        if (EventLoop* loop = current()) {
+            loop->postEvent<DeleteLaterEvent<T> >(NormalPriority, del);
+        } else if (EventLoop::SharedPtr shared = eventLoop()) {
+            shared->postEvent<DeleteLaterEvent<T> >(NormalPriority, del);
         } else {
             error("No event loop!");
         }
@@ -111,24 +152,29 @@ public:
     template<typename Object, typename... Args>
     void post(Object& object, Args&&... args)
     {
-        post(new SignalEvent<Object, Args...>(object, std::forward<Args>(args)...));
+        postEvent<SignalEvent<Object, Args...> >(NormalPriority, object, std::forward<Args>(args)...);
     }
     template<typename Object, typename... Args>
     void postMove(Object& object, Args&&... args)
     {
-        post(new SignalEvent<Object, Args...>(object, SignalEvent<Object, Args...>::Move, std::forward<Args>(args)...));
+        postEvent<SignalEvent<Object, Args...> >(NormalPriority, object, SignalEvent<Object, Args...>::Move, std::forward<Args>(args)...);
     }
     template<typename Object, typename... Args>
     void callLater(Object&& object, Args&&... args)
     {
-        post(new SignalEvent<Object, Args...>(std::forward<Object>(object), std::forward<Args>(args)...));
+        postEvent<SignalEvent<Object, Args...> >(NormalPriority, std::forward<Object>(object), std::forward<Args>(args)...);
     }
     template<typename Object, typename... Args>
     void callLaterMove(Object&& object, Args&&... args)
     {
-        post(new SignalEvent<Object, Args...>(std::forward<Object>(object), SignalEvent<Object, Args...>::Move, std::forward<Args>(args)...));
+        postEvent<SignalEvent<Object, Args...> >(NormalPriority, std::forward<Object>(object), SignalEvent<Object, Args...>::Move, std::forward<Args>(args)...);
+    }
+    template<typename Object, typename... Args>
+    void callLaterWithPriority(Priority priority, Object&& object, Args&&... args)
+    {
+        postEvent<SignalEvent<Object, Args...> >(priority, std::forward<Object>(object), std::forward<Args>(args)...);
     }
-    void post(Event* event);
+    void post(Event* event, Priority priority = NormalPriority);
     void wakeup();
 
     enum Mode {
@@ -142,16 +188,99 @@ public:
     bool updateSocket(int fd, unsigned int mode);
     void unregisterSocket(int fd);
     unsigned int processSocket(int fd, int timeout = -1);
+    // number of registered sockets
+    size_t socketCount() const;
+    // where the sockets of this loop get their read buffers from
+    const std::shared_ptr<BufferPool> &bufferPool() const { return mBufferPool; }
+
+    // Completion based I/O, only available when the loop runs on
+    // io_uring. Reads fill the free capacity of the buffer. The callback
+    // is called on the loop thread with the number of bytes transferred
+    // or -errno and gets the buffer back. Writes are retried until the
+    // whole buffer from offset is written. Returns 0 on failure.
+    typedef std::function<void(int, Buffer&&)> IoCallback;
+    bool hasIoUring() const;
+    uint64_t submitRead(int fd, Buffer&& buffer, IoCallback&& callback);
+    uint64_t submitWrite(int fd, Buffer&& buffer, size_t offset, IoCallback&& callback);
+    // the callback of a cancelled operation is never called
+    void cancelIo(uint64_t id);
 
     // See Timer.h for the flags
     int registerTimer(std::function<void(int)>&& func, int timeout, unsigned int flags = 0);
+    // timeout in microseconds, rounded up to milliseconds unless the loop
+    // has EnableHighResTimers
+    int registerTimerUs(std::function<void(int)>&& func, uint64_t timeout, unsigned int flags = 0);
     void unregisterTimer(int id);
 
+    // Monotonic time in microseconds. On the loop thread this is cached
+    // once per iteration of exec() and timers registered from callbacks
+    // count from it.
+    uint64_t now() const;
+    // now() of the loop running on the calling thread without looking it
+    // up, the clock on threads without one
+    static uint64_t threadNow();
+
+    // Limits on what one iteration of exec() dispatches, 0 means no
+    // limit. Once a budget runs out the loop polls its sockets without
+    // blocking and continues on the next iteration. socketBudget is
+    // capped at the 64 events exec() polls for at a time.
+    struct SchedulingPolicy
+    {
+        SchedulingPolicy() : postedBudget(0), timerBudget(0), socketBudget(0) { }
+        unsigned int postedBudget, timerBudget, socketBudget;
+    };
+    void setSchedulingPolicy(const SchedulingPolicy& policy);
+    SchedulingPolicy schedulingPolicy() const;
+
+    // Polls without blocking for up to us microseconds before going to
+    // sleep, trading a core for not paying for a sleep and a scheduler
+    // round trip on every wakeup. Meant for a loop of its own with a few
+    // latency critical sockets, see SocketClient::pinToLoop(). 0, the
+    // default, blocks right away. epoll only.
+    void setBusyPoll(int us) { mBusyPoll.store(us, std::memory_order_relaxed); }
+    int busyPoll() const { return mBusyPoll.load(std::memory_order_relaxed); }
+
     // Changes to the inactivity timeout while the loop is running may
     // not be honoured.
     int inactivityTimeout() const { return mInactivityTimeout; }
     void setInactivityTimeout(int timeout) { mInactivityTimeout = timeout; }
 
+    // Optional instrumentation of exec(). While enabled every dispatched
+    // callback is timed into a histogram for its source and callbacks
+    // slower than the threshold are logged with their fd or timer id.
+    // When disabled it costs a branch per callback.
+    struct Statistics
+    {
+        enum Source { SocketSource, TimerSource, PostedSource, IoSource, SourceCount };
+        // bucket i counts callbacks that took less than 2^i us, the last
+        // one everything slower
+        enum { BucketCount = 24 };
+        struct Histogram
+        {
+            uint64_t count, totalUs, maxUs;
+            uint64_t buckets[BucketCount];
+        };
+        Histogram histograms[SourceCount];
+        uint64_t iterations;
+        // time spent waiting for events
+        uint64_t blockedUs;
+        uint64_t slowCallbacks;
+        // iterations that ran out of a SchedulingPolicy budget, counted
+        // whether instrumentation is enabled or not
+        uint64_t postedBudgetHits, timerBudgetHits, socketBudgetHits;
+        // iterations whose events turned up while busy polling
+        uint64_t busyPollHits;
+    };
+    void setInstrumentationEnabled(bool enabled) { mInstrumentation.store(enabled, std::memory_order_relaxed); }
+    bool isInstrumentationEnabled() const { return mInstrumentation.load(std::memory_order_relaxed); }
+    // ms, 0 disables the warnings
+    void setSlowCallbackThreshold(int threshold) { mSlowCallbackThreshold.store(threshold, std::memory_order_relaxed); }
+    int slowCallbackThreshold() const { return mSlowCallbackThreshold.load(std::memory_order_relaxed); }
+    // safe to call from any thread, also exported by Metrics::instance()
+    // with a loop label that counts the loops created
+    Statistics statistics() const;
+    void resetStatistics();
+
     enum { Success = 0x100, GeneralError = 0x200, Timeout = 0x400 };
     unsigned int exec(int timeout = -1);
     void quit();
@@ -159,7 +288,14 @@ public:
     //bool isRunning() const { std::lock_guard<std::mutex> locker(mutex); return !mExecStack.empty(); }
 
     static EventLoop::SharedPtr mainEventLoop() { std::lock_guard<std::mutex> locker(mMainMutex); return sMainLoop.lock(); }
+    // the loop of this thread, or the main loop if it has none
     static EventLoop::SharedPtr eventLoop();
+    // Same as eventLoop() without touching reference counts. Only this
+    // thread's own loop, never the main loop of another thread, and only
+    // valid for as long as that loop runs.
+    static EventLoop* current();
+    // eventLoop() for keeping, without taking a strong reference first
+    static EventLoop::WeakPtr weakEventLoop();
     static void cleanupLocalEventLoop();
 
     static bool isMainThread() { return EventLoop::mainEventLoop() && std::this_thread::get_id() == EventLoop::mainEventLoop()->threadId; }
@@ -176,12 +312,44 @@ private:
     };
 #endif
 
+    template<typename T, typename... Args>
+    void postEvent(Priority priority, Args&&... args)
+    {
+        unsigned char allocation;
+        uint32_t cell;
+        Event* event = new (allocateEvent(sizeof(T), allocation, cell)) T(std::forward<Args>(args)...);
+        event->mAllocation = allocation;
+        event->mCell = cell;
+        post(event, priority);
+    }
+    void* allocateEvent(size_t size, unsigned char& allocation, uint32_t& cell);
+    void releaseEvent(Event* event);
+
+    int addTimer(std::function<void(int)>&& func, uint64_t timeout, unsigned int flags);
+    // in timer units, microseconds with EnableHighResTimers
+    uint64_t timerTime() const;
+    void updateTime();
     void clearTimer(int id);
-    bool sendPostedEvents();
-    bool sendTimers();
+    // the budgets count down, UINT_MAX for no limit
+    bool sendPostedEvents(unsigned int& budget);
+    unsigned int drainWakeup();
+    bool sendTimers(unsigned int& budget);
+    bool sendWheelTimers(unsigned int& budget);
     void cleanup();
     unsigned int processSocketEvents(NativeEvent* events, int eventCount);
-    unsigned int fireSocket(int fd, unsigned int mode);
+    unsigned int fireSocket(int fd, uint32_t generation, unsigned int mode);
+#if defined(HAVE_IO_URING)
+    struct IoOperation;
+    struct SocketData;
+    int waitUring(NativeEvent* events, int maxEvents, int64_t timeoutUs, bool& idle);
+    void rearmUring(const NativeEvent* events, int eventCount);
+    void armUring(int fd, SocketData& socket);
+    void disarmUring(int fd, SocketData& socket);
+    bool submitIo(IoOperation* op);
+    void completeIo(IoOperation* op, int result);
+#endif
+
+    void recordCallback(Statistics::Source source, int id, uint64_t started);
 
     static void error(const char* err);
 
@@ -190,19 +358,95 @@ private:
     mutable std::mutex mMutex;
     std::thread::id threadId;
 
-    std::queue<Event*> mEvents;
+#if defined(RCT_EVENTLOOP_LOCKFREE_POST)
+    // Multi-producer/single-consumer stacks of posted events, one per
+    // priority. Producers push with a CAS, the loop thread takes the
+    // whole list in one exchange and reverses it onto mDeferredEvents,
+    // where what didn't fit in the budget waits in posting order.
+    std::atomic<Event*> mPostedEvents[PriorityCount];
+    Event* mDeferredEvents[PriorityCount];
+    Event* mDeferredLast[PriorityCount];
+#else
+    std::queue<Event*> mEvents[PriorityCount];
+#endif
+    // Set by the first wakeup() after the loop last drained the
+    // wakeup fd, subsequent wakeups don't need to write to it.
+    std::atomic<bool> mWakeupPending;
+    // With eventfd both ends refer to the same descriptor
     int mEventPipe[2];
+
+    // Fixed size cells for posted events, carved out of slabs that live
+    // as long as the loop. Cells are referred to by index + 1 so a list
+    // head fits in 32 bits. Only the loop thread touches mFreeCells,
+    // other threads pop mSharedCells, a lock-free stack whose head
+    // carries a counter in the upper 32 bits against ABA. The loop
+    // thread hands shared cells back in batches. Bigger events, and
+    // everything once MaxEventSlabs is reached, use the heap.
+    enum {
+        EventCellSize = 128,
+        EventSlabShift = 6,
+        EventSlabSize = 1 << EventSlabShift,
+        MaxEventSlabs = 1024
+    };
+    union EventCell
+    {
+        uint32_t next;
+        long double align;
+        unsigned char data[EventCellSize];
+    };
+    uint32_t mFreeCells;
+    std::atomic<uint64_t> mSharedCells;
+    uint32_t mReleasedCells, mReleasedLast, mReleasedCount;
+    std::mutex mCellMutex;
+    size_t mEventSlabCount;
+    std::unique_ptr<EventCell[]> mEventSlabs[MaxEventSlabs];
+    EventCell* eventCell(uint32_t index) const
+    {
+        --index;
+        return mEventSlabs[index >> EventSlabShift].get() + (index & (EventSlabSize - 1));
+    }
+    uint32_t allocateSlab();
+    void pushSharedCells(uint32_t first, uint32_t last);
+    void flushReleasedCells();
 #if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
     int mPollFd;
 #endif
 
-    std::map<int, std::pair<unsigned int, std::function<void(int, unsigned int)> > > mSockets;
+    struct SocketData
+    {
+        SocketData()
+            : mode(0), generation(0)
+#if defined(HAVE_IO_URING)
+            , armed(0)
+#endif
+        {
+        }
+
+        unsigned int mode;
+        // bumped for every new registration of the fd
+        uint32_t generation;
+#if defined(HAVE_IO_URING)
+        // sequence number of the io_uring poll in flight, 0 if none
+        uint32_t armed;
+#endif
+        // null when the fd isn't registered
+        std::shared_ptr<std::function<void(int, unsigned int)> > callback;
+    };
+    // indexed by fd
+    std::vector<SocketData> mSockets;
+    size_t mSocketCount;
+    SocketData* socketData(int fd)
+    {
+        if (fd < 0 || static_cast<size_t>(fd) >= mSockets.size() || !mSockets[fd].callback)
+            return 0;
+        return &mSockets[fd];
+    }
 
     class TimerData
     {
     public:
         TimerData() { }
-        TimerData(uint64_t w, int i, unsigned int f, int in, std::function<void(int)>&& cb)
+        TimerData(uint64_t w, int i, unsigned int f, uint64_t in, std::function<void(int)>&& cb)
             : when(w), id(i), flags(f), interval(in), callback(std::move(cb))
         {
         }
@@ -229,7 +473,7 @@ private:
         uint64_t when;
         uint32_t id;
         unsigned int flags;
-        int interval;
+        uint64_t interval;
         std::function<void(int)> callback;
 
     private:
@@ -253,6 +497,38 @@ private:
     TimersById mTimersById;
     uint32_t mNextTimerId;
 
+    // replaces the two sets above with EnableTimerWheel
+    std::unique_ptr<TimerWheel> mTimerWheel;
+
+    std::shared_ptr<BufferPool> mBufferPool;
+
+    std::atomic<uint64_t> mLoopTime;
+    // nesting of exec(), mLoopTime is only used while it's running
+    int mExecLevel;
+#if defined(HAVE_TIMERFD)
+    // wakes epoll for EnableHighResTimers, mTimerFdDeadline is the
+    // timer time it is armed for or 0
+    int mTimerFd;
+    uint64_t mTimerFdDeadline;
+#endif
+
+#if defined(HAVE_IO_URING)
+    // replaces mPollFd with EnableIoUring
+    std::unique_ptr<IoUring> mUring;
+    uint32_t mUringSequence;
+    std::unordered_set<IoOperation*> mIoOperations;
+#endif
+
+    std::atomic<unsigned int> mPostedBudget, mTimerBudget, mSocketBudget;
+    std::atomic<int> mBusyPoll;
+
+    std::atomic<bool> mInstrumentation;
+    std::atomic<int> mSlowCallbackThreshold;
+    mutable std::mutex mStatisticsMutex;
+    Statistics mStatistics;
+    // of Metrics::instance()
+    int mMetricsCollector;
+
     bool mStop;
     bool mTimeout;
 
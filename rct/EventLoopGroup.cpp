@@ -0,0 +1,101 @@
+#include "EventLoopGroup.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <thread>
+
+#include "Thread.h"
+
+class EventLoopThread : public Thread
+{
+public:
+    EventLoopThread(EventLoopGroup *group, unsigned int flags)
+        : mGroup(group), mFlags(flags)
+    {
+    }
+
+protected:
+    virtual void run()
+    {
+        EventLoop::SharedPtr loop(new EventLoop);
+        loop->init(mFlags);
+        mGroup->loopStarted(loop);
+        loop->exec();
+    }
+
+private:
+    EventLoopGroup *mGroup;
+    const unsigned int mFlags;
+};
+
+EventLoopGroup::EventLoopGroup()
+    : mNext(0), mStarted(0)
+{
+}
+
+EventLoopGroup::~EventLoopGroup()
+{
+    stop();
+}
+
+bool EventLoopGroup::start(size_t count, unsigned int flags)
+{
+    if (!mThreads.empty())
+        return false;
+    if (!count)
+        count = std::max(1u, std::thread::hardware_concurrency());
+    // there can only be one main loop and it's not one of ours
+    flags &= ~(EventLoop::MainEventLoop|EventLoop::EnableSigIntHandler|EventLoop::EnableSigTermHandler);
+
+    mStarted = 0;
+    for (size_t i = 0; i < count; ++i) {
+        EventLoopThread *thread = new EventLoopThread(this, flags);
+        mThreads.push_back(thread);
+        thread->start();
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mStarted < count)
+        mCondition.wait(lock);
+    return true;
+}
+
+void EventLoopGroup::loopStarted(const EventLoop::SharedPtr &loop)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mLoops.push_back(loop);
+    ++mStarted;
+    mCondition.notify_one();
+}
+
+void EventLoopGroup::stop()
+{
+    for (const auto &loop : mLoops)
+        loop->quit();
+    for (auto thread : mThreads) {
+        thread->join();
+        delete thread;
+    }
+    mThreads.clear();
+    mLoops.clear();
+}
+
+EventLoop::SharedPtr EventLoopGroup::next()
+{
+    assert(!mLoops.empty());
+    return mLoops[mNext++ % mLoops.size()];
+}
+
+EventLoop::SharedPtr EventLoopGroup::leastLoaded() const
+{
+    assert(!mLoops.empty());
+    size_t best = 0, bestCount = mLoops[0]->socketCount();
+    for (size_t i = 1; i < mLoops.size() && bestCount; ++i) {
+        const size_t count = mLoops[i]->socketCount();
+        if (count < bestCount) {
+            best = i;
+            bestCount = count;
+        }
+    }
+    return mLoops[best];
+}
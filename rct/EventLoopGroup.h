@@ -0,0 +1,58 @@
+#ifndef EVENTLOOPGROUP_H
+#define EVENTLOOPGROUP_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <rct/EventLoop.h>
+
+class EventLoopThread;
+
+// N event loops running on N threads. Objects that register with
+// EventLoop::eventLoop() (SocketClient, Timer, Connection) belong to the
+// loop of the thread that created them, so create them on the loop you
+// want them on, e.g. with loop->callLater(). See
+// SocketServer::setEventLoopGroup() for spreading connections.
+class EventLoopGroup
+{
+public:
+    typedef std::shared_ptr<EventLoopGroup> SharedPtr;
+    typedef std::weak_ptr<EventLoopGroup> WeakPtr;
+
+    EventLoopGroup();
+    ~EventLoopGroup();
+
+    // starts count loops, 0 means one per core, and returns when all of
+    // them are running. flags are passed to EventLoop::init()
+    bool start(size_t count = 0, unsigned int flags = EventLoop::None);
+    // quits all loops and waits for their threads
+    void stop();
+
+    size_t size() const { return mLoops.size(); }
+    EventLoop::SharedPtr loop(size_t index) const { return mLoops.at(index); }
+
+    // round robin
+    EventLoop::SharedPtr next();
+    // the loop with the fewest registered sockets
+    EventLoop::SharedPtr leastLoaded() const;
+
+private:
+    void loopStarted(const EventLoop::SharedPtr &loop);
+
+    std::vector<EventLoop::SharedPtr> mLoops;
+    std::vector<EventLoopThread*> mThreads;
+    std::atomic<size_t> mNext;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    size_t mStarted;
+
+    friend class EventLoopThread;
+
+    EventLoopGroup(const EventLoopGroup &) = delete;
+    EventLoopGroup &operator=(const EventLoopGroup &) = delete;
+};
+
+#endif
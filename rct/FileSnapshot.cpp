@@ -0,0 +1,275 @@
+#include "FileSnapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "Rct.h"
+#include "rct/rct-config.h"
+
+FileSnapshot::FileSnapshot()
+    : mData(0), mSize(0), mCount(0)
+{
+    clear();
+}
+
+void FileSnapshot::clear()
+{
+    mFile.close();
+    mContents.clear();
+    mContents.resize(HeaderSize);
+    memset(&mContents[0], 0, HeaderSize);
+    const uint32_t header[] = { Magic, Format };
+    memcpy(&mContents[0], header, sizeof(header));
+    const uint32_t crc = Rct::crc32c(0, 0);
+    memcpy(&mContents[24], &crc, sizeof(crc));
+    setData(mContents.constData(), mContents.size());
+}
+
+void FileSnapshot::setData(const char *data, size_t size)
+{
+    mData = data;
+    mSize = size;
+    uint64_t count;
+    memcpy(&count, data + 8, sizeof(count));
+    mCount = count;
+}
+
+FileSnapshot::Record FileSnapshot::record(size_t idx) const
+{
+    Record ret;
+    memcpy(&ret, mData + HeaderSize + idx * RecordSize, sizeof(ret));
+    return ret;
+}
+
+StringView FileSnapshot::path(size_t idx) const
+{
+    const Record r = record(idx);
+    return StringView(mData + HeaderSize + mCount * RecordSize + r.nameOffset, r.nameSize);
+}
+
+FileSnapshot::Entry FileSnapshot::entry(size_t idx) const
+{
+    const Record r = record(idx);
+    const Entry ret = { r.inode, r.size, r.mtime };
+    return ret;
+}
+
+bool FileSnapshot::find(const Path &p, Entry *e) const
+{
+    const StringView key(p);
+    size_t lo = 0, hi = mCount;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        const int cmp = path(mid).compare(key);
+        if (!cmp) {
+            if (e)
+                *e = entry(mid);
+            return true;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return false;
+}
+
+void FileSnapshot::scan(const List<Path> &roots, bool recursive, ThreadPool *pool)
+{
+    typedef std::pair<Path, Entry> File;
+    std::vector<File> files;
+    std::mutex mutex;
+    auto add = [&files, &mutex](const Path &path) {
+        struct stat st;
+        if (::stat(path.constData(), &st) || !S_ISREG(st.st_mode))
+            return;
+#ifdef HAVE_STATMTIM
+        const int64_t mtime = st.st_mtim.tv_sec * static_cast<int64_t>(1000000000) + st.st_mtim.tv_nsec;
+#else
+        const int64_t mtime = st.st_mtime * static_cast<int64_t>(1000000000);
+#endif
+        const Entry entry = { static_cast<uint64_t>(st.st_ino), static_cast<uint64_t>(st.st_size), mtime };
+        std::lock_guard<std::mutex> lock(mutex);
+        files.push_back(std::make_pair(path, entry));
+    };
+
+    for (const Path &root : roots) {
+        if (!root.isDir()) {
+            add(root);
+            continue;
+        }
+        Path dir = root;
+        if (!dir.endsWith('/'))
+            dir.append('/');
+        // the stat()s are most of the work, they happen on the pool too
+        dir.visitParallel([recursive, &add](const Path &path, Path::Type type) {
+                if (type == Path::Directory)
+                    return recursive ? Path::Recurse : Path::Continue;
+                add(path);
+                return Path::Continue;
+            }, pool);
+    }
+
+    std::sort(files.begin(), files.end(), [](const File &a, const File &b) {
+            return StringView(a.first) < StringView(b.first);
+        });
+    // roots inside other roots
+    files.erase(std::unique(files.begin(), files.end(), [](const File &a, const File &b) {
+                return a.first == b.first;
+            }), files.end());
+
+    uint64_t namesSize = 0;
+    for (const File &file : files)
+        namesSize += file.first.size();
+
+    mFile.close();
+    mContents.clear();
+    mContents.resize(HeaderSize + files.size() * RecordSize + namesSize);
+    char *data = &mContents[0];
+    char *names = data + HeaderSize + files.size() * RecordSize;
+    uint32_t nameOffset = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        const File &file = files[i];
+        const Record r = { file.second.inode, file.second.size, file.second.mtime,
+                           nameOffset, static_cast<uint32_t>(file.first.size()) };
+        memcpy(data + HeaderSize + i * RecordSize, &r, sizeof(r));
+        memcpy(names + nameOffset, file.first.constData(), file.first.size());
+        nameOffset += file.first.size();
+    }
+
+    const uint32_t magic[] = { Magic, Format };
+    memcpy(data, magic, sizeof(magic));
+    const uint64_t sizes[] = { files.size(), namesSize };
+    memcpy(data + 8, sizes, sizeof(sizes));
+    const uint32_t crc[] = { Rct::crc32c(data + HeaderSize, mContents.size() - HeaderSize), 0 };
+    memcpy(data + 24, crc, sizeof(crc));
+    setData(data, mContents.size());
+}
+
+bool FileSnapshot::load(const Path &file)
+{
+    clear();
+    MappedFile mapped;
+    if (!mapped.open(file)) {
+        mError = String::format<128>("Can't open %s (%d)", file.constData(), errno);
+        return false;
+    }
+    const char *data = mapped.data();
+    const size_t size = mapped.size();
+    uint32_t magic[2];
+    uint64_t sizes[2];
+    uint32_t crc;
+    if (size < HeaderSize) {
+        mError = "Snapshot is too small";
+        return false;
+    }
+    memcpy(magic, data, sizeof(magic));
+    memcpy(sizes, data + 8, sizeof(sizes));
+    memcpy(&crc, data + 24, sizeof(crc));
+    if (magic[0] != Magic || magic[1] != Format) {
+        mError = String::format<64>("Wrong magic or format %x/%u", magic[0], magic[1]);
+        return false;
+    }
+    if (sizes[0] > (size - HeaderSize) / RecordSize
+        || HeaderSize + sizes[0] * RecordSize + sizes[1] != size) {
+        mError = "Snapshot is truncated";
+        return false;
+    }
+    if (Rct::crc32c(data + HeaderSize, size - HeaderSize) != crc) {
+        mError = "Snapshot checksum mismatch";
+        return false;
+    }
+
+    mFile = std::move(mapped);
+    setData(mFile.data(), mFile.size());
+    for (size_t i = 0; i < mCount; ++i) {
+        const Record r = record(i);
+        if (static_cast<uint64_t>(r.nameOffset) + r.nameSize > sizes[1]) {
+            mError = "Snapshot has an invalid entry";
+            clear();
+            return false;
+        }
+    }
+    mContents.clear();
+    return true;
+}
+
+static String failure(const char *what)
+{
+    const int error = errno;
+    return String::format<128>("%s failure %d (%s)", what, error, Rct::strerror(error).constData());
+}
+
+bool FileSnapshot::save(const Path &file) const
+{
+    if (!Path::mkdir(file.parentDir(), Path::Recursive)) {
+        mError = String::format<128>("Can't create directory for %s", file.constData());
+        return false;
+    }
+    // replaced at once, a snapshot is never half written
+    String tempFilePath = file + "XXXXXX";
+    const int fd = mkostemp(&tempFilePath[0], O_CLOEXEC);
+    if (fd == -1) {
+        mError = failure("mkstemp");
+        return false;
+    }
+    const char *data = mData;
+    size_t left = mSize;
+    while (left) {
+        const ssize_t w = ::write(fd, data, left);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            mError = failure("write");
+            ::close(fd);
+            Path::rm(tempFilePath);
+            return false;
+        }
+        data += w;
+        left -= w;
+    }
+    ::close(fd);
+    if (rename(tempFilePath.constData(), file.constData())) {
+        mError = failure("rename");
+        Path::rm(tempFilePath);
+        return false;
+    }
+    return true;
+}
+
+void FileSnapshot::diff(const FileSnapshot &newer, const std::function<void(Change change, const Path &path)> &callback) const
+{
+    size_t i = 0, j = 0;
+    while (i < mCount || j < newer.mCount) {
+        if (j == newer.mCount) {
+            const StringView p = path(i++);
+            callback(Removed, Path(p.data(), p.size()));
+        } else if (i == mCount) {
+            const StringView p = newer.path(j++);
+            callback(Added, Path(p.data(), p.size()));
+        } else {
+            const StringView a = path(i), b = newer.path(j);
+            const int cmp = a.compare(b);
+            if (cmp < 0) {
+                callback(Removed, Path(a.data(), a.size()));
+                ++i;
+            } else if (cmp > 0) {
+                callback(Added, Path(b.data(), b.size()));
+                ++j;
+            } else {
+                if (entry(i) != newer.entry(j))
+                    callback(Modified, Path(a.data(), a.size()));
+                ++i;
+                ++j;
+            }
+        }
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef FileSnapshot_h
+#define FileSnapshot_h
+
+#include <stdint.h>
+#include <functional>
+
+#include <rct/List.h>
+#include <rct/MappedFile.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+
+class ThreadPool;
+
+// The inode, size and mtime of every file below some directories, so
+// what changed while nothing was watching them, like between runs, can
+// be found by scanning them again and comparing:
+//
+//     FileSnapshot before, now;
+//     before.load(snapshotFile);
+//     now.scan(roots);
+//     watcher.catchUp(before, now);
+//     now.save(snapshotFile);
+//
+// The entries are kept sorted by path in the same layout they're saved
+// in, so a loaded snapshot is used straight from the mapping and diff()
+// is one pass over both.
+class FileSnapshot
+{
+public:
+    FileSnapshot();
+
+    struct Entry
+    {
+        uint64_t inode, size;
+        int64_t mtime; // ns
+        bool operator==(const Entry &other) const
+        {
+            return inode == other.inode && size == other.size && mtime == other.mtime;
+        }
+        bool operator!=(const Entry &other) const { return !operator==(other); }
+    };
+
+    // replaces the entries with the files below roots, and roots that
+    // are files, listed and stat'ed on pool's threads
+    void scan(const List<Path> &roots, bool recursive = true, ThreadPool *pool = 0);
+    void clear();
+
+    size_t size() const { return mCount; }
+    bool isEmpty() const { return !mCount; }
+    // in path order
+    StringView path(size_t idx) const;
+    Entry entry(size_t idx) const;
+    bool find(const Path &path, Entry *entry = 0) const;
+
+    bool load(const Path &file);
+    bool save(const Path &file) const;
+    String error() const { return mError; }
+
+    enum Change {
+        Added,
+        Removed,
+        Modified
+    };
+    // calls callback for every path that's only in this snapshot, only in
+    // newer, or has a different entry there, in path order
+    void diff(const FileSnapshot &newer, const std::function<void(Change change, const Path &path)> &callback) const;
+
+private:
+    enum {
+        Magic = 0x53544352, // "RCTS"
+        Format = 1,
+        HeaderSize = 32,
+        RecordSize = 32
+    };
+    struct Record
+    {
+        uint64_t inode, size;
+        int64_t mtime;
+        uint32_t nameOffset, nameSize;
+    };
+    Record record(size_t idx) const;
+    void setData(const char *data, size_t size);
+
+    MappedFile mFile;
+    String mContents;
+    const char *mData;
+    size_t mSize, mCount;
+    mutable String mError;
+
+    FileSnapshot(const FileSnapshot &) = delete;
+    FileSnapshot &operator=(const FileSnapshot &) = delete;
+};
+
+#endif
@@ -1,5 +1,7 @@
 #include "FileSystemWatcher.h"
 
+#include "FileSnapshot.h"
+
 FileSystemWatcher::FileSystemWatcher(const Options &options)
     : mOptions(options)
 {
@@ -7,21 +9,53 @@ FileSystemWatcher::FileSystemWatcher(const Options &options)
     mTimer.timeout().connect([this](Timer *) {
             processChanges(Remove);
         });
+    mDebounceTimer.timeout().connect([this](Timer *) {
+            emitChanges();
+        });
 }
 
 FileSystemWatcher::~FileSystemWatcher()
 {
     mTimer.stop();
+    mDebounceTimer.stop();
     shutdown();
 }
 
+void FileSystemWatcher::catchUp(const FileSnapshot &before, const FileSnapshot &now)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        before.diff(now, [this](FileSnapshot::Change change, const Path &path) {
+                add(change == FileSnapshot::Added ? Add : change == FileSnapshot::Removed ? Remove : Modified, path);
+            });
+    }
+    processChanges();
+}
+
 void FileSystemWatcher::processChanges()
+{
+    if (mOptions.debounce > 0) {
+        if (!mDebounceTimer.isRunning())
+            mDebounceTimer.restart(mOptions.debounce, Timer::SingleShot);
+    } else {
+        emitChanges();
+    }
+}
+
+void FileSystemWatcher::emitChanges()
 {
     if (mOptions.removeDelay > 0) {
         processChanges(Add|Modified);
         {
             std::lock_guard<std::mutex> lock(mMutex);
-            if (!mRemovedPaths.empty())
+            bool removed = false;
+            for (const auto &change : mChanges) {
+                if (change.second == Remove) {
+                    removed = true;
+                    break;
+                }
+            }
+            if (removed)
                 mTimer.restart(mOptions.removeDelay);
         }
     } else {
@@ -32,29 +66,44 @@ void FileSystemWatcher::processChanges()
 void FileSystemWatcher::processChanges(unsigned int types)
 {
     assert(types);
+    List<Path> paths[3];
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mChanges.begin();
+        while (it != mChanges.end()) {
+            if (types & it->second) {
+                const int idx = it->second == Add ? 0 : it->second == Remove ? 1 : 2;
+                paths[idx].append(it->first);
+                it = mChanges.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
     struct {
         const Type type;
+        Signal<std::function<void(const List<Path>&)> > &batch;
         Signal<std::function<void(const Path&)> > &signal;
-        Set<Path> &paths;
     } signals[] = {
-        { Add, mAdded, mAddedPaths },
-        { Remove, mRemoved, mRemovedPaths },
-        { Modified, mModified, mModifiedPaths }
+        { Add, mAddedBatch, mAdded },
+        { Remove, mRemovedBatch, mRemoved },
+        { Modified, mModifiedBatch, mModified }
     };
 
     const unsigned int count = sizeof(signals) / sizeof(signals[0]);
     for (unsigned i=0; i<count; ++i) {
-        if (types & signals[i].type) {
-            Set<Path> p;
-            {
-                std::lock_guard<std::mutex> lock(mMutex);
-                std::swap(p, signals[i].paths);
-            }
+        List<Path> &p = paths[i];
+        if (p.isEmpty())
+            continue;
+        p.sort();
+        // a directory or a link that moved or went away
+        if (signals[i].type != Add && Path::realPathPolicy() == Path::RealPathCached)
+            Path::invalidateRealPathCache(p.toSet());
 
-            for (Set<Path>::const_iterator it = p.begin(); it != p.end(); ++it) {
-                signals[i].signal(*it);
-            }
+        signals[i].batch(p);
+        for (const Path &path : p) {
+            signals[i].signal(path);
         }
     }
 }
-
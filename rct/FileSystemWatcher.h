@@ -2,9 +2,12 @@
 #define FileSystemWatcher_h
 
 #include <stdint.h>
+#include <deque>
 #include <mutex>
 
 #include <rct/rct-config.h>
+#include <rct/FlatHash.h>
+#include <rct/List.h>
 #include <rct/Map.h>
 #include <rct/Path.h>
 #include <rct/Set.h>
@@ -25,27 +28,49 @@ class WatcherData;
 #error no filesystemwatcher backend
 #endif
 
+class FileSnapshot;
 
 class FileSystemWatcher
 {
 public:
     struct Options {
         Options()
-            : removeDelay(1000)
+            : removeDelay(1000), debounce(0)
         {}
         int removeDelay;
+        // ms to collect events for before they're reported, a path that
+        // changes many times in that window is only reported once
+        int debounce;
     };
     FileSystemWatcher(const Options &option = Options());
     ~FileSystemWatcher();
 
-    bool watch(const Path &path);
+    enum WatchFlag {
+        // everything below the directory, not just its entries. With
+        // inotify this is a fanotify filesystem mark when the process is
+        // allowed to make one, otherwise the subdirectories get watches
+        // of their own that are added a few at a time. FSEvents and
+        // ChangeNotification always watch subtrees, kqueue never does.
+        Recursive = 0x1
+    };
+    bool watch(const Path &path, unsigned int flags = 0);
     bool unwatch(const Path &path);
     Signal<std::function<void(const Path &)> > &removed() { return mRemoved; }
     Signal<std::function<void(const Path &)> > &added() { return mAdded; }
     Signal<std::function<void(const Path &)> > &modified() { return mModified; }
+    // all the paths of a round of changes at once, sorted. Emitted before
+    // the signals for the single paths.
+    Signal<std::function<void(const List<Path> &)> > &removedBatch() { return mRemovedBatch; }
+    Signal<std::function<void(const List<Path> &)> > &addedBatch() { return mAddedBatch; }
+    Signal<std::function<void(const List<Path> &)> > &modifiedBatch() { return mModifiedBatch; }
     void clear();
+    // reports what changed from before to now, like between two runs, as
+    // if it had been watched
+    void catchUp(const FileSnapshot &before, const FileSnapshot &now);
 #if defined(HAVE_FSEVENTS) || defined(HAVE_CHANGENOTIFICATION)
     Set<Path> watchedPaths() const;
+#elif defined(HAVE_INOTIFY)
+    Set<Path> watchedPaths() const { return mWatchedByPath.keys().toSet().unite(mSubtrees.keys()); } // ### slow
 #else
     Set<Path> watchedPaths() const { return mWatchedByPath.keys().toSet(); } // ### slow
 #endif
@@ -67,6 +92,31 @@ private:
     Map<Path, int> mWatchedByPath;
     Map<int, Path> mWatchedById;
 
+#ifdef HAVE_INOTIFY
+    struct Subtree
+    {
+        // fanotify: a descriptor of the root to resolve handles with and
+        // the filesystem's id, -1 with inotify
+        int fd;
+        uint64_t fsid;
+        // inotify: the watches of the subdirectories
+        Set<int> watches;
+    };
+    bool watchSubtree(const Path &path);
+    bool initFanotify();
+    void notifyFanotifyReadyRead();
+    void scanSubtrees();
+    void addSubdirectory(const Path &path);
+    void removeSubdirectory(const Path &path);
+    Path subtreeOf(const Path &path) const;
+    int mFanotifyFd;
+    Map<Path, Subtree> mSubtrees;
+    // inotify subtrees, directories to watch and whether their entries
+    // are new
+    std::deque<std::pair<Path, bool> > mScanQueue;
+    Timer mScanTimer;
+#endif
+
 #ifdef HAVE_KQUEUE
     Map<Path, uint64_t> mTimes;
     static Path::VisitResult scanFiles(const Path& path, void* userData);
@@ -77,35 +127,43 @@ private:
 #endif
     std::mutex mMutex;
     Signal<std::function<void(const Path&)> > mRemoved, mModified, mAdded;
+    Signal<std::function<void(const List<Path>&)> > mRemovedBatch, mModifiedBatch, mAddedBatch;
 
     enum Type {
         Add = 0x1,
         Remove = 0x2,
         Modified = 0x4
     };
+    // a path gets one pending change, the events since the last round
+    // are folded into it
     void add(Type type, const Path &path)
     {
+        auto it = mChanges.find(path);
+        if (it == mChanges.end()) {
+            mChanges[path] = type;
+            return;
+        }
         switch (type) {
         case Add:
-            if (mRemovedPaths.remove(path)) {
-                mModifiedPaths.insert(path);
-            } else {
-                mAddedPaths.insert(path);
-            }
+            if (it->second == Remove)
+                it->second = Modified;
             break;
         case Remove:
-            if (!mAddedPaths.remove(path))
-                mRemovedPaths.insert(path);
+            if (it->second == Add) {
+                mChanges.erase(it);
+            } else {
+                it->second = Remove;
+            }
             break;
         case Modified:
-            mModifiedPaths.insert(path);
             break;
         }
     }
     const Options mOptions;
-    Set<Path> mAddedPaths, mRemovedPaths, mModifiedPaths;
-    Timer mTimer;
+    FlatHash<Path, unsigned int> mChanges;
+    Timer mTimer, mDebounceTimer;
     void processChanges();
+    void emitChanges();
     void processChanges(unsigned int types);
 };
 
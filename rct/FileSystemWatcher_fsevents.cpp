@@ -297,7 +297,7 @@ bool FileSystemWatcher::isWatching(const Path& p) const
     return mWatcher->paths.contains(p);
 }
 
-bool FileSystemWatcher::watch(const Path &p)
+bool FileSystemWatcher::watch(const Path &p, unsigned int)
 {
     Path path = p;
     assert(!path.isEmpty());
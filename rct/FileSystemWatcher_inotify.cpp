@@ -1,8 +1,13 @@
 #include "FileSystemWatcher.h"
 
+#include <algorithm>
 #include <errno.h>
+#include <fcntl.h>
+#include <string.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <unistd.h>
 
 #include "EventLoop.h"
 #include "Log.h"
@@ -10,21 +15,48 @@
 #include "Rct.h"
 #include "StackBuffer.h"
 
+#ifdef HAVE_FANOTIFY
+#include <sys/fanotify.h>
+#endif
+
+
+enum {
+    FileMask = IN_DELETE_SELF|IN_MOVE_SELF|IN_ATTRIB|IN_DELETE|IN_CLOSE_WRITE,
+    DirectoryMask = IN_MOVED_FROM|IN_MOVED_TO|IN_CREATE|IN_DELETE|IN_DELETE_SELF|IN_ATTRIB|IN_CLOSE_WRITE,
+    // directories of inotify subtrees watched per run of scanSubtrees()
+    ScanBatch = 64
+};
+
+#ifdef HAVE_FANOTIFY
+static const uint64_t FanotifyMask = (FAN_CREATE|FAN_DELETE|FAN_MOVED_FROM|FAN_MOVED_TO|FAN_ATTRIB
+                                      |FAN_CLOSE_WRITE|FAN_ONDIR);
+#endif
 
 void FileSystemWatcher::init()
 {
+    mFanotifyFd = -1;
     mFd = inotify_init();
     assert(mFd != -1);
     EventLoop::eventLoop()->registerSocket(mFd, EventLoop::SocketRead, std::bind(&FileSystemWatcher::notifyReadyRead, this));
+    mScanTimer.timeout().connect([this](Timer *) { scanSubtrees(); });
 }
 
 void FileSystemWatcher::shutdown()
 {
+    mScanTimer.stop();
     EventLoop::eventLoop()->unregisterSocket(mFd);
     for (Map<Path, int>::const_iterator it = mWatchedByPath.begin(); it != mWatchedByPath.end(); ++it) {
         inotify_rm_watch(mFd, it->second);
     }
     close(mFd);
+    for (const auto &subtree : mSubtrees) {
+        if (subtree.second.fd != -1)
+            close(subtree.second.fd);
+    }
+    if (mFanotifyFd >= 0) {
+        EventLoop::eventLoop()->unregisterSocket(mFanotifyFd);
+        close(mFanotifyFd);
+    }
 }
 
 void FileSystemWatcher::clear()
@@ -33,10 +65,23 @@ void FileSystemWatcher::clear()
         inotify_rm_watch(mFd, it->second);
     }
     mWatchedByPath.clear();
+    for (const auto &subtree : mSubtrees) {
+        for (int wd : subtree.second.watches)
+            inotify_rm_watch(mFd, wd);
+        if (subtree.second.fd != -1) {
+            close(subtree.second.fd);
+#ifdef HAVE_FANOTIFY
+            fanotify_mark(mFanotifyFd, FAN_MARK_REMOVE|FAN_MARK_FILESYSTEM, FanotifyMask,
+                          AT_FDCWD, subtree.first.constData());
+#endif
+        }
+    }
+    mSubtrees.clear();
+    mScanQueue.clear();
     mWatchedById.clear();
 }
 
-bool FileSystemWatcher::watch(const Path &p)
+bool FileSystemWatcher::watch(const Path &p, unsigned int watchFlags)
 {
     if (p.isEmpty())
         return false;
@@ -47,10 +92,10 @@ bool FileSystemWatcher::watch(const Path &p)
     uint32_t flags = 0;
     switch (type) {
     case Path::File:
-        flags = IN_DELETE_SELF|IN_MOVE_SELF|IN_ATTRIB|IN_DELETE|IN_CLOSE_WRITE;
+        flags = FileMask;
         break;
     case Path::Directory:
-        flags = IN_MOVED_FROM|IN_MOVED_TO|IN_CREATE|IN_DELETE|IN_DELETE_SELF|IN_ATTRIB|IN_CLOSE_WRITE;
+        flags = DirectoryMask;
         if (!path.endsWith('/'))
             path.append('/');
         break;
@@ -59,24 +104,73 @@ bool FileSystemWatcher::watch(const Path &p)
         return false;
     }
 
-    if (mWatchedByPath.contains(path)) {
+    const bool recursive = (watchFlags & Recursive) && type == Path::Directory;
+    if (recursive) {
+        if (mSubtrees.contains(path))
+            return false;
+        if (watchSubtree(path))
+            return true;
+    } else if (mWatchedByPath.contains(path)) {
         return false;
     }
-    const int ret = inotify_add_watch(mFd, path.nullTerminated(), flags);
-    if (ret == -1) {
-        error("FileSystemWatcher::watch() watch failed for '%s' (%d) %s",
-              path.constData(), errno, Rct::strerror().constData());
-        return false;
+
+    if (!mWatchedByPath.contains(path)) {
+        const int ret = inotify_add_watch(mFd, path.nullTerminated(), flags);
+        if (ret == -1) {
+            error("FileSystemWatcher::watch() watch failed for '%s' (%d) %s",
+                  path.constData(), errno, Rct::strerror().constData());
+            return false;
+        }
+
+        mWatchedByPath[path] = ret;
+        mWatchedById[ret] = path;
     }
 
-    mWatchedByPath[path] = ret;
-    mWatchedById[ret] = path;
+    if (recursive) {
+        // the subdirectories are watched from the event loop, a batch at
+        // a time, so this returns right away however big the tree is
+        Subtree &subtree = mSubtrees[path];
+        subtree.fd = -1;
+        subtree.fsid = 0;
+        mScanQueue.push_back(std::make_pair(path, false));
+        if (!mScanTimer.isRunning())
+            mScanTimer.restart(0, Timer::SingleShot);
+    }
     return true;
 }
 
 bool FileSystemWatcher::unwatch(const Path &path)
 {
     std::lock_guard<std::mutex> lock(mMutex);
+    Subtree subtree;
+    if (mSubtrees.remove(path, &subtree)) {
+        debug("FileSystemWatcher::unwatch(\"%s\") subtree", path.constData());
+        for (int wd : subtree.watches) {
+            mWatchedById.remove(wd);
+            inotify_rm_watch(mFd, wd);
+        }
+        mScanQueue.erase(std::remove_if(mScanQueue.begin(), mScanQueue.end(),
+                                        [&path](const std::pair<Path, bool> &dir) {
+                                            return dir.first.startsWith(path);
+                                        }), mScanQueue.end());
+        if (subtree.fd != -1) {
+            close(subtree.fd);
+#ifdef HAVE_FANOTIFY
+            // the mark is on the filesystem, other subtrees may be on it
+            bool shared = false;
+            for (const auto &other : mSubtrees) {
+                if (other.second.fd != -1 && other.second.fsid == subtree.fsid) {
+                    shared = true;
+                    break;
+                }
+            }
+            if (!shared)
+                fanotify_mark(mFanotifyFd, FAN_MARK_REMOVE|FAN_MARK_FILESYSTEM, FanotifyMask,
+                              AT_FDCWD, path.constData());
+#endif
+            return true;
+        }
+    }
     int wd = -1;
     if (mWatchedByPath.remove(path, &wd)) {
         debug("FileSystemWatcher::unwatch(\"%s\")", path.constData());
@@ -88,6 +182,143 @@ bool FileSystemWatcher::unwatch(const Path &path)
     }
 }
 
+bool FileSystemWatcher::initFanotify()
+{
+#ifdef HAVE_FANOTIFY
+    // -2 once it's failed, it won't work the next time either
+    if (mFanotifyFd == -1) {
+        // filesystem marks need CAP_SYS_ADMIN, fanotify_mark() will tell
+        mFanotifyFd = fanotify_init(FAN_CLASS_NOTIF|FAN_CLOEXEC|FAN_NONBLOCK|FAN_REPORT_DFID_NAME,
+                                    O_RDONLY|O_CLOEXEC|O_LARGEFILE);
+        if (mFanotifyFd == -1) {
+            debug("FileSystemWatcher: no fanotify (%d) %s", errno, Rct::strerror().constData());
+            mFanotifyFd = -2;
+            return false;
+        }
+        EventLoop::eventLoop()->registerSocket(mFanotifyFd, EventLoop::SocketRead,
+                                               std::bind(&FileSystemWatcher::notifyFanotifyReadyRead, this));
+    }
+    return mFanotifyFd >= 0;
+#else
+    return false;
+#endif
+}
+
+bool FileSystemWatcher::watchSubtree(const Path &path)
+{
+#ifdef HAVE_FANOTIFY
+    if (!initFanotify())
+        return false;
+    // events come with handles of directories, opened relative to this.
+    // It can't be O_PATH, open_by_handle_at() doesn't take those.
+    const int fd = ::open(path.constData(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    struct statfs st;
+    if (fstatfs(fd, &st)
+        || fanotify_mark(mFanotifyFd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM, FanotifyMask, AT_FDCWD, path.constData())) {
+        const int err = errno;
+        debug("FileSystemWatcher::watch() no filesystem mark for '%s' (%d) %s",
+              path.constData(), err, Rct::strerror(err).constData());
+        close(fd);
+        return false;
+    }
+    Subtree &subtree = mSubtrees[path];
+    subtree.fd = fd;
+    static_assert(sizeof(st.f_fsid) == sizeof(subtree.fsid), "fsid size");
+    memcpy(&subtree.fsid, &st.f_fsid, sizeof(subtree.fsid));
+    return true;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+void FileSystemWatcher::addSubdirectory(const Path &path)
+{
+    auto subtree = mSubtrees.find(subtreeOf(path));
+    if (subtree == mSubtrees.end() || subtree->second.fd != -1)
+        return;
+    mScanQueue.push_back(std::make_pair(path, true));
+    if (!mScanTimer.isRunning())
+        mScanTimer.restart(0, Timer::SingleShot);
+}
+
+void FileSystemWatcher::removeSubdirectory(const Path &path)
+{
+    // the watches of a directory that's moved away stay, with the old
+    // paths. One that's moved within the subtree is watched again.
+    auto subtree = mSubtrees.find(subtreeOf(path));
+    if (subtree == mSubtrees.end() || subtree->second.fd != -1)
+        return;
+    Set<int> &watches = subtree->second.watches;
+    for (auto it = watches.begin(); it != watches.end(); ) {
+        if (mWatchedById.value(*it).startsWith(path)) {
+            inotify_rm_watch(mFd, *it);
+            mWatchedById.remove(*it);
+            watches.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+Path FileSystemWatcher::subtreeOf(const Path &path) const
+{
+    // there are only a few of these
+    Path ret;
+    for (const auto &subtree : mSubtrees) {
+        if (path.startsWith(subtree.first) && subtree.first.size() > ret.size())
+            ret = subtree.first;
+    }
+    return ret;
+}
+
+void FileSystemWatcher::scanSubtrees()
+{
+    bool changed = false;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (int i = 0; i < ScanBatch && !mScanQueue.empty(); ++i) {
+            const std::pair<Path, bool> dir = mScanQueue.front();
+            mScanQueue.pop_front();
+            const Path &path = dir.first;
+            auto subtree = mSubtrees.find(subtreeOf(path));
+            if (subtree == mSubtrees.end() || subtree->second.fd != -1)
+                continue;
+            if (path != subtree->first) {
+                const int wd = inotify_add_watch(mFd, path.nullTerminated(), DirectoryMask);
+                if (wd == -1) {
+                    // most likely out of watches, the rest would fail too
+                    error("FileSystemWatcher: watch failed for '%s' (%d) %s",
+                          path.constData(), errno, Rct::strerror().constData());
+                    if (errno == ENOSPC)
+                        mScanQueue.clear();
+                    continue;
+                }
+                subtree->second.watches.insert(wd);
+                mWatchedById[wd] = path;
+            }
+            // entries of a directory that was created or moved in may have
+            // come before its watch
+            const bool isNew = dir.second;
+            path.visit([this, isNew, &changed](const Path &entry, Path::Type type) {
+                    if (type == Path::Directory)
+                        mScanQueue.push_back(std::make_pair(entry, isNew));
+                    if (isNew) {
+                        add(Add, type == Path::Directory ? Path(entry.left(entry.size() - 1)) : entry);
+                        changed = true;
+                    }
+                    return Path::Continue;
+                });
+        }
+        if (!mScanQueue.empty())
+            mScanTimer.restart(0, Timer::SingleShot);
+    }
+    if (changed)
+        processChanges();
+}
+
 static inline void dump(Log &log, unsigned int mask)
 {
     if (mask & IN_ACCESS)
@@ -147,17 +378,36 @@ void FileSystemWatcher::notifyReadyRead()
                 dump(log, event->mask);
             }
 
-            const bool isDir = path.isDir();
+            // directories are watched with a trailing slash, and the events
+            // for their entries have a name. No need to stat anything.
+            const bool isDir = event->len && path.endsWith('/');
+
+            if (!mSubtrees.isEmpty() && !mWatchedByPath.contains(path)) {
+                // a subdirectory of an inotify subtree, its parent reports
+                // what happens to it
+                if (event->mask & IN_IGNORED) {
+                    auto subtree = mSubtrees.find(subtreeOf(path));
+                    if (subtree != mSubtrees.end())
+                        subtree->second.watches.remove(event->wd);
+                    mWatchedById.remove(event->wd);
+                }
+                if (event->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_UNMOUNT|IN_IGNORED))
+                    continue;
+            }
 
             if (event->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_UNMOUNT)) {
                 add(Remove, path);
             } else if (event->mask & (IN_CREATE|IN_MOVED_TO)) {
                 if (isDir)
                     path.append(event->name);
+                if (event->mask & IN_ISDIR && !mSubtrees.isEmpty())
+                    addSubdirectory(path + '/');
                 add(Add, path);
             } else if (event->mask & (IN_DELETE|IN_MOVED_FROM)) {
                 if (isDir)
                     path.append(event->name);
+                if (event->mask & IN_MOVED_FROM && event->mask & IN_ISDIR && !mSubtrees.isEmpty())
+                    removeSubdirectory(path + '/');
                 add(Remove, path);
             } else if (event->mask & (IN_ATTRIB|IN_CLOSE_WRITE)) {
                 if (isDir)
@@ -166,13 +416,109 @@ void FileSystemWatcher::notifyReadyRead()
             }
         }
         if (dumpFS) {
-            if (!mAddedPaths.isEmpty())
-                error() << "Added" << mAddedPaths;
-            if (!mRemovedPaths.isEmpty())
-                error() << "Removed" << mRemovedPaths;
-            if (!mModifiedPaths.isEmpty())
-                error() << "Modified" << mModifiedPaths;
+            for (const auto &change : mChanges) {
+                error() << (change.second == Add ? "Added" : change.second == Remove ? "Removed" : "Modified")
+                        << change.first;
+            }
         }
     }
     processChanges();
 }
+
+void FileSystemWatcher::notifyFanotifyReadyRead()
+{
+#ifdef HAVE_FANOTIFY
+    bool changed = false;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        // the directories of this read, most events are for a few of them
+        Hash<String, Path> dirs;
+        alignas(fanotify_event_metadata) char buf[16384];
+        while (true) {
+            const ssize_t read = ::read(mFanotifyFd, buf, sizeof(buf));
+            if (read <= 0) {
+                if (read == -1 && errno == EINTR)
+                    continue;
+                break;
+            }
+            ssize_t len = read;
+            for (const fanotify_event_metadata *event = reinterpret_cast<const fanotify_event_metadata *>(buf);
+                 FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+                if (event->mask & FAN_Q_OVERFLOW) {
+                    error("FileSystemWatcher: fanotify queue overflow, events were lost");
+                    continue;
+                }
+                const char *info = reinterpret_cast<const char *>(event) + event->metadata_len;
+                const char *end = reinterpret_cast<const char *>(event) + event->event_len;
+                const fanotify_event_info_fid *fid = 0;
+                while (info + sizeof(fanotify_event_info_header) <= end) {
+                    const fanotify_event_info_header *header = reinterpret_cast<const fanotify_event_info_header *>(info);
+                    if (header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                        fid = reinterpret_cast<const fanotify_event_info_fid *>(info);
+                        break;
+                    }
+                    if (!header->len)
+                        break;
+                    info += header->len;
+                }
+                if (!fid)
+                    continue;
+
+                file_handle *handle = reinterpret_cast<file_handle *>(const_cast<unsigned char *>(fid->handle));
+                const char *name = reinterpret_cast<const char *>(handle->f_handle + handle->handle_bytes);
+                uint64_t fsid;
+                memcpy(&fsid, &fid->fsid, sizeof(fsid));
+                String key(reinterpret_cast<const char *>(&fsid), sizeof(fsid));
+                key.append(reinterpret_cast<const char *>(handle), sizeof(file_handle) + handle->handle_bytes);
+
+                Path &dir = dirs[key];
+                if (dir.isEmpty()) {
+                    for (const auto &subtree : mSubtrees) {
+                        if (subtree.second.fd == -1 || subtree.second.fsid != fsid)
+                            continue;
+                        const int fd = open_by_handle_at(subtree.second.fd, handle, O_PATH|O_CLOEXEC);
+                        if (fd != -1) {
+                            char link[64];
+                            snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+                            char target[PATH_MAX];
+                            const ssize_t size = readlink(link, target, sizeof(target) - 1);
+                            if (size > 0) {
+                                dir.assign(target, size);
+                                if (!dir.endsWith('/'))
+                                    dir.append('/');
+                            }
+                            ::close(fd);
+                        }
+                        break;
+                    }
+                    // gone, or not where any subtree can see it
+                    if (dir.isEmpty())
+                        dir = "-";
+                }
+                if (dir == "-" || !strcmp(name, "."))
+                    continue;
+
+                const Path path = dir + name;
+                const Path root = subtreeOf(path);
+                if (root.isEmpty() || mSubtrees.value(root).fd == -1)
+                    continue;
+
+                if (event->mask & (FAN_CREATE|FAN_MOVED_TO)) {
+                    add(Add, path);
+                } else if (event->mask & (FAN_DELETE|FAN_MOVED_FROM)) {
+                    add(Remove, path);
+                } else if (event->mask & (FAN_ATTRIB|FAN_CLOSE_WRITE)) {
+                    add(Modified, path);
+                } else {
+                    continue;
+                }
+                changed = true;
+                if (event->mask & FAN_ONDIR && event->mask & (FAN_MOVED_FROM|FAN_MOVED_TO|FAN_DELETE))
+                    dirs.clear(); // directories below it have new paths
+            }
+        }
+    }
+    if (changed)
+        processChanges();
+#endif
+}
@@ -135,7 +135,7 @@ bool FileSystemWatcher::isWatching(const Path& p) const
     return mWatchedByPath.contains(p);
 }
 
-bool FileSystemWatcher::watch(const Path &p)
+bool FileSystemWatcher::watch(const Path &p, unsigned int)
 {
     Path path = p;
     assert(!path.isEmpty());
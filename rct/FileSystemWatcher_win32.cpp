@@ -340,7 +340,7 @@ Set<Path> FileSystemWatcher::watchedPaths() const
     return mWatcher->paths;
 }
 
-bool FileSystemWatcher::watch(const Path& p)
+bool FileSystemWatcher::watch(const Path& p, unsigned int)
 {
     std::lock_guard<std::mutex> locker(mWatcher->changeMutex);
     //printf("watching %s\n", p.constData());
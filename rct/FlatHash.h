@@ -0,0 +1,637 @@
+#ifndef FLATHASH_H
+#define FLATHASH_H
+
+#include <assert.h>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <new>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <tuple>
+#include <utility>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <rct/List.h>
+#include <rct/Log.h>
+#include <rct/Serializer.h>
+#include <rct/Set.h>
+
+// An open addressing hash table with the API of Hash. Entries live in
+// one array instead of a node each, next to an array with a control
+// byte per slot that holds 7 bits of the entry's hash. A lookup checks
+// the control bytes of a group of 16 slots at once and only compares
+// keys whose bits match, so it usually costs one cache miss for the
+// control bytes and one for the entry.
+//
+//     FlatHash<Atom, Symbol> symbols;
+//     symbols.reserve(count);
+//
+// Inserting may move every entry, iterators and references to entries
+// are only valid until the next insertion. Removing doesn't move
+// anything. The table never shrinks unless it's cleared.
+template <typename Key, typename Value, typename Hasher = std::hash<Key> >
+class FlatHash
+{
+public:
+    typedef std::pair<const Key, Value> value_type;
+    typedef Key key_type;
+    typedef Value mapped_type;
+
+    enum { GroupSize = 16 };
+
+    FlatHash()
+        : mCtrl(emptyGroup()), mSlots(0), mGroupMask(0), mSize(0), mGrowthLeft(0)
+    {}
+    FlatHash(const FlatHash &other)
+        : FlatHash()
+    {
+        reserve(other.mSize);
+        for (const value_type &entry : other)
+            insertUnique(hashOf(entry.first), entry);
+    }
+    FlatHash(FlatHash &&other)
+        : FlatHash()
+    {
+        swap(other);
+    }
+    FlatHash(std::initializer_list<value_type> entries)
+        : FlatHash()
+    {
+        reserve(entries.size());
+        for (const value_type &entry : entries)
+            insert(entry.first, entry.second);
+    }
+    ~FlatHash()
+    {
+        destroy();
+    }
+
+    FlatHash &operator=(const FlatHash &other)
+    {
+        if (this != &other) {
+            FlatHash copy(other);
+            swap(copy);
+        }
+        return *this;
+    }
+    FlatHash &operator=(FlatHash &&other)
+    {
+        if (this != &other) {
+            destroy();
+            swap(other);
+        }
+        return *this;
+    }
+
+    void swap(FlatHash &other)
+    {
+        std::swap(mCtrl, other.mCtrl);
+        std::swap(mSlots, other.mSlots);
+        std::swap(mGroupMask, other.mGroupMask);
+        std::swap(mSize, other.mSize);
+        std::swap(mGrowthLeft, other.mGrowthLeft);
+    }
+
+    template <typename Entry, typename Ctrl>
+    class Iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef typename FlatHash::value_type value_type;
+        typedef ptrdiff_t difference_type;
+        typedef Entry *pointer;
+        typedef Entry &reference;
+
+        Iterator()
+            : mCtrl(0), mSlot(0), mEnd(0)
+        {}
+        // iterator converts to const_iterator
+        template <typename E, typename C>
+        Iterator(const Iterator<E, C> &other)
+            : mCtrl(other.mCtrl), mSlot(other.mSlot), mEnd(other.mEnd)
+        {}
+
+        Entry &operator*() const { return *mSlot; }
+        Entry *operator->() const { return mSlot; }
+        Iterator &operator++()
+        {
+            ++mCtrl;
+            ++mSlot;
+            skipFree();
+            return *this;
+        }
+        Iterator operator++(int)
+        {
+            Iterator ret = *this;
+            ++*this;
+            return ret;
+        }
+        template <typename E, typename C>
+        bool operator==(const Iterator<E, C> &other) const { return mCtrl == other.mCtrl; }
+        template <typename E, typename C>
+        bool operator!=(const Iterator<E, C> &other) const { return mCtrl != other.mCtrl; }
+
+    private:
+        Iterator(Ctrl *ctrl, Entry *slot, Ctrl *end)
+            : mCtrl(ctrl), mSlot(slot), mEnd(end)
+        {}
+        void skipFree()
+        {
+            while (mCtrl != mEnd && *mCtrl < 0) {
+                ++mCtrl;
+                ++mSlot;
+            }
+        }
+
+        Ctrl *mCtrl;
+        Entry *mSlot;
+        Ctrl *mEnd;
+
+        template <typename E, typename C> friend class Iterator;
+        friend class FlatHash;
+    };
+    typedef Iterator<value_type, int8_t> iterator;
+    typedef Iterator<const value_type, const int8_t> const_iterator;
+
+    iterator begin() { return makeIterator(0, true); }
+    iterator end() { return makeIterator(capacity(), false); }
+    const_iterator begin() const { return const_cast<FlatHash *>(this)->begin(); }
+    const_iterator end() const { return const_cast<FlatHash *>(this)->end(); }
+    const_iterator constBegin() const { return begin(); }
+    const_iterator constEnd() const { return end(); }
+
+    size_t size() const { return mSize; }
+    bool isEmpty() const { return !mSize; }
+    bool empty() const { return !mSize; }
+    size_t capacity() const { return mSlots ? (mGroupMask + 1) * GroupSize : 0; }
+
+    // room for count entries without rehashing
+    void reserve(size_t count)
+    {
+        size_t groups = 1;
+        while (maxLoad(groups) < count)
+            groups *= 2;
+        if (!mSlots || groups > mGroupMask + 1)
+            rehash(groups);
+    }
+
+    void clear()
+    {
+        destroy();
+        mCtrl = emptyGroup();
+        mSlots = 0;
+        mGroupMask = mSize = mGrowthLeft = 0;
+    }
+
+    iterator find(const Key &key)
+    {
+        const size_t index = indexOf(key);
+        return index == NotFound ? end() : makeIterator(index, false);
+    }
+    const_iterator find(const Key &key) const
+    {
+        return const_cast<FlatHash *>(this)->find(key);
+    }
+
+    bool contains(const Key &key) const
+    {
+        return indexOf(key) != NotFound;
+    }
+
+    Value value(const Key &key, const Value &defaultValue, bool *ok = 0) const
+    {
+        const size_t index = indexOf(key);
+        if (ok)
+            *ok = index != NotFound;
+        return index == NotFound ? defaultValue : mSlots[index].second;
+    }
+
+    Value value(const Key &key) const
+    {
+        return value(key, Value());
+    }
+
+    Value &operator[](const Key &key)
+    {
+        const size_t hash = hashOf(key);
+        size_t index = indexOf(key, hash);
+        if (index == NotFound)
+            index = insertUnique(hash, std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple());
+        return mSlots[index].second;
+    }
+
+    const Value &operator[](const Key &key) const
+    {
+        assert(contains(key));
+        return mSlots[indexOf(key)].second;
+    }
+
+    // false if key was already there, its value is left alone then
+    bool insert(const Key &key, const Value &value)
+    {
+        const size_t hash = hashOf(key);
+        if (indexOf(key, hash) != NotFound)
+            return false;
+        insertUnique(hash, key, value);
+        return true;
+    }
+
+    bool insert(Key &&key, Value &&value)
+    {
+        const size_t hash = hashOf(key);
+        if (indexOf(key, hash) != NotFound)
+            return false;
+        insertUnique(hash, std::move(key), std::move(value));
+        return true;
+    }
+
+    bool remove(const Key &key, Value *value = 0)
+    {
+        const size_t index = indexOf(key);
+        if (index == NotFound) {
+            if (value)
+                *value = Value();
+            return false;
+        }
+        if (value)
+            *value = std::move(mSlots[index].second);
+        eraseAt(index);
+        return true;
+    }
+
+    size_t remove(std::function<bool(const Key &key)> match)
+    {
+        size_t ret = 0;
+        for (size_t i = 0; i < capacity(); ++i) {
+            if (mCtrl[i] >= 0 && match(mSlots[i].first)) {
+                eraseAt(i);
+                ++ret;
+            }
+        }
+        return ret;
+    }
+
+    Value take(const Key &key, bool *ok = 0)
+    {
+        Value ret = Value();
+        const bool found = remove(key, &ret);
+        if (ok)
+            *ok = found;
+        return ret;
+    }
+
+    // returns the iterator after it
+    iterator erase(const_iterator it)
+    {
+        const size_t index = it.mSlot - mSlots;
+        eraseAt(index);
+        return makeIterator(index + 1, true);
+    }
+
+    size_t erase(const Key &key)
+    {
+        return remove(key) ? 1 : 0;
+    }
+
+    void deleteAll()
+    {
+        for (value_type &entry : *this)
+            delete entry.second;
+        clear();
+    }
+
+    FlatHash &unite(const FlatHash &other, size_t *count = 0)
+    {
+        for (const value_type &entry : other) {
+            Value &value = operator[](entry.first);
+            if (count && value != entry.second)
+                ++*count;
+            value = entry.second;
+        }
+        return *this;
+    }
+
+    FlatHash &subtract(const FlatHash &other)
+    {
+        for (const value_type &entry : other)
+            remove(entry.first);
+        return *this;
+    }
+
+    FlatHash &operator+=(const FlatHash &other) { return unite(other); }
+    FlatHash &operator-=(const FlatHash &other) { return subtract(other); }
+
+    List<Key> keys() const
+    {
+        List<Key> keys;
+        keys.reserve(mSize);
+        for (const value_type &entry : *this)
+            keys.append(entry.first);
+        return keys;
+    }
+
+    Set<Key> keysAsSet() const
+    {
+        Set<Key> keys;
+        for (const value_type &entry : *this)
+            keys.insert(entry.first);
+        return keys;
+    }
+
+    List<Value> values() const
+    {
+        List<Value> values;
+        values.reserve(mSize);
+        for (const value_type &entry : *this)
+            values.append(entry.second);
+        return values;
+    }
+
+private:
+    // control bytes, full slots hold the low 7 bits of the hash
+    enum : int8_t {
+        Empty = -128,
+        Deleted = -2
+    };
+    enum : size_t { NotFound = ~size_t(0) };
+
+    // 16 control bytes, bit i of a mask is slot i of the group
+    struct Group
+    {
+#ifdef __SSE2__
+        explicit Group(const int8_t *ctrl)
+            : bytes(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl)))
+        {}
+        uint32_t match(int8_t h2) const
+        {
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), bytes));
+        }
+        // Empty and Deleted are the negative ones
+        uint32_t matchFree() const { return _mm_movemask_epi8(bytes); }
+
+        __m128i bytes;
+#else
+        explicit Group(const int8_t *ctrl)
+        {
+            memcpy(bytes, ctrl, GroupSize);
+        }
+        uint32_t match(int8_t h2) const
+        {
+            uint32_t ret = 0;
+            for (int i = 0; i < GroupSize; ++i)
+                ret |= uint32_t(bytes[i] == h2) << i;
+            return ret;
+        }
+        uint32_t matchFree() const
+        {
+            uint32_t ret = 0;
+            for (int i = 0; i < GroupSize; ++i)
+                ret |= uint32_t(bytes[i] < 0) << i;
+            return ret;
+        }
+
+        int8_t bytes[GroupSize];
+#endif
+        uint32_t matchEmpty() const { return match(Empty); }
+    };
+
+    static int8_t *emptyGroup()
+    {
+        alignas(GroupSize) static int8_t empty[GroupSize] = {
+            Empty, Empty, Empty, Empty, Empty, Empty, Empty, Empty,
+            Empty, Empty, Empty, Empty, Empty, Empty, Empty, Empty
+        };
+        return empty;
+    }
+
+    // 7/8 of the slots, beyond that probe sequences get long
+    static size_t maxLoad(size_t groups) { return groups * GroupSize * 7 / 8; }
+
+    // std::hash is the identity for integers, spread them over all bits
+    size_t hashOf(const Key &key) const
+    {
+        uint64_t hash = static_cast<uint64_t>(Hasher()(key)) * 0x9e3779b97f4a7c15ull;
+        return static_cast<size_t>(hash ^ (hash >> 32));
+    }
+    static int8_t h2(size_t hash) { return static_cast<int8_t>(hash & 0x7f); }
+    static size_t h1(size_t hash) { return hash >> 7; }
+
+    size_t indexOf(const Key &key) const
+    {
+        return mSize ? indexOf(key, hashOf(key)) : NotFound;
+    }
+
+    // Groups are probed quadratically, a group with an empty slot ends
+    // the search since an insertion would have stopped there.
+    size_t indexOf(const Key &key, size_t hash) const
+    {
+        if (!mSlots)
+            return NotFound;
+        size_t group = h1(hash) & mGroupMask;
+        for (size_t step = 1; ; ++step) {
+            const Group g(mCtrl + group * GroupSize);
+            for (uint32_t match = g.match(h2(hash)); match; match &= match - 1) {
+                const size_t index = group * GroupSize + __builtin_ctz(match);
+                if (mSlots[index].first == key)
+                    return index;
+            }
+            if (g.matchEmpty() || step > mGroupMask)
+                return NotFound;
+            group = (group + step) & mGroupMask;
+        }
+    }
+
+    size_t freeSlot(size_t hash) const
+    {
+        size_t group = h1(hash) & mGroupMask;
+        for (size_t step = 1; ; ++step) {
+            if (const uint32_t free = Group(mCtrl + group * GroupSize).matchFree())
+                return group * GroupSize + __builtin_ctz(free);
+            group = (group + step) & mGroupMask;
+        }
+    }
+
+    template <typename... Args>
+    size_t insertUnique(size_t hash, Args &&...args)
+    {
+        if (!mGrowthLeft) {
+            // lots of tombstones, get rid of them without growing
+            const size_t groups = mGroupMask + 1;
+            rehash(mSlots && mSize <= maxLoad(groups) / 2 ? groups : (mSlots ? groups * 2 : 1));
+        }
+        const size_t index = freeSlot(hash);
+        new (mSlots + index) value_type(std::forward<Args>(args)...);
+        if (mCtrl[index] == Empty)
+            --mGrowthLeft;
+        mCtrl[index] = h2(hash);
+        ++mSize;
+        return index;
+    }
+
+    // A group that still has an empty slot never stopped a probe, its
+    // slots can become empty again. Otherwise lookups have to be able
+    // to walk past it.
+    void eraseAt(size_t index)
+    {
+        mSlots[index].~value_type();
+        --mSize;
+        if (Group(mCtrl + (index & ~size_t(GroupSize - 1))).matchEmpty()) {
+            mCtrl[index] = Empty;
+            ++mGrowthLeft;
+        } else {
+            mCtrl[index] = Deleted;
+        }
+    }
+
+    void rehash(size_t groups)
+    {
+        int8_t *oldCtrl = mCtrl;
+        value_type *oldSlots = mSlots;
+        const size_t oldCapacity = capacity();
+
+        const size_t slots = groups * GroupSize;
+        mCtrl = static_cast<int8_t *>(::operator new(slots));
+        memset(mCtrl, Empty, slots);
+        mSlots = static_cast<value_type *>(::operator new(slots * sizeof(value_type)));
+        mGroupMask = groups - 1;
+        mGrowthLeft = maxLoad(groups) - mSize;
+
+        for (size_t i = 0; i < oldCapacity; ++i) {
+            if (oldCtrl[i] < 0)
+                continue;
+            value_type &entry = oldSlots[i];
+            const size_t hash = hashOf(entry.first);
+            const size_t index = freeSlot(hash);
+            mCtrl[index] = h2(hash);
+            // the old entry is destroyed right after, its key may be moved from
+            new (mSlots + index) value_type(std::move(const_cast<Key &>(entry.first)), std::move(entry.second));
+            entry.~value_type();
+        }
+        if (oldSlots) {
+            ::operator delete(oldCtrl);
+            ::operator delete(oldSlots);
+        }
+    }
+
+    void destroy()
+    {
+        if (!mSlots)
+            return;
+        const size_t slots = capacity();
+        for (size_t i = 0; i < slots; ++i) {
+            if (mCtrl[i] >= 0)
+                mSlots[i].~value_type();
+        }
+        ::operator delete(mCtrl);
+        ::operator delete(mSlots);
+        mSlots = 0;
+    }
+
+    iterator makeIterator(size_t index, bool skip)
+    {
+        const size_t slots = capacity();
+        iterator it(mCtrl + index, mSlots + index, mCtrl + slots);
+        if (skip)
+            it.skipFree();
+        return it;
+    }
+
+    int8_t *mCtrl;
+    value_type *mSlots;
+    size_t mGroupMask, mSize, mGrowthLeft;
+};
+
+template <typename Key, typename Value, typename Hasher>
+inline const FlatHash<Key, Value, Hasher> operator+(const FlatHash<Key, Value, Hasher> &l,
+                                                    const FlatHash<Key, Value, Hasher> &r)
+{
+    FlatHash<Key, Value, Hasher> ret = l;
+    ret += r;
+    return ret;
+}
+
+template <typename Key, typename Value, typename Hasher>
+inline const FlatHash<Key, Value, Hasher> operator-(const FlatHash<Key, Value, Hasher> &l,
+                                                    const FlatHash<Key, Value, Hasher> &r)
+{
+    FlatHash<Key, Value, Hasher> ret = l;
+    ret -= r;
+    return ret;
+}
+
+// same format as Hash, one can be read back as the other
+template <typename Key, typename Value, typename Hasher>
+Serializer &operator<<(Serializer &s, const FlatHash<Key, Value, Hasher> &map)
+{
+    const uint32_t size = map.size();
+    s << size;
+    for (const auto &entry : map)
+        s << entry.first << entry.second;
+    return s;
+}
+
+template <typename Key, typename Value, typename Hasher>
+Deserializer &operator>>(Deserializer &s, FlatHash<Key, Value, Hasher> &map)
+{
+    uint32_t size;
+    s >> size;
+    map.clear();
+    if (size) {
+        map.reserve(size);
+        Key key;
+        Value value;
+        for (uint32_t i=0; i<size; ++i) {
+            s >> key >> value;
+            map[key] = std::move(value);
+        }
+    }
+    return s;
+}
+
+template <typename Key, typename Value, typename Hasher>
+size_t serializedSize(const FlatHash<Key, Value, Hasher> &map)
+{
+    size_t size = Serializer::sizeOf<uint32_t>();
+    for (const auto &entry : map)
+        size += serializedSize(entry.first) + serializedSize(entry.second);
+    return size;
+}
+
+template <typename Key, typename Value, typename Hasher>
+inline Log operator<<(Log stream, const FlatHash<Key, Value, Hasher> &map)
+{
+    bool old;
+    if (!(stream.flags() & LogOutput::NoTypename)) {
+        stream << "FlatHash<";
+        old = stream.setSpacing(false);
+        stream << typeName<Key>() << ", " << typeName<Value>() << ">(";
+    } else {
+        old = stream.setSpacing(false);
+    }
+    bool first = true;
+    for (const auto &entry : map) {
+        if (first) {
+            stream.disableNextSpacing();
+            first = false;
+        } else {
+            stream << ", ";
+        }
+        stream.setSpacing(old);
+        stream << entry.first;
+        old = stream.setSpacing(false);
+        stream << ": ";
+        stream.setSpacing(old);
+        stream << entry.second;
+        old = stream.setSpacing(false);
+    }
+    if (!(stream.flags() & LogOutput::NoTypename))
+        stream << ")";
+    stream.setSpacing(old);
+    return stream;
+}
+
+#endif
@@ -0,0 +1,511 @@
+#ifndef FLATMAP_H
+#define FLATMAP_H
+
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <utility>
+
+#include <rct/FlatSet.h>
+#include <rct/List.h>
+#include <rct/Log.h>
+#include <rct/Serializer.h>
+#include <rct/Set.h>
+
+// A map kept as a sorted List of keys and a List of values in the same
+// order. Lookups are binary searches over the keys alone, which stay
+// dense in the cache no matter how big the values are. Inserting and
+// removing single entries moves everything after them, the map is meant
+// to be built in bulk and then read:
+//
+//     Map<Path, uint32_t> map = ...;
+//     FlatMap<Path, uint32_t> flat;
+//     flat.insertSorted(map.begin(), map.end());
+//
+// Iterators dereference to an entry with first and second, like the
+// ones of Map, but it's a pair of references rather than a pair.
+//
+// The keys and then the values are serialized as List does it, as
+// single blocks of memory when they're native types, so this is not
+// the format of Map.
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class FlatMap
+{
+    // iterators point into the values
+    static_assert(!std::is_same<Value, bool>::value, "FlatMap can't hold bool values, List<bool> is a bit vector");
+public:
+    typedef Key key_type;
+    typedef Value mapped_type;
+
+    template <typename V>
+    class Iterator
+    {
+    public:
+        struct Entry
+        {
+            const Key &first;
+            V &second;
+        };
+        struct Arrow
+        {
+            const Entry *operator->() const { return &entry; }
+            Entry entry;
+        };
+
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef Entry value_type;
+        typedef Entry reference;
+        typedef Arrow pointer;
+        typedef ptrdiff_t difference_type;
+
+        Iterator()
+            : mKey(0), mValue(0)
+        {}
+        template <typename W>
+        Iterator(const Iterator<W> &other)
+            : mKey(other.mKey), mValue(other.mValue)
+        {}
+
+        Entry operator*() const { return Entry { *mKey, *mValue }; }
+        Arrow operator->() const { return Arrow { Entry { *mKey, *mValue } }; }
+        const Key &key() const { return *mKey; }
+        V &value() const { return *mValue; }
+
+        Iterator &operator++()
+        {
+            ++mKey;
+            ++mValue;
+            return *this;
+        }
+        Iterator operator++(int)
+        {
+            Iterator ret = *this;
+            ++*this;
+            return ret;
+        }
+        Iterator &operator--()
+        {
+            --mKey;
+            --mValue;
+            return *this;
+        }
+        Iterator operator--(int)
+        {
+            Iterator ret = *this;
+            --*this;
+            return ret;
+        }
+        Iterator operator+(ptrdiff_t count) const { return Iterator(mKey + count, mValue + count); }
+        template <typename W>
+        ptrdiff_t operator-(const Iterator<W> &other) const { return mKey - other.mKey; }
+        template <typename W>
+        bool operator==(const Iterator<W> &other) const { return mKey == other.mKey; }
+        template <typename W>
+        bool operator!=(const Iterator<W> &other) const { return mKey != other.mKey; }
+
+    private:
+        Iterator(const Key *key, V *value)
+            : mKey(key), mValue(value)
+        {}
+
+        const Key *mKey;
+        V *mValue;
+
+        template <typename W> friend class Iterator;
+        friend class FlatMap;
+    };
+    typedef Iterator<Value> iterator;
+    typedef Iterator<const Value> const_iterator;
+
+    FlatMap() {}
+    FlatMap(std::initializer_list<std::pair<Key, Value> > init)
+    {
+        *this = fromUnsorted(init.begin(), init.end());
+    }
+
+    // Builds the map from key/value pairs in any order. Of entries with
+    // the same key the last one wins, as if they were assigned in order.
+    template <typename It>
+    static FlatMap fromUnsorted(It begin, It end)
+    {
+        List<std::pair<Key, Value> > entries;
+        for (It it = begin; it != end; ++it)
+            entries.append(std::pair<Key, Value>(it->first, it->second));
+        return fromUnsorted(std::move(entries));
+    }
+
+    static FlatMap fromUnsorted(List<std::pair<Key, Value> > &&entries)
+    {
+        std::stable_sort(entries.begin(), entries.end(),
+                         [](const std::pair<Key, Value> &l, const std::pair<Key, Value> &r) {
+                             return Compare()(l.first, r.first);
+                         });
+        FlatMap ret;
+        ret.mKeys.reserve(entries.size());
+        ret.mValues.reserve(entries.size());
+        for (auto &entry : entries) {
+            if (!ret.mKeys.isEmpty() && !Compare()(ret.mKeys.last(), entry.first)) {
+                ret.mValues.last() = std::move(entry.second);
+            } else {
+                ret.mKeys.append(std::move(entry.first));
+                ret.mValues.append(std::move(entry.second));
+            }
+        }
+        return ret;
+    }
+
+    // Takes over keys and values, keys must be strictly ascending
+    static FlatMap fromSorted(List<Key> &&keys, List<Value> &&values)
+    {
+        assert(keys.size() == values.size());
+        FlatMap ret;
+        ret.mKeys = std::move(keys);
+        ret.mValues = std::move(values);
+        assert(ret.isSorted());
+        return ret;
+    }
+
+    // Adds the key/value pairs of [begin, end), which must be in
+    // strictly ascending order, like the entries of a Map or another
+    // FlatMap. A range that goes after everything there is appended,
+    // others are merged in linear time. Entries of the range replace
+    // existing ones with the same key.
+    template <typename It>
+    void insertSorted(It begin, It end)
+    {
+        if (begin == end)
+            return;
+        if (mKeys.isEmpty() || Compare()(mKeys.last(), begin->first)) {
+            for (It it = begin; it != end; ++it) {
+                mKeys.append(it->first);
+                mValues.append(it->second);
+            }
+            return;
+        }
+        List<Key> keys;
+        List<Value> values;
+        keys.reserve(mKeys.size() + std::distance(begin, end));
+        values.reserve(keys.capacity());
+        size_t i = 0;
+        const size_t count = mKeys.size();
+        for (It it = begin; it != end; ++it) {
+            while (i < count && Compare()(mKeys[i], it->first)) {
+                keys.append(std::move(mKeys[i]));
+                values.append(std::move(mValues[i]));
+                ++i;
+            }
+            if (i < count && !Compare()(it->first, mKeys[i]))
+                ++i;
+            keys.append(it->first);
+            values.append(it->second);
+        }
+        for (; i < count; ++i) {
+            keys.append(std::move(mKeys[i]));
+            values.append(std::move(mValues[i]));
+        }
+        mKeys = std::move(keys);
+        mValues = std::move(values);
+    }
+
+    void reserve(size_t size)
+    {
+        mKeys.reserve(size);
+        mValues.reserve(size);
+    }
+
+    void squeeze()
+    {
+        mKeys.shrink_to_fit();
+        mValues.shrink_to_fit();
+    }
+
+    iterator begin() { return iterator(mKeys.data(), mValues.data()); }
+    iterator end() { return begin() + mKeys.size(); }
+    const_iterator begin() const { return const_iterator(mKeys.data(), mValues.data()); }
+    const_iterator end() const { return begin() + mKeys.size(); }
+    const_iterator constBegin() const { return begin(); }
+    const_iterator constEnd() const { return end(); }
+
+    iterator lower_bound(const Key &key) { return begin() + lowerBound(key); }
+    const_iterator lower_bound(const Key &key) const { return begin() + lowerBound(key); }
+    iterator upper_bound(const Key &key) { return begin() + upperBound(key); }
+    const_iterator upper_bound(const Key &key) const { return begin() + upperBound(key); }
+    iterator find(const Key &key) { return begin() + indexOf(key); }
+    const_iterator find(const Key &key) const { return begin() + indexOf(key); }
+
+    bool contains(const Key &key) const
+    {
+        return indexOf(key) != mKeys.size();
+    }
+
+    size_t size() const { return mKeys.size(); }
+    bool isEmpty() const { return mKeys.isEmpty(); }
+    bool empty() const { return mKeys.isEmpty(); }
+
+    void clear()
+    {
+        mKeys.clear();
+        mValues.clear();
+    }
+
+    Value value(const Key &key, const Value &defaultValue, bool *ok = 0) const
+    {
+        const size_t idx = indexOf(key);
+        const bool found = idx != mKeys.size();
+        if (ok)
+            *ok = found;
+        return found ? mValues[idx] : defaultValue;
+    }
+
+    Value value(const Key &key) const
+    {
+        return value(key, Value());
+    }
+
+    Value &operator[](const Key &key)
+    {
+        const size_t idx = lowerBound(key);
+        if (idx == mKeys.size() || Compare()(key, mKeys[idx])) {
+            mKeys.insert(idx, key);
+            mValues.insert(idx, Value());
+        }
+        return mValues[idx];
+    }
+
+    const Value &operator[](const Key &key) const
+    {
+        assert(contains(key));
+        return mValues[indexOf(key)];
+    }
+
+    bool insert(const Key &key, const Value &value)
+    {
+        const size_t idx = lowerBound(key);
+        if (idx != mKeys.size() && !Compare()(key, mKeys[idx]))
+            return false;
+        mKeys.insert(idx, key);
+        mValues.insert(idx, value);
+        return true;
+    }
+
+    bool remove(const Key &key, Value *value = 0)
+    {
+        const size_t idx = indexOf(key);
+        if (idx == mKeys.size()) {
+            if (value)
+                *value = Value();
+            return false;
+        }
+        if (value)
+            *value = std::move(mValues[idx]);
+        mKeys.removeAt(idx);
+        mValues.removeAt(idx);
+        return true;
+    }
+
+    size_t remove(std::function<bool(const Key &key)> match)
+    {
+        size_t to = 0;
+        const size_t count = mKeys.size();
+        for (size_t from = 0; from < count; ++from) {
+            if (match(mKeys[from]))
+                continue;
+            if (to != from) {
+                mKeys[to] = std::move(mKeys[from]);
+                mValues[to] = std::move(mValues[from]);
+            }
+            ++to;
+        }
+        mKeys.resize(to);
+        mValues.resize(to);
+        return count - to;
+    }
+
+    Value take(const Key &key, bool *ok = 0)
+    {
+        Value ret = Value();
+        const bool found = remove(key, &ret);
+        if (ok)
+            *ok = found;
+        return ret;
+    }
+
+    iterator erase(const_iterator it)
+    {
+        const size_t idx = it - begin();
+        mKeys.removeAt(idx);
+        mValues.removeAt(idx);
+        return begin() + idx;
+    }
+
+    void deleteAll()
+    {
+        for (Value &value : mValues)
+            delete value;
+        clear();
+    }
+
+    FlatMap &unite(const FlatMap &other, size_t *count = 0)
+    {
+        // insertSorted() moves out of the entries it's reading
+        if (&other == this)
+            return *this;
+        if (count) {
+            for (const auto &entry : other) {
+                bool ok;
+                const Value &current = value(entry.first, Value(), &ok);
+                if (!ok || current != entry.second)
+                    ++*count;
+            }
+        }
+        insertSorted(other.begin(), other.end());
+        return *this;
+    }
+
+    FlatMap &subtract(const FlatMap &other)
+    {
+        remove([&other](const Key &key) { return other.contains(key); });
+        return *this;
+    }
+
+    FlatMap &operator+=(const FlatMap &other) { return unite(other); }
+    FlatMap &operator-=(const FlatMap &other) { return subtract(other); }
+
+    const List<Key> &keys() const { return mKeys; }
+    const List<Value> &values() const { return mValues; }
+    Set<Key> keysAsSet() const { return mKeys.toSet(); }
+    FlatSet<Key, Compare> keysAsFlatSet() const { return FlatSet<Key, Compare>::fromUnsorted(List<Key>(mKeys)); }
+
+private:
+    size_t lowerBound(const Key &key) const
+    {
+        return Rct::flatLowerBound(mKeys.data(), mKeys.size(), key, Compare());
+    }
+
+    size_t upperBound(const Key &key) const
+    {
+        const size_t idx = lowerBound(key);
+        return idx != mKeys.size() && !Compare()(key, mKeys[idx]) ? idx + 1 : idx;
+    }
+
+    // mKeys.size() when it's not there
+    size_t indexOf(const Key &key) const
+    {
+        const size_t idx = lowerBound(key);
+        return idx != mKeys.size() && !Compare()(key, mKeys[idx]) ? idx : mKeys.size();
+    }
+
+    bool isSorted() const
+    {
+        return std::adjacent_find(mKeys.begin(), mKeys.end(), [](const Key &l, const Key &r) {
+                return !Compare()(l, r);
+            }) == mKeys.end();
+    }
+
+    List<Key> mKeys;
+    List<Value> mValues;
+
+    template <typename K, typename V, typename C>
+    friend Serializer &operator<<(Serializer &s, const FlatMap<K, V, C> &map);
+    template <typename K, typename V, typename C>
+    friend Deserializer &operator>>(Deserializer &s, FlatMap<K, V, C> &map);
+    template <typename K, typename V, typename C>
+    friend size_t serializedSize(const FlatMap<K, V, C> &map);
+};
+
+template <typename Key, typename Value, typename Compare>
+inline const FlatMap<Key, Value, Compare> operator+(const FlatMap<Key, Value, Compare> &l,
+                                                    const FlatMap<Key, Value, Compare> &r)
+{
+    FlatMap<Key, Value, Compare> ret = l;
+    ret += r;
+    return ret;
+}
+
+template <typename Key, typename Value, typename Compare>
+inline const FlatMap<Key, Value, Compare> operator-(const FlatMap<Key, Value, Compare> &l,
+                                                    const FlatMap<Key, Value, Compare> &r)
+{
+    FlatMap<Key, Value, Compare> ret = l;
+    ret -= r;
+    return ret;
+}
+
+template <typename Key, typename Value, typename Compare>
+Serializer &operator<<(Serializer &s, const FlatMap<Key, Value, Compare> &map)
+{
+    const uint32_t size = map.size();
+    s << size;
+    if (size) {
+        serializeElements(s, map.mKeys, std::integral_constant<bool, BulkSerializable<Key>::value>());
+        serializeElements(s, map.mValues, std::integral_constant<bool, BulkSerializable<Value>::value>());
+    }
+    return s;
+}
+
+// keys that aren't ascending, from a writer with a different Compare,
+// are sorted here
+template <typename Key, typename Value, typename Compare>
+Deserializer &operator>>(Deserializer &s, FlatMap<Key, Value, Compare> &map)
+{
+    uint32_t size;
+    s >> size;
+    map.clear();
+    if (size) {
+        map.mKeys.resize(size);
+        map.mValues.resize(size);
+        deserializeElements(s, map.mKeys, std::integral_constant<bool, BulkSerializable<Key>::value>());
+        deserializeElements(s, map.mValues, std::integral_constant<bool, BulkSerializable<Value>::value>());
+        if (!map.isSorted()) {
+            List<std::pair<Key, Value> > entries(size);
+            for (uint32_t i=0; i<size; ++i)
+                entries[i] = std::make_pair(std::move(map.mKeys[i]), std::move(map.mValues[i]));
+            map = FlatMap<Key, Value, Compare>::fromUnsorted(std::move(entries));
+        }
+    }
+    return s;
+}
+
+template <typename Key, typename Value, typename Compare>
+size_t serializedSize(const FlatMap<Key, Value, Compare> &map)
+{
+    return Serializer::sizeOf<uint32_t>()
+        + serializedElementsSize(map.mKeys, std::integral_constant<bool, BulkSerializable<Key>::value>())
+        + serializedElementsSize(map.mValues, std::integral_constant<bool, BulkSerializable<Value>::value>());
+}
+
+template <typename Key, typename Value, typename Compare>
+inline Log operator<<(Log stream, const FlatMap<Key, Value, Compare> &map)
+{
+    bool old;
+    if (!(stream.flags() & LogOutput::NoTypename)) {
+        stream << "FlatMap<";
+        old = stream.setSpacing(false);
+        stream << typeName<Key>() << ", " << typeName<Value>() << ">(";
+    } else {
+        old = stream.setSpacing(false);
+    }
+    bool first = true;
+    for (const auto &entry : map) {
+        if (first) {
+            stream.disableNextSpacing();
+            first = false;
+        } else {
+            stream << ", ";
+        }
+        stream.setSpacing(old);
+        stream << entry.first;
+        old = stream.setSpacing(false);
+        stream << ": ";
+        stream.setSpacing(old);
+        stream << entry.second;
+        old = stream.setSpacing(false);
+    }
+    if (!(stream.flags() & LogOutput::NoTypename))
+        stream << ")";
+    stream.setSpacing(old);
+    return stream;
+}
+
+#endif
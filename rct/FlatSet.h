@@ -0,0 +1,339 @@
+#ifndef FLATSET_H
+#define FLATSET_H
+
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+
+#include <rct/List.h>
+#include <rct/Log.h>
+#include <rct/Serializer.h>
+#include <rct/Set.h>
+
+namespace Rct {
+// Index of the first element of data that isn't less than key. The
+// search has no branches to mispredict and prefetches both halves it
+// may continue in, so for large arrays the memory loads of two steps
+// overlap.
+template <typename T, typename Key, typename Compare>
+size_t flatLowerBound(const T *data, size_t size, const Key &key, const Compare &compare)
+{
+    if (!size)
+        return 0;
+    const T *base = data;
+    while (size > 1) {
+        const size_t half = size / 2;
+        __builtin_prefetch(base + half / 2);
+        __builtin_prefetch(base + half + half / 2);
+        base = compare(base[half], key) ? base + half : base;
+        size -= half;
+    }
+    return (base - data) + compare(*base, key);
+}
+}
+
+// A set kept as a sorted List. Lookups are binary searches over
+// contiguous memory, inserting and removing single elements moves
+// everything after them. Meant for sets that are built once, with
+// fromUnsorted(), insertSorted() or a Deserializer, and then mostly read:
+//
+//     FlatSet<uint32_t> ids = FlatSet<uint32_t>::fromUnsorted(std::move(list));
+//
+// Serializes like Set and List, one can be read as the other.
+template <typename T, typename Compare = std::less<T> >
+class FlatSet
+{
+public:
+    typedef T value_type;
+    typedef T key_type;
+    typedef typename List<T>::const_iterator iterator;
+    typedef typename List<T>::const_iterator const_iterator;
+
+    FlatSet() {}
+    FlatSet(std::initializer_list<T> init)
+        : mData(init)
+    {
+        normalize();
+    }
+
+    // sorts and removes duplicates
+    static FlatSet fromUnsorted(List<T> &&list)
+    {
+        FlatSet ret;
+        ret.mData = std::move(list);
+        ret.normalize();
+        return ret;
+    }
+
+    template <typename Iterator>
+    static FlatSet fromUnsorted(Iterator begin, Iterator end)
+    {
+        List<T> list;
+        for (Iterator it = begin; it != end; ++it)
+            list.append(*it);
+        return fromUnsorted(std::move(list));
+    }
+
+    // Adds the ascending range [begin, end). A range that goes after
+    // everything there is appended, others are merged in linear time.
+    template <typename Iterator>
+    void insertSorted(Iterator begin, Iterator end)
+    {
+        const size_t old = mData.size();
+        for (Iterator it = begin; it != end; ++it)
+            mData.append(*it);
+        if (old && old < mData.size() && !Compare()(mData[old - 1], mData[old])) {
+            std::inplace_merge(mData.begin(), mData.begin() + old, mData.end(), Compare());
+            unique();
+        }
+    }
+
+    void reserve(size_t size) { mData.reserve(size); }
+    void squeeze() { mData.shrink_to_fit(); }
+
+    const_iterator begin() const { return mData.begin(); }
+    const_iterator end() const { return mData.end(); }
+    const_iterator constBegin() const { return mData.begin(); }
+    const_iterator constEnd() const { return mData.end(); }
+
+    const_iterator lower_bound(const T &t) const
+    {
+        return mData.begin() + Rct::flatLowerBound(mData.data(), mData.size(), t, Compare());
+    }
+
+    const_iterator upper_bound(const T &t) const
+    {
+        return std::upper_bound(lower_bound(t), end(), t, Compare());
+    }
+
+    const_iterator find(const T &t) const
+    {
+        const const_iterator it = lower_bound(t);
+        return it != end() && !Compare()(t, *it) ? it : end();
+    }
+
+    bool contains(const T &t) const
+    {
+        return find(t) != end();
+    }
+
+    size_t size() const { return mData.size(); }
+    bool isEmpty() const { return mData.isEmpty(); }
+    bool empty() const { return mData.isEmpty(); }
+    void clear() { mData.clear(); }
+
+    const T &at(size_t idx) const { return mData.at(idx); }
+    const T &first() const { return mData.first(); }
+    const T &last() const { return mData.last(); }
+    const List<T> &toList() const { return mData; }
+    Set<T> toSet() const { return mData.toSet(); }
+
+    bool insert(const T &t)
+    {
+        const const_iterator it = lower_bound(t);
+        if (it != end() && !Compare()(t, *it))
+            return false;
+        mData.insert(it - begin(), t);
+        return true;
+    }
+
+    bool remove(const T &t)
+    {
+        const const_iterator it = find(t);
+        if (it == end())
+            return false;
+        mData.erase(mData.begin() + (it - begin()));
+        return true;
+    }
+
+    size_t remove(std::function<bool(const T &t)> match)
+    {
+        return mData.remove(match);
+    }
+
+    const_iterator erase(const_iterator it)
+    {
+        return mData.erase(mData.begin() + (it - begin()));
+    }
+
+    void deleteAll()
+    {
+        for (T &t : mData)
+            delete t;
+        mData.clear();
+    }
+
+    FlatSet &unite(const FlatSet &other, size_t *count = 0)
+    {
+        // insertSorted() appends to what it's reading
+        if (&other == this) {
+            if (count)
+                *count = 0;
+            return *this;
+        }
+        const size_t old = size();
+        insertSorted(other.begin(), other.end());
+        if (count)
+            *count = size() - old;
+        return *this;
+    }
+
+    FlatSet &unite(const List<T> &other, size_t *count = 0)
+    {
+        return unite(fromUnsorted(other.begin(), other.end()), count);
+    }
+
+    FlatSet &subtract(const FlatSet &other, size_t *count = 0)
+    {
+        List<T> ret;
+        ret.reserve(mData.size());
+        std::set_difference(mData.begin(), mData.end(), other.begin(), other.end(),
+                            std::back_inserter(ret), Compare());
+        if (count)
+            *count = mData.size() - ret.size();
+        mData = std::move(ret);
+        return *this;
+    }
+
+    bool intersects(const FlatSet &other) const
+    {
+        const_iterator a = begin(), b = other.begin();
+        while (a != end() && b != other.end()) {
+            if (Compare()(*a, *b)) {
+                ++a;
+            } else if (Compare()(*b, *a)) {
+                ++b;
+            } else {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    FlatSet intersected(const FlatSet &other) const
+    {
+        FlatSet ret;
+        std::set_intersection(begin(), end(), other.begin(), other.end(),
+                              std::back_inserter(ret.mData), Compare());
+        return ret;
+    }
+
+    FlatSet &operator+=(const FlatSet &other) { return unite(other); }
+    FlatSet &operator+=(const List<T> &other) { return unite(other); }
+    FlatSet &operator+=(const T &t)
+    {
+        insert(t);
+        return *this;
+    }
+    FlatSet &operator<<(const T &t)
+    {
+        insert(t);
+        return *this;
+    }
+    FlatSet &operator<<(const FlatSet &other) { return unite(other); }
+    FlatSet &operator<<(const List<T> &other) { return unite(other); }
+    FlatSet &operator-=(const FlatSet &other) { return subtract(other); }
+
+    bool operator==(const FlatSet &other) const
+    {
+        return size() == other.size() && std::equal(begin(), end(), other.begin());
+    }
+    bool operator!=(const FlatSet &other) const { return !operator==(other); }
+
+private:
+    bool isSorted() const
+    {
+        return std::adjacent_find(mData.begin(), mData.end(), [](const T &l, const T &r) {
+                return !Compare()(l, r);
+            }) == mData.end();
+    }
+
+    void normalize()
+    {
+        if (!isSorted()) {
+            std::sort(mData.begin(), mData.end(), Compare());
+            unique();
+        }
+    }
+
+    void unique()
+    {
+        mData.erase(std::unique(mData.begin(), mData.end(), [](const T &l, const T &r) {
+                    return !Compare()(l, r) && !Compare()(r, l);
+                }), mData.end());
+    }
+
+    List<T> mData;
+
+    template <typename U, typename C> friend Deserializer &operator>>(Deserializer &s, FlatSet<U, C> &set);
+};
+
+template <typename T, typename Compare>
+inline const FlatSet<T, Compare> operator+(const FlatSet<T, Compare> &l, const FlatSet<T, Compare> &r)
+{
+    FlatSet<T, Compare> ret = l;
+    ret += r;
+    return ret;
+}
+
+template <typename T, typename Compare>
+inline const FlatSet<T, Compare> operator-(const FlatSet<T, Compare> &l, const FlatSet<T, Compare> &r)
+{
+    FlatSet<T, Compare> ret = l;
+    ret -= r;
+    return ret;
+}
+
+template <typename T, typename Compare>
+Serializer &operator<<(Serializer &s, const FlatSet<T, Compare> &set)
+{
+    s << set.toList();
+    return s;
+}
+
+// data written by something else, a List for instance, is sorted here
+template <typename T, typename Compare>
+Deserializer &operator>>(Deserializer &s, FlatSet<T, Compare> &set)
+{
+    set.clear();
+    s >> set.mData;
+    set.normalize();
+    return s;
+}
+
+template <typename T, typename Compare>
+size_t serializedSize(const FlatSet<T, Compare> &set)
+{
+    return serializedSize(set.toList());
+}
+
+template <typename T, typename Compare>
+inline Log operator<<(Log stream, const FlatSet<T, Compare> &set)
+{
+    bool old;
+    if (!(stream.flags() & LogOutput::NoTypename)) {
+        stream << "FlatSet<";
+        old = stream.setSpacing(false);
+        stream << typeName<T>() << ">(";
+    } else {
+        old = stream.setSpacing(false);
+    }
+    bool first = true;
+    for (const T &t : set) {
+        if (first) {
+            stream.disableNextSpacing();
+            first = false;
+        } else {
+            stream << ", ";
+        }
+        stream.setSpacing(old);
+        stream << t;
+        old = stream.setSpacing(false);
+    }
+    if (!(stream.flags() & LogOutput::NoTypename))
+        stream << ")";
+    stream.setSpacing(old);
+    return stream;
+}
+
+#endif
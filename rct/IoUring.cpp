@@ -0,0 +1,147 @@
+#include "IoUring.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+IoUring::IoUring()
+    : mFd(-1), mSqRing(MAP_FAILED), mCqRing(MAP_FAILED), mSqRingSize(0), mCqRingSize(0),
+      mSqes(static_cast<io_uring_sqe*>(MAP_FAILED)), mSqesSize(0), mSqHead(0), mSqTail(0),
+      mSqMask(0), mSqArray(0), mSqEntries(0), mCqHead(0), mCqTail(0), mCqMask(0), mCqes(0)
+{
+}
+
+IoUring::~IoUring()
+{
+    if (mSqes != MAP_FAILED)
+        munmap(mSqes, mSqesSize);
+    if (mCqRing != MAP_FAILED && mCqRing != mSqRing)
+        munmap(mCqRing, mCqRingSize);
+    if (mSqRing != MAP_FAILED)
+        munmap(mSqRing, mSqRingSize);
+    if (mFd != -1)
+        ::close(mFd);
+}
+
+bool IoUring::init(unsigned int entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    mFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (mFd == -1)
+        return false;
+    // we need timeouts on the wait without an extra timeout entry
+    if (!(params.features & IORING_FEAT_EXT_ARG))
+        return false;
+
+    mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        mSqRingSize = mCqRingSize = std::max(mSqRingSize, mCqRingSize);
+
+    mSqRing = mmap(0, mSqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+    if (mSqRing == MAP_FAILED)
+        return false;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        mCqRing = mSqRing;
+    } else {
+        mCqRing = mmap(0, mCqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+        if (mCqRing == MAP_FAILED)
+            return false;
+    }
+    mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    mSqes = static_cast<io_uring_sqe*>(mmap(0, mSqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, mFd, IORING_OFF_SQES));
+    if (mSqes == MAP_FAILED)
+        return false;
+
+    char *sq = static_cast<char*>(mSqRing);
+    mSqHead = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+    mSqTail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+    mSqMask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+    mSqArray = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+    mSqEntries = params.sq_entries;
+
+    char *cq = static_cast<char*>(mCqRing);
+    mCqHead = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+    mCqTail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+    mCqMask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+    mCqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+io_uring_sqe *IoUring::prepare()
+{
+    const unsigned int tail = *mSqTail;
+    if (tail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) >= mSqEntries) {
+        submit();
+        if (tail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) >= mSqEntries)
+            return 0;
+    }
+    const unsigned int index = tail & *mSqMask;
+    io_uring_sqe *sqe = mSqes + index;
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    mSqArray[index] = index;
+    return sqe;
+}
+
+void IoUring::commit()
+{
+    __atomic_store_n(mSqTail, *mSqTail + 1, __ATOMIC_RELEASE);
+}
+
+int IoUring::enter(unsigned int toSubmit, unsigned int minComplete, unsigned int flags, void *arg, size_t argSize)
+{
+    return syscall(__NR_io_uring_enter, mFd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+unsigned int IoUring::pending() const
+{
+    return *mSqTail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+}
+
+int IoUring::submit()
+{
+    int ret;
+    do {
+        ret = enter(pending(), 0, 0, 0, 0);
+    } while (ret == -1 && errno == EINTR);
+    return ret;
+}
+
+int IoUring::wait(int64_t timeout)
+{
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    __kernel_timespec ts;
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000000;
+        ts.tv_nsec = (timeout % 1000000) * 1000;
+        arg.ts = reinterpret_cast<uintptr_t>(&ts);
+    }
+    // asking for more than is queued makes the kernel return without
+    // waiting
+    const int ret = enter(pending(), 1, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret == -1 && errno != ETIME && errno != EINTR && errno != EBUSY)
+        return -1;
+    return 0;
+}
+
+io_uring_cqe *IoUring::peek()
+{
+    const unsigned int head = *mCqHead;
+    if (head == __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE))
+        return 0;
+    return mCqes + (head & *mCqMask);
+}
+
+void IoUring::seen()
+{
+    __atomic_store_n(mCqHead, *mCqHead + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,57 @@
+#ifndef IOURING_H
+#define IOURING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal io_uring ring on top of the raw system calls, used by EventLoop
+// when initialized with EventLoop::EnableIoUring. Entries are prepared
+// and committed with the caller holding EventLoop's mutex, the kernel
+// picks them up on the next submit() or wait() from any thread.
+// Completions are only consumed by the loop thread.
+class IoUring
+{
+public:
+    IoUring();
+    ~IoUring();
+
+    // false if the kernel doesn't support io_uring or lacks features we
+    // rely on, the caller should fall back to epoll
+    bool init(unsigned int entries);
+
+    // returns a cleared entry, submitting queued entries if the
+    // submission queue is full. 0 if no entry could be made available
+    io_uring_sqe *prepare();
+    // makes the entry returned by prepare() visible to the kernel
+    void commit();
+
+    int submit();
+    // submits queued entries and waits up to timeout us (-1 for
+    // forever) for at least one completion. -1 on error
+    int wait(int64_t timeout);
+
+    io_uring_cqe *peek();
+    void seen();
+
+private:
+    // entries committed but not consumed by the kernel yet
+    unsigned int pending() const;
+    int enter(unsigned int toSubmit, unsigned int minComplete, unsigned int flags, void *arg, size_t argSize);
+
+    int mFd;
+    void *mSqRing, *mCqRing;
+    size_t mSqRingSize, mCqRingSize;
+    io_uring_sqe *mSqes;
+    size_t mSqesSize;
+
+    unsigned int *mSqHead, *mSqTail, *mSqMask, *mSqArray;
+    unsigned int mSqEntries;
+    unsigned int *mCqHead, *mCqTail, *mCqMask;
+    io_uring_cqe *mCqes;
+
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+};
+
+#endif
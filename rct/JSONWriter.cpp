@@ -0,0 +1,334 @@
+#include "JSONWriter.h"
+
+#include <assert.h>
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "Serializer.h"
+#include "SocketClient.h"
+#include "Value.h"
+
+JSONWriter::JSONWriter(Output &&output)
+    : mOutput(std::move(output)), mBuffer(new char[BufferSize]), mBuffered(0), mFlushed(0),
+      mPretty(false), mHasKey(false), mHasRoot(false), mError(false)
+{
+}
+
+JSONWriter::JSONWriter(String &out)
+    : JSONWriter([&out](const char *data, size_t size) {
+            out.append(data, size);
+            return true;
+        })
+{
+}
+
+JSONWriter::JSONWriter(Serializer &serializer)
+    : JSONWriter([&serializer](const char *data, size_t size) {
+            return serializer.write(data, static_cast<int>(size));
+        })
+{
+}
+
+JSONWriter::JSONWriter(FILE *file)
+    : JSONWriter([file](const char *data, size_t size) {
+            return fwrite(data, sizeof(char), size, file) == size;
+        })
+{
+    assert(file);
+}
+
+JSONWriter::JSONWriter(const std::shared_ptr<SocketClient> &client)
+    : JSONWriter([client](const char *data, size_t size) {
+            return client->write(data, static_cast<unsigned int>(size));
+        })
+{
+    assert(client);
+}
+
+JSONWriter::~JSONWriter()
+{
+    flush();
+}
+
+bool JSONWriter::flush()
+{
+    if (mBuffered && !mError) {
+        if (!mOutput(mBuffer.get(), mBuffered))
+            mError = true;
+    }
+    mFlushed += mBuffered;
+    mBuffered = 0;
+    return !mError;
+}
+
+void JSONWriter::writeSlow(const char *data, size_t size)
+{
+    flush();
+    if (size < BufferSize) {
+        memcpy(mBuffer.get(), data, size);
+        mBuffered = size;
+    } else {
+        if (!mError && !mOutput(data, size))
+            mError = true;
+        mFlushed += size;
+    }
+}
+
+void JSONWriter::newline()
+{
+    if (!mPretty)
+        return;
+    write('\n');
+    for (size_t i = 0; i < mStack.size(); ++i)
+        write("    ", 4);
+}
+
+void JSONWriter::beginValue()
+{
+    if (mStack.isEmpty()) {
+        if (mHasRoot)
+            write('\n');
+        mHasRoot = true;
+        return;
+    }
+    unsigned char &top = mStack.last();
+    if (top & Object) {
+        assert(mHasKey);
+        mHasKey = false;
+        return;
+    }
+    if (top & HasElements)
+        write(',');
+    top |= HasElements;
+    newline();
+}
+
+JSONWriter &JSONWriter::beginObject()
+{
+    beginValue();
+    write('{');
+    mStack.append(Object);
+    return *this;
+}
+
+JSONWriter &JSONWriter::endObject()
+{
+    assert(!mStack.isEmpty() && (mStack.last() & Object) && !mHasKey);
+    const bool hasElements = mStack.last() & HasElements;
+    mStack.removeLast();
+    if (hasElements)
+        newline();
+    write('}');
+    return *this;
+}
+
+JSONWriter &JSONWriter::beginArray()
+{
+    beginValue();
+    write('[');
+    mStack.append(0);
+    return *this;
+}
+
+JSONWriter &JSONWriter::endArray()
+{
+    assert(!mStack.isEmpty() && !(mStack.last() & Object));
+    const bool hasElements = mStack.last() & HasElements;
+    mStack.removeLast();
+    if (hasElements)
+        newline();
+    write(']');
+    return *this;
+}
+
+JSONWriter &JSONWriter::key(const char *key, size_t size)
+{
+    assert(!mStack.isEmpty() && (mStack.last() & Object) && !mHasKey);
+    unsigned char &top = mStack.last();
+    if (top & HasElements)
+        write(',');
+    top |= HasElements;
+    newline();
+    writeString(key, size);
+    if (mPretty) {
+        write(": ", 2);
+    } else {
+        write(':');
+    }
+    mHasKey = true;
+    return *this;
+}
+
+JSONWriter &JSONWriter::null()
+{
+    beginValue();
+    write("null", 4);
+    return *this;
+}
+
+JSONWriter &JSONWriter::value(bool value)
+{
+    beginValue();
+    if (value) {
+        write("true", 4);
+    } else {
+        write("false", 5);
+    }
+    return *this;
+}
+
+JSONWriter &JSONWriter::value(long long value)
+{
+    if (value >= 0)
+        return this->value(static_cast<unsigned long long>(value));
+    beginValue();
+    char buf[24];
+    char *end = buf + sizeof(buf), *pos = end;
+    // through unsigned so LLONG_MIN doesn't overflow
+    unsigned long long magnitude = 0ull - static_cast<unsigned long long>(value);
+    do {
+        *--pos = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    *--pos = '-';
+    write(pos, end - pos);
+    return *this;
+}
+
+JSONWriter &JSONWriter::value(unsigned long long value)
+{
+    beginValue();
+    char buf[24];
+    char *end = buf + sizeof(buf), *pos = end;
+    do {
+        *--pos = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value);
+    write(pos, end - pos);
+    return *this;
+}
+
+JSONWriter &JSONWriter::value(double value)
+{
+    if (!std::isfinite(value))
+        return null();
+    beginValue();
+    // the shortest that reads back as the same double
+    char buf[32];
+    int len = 0;
+    for (int precision = 15; precision <= 17; ++precision) {
+        len = snprintf(buf, sizeof(buf), "%.*g", precision, value);
+        if (strtod(buf, 0) == value)
+            break;
+    }
+    write(buf, len);
+    return *this;
+}
+
+JSONWriter &JSONWriter::value(const char *string, size_t size)
+{
+    beginValue();
+    writeString(string, size);
+    return *this;
+}
+
+JSONWriter &JSONWriter::value(const Value &value)
+{
+    switch (value.type()) {
+    case Value::Type_Invalid:
+    case Value::Type_Undefined:
+        return null();
+    case Value::Type_Boolean:
+        return this->value(value.toBool());
+    case Value::Type_Integer:
+    case Value::Type_Date:
+        return this->value(value.toLongLong());
+    case Value::Type_Double:
+        return this->value(value.toDouble());
+    case Value::Type_String:
+        return this->value(value.stringRef());
+    case Value::Type_Custom:
+        if (std::shared_ptr<Value::Custom> custom = value.toCustom())
+            return this->value(custom->toString());
+        return null();
+    case Value::Type_List: {
+        beginArray();
+        const auto end = value.listEnd();
+        for (auto it = value.listBegin(); it != end; ++it)
+            this->value(*it);
+        return endArray(); }
+    case Value::Type_Map: {
+        beginObject();
+        const auto end = value.end();
+        for (auto it = value.begin(); it != end; ++it) {
+            key(it->first);
+            this->value(it->second);
+        }
+        return endObject(); }
+    }
+    return null();
+}
+
+JSONWriter &JSONWriter::raw(const char *json, size_t size)
+{
+    beginValue();
+    write(json, size);
+    return *this;
+}
+
+// the next character that has to be escaped, a control character, '"'
+// or '\\', or end
+static const char *findEscape(const char *ch, const char *end)
+{
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    while (end - ch >= 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ch));
+        const __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                             _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+        if (const int mask = _mm_movemask_epi8(special))
+            return ch + __builtin_ctz(mask);
+        ch += 16;
+    }
+#endif
+    while (ch != end) {
+        const unsigned char c = *ch;
+        if (c < 0x20 || c == '"' || c == '\\')
+            break;
+        ++ch;
+    }
+    return ch;
+}
+
+void JSONWriter::writeString(const char *string, size_t size)
+{
+    write('"');
+    const char *end = string + size;
+    while (true) {
+        const char *escape = findEscape(string, end);
+        if (escape != string)
+            write(string, escape - string);
+        if (escape == end)
+            break;
+        switch (const char ch = *escape) {
+        case '"': write("\\\"", 2); break;
+        case '\\': write("\\\\", 2); break;
+        case '\b': write("\\b", 2); break;
+        case '\f': write("\\f", 2); break;
+        case '\n': write("\\n", 2); break;
+        case '\r': write("\\r", 2); break;
+        case '\t': write("\\t", 2); break;
+        default: {
+            char buf[7];
+            snprintf(buf, sizeof(buf), "\\u%04x", ch);
+            write(buf, 6);
+            break; }
+        }
+        string = escape + 1;
+    }
+    write('"');
+}
@@ -0,0 +1,119 @@
+#ifndef JSONWRITER_H
+#define JSONWRITER_H
+
+#include <stdio.h>
+#include <functional>
+#include <memory>
+
+#include <rct/SmallList.h>
+#include <rct/String.h>
+
+class Serializer;
+class SocketClient;
+class Value;
+
+// Writes JSON as it goes, through a buffer of BufferSize bytes that is
+// handed to the output whenever it fills up, so documents of any size
+// take the same memory. Either write whole Values or build the document
+// piece by piece without ever having one:
+//
+//     JSONWriter writer(client);
+//     writer.beginObject();
+//     writer.key("files").beginArray();
+//     for (const Path &file : files)
+//         writer.value(file);
+//     writer.endArray();
+//     writer.endObject();
+//
+// Several top level values come out one per line. Misuse, like a value
+// in an object without a key, asserts.
+class JSONWriter
+{
+public:
+    enum { BufferSize = 16 * 1024 };
+
+    // returns false if the data couldn't be written
+    typedef std::function<bool(const char *data, size_t size)> Output;
+
+    JSONWriter(Output &&output);
+    JSONWriter(String &out);
+    JSONWriter(Serializer &serializer);
+    JSONWriter(FILE *file);
+    // queued on the client like any write(), pause on writeBlocked() to
+    // keep what's pending bounded
+    JSONWriter(const std::shared_ptr<SocketClient> &client);
+    ~JSONWriter();
+
+    // newlines and indentation, off by default
+    void setPretty(bool pretty) { mPretty = pretty; }
+    bool isPretty() const { return mPretty; }
+
+    JSONWriter &beginObject();
+    JSONWriter &endObject();
+    JSONWriter &beginArray();
+    JSONWriter &endArray();
+    JSONWriter &key(const char *key, size_t size);
+    JSONWriter &key(const char *key) { return this->key(key, strlen(key)); }
+    JSONWriter &key(const String &key) { return this->key(key.constData(), key.size()); }
+
+    JSONWriter &null();
+    JSONWriter &value(bool value);
+    JSONWriter &value(int value) { return this->value(static_cast<long long>(value)); }
+    JSONWriter &value(unsigned int value) { return this->value(static_cast<long long>(value)); }
+    JSONWriter &value(long value) { return this->value(static_cast<long long>(value)); }
+    JSONWriter &value(unsigned long value) { return this->value(static_cast<unsigned long long>(value)); }
+    JSONWriter &value(long long value);
+    JSONWriter &value(unsigned long long value);
+    // nan and infinity aren't JSON, they come out as null
+    JSONWriter &value(double value);
+    JSONWriter &value(const char *string, size_t size);
+    JSONWriter &value(const char *string) { return value(string, strlen(string)); }
+    JSONWriter &value(const String &string) { return value(string.constData(), string.size()); }
+    JSONWriter &value(const Value &value);
+    // already encoded JSON, written as is
+    JSONWriter &raw(const char *json, size_t size);
+
+    // hands what's buffered to the output
+    bool flush();
+    bool hasError() const { return mError; }
+    // bytes written so far, buffered ones included
+    size_t written() const { return mFlushed + mBuffered; }
+
+private:
+    enum {
+        Object = 0x1,
+        HasElements = 0x2
+    };
+
+    void beginValue();
+    void newline();
+    void writeString(const char *string, size_t size);
+    void write(const char *data, size_t size)
+    {
+        if (mBuffered + size <= BufferSize) {
+            memcpy(mBuffer.get() + mBuffered, data, size);
+            mBuffered += size;
+        } else {
+            writeSlow(data, size);
+        }
+    }
+    void write(char ch)
+    {
+        if (mBuffered == BufferSize)
+            flush();
+        mBuffer[mBuffered++] = ch;
+    }
+    void writeSlow(const char *data, size_t size);
+
+    Output mOutput;
+    std::unique_ptr<char[]> mBuffer;
+    size_t mBuffered, mFlushed;
+    // one entry of Object/HasElements per open object or array
+    SmallList<unsigned char, 32> mStack;
+    bool mPretty, mHasKey, mHasRoot, mError;
+
+    JSONWriter(const JSONWriter &) = delete;
+    JSONWriter &operator=(const JSONWriter &) = delete;
+};
+
+#endif
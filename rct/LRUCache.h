@@ -0,0 +1,379 @@
+#ifndef LRUCACHE_H
+#define LRUCACHE_H
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+
+#include <rct/EmbeddedLinkedList.h>
+#include <rct/FlatHash.h>
+
+// A cache that drops the least recently used entries once it holds more
+// than maxCount entries or their costs add up to more than maxCost, 0
+// means no limit. Each entry is one allocation, linked into the recency
+// list through the entry itself and found through a FlatHash.
+//
+//     LRUCache<Path, String> contents(0, 64 * 1024 * 1024);
+//     if (const String *data = contents.find(path))
+//         return *data;
+//     const String data = path.readAll();
+//     contents.insert(path, data, data.size());
+//
+// Not thread safe, ShardedLRUCache is.
+template <typename Key, typename Value, typename Hasher = std::hash<Key> >
+class LRUCache
+{
+public:
+    typedef std::function<void(const Key &key, Value &value)> EvictionHandler;
+
+    struct Statistics
+    {
+        Statistics()
+            : hits(0), misses(0), insertions(0), evictions(0)
+        {}
+
+        Statistics &operator+=(const Statistics &other)
+        {
+            hits += other.hits;
+            misses += other.misses;
+            insertions += other.insertions;
+            evictions += other.evictions;
+            return *this;
+        }
+
+        uint64_t hits, misses, insertions, evictions;
+    };
+
+    LRUCache(size_t maxCount = 0, size_t maxCost = 0)
+        : mMaxCount(maxCount), mMaxCost(maxCost), mCost(0)
+    {}
+
+    size_t maxCount() const { return mMaxCount; }
+    size_t maxCost() const { return mMaxCost; }
+    void setMaxCount(size_t maxCount)
+    {
+        mMaxCount = maxCount;
+        evict();
+    }
+    void setMaxCost(size_t maxCost)
+    {
+        mMaxCost = maxCost;
+        evict();
+    }
+
+    // Called for entries dropped to make room, not for ones that are
+    // removed, replaced or cleared.
+    void setEvictionHandler(EvictionHandler &&handler) { mEvictionHandler = std::move(handler); }
+
+    size_t size() const { return mIndex.size(); }
+    bool isEmpty() const { return mIndex.isEmpty(); }
+    size_t cost() const { return mCost; }
+
+    const Statistics &statistics() const { return mStatistics; }
+    void resetStatistics() { mStatistics = Statistics(); }
+
+    // Makes key the most recently used entry. The pointer is good until
+    // the cache is changed.
+    Value *find(const Key &key)
+    {
+        Node *node = mIndex.value(key, 0);
+        if (!node) {
+            ++mStatistics.misses;
+            return 0;
+        }
+        ++mStatistics.hits;
+        mList.moveToFront(node);
+        return &node->value;
+    }
+
+    Value value(const Key &key, const Value &defaultValue = Value(), bool *ok = 0)
+    {
+        const Value *value = find(key);
+        if (ok)
+            *ok = value != 0;
+        return value ? *value : defaultValue;
+    }
+
+    // doesn't count as a use
+    const Value *peek(const Key &key) const
+    {
+        const Node *node = mIndex.value(key, 0);
+        return node ? &node->value : 0;
+    }
+
+    bool contains(const Key &key) const
+    {
+        return mIndex.contains(key);
+    }
+
+    // Adds or replaces key as the most recently used entry. Returns false
+    // if cost alone is more than maxCost, the entry isn't kept then.
+    bool insert(const Key &key, Value &&value, size_t cost = 1)
+    {
+        remove(key);
+        if (mMaxCost && cost > mMaxCost)
+            return false;
+        Node *node = new Node(key, std::move(value), cost);
+        mIndex[key] = node;
+        mList.prepend(node);
+        mCost += cost;
+        ++mStatistics.insertions;
+        evict();
+        return true;
+    }
+
+    bool insert(const Key &key, const Value &value, size_t cost = 1)
+    {
+        return insert(key, Value(value), cost);
+    }
+
+    bool remove(const Key &key, Value *value = 0)
+    {
+        Node *node = 0;
+        if (!mIndex.remove(key, &node)) {
+            if (value)
+                *value = Value();
+            return false;
+        }
+        if (value)
+            *value = std::move(node->value);
+        unlink(node);
+        return true;
+    }
+
+    Value take(const Key &key, bool *ok = 0)
+    {
+        Value ret = Value();
+        const bool found = remove(key, &ret);
+        if (ok)
+            *ok = found;
+        return ret;
+    }
+
+    void clear()
+    {
+        mIndex.clear();
+        mList.deleteAll();
+        mCost = 0;
+    }
+
+    // most recently used first
+    List<Key> keys() const
+    {
+        List<Key> keys;
+        keys.reserve(size());
+        for (const Node *node = mList.first(); node; node = node->next)
+            keys.append(node->key);
+        return keys;
+    }
+
+private:
+    struct Node
+    {
+        Node(const Key &k, Value &&v, size_t c)
+            : key(k), value(std::move(v)), cost(c), next(0), prev(0)
+        {}
+
+        const Key key;
+        Value value;
+        const size_t cost;
+        Node *next, *prev;
+    };
+
+    void unlink(Node *node)
+    {
+        mList.remove(node);
+        mCost -= node->cost;
+        delete node;
+    }
+
+    void evict()
+    {
+        while ((mMaxCount && mIndex.size() > mMaxCount) || (mMaxCost && mCost > mMaxCost)) {
+            Node *node = mList.last();
+            mIndex.remove(node->key);
+            ++mStatistics.evictions;
+            if (mEvictionHandler)
+                mEvictionHandler(node->key, node->value);
+            unlink(node);
+        }
+    }
+
+    size_t mMaxCount, mMaxCost, mCost;
+    EvictionHandler mEvictionHandler;
+    FlatHash<Key, Node *, Hasher> mIndex;
+    EmbeddedLinkedList<Node *> mList;
+    Statistics mStatistics;
+
+    LRUCache(const LRUCache &) = delete;
+    LRUCache &operator=(const LRUCache &) = delete;
+};
+
+// An LRUCache split into Shards independent caches, each with its own
+// mutex and an equal part of the limits, so threads using different
+// keys rarely wait for each other. Recency is per shard. Lookups return
+// copies since entries can go as soon as the lock is released. The
+// eviction handler is called with the shard locked.
+template <typename Key, typename Value, typename Hasher = std::hash<Key>, size_t Shards = 16>
+class ShardedLRUCache
+{
+public:
+    typedef LRUCache<Key, Value, Hasher> Cache;
+    typedef typename Cache::Statistics Statistics;
+    typedef typename Cache::EvictionHandler EvictionHandler;
+
+    ShardedLRUCache(size_t maxCount = 0, size_t maxCost = 0)
+    {
+        setMaxCount(maxCount);
+        setMaxCost(maxCost);
+    }
+
+    void setMaxCount(size_t maxCount)
+    {
+        for (Shard &shard : mShards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.cache.setMaxCount(maxCount ? std::max<size_t>(maxCount / Shards, 1) : 0);
+        }
+    }
+
+    void setMaxCost(size_t maxCost)
+    {
+        for (Shard &shard : mShards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.cache.setMaxCost(maxCost ? std::max<size_t>(maxCost / Shards, 1) : 0);
+        }
+    }
+
+    void setEvictionHandler(const EvictionHandler &handler)
+    {
+        for (Shard &shard : mShards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.cache.setEvictionHandler(EvictionHandler(handler));
+        }
+    }
+
+    bool find(const Key &key, Value *value)
+    {
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const Value *found = shard.cache.find(key);
+        if (found && value)
+            *value = *found;
+        return found != 0;
+    }
+
+    Value value(const Key &key, const Value &defaultValue = Value(), bool *ok = 0)
+    {
+        Value ret;
+        const bool found = find(key, &ret);
+        if (ok)
+            *ok = found;
+        return found ? ret : defaultValue;
+    }
+
+    bool contains(const Key &key) const
+    {
+        const Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.cache.contains(key);
+    }
+
+    bool insert(const Key &key, Value &&value, size_t cost = 1)
+    {
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.cache.insert(key, std::move(value), cost);
+    }
+
+    bool insert(const Key &key, const Value &value, size_t cost = 1)
+    {
+        return insert(key, Value(value), cost);
+    }
+
+    bool remove(const Key &key, Value *value = 0)
+    {
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.cache.remove(key, value);
+    }
+
+    Value take(const Key &key, bool *ok = 0)
+    {
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.cache.take(key, ok);
+    }
+
+    void clear()
+    {
+        for (Shard &shard : mShards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.cache.clear();
+        }
+    }
+
+    size_t size() const
+    {
+        size_t size = 0;
+        for (const Shard &shard : mShards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            size += shard.cache.size();
+        }
+        return size;
+    }
+
+    size_t cost() const
+    {
+        size_t cost = 0;
+        for (const Shard &shard : mShards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            cost += shard.cache.cost();
+        }
+        return cost;
+    }
+
+    Statistics statistics() const
+    {
+        Statistics ret;
+        for (const Shard &shard : mShards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            ret += shard.cache.statistics();
+        }
+        return ret;
+    }
+
+    void resetStatistics()
+    {
+        for (Shard &shard : mShards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.cache.resetStatistics();
+        }
+    }
+
+private:
+    // A cache line of padding after each keeps the shards' locks and
+    // hot fields off each other's lines. alignas wouldn't do, new
+    // doesn't honour extended alignment before C++17.
+    struct Shard
+    {
+        mutable std::mutex mutex;
+        Cache cache;
+        char pad[64];
+    };
+
+    // the top bits, FlatHash indexes the shard by the low ones
+    Shard &shardFor(const Key &key)
+    {
+        const uint64_t hash = static_cast<uint64_t>(Hasher()(key)) * 0x9e3779b97f4a7c15ull;
+        return mShards[(hash >> 32) % Shards];
+    }
+    const Shard &shardFor(const Key &key) const
+    {
+        return const_cast<ShardedLRUCache *>(this)->shardFor(key);
+    }
+
+    Shard mShards[Shards];
+};
+
+#endif
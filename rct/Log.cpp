@@ -4,17 +4,51 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <syslog.h>
+#include <atomic>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
 
+#include "Allocations.h"
+#include "BinaryLog.h"
+#include "Metrics.h"
 #include "Path.h"
 #include "StackBuffer.h"
 #include "StopWatch.h"
 
 static Flags<LogFlag> sFlags;
 static StopWatch sStart;
-static Set<std::shared_ptr<LogOutput> > sOutputs;
+typedef Set<std::shared_ptr<LogOutput> > Outputs;
+// replaced when outputs are added or removed, logging only takes a
+// reference to the current set
+static std::shared_ptr<const Outputs> sOutputs;
 static std::mutex sOutputsMutex;
+
+std::atomic<int> gMaxLogLevel(INT_MAX);
+
+// with sOutputsMutex held
+static void setOutputs(std::shared_ptr<const Outputs> &&outputs)
+{
+    int max = INT_MAX;
+    if (outputs && !outputs->isEmpty()) {
+        max = INT_MIN;
+        for (const auto &output : *outputs)
+            max = std::max(max, output->logLevel().toInt());
+    }
+    sOutputs = std::move(outputs);
+    gMaxLogLevel.store(max);
+}
+
+static std::shared_ptr<const Outputs> outputs()
+{
+    std::lock_guard<std::mutex> lock(sOutputsMutex);
+    return sOutputs;
+}
 static LogLevel sLevel = LogLevel::Error;
+// set on the async log thread while it writes a batch. The outputs don't
+// flush every message then and timestamps are from when it was logged.
+static thread_local bool tLogBatch = false;
+static thread_local uint64_t tLogTime = 0;
 
 const LogLevel LogLevel::None(-1);
 const LogLevel LogLevel::Error(0);
@@ -24,7 +58,7 @@ const LogLevel LogLevel::VerboseDebug(3);
 
 static inline size_t prettyTimeSinceStarted(char *buf, size_t max)
 {
-    uint64_t elapsed = sStart.elapsed();
+    uint64_t elapsed = tLogBatch ? tLogTime : sStart.elapsed();
     enum {
         MS = 1,
         Second = 1000,
@@ -51,7 +85,7 @@ static inline int writeLog(FILE *f, const char *msg, int len, Flags<LogOutput::L
     ret += fwrite(msg, 1, len, f);
     if (flags & LogOutput::TrailingNewLine) {
         ret += fwrite("\n", 1, 1, f);
-    } else {
+    } else if (!tLogBatch) {
         fflush(f);
     }
     return ret;
@@ -72,6 +106,11 @@ public:
     virtual void log(Flags<LogOutput::LogFlag> flags, const char *msg, int len) override
     {
         writeLog(file, msg, len, flags);
+        if (!tLogBatch)
+            fflush(file);
+    }
+    virtual void flush() override
+    {
         fflush(file);
     }
     FILE *file;
@@ -101,6 +140,11 @@ public:
             writeLog(f, msg, len, flags);
         }
     }
+    virtual void flush() override
+    {
+        fflush(stdout);
+        fflush(stderr);
+    }
 private:
     int mReplaceableLength;
 };
@@ -123,6 +167,243 @@ public:
     }
 };
 
+// A bounded queue of messages that any thread adds to with a CAS on the
+// position to write and the log thread takes from in order, the one
+// described by Dmitry Vyukov. Messages that don't fit in a slot are
+// copied to the heap.
+class AsyncLog
+{
+public:
+    AsyncLog(LogOverflow overflow, size_t capacity)
+        : mOverflow(overflow), mEnqueue(0), mDequeue(0), mDropped(0), mReported(0),
+          mSleeping(false), mStop(false)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size *= 2;
+        mMask = size - 1;
+        mSlots.reset(new Slot[size]);
+        for (size_t i = 0; i < size; ++i)
+            mSlots[i].sequence.store(i, std::memory_order_relaxed);
+        mThread = std::thread(std::bind(&AsyncLog::run, this));
+    }
+
+    bool push(LogLevel level, const char *msg, int len, Flags<LogOutput::LogFlag> flags)
+    {
+        size_t pos = mEnqueue.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &mSlots[pos & mMask];
+            const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (!diff) {
+                if (mEnqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                if (mOverflow != LogOverflowBlock || mStop.load(std::memory_order_relaxed)) {
+                    mDropped.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                wake();
+                std::this_thread::yield();
+                pos = mEnqueue.load(std::memory_order_relaxed);
+            } else {
+                pos = mEnqueue.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->level = level.toInt();
+        slot->flags = flags;
+        slot->time = sFlags & LogTimeStamp ? sStart.elapsed() : 0;
+        slot->len = len;
+        if (len <= static_cast<int>(sizeof(slot->data))) {
+            memcpy(slot->data, msg, len);
+        } else {
+            slot->heap = new char[len];
+            memcpy(slot->heap, msg, len);
+        }
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        if (mSleeping.load())
+            wake();
+        return true;
+    }
+
+    // takes everything that's queued, on the log thread or in flushLogs()
+    bool drain(bool wait)
+    {
+        std::unique_lock<std::mutex> lock(mConsumer, std::defer_lock);
+        if (wait) {
+            lock.lock();
+        } else {
+            // the log thread may be stuck in an output when crashing
+            for (int i = 0; i < 1000 && !lock.try_lock(); ++i)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            if (!lock.owns_lock())
+                return false;
+        }
+
+        std::shared_ptr<const Outputs> logs;
+        bool any = false;
+        tLogBatch = true;
+        size_t dequeue = mDequeue.load(std::memory_order_relaxed);
+        while (true) {
+            Slot &slot = mSlots[dequeue & mMask];
+            if (slot.sequence.load(std::memory_order_acquire) != dequeue + 1)
+                break;
+            if (!any) {
+                logs = outputs();
+                any = true;
+            }
+            const char *msg = slot.heap ? slot.heap : slot.data;
+            tLogTime = slot.time;
+            write(logs, LogLevel(slot.level), msg, slot.len, slot.flags);
+            delete[] slot.heap;
+            slot.heap = 0;
+            slot.sequence.store(dequeue + mMask + 1, std::memory_order_release);
+            mDequeue.store(++dequeue, std::memory_order_relaxed);
+        }
+        const size_t dropped = mDropped.load(std::memory_order_relaxed);
+        if (mOverflow == LogOverflowCount && dropped != mReported) {
+            const String msg = String::format<64>("%zu log messages were dropped", dropped - mReported);
+            mReported = dropped;
+            if (!any)
+                logs = outputs();
+            tLogTime = sStart.elapsed();
+            write(logs, LogLevel::Error, msg.constData(), msg.size(), LogOutput::DefaultFlags);
+            any = true;
+        }
+        tLogBatch = false;
+        if (any && logs) {
+            for (const auto &output : *logs)
+                output->flush();
+        }
+        if (!logs || logs->isEmpty())
+            fflush(stdout);
+        return any;
+    }
+
+    void stop()
+    {
+        mStop.store(true);
+        wake();
+        mThread.join();
+        drain(true);
+    }
+
+    size_t dropped() const { return mDropped.load(std::memory_order_relaxed); }
+
+    static void write(const std::shared_ptr<const Outputs> &logs, LogLevel level, const char *msg, int len,
+                      Flags<LogOutput::LogFlag> flags)
+    {
+        if (!logs || logs->isEmpty()) {
+            fwrite(msg, len, 1, stdout);
+            if (flags & LogOutput::TrailingNewLine)
+                fwrite("\n", 1, 1, stdout);
+        } else {
+            for (const auto &output : *logs) {
+                if (output->testLog(level)) {
+                    output->log(flags, msg, len);
+                }
+            }
+        }
+    }
+
+    static thread_local bool tLogThread;
+
+private:
+    struct Slot
+    {
+        Slot()
+            : level(0), time(0), len(0), heap(0)
+        {}
+        std::atomic<size_t> sequence;
+        int level;
+        Flags<LogOutput::LogFlag> flags;
+        uint64_t time;
+        int len;
+        char *heap;
+        char data[200];
+    };
+
+    void wake()
+    {
+        // not under mWaitMutex, the log thread only sleeps for a bit
+        // anyway if this comes between its check and its wait
+        mSleeping.store(false);
+        mWake.notify_one();
+    }
+
+    void run()
+    {
+        tLogThread = true;
+        while (!mStop.load()) {
+            if (drain(true))
+                continue;
+            std::unique_lock<std::mutex> lock(mWaitMutex);
+            mSleeping.store(true);
+            const size_t dequeue = mDequeue.load(std::memory_order_relaxed);
+            if (mSlots[dequeue & mMask].sequence.load(std::memory_order_acquire) == dequeue + 1 || mStop.load()) {
+                mSleeping.store(false);
+                continue;
+            }
+            mWake.wait_for(lock, std::chrono::milliseconds(50));
+            mSleeping.store(false);
+        }
+    }
+
+    const LogOverflow mOverflow;
+    std::unique_ptr<Slot[]> mSlots;
+    size_t mMask;
+    // apart so the threads that log and the log thread don't share a
+    // cache line
+    char mPad0[64];
+    std::atomic<size_t> mEnqueue;
+    char mPad1[64];
+    std::atomic<size_t> mDequeue;
+    char mPad2[64];
+    std::atomic<size_t> mDropped;
+    size_t mReported;
+    std::atomic<bool> mSleeping, mStop;
+    std::mutex mWaitMutex, mConsumer;
+    std::condition_variable mWake;
+    std::thread mThread;
+};
+
+thread_local bool AsyncLog::tLogThread = false;
+
+// a thread may still be in push() after async logging is turned off so
+// these are never deleted, only stopped
+static std::atomic<AsyncLog *> sAsyncLog(0);
+static std::mutex sAsyncLogMutex;
+
+void setLogAsync(bool async, LogOverflow overflow, size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(sAsyncLogMutex);
+    if (AsyncLog *old = sAsyncLog.exchange(0))
+        old->stop();
+    if (async)
+        sAsyncLog.store(new AsyncLog(overflow, capacity));
+}
+
+bool isLogAsync()
+{
+    return sAsyncLog.load() != 0;
+}
+
+void flushLogs()
+{
+    AsyncLog *async = sAsyncLog.load();
+    if (async && !AsyncLog::tLogThread)
+        async->drain(false);
+    log([](const std::shared_ptr<LogOutput> &output) { output->flush(); });
+}
+
+size_t droppedLogCount()
+{
+    AsyncLog *async = sAsyncLog.load();
+    return async ? async->dropped() : 0;
+}
+
 void restartTime()
 {
     sStart.restart();
@@ -132,6 +413,7 @@ static void logHelper(LogLevel level, Flags<LogOutput::LogFlag> flags, const cha
 {
     if (!testLog(level))
         return;
+    RCT_ALLOCATION_SCOPE(Allocations::LogSubsystem);
 
     va_list v2;
     va_copy(v2, v);
@@ -153,35 +435,38 @@ static void logHelper(LogLevel level, Flags<LogOutput::LogFlag> flags, const cha
     va_end(v2);
 }
 
+void countLogMessage(LogLevel level)
+{
+    static Metrics::Counter *counters[] = {
+        &Metrics::instance().counter("rct_log_messages_total", { { "level", "error" } }),
+        &Metrics::instance().counter("rct_log_messages_total", { { "level", "warning" } }),
+        &Metrics::instance().counter("rct_log_messages_total", { { "level", "debug" } }),
+        &Metrics::instance().counter("rct_log_messages_total", { { "level", "verbose" } })
+    };
+    const int index = std::min(std::max(level.toInt(), 0), 3);
+    counters[index]->add();
+}
+
 void logDirect(LogLevel level, const char *msg, int len, Flags<LogOutput::LogFlag> flags)
 {
-    Set<std::shared_ptr<LogOutput> > logs;
-    {
-        std::lock_guard<std::mutex> lock(sOutputsMutex);
-        logs = sOutputs;
-    }
-    if (logs.isEmpty()) {
-        fwrite(msg, len, 1, stdout);
-        if (flags & LogOutput::TrailingNewLine)
-            fwrite("\n", 1, 1, stdout);
-    } else {
-        for (const auto &output : logs) {
-            if (output->testLog(level)) {
-                output->log(flags, msg, len);
-            }
-        }
+    RCT_ALLOCATION_SCOPE(Allocations::LogSubsystem);
+    countLogMessage(level);
+    // what the outputs log themselves on the log thread is written right
+    // away, it could wait for its own queue otherwise
+    AsyncLog *async = sAsyncLog.load(std::memory_order_acquire);
+    if (async && !AsyncLog::tLogThread) {
+        async->push(level, msg, len, flags);
+        return;
     }
+    AsyncLog::write(outputs(), level, msg, len, flags);
 }
 
 void log(const std::function<void(const std::shared_ptr<LogOutput> &)> &func)
 {
-    Set<std::shared_ptr<LogOutput> > logs;
-    {
-        std::lock_guard<std::mutex> lock(sOutputsMutex);
-        logs = sOutputs;
-    }
-    for (const auto &out : logs) {
-        func(out);
+    if (const std::shared_ptr<const Outputs> logs = outputs()) {
+        for (const auto &out : *logs) {
+            func(out);
+        }
     }
 }
 
@@ -234,12 +519,12 @@ void error(const char *format, ...)
     va_end(v);
 }
 
-bool testLog(LogLevel level)
+bool testLogOutputs(LogLevel level)
 {
-    std::lock_guard<std::mutex> lock(sOutputsMutex);
-    if (sOutputs.isEmpty())
+    const std::shared_ptr<const Outputs> logs = outputs();
+    if (!logs || logs->isEmpty())
         return true;
-    for (const auto &output : sOutputs) {
+    for (const auto &output : *logs) {
         if (output->testLog(level))
             return true;
     }
@@ -284,16 +569,26 @@ bool initLogging(const char* ident, Flags<LogFlag> flags, LogLevel level,
         FILE *f = fopen(file.constData(), flags & Append ? "a" : "w");
         if (!f)
             return false;
-        std::shared_ptr<FileOutput> out(new FileOutput(logFileLogLevel, f));
+        std::shared_ptr<LogOutput> out;
+        if (flags & LogBinary) {
+            out.reset(new BinaryLogOutput(logFileLogLevel, f));
+        } else {
+            out.reset(new FileOutput(logFileLogLevel, f));
+        }
         out->add();
     }
+    if (flags & LogAsync)
+        setLogAsync(true);
     return true;
 }
 
 void cleanupLogging()
 {
+    setLogAsync(false);
+    std::shared_ptr<const Outputs> old;
     std::lock_guard<std::mutex> lock(sOutputsMutex);
-    sOutputs.clear();
+    old.swap(sOutputs);
+    gMaxLogLevel.store(INT_MAX);
 }
 
 Log::Log(String *out, Flags<LogOutput::LogFlag> flags)
@@ -302,12 +597,6 @@ Log::Log(String *out, Flags<LogOutput::LogFlag> flags)
     mData.reset(new Data(out, flags));
 }
 
-Log::Log(LogLevel level, Flags<LogOutput::LogFlag> flags)
-{
-    if (testLog(level))
-        mData.reset(new Data(level, flags));
-}
-
 Log::Log(const Log &other)
     : mData(other.mData)
 {
@@ -331,11 +620,17 @@ LogOutput::~LogOutput()
 void LogOutput::add()
 {
     std::lock_guard<std::mutex> lock(sOutputsMutex);
-    sOutputs.insert(shared_from_this());
+    std::shared_ptr<Outputs> copy = sOutputs ? std::make_shared<Outputs>(*sOutputs) : std::make_shared<Outputs>();
+    copy->insert(shared_from_this());
+    setOutputs(std::move(copy));
 }
 
 void LogOutput::remove()
 {
     std::lock_guard<std::mutex> lock(sOutputsMutex);
-    sOutputs.remove(shared_from_this());
+    if (!sOutputs)
+        return;
+    std::shared_ptr<Outputs> copy = std::make_shared<Outputs>(*sOutputs);
+    copy->remove(shared_from_this());
+    setOutputs(std::move(copy));
 }
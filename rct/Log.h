@@ -1,7 +1,9 @@
 #ifndef Log_h
 #define Log_h
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <cxxabi.h>
 #include <climits>
 #include <ctype.h>
@@ -9,6 +11,7 @@
 #include <sstream>
 #include <stdio.h>
 #include <string.h>
+#include <type_traits>
 
 #include "Flags.h"
 #include "Hash.h"
@@ -49,6 +52,7 @@ private:
     int mValue;
 };
 
+class BinaryLogFormat;
 class LogOutput : public std::enable_shared_from_this<LogOutput>
 {
 public:
@@ -60,6 +64,7 @@ public:
 
     virtual unsigned int flags() const { return 0; }
 
+    // levels above logLevel() don't get here, see ::testLog()
     virtual bool testLog(LogLevel level) const
     {
         return level >= LogLevel::Error && level <= mLogLevel;
@@ -70,9 +75,22 @@ public:
         NoTypename = 0x2,
         Replaceable = 0x4,
         StdOut = 0x8,
+        // the text of an RCT_BINARY_LOG() message, for outputs that didn't
+        // take it in logBinary()
+        BinaryLogged = 0x10,
         DefaultFlags = TrailingNewLine
     };
     virtual void log(Flags<LogFlag> /*flags*/, const char */*msg*/, int /*len*/) { }
+    // RCT_BINARY_LOG() messages before they're formatted, false to get
+    // the text in log() instead. time is in ns since the epoch.
+    virtual bool logBinary(LogLevel /*level*/, const BinaryLogFormat &/*format*/, uint64_t /*time*/,
+                           const char */*args*/, size_t /*size*/)
+    {
+        return false;
+    }
+    // after a batch of messages from the async log thread, which doesn't
+    // flush each of them
+    virtual void flush() { }
     void log(const String &msg) { log(Flags<LogFlag>(DefaultFlags), msg.constData(), msg.length()); }
     template <int StaticBufSize = 256>
     void log(const char *format, ...) RCT_PRINTF_WARNING(2, 3);
@@ -103,19 +121,54 @@ inline void logDirect(LogLevel level, const String &out, Flags<LogOutput::LogFla
 {
     return logDirect(level, out.constData(), out.size(), flags);
 }
+// counts a message in the rct_log_messages_total metric, logDirect() does
+// it for what it logs
+void countLogMessage(LogLevel level);
 void log(const std::function<void(const std::shared_ptr<LogOutput> &)> &func);
 
-bool testLog(LogLevel level);
+// the most verbose logLevel() of the outputs, INT_MAX without any since
+// everything goes to stdout then
+extern std::atomic<int> gMaxLogLevel;
+bool testLogOutputs(LogLevel level);
+inline bool testLog(LogLevel level)
+{
+    // most calls are for debug output that no output wants, those stop here
+    // without taking a lock
+    return level.toInt() <= gMaxLogLevel.load(std::memory_order_relaxed) && testLogOutputs(level);
+}
 
 enum LogFlag {
     Append = 0x01,
     DontRotate = 0x02,
     LogStderr = 0x04,
     LogSyslog = 0x08,
-    LogTimeStamp = 0x10
+    LogTimeStamp = 0x10,
+    LogAsync = 0x20,
+    // the log file is written by a BinaryLogOutput, see BinaryLog.h
+    LogBinary = 0x40
 };
 RCT_FLAGS_OPERATORS(LogFlag);
 
+enum LogOverflow {
+    // wait for the log thread to make room
+    LogOverflowBlock,
+    // lose the message
+    LogOverflowDrop,
+    // lose it and log how many were lost once there's room again
+    LogOverflowCount
+};
+// Queues messages for a thread of its own that writes them to the outputs
+// in batches, so threads that log don't wait for each other or for the
+// disk. capacity is how many messages can be queued, rounded up to a
+// power of two.
+void setLogAsync(bool async, LogOverflow overflow = LogOverflowCount, size_t capacity = 8192);
+bool isLogAsync();
+// writes what's queued on the calling thread and flushes the outputs,
+// like before crashing
+void flushLogs();
+// messages lost to LogOverflowDrop and LogOverflowCount
+size_t droppedLogCount();
+
 bool initLogging(const char* ident,
                  Flags<LogFlag> flags = LogStderr,
                  LogLevel logLevel = LogLevel::Error,
@@ -128,32 +181,36 @@ class Log
 {
 public:
     Log(String *out, Flags<LogOutput::LogFlag> flags = LogOutput::DefaultFlags);
-    Log(LogLevel level = LogLevel::Error, Flags<LogOutput::LogFlag> flags = LogOutput::DefaultFlags);
+    Log(LogLevel level = LogLevel::Error, Flags<LogOutput::LogFlag> flags = LogOutput::DefaultFlags)
+    {
+        if (testLog(level))
+            mData.reset(new Data(level, flags));
+    }
     Log(const Log &other);
     Log &operator=(const Log &other);
 #if defined(OS_Darwin)
 #ifndef __i386__
-    Log operator<<(long number) { return addStringStream(number); }
+    Log operator<<(long number) { return addInteger(number); }
 #endif
-    Log operator<<(size_t number) { return addStringStream(number); }
+    Log operator<<(size_t number) { return addInteger(number); }
 #elif (ULONG_MAX) != (UINT_MAX)
-    Log operator<<(uint64_t number) { return addStringStream(number); }
-    Log operator<<(int64_t number) { return addStringStream(number); }
+    Log operator<<(uint64_t number) { return addInteger(number); }
+    Log operator<<(int64_t number) { return addInteger(number); }
 #endif
 #if defined(__i386__)
-    Log operator<<(long number) { return addStringStream(number); }
+    Log operator<<(long number) { return addInteger(number); }
 #endif
-    Log operator<<(unsigned long long number) { return addStringStream(number); }
-    Log operator<<(long long number) { return addStringStream(number); }
-    Log operator<<(uint32_t number) { return addStringStream(number); }
-    Log operator<<(int32_t number) { return addStringStream(number); }
-    Log operator<<(uint16_t number) { return addStringStream(number); }
-    Log operator<<(int16_t number) { return addStringStream(number); }
-    Log operator<<(uint8_t number) { return addStringStream<uint16_t>(number); }
-    Log operator<<(int8_t number) { return addStringStream(number); }
-    Log operator<<(float number) { return addStringStream(number); }
-    Log operator<<(double number) { return addStringStream(number); }
-    Log operator<<(long double number) { return addStringStream(number); }
+    Log operator<<(unsigned long long number) { return addInteger(number); }
+    Log operator<<(long long number) { return addInteger(number); }
+    Log operator<<(uint32_t number) { return addInteger(number); }
+    Log operator<<(int32_t number) { return addInteger(number); }
+    Log operator<<(uint16_t number) { return addInteger(number); }
+    Log operator<<(int16_t number) { return addInteger(number); }
+    Log operator<<(uint8_t number) { return addInteger<uint16_t>(number); }
+    Log operator<<(int8_t number) { return write(reinterpret_cast<const char *>(&number), 1); }
+    Log operator<<(float number) { return addFloat("%g", number); }
+    Log operator<<(double number) { return addFloat("%g", number); }
+    Log operator<<(long double number) { return addFloat("%Lg", number); }
     Log operator<<(char ch) { return write(&ch, 1); }
     Log operator<<(bool boolean) { return write(boolean ? "true" : "false"); }
     Log operator<<(void *ptr)
@@ -209,6 +266,8 @@ public:
     {
         return mData && mData->spacing;
     }
+    // false if the level isn't logged, everything written is dropped then
+    bool isEnabled() const { return mData != 0; }
     template <typename T>
     static String toString(const T &t)
     {
@@ -226,13 +285,35 @@ public:
         return Flags<LogOutput::LogFlag>();
     }
 private:
-    template <typename T> Log addStringStream(T t)
+    // what std::ostream would print, without building one
+    template <typename T> static bool isNegative(T t, std::true_type) { return t < 0; }
+    template <typename T> static bool isNegative(T, std::false_type) { return false; }
+    template <typename T> Log addInteger(T t)
+    {
+        if (mData) {
+            typedef typename std::make_unsigned<T>::type Unsigned;
+            char buf[24];
+            char *end = buf + sizeof(buf);
+            char *p = end;
+            const bool negative = isNegative(t, std::is_signed<T>());
+            Unsigned u = negative ? Unsigned(0) - static_cast<Unsigned>(t) : static_cast<Unsigned>(t);
+            do {
+                *--p = static_cast<char>('0' + u % 10);
+                u /= 10;
+            } while (u);
+            if (negative)
+                *--p = '-';
+            return write(p, end - p);
+        }
+        return *this;
+    }
+    template <typename T> Log addFloat(const char *format, T t)
     {
         if (mData) {
-            std::ostringstream str;
-            str << t;
-            const std::string string = str.str();
-            return write(string.data(), string.size());
+            char buf[64];
+            const int w = snprintf(buf, sizeof(buf), format, t);
+            if (w > 0)
+                return write(buf, std::min<int>(w, sizeof(buf) - 1));
         }
         return *this;
     }
@@ -268,11 +349,20 @@ template <int StaticBufSize>
 inline Log Log::log(const char *format, ...)
 {
     if (mData) {
+        // formatted in place, with write()'s spacing applied after the fact
+        String &str = mData->outPtr ? *mData->outPtr : mData->out;
+        const size_t outLength = str.size();
         va_list args;
         va_start(args, format);
-        const String str = String::format<StaticBufSize>(format, args);
-        write(str.constData(), str.size());
+        str.appendFormat(format, args);
         va_end(args);
+        if (str.size() > outLength) {
+            if (mData->disableSpacingOverride) {
+                --mData->disableSpacingOverride;
+            } else if (mData->spacing && outLength && !isspace(str.at(outLength - 1)) && !isspace(str.at(outLength))) {
+                str.insert(outLength, " ", 1);
+            }
+        }
     }
     return *this;
 }
@@ -296,6 +386,8 @@ template <typename T> inline String typeName()
 template <typename T>
 inline Log operator<<(Log stream, const std::shared_ptr<T> &ptr)
 {
+    if (!stream.isEnabled())
+        return stream;
     if (!(stream.flags() & LogOutput::NoTypename))
         stream << ("std::shared_ptr<" + typeName<T>() + ">");
     stream << ptr.get();
@@ -305,6 +397,8 @@ inline Log operator<<(Log stream, const std::shared_ptr<T> &ptr)
 template <typename T>
 inline Log operator<<(Log stream, const List<T> &list)
 {
+    if (!stream.isEnabled())
+        return stream;
     bool old;
     if (!(stream.flags() & LogOutput::NoTypename)) {
         stream << "List<";
@@ -335,6 +429,8 @@ inline Log operator<<(Log stream, const List<T> &list)
 template <typename T1, typename T2>
 inline Log operator<<(Log stream, const std::pair<T1, T2> &pair)
 {
+    if (!stream.isEnabled())
+        return stream;
     bool old;
     if (!(stream.flags() & LogOutput::NoTypename)) {
         stream << "pair<";
@@ -353,6 +449,8 @@ inline Log operator<<(Log stream, const std::pair<T1, T2> &pair)
 template <typename T>
 inline Log operator<<(Log stream, const Set<T> &list)
 {
+    if (!stream.isEnabled())
+        return stream;
     bool old;
     if (!(stream.flags() & LogOutput::NoTypename)) {
         stream << "Set<";
@@ -383,6 +481,8 @@ inline Log operator<<(Log stream, const Set<T> &list)
 template <typename Key, typename Value>
 inline Log operator<<(Log stream, const Map<Key, Value> &map)
 {
+    if (!stream.isEnabled())
+        return stream;
     bool old;
     if (!(stream.flags() & LogOutput::NoTypename)) {
         stream << "Map<";
@@ -418,6 +518,8 @@ inline Log operator<<(Log stream, const Map<Key, Value> &map)
 template <typename Key, typename Value>
 inline Log operator<<(Log stream, const Hash<Key, Value> &map)
 {
+    if (!stream.isEnabled())
+        return stream;
     bool old;
     if (!(stream.flags() & LogOutput::NoTypename)) {
         stream << "Hash<";
@@ -453,7 +555,8 @@ inline Log operator<<(Log stream, const Hash<Key, Value> &map)
 template <typename T>
 inline Log operator<<(Log log, Flags<T> f)
 {
-    log << f.toString();
+    if (log.isEnabled())
+        log << f.toString();
     return log;
 }
 
@@ -17,6 +17,8 @@ public:
         : Base(init, comp)
     {
     }
+    Map(const Map<Key, Value, Compare> &other) = default;
+    Map(Map<Key, Value, Compare> &&other) = default;
 
     Map<Key, Value, Compare>& operator=(const Map<Key, Value, Compare>& other)
     {
@@ -24,6 +26,8 @@ public:
         return *this;
     }
 
+    Map<Key, Value, Compare>& operator=(Map<Key, Value, Compare>&& other) = default;
+
     Map<Key, Value, Compare>& operator=(std::initializer_list<typename Base::value_type> init)
     {
         Base::operator=(init);
@@ -242,6 +246,8 @@ public:
         : std::multimap<Key, Value, Compare>(init, comp)
     {
     }
+    MultiMap(const MultiMap<Key, Value, Compare> &other) = default;
+    MultiMap(MultiMap<Key, Value, Compare> &&other) = default;
 
     MultiMap<Key, Value, Compare>& operator=(const MultiMap<Key, Value, Compare>& other)
     {
@@ -249,6 +255,8 @@ public:
         return *this;
     }
 
+    MultiMap<Key, Value, Compare>& operator=(MultiMap<Key, Value, Compare>&& other) = default;
+
     MultiMap<Key, Value, Compare>& operator=(std::initializer_list<typename std::multimap<Key, Value>::value_type> init)
     {
         std::multimap<Key, Value, Compare>::operator=(init);
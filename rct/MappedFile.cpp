@@ -0,0 +1,102 @@
+#include "MappedFile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Parallel.h"
+#include "Rct.h"
+
+MappedFile::MappedFile(MappedFile &&other)
+    : mData(other.mData), mSize(other.mSize), mMode(other.mMode), mMapped(other.mMapped),
+      mContents(std::move(other.mContents))
+{
+    if (mData && !mMapped)
+        mData = mContents.constData();
+    other.mData = 0;
+    other.mSize = 0;
+    other.mMapped = false;
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other)
+{
+    if (this != &other) {
+        close();
+        mData = other.mData;
+        mSize = other.mSize;
+        mMode = other.mMode;
+        mMapped = other.mMapped;
+        mContents = std::move(other.mContents);
+        if (mData && !mMapped)
+            mData = mContents.constData();
+        other.mData = 0;
+        other.mSize = 0;
+        other.mMapped = false;
+    }
+    return *this;
+}
+
+void MappedFile::close()
+{
+    if (mMapped)
+        munmap(const_cast<char *>(mData), mSize);
+    mData = 0;
+    mSize = 0;
+    mMode = 0;
+    mMapped = false;
+    mContents.clear();
+}
+
+bool MappedFile::open(const Path &path)
+{
+    close();
+    const int fd = ::open(path.constData(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    const bool ret = open(fd);
+    const int error = errno;
+    ::close(fd);
+    errno = error;
+    return ret;
+}
+
+bool MappedFile::open(int fd)
+{
+    close();
+    struct stat st;
+    if (fstat(fd, &st))
+        return false;
+    mMode = st.st_mode;
+    if (S_ISREG(st.st_mode) && st.st_size >= MapThreshold) {
+        const off_t offset = lseek(fd, 0, SEEK_CUR);
+        // mappings start at a page, only whole files are mapped
+        if (!offset) {
+            void *mapped = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                mData = static_cast<const char *>(mapped);
+                mSize = st.st_size;
+                mMapped = true;
+                return true;
+            }
+        }
+    }
+    if (!Rct::readAll(fd, mContents, String::npos, &st)) {
+        mContents.clear();
+        return false;
+    }
+    mData = mContents.constData();
+    mSize = mContents.size();
+    return true;
+}
+
+std::vector<MappedFile> MappedFile::openAll(const List<Path> &paths, ThreadPool *pool)
+{
+    std::vector<MappedFile> files(paths.size());
+    // small files are mostly open(), fstat() and read(), a few per job
+    Rct::parallelFor<size_t>(0, paths.size(), 8, [&paths, &files](size_t idx) {
+            files[idx].open(paths.at(idx));
+        }, pool);
+    return files;
+}
@@ -0,0 +1,78 @@
+#ifndef MappedFile_h
+#define MappedFile_h
+
+#include <sys/types.h>
+#include <vector>
+
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/Span.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+
+class ThreadPool;
+
+// A read only view of a file's contents. Files of MapThreshold bytes or
+// more are mapped, so the contents are only paged in as they're used and
+// nothing is copied. Smaller ones, where setting up a mapping costs more
+// than reading, and files that can't be mapped like pipes are read into
+// memory of the MappedFile's own.
+//
+//     MappedFile file(path);
+//     if (file.isOpen())
+//         scan(file.view());
+//
+// The contents of a mapped file change if the file is changed in place,
+// and reading past a point where it was truncated crashes. Files that are
+// replaced with rename(), like DataFile does, are fine.
+class MappedFile
+{
+public:
+    enum { MapThreshold = 64 * 1024 };
+
+    MappedFile()
+        : mData(0), mSize(0), mMode(0), mMapped(false)
+    {}
+    explicit MappedFile(const Path &path)
+        : MappedFile()
+    {
+        open(path);
+    }
+    MappedFile(MappedFile &&other);
+    MappedFile &operator=(MappedFile &&other);
+    ~MappedFile() { close(); }
+
+    bool open(const Path &path);
+    // reads what's left of fd, which stays open
+    bool open(int fd);
+    void close();
+
+    bool isOpen() const { return mData != 0; }
+    bool isMapped() const { return mMapped; }
+    // the file's st_mode
+    mode_t mode() const { return mMode; }
+
+    const char *data() const { return mData; }
+    size_t size() const { return mSize; }
+    Span<const char> span() const { return Span<const char>(mData, mSize); }
+    StringView view() const { return StringView(mData, mSize); }
+    // a copy of the contents
+    String toString() const { return String(mData, mSize); }
+
+    // Opens all of paths on pool's threads, ThreadPool::instance() if
+    // it's 0, and the calling one. The files are in the order of paths,
+    // the ones that couldn't be opened aren't open.
+    static std::vector<MappedFile> openAll(const List<Path> &paths, ThreadPool *pool = 0);
+
+private:
+    const char *mData;
+    size_t mSize;
+    mode_t mMode;
+    bool mMapped;
+    String mContents;
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+};
+
+#endif
@@ -2,24 +2,43 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #ifdef OS_Darwin
+# include <libproc.h>
 # include <mach/mach_init.h>
 # include <mach/mach_port.h>
 # include <mach/mach_traps.h>
 # include <mach/mach_vm.h>
+# include <mach/task.h>
+# include <mach/task_info.h>
 # include <mutex>
 #endif
 
 #include "List.h"
 #include "Log.h"
 #include "String.h"
+#include "rct/rct-config.h"
 
+#ifdef HAVE_MALLINFO2
+# include <malloc.h>
+#endif
+
+#if defined(OS_Linux)
+// jemalloc's, when it's linked in
+extern "C" int mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen) __attribute__((weak));
+#endif
 
 MemoryMonitor::MemoryMonitor()
+    : mUsage(0), mModerate(0), mCritical(0), mPressure(NoPressure), mStop(false)
+{
+}
+
+MemoryMonitor::~MemoryMonitor()
 {
+    stop();
 }
 
 #if defined(OS_Linux) || defined(__CYGWIN__ )
@@ -49,10 +68,45 @@ static bool lineVisitor(char* line, void* userData)
     return true;
 }
 
+// reads a small /proc file in one go, false if it's not there
+static bool readProcFile(const char *path, char *buffer, size_t size)
+{
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    size_t len = 0;
+    while (len < size - 1) {
+        const ssize_t r = read(fd, buffer + len, size - 1 - len);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        len += r;
+    }
+    close(fd);
+    buffer[len] = '\0';
+    return true;
+}
+
 static inline uint64_t usageLinux()
 {
-    const pid_t pid = getpid();
-    FILE* file = fopen(("/proc/" + String::number(pid) + "/smaps").constData(), "r");
+    // smaps_rollup is the sum of the mappings in smaps, since 4.14
+    static std::atomic<bool> noRollup(false);
+    if (!noRollup.load(std::memory_order_relaxed)) {
+        char buffer[4096];
+        if (readProcFile("/proc/self/smaps_rollup", buffer, sizeof(buffer))) {
+            uint64_t total = 0;
+            for (char *line = buffer; line; line = strchr(line, '\n')) {
+                if (*line == '\n')
+                    ++line;
+                lineVisitor(line, &total);
+            }
+            return total;
+        }
+        noRollup.store(true, std::memory_order_relaxed);
+    }
+
+    FILE* file = fopen("/proc/self/smaps", "r");
     if (!file)
         return 0;
 
@@ -122,3 +176,130 @@ uint64_t MemoryMonitor::usage()
 #error "MemoryMonitor does not support this system"
 #endif
 }
+
+#if defined(OS_Linux) || defined(__CYGWIN__)
+static uint64_t residentSizeLinux(const char *statm)
+{
+    // pages: size, resident, shared...
+    char buffer[128];
+    if (!readProcFile(statm, buffer, sizeof(buffer)))
+        return 0;
+    const char *resident = strchr(buffer, ' ');
+    return resident ? strtoull(resident + 1, 0, 10) * sysconf(_SC_PAGESIZE) : 0;
+}
+#endif
+
+uint64_t MemoryMonitor::residentSize()
+{
+#if defined(OS_Linux) || defined(__CYGWIN__)
+    return residentSizeLinux("/proc/self/statm");
+#elif defined(OS_Darwin)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS)
+        return 0;
+    return info.resident_size;
+#else
+    return 0;
+#endif
+}
+
+uint64_t MemoryMonitor::residentSize(pid_t pid)
+{
+#if defined(OS_Linux) || defined(__CYGWIN__)
+    char statm[64];
+    snprintf(statm, sizeof(statm), "/proc/%d/statm", static_cast<int>(pid));
+    return residentSizeLinux(statm);
+#elif defined(OS_Darwin)
+    struct proc_taskinfo info;
+    if (proc_pidinfo(pid, PROC_PIDTASKINFO, 0, &info, sizeof(info)) != sizeof(info))
+        return 0;
+    return info.pti_resident_size;
+#else
+    return 0;
+#endif
+}
+
+bool MemoryMonitor::mallocStats(MallocStats &stats)
+{
+#if defined(OS_Linux)
+    if (mallctl) {
+        // the stats are only refreshed when the epoch is written
+        uint64_t epoch = 1;
+        size_t len = sizeof(epoch);
+        mallctl("epoch", &epoch, &len, &epoch, len);
+        size_t allocated, resident;
+        len = sizeof(size_t);
+        if (!mallctl("stats.allocated", &allocated, &len, 0, 0) && !mallctl("stats.resident", &resident, &len, 0, 0)) {
+            stats.allocated = allocated;
+            stats.retained = resident > allocated ? resident - allocated : 0;
+            return true;
+        }
+    }
+#endif
+#ifdef HAVE_MALLINFO2
+    const struct mallinfo2 info = mallinfo2();
+    // hblkhd is what's mmap()ed by itself
+    stats.allocated = info.uordblks + info.hblkhd;
+    stats.retained = info.fordblks;
+    return true;
+#else
+    (void)stats;
+    return false;
+#endif
+}
+
+void MemoryMonitor::setThresholds(uint64_t moderate, uint64_t critical)
+{
+    mModerate.store(moderate, std::memory_order_relaxed);
+    mCritical.store(critical, std::memory_order_relaxed);
+}
+
+void MemoryMonitor::start(int interval)
+{
+    stop();
+    mStop = false;
+    mThread = std::thread(std::bind(&MemoryMonitor::run, this, interval));
+}
+
+void MemoryMonitor::stop()
+{
+    if (!mThread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mCondition.notify_one();
+    mThread.join();
+}
+
+void MemoryMonitor::run(int interval)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (!mStop) {
+        lock.unlock();
+        const uint64_t current = usage();
+        mUsage.store(current, std::memory_order_relaxed);
+        const Pressure old = pressure();
+        auto reached = [current, old](uint64_t threshold, Pressure level) {
+            if (!threshold)
+                return false;
+            if (level <= old)
+                threshold -= threshold / 10;
+            return current >= threshold;
+        };
+        Pressure now = NoPressure;
+        if (reached(mCritical.load(std::memory_order_relaxed), CriticalPressure)) {
+            now = CriticalPressure;
+        } else if (reached(mModerate.load(std::memory_order_relaxed), ModeratePressure)) {
+            now = ModeratePressure;
+        }
+        if (now != old) {
+            mPressure.store(now, std::memory_order_relaxed);
+            mPressureChanged(now, current);
+        }
+        lock.lock();
+        mCondition.wait_for(lock, std::chrono::milliseconds(interval), [this] { return mStop; });
+    }
+}
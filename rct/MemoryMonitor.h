@@ -2,14 +2,83 @@
 #define MEMORYMONITOR_H
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
 
+#include <rct/SignalSlot.h>
+
+// The static functions measure the process when called. An instance
+// samples usage() on a thread of its own so the latest value is a load
+// away, and tells when it crosses thresholds so caches can be shed:
+//
+//     monitor.setThresholds(2ULL << 30, 3ULL << 30);
+//     monitor.pressureChanged().connect<EventLoop::Async>([](MemoryMonitor::Pressure pressure, uint64_t) {
+//             if (pressure != MemoryMonitor::NoPressure)
+//                 cache.clear();
+//         });
+//     monitor.start();
 class MemoryMonitor
 {
 public:
+    MemoryMonitor();
+    ~MemoryMonitor();
+
+    // private memory in bytes. From smaps_rollup on Linux when the kernel
+    // has it, that's one small read, otherwise every mapping in smaps.
     static uint64_t usage();
+    // resident memory in bytes, shared pages included, cheaper still
+    static uint64_t residentSize();
+    // of another process of the same user, 0 if it can't be read
+    static uint64_t residentSize(pid_t pid);
+
+    struct MallocStats
+    {
+        // in use by the program
+        uint64_t allocated;
+        // held by the allocator without being in use
+        uint64_t retained;
+    };
+    // from jemalloc when it's linked in, otherwise mallinfo2(). false
+    // without either.
+    static bool mallocStats(MallocStats &stats);
+
+    enum Pressure {
+        NoPressure,
+        ModeratePressure,
+        CriticalPressure
+    };
+    // bytes of usage(), 0 leaves a level out. A level is left once usage
+    // is 10% below it so it doesn't go back and forth.
+    void setThresholds(uint64_t moderate, uint64_t critical);
+    // ms between samples
+    void start(int interval = 1000);
+    void stop();
+    bool isRunning() const { return mThread.joinable(); }
+
+    // the latest sample, 0 until there is one
+    uint64_t lastUsage() const { return mUsage.load(std::memory_order_relaxed); }
+    Pressure pressure() const { return static_cast<Pressure>(mPressure.load(std::memory_order_relaxed)); }
+    // emitted on the sampling thread, connect with EventLoop::Async to
+    // get it on the connecting thread's loop
+    Signal<std::function<void(Pressure, uint64_t)> > &pressureChanged() { return mPressureChanged; }
 
 private:
-    MemoryMonitor();
+    void run(int interval);
+
+    std::atomic<uint64_t> mUsage, mModerate, mCritical;
+    std::atomic<int> mPressure;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mStop;
+    std::thread mThread;
+    Signal<std::function<void(Pressure, uint64_t)> > mPressureChanged;
+
+    MemoryMonitor(const MemoryMonitor &) = delete;
+    MemoryMonitor &operator=(const MemoryMonitor &) = delete;
 };
 
 #endif
@@ -2,100 +2,203 @@
 
 #include <assert.h>
 #include <cstdlib>
+#include <vector>
 
+#include "Allocations.h"
 #include "FinishMessage.h"
 #include "QuitMessage.h"
 #include "ResponseMessage.h"
 #include "Serializer.h"
 
-std::mutex Message::sMutex;
-Map<uint8_t, Message::MessageCreatorBase *> Message::sFactory;
+std::atomic<Message::Creator> Message::sFactory[256] = {
+    { 0 },
+    { &Message::createMessage<ResponseMessage> },
+    { &Message::createMessage<FinishMessage> },
+    { &Message::createMessage<QuitMessage> }
+};
+std::atomic<size_t> Message::sCompressionThreshold(512);
 
-void Message::prepare(int version, String &header, String &value) const
+uint8_t Message::compress(String &value) const
 {
+    const uint8_t raw = mFlags & ~(Compressed|Lz4|Zstd);
+    if (!(mFlags & Compressed) || value.size() < sCompressionThreshold || !String::hasCodec(codec(mFlags)))
+        return raw;
+    String compressed = value.compress(codec(mFlags));
+    // not worth making the other side decompress it
+    if (compressed.isEmpty() || compressed.size() > value.size() - value.size() / 16)
+        return raw;
+    value = std::move(compressed);
+    return mFlags;
+}
+
+uint8_t Message::prepare(int version, String &header, String &value) const
+{
+    RCT_ALLOCATION_SCOPE(Allocations::SerializerSubsystem);
     if (mHeader.isEmpty() || version != mVersion) {
         if (version != mVersion) {
             mHeader.clear();
             mValue.clear();
         }
         {
-            Serializer s(mValue);
+            Serializer s(mValue, encodedSize());
+            s.setCompact(isCompact(version));
             encode(s);
         }
-        if (mFlags & Compressed) {
-            mValue = mValue.compress();
-        }
+        mHeaderFlags = compress(mValue);
         Serializer s(mHeader);
-        encodeHeader(s, mValue.size(), version);
+        encodeHeader(s, mValue.size(), version, mHeaderFlags);
         mVersion = version;
     }
     value = mValue;
     header = mHeader;
+    return mHeaderFlags;
 }
 
-std::shared_ptr<Message> Message::create(int version, const char *data, int size)
+std::shared_ptr<const EncodedMessage> Message::encoded(int version) const
 {
-    if (!size || !data) {
+    RCT_ALLOCATION_SCOPE(Allocations::SerializerSubsystem);
+    std::shared_ptr<EncodedMessage> ret(new EncodedMessage(version, mMessageId));
+    String &data = ret->mData;
+    if (mFlags & Compressed) {
+        String value;
+        {
+            Serializer s(value, encodedSize());
+            s.setCompact(isCompact(version));
+            encode(s);
+        }
+        const uint8_t flags = compress(value);
+        Serializer s(data, sizeof(uint32_t) + HeaderExtra + value.size());
+        encodeHeader(s, value.size(), version, flags);
+        data.append(value);
+    } else {
+        // header with a placeholder size, the value right behind it
+        const size_t size = encodedSize();
+        Serializer s(data, size == String::npos ? size : sizeof(uint32_t) + HeaderExtra + size);
+        encodeHeader(s, 0, version);
+        s.setCompact(isCompact(version));
+        encode(s);
+        const uint32_t frame = data.size() - sizeof(uint32_t);
+        memcpy(data.data(), &frame, sizeof(frame));
+    }
+    return ret;
+}
+
+std::shared_ptr<Message> Message::create(int version, const char *data, int size, Arena *arena)
+{
+    const Deserializer::Chunk chunk(data, data && size > 0 ? size : 0);
+    return create(version, &chunk, 1, arena);
+}
+
+std::shared_ptr<Message> Message::create(int version, const Deserializer::Chunk *chunks, size_t count, Arena *arena)
+{
+    RCT_ALLOCATION_SCOPE(Allocations::SerializerSubsystem);
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i)
+        size += chunks[i].second;
+    if (!size) {
         error("Can't create message from empty data");
         return std::shared_ptr<Message>();
     }
-    Deserializer ds(data, Serializer::sizeOf<int>() + Serializer::sizeOf<uint8_t>() + Serializer::sizeOf<uint8_t>());
+    const char *data = chunks[0].first;
+    if (size < HeaderExtra) {
+        error("Message too short: %zu bytes", size);
+        error() << String::toHex(data, chunks[0].second);
+        return std::shared_ptr<Message>();
+    }
+    Deserializer ds(chunks, count);
     int ver;
     ds >> ver;
-    if (ver != version) {
+    // either format of the same version is fine, what follows the header
+    // is read in the one the sender used
+    if ((ver ^ version) & ~Serializer::CompactVersion) {
         size -= Serializer::sizeOf(ver);
+        const int dump = std::min<size_t>(chunks[0].second, 1024);
         if (size > 1) {
             uint8_t id;
             ds >> id;
             error("Invalid message version. Got %d, expected %d id: %d", ver, version, id);
-            error() << String::toHex(data, std::min(size, 1024));
+            error() << String::toHex(data, dump);
             // error() << Rct::backtrace();
         } else {
             error("Invalid message version. Got %d, expected %d", ver, version);
-            error() << String::toHex(data, std::min(size, 1024));
+            error() << String::toHex(data, dump);
         }
         return std::shared_ptr<Message>();
     }
-    size -= Serializer::sizeOf(version);
-    data += Serializer::sizeOf(version);
     uint8_t id;
     ds >> id;
-    size -= Serializer::sizeOf(id);
-    data += Serializer::sizeOf(id);
     uint8_t flags;
     ds >> flags;
-    data += Serializer::sizeOf(flags);
-    size -= Serializer::sizeOf(flags);
-    String uncompressed;
-    if (flags & Compressed) {
-        uncompressed = String::uncompress(data, size);
-        data = uncompressed.constData();
-        size = uncompressed.size();
+    const size_t extra = headerExtra(flags);
+    if (size < extra) {
+        error("Message too short: %zu bytes", size);
+        return std::shared_ptr<Message>();
+    }
+    uint32_t requestId = 0;
+    if (flags & (RequestFlag|ResponseFlag))
+        ds >> requestId;
+    size -= extra;
+
+    // the payload, still spread over the chunks
+    size_t offset = extra;
+    while (count && offset >= chunks->second) {
+        offset -= chunks->second;
+        ++chunks;
+        --count;
     }
-    std::lock_guard<std::mutex> lock(sMutex);
-    if (!sFactory.contains(ResponseMessage::MessageId)) {
-        atexit(Message::cleanup);
-        sFactory[ResponseMessage::MessageId] = new MessageCreator<ResponseMessage>();
-        sFactory[FinishMessage::MessageId] = new MessageCreator<FinishMessage>();
-        sFactory[QuitMessage::MessageId] = new MessageCreator<QuitMessage>();
+    Deserializer::Chunk first("", 0);
+    std::vector<Deserializer::Chunk> rest;
+    if (count) {
+        first = Deserializer::Chunk(chunks->first + offset, chunks->second - offset);
+        if (count > 1) {
+            rest.assign(chunks, chunks + count);
+            rest[0] = first;
+        }
     }
+    const Deserializer::Chunk *payload = rest.empty() ? &first : rest.data();
 
-    MessageCreatorBase *base = sFactory.value(id);
-    if (!base) {
-        error("Invalid message id %d, data: %d bytes", id, size);
+    const Creator creator = sFactory[id].load(std::memory_order_acquire);
+    if (!creator) {
+        error("Invalid message id %d, data: %zu bytes", id, size);
         return std::shared_ptr<Message>();
     }
-    std::shared_ptr<Message> message(base->create(data, size));
+    std::shared_ptr<Message> message;
+    if (flags & Compressed) {
+        if (!String::hasCodec(codec(flags))) {
+            error("Message id: %d is compressed with a codec this build doesn't have", id);
+            return std::shared_ptr<Message>();
+        }
+        const String uncompressed = String::uncompress(payload, rest.empty() ? 1 : rest.size(), codec(flags));
+        if (uncompressed.isEmpty() && size) {
+            error("Can't uncompress message id: %d, data: %zu bytes", id, size);
+            return std::shared_ptr<Message>();
+        }
+        Deserializer deserializer(uncompressed.constData(), uncompressed.size());
+        deserializer.setArena(arena);
+        deserializer.setCompact(isCompact(ver));
+        message = creator(deserializer);
+    } else if (!rest.empty()) {
+        Deserializer deserializer(payload, rest.size());
+        deserializer.setArena(arena);
+        deserializer.setCompact(isCompact(ver));
+        message = creator(deserializer);
+    } else {
+        Deserializer deserializer(first.first, first.second);
+        deserializer.setArena(arena);
+        deserializer.setCompact(isCompact(ver));
+        message = creator(deserializer);
+    }
     if (!message) {
-        error("Can't create message from data id: %d, data: %d bytes", id, size);
+        error("Can't create message from data id: %d, data: %zu bytes", id, size);
+    } else {
+        message->mRequestId = requestId;
+        message->mIsResponse = flags & ResponseFlag;
     }
     return message;
 }
 
 void Message::cleanup()
 {
-    std::lock_guard<std::mutex> lock(sMutex);
-    for (Map<uint8_t, MessageCreatorBase *>::const_iterator it = sFactory.begin(); it != sFactory.end(); ++it)
-        delete it->second;
-    sFactory.clear();
+    for (size_t id = QuitMessageId + 1; id < sizeof(sFactory) / sizeof(sFactory[0]); ++id)
+        sFactory[id].store(0, std::memory_order_relaxed);
 }
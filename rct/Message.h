@@ -1,11 +1,22 @@
 #ifndef MESSAGE_H
 #define MESSAGE_H
 
+#include <atomic>
 #include <mutex>
 #include <memory>
 
 #include <rct/Serializer.h>
 
+// Declares the members a message serializes, in wire order, and generates
+// encode(), decode() and an encodedSize() that's always right:
+//
+//     RCT_MESSAGE_FIELDS(mPath, mFlags, mArguments)
+#define RCT_MESSAGE_FIELDS(...)                                                                \
+    virtual size_t encodedSize() const override { return serializedFieldsSize(__VA_ARGS__); } \
+    virtual void encode(Serializer &s) const override { serializeFields(s, __VA_ARGS__); }    \
+    virtual void decode(Deserializer &s) override { deserializeFields(s, __VA_ARGS__); }
+
+class EncodedMessage;
 class Message
 {
 public:
@@ -16,75 +27,136 @@ public:
     };
 
     Message(uint8_t id, uint8_t flags = None)
-        : mMessageId(id), mFlags(flags), mVersion(0)
+        : mMessageId(id), mFlags(flags & ~(RequestFlag|ResponseFlag)), mRequestId(0), mIsResponse(false), mVersion(0), mHeaderFlags(0)
     {}
     virtual ~Message()
     {}
 
+    // Compressed uses zlib unless Lz4 or Zstd is set as well. Values
+    // smaller than compressionThreshold(), or that don't get noticeably
+    // smaller, are sent uncompressed. 0x10 and 0x20 are used by the header.
     enum Flag {
         None = 0x0,
         Compressed = 0x1,
-        MessageCache = 0x2
+        MessageCache = 0x2,
+        Lz4 = 0x4,
+        Zstd = 0x8
     };
 
     uint8_t flags() const { return mFlags; }
     uint8_t messageId() const { return mMessageId; }
+    // the id of the request a received message belongs to, 0 if it came
+    // outside of a request, see Connection::request()
+    uint32_t requestId() const { return mRequestId; }
+
+    static size_t compressionThreshold() { return sCompressionThreshold; }
+    static void setCompressionThreshold(size_t size) { sCompressionThreshold = size; }
 
     virtual void encode(Serializer &/* serializer */) const = 0;
     virtual void decode(Deserializer &/* deserializer */) = 0;
 
+    // exact size of what encode() writes, -1 if unknown. Connection::send()
+    // serializes straight into the outgoing frame when it's known, see
+    // RCT_MESSAGE_FIELDS
     virtual size_t encodedSize() const { return -1; }
-    static std::shared_ptr<Message> create(int version, const char *data, int size);
+    // serializes, and compresses, the message for one protocol version
+    // into an immutable frame that can be sent on any number of
+    // connections. Doesn't touch the cache prepare() uses.
+    std::shared_ptr<const EncodedMessage> encoded(int version) const;
+    // With an arena the message, and whatever its decode() puts in the
+    // deserializer's arena, is allocated there. It must not outlive the
+    // arena or its next reset().
+    static std::shared_ptr<Message> create(int version, const char *data, int size, Arena *arena = 0);
+    // decodes a message spread over several chunks without joining them
+    static std::shared_ptr<Message> create(int version, const Deserializer::Chunk *chunks, size_t count,
+                                           Arena *arena = 0);
+    // the first type registered for an id is the one that's created
     template<typename T> static void registerMessage()
     {
         const uint8_t id = T::MessageId;
-        std::lock_guard<std::mutex> lock(sMutex);
-        MessageCreatorBase *&base = sFactory[id];
-        if (!base) {
-            base = new MessageCreator<T>();
-        }
+        Creator expected = 0;
+        sFactory[id].compare_exchange_strong(expected, &createMessage<T>, std::memory_order_release);
     }
+    // forgets the registered types, the built in ones stay
     static void cleanup();
 private:
-    class MessageCreatorBase
-    {
-    public:
-        virtual ~MessageCreatorBase() {}
-        virtual Message *create(const char *data, int size) = 0;
-    };
-
+    typedef std::shared_ptr<Message> (*Creator)(Deserializer &deserializer);
     template <typename T>
-    class MessageCreator : public MessageCreatorBase
+    static std::shared_ptr<Message> createMessage(Deserializer &deserializer)
     {
-    public:
-        virtual Message *create(const char *data, int size) override
-        {
-            T *t = new T;
-            Deserializer deserializer(data, size);
-            t->decode(deserializer);
-            return t;
+        // one allocation for the message and the reference count
+        std::shared_ptr<T> t;
+        if (Arena *arena = deserializer.arena()) {
+            t = std::allocate_shared<T>(ArenaAllocator<T>(arena));
+        } else {
+            t = std::make_shared<T>();
         }
-    };
+        t->decode(deserializer);
+        return t;
+    }
 
-    void prepare(int version, String &header, String &value) const;
+    // returns the flags of the header
+    uint8_t prepare(int version, String &header, String &value) const;
+    static bool isCompact(int version) { return version & Serializer::CompactVersion; }
     enum { HeaderExtra = Serializer::sizeOf<int>() + Serializer::sizeOf<uint8_t>() + Serializer::sizeOf<uint8_t>() };
+    // header only flags, a request id follows the flags when either is set
+    enum { RequestFlag = 0x10, ResponseFlag = 0x20 };
+    static size_t headerExtra(uint8_t flags)
+    {
+        return HeaderExtra + (flags & (RequestFlag|ResponseFlag) ? Serializer::sizeOf<uint32_t>() : 0);
+    }
     inline void encodeHeader(Serializer &serializer, uint32_t size, int version) const
     {
-        size += HeaderExtra;
+        encodeHeader(serializer, size, version, mFlags & ~(Compressed|Lz4|Zstd));
+    }
+    inline void encodeHeader(Serializer &serializer, uint32_t size, int version, uint8_t flags, uint32_t requestId = 0) const
+    {
+        size += headerExtra(flags);
         serializer.write(&size, sizeof(size));
-        serializer << version << static_cast<uint8_t>(mMessageId) << mFlags;
+        serializer << version << static_cast<uint8_t>(mMessageId) << flags;
+        if (flags & (RequestFlag|ResponseFlag))
+            serializer << requestId;
     }
+    // compresses value if the message wants it and it's worth it, returns
+    // the flags for the header
+    uint8_t compress(String &value) const;
+    static String::Codec codec(uint8_t flags) { return flags & Zstd ? String::Zstd : flags & Lz4 ? String::Lz4 : String::Zlib; }
     friend class Connection;
+    friend class SharedMemoryChannel;
 
     uint8_t mMessageId;
     uint8_t mFlags;
+    uint32_t mRequestId;
+    bool mIsResponse;
     mutable int mVersion;
+    mutable uint8_t mHeaderFlags;
     mutable String mHeader;
     mutable String mValue;
 
-    static Map<uint8_t, MessageCreatorBase *> sFactory;
-    static std::mutex sMutex;
+    // indexed by id, read without locking
+    static std::atomic<Creator> sFactory[256];
+    static std::atomic<size_t> sCompressionThreshold;
+
+};
+
+class EncodedMessage
+{
+public:
+    int version() const { return mVersion; }
+    uint8_t messageId() const { return mMessageId; }
+    // the whole frame, size prefix included
+    const String &data() const { return mData; }
+
+private:
+    EncodedMessage(int version, uint8_t id)
+        : mVersion(version), mMessageId(id)
+    {}
+
+    const int mVersion;
+    const uint8_t mMessageId;
+    String mData;
 
+    friend class Message;
 };
 
 #endif // MESSAGE_H
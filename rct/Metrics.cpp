@@ -0,0 +1,525 @@
+#include "Metrics.h"
+
+#include <math.h>
+#include <stdio.h>
+
+#include "Allocations.h"
+#include "Buffer.h"
+#include "CpuUsage.h"
+#include "JSONWriter.h"
+#include "Log.h"
+#include "MemoryMonitor.h"
+#include "SocketClient.h"
+#include "SocketServer.h"
+
+Metrics::Counter::Counter()
+{
+    for (int i = 0; i < ShardCount; ++i)
+        mShards[i].value.store(0, std::memory_order_relaxed);
+}
+
+unsigned int Metrics::Counter::shard()
+{
+    static std::atomic<unsigned int> next(0);
+    static thread_local unsigned int tShard = next.fetch_add(1, std::memory_order_relaxed) % ShardCount;
+    return tShard;
+}
+
+uint64_t Metrics::Counter::value() const
+{
+    uint64_t ret = 0;
+    for (int i = 0; i < ShardCount; ++i)
+        ret += mShards[i].value.load(std::memory_order_relaxed);
+    return ret;
+}
+
+void Metrics::Gauge::add(double delta)
+{
+    double value = mValue.load(std::memory_order_relaxed);
+    while (!mValue.compare_exchange_weak(value, value + delta, std::memory_order_relaxed)) {
+    }
+}
+
+Metrics::Histogram::Histogram()
+    : mCount(0), mSum(0), mMax(0)
+{
+    for (int i = 0; i < BucketCount; ++i)
+        mBuckets[i].store(0, std::memory_order_relaxed);
+}
+
+int Metrics::Histogram::bucket(uint64_t value)
+{
+    if (value < 16)
+        return static_cast<int>(value);
+    const int exponent = 63 - __builtin_clzll(value);
+    const int sub = static_cast<int>(value >> (exponent - SubBucketBits)) & ((1 << SubBucketBits) - 1);
+    return 16 + ((exponent - 4) << SubBucketBits) + sub;
+}
+
+uint64_t Metrics::Histogram::bucketLimit(int bucket)
+{
+    if (bucket < 16)
+        return bucket;
+    const int exponent = 4 + ((bucket - 16) >> SubBucketBits);
+    const uint64_t sub = (bucket - 16) & ((1 << SubBucketBits) - 1);
+    const int shift = exponent - SubBucketBits;
+    return (((1ULL << SubBucketBits) + sub) << shift) + ((1ULL << shift) - 1);
+}
+
+void Metrics::Histogram::observe(uint64_t value)
+{
+    mBuckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    mSum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = mMax.load(std::memory_order_relaxed);
+    while (value > max && !mMax.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+uint64_t Metrics::HistogramSnapshot::percentile(double q) const
+{
+    if (!count)
+        return 0;
+    uint64_t target = static_cast<uint64_t>(ceil(q * count));
+    if (!target)
+        target = 1;
+    uint64_t seen = 0;
+    for (const auto &bucket : buckets) {
+        seen += bucket.second;
+        if (seen >= target)
+            return std::min(bucket.first, max);
+    }
+    return max;
+}
+
+Metrics::Metrics()
+    : mNextCollector(1)
+{
+}
+
+Metrics::~Metrics()
+{
+}
+
+static void processCollector(List<Metrics::Sample> &samples)
+{
+    samples.append(Metrics::sample("rct_process_resident_bytes", Metrics::GaugeType, MemoryMonitor::residentSize()));
+    for (const auto &thread : CpuUsage::usageByName())
+        samples.append(Metrics::sample("rct_thread_cpu_usage", Metrics::GaugeType, thread.second, { { "thread", thread.first } }));
+
+    uint64_t bytesRead = 0, bytesWritten = 0, readCalls = 0, writeCalls = 0;
+    const List<SocketClient::Stats> sockets = SocketClient::allStats();
+    for (const SocketClient::Stats &stats : sockets) {
+        bytesRead += stats.bytesRead;
+        bytesWritten += stats.bytesWritten;
+        readCalls += stats.readCalls;
+        writeCalls += stats.writeCalls;
+    }
+    // gauges, a socket that's closed takes its numbers with it
+    samples.append(Metrics::sample("rct_sockets", Metrics::GaugeType, sockets.size()));
+    samples.append(Metrics::sample("rct_socket_read_bytes", Metrics::GaugeType, bytesRead));
+    samples.append(Metrics::sample("rct_socket_written_bytes", Metrics::GaugeType, bytesWritten));
+    samples.append(Metrics::sample("rct_socket_read_calls", Metrics::GaugeType, readCalls));
+    samples.append(Metrics::sample("rct_socket_write_calls", Metrics::GaugeType, writeCalls));
+
+    if (Allocations::isEnabled()) {
+        for (int i = 0; i < Allocations::SubsystemCount; ++i) {
+            const Allocations::Subsystem subsystem = static_cast<Allocations::Subsystem>(i);
+            const Allocations::Stats stats = Allocations::stats(subsystem);
+            const Metrics::Labels labels = { { "subsystem", Allocations::name(subsystem) } };
+            samples.append(Metrics::sample("rct_allocations_total", Metrics::CounterType, stats.allocations, labels));
+            samples.append(Metrics::sample("rct_allocated_bytes_total", Metrics::CounterType, stats.allocatedBytes, labels));
+            samples.append(Metrics::sample("rct_allocated_live_bytes", Metrics::GaugeType,
+                                           static_cast<double>(static_cast<int64_t>(stats.allocatedBytes - stats.freedBytes)), labels));
+        }
+    }
+}
+
+Metrics &Metrics::instance()
+{
+    // never destroyed, metrics are updated from static destructors
+    static Metrics *metrics = []() {
+            static const char *help[][2] = {
+                { "rct_process_resident_bytes", "Resident memory of the process" },
+                { "rct_thread_cpu_usage", "Cores used by the threads of a name over the last second" },
+                { "rct_sockets", "Open SocketClients" },
+                { "rct_socket_read_bytes", "Bytes read by the open SocketClients" },
+                { "rct_socket_written_bytes", "Bytes written by the open SocketClients" },
+                { "rct_allocations_total", "Allocations with operator new by the subsystem that made them" },
+                { "rct_allocated_bytes_total", "Bytes allocated with operator new by the subsystem that made them" },
+                { "rct_allocated_live_bytes", "Bytes allocated by the subsystem that haven't been freed" },
+                { "rct_log_messages_total", "Messages logged by level" },
+                { "rct_threadpool_threads", "Concurrent jobs of the pool" },
+                { "rct_threadpool_backlog", "Jobs waiting for a thread" },
+                { "rct_threadpool_busy_threads", "Threads running a job" },
+                { "rct_threadpool_jobs_started_total", "Jobs started while instrumented" },
+                { "rct_threadpool_jobs_finished_total", "Jobs finished while instrumented" },
+                { "rct_threadpool_slow_waits_total", "Jobs that waited longer than the slow wait threshold" },
+                { "rct_threadpool_job_wait_us", "Time from start() until a thread took the job" },
+                { "rct_threadpool_job_run_us", "Time jobs ran" },
+                { "rct_eventloop_iterations_total", "Iterations of exec() while instrumented" },
+                { "rct_eventloop_blocked_us_total", "Time spent waiting for events while instrumented" },
+                { "rct_eventloop_slow_callbacks_total", "Callbacks slower than the slow callback threshold" },
+                { "rct_eventloop_budget_hits_total", "Iterations that ran out of a SchedulingPolicy budget" },
+                { "rct_eventloop_callback_us", "Time callbacks took while instrumented" }
+            };
+            Metrics *ret = new Metrics;
+            for (const auto &it : help)
+                ret->mHelp[it[0]] = it[1];
+            ret->addCollector(processCollector);
+            return ret;
+        }();
+    return *metrics;
+}
+
+static String entryKey(const String &name, const Metrics::Labels &labels)
+{
+    // '\0' sorts first so all of a name's entries are together
+    String key = name;
+    for (const auto &label : labels) {
+        key += '\0';
+        key += label.first;
+        key += '\0';
+        key += label.second;
+    }
+    return key;
+}
+
+Metrics::Entry *Metrics::entry(Type type, const String &name, const Labels &labels, const String &help)
+{
+    static const char *typeNames[] = { "counter", "gauge", "histogram" };
+    Entry *ret = 0;
+    Type registered = type;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mTypes.find(name);
+        if (it == mTypes.end()) {
+            mTypes[name] = type;
+        } else {
+            registered = it->second;
+        }
+        if (!help.isEmpty() && !mHelp.count(name))
+            mHelp[name] = help;
+        if (registered == type) {
+            std::unique_ptr<Entry> &e = mEntries[entryKey(name, labels)];
+            if (!e) {
+                e.reset(new Entry);
+                e->type = type;
+                e->name = name;
+                e->labels = labels;
+                switch (type) {
+                case CounterType: e->counter.reset(new Counter); break;
+                case GaugeType: e->gauge.reset(new Gauge); break;
+                case HistogramType: e->histogram.reset(new Histogram); break;
+                }
+            }
+            ret = e.get();
+        }
+    }
+    if (!ret) {
+        // logged without the lock, logging counts messages here
+        ::error("Metrics: %s is a %s, not a %s", name.constData(), typeNames[registered], typeNames[type]);
+        static thread_local Entry unexported[3];
+        ret = &unexported[type];
+        ret->type = type;
+        switch (type) {
+        case CounterType: if (!ret->counter) ret->counter.reset(new Counter); break;
+        case GaugeType: if (!ret->gauge) ret->gauge.reset(new Gauge); break;
+        case HistogramType: if (!ret->histogram) ret->histogram.reset(new Histogram); break;
+        }
+    }
+    return ret;
+}
+
+Metrics::Counter &Metrics::counter(const String &name, const Labels &labels, const String &help)
+{
+    return *entry(CounterType, name, labels, help)->counter;
+}
+
+Metrics::Gauge &Metrics::gauge(const String &name, const Labels &labels, const String &help)
+{
+    return *entry(GaugeType, name, labels, help)->gauge;
+}
+
+Metrics::Histogram &Metrics::histogram(const String &name, const Labels &labels, const String &help)
+{
+    return *entry(HistogramType, name, labels, help)->histogram;
+}
+
+int Metrics::addCollector(Collector &&collector)
+{
+    std::lock_guard<std::mutex> lock(mCollectorsMutex);
+    const int id = mNextCollector++;
+    mCollectors[id] = std::move(collector);
+    return id;
+}
+
+void Metrics::removeCollector(int id)
+{
+    // waits for a snapshot() that's calling it
+    std::lock_guard<std::mutex> lock(mCollectorsMutex);
+    mCollectors.erase(id);
+}
+
+void Metrics::setHelp(const String &name, const String &help)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mHelp[name] = help;
+}
+
+List<Metrics::Sample> Metrics::snapshot() const
+{
+    List<Sample> ret;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ret.reserve(mEntries.size());
+        for (const auto &it : mEntries) {
+            const Entry &entry = *it.second;
+            Sample sample;
+            sample.name = entry.name;
+            sample.labels = entry.labels;
+            sample.type = entry.type;
+            sample.value = 0;
+            switch (entry.type) {
+            case CounterType:
+                sample.value = entry.counter->value();
+                break;
+            case GaugeType:
+                sample.value = entry.gauge->value();
+                break;
+            case HistogramType: {
+                const Histogram &histogram = *entry.histogram;
+                HistogramSnapshot &snapshot = sample.histogram;
+                for (int i = 0; i < Histogram::BucketCount; ++i) {
+                    if (const uint64_t count = histogram.mBuckets[i].load(std::memory_order_relaxed)) {
+                        snapshot.buckets.append(std::make_pair(Histogram::bucketLimit(i), count));
+                        snapshot.count += count;
+                    }
+                }
+                // from the buckets so they add up while values come in
+                snapshot.sum = histogram.mSum.load(std::memory_order_relaxed);
+                snapshot.max = histogram.mMax.load(std::memory_order_relaxed);
+                sample.value = snapshot.count;
+                break; }
+            }
+            ret.append(std::move(sample));
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mCollectorsMutex);
+        for (const auto &collector : mCollectors)
+            collector.second(ret);
+    }
+    std::stable_sort(ret.begin(), ret.end(), [](const Sample &a, const Sample &b) {
+            return entryKey(a.name, a.labels) < entryKey(b.name, b.labels);
+        });
+    return ret;
+}
+
+static void appendNumber(String &out, double value)
+{
+    if (isnan(value)) {
+        out += "NaN";
+    } else if (isinf(value)) {
+        out += value > 0 ? "+Inf" : "-Inf";
+    } else {
+        out.appendFormat("%.15g", value);
+    }
+}
+
+static void appendLabels(String &out, const Metrics::Labels &labels, const char *le = 0)
+{
+    if (labels.isEmpty() && !le)
+        return;
+    out += '{';
+    bool first = true;
+    auto label = [&out, &first](const String &name, const String &value) {
+        if (!first)
+            out += ',';
+        first = false;
+        out += name;
+        out += "=\"";
+        for (size_t i = 0; i < value.size(); ++i) {
+            const char ch = value.at(i);
+            if (ch == '\\' || ch == '"') {
+                out += '\\';
+                out += ch;
+            } else if (ch == '\n') {
+                out += "\\n";
+            } else {
+                out += ch;
+            }
+        }
+        out += '"';
+    };
+    for (const auto &it : labels)
+        label(it.first, it.second);
+    if (le)
+        label("le", le);
+    out += '}';
+}
+
+String Metrics::toText() const
+{
+    const List<Sample> samples = snapshot();
+    std::map<String, String> help;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        help = mHelp;
+    }
+    static const char *typeNames[] = { "counter", "gauge", "histogram" };
+    String out;
+    const String *last = 0;
+    for (const Sample &sample : samples) {
+        if (!last || *last != sample.name) {
+            last = &sample.name;
+            auto it = help.find(sample.name);
+            if (it != help.end()) {
+                String text = it->second;
+                text.replace("\\", "\\\\");
+                text.replace("\n", "\\n");
+                out.appendFormat("# HELP %s %s\n", sample.name.constData(), text.constData());
+            }
+            out.appendFormat("# TYPE %s %s\n", sample.name.constData(), typeNames[sample.type]);
+        }
+        if (sample.type != HistogramType) {
+            out += sample.name;
+            appendLabels(out, sample.labels);
+            out += ' ';
+            appendNumber(out, sample.value);
+            out += '\n';
+            continue;
+        }
+        // cumulative, buckets without values are left out
+        uint64_t count = 0;
+        char le[32];
+        for (const auto &bucket : sample.histogram.buckets) {
+            count += bucket.second;
+            snprintf(le, sizeof(le), "%llu", static_cast<unsigned long long>(bucket.first));
+            out += sample.name;
+            out += "_bucket";
+            appendLabels(out, sample.labels, le);
+            out.appendFormat(" %llu\n", static_cast<unsigned long long>(count));
+        }
+        out += sample.name;
+        out += "_bucket";
+        appendLabels(out, sample.labels, "+Inf");
+        out.appendFormat(" %llu\n", static_cast<unsigned long long>(sample.histogram.count));
+        out += sample.name;
+        out += "_sum";
+        appendLabels(out, sample.labels);
+        out.appendFormat(" %llu\n", static_cast<unsigned long long>(sample.histogram.sum));
+        out += sample.name;
+        out += "_count";
+        appendLabels(out, sample.labels);
+        out.appendFormat(" %llu\n", static_cast<unsigned long long>(sample.histogram.count));
+    }
+    return out;
+}
+
+void Metrics::write(JSONWriter &writer) const
+{
+    static const char *typeNames[] = { "counter", "gauge", "histogram" };
+    writer.beginObject();
+    writer.key("metrics").beginArray();
+    for (const Sample &sample : snapshot()) {
+        writer.beginObject();
+        writer.key("name").value(sample.name);
+        writer.key("type").value(typeNames[sample.type]);
+        if (!sample.labels.isEmpty()) {
+            writer.key("labels").beginObject();
+            for (const auto &label : sample.labels)
+                writer.key(label.first).value(label.second);
+            writer.endObject();
+        }
+        if (sample.type != HistogramType) {
+            writer.key("value").value(sample.value);
+        } else {
+            const HistogramSnapshot &histogram = sample.histogram;
+            writer.key("count").value(static_cast<unsigned long long>(histogram.count));
+            writer.key("sum").value(static_cast<unsigned long long>(histogram.sum));
+            writer.key("max").value(static_cast<unsigned long long>(histogram.max));
+            writer.key("p50").value(static_cast<unsigned long long>(histogram.percentile(.5)));
+            writer.key("p90").value(static_cast<unsigned long long>(histogram.percentile(.9)));
+            writer.key("p99").value(static_cast<unsigned long long>(histogram.percentile(.99)));
+            writer.key("buckets").beginArray();
+            for (const auto &bucket : histogram.buckets) {
+                writer.beginArray();
+                writer.value(static_cast<unsigned long long>(bucket.first));
+                writer.value(static_cast<unsigned long long>(bucket.second));
+                writer.endArray();
+            }
+            writer.endArray();
+        }
+        writer.endObject();
+    }
+    writer.endArray();
+    writer.endObject();
+}
+
+String Metrics::toJSON() const
+{
+    String ret;
+    {
+        JSONWriter writer(ret);
+        write(writer);
+    }
+    return ret;
+}
+
+void Metrics::serve(const std::shared_ptr<SocketServer> &server)
+{
+    enum { MaxRequest = 16384 };
+    auto finish = [](const SocketClient::SharedPtr &client) {
+        // drops the reference the disconnected() slot holds
+        client->readyRead().disconnect();
+        client->bytesWritten().disconnect();
+        client->disconnected().disconnect();
+        client->close();
+    };
+    auto respond = [this, finish](const SocketClient::SharedPtr &client) {
+        // kept alive by its own slot until it's finished
+        client->disconnected().connect([client, finish](const SocketClient::SharedPtr &) { finish(client); });
+        std::shared_ptr<String> request = std::make_shared<String>();
+        client->readyRead().connect([this, request, finish](const SocketClient::SharedPtr &c, Buffer &&buffer) {
+                request->append(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+                if (request->indexOf("\r\n\r\n") == String::npos) {
+                    if (request->size() > MaxRequest)
+                        finish(c);
+                    return;
+                }
+                const String line = request->left(request->indexOf("\r\n"));
+                c->readyRead().disconnect();
+                String body, type;
+                const char *status = "200 OK";
+                if (!line.startsWith("GET ")) {
+                    status = "405 Method Not Allowed";
+                } else if (line.contains("json")) {
+                    body = toJSON();
+                    type = "application/json";
+                } else {
+                    body = toText();
+                    type = "text/plain; version=0.0.4";
+                }
+                String response = String::format<128>("HTTP/1.0 %s\r\nConnection: close\r\nContent-Length: %zu\r\n",
+                                                      status, body.size());
+                if (!type.isEmpty())
+                    response.appendFormat("Content-Type: %s\r\n", type.constData());
+                response += "\r\n";
+                response += body;
+                c->bytesWritten().connect([finish](const SocketClient::SharedPtr &socket, int) {
+                        if (!socket->pendingWrite())
+                            finish(socket);
+                    });
+                if (!c->write(response) || !c->pendingWrite())
+                    finish(c);
+            });
+    };
+    server->newConnection().connect([respond](SocketServer *s) {
+            while (SocketClient::SharedPtr client = s->nextConnection())
+                respond(client);
+        });
+    server->newClient().connect([respond](SocketServer *, const SocketClient::SharedPtr &client) {
+            respond(client);
+        });
+}
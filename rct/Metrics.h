@@ -0,0 +1,204 @@
+#ifndef Metrics_h
+#define Metrics_h
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <rct/List.h>
+#include <rct/String.h>
+
+class JSONWriter;
+class SocketServer;
+
+// Counters, gauges and histograms by name and labels that can be
+// exported as a whole, in the Prometheus text format or as JSON:
+//
+//     static Metrics::Counter &requests = Metrics::instance().counter("requests_total", { { "kind", "query" } });
+//     static Metrics::Histogram &latency = Metrics::instance().histogram("request_us");
+//     requests.add();
+//     latency.observe(us);
+//
+// Looking a metric up takes a lock, updating it doesn't so the references
+// are meant to be kept. They stay valid as long as the registry does.
+// Collectors add the numbers of things that keep their own when a
+// snapshot is taken. The instance() has the rct_ metrics: every ThreadPool
+// and EventLoop adds its Statistics, logging counts messages by level and
+// there are the process' memory, the CPU of named threads, the totals of
+// the open sockets and, with RCT_ALLOCATION_PROFILING, the allocations of
+// each subsystem. A scrape can be answered by serve() over HTTP or
+// sent with a ResponseMessage(toText()).
+class Metrics
+{
+public:
+    Metrics();
+    ~Metrics();
+
+    static Metrics &instance();
+
+    typedef List<std::pair<String, String> > Labels;
+    enum Type { CounterType, GaugeType, HistogramType };
+
+    // Sharded so threads counting at the same time don't share a cache
+    // line, value() adds the shards up.
+    class Counter
+    {
+    public:
+        Counter();
+        void add(uint64_t n = 1) { mShards[shard()].value.fetch_add(n, std::memory_order_relaxed); }
+        uint64_t value() const;
+
+    private:
+        enum { ShardCount = 16 };
+        struct Shard
+        {
+            std::atomic<uint64_t> value;
+            char pad[64 - sizeof(std::atomic<uint64_t>)];
+        };
+        static unsigned int shard();
+        Shard mShards[ShardCount];
+    };
+
+    class Gauge
+    {
+    public:
+        Gauge()
+            : mValue(0)
+        {}
+        void set(double value) { mValue.store(value, std::memory_order_relaxed); }
+        void add(double delta);
+        double value() const { return mValue.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<double> mValue;
+    };
+
+    // Values are counted in buckets that are at most 1/8th of their lower
+    // bound wide, exactly below 16, so percentiles are off by less than
+    // 12.5% across the whole range of uint64_t.
+    class Histogram
+    {
+    public:
+        Histogram();
+        void observe(uint64_t value);
+
+        enum { SubBucketBits = 3, BucketCount = 16 + 60 * 8 };
+        static int bucket(uint64_t value);
+        // the largest value that goes in bucket
+        static uint64_t bucketLimit(int bucket);
+
+    private:
+        std::atomic<uint64_t> mBuckets[BucketCount];
+        std::atomic<uint64_t> mCount, mSum, mMax;
+
+        friend class Metrics;
+    };
+
+    struct HistogramSnapshot
+    {
+        HistogramSnapshot()
+            : count(0), sum(0), max(0)
+        {}
+        uint64_t count, sum, max;
+        // the buckets that have values, by their largest value
+        List<std::pair<uint64_t, uint64_t> > buckets;
+
+        // q from 0 to 1, 0 without values
+        uint64_t percentile(double q) const;
+    };
+
+    struct Sample
+    {
+        String name;
+        Labels labels;
+        Type type;
+        // counters and gauges
+        double value;
+        HistogramSnapshot histogram;
+    };
+
+    // Each name has one type, help is taken the first time a name is
+    // seen. Asking for a name as another type than it was registered as
+    // is an error, it gets a metric that isn't exported.
+    Counter &counter(const String &name, const Labels &labels = Labels(), const String &help = String());
+    Gauge &gauge(const String &name, const Labels &labels = Labels(), const String &help = String());
+    Histogram &histogram(const String &name, const Labels &labels = Labels(), const String &help = String());
+
+    // Called on the thread that takes a snapshot, appends its samples.
+    typedef std::function<void(List<Sample> &samples)> Collector;
+    int addCollector(Collector &&collector);
+    void removeCollector(int id);
+    // help for the samples of a collector
+    void setHelp(const String &name, const String &help);
+    static Sample sample(const String &name, Type type, double value, const Labels &labels = Labels())
+    {
+        Sample ret;
+        ret.name = name;
+        ret.labels = labels;
+        ret.type = type;
+        ret.value = value;
+        return ret;
+    }
+    // From a histogram whose bucket i counts values below 2^i and the last
+    // one everything slower, like the ones of EventLoop::Statistics and
+    // ThreadPool::Statistics.
+    template <typename T>
+    static Sample histogramSample(const String &name, const T &histogram, int bucketCount, const Labels &labels = Labels())
+    {
+        Sample ret = sample(name, HistogramType, histogram.count, labels);
+        ret.histogram.count = histogram.count;
+        ret.histogram.sum = histogram.totalUs;
+        ret.histogram.max = histogram.maxUs;
+        for (int i = 0; i < bucketCount; ++i) {
+            if (histogram.buckets[i]) {
+                const uint64_t limit = i + 1 < bucketCount ? (1ULL << i) - 1 : histogram.maxUs;
+                ret.histogram.buckets.append(std::make_pair(limit, static_cast<uint64_t>(histogram.buckets[i])));
+            }
+        }
+        return ret;
+    }
+
+    // sorted by name
+    List<Sample> snapshot() const;
+
+    // the Prometheus text exposition format
+    String toText() const;
+    void write(JSONWriter &writer) const;
+    String toJSON() const;
+
+    // Answers HTTP GET requests to the server's connections with
+    // toText(), or toJSON() if the path has "json" in it, and closes
+    // them. The registry has to outlive the server.
+    void serve(const std::shared_ptr<SocketServer> &server);
+
+private:
+    struct Entry
+    {
+        Type type;
+        String name;
+        Labels labels;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+    Entry *entry(Type type, const String &name, const Labels &labels, const String &help);
+
+    mutable std::mutex mMutex;
+    // by name and labels
+    std::map<String, std::unique_ptr<Entry> > mEntries;
+    std::map<String, Type> mTypes;
+    std::map<String, String> mHelp;
+    // held while collectors are called
+    mutable std::mutex mCollectorsMutex;
+    std::map<int, Collector> mCollectors;
+    int mNextCollector;
+
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include "Parallel.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+namespace Rct {
+
+enum { ChunksPerThread = 4 };
+
+// Shared with the helper jobs, which may only get to run after the
+// caller has returned. By then every chunk is claimed and they leave
+// without touching fn.
+struct ParallelState
+{
+    ParallelState(size_t c, const std::function<void(size_t)> &f)
+        : count(c), fn(&f), next(0), finished(0)
+    {}
+
+    void work()
+    {
+        for (;;) {
+            const size_t chunk = next.fetch_add(1);
+            if (chunk >= count)
+                return;
+            (*fn)(chunk);
+            if (finished.fetch_add(1) + 1 == count) {
+                std::lock_guard<std::mutex> lock(mutex);
+                condition.notify_all();
+            }
+        }
+    }
+
+    const size_t count;
+    const std::function<void(size_t)> *fn;
+    std::atomic<size_t> next, finished;
+    std::mutex mutex;
+    std::condition_variable condition;
+};
+
+static ThreadPool *parallelPool(ThreadPool *pool)
+{
+    return pool ? pool : ThreadPool::instance();
+}
+
+size_t parallelGrain(size_t count, size_t grain, ThreadPool *pool)
+{
+    if (grain)
+        return grain;
+    const size_t threads = std::max(parallelPool(pool)->concurrentJobs(), 1) + 1;
+    return std::max<size_t>(count / (threads * ChunksPerThread), 1);
+}
+
+void parallelChunks(size_t chunks, const std::function<void(size_t)> &fn, ThreadPool *pool)
+{
+    if (!chunks)
+        return;
+    pool = parallelPool(pool);
+    const size_t helpers = std::min<size_t>(chunks - 1, std::max(pool->concurrentJobs(), 0));
+    if (!helpers) {
+        for (size_t i = 0; i < chunks; ++i)
+            fn(i);
+        return;
+    }
+
+    std::shared_ptr<ParallelState> state = std::make_shared<ParallelState>(chunks, fn);
+    for (size_t i = 0; i < helpers; ++i)
+        pool->submit([state]() { state->work(); });
+    state->work();
+
+    if (state->finished.load() < chunks) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        while (state->finished.load() < chunks)
+            state->condition.wait(lock);
+    }
+}
+
+}
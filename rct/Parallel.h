@@ -0,0 +1,142 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <vector>
+
+#include <rct/List.h>
+#include <rct/ThreadPool.h>
+
+// Data parallel loops on a ThreadPool. The range is cut into chunks of
+// grain elements, 0 picks a grain that gives each pool thread a few
+// chunks. Chunks are handed out one at a time to whoever asks next, the
+// pool threads and the calling thread, so uneven chunks even out and a
+// busy pool only means the caller does more of the work. The calling
+// thread returns once every chunk has run, nested calls from pool jobs
+// don't deadlock. fn must be safe to call concurrently.
+//
+//     List<String> hashes(files.size());
+//     Rct::parallelFor<size_t>(0, files.size(), 1, [&](size_t i) {
+//             hashes[i] = SHA256::hashFile(files[i]);
+//         });
+//
+// A pool with ThreadPool::WorkStealing scheduling suits them best.
+namespace Rct {
+
+// runs fn(0) ... fn(chunks - 1) on pool and the calling thread
+void parallelChunks(size_t chunks, const std::function<void(size_t)> &fn, ThreadPool *pool = 0);
+// grain for count elements when 0 is asked for
+size_t parallelGrain(size_t count, size_t grain, ThreadPool *pool = 0);
+
+// fn(i) for every i in [begin, end), Index is an integer or a random
+// access iterator
+template<typename Index, typename F>
+void parallelFor(Index begin, Index end, size_t grain, F &&fn, ThreadPool *pool = 0)
+{
+    if (!(begin < end))
+        return;
+    const size_t count = end - begin;
+    grain = parallelGrain(count, grain, pool);
+    parallelChunks((count + grain - 1) / grain, [&](size_t chunk) {
+            const size_t first = chunk * grain;
+            const size_t last = std::min(first + grain, count);
+            for (size_t i = first; i < last; ++i)
+                fn(begin + i);
+        }, pool);
+}
+
+// fn(value) for every value in container. Containers without random
+// access, like Map, have their iterators collected first.
+template<typename Container, typename F>
+void parallelForEach(Container &container, size_t grain, F &&fn, ThreadPool *pool = 0)
+{
+    typedef decltype(container.begin()) Iterator;
+    std::vector<Iterator> iterators;
+    iterators.reserve(container.size());
+    for (Iterator it = container.begin(); it != container.end(); ++it)
+        iterators.push_back(it);
+    parallelFor<size_t>(0, iterators.size(), grain, [&](size_t i) { fn(*iterators[i]); }, pool);
+}
+
+// out[i] = fn(in[i]), out must have room for in.size() values
+template<typename In, typename Out, typename F>
+void parallelTransform(const In &in, Out &out, size_t grain, F &&fn, ThreadPool *pool = 0)
+{
+    parallelFor<size_t>(0, in.size(), grain, [&](size_t i) { out[i] = fn(in[i]); }, pool);
+}
+
+template<typename T, typename F>
+List<typename std::result_of<F(const T &)>::type> parallelTransform(const List<T> &in, size_t grain, F &&fn,
+                                                                    ThreadPool *pool = 0)
+{
+    List<typename std::result_of<F(const T &)>::type> out(in.size());
+    parallelTransform(in, out, grain, std::forward<F>(fn), pool);
+    return out;
+}
+
+// combine(... combine(combine(init, transform(begin)), transform(begin + 1)) ...).
+// Each chunk is reduced on its own, starting from init, and the chunk
+// results are then combined in order, so combine has to be associative
+// and init its identity, but needn't be commutative.
+template<typename Index, typename T, typename Transform, typename Combine>
+T parallelReduce(Index begin, Index end, size_t grain, const T &init, Transform &&transform, Combine &&combine,
+                 ThreadPool *pool = 0)
+{
+    if (!(begin < end))
+        return init;
+    const size_t count = end - begin;
+    grain = parallelGrain(count, grain, pool);
+    const size_t chunks = (count + grain - 1) / grain;
+    std::vector<T> results(chunks, init);
+    parallelChunks(chunks, [&](size_t chunk) {
+            const size_t first = chunk * grain;
+            const size_t last = std::min(first + grain, count);
+            T value = init;
+            for (size_t i = first; i < last; ++i)
+                value = combine(value, transform(begin + i));
+            results[chunk] = std::move(value);
+        }, pool);
+    T ret = init;
+    for (T &result : results)
+        ret = combine(ret, result);
+    return ret;
+}
+
+// Sorts chunks of the range in parallel and merges them pairwise, the
+// merges of a round run in parallel too. Not stable.
+template<typename Iterator, typename Compare>
+void parallelSort(Iterator begin, Iterator end, Compare compare, size_t grain = 0, ThreadPool *pool = 0)
+{
+    const size_t count = end - begin;
+    if (count < 2)
+        return;
+    enum { MinimumGrain = 4096 };
+    grain = std::max<size_t>(parallelGrain(count, grain, pool), MinimumGrain);
+    const size_t chunks = (count + grain - 1) / grain;
+    parallelChunks(chunks, [&](size_t chunk) {
+            const size_t first = chunk * grain;
+            std::sort(begin + first, begin + std::min(first + grain, count), compare);
+        }, pool);
+    for (size_t width = grain; width < count; width *= 2) {
+        const size_t merges = (count + 2 * width - 1) / (2 * width);
+        parallelChunks(merges, [&](size_t merge) {
+                const size_t first = merge * 2 * width;
+                const size_t middle = std::min(first + width, count);
+                const size_t last = std::min(first + 2 * width, count);
+                if (middle < last)
+                    std::inplace_merge(begin + first, begin + middle, begin + last, compare);
+            }, pool);
+    }
+}
+
+template<typename Iterator>
+void parallelSort(Iterator begin, Iterator end)
+{
+    parallelSort(begin, end, std::less<typename std::iterator_traits<Iterator>::value_type>());
+}
+
+}
+
+#endif
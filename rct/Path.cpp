@@ -8,12 +8,179 @@
 #include <sys/types.h>
 #include <utime.h>
 #include <wordexp.h>
+#ifdef OS_Linux
+#include <sys/syscall.h>
+#endif
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 
 #include "Log.h"
 #include "Rct.h"
+#include "Set.h"
+#include "SharedMutex.h"
+#include "ThreadPool.h"
 #include "rct/rct-config.h"
 
-bool Path::sRealPathEnabled = true;
+Path::RealPathPolicy Path::sRealPathPolicy = Path::RealPathUncached;
+
+enum {
+    DefaultRealPathCacheTtl = 5000,
+    MaxRealPathCacheEntries = 64 * 1024
+};
+
+namespace {
+// the real paths of directories, with a trailing '/', by the absolute
+// paths they were asked for as
+struct RealPathCache
+{
+    RealPathCache()
+        : ttl(DefaultRealPathCacheTtl)
+    {}
+
+    struct Entry
+    {
+        Path realPath;
+        uint64_t expires;
+    };
+    SharedMutex mutex;
+    Hash<Path, Entry> entries;
+    std::atomic<int> ttl;
+};
+}
+
+static RealPathCache &realPathCache()
+{
+    // not on the heap, SharedMutex is over aligned
+    static RealPathCache cache;
+    return cache;
+}
+
+void Path::setRealPathPolicy(RealPathPolicy policy)
+{
+    sRealPathPolicy = policy;
+    if (policy != RealPathCached)
+        invalidateRealPathCache();
+}
+
+int Path::realPathCacheTtl()
+{
+    return realPathCache().ttl;
+}
+
+void Path::setRealPathCacheTtl(int ms)
+{
+    realPathCache().ttl = ms;
+}
+
+void Path::invalidateRealPathCache()
+{
+    RealPathCache &cache = realPathCache();
+    cache.mutex.lockForWrite();
+    cache.entries.clear();
+    cache.mutex.unlockWrite();
+}
+
+// whether path or one of its parent directories is in paths
+static bool underAny(const Path &path, const Set<Path> &paths)
+{
+    for (size_t slash = path.indexOf('/', 1); ; slash = path.indexOf('/', slash + 1)) {
+        const size_t len = slash == String::npos ? path.size() : slash;
+        // the set has them with and without a trailing slash
+        if (paths.contains(Path(path.constData(), len)) || (slash != String::npos && paths.contains(Path(path.constData(), len + 1))))
+            return true;
+        if (slash == String::npos || slash + 1 == path.size())
+            return false;
+    }
+}
+
+void Path::invalidateRealPathCache(const Set<Path> &paths)
+{
+    if (paths.isEmpty())
+        return;
+    RealPathCache &cache = realPathCache();
+    cache.mutex.lockForWrite();
+    for (auto it = cache.entries.begin(); it != cache.entries.end(); ) {
+        if (underAny(it->first, paths) || underAny(it->second.realPath, paths)) {
+            it = cache.entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    cache.mutex.unlockWrite();
+}
+
+// The real path of dir, an absolute path that ends with '/', from the
+// cache or realpath(). Empty if it doesn't exist.
+static Path realDirectory(const Path &dir)
+{
+    RealPathCache &cache = realPathCache();
+    const uint64_t now = Rct::monoMs();
+    {
+        SharedMutex::ReadLocker lock(&cache.mutex);
+        auto it = cache.entries.find(dir);
+        if (it != cache.entries.end() && (!it->second.expires || it->second.expires > now))
+            return it->second.realPath;
+    }
+
+    char buffer[PATH_MAX + 2];
+    if (!realpath(dir.constData(), buffer))
+        return Path();
+    Path ret = buffer;
+    if (!ret.endsWith('/'))
+        ret.append('/');
+    const int ttl = cache.ttl;
+    cache.mutex.lockForWrite();
+    if (cache.entries.size() >= MaxRealPathCacheEntries)
+        cache.entries.clear();
+    RealPathCache::Entry &entry = cache.entries[dir];
+    entry.realPath = ret;
+    entry.expires = ttl > 0 ? now + ttl : 0;
+    cache.mutex.unlockWrite();
+    return ret;
+}
+
+// realpath() of path through the cache of its directory, one lstat() for
+// the name. Only names that are links, "." or ".." take a realpath().
+static bool cachedRealPath(const Path &path, Path &ret)
+{
+    Path absolute = path.isAbsolute() ? path : Path::pwd().ensureTrailingSlash() + path;
+    const bool trailingSlash = absolute.endsWith('/');
+    size_t end = absolute.size();
+    while (end > 1 && absolute.at(end - 1) == '/')
+        --end;
+    const size_t slash = absolute.lastIndexOf('/', end - 1);
+    const size_t nameLength = end - slash - 1;
+    const char *name = absolute.constData() + slash + 1;
+    if (!nameLength || (name[0] == '.' && (nameLength == 1 || (nameLength == 2 && name[1] == '.')))) {
+        // the whole thing is the directory
+        ret = realDirectory(absolute.ensureTrailingSlash());
+        return !ret.isEmpty();
+    }
+
+    ret = realDirectory(Path(absolute.constData(), slash + 1));
+    if (ret.isEmpty())
+        return false;
+    ret.append(name, nameLength);
+    struct stat st;
+    if (lstat(ret.constData(), &st))
+        return false;
+    if (S_ISLNK(st.st_mode)) {
+        char buffer[PATH_MAX + 2];
+        if (!realpath(ret.constData(), buffer))
+            return false;
+        ret = buffer;
+        if (::stat(buffer, &st))
+            return false;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        if (!ret.endsWith('/'))
+            ret.append('/');
+    } else if (trailingSlash) {
+        return false;
+    }
+    return true;
+}
 // this doesn't check if *this actually is a real file
 Path Path::parentDir() const
 {
@@ -34,24 +201,28 @@ Path Path::parentDir() const
     return copy;
 }
 
+static Path::Type modeType(mode_t mode)
+{
+    switch (mode & S_IFMT) {
+    case S_IFBLK: return Path::BlockDevice;
+    case S_IFCHR: return Path::CharacterDevice;
+    case S_IFDIR: return Path::Directory;
+    case S_IFIFO: return Path::NamedPipe;
+    case S_IFREG: return Path::File;
+    case S_IFSOCK: return Path::Socket;
+    default:
+        break;
+    }
+    return Path::Invalid;
+}
+
 Path::Type Path::type() const
 {
     bool ok;
     struct stat st = stat(&ok);
     if (!ok)
         return Invalid;
-
-    switch (st.st_mode & S_IFMT) {
-    case S_IFBLK: return BlockDevice;
-    case S_IFCHR: return CharacterDevice;
-    case S_IFDIR: return Directory;
-    case S_IFIFO: return NamedPipe;
-    case S_IFREG: return File;
-    case S_IFSOCK: return Socket;
-    default:
-        break;
-    }
-    return Invalid;
+    return modeType(st.st_mode);
 }
 
 bool Path::isSymLink() const
@@ -191,7 +362,7 @@ bool Path::resolve(ResolveMode mode, const Path &cwd, bool *changed)
     }
     if (*this == ".")
         clear();
-    if (mode == MakeAbsolute || !sRealPathEnabled) {
+    if (mode == MakeAbsolute || sRealPathPolicy == RealPathDisabled) {
         if (isAbsolute())
             return true;
         Path copy = (cwd.isEmpty() ? Path::pwd() : cwd.ensureTrailingSlash()) + *this;
@@ -214,6 +385,16 @@ bool Path::resolve(ResolveMode mode, const Path &cwd, bool *changed)
         }
     }
 
+    if (sRealPathPolicy == RealPathCached) {
+        Path real;
+        if (!cachedRealPath(*this, real))
+            return false;
+        if (changed && real != *this)
+            *changed = true;
+        operator=(real);
+        return true;
+    }
+
     {
         char buffer[PATH_MAX + 2];
         if (realpath(constData(), buffer)) {
@@ -420,69 +601,347 @@ bool Path::rmdir(const Path &dir)
     return ::rmdir(dir.constData()) == 0;
 }
 
-static void visitorWrapper(Path path, const std::function<Path::VisitResult(const Path &path)> &callback, Set<Path> &seen)
+// The type of the entry name of the directory open as dirFd, from the
+// listing's d_type when it has one. Links are followed like type() does,
+// which takes a stat, and so do file systems that leave d_type unknown.
+static Path::Type entryType(int dirFd, const char *name, unsigned char type)
 {
-    if (!seen.insert(path.resolved())) {
-        return;
+    switch (type) {
+    case DT_REG: return Path::File;
+    case DT_DIR: return Path::Directory;
+    case DT_CHR: return Path::CharacterDevice;
+    case DT_BLK: return Path::BlockDevice;
+    case DT_FIFO: return Path::NamedPipe;
+    case DT_SOCK: return Path::Socket;
+    default:
+        break;
     }
-    DIR *d = opendir(path.constData());
-    if (!d)
-        return;
+    struct stat st;
+    if (fstatat(dirFd, name, &st, 0))
+        return Path::Invalid;
+    return modeType(st.st_mode);
+}
 
-    union {
-        char buf[PATH_MAX + sizeof(dirent) + 1];
-        dirent dbuf;
+// Calls entry with the name and d_type of everything in the directory open
+// as fd but "." and "..", until it returns false. Straight getdents64()
+// on Linux, a buffer full of entries per call.
+static void readDirectory(int fd, const std::function<bool(const char *name, unsigned char type)> &entry)
+{
+#ifdef OS_Linux
+    struct LinuxDirent64
+    {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[256];
     };
-
-    dirent *p;
-    if (!path.endsWith('/'))
-        path.append('/');
-    const size_t s = path.size();
-    path.reserve(s + 128);
-    List<String> recurseDirs;
-    while (!readdir_r(d, &dbuf, &p) && p) {
-        if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
-            continue;
-        bool isDir = false;
-        path.truncate(s);
-        path.append(p->d_name);
-#if defined(_DIRENT_HAVE_D_TYPE) && defined(_BSD_SOURCE)
-        if (p->d_type == DT_DIR) {
-            isDir = true;
-            path.append('/');
+    enum { BufferSize = 32 * 1024 };
+    std::unique_ptr<uint64_t[]> buffer(new uint64_t[BufferSize / sizeof(uint64_t)]);
+    char *buf = reinterpret_cast<char *>(buffer.get());
+    while (true) {
+        const long read = syscall(SYS_getdents64, fd, buf, BufferSize);
+        if (read <= 0)
+            return;
+        for (long pos = 0; pos < read; ) {
+            const LinuxDirent64 *dirent = reinterpret_cast<const LinuxDirent64 *>(buf + pos);
+            pos += dirent->d_reclen;
+            const char *name = dirent->d_name;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+                continue;
+            if (!entry(name, dirent->d_type))
+                return;
         }
+    }
 #else
-        isDir = path.isDir();
-        if (isDir)
-            path.append('/');
-#endif
-        switch (callback(path)) {
-        case Path::Abort:
-            p = 0;
-            break;
-        case Path::Recurse:
-            if (isDir)
-                recurseDirs.append(p->d_name);
+    const int copy = dup(fd);
+    DIR *d = copy == -1 ? 0 : fdopendir(copy);
+    if (!d) {
+        if (copy != -1)
+            ::close(copy);
+        return;
+    }
+    while (const dirent *p = readdir(d)) {
+        if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
+            continue;
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (!entry(p->d_name, p->d_type))
             break;
-        case Path::Continue:
+#else
+        if (!entry(p->d_name, DT_UNKNOWN))
             break;
-        }
+#endif
     }
     closedir(d);
-    const size_t count = recurseDirs.size();
-    for (size_t i=0; i<count; ++i) {
-        path.truncate(s);
-        path.append(recurseDirs.at(i));
-        visitorWrapper(path, callback, seen);
+#endif
+}
+
+// Hands the entries of the directory open as fd to callback, path is the
+// directory's ending with a '/' and gets each name appended in turn.
+// entry is told about each one, and whether callback wants it recursed
+// into. false if callback aborted.
+typedef std::function<void(const char *name, Path::Type type, bool recurse)> EntryHandler;
+static bool visitEntries(int fd, Path &path, const Path::TypedVisitor &callback, const EntryHandler &entry)
+{
+    const size_t size = path.size();
+    bool aborted = false;
+    readDirectory(fd, [&](const char *name, unsigned char dtype) {
+            const Path::Type type = entryType(fd, name, dtype);
+            path.truncate(size);
+            path.append(name);
+            if (type == Path::Directory)
+                path.append('/');
+            const Path::VisitResult result = callback(path, type);
+            if (result == Path::Abort) {
+                aborted = true;
+                return false;
+            }
+            entry(name, type, result == Path::Recurse && type == Path::Directory);
+            return true;
+        });
+    path.truncate(size);
+    return !aborted;
+}
+
+typedef std::pair<dev_t, ino_t> DirectoryId;
+
+// takes fd, false if callback aborted
+static bool visitDirectory(int fd, Path &path, const Path::TypedVisitor &callback, Set<DirectoryId> &seen)
+{
+    // links can make loops
+    struct stat st;
+    if (fstat(fd, &st) || !seen.insert(DirectoryId(st.st_dev, st.st_ino))) {
+        ::close(fd);
+        return true;
+    }
+    List<String> recurse;
+    bool ok = visitEntries(fd, path, callback, [&recurse](const char *name, Path::Type, bool r) {
+            if (r)
+                recurse.append(name);
+        });
+    const size_t size = path.size();
+    for (size_t i = 0; ok && i < recurse.size(); ++i) {
+        const int child = openat(fd, recurse.at(i).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (child == -1)
+            continue;
+        path.truncate(size);
+        path.append(recurse.at(i));
+        path.append('/');
+        ok = visitDirectory(child, path, callback, seen);
     }
+    path.truncate(size);
+    ::close(fd);
+    return ok;
 }
 
 void Path::visit(const std::function<VisitResult(const Path &path)> &callback) const
 {
-    if (!callback || !isDir())
+    if (!callback)
         return;
-    Set<Path> seenDirs;
-    visitorWrapper(*this, callback, seenDirs);
+    visit([&callback](const Path &path, Type) { return callback(path); });
+}
+
+void Path::visit(const TypedVisitor &callback) const
+{
+    if (!callback)
+        return;
+    const int fd = ::open(constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    Path path = *this;
+    if (!path.endsWith('/'))
+        path.append('/');
+    path.reserve(path.size() + 128);
+    Set<DirectoryId> seen;
+    visitDirectory(fd, path, callback, seen);
+}
+
+namespace {
+// The listing of a directory, for putting the paths in order after the
+// directories were listed in parallel. Each directory is listed once,
+// under whichever path a thread got to first, and the entries that lead
+// to it point to that listing.
+struct VisitNode
+{
+    struct Entry
+    {
+        String name;
+        Path::Type type;
+        bool recurse;
+        VisitNode *directory;
+    };
+    List<Entry> entries;
+
+    // the paths that files() would have found, the same directories are
+    // skipped as they're reached the same way
+    void flatten(Path &path, unsigned int filter, Set<const VisitNode *> &seen, List<Path> &out) const
+    {
+        if (!seen.insert(this))
+            return;
+        const size_t size = path.size();
+        for (const Entry &entry : entries) {
+            if (entry.type & filter) {
+                path.truncate(size);
+                path.append(entry.name);
+                if (entry.type == Path::Directory)
+                    path.append('/');
+                out.append(path);
+            }
+        }
+        for (const Entry &entry : entries) {
+            if (entry.directory) {
+                path.truncate(size);
+                path.append(entry.name);
+                path.append('/');
+                entry.directory->flatten(path, filter, seen, out);
+            }
+        }
+        path.truncate(size);
+    }
+};
+
+// A queue of directories that the calling thread and pool's threads take
+// from, each listed directory queues the ones it recurses into. help()
+// returns when there's nothing left in the queue or being listed.
+struct ParallelVisit
+{
+    struct Directory
+    {
+        Path path;
+        // where the listing goes, when the paths are put in order
+        VisitNode::Entry *entry;
+    };
+
+    ParallelVisit(const Path::TypedVisitor &c, unsigned int f)
+        : callback(c), filter(f), active(0), aborted(false)
+    {}
+
+    void help()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cond.wait(lock, [this]() { return !queue.empty() || !active; });
+            if (queue.empty())
+                return;
+            Directory dir = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+
+            List<Directory> children;
+            const bool ok = list(dir, children);
+
+            lock.lock();
+            if (!ok && !aborted) {
+                aborted = true;
+                active -= queue.size();
+                queue.clear();
+            }
+            if (!aborted) {
+                for (Directory &child : children)
+                    queue.push_back(std::move(child));
+                active += children.size();
+            }
+            if (!--active || !children.isEmpty())
+                cond.notify_all();
+        }
+    }
+
+    bool list(Directory &dir, List<Directory> &children)
+    {
+        const int fd = ::open(dir.path.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            return true;
+        VisitNode *node = 0;
+        struct stat st;
+        if (!fstat(fd, &st)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::unique_ptr<VisitNode> &n = nodes[DirectoryId(st.st_dev, st.st_ino)];
+            if (dir.entry)
+                dir.entry->directory = n.get();
+            if (!n) {
+                n.reset(new VisitNode);
+                node = n.get();
+                if (dir.entry)
+                    dir.entry->directory = node;
+            }
+        }
+        // links can make loops, and lead to a directory more than once
+        if (!node) {
+            ::close(fd);
+            return true;
+        }
+        const bool ordered = dir.entry;
+        List<String> recurse;
+        const bool ok = visitEntries(fd, dir.path, callback, [&](const char *name, Path::Type type, bool r) {
+                if (ordered) {
+                    if (r || (type & filter)) {
+                        const VisitNode::Entry entry = { name, type, r, 0 };
+                        node->entries.append(entry);
+                    }
+                } else if (r) {
+                    recurse.append(name);
+                }
+            });
+        ::close(fd);
+        if (!ok)
+            return false;
+
+        // the entries don't move from here
+        const auto add = [&dir, &children](const String &name, VisitNode::Entry *entry) {
+            Directory child;
+            child.path.reserve(dir.path.size() + name.size() + 1);
+            child.path.append(dir.path);
+            child.path.append(name);
+            child.path.append('/');
+            child.entry = entry;
+            children.append(std::move(child));
+        };
+        if (ordered) {
+            for (VisitNode::Entry &entry : node->entries) {
+                if (entry.recurse)
+                    add(entry.name, &entry);
+            }
+        } else {
+            for (const String &name : recurse)
+                add(name, 0);
+        }
+        return true;
+    }
+
+    const Path::TypedVisitor callback;
+    const unsigned int filter;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Directory> queue;
+    size_t active;
+    bool aborted;
+    std::map<DirectoryId, std::unique_ptr<VisitNode> > nodes;
+};
+}
+
+// rootEntry gets the listing of root when the paths are put in order,
+// the listings belong to visit
+static void visitParallel(const std::shared_ptr<ParallelVisit> &visit, ThreadPool *pool, const Path &root,
+                          VisitNode::Entry *rootEntry)
+{
+    if (!pool)
+        pool = ThreadPool::instance();
+    ParallelVisit::Directory dir;
+    dir.path = root;
+    if (!dir.path.endsWith('/'))
+        dir.path.append('/');
+    dir.entry = rootEntry;
+    visit->queue.push_back(std::move(dir));
+    visit->active = 1;
+    for (int i = 1; i < pool->concurrentJobs(); ++i)
+        pool->submit([visit]() { visit->help(); });
+    visit->help();
+}
+
+void Path::visitParallel(const TypedVisitor &callback, ThreadPool *pool) const
+{
+    if (callback)
+        ::visitParallel(std::make_shared<ParallelVisit>(callback, 0), pool, *this, 0);
 }
 
 Path Path::followLink(bool *ok) const
@@ -505,36 +964,33 @@ Path Path::followLink(bool *ok) const
 
 size_t Path::readAll(char *&buf, size_t max) const
 {
-    FILE *f = fopen(constData(), "r");
     buf = 0;
-    if (!f)
+    String contents;
+    if (!readAll(contents, max))
         return -1;
-    fseek(f, 0, SEEK_END);
-    int size = ftell(f);
-    if (max > 0 && max < static_cast<size_t>(size))
-        size = max;
-    if (size) {
-        fseek(f, 0, SEEK_SET);
-        buf = new char[size + 1];
-        const int ret = fread(buf, sizeof(char), size, f);
-        if (ret != size) {
-            size = -1;
-            delete[] buf;
-        } else {
-            buf[size] = '\0';
-        }
+    if (!contents.isEmpty()) {
+        buf = new char[contents.size() + 1];
+        memcpy(buf, contents.constData(), contents.size() + 1);
     }
-    fclose(f);
-    return size;
+    return contents.size();
 }
 
 String Path::readAll(size_t max) const
 {
-    FILE *f = fopen(constData(), "r");
-    if (!f)
-        return String();
-    const String ret = Rct::readAll(f, max);
-    fclose(f);
+    String ret;
+    readAll(ret, max);
+    return ret;
+}
+
+bool Path::readAll(String &data, size_t max) const
+{
+    const int fd = ::open(constData(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        data.clear();
+        return false;
+    }
+    const bool ret = Rct::readAll(fd, data, max);
+    ::close(fd);
     return ret;
 }
 
@@ -586,10 +1042,10 @@ List<Path> Path::files(unsigned int filter, size_t max, bool recurse) const
     assert(max != 0);
 
     List<Path> paths;
-    visit([filter, &max, recurse, &paths](const Path &path) {
+    visit([filter, &max, recurse, &paths](const Path &path, Type type) {
             if (max > 0)
                 --max;
-            if (path.type() & filter) {
+            if (type & filter) {
                 paths.append(path);
             }
             if (!max)
@@ -599,6 +1055,24 @@ List<Path> Path::files(unsigned int filter, size_t max, bool recurse) const
     return paths;
 }
 
+List<Path> Path::filesParallel(unsigned int filter, bool recurse, ThreadPool *pool) const
+{
+    std::shared_ptr<ParallelVisit> visit = std::make_shared<ParallelVisit>([recurse](const Path &, Type) {
+            return recurse ? Path::Recurse : Path::Continue;
+        }, filter);
+    VisitNode::Entry root = { String(), Directory, true, 0 };
+    ::visitParallel(visit, pool, *this, &root);
+    List<Path> paths;
+    if (root.directory) {
+        Path path = *this;
+        if (!path.endsWith('/'))
+            path.append('/');
+        Set<const VisitNode *> seen;
+        root.directory->flatten(path, filter, seen, paths);
+    }
+    return paths;
+}
+
 uint64_t Path::lastModifiedMs() const
 {
     bool ok;
@@ -13,6 +13,9 @@
 
 #include <rct/String.h>
 
+class ThreadPool;
+template <typename T> class Set;
+
 class Path : public String
 {
 public:
@@ -110,8 +113,36 @@ public:
         RealPath,
         MakeAbsolute
     };
-    static bool realPathEnabled() { return sRealPathEnabled; }
-    static void setRealPathEnabled(bool enabled) { sRealPathEnabled = enabled; }
+    // how resolve() with RealPath finds real paths
+    enum RealPathPolicy {
+        // like MakeAbsolute
+        RealPathDisabled,
+        // realpath() every time
+        RealPathUncached,
+        // The real paths of directories are cached, so a file in a known
+        // directory takes one lstat() rather than one per component.
+        // Entries live for realPathCacheTtl() ms, forever if it's 0, or
+        // until invalidateRealPathCache() drops them. FileSystemWatcher
+        // does that with the paths it sees removed or modified.
+        RealPathCached
+    };
+    static RealPathPolicy realPathPolicy() { return sRealPathPolicy; }
+    static void setRealPathPolicy(RealPathPolicy policy);
+    static bool realPathEnabled() { return sRealPathPolicy != RealPathDisabled; }
+    static void setRealPathEnabled(bool enabled)
+    {
+        if (!enabled) {
+            setRealPathPolicy(RealPathDisabled);
+        } else if (sRealPathPolicy == RealPathDisabled) {
+            setRealPathPolicy(RealPathUncached);
+        }
+    }
+    static int realPathCacheTtl();
+    static void setRealPathCacheTtl(int ms);
+    // drops what's cached for paths and everything under them, or for
+    // everything without paths
+    static void invalidateRealPathCache(const Set<Path> &paths);
+    static void invalidateRealPathCache();
     Path resolved(ResolveMode mode = RealPath, const Path &cwd = Path(), bool *ok = 0) const;
     bool resolve(ResolveMode mode = RealPath, const Path &cwd = Path(), bool *changed = 0);
     size_t canonicalize();
@@ -141,6 +172,9 @@ public:
     static Path pwd();
     size_t readAll(char *&, size_t max = -1) const;
     String readAll(size_t max = -1) const;
+    // one open() and fstat(), and read() straight into data. See MappedFile
+    // for not copying the contents at all.
+    bool readAll(String &data, size_t max = -1) const;
 
     bool touch() const
     {
@@ -165,10 +199,24 @@ public:
         Continue,
         Recurse
     };
+    // Directories come with a trailing '/'. Abort stops the whole visit,
+    // links to directories are followed and each directory is visited once.
     void visit(const std::function<VisitResult(const Path &path)> &callback) const;
+    // with the type of each entry, from the directory listing when the file
+    // system has it there so no entry needs a stat()
+    typedef std::function<VisitResult(const Path &path, Type type)> TypedVisitor;
+    void visit(const TypedVisitor &callback) const;
+    // Lists the directories on pool's threads, ThreadPool::instance() if
+    // it's 0, and the calling one. callback is called from all of them at
+    // once, with the entries of a directory in order, and visitParallel()
+    // returns when it's done.
+    void visitParallel(const TypedVisitor &callback, ThreadPool *pool = 0) const;
     List<Path> files(unsigned int filter = All, size_t max = String::npos, bool recurse = false) const;
+    // files() listed in parallel, in the same order
+    List<Path> filesParallel(unsigned int filter = All, bool recurse = true, ThreadPool *pool = 0) const;
 
-    static bool sRealPathEnabled;
+private:
+    static RealPathPolicy sRealPathPolicy;
 };
 
 namespace std
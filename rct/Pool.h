@@ -0,0 +1,105 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Fixed size allocation of T. Freed objects go on a free list that the
+// next create() takes from, new memory is allocated BlockCount objects
+// at a time, so objects that come and go a lot cost neither malloc nor
+// free. Memory only goes back to the system when the pool is destroyed,
+// which has to be after every object was destroyed. Not thread safe.
+//
+//     Pool<Node> nodes;
+//     Node *node = nodes.create(key);
+//     ...
+//     nodes.destroy(node);
+template <typename T, size_t BlockCount = 64>
+class Pool
+{
+public:
+    Pool()
+        : mFree(0), mBlocks(0), mNext(0), mEnd(0), mCount(0)
+    {}
+    ~Pool()
+    {
+        assert(!mCount);
+        while (Block *block = mBlocks) {
+            mBlocks = block->next;
+            delete block;
+        }
+    }
+
+    template <typename... Args>
+    T *create(Args &&...args)
+    {
+        void *memory = allocate();
+        T *t = new (memory) T(std::forward<Args>(args)...);
+        return t;
+    }
+
+    void destroy(T *t)
+    {
+        if (!t)
+            return;
+        t->~T();
+        deallocate(t);
+    }
+
+    // memory for one T, without constructing it
+    void *allocate()
+    {
+        Slot *slot = mFree;
+        if (slot) {
+            mFree = slot->next;
+        } else {
+            if (mNext == mEnd) {
+                Block *block = new Block;
+                block->next = mBlocks;
+                mBlocks = block;
+                mNext = block->slots;
+                mEnd = block->slots + BlockCount;
+            }
+            slot = mNext++;
+        }
+        ++mCount;
+        return slot;
+    }
+
+    void deallocate(void *memory)
+    {
+        assert(mCount);
+        Slot *slot = static_cast<Slot *>(memory);
+        slot->next = mFree;
+        mFree = slot;
+        --mCount;
+    }
+
+    // objects that are alive
+    size_t count() const { return mCount; }
+
+private:
+    union Slot
+    {
+        Slot *next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+    struct Block
+    {
+        Block *next;
+        Slot slots[BlockCount];
+    };
+
+    Slot *mFree;
+    Block *mBlocks;
+    Slot *mNext, *mEnd;
+    size_t mCount;
+
+    Pool(const Pool &) = delete;
+    Pool &operator=(const Pool &) = delete;
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -11,15 +12,24 @@
 #endif
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "EventLoop.h"
 #include "Log.h"
 #include "rct/rct-config.h"
 #include "Rct.h"
+#include "SmallList.h"
 #include "SocketClient.h"
 #include "StopWatch.h"
 #include "Thread.h"
 
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
+#ifdef HAVE_PIDFD_OPEN
+#include <sys/syscall.h>
+#endif
+
 
 static std::once_flag sProcessHandler;
 
@@ -27,7 +37,12 @@ class ProcessThread : public Thread
 {
 public:
     static void installProcessHandler();
-    static void addPid(pid_t pid, Process* process, bool async);
+    // returns a pidfd for a synchronous process when there's pidfd_open
+    static int addPid(pid_t pid, Process* process, bool async);
+    // reaps pid if it has exited and the thread hasn't yet
+    static void reap(pid_t pid);
+    // the process won't wait for pid anymore, it's reaped quietly
+    static void abandon(pid_t pid);
     static void shutdown();
     static void setPending(int pending);
 
@@ -43,6 +58,7 @@ private:
     static void wakeup(Signal sig);
 
     static void processSignalHandler(int sig);
+    static int exitCode(int status);
 private:
     static ProcessThread* sProcessThread;
     static int sProcessPipe[2];
@@ -50,6 +66,7 @@ private:
     static std::mutex sProcessMutex;
     static int sPending;
     static std::unordered_map<pid_t, int> sPendingPids;
+    static std::unordered_set<pid_t> sAbandonedPids;
 
     struct ProcessData
     {
@@ -64,6 +81,7 @@ int ProcessThread::sProcessPipe[2];
 std::mutex ProcessThread::sProcessMutex;
 int ProcessThread::sPending = 0;
 std::unordered_map<pid_t, int> ProcessThread::sPendingPids;
+std::unordered_set<pid_t> ProcessThread::sAbandonedPids;
 std::map<pid_t, ProcessThread::ProcessData> ProcessThread::sProcesses;
 
 class ProcessThreadKiller
@@ -93,7 +111,12 @@ void ProcessThread::setPending(int pending)
         sPendingPids.clear();
 }
 
-void ProcessThread::addPid(pid_t pid, Process* process, bool async)
+int ProcessThread::exitCode(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : static_cast<int>(Process::ReturnCrashed);
+}
+
+int ProcessThread::addPid(pid_t pid, Process* process, bool async)
 {
     std::lock_guard<std::mutex> lock(sProcessMutex);
     sPending -= 1;
@@ -112,7 +135,7 @@ void ProcessThread::addPid(pid_t pid, Process* process, bool async)
             sPendingPids.erase(it);
             if (!sPending)
                 sPendingPids.clear();
-            return;
+            return -1;
         }
     }
 
@@ -120,6 +143,38 @@ void ProcessThread::addPid(pid_t pid, Process* process, bool async)
 
     if (!sPending)
         sPendingPids.clear();
+
+    int pidfd = -1;
+#ifdef HAVE_PIDFD_OPEN
+    // pid can't have been reaped, and reused, while we hold the lock
+    if (!async)
+        pidfd = static_cast<int>(::syscall(SYS_pidfd_open, pid, 0));
+#endif
+    return pidfd;
+}
+
+void ProcessThread::reap(pid_t pid)
+{
+    std::unique_lock<std::mutex> lock(sProcessMutex);
+    auto proc = sProcesses.find(pid);
+    if (proc == sProcesses.end())
+        return;
+    int status;
+    pid_t p;
+    eintrwrap(p, ::waitpid(pid, &status, WNOHANG));
+    if (p != pid)
+        return;
+    Process *process = proc->second.proc;
+    sProcesses.erase(proc);
+    lock.unlock();
+    process->finish(exitCode(status));
+}
+
+void ProcessThread::abandon(pid_t pid)
+{
+    std::lock_guard<std::mutex> lock(sProcessMutex);
+    if (sProcesses.erase(pid))
+        sAbandonedPids.insert(pid);
 }
 
 void ProcessThread::run()
@@ -153,11 +208,7 @@ void ProcessThread::run()
                         break;
                     default:
                         //printf("successfully waited for pid (got %d)\n", p);
-                        if (WIFEXITED(ret)) {
-                            ret = WEXITSTATUS(ret);
-                        } else {
-                            ret = Process::ReturnCrashed;
-                        }
+                        ret = exitCode(ret);
                         auto proc = sProcesses.find(p);
                         if (proc != sProcesses.end()) {
                             Process *process = proc->second.proc;
@@ -170,7 +221,7 @@ void ProcessThread::run()
                                 process->finish(ret);
                             }
                             lock.lock();
-                        } else {
+                        } else if (!sAbandonedPids.erase(p)) {
                             if (sPending) {
                                 assert(sPendingPids.find(p) == sPendingPids.end());
                                 sPendingPids[p] = ret;
@@ -219,12 +270,14 @@ void ProcessThread::installProcessHandler()
 {
     assert(sProcessThread == 0);
     sProcessThread = new ProcessThread;
+    sProcessThread->setName("ProcessThread");
     sProcessThread->start();
 }
 
 Process::Process()
-    : mPid(-1), mReturn(ReturnUnset), mStdInIndex(0), mStdOutIndex(0), mStdErrIndex(0),
-      mWantStdInClosed(false), mMode(Sync)
+    : mStdOutFd(-1), mStdErrFd(-1), mPid(-1), mReturn(ReturnUnset), mStdInIndex(0), mStdOutIndex(0), mStdErrIndex(0),
+      mWantStdInClosed(false), mOutputMode(CollectOutput), mMaxOutput(0), mOutputPaused(false), mWatched(0), mEnded(0),
+      mMode(Sync)
 {
     std::call_once(sProcessHandler, ProcessThread::installProcessHandler);
 
@@ -255,6 +308,10 @@ Process::~Process()
         eintrwrap(w, ::close(mSync[0]));
     if (mSync[1] != -1)
         eintrwrap(w, ::close(mSync[1]));
+    if (mStdOutFd != -1)
+        eintrwrap(w, ::close(mStdOutFd));
+    if (mStdErrFd != -1)
+        eintrwrap(w, ::close(mStdErrFd));
 }
 
 void Process::clear()
@@ -280,6 +337,8 @@ void Process::clear()
     mReturn = ReturnUnset;
     mStdInIndex = mStdOutIndex = mStdErrIndex = 0;
     mWantStdInClosed = false;
+    mOutputPaused = false;
+    mWatched = mEnded = 0;
     mMode = Sync;
 }
 
@@ -308,94 +367,119 @@ Path Process::findCommand(const String &command, const char *path)
     return Path();
 }
 
-Process::ExecState Process::startInternal(const Path &command, const List<String> &a, const List<String> &environment,
-                                          int timeout, unsigned int execFlags)
+static char *const *currentEnviron()
 {
-    mErrorString.clear();
+#ifdef OS_Darwin
+    return *_NSGetEnviron();
+#else
+    extern char** environ;
+    return environ;
+#endif
+}
 
-    const char *path = 0;
-    for (const auto &it : environment) {
-        if (it.startsWith("PATH=")) {
-            path = it.constData() + 5;
-            break;
-        }
-    }
-    Path cmd = findCommand(command, path);
-    if (cmd.isEmpty()) {
-        mErrorString = "Command not found";
-        return Error;
-    }
-    List<String> arguments = a;
+// both ends are closed on exec, the child's are dup2()'d to 0, 1 and 2
+static bool createPipe(int fds[2])
+{
     int err;
-
-    int closePipe[2];
-    eintrwrap(err, ::pipe(closePipe));
+#ifdef HAVE_PIPE2
+    eintrwrap(err, ::pipe2(fds, O_CLOEXEC));
+    return !err;
+#else
+    eintrwrap(err, ::pipe(fds));
+    if (err)
+        return false;
 #ifdef HAVE_CLOEXEC
-    if (!SocketClient::setFlags(closePipe[1], FD_CLOEXEC, F_GETFD, F_SETFD)) {
-        mErrorString = "Unable to set FD_CLOEXEC";
-        eintrwrap(err, ::close(closePipe[0]));
-        eintrwrap(err, ::close(closePipe[1]));
-        return Error;
+    for (int i = 0; i < 2; ++i) {
+        if (!SocketClient::setFlags(fds[i], FD_CLOEXEC, F_GETFD, F_SETFD)) {
+            eintrwrap(err, ::close(fds[0]));
+            eintrwrap(err, ::close(fds[1]));
+            fds[0] = fds[1] = -1;
+            return false;
+        }
     }
 #else
 #warning No CLOEXEC, Process might have problematic behavior
 #endif
+    return true;
+#endif
+}
 
-    eintrwrap(err, ::pipe(mStdIn));
-    eintrwrap(err, ::pipe(mStdOut));
-    eintrwrap(err, ::pipe(mStdErr));
-    if (mMode == Sync)
-        eintrwrap(err, ::pipe(mSync));
-
-    const char **args = new const char*[arguments.size() + 2];
-    // const char* args[arguments.size() + 2];
-    args[arguments.size() + 1] = 0;
-    args[0] = cmd.nullTerminated();
-    int pos = 1;
-    for (List<String>::const_iterator it = arguments.begin(); it != arguments.end(); ++it) {
-        args[pos] = it->nullTerminated();
-        //printf("arg: '%s'\n", args[pos]);
-        ++pos;
-    }
-
-    const bool hasEnviron = !environment.empty();
-
-    const char **env = new const char*[environment.size() + 1];
-    env[environment.size()] = 0;
+// The child's end is a dup of target when there's one, then we don't
+// get a read end.
+static bool createOutput(int fds[2], int target)
+{
+    if (target == -1)
+        return createPipe(fds);
+    fds[0] = -1;
+    eintrwrap(fds[1], ::fcntl(target, F_DUPFD_CLOEXEC, STDERR_FILENO + 1));
+    return fds[1] != -1;
+}
 
-    if (hasEnviron) {
-        pos = 0;
-        //printf("fork, about to exec '%s'\n", cmd.nullTerminated());
-        for (List<String>::const_iterator it = environment.begin(); it != environment.end(); ++it) {
-            env[pos] = it->nullTerminated();
-            //printf("env: '%s'\n", env[pos]);
-            ++pos;
+static void closePipe(int fds[2])
+{
+    int err;
+    for (int i = 0; i < 2; ++i) {
+        if (fds[i] != -1) {
+            eintrwrap(err, ::close(fds[i]));
+            fds[i] = -1;
         }
     }
+}
 
-    ProcessThread::setPending(1);
+bool Process::spawn(const Path &command, const char *const *args, const char *const *env)
+{
+#ifdef HAVE_POSIX_SPAWN
+    posix_spawn_file_actions_t actions;
+    int ret = posix_spawn_file_actions_init(&actions);
+    if (ret) {
+        mErrorString = "Process failed to start: " + Rct::strerror(ret);
+        return false;
+    }
+    ret = posix_spawn_file_actions_adddup2(&actions, mStdIn[0], STDIN_FILENO);
+    if (!ret)
+        ret = posix_spawn_file_actions_adddup2(&actions, mStdOut[1], STDOUT_FILENO);
+    if (!ret)
+        ret = posix_spawn_file_actions_adddup2(&actions, mStdErr[1], STDERR_FILENO);
+#ifdef HAVE_POSIX_SPAWN_ADDCHDIR
+    if (!ret && !mCwd.isEmpty())
+        ret = posix_spawn_file_actions_addchdir_np(&actions, mCwd.constData());
+#endif
+    // reports a failed exec too
+    if (!ret)
+        ret = ::posix_spawn(&mPid, command.constData(), &actions, 0, const_cast<char *const *>(args),
+                            const_cast<char *const *>(env));
+    posix_spawn_file_actions_destroy(&actions);
+    if (ret) {
+        mErrorString = "Process failed to start: " + Rct::strerror(ret);
+        return false;
+    }
+    return true;
+#else
+    (void)command;
+    (void)args;
+    (void)env;
+    mErrorString = "posix_spawn isn't available";
+    return false;
+#endif
+}
+
+bool Process::forkExec(const Path &command, const char *const *args, const char *const *env)
+{
+    int err;
+    // written to by the child when exec fails, closed by the exec otherwise
+    int closePipe[2];
+    if (!createPipe(closePipe)) {
+        mErrorString = "Unable to create pipes: " + Rct::strerror();
+        return false;
+    }
 
     mPid = ::fork();
     if (mPid == -1) {
-        //printf("fork, something horrible has happened %d\n", errno);
-        // bail out
-
-        ProcessThread::setPending(-1);
-
-        eintrwrap(err, ::close(mStdIn[1]));
-        eintrwrap(err, ::close(mStdIn[0]));
-        eintrwrap(err, ::close(mStdOut[1]));
-        eintrwrap(err, ::close(mStdOut[0]));
-        eintrwrap(err, ::close(mStdErr[1]));
-        eintrwrap(err, ::close(mStdErr[0]));
         eintrwrap(err, ::close(closePipe[1]));
         eintrwrap(err, ::close(closePipe[0]));
         mErrorString = "Fork failed";
-        delete[] env;
-        delete[] args;
-        return Error;
+        return false;
     } else if (mPid == 0) {
-        //printf("fork, in child\n");
         // child, should do some error checking here really
         eintrwrap(err, ::close(closePipe[0]));
         eintrwrap(err, ::close(mStdIn[1]));
@@ -413,17 +497,16 @@ Process::ExecState Process::startInternal(const Path &command, const List<String
         eintrwrap(err, ::dup2(mStdErr[1], STDERR_FILENO));
         eintrwrap(err, ::close(mStdErr[1]));
 
-        int ret;
         if (!mChRoot.isEmpty() && ::chroot(mChRoot.constData())) {
             goto error;
         }
         if (!mCwd.isEmpty() && ::chdir(mCwd.constData())) {
             goto error;
         }
-        if (hasEnviron) {
-            ret = ::execve(cmd.nullTerminated(), const_cast<char* const*>(args), const_cast<char* const*>(env));
+        if (env) {
+            ::execve(command.nullTerminated(), const_cast<char* const*>(args), const_cast<char* const*>(env));
         } else {
-            ret = ::execv(cmd.nullTerminated(), const_cast<char* const*>(args));
+            ::execv(command.nullTerminated(), const_cast<char* const*>(args));
         }
         // notify the parent process
   error:
@@ -431,138 +514,204 @@ Process::ExecState Process::startInternal(const Path &command, const List<String
         eintrwrap(err, ::write(closePipe[1], &c, 1));
         eintrwrap(err, ::close(closePipe[1]));
         ::_exit(1);
-        (void)ret;
-        //printf("fork, exec seemingly failed %d, %d %s\n", ret, errno, Rct::strerror().constData());
-    } else {
-        delete[] env;
-        delete[] args;
+    }
 
-        // parent
-        eintrwrap(err, ::close(closePipe[1]));
-        eintrwrap(err, ::close(mStdIn[0]));
-        eintrwrap(err, ::close(mStdOut[1]));
-        eintrwrap(err, ::close(mStdErr[1]));
+    // parent, blocks until exec is called in the child or until exec fails
+    eintrwrap(err, ::close(closePipe[1]));
+    char c;
+    eintrwrap(err, ::read(closePipe[0], &c, 1));
+    (void)c;
+    int ret;
+    eintrwrap(ret, ::close(closePipe[0]));
+    if (err == -1) {
+        mErrorString = "Failed to read from closePipe during process start";
+        return false;
+    } else if (err == 1) {
+        mErrorString = "Process failed to start";
+        return false;
+    }
+    // process has started successfully
+    return true;
+}
 
-        //printf("fork, in parent\n");
-
-        int flags;
-        eintrwrap(flags, fcntl(mStdIn[1], F_GETFL, 0));
-        eintrwrap(flags, fcntl(mStdIn[1], F_SETFL, flags | O_NONBLOCK));
-        eintrwrap(flags, fcntl(mStdOut[0], F_GETFL, 0));
-        eintrwrap(flags, fcntl(mStdOut[0], F_SETFL, flags | O_NONBLOCK));
-        eintrwrap(flags, fcntl(mStdErr[0], F_GETFL, 0));
-        eintrwrap(flags, fcntl(mStdErr[0], F_SETFL, flags | O_NONBLOCK));
-
-        // block until exec is called in the child or until exec fails
-        {
-            char c;
-            eintrwrap(err, ::read(closePipe[0], &c, 1));
-            (void)c;
-
-            if (err == -1) {
-                // bad
-                eintrwrap(err, ::close(closePipe[0]));
-                mErrorString = "Failed to read from closePipe during process start";
-                mPid = -1;
-                ProcessThread::setPending(-1);
-                return Error;
-            } else if (err == 0) {
-                // process has started successfully
-                eintrwrap(err, ::close(closePipe[0]));
-            } else if (err == 1) {
-                // process start failed
-                eintrwrap(err, ::close(closePipe[0]));
-                mErrorString = "Process failed to start";
-                mPid = -1;
-                ProcessThread::setPending(-1);
-                return Error;
-            }
+Process::ExecState Process::startInternal(const Path &command, const List<String> &arguments, const List<String> &environment,
+                                          int timeout, unsigned int execFlags)
+{
+    mErrorString.clear();
+
+    const char *path = 0;
+    for (const auto &it : environment) {
+        if (it.startsWith("PATH=")) {
+            path = it.constData() + 5;
+            break;
         }
+    }
+    Path cmd = findCommand(command, path);
+    if (cmd.isEmpty()) {
+        mErrorString = "Command not found";
+        return Error;
+    }
+    int err;
+    if (!createPipe(mStdIn) || !createOutput(mStdOut, mStdOutFd) || !createOutput(mStdErr, mStdErrFd)
+        || (mMode == Sync && !createPipe(mSync))) {
+        mErrorString = "Unable to create pipes: " + Rct::strerror();
+        closePipe(mStdIn);
+        closePipe(mStdOut);
+        closePipe(mStdErr);
+        closePipe(mSync);
+        return Error;
+    }
 
-        ProcessThread::addPid(mPid, this, (mMode == Async));
+    // built before starting the child, it can't allocate safely
+    SmallList<const char *, 32> args;
+    args.reserve(arguments.size() + 2);
+    args.append(cmd.nullTerminated());
+    for (const String &argument : arguments)
+        args.append(argument.nullTerminated());
+    args.append(nullptr);
 
-        //printf("fork, about to add fds: stdin=%d, stdout=%d, stderr=%d\n", mStdIn[1], mStdOut[0], mStdErr[0]);
-        if (mMode == Async) {
-            if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                loop->registerSocket(mStdOut[0], EventLoop::SocketRead, std::bind(&Process::processCallback, this, std::placeholders::_1, std::placeholders::_2));
-                loop->registerSocket(mStdErr[0], EventLoop::SocketRead, std::bind(&Process::processCallback, this, std::placeholders::_1, std::placeholders::_2));
+    const bool hasEnviron = !environment.empty();
+
+    SmallList<const char *, 32> env;
+    if (hasEnviron) {
+        env.reserve(environment.size() + 1);
+        for (const String &variable : environment)
+            env.append(variable.nullTerminated());
+    }
+    env.append(nullptr);
+
+    ProcessThread::setPending(1);
+
+    // posix_spawn() starts the child without copying our page tables like
+    // fork() does, which adds up for a large process that starts many. It
+    // can't chroot and needs the pipes out of the way of 0, 1 and 2, the
+    // child's ends are close on exec and only lose it when they're moved.
+    bool launched;
+#ifdef HAVE_POSIX_SPAWN
+#ifdef HAVE_POSIX_SPAWN_ADDCHDIR
+    const bool canChdir = true;
+#else
+    const bool canChdir = mCwd.isEmpty();
+#endif
+    if (mChRoot.isEmpty() && canChdir && mStdIn[0] > STDERR_FILENO
+        && mStdOut[1] > STDERR_FILENO && mStdErr[1] > STDERR_FILENO) {
+        launched = spawn(cmd, args.data(), hasEnviron ? env.data() : currentEnviron());
+    } else
+#endif
+    {
+        launched = forkExec(cmd, args.data(), hasEnviron ? env.data() : 0);
+    }
+    if (!launched) {
+        mPid = -1;
+        ProcessThread::setPending(-1);
+        closePipe(mStdIn);
+        closePipe(mStdOut);
+        closePipe(mStdErr);
+        closePipe(mSync);
+        return Error;
+    }
+
+    eintrwrap(err, ::close(mStdIn[0]));
+    eintrwrap(err, ::close(mStdOut[1]));
+    eintrwrap(err, ::close(mStdErr[1]));
+
+    int flags;
+    eintrwrap(flags, fcntl(mStdIn[1], F_GETFL, 0));
+    eintrwrap(flags, fcntl(mStdIn[1], F_SETFL, flags | O_NONBLOCK));
+    if (mStdOut[0] != -1)
+        SocketClient::setFlags(mStdOut[0], O_NONBLOCK, F_GETFL, F_SETFL);
+    if (mStdErr[0] != -1)
+        SocketClient::setFlags(mStdErr[0], O_NONBLOCK, F_GETFL, F_SETFL);
+
+    const int pidfd = ProcessThread::addPid(mPid, this, (mMode == Async));
+
+    //printf("fork, about to add fds: stdin=%d, stdout=%d, stderr=%d\n", mStdIn[1], mStdOut[0], mStdErr[0]);
+    if (mMode == Async) {
+        mWatched = mEnded = 0;
+        watchOutput();
+    } else {
+        if (!(execFlags & NoCloseStdIn)) {
+            closeStdIn(CloseForce);
+            mWantStdInClosed = false;
+        }
+        // poll() since the pipes may well be past FD_SETSIZE. mSync is
+        // written when the child has been reaped, a pidfd wakes us up as
+        // soon as it exits so we can reap it ourselves.
+        enum { StdOutFd, StdErrFd, SyncFd, PidFd, StdInFd, FdCount };
+        pollfd fds[FdCount];
+        fds[StdOutFd].fd = mStdOut[0];
+        fds[StdErrFd].fd = mStdErr[0];
+        fds[SyncFd].fd = mSync[0];
+        fds[PidFd].fd = pidfd;
+        for (pollfd &fd : fds)
+            fd.events = POLLIN;
+        fds[StdInFd].events = POLLOUT;
+        const uint64_t deadline = timeout > 0 ? Rct::monoMs() + timeout : 0;
+        for (;;) {
+            fds[StdInFd].fd = mStdIn[1];
+            int wait = -1;
+            if (deadline) {
+                const uint64_t now = Rct::monoMs();
+                if (now >= deadline) {
+                    // timeout, we're done
+                    kill(); // attempt to kill
+                    // whenever it dies it's none of our business
+                    ProcessThread::abandon(mPid);
+                    if (pidfd != -1)
+                        eintrwrap(err, ::close(pidfd));
+                    mErrorString = "Timed out";
+                    return TimedOut;
+                }
+                wait = static_cast<int>(deadline - now);
             }
-        } else {
-            // select and stuff
-            timeval started, now, *selecttime = 0;
-            if (timeout > 0) {
-                Rct::gettime(&started);
-                now = started;
-                selecttime = &now;
-                Rct::timevalAdd(selecttime, timeout);
+            int ret;
+            eintrwrap(ret, ::poll(fds, FdCount, wait));
+            if (ret == -1) { // ow
+                mErrorString = "Sync poll failed: ";
+                mErrorString += Rct::strerror();
+                if (pidfd != -1)
+                    eintrwrap(err, ::close(pidfd));
+                return Error;
             }
-            if (!(execFlags & NoCloseStdIn)) {
-                closeStdIn(CloseForce);
-                mWantStdInClosed = false;
+            // a pipe that's been closed by the child stays readable, it's
+            // drained once and not polled anymore
+            if (fds[StdOutFd].revents) {
+                handleOutput(mStdOut[0], StdOutStream);
+                if (fds[StdOutFd].revents & (POLLHUP|POLLERR|POLLNVAL))
+                    fds[StdOutFd].fd = -1;
             }
-            for (;;) {
-                // set up all the select crap
-                fd_set rfds, wfds;
-                FD_ZERO(&rfds);
-                FD_ZERO(&wfds);
-                int max = 0;
-                FD_SET(mStdOut[0], &rfds);
-                max = std::max(max, mStdOut[0]);
-                FD_SET(mStdErr[0], &rfds);
-                max = std::max(max, mStdErr[0]);
-                FD_SET(mSync[0], &rfds);
-                max = std::max(max, mSync[0]);
-                if (mStdIn[1] != -1) {
-                    FD_SET(mStdIn[1], &wfds);
-                    max = std::max(max, mStdIn[1]);
-                }
-                int ret;
-                eintrwrap(ret, ::select(max + 1, &rfds, &wfds, 0, selecttime));
-                if (ret == -1) { // ow
-                    mErrorString = "Sync select failed: ";
-                    mErrorString += Rct::strerror();
-                    return Error;
-                }
-                // check fds and stuff
-                if (FD_ISSET(mStdOut[0], &rfds))
-                    handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mReadyReadStdOut);
-                if (FD_ISSET(mStdErr[0], &rfds))
-                    handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mReadyReadStdErr);
-                if (mStdIn[1] != -1 && FD_ISSET(mStdIn[1], &wfds))
-                    handleInput(mStdIn[1]);
-                if (FD_ISSET(mSync[0], &rfds)) {
-                    // we're done
-                    {
-                        std::lock_guard<std::mutex> lock(mMutex);
-                        assert(mSync[1] == -1);
-
-                        // try to read all remaining data on stdout and stderr
-                        handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mReadyReadStdOut);
-                        handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mReadyReadStdErr);
-
-                        closeStdOut();
-                        closeStdErr();
-
-                        int w;
-                        eintrwrap(w, ::close(mSync[0]));
-                        mSync[0] = -1;
-                    }
-                    mFinished(this);
-                    return Done;
-                }
-                if (timeout) {
-                    assert(selecttime);
-                    Rct::gettime(selecttime);
-                    const int lasted = Rct::timevalDiff(selecttime, &started);
-                    if (lasted >= timeout) {
-                        // timeout, we're done
-                        kill(); // attempt to kill
-                        mErrorString = "Timed out";
-                        return TimedOut;
-                    }
-                    *selecttime = started;
-                    Rct::timevalAdd(selecttime, timeout);
+            if (fds[StdErrFd].revents) {
+                handleOutput(mStdErr[0], StdErrStream);
+                if (fds[StdErrFd].revents & (POLLHUP|POLLERR|POLLNVAL))
+                    fds[StdErrFd].fd = -1;
+            }
+            if (mStdIn[1] != -1 && fds[StdInFd].revents)
+                handleInput(mStdIn[1]);
+            if (fds[PidFd].revents) {
+                // finish() writes to mSync, unless the thread beat us to it
+                ProcessThread::reap(mPid);
+                fds[PidFd].fd = -1;
+            }
+            if (fds[SyncFd].revents) {
+                // we're done
+                {
+                    std::lock_guard<std::mutex> lock(mMutex);
+                    assert(mSync[1] == -1);
+
+                    // try to read all remaining data on stdout and stderr
+                    handleOutput(mStdOut[0], StdOutStream, true);
+                    handleOutput(mStdErr[0], StdErrStream, true);
+
+                    closeStdOut();
+                    closeStdErr();
+
+                    eintrwrap(err, ::close(mSync[0]));
+                    mSync[0] = -1;
                 }
+                if (pidfd != -1)
+                    eintrwrap(err, ::close(pidfd));
+                mFinished(this);
+                return Done;
             }
         }
     }
@@ -620,6 +769,7 @@ void Process::closeStdOut()
 
     if (EventLoop::SharedPtr eventLoop = EventLoop::eventLoop())
         eventLoop->unregisterSocket(mStdOut[0]);
+    mWatched &= ~StdOutStream;
     int err;
     eintrwrap(err, ::close(mStdOut[0]));
     mStdOut[0] = -1;
@@ -632,6 +782,7 @@ void Process::closeStdErr()
 
     if (EventLoop::SharedPtr eventLoop = EventLoop::eventLoop())
         eventLoop->unregisterSocket(mStdErr[0]);
+    mWatched &= ~StdErrStream;
     int err;
     eintrwrap(err, ::close(mStdErr[0]));
     mStdErr[0] = -1;
@@ -642,6 +793,7 @@ String Process::readAllStdOut()
     String out;
     std::swap(mStdOutBuffer, out);
     mStdOutIndex = 0;
+    watchOutput();
     return out;
 }
 
@@ -650,6 +802,7 @@ String Process::readAllStdErr()
     String out;
     std::swap(mStdErrBuffer, out);
     mStdErrIndex = 0;
+    watchOutput();
     return out;
 }
 
@@ -662,9 +815,9 @@ void Process::processCallback(int fd, int mode)
     if (fd == mStdIn[1])
         handleInput(fd);
     else if (fd == mStdOut[0])
-        handleOutput(fd, mStdOutBuffer, mStdOutIndex, mReadyReadStdOut);
+        handleOutput(fd, StdOutStream);
     else if (fd == mStdErr[0])
-        handleOutput(fd, mStdErrBuffer, mStdErrIndex, mReadyReadStdErr);
+        handleOutput(fd, StdErrStream);
 }
 
 void Process::finish(int returnCode)
@@ -679,8 +832,8 @@ void Process::finish(int returnCode)
 
         if (mMode == Async) {
             // try to read all remaining data on stdout and stderr
-            handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mReadyReadStdOut);
-            handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mReadyReadStdErr);
+            handleOutput(mStdOut[0], StdOutStream, true);
+            handleOutput(mStdErr[0], StdErrStream, true);
 
             closeStdOut();
             closeStdErr();
@@ -738,50 +891,138 @@ void Process::handleInput(int fd)
     }
 }
 
-void Process::handleOutput(int fd, String &buffer, int &index, Signal<std::function<void(Process*)> > &signal)
+void Process::handleOutput(int fd, unsigned int stream, bool drain)
 {
+    if (fd == -1)
+        return;
+
     //printf("Process::handleOutput %d\n", fd);
-    enum { BufSize = 1024, MaxSize = (1024 * 1024 * 256) };
+    enum { BufSize = 16 * 1024, ChunkSize = 64 * 1024, MaxSize = (1024 * 1024 * 256) };
+    const bool isStdOut = stream == StdOutStream;
+    String &buffer = isStdOut ? mStdOutBuffer : mStdErrBuffer;
+    int &index = isStdOut ? mStdOutIndex : mStdErrIndex;
+    const EventLoop::SharedPtr eventLoop = EventLoop::eventLoop();
     char buf[BufSize];
     int total = 0;
     for (;;) {
+        // a slot may pause, only an async child can wait for us
+        if (!drain && mMode == Async) {
+            if (mOutputPaused || (mOutputMode == CollectOutput && mMaxOutput && buffer.size() >= mMaxOutput))
+                break;
+        }
         int r;
-        eintrwrap(r, ::read(fd, buf, BufSize));
-        if (r == -1) {
-            //printf("Process::handleOutput %d returning -1, errno %d %s\n", fd, errno, Rct::strerror().constData());
-            break;
-        } else if (r == 0) { // file descriptor closed, remove it
-            //printf("Process::handleOutput %d returning 0\n", fd);
-            if (auto eventLoop = EventLoop::eventLoop())
-                eventLoop->unregisterSocket(fd);
-            break;
+        if (mOutputMode == StreamOutput) {
+            Buffer chunk = eventLoop ? eventLoop->bufferPool()->acquire(ChunkSize) : Buffer();
+            chunk.reserve(ChunkSize);
+            eintrwrap(r, ::read(fd, chunk.data(), ChunkSize));
+            if (r > 0) {
+                chunk.resize(r);
+                total += r;
+                (isStdOut ? mStdOutData : mStdErrData)(this, std::move(chunk));
+                continue;
+            }
+            if (eventLoop)
+                eventLoop->bufferPool()->release(std::move(chunk));
         } else {
-            //printf("Process::handleOutput in loop %d\n", fd);
-            //printf("data: '%s'\n", String(buf, r).constData());
-            int sz = buffer.size();
-            if (sz + r > MaxSize) {
-                if (sz + r - index > MaxSize) {
-                    error("Process::handleOutput, buffer too big, dropping data");
-                    buffer.clear();
-                    index = sz = 0;
-                } else {
-                    sz = buffer.size() - index;
-                    memmove(buffer.data(), buffer.data() + index, sz);
-                    buffer.resize(sz);
-                    index = 0;
+            eintrwrap(r, ::read(fd, buf, BufSize));
+            if (r > 0) {
+                //printf("data: '%s'\n", String(buf, r).constData());
+                int sz = buffer.size();
+                if (sz + r > MaxSize && (!mMaxOutput || mMode != Async)) {
+                    if (sz + r - index > MaxSize) {
+                        error("Process::handleOutput, buffer too big, dropping data");
+                        buffer.clear();
+                        index = sz = 0;
+                    } else {
+                        sz = buffer.size() - index;
+                        memmove(buffer.data(), buffer.data() + index, sz);
+                        buffer.resize(sz);
+                        index = 0;
+                    }
                 }
+                buffer.resize(sz + r);
+                memcpy(buffer.data() + sz, buf, r);
+                total += r;
+                continue;
             }
-            buffer.resize(sz + r);
-            memcpy(buffer.data() + sz, buf, r);
-
-            total += r;
         }
+        if (r == 0) { // file descriptor closed, remove it
+            //printf("Process::handleOutput %d returning 0\n", fd);
+            if (eventLoop && (mWatched & stream))
+                eventLoop->unregisterSocket(fd);
+            mWatched &= ~stream;
+            mEnded |= stream;
+        }
+        break;
     }
 
     //printf("total data '%s'\n", buffer.nullTerminated());
 
-    if (total)
-        signal(this);
+    if (total && mOutputMode == CollectOutput)
+        (isStdOut ? mReadyReadStdOut : mReadyReadStdErr)(this);
+    watchOutput();
+}
+
+void Process::watchOutput()
+{
+    EventLoop::SharedPtr eventLoop = EventLoop::eventLoop();
+    if (mMode != Async || !eventLoop)
+        return;
+    const int fds[] = { mStdOut[0], mStdErr[0] };
+    const unsigned int streams[] = { StdOutStream, StdErrStream };
+    const String *buffers[] = { &mStdOutBuffer, &mStdErrBuffer };
+    for (int i = 0; i < 2; ++i) {
+        const bool full = mOutputMode == CollectOutput && mMaxOutput && buffers[i]->size() >= mMaxOutput;
+        const bool watch = fds[i] != -1 && !(mEnded & streams[i]) && !mOutputPaused && !full;
+        if (watch && !(mWatched & streams[i])) {
+            eventLoop->registerSocket(fds[i], EventLoop::SocketRead,
+                                      std::bind(&Process::processCallback, this, std::placeholders::_1, std::placeholders::_2));
+            mWatched |= streams[i];
+        } else if (!watch && (mWatched & streams[i])) {
+            eventLoop->unregisterSocket(fds[i]);
+            mWatched &= ~streams[i];
+        }
+    }
+}
+
+void Process::setOutputMode(OutputMode mode)
+{
+    assert(mPid == -1);
+    mOutputMode = mode;
+}
+
+static void setOutputFd(int &member, int fd)
+{
+    int err;
+    if (member != -1)
+        eintrwrap(err, ::close(member));
+    member = -1;
+    if (fd != -1)
+        eintrwrap(member, ::fcntl(fd, F_DUPFD_CLOEXEC, 0));
+}
+
+void Process::setStdOutFd(int fd)
+{
+    assert(mPid == -1);
+    setOutputFd(mStdOutFd, fd);
+}
+
+void Process::setStdErrFd(int fd)
+{
+    assert(mPid == -1);
+    setOutputFd(mStdErrFd, fd);
+}
+
+void Process::pauseOutput()
+{
+    mOutputPaused = true;
+    watchOutput();
+}
+
+void Process::resumeOutput()
+{
+    mOutputPaused = false;
+    watchOutput();
 }
 
 void Process::kill(int sig)
@@ -795,12 +1036,7 @@ void Process::kill(int sig)
 
 List<String> Process::environment()
 {
-#ifdef OS_Darwin
-    char **cur = *_NSGetEnviron();
-#else
-    extern char** environ;
-    char** cur = environ;
-#endif
+    char *const *cur = currentEnviron();
     List<String> env;
     while (*cur) {
         env.push_back(*cur);
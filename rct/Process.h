@@ -5,6 +5,7 @@
 #include <deque>
 #include <mutex>
 
+#include <rct/Buffer.h>
 #include <rct/List.h>
 #include <rct/Path.h>
 #include <rct/SignalSlot.h>
@@ -19,6 +20,23 @@ public:
     void setCwd(const Path &cwd);
     void setChRoot(const Path &path);
 
+    // Output is collected for readAllStdOut() and readAllStdErr() by
+    // default, readyReadStdOut() and readyReadStdErr() tell when there's
+    // more. Streamed it goes to stdOutData() and stdErrData() as it's
+    // read, in chunks of up to 64k, and isn't kept.
+    enum OutputMode { CollectOutput, StreamOutput };
+    void setOutputMode(OutputMode mode);
+    OutputMode outputMode() const { return mOutputMode; }
+    // Collecting asynchronously, the pipes aren't read while this many
+    // bytes are waiting for readAll*() so the child blocks instead of us
+    // growing. 0 drops what's collected at 256M.
+    void setMaxOutput(size_t bytes) { mMaxOutput = bytes; }
+    size_t maxOutput() const { return mMaxOutput; }
+    // The child writes to fd instead of a pipe of ours, no copies and no
+    // output for us. fd is dup'ed, -1 goes back to the pipe.
+    void setStdOutFd(int fd);
+    void setStdErrFd(int fd);
+
     bool start(const Path &command,
                const List<String> &arguments = List<String>(),
                const List<String> &environ = List<String>());
@@ -49,8 +67,18 @@ public:
 
     void kill(int signal = SIGTERM);
 
+    // Of a started process, stops reading the pipes until resumed, for a
+    // consumer that can't keep up. What's in them when the child exits is
+    // read regardless.
+    void pauseOutput();
+    void resumeOutput();
+    bool isOutputPaused() const { return mOutputPaused; }
+
     Signal<std::function<void(Process*)> > &readyReadStdOut() { return mReadyReadStdOut; }
     Signal<std::function<void(Process*)> > &readyReadStdErr() { return mReadyReadStdErr; }
+    // StreamOutput, the buffers can go back to EventLoop::bufferPool()
+    Signal<std::function<void(Process*, Buffer&&)> > &stdOutData() { return mStdOutData; }
+    Signal<std::function<void(Process*, Buffer&&)> > &stdErrData() { return mStdErrData; }
     Signal<std::function<void(Process*)> > &finished() { return mFinished; }
 
     static List<String> environment();
@@ -69,10 +97,18 @@ private:
     void closeStdErr();
 
     void handleInput(int fd);
-    void handleOutput(int fd, String &buffer, int &index, Signal<std::function<void(Process*)> > &signal);
+    enum { StdOutStream = 0x1, StdErrStream = 0x2 };
+    // drain reads what there is, paused or full
+    void handleOutput(int fd, unsigned int stream, bool drain = false);
+    // registers the output pipes that should be read with the loop,
+    // unregisters the others
+    void watchOutput();
 
     ExecState startInternal(const Path &command, const List<String> &arguments,
                             const List<String> &environ, int timeout = 0, unsigned int flags = 0);
+    // start the child on mPid, false with mErrorString set on failure
+    bool spawn(const Path &command, const char *const *args, const char *const *env);
+    bool forkExec(const Path &command, const char *const *args, const char *const *env);
 
 private:
 
@@ -80,6 +116,7 @@ private:
     int mStdOut[2];
     int mStdErr[2];
     int mSync[2];
+    int mStdOutFd, mStdErrFd;
 
     mutable std::mutex mMutex;
     pid_t mPid;
@@ -91,6 +128,12 @@ private:
     int mStdInIndex, mStdOutIndex, mStdErrIndex;
     bool mWantStdInClosed;
 
+    OutputMode mOutputMode;
+    size_t mMaxOutput;
+    bool mOutputPaused;
+    // streams registered with the loop and streams at their end
+    unsigned int mWatched, mEnded;
+
     Path mCwd, mChRoot;
 
     String mErrorString;
@@ -98,6 +141,7 @@ private:
     enum { Sync, Async } mMode;
 
     Signal<std::function<void(Process*)> > mReadyReadStdOut, mReadyReadStdErr, mFinished;
+    Signal<std::function<void(Process*, Buffer&&)> > mStdOutData, mStdErrData;
 
     friend class ProcessThread;
 };
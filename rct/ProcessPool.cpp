@@ -0,0 +1,374 @@
+#include "ProcessPool.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "EventLoop.h"
+#include "Log.h"
+#include "MemoryMonitor.h"
+#include "Process.h"
+#include "Rct.h"
+#include "SocketClient.h"
+#include "ThreadPool.h"
+#include "Timer.h"
+
+// the worker's end of the socketpair
+static const char *const FdVariable = "RCT_PROCESS_POOL_FD";
+
+enum {
+    // a worker that doesn't exit this long after its connection is closed
+    // is killed
+    KillTimeout = 5000,
+    // a worker that dies sooner than this after starting is replaced this
+    // much later, a broken command shouldn't spin
+    RestartDelay = 1000
+};
+
+ProcessPool::ProcessPool(const Path &command, const List<String> &arguments, int version)
+    : mCommand(command), mArguments(arguments), mVersion(version), mCount(0), mMaxJobsPerWorker(0),
+      mMemoryLimit(0), mNextId(0), mRunning(false), mRestartTimer(0)
+{
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+ProcessPool::~ProcessPool()
+{
+    if (mRestartTimer) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+            loop->unregisterTimer(mRestartTimer);
+    }
+    for (auto &worker : mWorkers) {
+        if (worker->connection->client())
+            worker->connection->close();
+        worker->process->kill(SIGKILL);
+        release(std::move(worker));
+    }
+}
+
+bool ProcessPool::start(size_t count)
+{
+    mCount = count ? count : ThreadPool::idealThreadCount();
+    mRunning = true;
+    maintain();
+    return size();
+}
+
+void ProcessPool::stop()
+{
+    mRunning = false;
+    if (mRestartTimer) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+            loop->unregisterTimer(mRestartTimer);
+        mRestartTimer = 0;
+    }
+    // busy ones are retired by finished()
+    for (size_t i = 0; i < mWorkers.size(); ++i) {
+        if (!mWorkers[i]->job)
+            retire(mWorkers[i].get());
+    }
+    std::deque<std::shared_ptr<Job> > jobs;
+    std::swap(jobs, mJobs);
+    for (const auto &job : jobs) {
+        if (job->onFinished)
+            job->onFinished(-1);
+    }
+}
+
+void ProcessPool::post(const std::shared_ptr<Message> &message,
+                       Connection::ResponseCallback &&onResponse,
+                       Connection::FinishedCallback &&onFinished)
+{
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->message = message;
+    job->onResponse = std::move(onResponse);
+    job->onFinished = std::move(onFinished);
+    job->finished = false;
+    mJobs.push_back(job);
+    dispatch();
+}
+
+size_t ProcessPool::size() const
+{
+    size_t ret = 0;
+    for (const auto &worker : mWorkers) {
+        if (!worker->retired)
+            ++ret;
+    }
+    return ret;
+}
+
+size_t ProcessPool::idleCount() const
+{
+    size_t ret = 0;
+    for (const auto &worker : mWorkers) {
+        if (!worker->job && !worker->retired && worker->connection->isConnected())
+            ++ret;
+    }
+    return ret;
+}
+
+bool ProcessPool::spawn()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        error("ProcessPool: socketpair failed %s", Rct::strerror().constData());
+        return false;
+    }
+    // only the worker's end is inherited
+    SocketClient::setFlags(fds[0], FD_CLOEXEC, F_GETFD, F_SETFD);
+
+    std::unique_ptr<Worker> worker(new Worker);
+    worker->id = ++mNextId;
+    worker->jobs = 0;
+    worker->retired = false;
+    worker->process.reset(new Process);
+
+    const uint64_t id = worker->id;
+    WeakPtr weak = shared_from_this();
+    worker->process->finished().connect([weak, id](Process *) {
+            if (SharedPtr pool = weak.lock())
+                pool->exited(id);
+        });
+    worker->process->readyReadStdOut().connect([](Process *process) {
+            const String out = process->readAllStdOut();
+            debug("ProcessPool: worker %d: %s", process->pid(), out.constData());
+        });
+    worker->process->readyReadStdErr().connect([](Process *process) {
+            const String err = process->readAllStdErr();
+            error("ProcessPool: worker %d: %s", process->pid(), err.constData());
+        });
+
+    List<String> environment = Process::environment();
+    environment.append(String::format<64>("%s=%d", FdVariable, fds[1]));
+    const bool started = worker->process->start(mCommand, mArguments, environment);
+    ::close(fds[1]);
+    if (!started) {
+        ::close(fds[0]);
+        error("ProcessPool: couldn't start %s: %s", mCommand.constData(), worker->process->errorString().constData());
+        return false;
+    }
+
+    worker->started = Rct::monoMs();
+    worker->connection = Connection::create(std::make_shared<SocketClient>(fds[0], SocketClient::Unix), mVersion);
+    worker->connection->disconnected().connect([weak, id](const std::shared_ptr<Connection> &) {
+            // it's exiting or crashed, exited() takes it from here
+            if (SharedPtr pool = weak.lock())
+                pool->killLater(id);
+        });
+    mWorkers.push_back(std::move(worker));
+    ++mStats.started;
+    return true;
+}
+
+void ProcessPool::maintain()
+{
+    if (!mRunning || mRestartTimer)
+        return;
+    for (size_t live = size(); live < mCount; ++live) {
+        if (!spawn())
+            break;
+    }
+    dispatch();
+}
+
+void ProcessPool::dispatch()
+{
+    if (!mRunning)
+        return;
+    // callbacks may post and finish, workers are only added by maintain()
+    for (size_t i = 0; i < mWorkers.size() && !mJobs.empty(); ++i) {
+        Worker *worker = mWorkers[i].get();
+        if (worker->job || worker->retired || !worker->connection->isConnected())
+            continue;
+        const std::shared_ptr<Job> job = mJobs.front();
+        const uint64_t id = worker->id;
+        WeakPtr weak = shared_from_this();
+        const uint32_t requestId = worker->connection->request(*job->message, [job](const std::shared_ptr<Message> &response) {
+                if (job->onResponse)
+                    job->onResponse(response);
+            }, [weak, job, id](int status) {
+                // exited() finishes it if the worker is gone first
+                if (job->finished)
+                    return;
+                job->finished = true;
+                if (job->onFinished)
+                    job->onFinished(status);
+                if (status >= 0) {
+                    if (SharedPtr pool = weak.lock())
+                        pool->finished(id);
+                } else if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+                    // the connection may be going, it's closed once
+                    // disconnected() is done
+                    loop->callLater([weak, id]() {
+                            if (SharedPtr pool = weak.lock())
+                                pool->finished(id);
+                        });
+                }
+            });
+        if (!requestId) {
+            // the job stays for the next one
+            retire(worker);
+            continue;
+        }
+        mJobs.pop_front();
+        worker->job = job;
+    }
+}
+
+void ProcessPool::finished(uint64_t id)
+{
+    ++mStats.jobs;
+    Worker *worker = ProcessPool::worker(id);
+    if (worker) {
+        worker->job.reset();
+        ++worker->jobs;
+        // a worker that died with the job is left to exited()
+        if (!worker->retired && worker->connection->isConnected()) {
+            if (!mRunning) {
+                retire(worker);
+            } else if ((mMaxJobsPerWorker && worker->jobs >= mMaxJobsPerWorker)
+                       || (mMemoryLimit && MemoryMonitor::residentSize(worker->process->pid()) > mMemoryLimit)) {
+                ++mStats.recycled;
+                retire(worker);
+                maintain();
+            }
+        }
+    }
+    dispatch();
+}
+
+void ProcessPool::retire(Worker *worker)
+{
+    if (worker->retired)
+        return;
+    worker->retired = true;
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop)
+        return;
+    // we may be in one of the connection's emissions
+    const std::shared_ptr<Connection> connection = worker->connection;
+    loop->callLater([connection]() {
+            if (connection->client())
+                connection->close();
+        });
+    killLater(worker->id);
+}
+
+void ProcessPool::killLater(uint64_t id)
+{
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop)
+        return;
+    WeakPtr weak = shared_from_this();
+    loop->registerTimer([weak, id](int) {
+            if (SharedPtr pool = weak.lock()) {
+                if (Worker *worker = pool->worker(id))
+                    worker->process->kill(SIGKILL);
+            }
+        }, KillTimeout, Timer::SingleShot);
+}
+
+void ProcessPool::exited(uint64_t id)
+{
+    auto it = mWorkers.begin();
+    while (it != mWorkers.end() && (*it)->id != id)
+        ++it;
+    if (it == mWorkers.end())
+        return;
+
+    // a worker we didn't retire crashed or quit on its own
+    const bool crashed = !(*it)->retired;
+    const bool early = Rct::monoMs() - (*it)->started < RestartDelay;
+    if (crashed) {
+        ++mStats.crashed;
+        error("ProcessPool: worker of %s exited with %d", mCommand.constData(), (*it)->process->returnCode());
+    }
+    (*it)->retired = true;
+    std::unique_ptr<Worker> worker = std::move(*it);
+    mWorkers.erase(it);
+    const std::shared_ptr<Job> job = std::move(worker->job);
+    // we're in the process's finished()
+    release(std::move(worker));
+    if (job && !job->finished) {
+        job->finished = true;
+        ++mStats.jobs;
+        if (job->onFinished)
+            job->onFinished(-1);
+    }
+
+    if (crashed && early && mRunning && !mRestartTimer) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+            WeakPtr weak = shared_from_this();
+            mRestartTimer = loop->registerTimer([weak](int) {
+                    if (SharedPtr pool = weak.lock()) {
+                        pool->mRestartTimer = 0;
+                        pool->maintain();
+                    }
+                }, RestartDelay, Timer::SingleShot);
+            return;
+        }
+    }
+    maintain();
+}
+
+ProcessPool::Worker *ProcessPool::worker(uint64_t id) const
+{
+    for (const auto &worker : mWorkers) {
+        if (worker->id == id)
+            return worker.get();
+    }
+    return 0;
+}
+
+void ProcessPool::release(std::unique_ptr<Worker> &&worker)
+{
+    Worker *doomed = worker.release();
+    if (doomed->process->pid() != -1) {
+        // deleted once it's reaped, a running Process can't go
+        Process *process = doomed->process.release();
+        process->finished().connect([](Process *finished) {
+                if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+                    loop->callLater([finished]() { delete finished; });
+            });
+    }
+    if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+        loop->callLater([doomed]() { delete doomed; });
+    } else {
+        delete doomed;
+    }
+}
+
+bool ProcessPool::isWorker()
+{
+    return getenv(FdVariable) != 0;
+}
+
+int ProcessPool::runWorker(Handler &&handler, int version)
+{
+    const char *fd = getenv(FdVariable);
+    if (!fd) {
+        error("ProcessPool: %s isn't set, not started by a ProcessPool", FdVariable);
+        return 1;
+    }
+    const int socket = atoi(fd);
+    // not for the worker's own children
+    unsetenv(FdVariable);
+    SocketClient::setFlags(socket, FD_CLOEXEC, F_GETFD, F_SETFD);
+
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop) {
+        loop = std::make_shared<EventLoop>();
+        loop->init(EventLoop::MainEventLoop);
+    }
+    std::shared_ptr<Connection> connection = Connection::create(std::make_shared<SocketClient>(socket, SocketClient::Unix), version);
+    connection->newMessage().connect([&handler](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn) {
+            handler(message, conn);
+        });
+    connection->disconnected().connect([loop](const std::shared_ptr<Connection> &) { loop->quit(); });
+    loop->exec();
+    return 0;
+}
@@ -0,0 +1,142 @@
+#ifndef PROCESSPOOL_H
+#define PROCESSPOOL_H
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <rct/Connection.h>
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+
+class Process;
+
+// Keeps worker processes running and hands them jobs as Messages over a
+// socketpair, one job per worker at a time, so jobs don't pay for
+// starting a process each:
+//
+//     ProcessPool::SharedPtr pool = ProcessPool::create("/usr/bin/tool-worker");
+//     pool->start(4);
+//     pool->post(std::make_shared<JobMessage>(file), [](const std::shared_ptr<Message> &response) {
+//             ...
+//         }, [](int status) {
+//             // -1 when the worker died with the job
+//         });
+//
+// The worker calls runWorker() from main(), see there. Both sides register
+// the message types. A worker is replaced after maxJobsPerWorker() jobs,
+// when its resident memory is over memoryLimit() after a job and when it
+// exits. A pool belongs to the loop of the thread that created it.
+class ProcessPool : public std::enable_shared_from_this<ProcessPool>
+{
+public:
+    typedef std::shared_ptr<ProcessPool> SharedPtr;
+    typedef std::weak_ptr<ProcessPool> WeakPtr;
+
+    static SharedPtr create(const Path &command, const List<String> &arguments = List<String>(), int version = 0)
+    {
+        return SharedPtr(new ProcessPool(command, arguments, version));
+    }
+    // running workers are killed
+    ~ProcessPool();
+
+    // 0 is one per core. false if no worker could be started.
+    bool start(size_t count = 0);
+    // Workers exit once their job is done, queued jobs are finished with
+    // -1. Jobs posted after are queued until the next start().
+    void stop();
+    bool isRunning() const { return mRunning; }
+
+    // 0 means no limit
+    void setMaxJobsPerWorker(size_t jobs) { mMaxJobsPerWorker = jobs; }
+    size_t maxJobsPerWorker() const { return mMaxJobsPerWorker; }
+    // bytes, 0 means no limit
+    void setMemoryLimit(uint64_t bytes) { mMemoryLimit = bytes; }
+    uint64_t memoryLimit() const { return mMemoryLimit; }
+
+    // onResponse gets what the worker respond()s for the job, onFinished
+    // the status of its finishRequest()
+    void post(const std::shared_ptr<Message> &message,
+              Connection::ResponseCallback &&onResponse = Connection::ResponseCallback(),
+              Connection::FinishedCallback &&onFinished = Connection::FinishedCallback());
+
+    size_t size() const;
+    size_t idleCount() const;
+    size_t backlog() const { return mJobs.size(); }
+
+    struct Stats
+    {
+        uint64_t jobs, started, recycled, crashed;
+    };
+    const Stats &stats() const { return mStats; }
+
+    // In the worker, serves the pool's jobs on an EventLoop until the pool
+    // closes the connection. handler gets each job with its requestId()
+    // and answers with respond() and finishRequest() on the connection,
+    // now or later. Returns the exit code for main(), 1 if the process
+    // wasn't started by a ProcessPool.
+    //
+    //     int main()
+    //     {
+    //         Message::registerMessage<JobMessage>();
+    //         return ProcessPool::runWorker([](const std::shared_ptr<Message> &message,
+    //                                          const std::shared_ptr<Connection> &connection) {
+    //                 ...
+    //                 connection->finishRequest(message->requestId());
+    //             });
+    //     }
+    typedef std::function<void(const std::shared_ptr<Message> &, const std::shared_ptr<Connection> &)> Handler;
+    static int runWorker(Handler &&handler, int version = 0);
+    // whether this process was started by a ProcessPool
+    static bool isWorker();
+
+private:
+    ProcessPool(const Path &command, const List<String> &arguments, int version);
+
+    struct Job
+    {
+        std::shared_ptr<Message> message;
+        Connection::ResponseCallback onResponse;
+        Connection::FinishedCallback onFinished;
+        bool finished;
+    };
+    struct Worker
+    {
+        uint64_t id, started;
+        size_t jobs;
+        bool retired;
+        // the one it's doing
+        std::shared_ptr<Job> job;
+        std::unique_ptr<Process> process;
+        std::shared_ptr<Connection> connection;
+    };
+
+    bool spawn();
+    void maintain();
+    void dispatch();
+    void finished(uint64_t id);
+    void retire(Worker *worker);
+    void killLater(uint64_t id);
+    void exited(uint64_t id);
+    Worker *worker(uint64_t id) const;
+    static void release(std::unique_ptr<Worker> &&worker);
+
+    const Path mCommand;
+    const List<String> mArguments;
+    const int mVersion;
+    size_t mCount, mMaxJobsPerWorker;
+    uint64_t mMemoryLimit, mNextId;
+    bool mRunning;
+    int mRestartTimer;
+    std::vector<std::unique_ptr<Worker> > mWorkers;
+    std::deque<std::shared_ptr<Job> > mJobs;
+    Stats mStats;
+
+    ProcessPool(const ProcessPool &) = delete;
+    ProcessPool &operator=(const ProcessPool &) = delete;
+};
+
+#endif
@@ -14,9 +14,7 @@ public:
     }
 
     int exitCode() const { return mExitCode; }
-    virtual size_t encodedSize() const override { return sizeof(int); }
-    void encode(Serializer &s) const override { s << mExitCode; }
-    void decode(Deserializer &s) override { s >> mExitCode; }
+    RCT_MESSAGE_FIELDS(mExitCode)
 private:
     int mExitCode;
 };
@@ -22,9 +22,19 @@
 #include <mach/mach_time.h>
 #endif
 
+#include "DnsResolver.h"
 #include "Log.h"
 #include "StackBuffer.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define RCT_JSON_ESCAPE_AVX2
+#define RCT_CRC32C_SSE42
+#endif
+
 #if !defined(HOST_NAME_MAX) && defined(_POSIX_HOST_NAME_MAX)
 #define HOST_NAME_MAX _POSIX_HOST_NAME_MAX
 #endif
@@ -33,13 +43,14 @@ namespace Rct {
 
 bool readFile(const Path& path, String& data, mode_t *perm)
 {
-    if (!path.isFile())
-        return false;
-    FILE *f = fopen(path.nullTerminated(), "r");
-    if (!f)
+    const int fd = open(path.nullTerminated(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
         return false;
-    const bool ret = readFile(f, data, perm);
-    fclose(f);
+    struct stat st;
+    bool ret = !fstat(fd, &st) && S_ISREG(st.st_mode) && readAll(fd, data, String::npos, &st);
+    close(fd);
+    if (ret && perm)
+        *perm = st.st_mode;
     return ret;
 }
 
@@ -125,6 +136,42 @@ String readAll(FILE *f, int max)
     return String();
 }
 
+bool readAll(int fd, String &data, size_t max, const struct stat *st)
+{
+    struct stat buf;
+    if (!st) {
+        if (fstat(fd, &buf))
+            return false;
+        st = &buf;
+    }
+    enum { ChunkSize = 16 * 1024 };
+    const bool sized = S_ISREG(st->st_mode) && st->st_size > 0;
+    size_t capacity = sized ? std::min<size_t>(st->st_size, max) : std::min<size_t>(ChunkSize, max);
+    data.resize(capacity);
+    size_t pos = 0;
+    while (pos < max) {
+        if (pos == capacity) {
+            // the size was wrong, or there is none
+            if (sized && pos == static_cast<size_t>(st->st_size))
+                break;
+            capacity = std::min<size_t>(capacity * 2, max);
+            data.resize(capacity);
+        }
+        const ssize_t r = read(fd, data.data() + pos, capacity - pos);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            data.clear();
+            return false;
+        }
+        if (!r)
+            break;
+        pos += r;
+    }
+    data.resize(pos);
+    return true;
+}
+
 String shortOptions(const option *longOptions)
 {
     String ret;
@@ -313,46 +360,46 @@ String backtrace(int)
 #endif
 
 
-bool gettime(timeval* time)
+uint64_t monoNs()
 {
 #if defined(HAVE_MACH_ABSOLUTE_TIME)
-    static mach_timebase_info_data_t info;
-    static bool first = true;
-    uint64_t machtime = mach_absolute_time();
-    if (first) {
-        first = false;
-        mach_timebase_info(&info);
-    }
-    machtime = machtime * info.numer / (info.denom * 1000); // microseconds
-    time->tv_sec = machtime / 1000000;
-    time->tv_usec = machtime % 1000000;
-#elif defined(HAVE_CLOCK_MONOTONIC_RAW) || defined(HAVE_CLOCK_MONOTONIC)
+    static const mach_timebase_info_data_t info = []() {
+            mach_timebase_info_data_t ret;
+            mach_timebase_info(&ret);
+            return ret;
+        }();
+    return mach_absolute_time() * info.numer / info.denom;
+#elif defined(HAVE_CLOCK_MONOTONIC)
     timespec spec;
-#if defined(HAVE_CLOCK_MONOTONIC_RAW)
-    const clockid_t cid = CLOCK_MONOTONIC_RAW;
-#else
-    const clockid_t cid = CLOCK_MONOTONIC;
-#endif
-    const int ret = ::clock_gettime(cid, &spec);
-    if (ret == -1) {
-        memset(time, 0, sizeof(timeval));
-        return false;
-    }
-    time->tv_sec = spec.tv_sec;
-    time->tv_usec = spec.tv_nsec / 1000;
+    if (::clock_gettime(CLOCK_MONOTONIC, &spec) == -1)
+        return 0;
+    return spec.tv_sec * static_cast<uint64_t>(1000000000) + spec.tv_nsec;
 #else
-#error No EventLoop::gettime() implementation
+#error No Rct::monoNs() implementation
 #endif
-    return true;
 }
 
 uint64_t monoMs()
 {
-    timeval time;
-    if (gettime(&time)) {
-        return (time.tv_sec * static_cast<uint64_t>(1000)) + (time.tv_usec / static_cast<uint64_t>(1000));
-    }
-    return 0;
+    return monoNs() / 1000000;
+}
+
+uint64_t monoCoarseMs()
+{
+#if defined(CLOCK_MONOTONIC_COARSE)
+    timespec spec;
+    if (::clock_gettime(CLOCK_MONOTONIC_COARSE, &spec) == 0)
+        return spec.tv_sec * static_cast<uint64_t>(1000) + spec.tv_nsec / 1000000;
+#endif
+    return monoMs();
+}
+
+bool gettime(timeval* time)
+{
+    const uint64_t ns = monoNs();
+    time->tv_sec = ns / 1000000000;
+    time->tv_usec = (ns % 1000000000) / 1000;
+    return ns != 0;
 }
 
 uint64_t currentTimeMs()
@@ -483,64 +530,215 @@ String addrLookup(const String &address, LookupMode mode, bool *ok)
 
 String nameLookup(const String& name, LookupMode mode, bool *ok)
 {
-    assert(mode == Auto);
-    String out(INET6_ADDRSTRLEN, '\0');
-    addrinfo hints, *p, *res;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = (mode == IPv6) ? AF_INET6 : AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-
-    if (getaddrinfo(name.constData(), NULL, &hints, &res) != 0) {
+    assert(mode != Auto);
+    // cached names don't block
+    const DnsResolver::Addresses addresses = DnsResolver::instance()->resolveNow(name, mode == IPv6 ? AF_INET6 : AF_INET);
+    if (addresses.empty()) {
         if (ok)
             *ok = false;
         // bad
         return name;
     }
 
-    bool found = false;
-    for (p = res; p; p = p->ai_next) {
-        if (mode == IPv4 && p->ai_family == AF_INET) {
-            sockaddr_in* addr = reinterpret_cast<sockaddr_in*>(p->ai_addr);
-            inet_ntop(AF_INET, &addr->sin_addr, out.data(), out.size());
-            out.resize(strlen(out.constData()));
-            found = true;
+    String out(INET6_ADDRSTRLEN, '\0');
+    if (mode == IPv4) {
+        const sockaddr_in* addr = reinterpret_cast<const sockaddr_in*>(addresses.front().addr());
+        inet_ntop(AF_INET, &addr->sin_addr, out.data(), out.size());
+    } else {
+        const sockaddr_in6* addr = reinterpret_cast<const sockaddr_in6*>(addresses.front().addr());
+        inet_ntop(AF_INET6, &addr->sin6_addr, out.data(), out.size());
+    }
+    out.resize(strlen(out.constData()));
+    if (ok)
+        *ok = true;
+
+    return out;
+}
+
+// The next byte of [ch, end) that jsonEscape() escapes, a control
+// character, DEL, '"' or '\\', or end. Plain text goes 16 or 32 bytes at a
+// time with SSE2 or AVX2, whichever the CPU has.
+static const char *findEscapeScalar(const char *ch, const char *end)
+{
+    while (ch != end) {
+        const unsigned char c = *ch;
+        if (c < 0x20 || c == 0x7f || c == '"' || c == '\\')
             break;
-        } else if (mode == IPv6 && p->ai_family == AF_INET6) {
-            sockaddr_in6* addr = reinterpret_cast<sockaddr_in6*>(p->ai_addr);
-            inet_ntop(AF_INET6, &addr->sin6_addr, out.data(), out.size());
-            out.resize(strlen(out.constData()));
-            found = true;
+        ++ch;
+    }
+    return ch;
+}
+
+#if defined(__SSE2__)
+static const char *findEscapeSSE2(const char *ch, const char *end)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i control = _mm_set1_epi8(0x1f);
+    while (end - ch >= 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ch));
+        const __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                             _mm_or_si128(_mm_cmpeq_epi8(v, del),
+                                                          _mm_cmpeq_epi8(_mm_min_epu8(v, control), v)));
+        if (const int mask = _mm_movemask_epi8(special))
+            return ch + __builtin_ctz(mask);
+        ch += 16;
+    }
+    return findEscapeScalar(ch, end);
+}
+#endif
+
+#ifdef RCT_JSON_ESCAPE_AVX2
+__attribute__((target("avx2"))) static const char *findEscapeAVX2(const char *ch, const char *end)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    while (end - ch >= 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ch));
+        const __m256i special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                                _mm256_cmpeq_epi8(v, backslash)),
+                                                _mm256_or_si256(_mm256_cmpeq_epi8(v, del),
+                                                                _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v)));
+        if (const unsigned int mask = _mm256_movemask_epi8(special))
+            return ch + __builtin_ctz(mask);
+        ch += 32;
+    }
+    return findEscapeScalar(ch, end);
+}
+#endif
+
+static const char *findEscape(const char *ch, const char *end)
+{
+    static const char *(*const find)(const char *, const char *) = []() {
+#ifdef RCT_JSON_ESCAPE_AVX2
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return findEscapeAVX2;
+#endif
+#if defined(__SSE2__)
+            return findEscapeSSE2;
+#else
+            return findEscapeScalar;
+#endif
+        }();
+    return find(ch, end);
+}
+
+// output gets the clean runs whole and each escape on its own
+template <typename Output>
+static inline void escape(const String &str, Output &output)
+{
+    output("\"", 1);
+    const char *ch = str.constData();
+    const char *end = ch + str.size();
+    while (true) {
+        const char *next = findEscape(ch, end);
+        if (next != ch)
+            output(ch, next - ch);
+        if (next == end)
             break;
+        switch (const unsigned char c = *next) {
+        case 8: output("\\b", 2); break; // backspace
+        case 12: output("\\f", 2); break; // Form feed
+        case '\n': output("\\n", 2); break; // newline
+        case '\t': output("\\t", 2); break; // tab
+        case '\r': output("\\r", 2); break; // carriage return
+        case '"': output("\\\"", 2); break; // quote
+        case '\\': output("\\\\", 2); break; // backslash
+        default: { // non printable characters
+            char buffer[7];
+            snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            output(buffer, 6);
+            break; }
         }
+        ch = next + 1;
     }
+    output("\"", 1);
+}
 
-    freeaddrinfo(res);
+void jsonEscape(const String &str, const std::function<void(const char *, size_t)> &output)
+{
+    escape(str, output);
+}
 
-    if (!found) {
-        if (ok)
-            *ok = false;
-        return name;
-    }
-    if (ok)
-        *ok = true;
+void jsonEscape(const String &str, String &out)
+{
+    // room for the quotes and a few escapes
+    out.reserve(out.size() + str.size() + 8);
+    auto append = [&out](const char *data, size_t size) { out.append(data, size); };
+    escape(str, append);
+}
 
-    return out;
+// CRC32C, the Castagnoli polynomial, reflected
+static const uint32_t *crc32cTable()
+{
+    static const uint32_t *table = []() {
+            static uint32_t t[256];
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; ++bit)
+                    crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+                t[i] = crc;
+            }
+            return t;
+        }();
+    return table;
 }
 
-String strerror(int error)
+static uint32_t crc32cScalar(uint32_t crc, const unsigned char *data, size_t size)
+{
+    const uint32_t *table = crc32cTable();
+    while (size--)
+        crc = table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef RCT_CRC32C_SSE42
+__attribute__((target("sse4.2"))) static uint32_t crc32cSSE42(uint32_t crc, const unsigned char *data, size_t size)
 {
-#ifdef _GNU_SOURCE
-#undef _GNU_SOURCE
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
 #endif
-#ifdef __USE_GNU
-#undef __USE_GNU
+    while (size--)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+uint32_t crc32c(const void *data, size_t size, uint32_t crc)
+{
+    static uint32_t (*const update)(uint32_t, const unsigned char *, size_t) = []() {
+#ifdef RCT_CRC32C_SSE42
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("sse4.2"))
+                return crc32cSSE42;
 #endif
+            return crc32cScalar;
+        }();
+    return ~update(~crc, static_cast<const unsigned char *>(data), size);
+}
+
+// strerror_r() is the XSI one returning an int, or with _GNU_SOURCE the
+// GNU one that returns the message and may leave buf alone
+static inline const char *strerrorMessage(int, const char *buf) { return buf; }
+static inline const char *strerrorMessage(const char *message, const char *) { return message; }
+
+String strerror(int error)
+{
     char buf[1024];
     buf[0] = '\0';
-    auto foo = strerror_r(error, buf, sizeof(buf));
-    (void)foo;
-    String ret = buf;
+    String ret = strerrorMessage(strerror_r(error, buf, sizeof(buf)), buf);
     ret << " (" << error << ')';
     return ret;
 }
@@ -49,6 +49,11 @@ inline bool contains(const String &str, const std::regex &rx, std::cmatch *match
 String shortOptions(const option *longOptions);
 int readLine(FILE *f, char *buf = 0, int max = -1);
 String readAll(FILE *f, int max = -1);
+// Reads the rest of fd into data, up to max bytes, with read() straight
+// into data. st is fd's if the caller has it already. Regular files are
+// read in one go at their size, the rest, like pipes and files in /proc
+// that claim to be empty, until they end.
+bool readAll(int fd, String &data, size_t max = String::npos, const struct stat *st = 0);
 inline int fileSize(FILE *f)
 {
     assert(f);
@@ -72,7 +77,15 @@ void findExecutablePath(const char *argv0);
 Path executablePath();
 String backtrace(int maxFrames = -1);
 bool gettime(timeval* time);
+// Monotonic time. CLOCK_MONOTONIC is read in user space through the vDSO,
+// a few ns a call, CLOCK_MONOTONIC_RAW isn't on every kernel.
+// EventLoop::now() is the cached one of the running loop.
+uint64_t monoNs();
+inline uint64_t monoUs() { return monoNs() / 1000; }
 uint64_t monoMs();
+// a coarse clock where there is one, ticks of a few ms at much less
+// cost, for expiry times and the like
+uint64_t monoCoarseMs();
 uint64_t currentTimeMs();
 String hostName();
 
@@ -102,54 +115,18 @@ String addrLookup(const String& addr, LookupMode mode = Auto, bool *ok = 0);
 String nameLookup(const String& name, LookupMode mode = IPv4, bool *ok = 0);
 bool isIP(const String& addr, LookupMode mode = Auto);
 
-inline void jsonEscape(const String &str, std::function<void(const char *, size_t)> output)
-{
-    output("\"", 1);
-    bool hasEscaped = false;
-    size_t i;
-    auto put = [&output, &hasEscaped, &i, &str](const char *escaped) {
-        if (!hasEscaped) {
-            hasEscaped = true;
-            if (i)
-                output(str.constData(), i);
-        }
-        output(escaped, strlen(escaped));
-    };
-    const char *stringData = str.constData();
-
-    const size_t length = str.size();
-    for (i = 0; i < length; ++i) {
-        switch (const char ch = stringData[i]) {
-        case 8: put("\\b"); break; // backspace
-        case 12: put("\\f"); break; // Form feed
-        case '\n': put("\\n"); break; // newline
-        case '\t': put("\\t"); break; // tab
-        case '\r': put("\\r"); break; // carriage return
-        case '"': put("\\\""); break; // quote
-        case '\\': put("\\\\"); break; // backslash
-        default:
-            if (ch < 0x20 || ch == 127) { // escape non printable characters
-                char buffer[7];
-                snprintf(buffer, 7, "\\u%04x", ch);
-                put(buffer);
-                break;
-            } else if (hasEscaped) {
-                output(&ch, 1);
-            }
-            break;
-        }
-    }
-
-    if (!hasEscaped)
-        output(stringData, length);
-    output("\"", 1);
-}
+// Quotes and escapes str as a JSON string. output gets runs that need no
+// escaping in one call each, the other overload appends to out.
+void jsonEscape(const String &str, const std::function<void(const char *, size_t)> &output);
+void jsonEscape(const String &str, String &out);
+// CRC32C of size bytes of data, with the crc of what came before to
+// continue it. Uses the SSE4.2 instruction when the CPU has it.
+uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0);
 
 inline String jsonEscape(const String &string)
 {
     String ret;
-    jsonEscape(string, std::bind(static_cast<void(String::*)(const char *, size_t)>(&String::append),
-                                 &ret, std::placeholders::_1, std::placeholders::_2));
+    jsonEscape(string, ret);
     return ret;
 }
 
@@ -16,6 +16,12 @@ public:
         if (mData.endsWith('\n'))
             mData.chop(1);
     }
+    ResponseMessage(String &&data, Type type = Stdout)
+        : Message(MessageId), mData(std::move(data)), mType(type)
+    {
+        if (mData.endsWith('\n'))
+            mData.chop(1);
+    }
     ResponseMessage(const List<String> &data, Type type = Stdout)
         : Message(MessageId), mData(String::join(data, "\n")), mType(type)
     {
@@ -28,9 +34,7 @@ public:
     String data() const { return mData; }
     void setData(const String &data) { mData = data; }
 
-    virtual size_t encodedSize() const override { return mData.size() + sizeof(int); }
-    virtual void encode(Serializer &serializer) const override { serializer << mData; }
-    virtual void decode(Deserializer &deserializer) override { deserializer >> mData; }
+    RCT_MESSAGE_FIELDS(mData)
 private:
     String mData;
     Type mType;
@@ -1,6 +1,10 @@
 #include "SHA256.h"
 
-#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
 #ifdef OS_Darwin
 #include "CommonCrypto/CommonDigest.h"
 #define SHA256_Update        CC_SHA256_Update
@@ -11,7 +15,16 @@
 #else
 #include <openssl/sha.h>
 #endif
+#include "rct/Parallel.h"
 #include "rct/Path.h"
+#include "rct/Rct.h"
+
+enum {
+    // CommonCrypto takes 32 bit sizes
+    MaxUpdate = 1024 * 1024 * 1024,
+    // what hashFile() reads at a time
+    ReadSize = 1024 * 1024
+};
 
 class SHA256Private
 {
@@ -32,13 +45,23 @@ SHA256::~SHA256()
     delete priv;
 }
 
-void SHA256::update(const char *data, unsigned int size)
+static inline void updateContext(SHA256_CTX *ctx, const char *data, size_t size)
+{
+    while (size) {
+        const size_t chunk = std::min<size_t>(size, MaxUpdate);
+        SHA256_Update(ctx, data, chunk);
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+void SHA256::update(const char *data, size_t size)
 {
     if (!size)
         return;
     if (priv->finalized)
         priv->finalized = false;
-    SHA256_Update(&priv->ctx, data, size);
+    updateContext(&priv->ctx, data, size);
 }
 
 void SHA256::update(const String &data)
@@ -88,20 +111,23 @@ String SHA256::hash(const String& data, MapType type)
     return SHA256::hash(data.constData(), data.size(), type);
 }
 
-String SHA256::hash(const char* data, unsigned int size, MapType type)
+String SHA256::hash(const char* data, size_t size, MapType type)
 {
     SHA256Private priv;
     SHA256_Init(&priv.ctx);
-    SHA256_Update(&priv.ctx, data, size);
+    updateContext(&priv.ctx, data, size);
     SHA256_Final(priv.hash, &priv.ctx);
     if (type == Hex)
         return hashToHex(&priv);
     return String(reinterpret_cast<char*>(priv.hash), SHA256_DIGEST_LENGTH);
 }
 
+// Files are read rather than mapped, a mapping costs page faults for
+// every 4k and hashing reads every byte once anyway. The kernel's
+// readahead sees the sequential reads.
 String SHA256::hashFile(const Path& file, MapType type)
 {
-    const int fd = ::open(file.nullTerminated(), 0);
+    const int fd = ::open(file.constData(), O_RDONLY | O_CLOEXEC);
     if (fd < 0)
         return String();
 
@@ -110,14 +136,47 @@ String SHA256::hashFile(const Path& file, MapType type)
         ::close(fd);
         return String();
     }
-    void *mapped = ::mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
-    if (mapped == MAP_FAILED)
-        return String();
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (S_ISREG(st.st_mode) && st.st_size > ReadSize)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-    const String ret = SHA256::hash(const_cast<const char *>(static_cast<char*>(mapped)), st.st_size, type);
+    // one buffer per thread, a small file only needs as much as it has
+    static thread_local std::unique_ptr<char[]> tBuffer;
+    static thread_local size_t tBufferSize = 0;
+    const size_t size = (S_ISREG(st.st_mode) && st.st_size < ReadSize) ? static_cast<size_t>(st.st_size) + 1 : static_cast<size_t>(ReadSize);
+    if (tBufferSize < size) {
+        tBuffer.reset(new char[size]);
+        tBufferSize = size;
+    }
 
-    ::munmap(mapped, st.st_size);
+    SHA256Private priv;
+    SHA256_Init(&priv.ctx);
+    bool ok = true;
+    for (;;) {
+        ssize_t r;
+        eintrwrap(r, ::read(fd, tBuffer.get(), tBufferSize));
+        if (r <= 0) {
+            ok = !r;
+            break;
+        }
+        updateContext(&priv.ctx, tBuffer.get(), r);
+    }
     ::close(fd);
+    SHA256_Final(priv.hash, &priv.ctx);
+    if (!ok)
+        return String();
+    if (type == Hex)
+        return hashToHex(&priv);
+    return String(reinterpret_cast<char*>(priv.hash), SHA256_DIGEST_LENGTH);
+}
 
+List<String> SHA256::hashFiles(const List<Path>& files, MapType type, ThreadPool* pool)
+{
+    // files differ a lot in size, they're handed out one at a time
+    List<String> ret(files.size());
+    Rct::parallelFor<size_t>(0, files.size(), 1, [&](size_t i) {
+            ret[i] = hashFile(files[i], type);
+        }, pool);
     return ret;
 }
@@ -1,10 +1,15 @@
 #ifndef SHA256_H
 #define SHA256_H
 
+#include <rct/List.h>
 #include <rct/String.h>
 
 class Path;
 class SHA256Private;
+class ThreadPool;
+
+// The digest is computed by OpenSSL, CommonCrypto on Darwin, which pick
+// the SHA extensions of the CPU at runtime where there are some.
 class SHA256
 {
 public:
@@ -14,15 +19,19 @@ public:
     enum MapType { Raw, Hex };
 
     void update(const String& data);
-    void update(const char* data, unsigned int size);
+    void update(const char* data, size_t size);
 
     void reset();
 
     String hash(MapType type = Hex) const;
 
     static String hash(const String& data, MapType type = Hex);
-    static String hash(const char* data, unsigned int size, MapType type = Hex);
+    static String hash(const char* data, size_t size, MapType type = Hex);
+    // empty if the file can't be read
     static String hashFile(const Path& fileName, MapType type = Hex);
+    // Hashes files on pool's threads, ThreadPool::instance() if it's 0,
+    // and the calling one. The hashes are in the order of files.
+    static List<String> hashFiles(const List<Path>& files, MapType type = Hex, ThreadPool* pool = 0);
 
 private:
     SHA256Private* priv;
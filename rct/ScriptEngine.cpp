@@ -732,7 +732,7 @@ static inline v8::Local<v8::Value> toV8_helper(v8::Isolate* isolate, const Value
     v8::Local<v8::Value> result;
     switch (value.type()) {
     case Value::Type_String:
-        result = v8::String::NewFromUtf8(isolate, value.toString().constData());
+        result = v8::String::NewFromUtf8(isolate, value.get<String>()->constData());
         break;
     case Value::Type_List: {
         const int sz = value.count();
@@ -1254,7 +1254,7 @@ static void ClassInterceptEnumerator(const v8::PropertyCallbackInfo<v8::Array>&
     const Value r = priv->intercept.enumerator();
     if (r.type() != Value::Type_List)
         return;
-    const List<Value> l = r.toList();
+    const List<Value> &l = r.listRef();
     v8::Local<v8::Array> array = v8::Array::New(iso, l.size());
     for (size_t idx = 0; idx < l.size(); ++idx)
         array->Set(idx, toV8(iso, l[idx]));
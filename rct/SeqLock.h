@@ -0,0 +1,90 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <type_traits>
+
+// Holds a small trivially copyable value, e.g. a struct of counters or a
+// configuration snapshot, that many threads read and few write. Readers
+// never write to shared memory, they copy the value and retry if a
+// writer got in the way, so reads scale with any number of threads as
+// long as writes are rare and short. Writers are serialized among
+// themselves.
+//
+//     SeqLock<Limits> limits;
+//     limits.store(newLimits);
+//     const Limits current = limits.load();
+template <typename T>
+class SeqLock
+{
+public:
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock<T> needs a trivially copyable T");
+
+    SeqLock(const T &value = T())
+        : mSequence(0)
+    {
+        write(value);
+    }
+
+    T load() const
+    {
+        for (;;) {
+            const uint64_t sequence = mSequence.load(std::memory_order_acquire);
+            if (!(sequence & 1)) {
+                uint64_t words[Words];
+                for (size_t i = 0; i < Words; ++i)
+                    words[i] = mWords[i].load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (mSequence.load(std::memory_order_relaxed) == sequence) {
+                    T ret;
+                    memcpy(&ret, words, sizeof(T));
+                    return ret;
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    void store(const T &value)
+    {
+        uint64_t sequence = mSequence.load(std::memory_order_relaxed);
+        for (;;) {
+            if (!(sequence & 1)
+                && mSequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire)) {
+                break;
+            }
+            std::this_thread::yield();
+            sequence = mSequence.load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        write(value);
+        mSequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    // bumped twice by every store()
+    uint64_t sequence() const { return mSequence.load(std::memory_order_acquire); }
+
+private:
+    enum { Words = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t) };
+
+    void write(const T &value)
+    {
+        uint64_t words[Words] = {};
+        memcpy(words, &value, sizeof(T));
+        for (size_t i = 0; i < Words; ++i)
+            mWords[i].store(words[i], std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> mSequence;
+    // the value is kept in atomic words so that a torn read is merely
+    // thrown away instead of being a data race
+    std::atomic<uint64_t> mWords[Words];
+
+    SeqLock(const SeqLock &) = delete;
+    SeqLock &operator=(const SeqLock &) = delete;
+};
+
+#endif
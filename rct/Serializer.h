@@ -4,11 +4,17 @@
 // #define RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
 #include <assert.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <type_traits>
 #include <utility>
 #include <string>
 
+#include <rct/Arena.h>
 #include <rct/Hash.h>
 #include <rct/List.h>
 #include <rct/Log.h>
@@ -16,8 +22,13 @@
 #include <rct/Path.h>
 #include <rct/Rct.h>
 #include <rct/Set.h>
+#include <rct/Span.h>
 #include <rct/String.h>
+#include <rct/StringView.h>
 
+// Strings and files are written to directly, only custom Buffers go
+// through a virtual call per write. File output is staged and written in
+// large chunks, call flush() before touching the FILE yourself.
 class Serializer
 {
 public:
@@ -29,24 +40,48 @@ public:
         virtual int pos() const = 0;
     };
 
+    enum { FileStagingSize = 64 * 1024 };
+
+    // Message and DataFile versions with this bit set use the compact
+    // format for everything after their header, see setCompact()
+    enum { CompactVersion = 0x40000000 };
+
     Serializer(std::unique_ptr<Buffer> &&buffer)
-        : mError(false), mBuffer(std::move(buffer))
+        : mError(false), mCompact(false), mString(0), mFile(0), mStaged(0), mBuffer(std::move(buffer))
     {}
 
-    Serializer(std::string &out)
-        : mError(false), mBuffer(new StringBuffer(out))
-    {}
+    // sizeHint is how much is about to be written, e.g.
+    // Message::encodedSize(), String::npos if it isn't known
+    Serializer(std::string &out, size_t sizeHint = String::npos)
+        : mError(false), mCompact(false), mString(&out), mFile(0), mStaged(0)
+    {
+        reserve(sizeHint);
+    }
 
-    Serializer(String &out)
-        : mError(false), mBuffer(new StringBuffer(out))
-    {}
+    Serializer(String &out, size_t sizeHint = String::npos)
+        : mError(false), mCompact(false), mString(&out.ref()), mFile(0), mStaged(0)
+    {
+        reserve(sizeHint);
+    }
 
     Serializer(FILE *f)
-        : mError(false), mBuffer(new FileBuffer(f))
+        : mError(false), mCompact(false), mString(0), mFile(f), mStaging(new char[FileStagingSize]), mStaged(0)
     {
         assert(f);
     }
 
+    ~Serializer()
+    {
+        flush();
+    }
+
+    // makes room for size more bytes in a string
+    void reserve(size_t size)
+    {
+        if (mString && size != String::npos)
+            mString->reserve(mString->size() + size);
+    }
+
     bool write(const String &string)
     {
         return write(string.constData(), string.size());
@@ -57,6 +92,18 @@ public:
         assert(len > 0);
         if (mError)
             return false;
+        if (mString) {
+            mString->append(static_cast<const char *>(data), len);
+            return true;
+        }
+        if (mFile) {
+            if (mStaged + len <= FileStagingSize) {
+                memcpy(mStaging.get() + mStaged, data, len);
+                mStaged += len;
+                return true;
+            }
+            return writeFile(data, len);
+        }
         if (!mBuffer->write(data, len)) {
             mError = true;
             return false;
@@ -64,12 +111,53 @@ public:
         return true;
     }
 
+    // writes what's staged for a file
+    bool flush()
+    {
+        if (!mStaged || mError)
+            return !mError;
+        const size_t staged = mStaged;
+        mStaged = 0;
+        if (fwrite(mStaging.get(), sizeof(char), staged, mFile) != staged)
+            mError = true;
+        return !mError;
+    }
+
     int pos() const
     {
+        if (mString)
+            return mString->size();
+        if (mFile)
+            return static_cast<int>(ftell(mFile)) + mStaged;
         return mBuffer->pos();
     }
 
     bool hasError() const { return mError; }
+
+    // In the compact format integers wider than a byte, lengths included,
+    // are varints, zigzagged when signed, and Value writes a one byte
+    // type and its map keys through writeKey(). Lists of native types
+    // stay one block of memory so Span can still point into them.
+    // serializedSize() is only exact for the default format.
+    bool isCompact() const { return mCompact; }
+    void setCompact(bool compact) { mCompact = compact; }
+
+    bool writeVarint(uint64_t value)
+    {
+        unsigned char buf[10];
+        int len = 0;
+        while (value >= 0x80) {
+            buf[len++] = static_cast<unsigned char>(value | 0x80);
+            value >>= 7;
+        }
+        buf[len++] = static_cast<unsigned char>(value);
+        return write(buf, len);
+    }
+
+    // Strings that repeat, like map keys, are written the first time and
+    // as the index of the first time after that
+    void writeKey(const String &key);
+
 #ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
     template <typename T>
     bool encodeType()
@@ -83,67 +171,54 @@ public:
     template <typename T> bool encodeType() { return true; }
 #endif
 private:
-    class StringBuffer : public Buffer
+    bool writeFile(const void *data, int len)
     {
-    public:
-        StringBuffer(std::string &out)
-            : mString(&out)
-        {}
-        StringBuffer(String &out)
-            : mString(&out.ref())
-        {}
-
-        virtual bool write(const void *data, int len) override
-        {
-            mString->append(static_cast<const char*>(data), len);
-            return true;
-        }
-        virtual int pos() const override { return mString->size(); }
-    private:
-        std::string *mString;
-    };
-    class FileBuffer : public Buffer
-    {
-    public:
-        FileBuffer(FILE *f)
-            : mFile(f)
-        {
-            assert(f);
-        }
-
-        virtual bool write(const void *data, int len) override
-        {
-            assert(mFile);
-            const size_t ret = fwrite(data, sizeof(char), len, mFile);
-            return (ret == static_cast<size_t>(len));
-        }
-
-        virtual int pos() const override
-        {
-            return static_cast<int>(ftell(mFile));
+        if (!flush())
+            return false;
+        if (len < FileStagingSize) {
+            memcpy(mStaging.get(), data, len);
+            mStaged = len;
+        } else if (fwrite(data, sizeof(char), len, mFile) != static_cast<size_t>(len)) {
+            mError = true;
         }
-    private:
-        FILE *mFile;
-    };
+        return !mError;
+    }
 
-    bool mError;
+    bool mError, mCompact;
+    std::string *mString;
+    FILE *mFile;
+    std::unique_ptr<char[]> mStaging;
+    int mStaged;
     std::unique_ptr<Buffer> mBuffer;
+    Hash<String, uint32_t> mKeys;
+
+    Serializer(const Serializer &) = delete;
+    Serializer &operator=(const Serializer &) = delete;
 };
 
 class Deserializer
 {
 public:
+    typedef std::pair<const char *, size_t> Chunk;
+
     Deserializer(const char *data, int length, const char *key = "")
-        : mData(data), mLength(length), mPos(0), mFile(0), mKey(key)
+        : mData(data), mLength(length), mPos(0), mChunks(0), mChunkCount(0), mFile(0), mKey(key), mArena(0), mCompact(false)
     {}
 
     Deserializer(const String &string, const char *key = "")
         : mString(string), mData(mString.constData()), mLength(mString.size()),
-          mPos(0), mFile(0), mKey(key)
+          mPos(0), mChunks(0), mChunkCount(0), mFile(0), mKey(key), mArena(0), mCompact(false)
+    {}
+
+    // reads data spread over several chunks in place, the chunks have
+    // to outlive the deserializer
+    Deserializer(const Chunk *chunks, size_t count, const char *key = "")
+        : mData(0), mLength(chunksLength(chunks, count)), mPos(0), mChunks(chunks), mChunkCount(count),
+          mChunk(0), mChunkPos(0), mFile(0), mKey(key), mArena(0), mCompact(false)
     {}
 
     Deserializer(FILE *file, const char *key = "")
-        : mData(0), mLength(0), mFile(file), mKey(key)
+        : mData(0), mLength(0), mChunks(0), mChunkCount(0), mFile(file), mKey(key), mArena(0), mCompact(false)
     {
         assert(file);
     }
@@ -155,6 +230,9 @@ public:
                 assert(mPos + len <= mLength);
                 memcpy(target, mData + mPos, len);
                 return len;
+            } else if (mChunks) {
+                size_t chunk = mChunk, chunkPos = mChunkPos;
+                return readChunks(target, len, chunk, chunkPos);
             } else {
                 assert(mFile);
                 const int read = fread(target, sizeof(char), len, mFile);
@@ -181,6 +259,10 @@ public:
                 memcpy(target, mData + mPos, len);
                 mPos += len;
                 return len;
+            } else if (mChunks) {
+                const int read = readChunks(target, len, mChunk, mChunkPos);
+                mPos += read;
+                return read;
             } else {
                 assert(mFile);
                 return fread(target, sizeof(char), len, mFile);
@@ -189,8 +271,97 @@ public:
         return 0;
     }
 
+    // skips len bytes and returns where they are in the source, for
+    // decoding StringView and Span without copying. Data that isn't
+    // contiguous in memory, in a file or across chunks, is copied to
+    // storage owned by the deserializer instead.
+    const char *view(int len)
+    {
+        if (mData) {
+            assert(mPos + len <= mLength);
+            const char *ret = mData + mPos;
+            mPos += len;
+            return ret;
+        } else if (mChunks && mChunk < mChunkCount && mChunkPos + len <= mChunks[mChunk].second) {
+            const char *ret = mChunks[mChunk].first + mChunkPos;
+            mChunkPos += len;
+            if (mChunkPos == mChunks[mChunk].second) {
+                ++mChunk;
+                mChunkPos = 0;
+            }
+            mPos += len;
+            return ret;
+        }
+        char *ret = storage(len);
+        read(ret, len);
+        return ret;
+    }
+
+    // the next len bytes without skipping them, like view()
+    const char *peekView(int len)
+    {
+        if (mData) {
+            assert(mPos + len <= mLength);
+            return mData + mPos;
+        } else if (mChunks && mChunk < mChunkCount && mChunkPos + len <= mChunks[mChunk].second) {
+            return mChunks[mChunk].first + mChunkPos;
+        }
+        char *ret = storage(len);
+        peek(ret, len);
+        return ret;
+    }
+
+    // storage for len bytes that lives as long as the deserializer, or
+    // the arena when it has one
+    char *storage(int len)
+    {
+        if (mArena)
+            return static_cast<char *>(mArena->allocate(len, 1));
+        mStorage.push_back(String(len, '\0'));
+        return mStorage.back().data();
+    }
+
+    // Where what's decoded may allocate, Message::create() puts the
+    // message there. Views of data that had to be copied then live as
+    // long as the arena rather than the deserializer.
+    void setArena(Arena *arena) { mArena = arena; }
+    Arena *arena() const { return mArena; }
+
     bool atEnd() const { return mPos == mLength; }
 
+    // see Serializer::setCompact()
+    bool isCompact() const { return mCompact; }
+    void setCompact(bool compact) { mCompact = compact; }
+
+    uint64_t readVarint()
+    {
+        uint64_t ret = 0;
+        if (mData) {
+            for (int shift = 0; shift < 64 && mPos < mLength; shift += 7) {
+                const unsigned char byte = mData[mPos++];
+                ret |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    return ret;
+            }
+            return ret;
+        }
+        for (int shift = 0; shift < 64; shift += 7) {
+            unsigned char byte = 0;
+            if (read(&byte, 1) != 1)
+                break;
+            ret |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        return ret;
+    }
+
+    // see Serializer::writeKey()
+    void readKey(String &key);
+    // the keys read so far, in the order they're referred to
+    const List<String> &keys() const { return mKeys; }
+    void addKey(const String &key) { mKeys.append(key); }
+
     int pos() const { return mFile ? ftell(mFile) : mPos; }
     int length() const { return mFile ? Rct::fileSize(mFile) : mLength; }
 #ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
@@ -210,12 +381,43 @@ public:
     template <typename T> bool decodeType() { return true; }
 #endif
 private:
+    static int chunksLength(const Chunk *chunks, size_t count)
+    {
+        size_t length = 0;
+        for (size_t i = 0; i < count; ++i)
+            length += chunks[i].second;
+        return length;
+    }
+    int readChunks(void *target, int len, size_t &chunk, size_t &chunkPos) const
+    {
+        assert(mPos + len <= mLength);
+        char *out = static_cast<char *>(target);
+        int read = 0;
+        while (read < len && chunk < mChunkCount) {
+            const size_t count = std::min<size_t>(mChunks[chunk].second - chunkPos, len - read);
+            memcpy(out + read, mChunks[chunk].first + chunkPos, count);
+            read += count;
+            chunkPos += count;
+            if (chunkPos == mChunks[chunk].second) {
+                ++chunk;
+                chunkPos = 0;
+            }
+        }
+        return read;
+    }
+
     String mString;
     const char *mData;
     const int mLength;
     int mPos;
+    const Chunk *mChunks;
+    size_t mChunkCount, mChunk, mChunkPos;
     FILE *mFile;
     const char *mKey;
+    Arena *mArena;
+    std::deque<String> mStorage;
+    bool mCompact;
+    List<String> mKeys;
 };
 
 template <typename T>
@@ -232,19 +434,60 @@ Deserializer &operator>>(Deserializer &s, T &t)
     return s;
 }
 
+// The exact number of bytes operator<< writes for t
+template <typename T>
+size_t serializedSize(const T &t)
+{
+    YouNeedToDeclareSerializedSize(t);
+    return 0;
+}
+
 template <typename T>
 struct FixedSize
 {
     static constexpr size_t value = 0;
 };
+// integers that are varints in the compact format
+template <typename T>
+struct VarintSerializable
+{
+    static constexpr bool value = std::is_integral<T>::value && sizeof(T) > 1;
+};
+
+template <typename T>
+inline uint64_t toVarint(T t)
+{
+    if (std::is_signed<T>::value) {
+        const int64_t value = static_cast<int64_t>(t);
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+    return static_cast<uint64_t>(t);
+}
+
+template <typename T>
+inline T fromVarint(uint64_t value)
+{
+    if (std::is_signed<T>::value)
+        return static_cast<T>(static_cast<int64_t>((value >> 1) ^ (0 - (value & 1))));
+    return static_cast<T>(value);
+}
+
 #define DECLARE_NATIVE_TYPE(T)                                      \
     template <> struct FixedSize<T>                                 \
     {                                                               \
         static constexpr size_t value = sizeof(T);                  \
     };                                                              \
+    template <> inline size_t serializedSize(const T &)             \
+    {                                                               \
+        return Serializer::sizeOf<T>();                             \
+    }                                                               \
     template <> inline Serializer &operator<<(Serializer &s,        \
                                               const T &t)           \
     {                                                               \
+        if (VarintSerializable<T>::value && s.isCompact()) {        \
+            s.writeVarint(toVarint(t));                             \
+            return s;                                               \
+        }                                                           \
         s.encodeType<T>();                                          \
         union {                                                     \
             T orig;                                                 \
@@ -257,6 +500,10 @@ struct FixedSize
     template <> inline Deserializer &operator>>(Deserializer &s,    \
                                                 T &t)               \
     {                                                               \
+        if (VarintSerializable<T>::value && s.isCompact()) {        \
+            t = fromVarint<T>(s.readVarint());                      \
+            return s;                                               \
+        }                                                           \
         if (s.decodeType<T>()) {                                    \
             union {                                                 \
                 T value;                                            \
@@ -284,6 +531,19 @@ DECLARE_NATIVE_TYPE(unsigned long long);
 DECLARE_NATIVE_TYPE(float);
 DECLARE_NATIVE_TYPE(double);
 
+// Lists of these are written and read as one block of memory, the same
+// bytes the element by element encoding produces
+template <typename T>
+struct BulkSerializable
+{
+#ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
+    static constexpr bool value = false;
+#else
+    // List<bool> is a bit vector
+    static constexpr bool value = FixedSize<T>::value && !std::is_same<T, bool>::value;
+#endif
+};
+
 template <>
 inline Serializer &operator<<(Serializer &s, const String &string)
 {
@@ -311,14 +571,26 @@ inline Serializer &operator<<(Serializer &s, const LogLevel &level)
     return s;
 }
 
+template <typename T>
+void serializeElements(Serializer &s, const List<T> &list, std::false_type)
+{
+    for (const T &t : list)
+        s << t;
+}
+
+template <typename T>
+void serializeElements(Serializer &s, const List<T> &list, std::true_type)
+{
+    s.write(list.data(), list.size() * sizeof(T));
+}
+
 template <typename T>
 Serializer &operator<<(Serializer &s, const List<T> &list)
 {
     const uint32_t size = list.size();
     s << size;
-    for (uint32_t i=0; i<size; ++i) {
-        s << list.at(i);
-    }
+    if (size)
+        serializeElements(s, list, std::integral_constant<bool, BulkSerializable<T>::value>());
     return s;
 }
 
@@ -424,6 +696,19 @@ Deserializer &operator>>(Deserializer &s, Hash<Key, Value> &map)
     return s;
 }
 
+template <typename T>
+void deserializeElements(Deserializer &s, List<T> &list, std::false_type)
+{
+    for (T &t : list)
+        s >> t;
+}
+
+template <typename T>
+void deserializeElements(Deserializer &s, List<T> &list, std::true_type)
+{
+    s.read(list.data(), list.size() * sizeof(T));
+}
+
 template <typename T>
 Deserializer &operator>>(Deserializer &s, List<T> &list)
 {
@@ -431,9 +716,7 @@ Deserializer &operator>>(Deserializer &s, List<T> &list)
     s >> size;
     if (size) {
         list.resize(size);
-        for (uint32_t i=0; i<size; ++i) {
-            s >> list[i];
-        }
+        deserializeElements(s, list, std::integral_constant<bool, BulkSerializable<T>::value>());
     }
     return s;
 }
@@ -493,4 +776,228 @@ inline Deserializer &operator>>(Deserializer &s, LogLevel &level)
     return s;
 }
 
+// Views into the deserializer's source, valid as long as that is. They're
+// encoded exactly like String and List<T>.
+template <>
+inline Serializer &operator<<(Serializer &s, const StringView &string)
+{
+    const uint32_t size = string.size();
+    s << size;
+    if (size)
+        s.write(string.constData(), size);
+    return s;
+}
+
+template <>
+inline Deserializer &operator>>(Deserializer &s, StringView &string)
+{
+    uint32_t size = 0;
+    s >> size;
+    string = StringView(size ? s.view(size) : 0, size);
+    return s;
+}
+
+template <typename T>
+Serializer &operator<<(Serializer &s, const Span<T> &span)
+{
+    const uint32_t size = span.size();
+    s << size;
+    for (const T &t : span)
+        s << t;
+    return s;
+}
+
+// only for the native types, whose lists are stored as an array
+template <typename T>
+Deserializer &operator>>(Deserializer &s, Span<const T> &span)
+{
+    static_assert(FixedSize<T>::value, "Span can only be decoded for native types");
+    uint32_t size = 0;
+    s >> size;
+    if (!size) {
+        span = Span<const T>();
+        return s;
+    }
+#ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
+    T *data = reinterpret_cast<T *>(s.storage(size * sizeof(T)));
+    for (uint32_t i=0; i<size; ++i)
+        s >> data[i];
+#else
+    const char *data = s.view(size * sizeof(T));
+    if (reinterpret_cast<uintptr_t>(data) % alignof(T)) {
+        char *aligned = s.storage(size * sizeof(T));
+        memcpy(aligned, data, size * sizeof(T));
+        data = aligned;
+    }
+#endif
+    span = Span<const T>(reinterpret_cast<const T *>(data), size);
+    return s;
+}
+
+template <>
+inline size_t serializedSize(const String &string)
+{
+    return Serializer::sizeOf<uint32_t>() + string.size();
+}
+
+template <>
+inline size_t serializedSize(const Path &path)
+{
+    return Serializer::sizeOf<uint32_t>() + path.size();
+}
+
+template <>
+inline size_t serializedSize(const LogLevel &)
+{
+    return Serializer::sizeOf<int>();
+}
+
+template <typename First, typename Second>
+size_t serializedSize(const std::pair<First, Second> &pair)
+{
+    return serializedSize(pair.first) + serializedSize(pair.second);
+}
+
+template <typename T>
+size_t serializedElementsSize(const List<T> &list, std::false_type)
+{
+    size_t size = 0;
+    for (const auto &t : list)
+        size += serializedSize(t);
+    return size;
+}
+
+template <typename T>
+size_t serializedElementsSize(const List<T> &list, std::true_type)
+{
+    return list.size() * sizeof(T);
+}
+
+template <typename T>
+size_t serializedSize(const List<T> &list)
+{
+    return Serializer::sizeOf<uint32_t>()
+        + serializedElementsSize(list, std::integral_constant<bool, BulkSerializable<T>::value>());
+}
+
+template <typename T>
+size_t serializedSize(const Set<T> &set)
+{
+    size_t size = Serializer::sizeOf<uint32_t>();
+    for (const auto &t : set)
+        size += serializedSize(t);
+    return size;
+}
+
+template <typename Key, typename Value>
+size_t serializedSize(const Map<Key, Value> &map)
+{
+    size_t size = Serializer::sizeOf<uint32_t>();
+    for (const auto &it : map)
+        size += serializedSize(it.first) + serializedSize(it.second);
+    return size;
+}
+
+template <typename Key, typename Value>
+size_t serializedSize(const MultiMap<Key, Value> &map)
+{
+    size_t size = Serializer::sizeOf<uint32_t>();
+    for (const auto &it : map)
+        size += serializedSize(it.first) + serializedSize(it.second);
+    return size;
+}
+
+template <typename Key, typename Value>
+size_t serializedSize(const Hash<Key, Value> &map)
+{
+    size_t size = Serializer::sizeOf<uint32_t>();
+    for (const auto &it : map)
+        size += serializedSize(it.first) + serializedSize(it.second);
+    return size;
+}
+
+template <>
+inline size_t serializedSize(const StringView &string)
+{
+    return Serializer::sizeOf<uint32_t>() + string.size();
+}
+
+template <typename T>
+size_t serializedSize(const Span<T> &span)
+{
+    size_t size = Serializer::sizeOf<uint32_t>();
+    for (const T &t : span)
+        size += serializedSize(t);
+    return size;
+}
+
+// Field packs, serializeFields(s, a, b, c) is s << a << b << c and
+// serializedFieldsSize(a, b, c) is exactly what that writes
+inline void serializeFields(Serializer &)
+{
+}
+
+template <typename T, typename... Args>
+void serializeFields(Serializer &s, const T &t, const Args &... args)
+{
+    s << t;
+    serializeFields(s, args...);
+}
+
+inline void deserializeFields(Deserializer &)
+{
+}
+
+template <typename T, typename... Args>
+void deserializeFields(Deserializer &s, T &t, Args &... args)
+{
+    s >> t;
+    deserializeFields(s, args...);
+}
+
+inline size_t serializedFieldsSize()
+{
+    return 0;
+}
+
+template <typename T, typename... Args>
+size_t serializedFieldsSize(const T &t, const Args &... args)
+{
+    return serializedSize(t) + serializedFieldsSize(args...);
+}
+
+inline void Serializer::writeKey(const String &key)
+{
+    if (!mCompact) {
+        *this << key;
+        return;
+    }
+    uint32_t &index = mKeys[key];
+    if (index) {
+        writeVarint(index);
+        return;
+    }
+    index = mKeys.size();
+    writeVarint(0);
+    *this << key;
+}
+
+inline void Deserializer::readKey(String &key)
+{
+    if (!mCompact) {
+        *this >> key;
+        return;
+    }
+    const uint64_t index = readVarint();
+    if (!index) {
+        *this >> key;
+        mKeys.append(key);
+    } else if (index <= mKeys.size()) {
+        key = mKeys.at(index - 1);
+    } else {
+        error() << "Invalid key index" << index << "for" << mKey;
+        key.clear();
+    }
+}
+
 #endif
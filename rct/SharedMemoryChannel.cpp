@@ -0,0 +1,548 @@
+#include "SharedMemoryChannel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "Allocations.h"
+#include "EventLoop.h"
+#include "Log.h"
+#include "rct/rct-config.h"
+#include "Rct.h"
+#include "SocketClient.h"
+#include "Timer.h"
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "the rings need lock free atomics");
+
+enum {
+    Magic = 0x52435452,
+    MinimumCapacity = 4096,
+    // where the data of the rings starts
+    DataOffset = 4096,
+    // with several producers a failed send() can't count on being woken
+    // up, another producer may have taken the wakeup, it's retried
+    RetryInterval = 10
+};
+
+namespace {
+struct Control
+{
+    // producers reserve at head, the consumer frees up to tail, both only
+    // grow
+    std::atomic<uint64_t> head;
+    char pad0[64 - sizeof(std::atomic<uint64_t>)];
+    std::atomic<uint64_t> tail;
+    char pad1[64 - sizeof(std::atomic<uint64_t>)];
+    std::atomic<uint32_t> consumerWaiting, producerWaiting;
+    char pad2[64 - 2 * sizeof(std::atomic<uint32_t>)];
+};
+
+struct Layout
+{
+    uint32_t magic, capacity, mode;
+    char pad[64 - 3 * sizeof(uint32_t)];
+    Control rings[2];
+};
+static_assert(sizeof(Layout) <= DataOffset, "the control blocks fit before the data");
+
+// In front of every record, 8 byte aligned. size is stored last, a record
+// is there once it's not 0. The consumer zeroes what it has consumed so a
+// record that isn't there yet reads as 0.
+struct Record
+{
+    enum Kind { Message = 1, Skip = 2 };
+    // of the message, or of the whole record when it's skipped
+    std::atomic<uint32_t> size;
+    uint32_t kind;
+};
+static_assert(sizeof(Record) == 8, "records stay 8 byte aligned");
+
+inline uint32_t recordSize(uint32_t size)
+{
+    return (sizeof(Record) + size + 7) & ~7;
+}
+
+// writes a message into the record it's serialized for
+class RecordWriter : public Serializer::Buffer
+{
+public:
+    RecordWriter(char *data, size_t size)
+        : mData(data), mSize(size), mPos(0)
+    {}
+
+    virtual bool write(const void *data, int len) override
+    {
+        if (mPos + len > mSize)
+            return false;
+        memcpy(mData + mPos, data, len);
+        mPos += len;
+        return true;
+    }
+    virtual int pos() const override { return static_cast<int>(mPos); }
+
+private:
+    char *mData;
+    const size_t mSize;
+    size_t mPos;
+};
+}
+
+static inline Layout *layout(char *base)
+{
+    return reinterpret_cast<Layout *>(base);
+}
+
+static bool createNotifier(int fds[2])
+{
+#ifdef HAVE_EVENTFD
+    fds[0] = fds[1] = ::eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    return fds[0] != -1;
+#else
+    int ret;
+    eintrwrap(ret, ::pipe(fds));
+    if (ret == -1)
+        return false;
+    for (int i = 0; i < 2; ++i) {
+        SocketClient::setFlags(fds[i], O_NONBLOCK, F_GETFL, F_SETFL);
+        SocketClient::setFlags(fds[i], FD_CLOEXEC, F_GETFD, F_SETFD);
+    }
+    return true;
+#endif
+}
+
+static void notify(const int fds[2])
+{
+    int ret;
+#ifdef HAVE_EVENTFD
+    const uint64_t one = 1;
+    eintrwrap(ret, ::write(fds[1], &one, sizeof(one)));
+#else
+    // a full pipe has a wakeup in it already
+    const char c = 'w';
+    eintrwrap(ret, ::write(fds[1], &c, sizeof(c)));
+#endif
+    (void)ret;
+}
+
+static void drainNotifier(const int fds[2])
+{
+    int ret;
+#ifdef HAVE_EVENTFD
+    uint64_t value;
+    eintrwrap(ret, ::read(fds[0], &value, sizeof(value)));
+#else
+    char buf[64];
+    do {
+        eintrwrap(ret, ::read(fds[0], buf, sizeof(buf)));
+    } while (ret == sizeof(buf));
+#endif
+    (void)ret;
+}
+
+static void closeNotifier(int fds[2])
+{
+    int ret;
+    if (fds[0] != -1)
+        eintrwrap(ret, ::close(fds[0]));
+    if (fds[1] != -1 && fds[1] != fds[0])
+        eintrwrap(ret, ::close(fds[1]));
+    fds[0] = fds[1] = -1;
+}
+
+static int createMemory(size_t size)
+{
+    int fd = -1;
+#ifdef HAVE_MEMFD_CREATE
+    fd = ::memfd_create("rct-channel", MFD_CLOEXEC);
+#else
+    static std::atomic<unsigned int> counter(0);
+    char name[64];
+    for (int attempt = 0; fd == -1 && attempt < 16; ++attempt) {
+        snprintf(name, sizeof(name), "/rct-channel-%d-%u", getpid(), counter.fetch_add(1));
+        fd = ::shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+        if (fd == -1 && errno != EEXIST)
+            break;
+    }
+    if (fd != -1) {
+        // the descriptors are how it's shared
+        ::shm_unlink(name);
+        SocketClient::setFlags(fd, FD_CLOEXEC, F_GETFD, F_SETFD);
+    }
+#endif
+    if (fd == -1)
+        return -1;
+    int ret;
+    eintrwrap(ret, ::ftruncate(fd, size));
+    if (ret == -1) {
+        eintrwrap(ret, ::close(fd));
+        return -1;
+    }
+    return fd;
+}
+
+SharedMemoryChannel::SharedMemoryChannel(int version)
+    : mVersion(version), mMode(SingleProducer), mCapacity(0), mMappedSize(0), mMemory(-1), mSide(0),
+      mBase(0), mRetryTimer(0)
+{
+    for (int i = 0; i < 2; ++i)
+        mDataFds[i][0] = mDataFds[i][1] = mRoomFds[i][0] = mRoomFds[i][1] = -1;
+}
+
+SharedMemoryChannel::~SharedMemoryChannel()
+{
+    unlisten();
+    closeAll();
+}
+
+void SharedMemoryChannel::unlisten()
+{
+    if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+        if (mRetryTimer)
+            loop->unregisterTimer(mRetryTimer);
+        if (mDataFds[!mSide][0] != -1)
+            loop->unregisterSocket(mDataFds[!mSide][0]);
+        if (mRoomFds[mSide][0] != -1)
+            loop->unregisterSocket(mRoomFds[mSide][0]);
+    }
+    mRetryTimer = 0;
+}
+
+void SharedMemoryChannel::closeAll()
+{
+    if (mBase)
+        ::munmap(mBase, mMappedSize);
+    mBase = 0;
+    int ret;
+    if (mMemory != -1)
+        eintrwrap(ret, ::close(mMemory));
+    mMemory = -1;
+    for (int i = 0; i < 2; ++i) {
+        closeNotifier(mDataFds[i]);
+        closeNotifier(mRoomFds[i]);
+    }
+}
+
+SharedMemoryChannel::SharedPtr SharedMemoryChannel::create(size_t capacity, Mode mode, int version)
+{
+    size_t size = MinimumCapacity;
+    while (size < capacity && size < (1U << 31))
+        size <<= 1;
+
+    SharedPtr channel(new SharedMemoryChannel(version));
+    channel->mMode = mode;
+    channel->mCapacity = size;
+    channel->mMemory = createMemory(DataOffset + 2 * size);
+    bool ok = channel->mMemory != -1 && channel->map(channel->mMemory, DataOffset + 2 * size);
+    for (int i = 0; ok && i < 2; ++i)
+        ok = createNotifier(channel->mDataFds[i]) && createNotifier(channel->mRoomFds[i]);
+    if (!ok) {
+        error("SharedMemoryChannel: couldn't create a channel of %zu bytes: %s", size, Rct::strerror().constData());
+        return SharedPtr();
+    }
+
+    // the memory is zeroed, consumers start out waiting
+    Layout *l = layout(channel->mBase);
+    l->capacity = size;
+    l->mode = mode;
+    for (Control &control : l->rings)
+        control.consumerWaiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    l->magic = Magic;
+
+    if (!channel->listen())
+        return SharedPtr();
+    return channel;
+}
+
+SharedMemoryChannel::SharedPtr SharedMemoryChannel::open(const String &handle, int version)
+{
+    SharedPtr channel(new SharedMemoryChannel(version));
+    channel->mSide = 1;
+    int (&data)[2][2] = channel->mDataFds;
+    int (&room)[2][2] = channel->mRoomFds;
+    if (sscanf(handle.constData(), "%d,%d,%d,%d,%d,%d,%d,%d,%d", &channel->mMemory,
+               &data[0][0], &data[0][1], &data[1][0], &data[1][1],
+               &room[0][0], &room[0][1], &room[1][0], &room[1][1]) != 9) {
+        error("SharedMemoryChannel: invalid handle %s", handle.constData());
+        channel->mMemory = -1;
+        for (int i = 0; i < 2; ++i)
+            data[i][0] = data[i][1] = room[i][0] = room[i][1] = -1;
+        return SharedPtr();
+    }
+    // they're ours now, they shouldn't go further
+    channel->setInheritable(false);
+
+    struct stat st;
+    if (::fstat(channel->mMemory, &st) || static_cast<size_t>(st.st_size) <= DataOffset
+        || !channel->map(channel->mMemory, st.st_size)) {
+        error("SharedMemoryChannel: couldn't map %s: %s", handle.constData(), Rct::strerror().constData());
+        return SharedPtr();
+    }
+    Layout *l = layout(channel->mBase);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (l->magic != Magic || DataOffset + 2 * static_cast<size_t>(l->capacity) != static_cast<size_t>(st.st_size)) {
+        error("SharedMemoryChannel: %s isn't a channel", handle.constData());
+        return SharedPtr();
+    }
+    channel->mCapacity = l->capacity;
+    channel->mMode = static_cast<Mode>(l->mode);
+    if (!channel->listen())
+        return SharedPtr();
+    return channel;
+}
+
+bool SharedMemoryChannel::map(int fd, size_t size)
+{
+    void *base = ::mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        return false;
+    mBase = static_cast<char *>(base);
+    mMappedSize = size;
+    return true;
+}
+
+bool SharedMemoryChannel::listen()
+{
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop) {
+        error("SharedMemoryChannel: no event loop");
+        return false;
+    }
+    WeakPtr weak = shared_from_this();
+    // with several producers the creating side only receives and the
+    // others only send
+    if (mMode == SingleProducer || !mSide) {
+        loop->registerSocket(mDataFds[!mSide][0], EventLoop::SocketRead, [weak](int, unsigned int) {
+                if (SharedPtr channel = weak.lock())
+                    channel->receive();
+            });
+        // anything sent before we got here
+        loop->callLater([weak]() {
+                if (SharedPtr channel = weak.lock())
+                    channel->receive();
+            });
+    }
+    if (mMode == SingleProducer || mSide) {
+        loop->registerSocket(mRoomFds[mSide][0], EventLoop::SocketRead, [weak](int, unsigned int) {
+                if (SharedPtr channel = weak.lock()) {
+                    drainNotifier(channel->mRoomFds[channel->mSide]);
+                    channel->mWritable(channel);
+                }
+            });
+    }
+    return true;
+}
+
+String SharedMemoryChannel::handle() const
+{
+    return String::format<128>("%d,%d,%d,%d,%d,%d,%d,%d,%d", mMemory,
+                               mDataFds[0][0], mDataFds[0][1], mDataFds[1][0], mDataFds[1][1],
+                               mRoomFds[0][0], mRoomFds[0][1], mRoomFds[1][0], mRoomFds[1][1]);
+}
+
+void SharedMemoryChannel::setInheritable(bool inheritable)
+{
+    const int fds[] = {
+        mMemory, mDataFds[0][0], mDataFds[0][1], mDataFds[1][0], mDataFds[1][1],
+        mRoomFds[0][0], mRoomFds[0][1], mRoomFds[1][0], mRoomFds[1][1]
+    };
+    for (int fd : fds) {
+        int flags;
+        if (fd == -1 || (flags = ::fcntl(fd, F_GETFD)) == -1)
+            continue;
+        ::fcntl(fd, F_SETFD, inheritable ? flags & ~FD_CLOEXEC : flags | FD_CLOEXEC);
+    }
+}
+
+size_t SharedMemoryChannel::pending() const
+{
+    if (!mBase)
+        return 0;
+    const Control &control = layout(mBase)->rings[mSide];
+    return control.head.load(std::memory_order_relaxed) - control.tail.load(std::memory_order_relaxed);
+}
+
+bool SharedMemoryChannel::send(const Message &message)
+{
+    if (!mBase) {
+        error("SharedMemoryChannel: the channel is closed (%d)", message.messageId());
+        return false;
+    }
+    if (mMode == MultiProducer && !mSide) {
+        error("SharedMemoryChannel: the creating side of a multi producer channel can't send (%d)", message.messageId());
+        return false;
+    }
+
+    // the frame is what Connection sends, size prefix included
+    const size_t encodedSize = Message::isCompact(mVersion) ? String::npos : message.encodedSize();
+    const bool direct = encodedSize != String::npos && !(message.mFlags & (Message::MessageCache|Message::Compressed));
+    String header, value;
+    size_t size;
+    if (direct) {
+        size = encodedSize + Message::headerExtra(0) + sizeof(int);
+    } else {
+        message.prepare(mVersion, header, value);
+        size = header.size() + value.size();
+    }
+    if (recordSize(size) > mCapacity / 2) {
+        error("SharedMemoryChannel: message of %zu bytes is too big for the channel (%d)", size, message.messageId());
+        return false;
+    }
+
+    // claim the record, and whatever is left at the end of the ring if it
+    // doesn't fit there
+    Control &control = layout(mBase)->rings[mSide];
+    char *data = mBase + DataOffset + mSide * mCapacity;
+    const uint32_t total = recordSize(size);
+    uint64_t pos = control.head.load(std::memory_order_relaxed);
+    uint64_t skip;
+    for (bool retried = false;;) {
+        const uint64_t offset = pos & (mCapacity - 1);
+        skip = offset + total > mCapacity ? mCapacity - offset : 0;
+        if (pos + skip + total - control.tail.load(std::memory_order_acquire) > mCapacity) {
+            if (retried) {
+                waitForRoom();
+                return false;
+            }
+            // the consumer tells us when there's room once this is set,
+            // unless it made some in the meantime
+            control.producerWaiting.store(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            retried = true;
+            continue;
+        }
+        if (mMode == SingleProducer) {
+            control.head.store(pos + skip + total, std::memory_order_relaxed);
+            break;
+        }
+        if (control.head.compare_exchange_weak(pos, pos + skip + total, std::memory_order_relaxed))
+            break;
+    }
+    if (skip) {
+        Record *record = reinterpret_cast<Record *>(data + (pos & (mCapacity - 1)));
+        record->kind = Record::Skip;
+        record->size.store(static_cast<uint32_t>(skip), std::memory_order_release);
+    }
+    Record *record = reinterpret_cast<Record *>(data + ((pos + skip) & (mCapacity - 1)));
+    char *frame = reinterpret_cast<char *>(record + 1);
+    bool ok = true;
+    if (direct) {
+        RCT_ALLOCATION_SCOPE(Allocations::SerializerSubsystem);
+        Serializer serializer(std::unique_ptr<Serializer::Buffer>(new RecordWriter(frame, size)));
+        message.encodeHeader(serializer, encodedSize, mVersion);
+        message.encode(serializer);
+        ok = !serializer.hasError() && serializer.pos() == static_cast<int>(size);
+    } else {
+        memcpy(frame, header.constData(), header.size());
+        if (!value.isEmpty())
+            memcpy(frame + header.size(), value.constData(), value.size());
+    }
+    // a failed record has been claimed, it's skipped
+    record->kind = ok ? Record::Message : Record::Skip;
+    record->size.store(ok ? static_cast<uint32_t>(size) : total, std::memory_order_release);
+
+    // the consumer checks for records after saying it waits
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (control.consumerWaiting.load(std::memory_order_relaxed) && control.consumerWaiting.exchange(0))
+        notify(mDataFds[mSide]);
+    if (!ok)
+        error("SharedMemoryChannel: couldn't serialize message (%d)", message.messageId());
+    return ok;
+}
+
+void SharedMemoryChannel::waitForRoom()
+{
+    if (mMode == SingleProducer || mRetryTimer)
+        return;
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop)
+        return;
+    WeakPtr weak = shared_from_this();
+    mRetryTimer = loop->registerTimer([weak](int) {
+            if (SharedPtr channel = weak.lock()) {
+                channel->mRetryTimer = 0;
+                channel->mWritable(channel);
+            }
+        }, RetryInterval, Timer::SingleShot);
+}
+
+void SharedMemoryChannel::receive()
+{
+    // a slot may drop the last reference to us
+    SharedPtr that = shared_from_this();
+    if (!mBase)
+        return;
+    const int side = !mSide;
+    Control &control = layout(mBase)->rings[side];
+    char *data = mBase + DataOffset + side * mCapacity;
+    drainNotifier(mDataFds[side]);
+
+    uint64_t pos = control.tail.load(std::memory_order_relaxed);
+    for (;;) {
+        const uint64_t offset = pos & (mCapacity - 1);
+        Record *record = reinterpret_cast<Record *>(data + offset);
+        uint32_t size = record->size.load(std::memory_order_acquire);
+        if (!size) {
+            // going to sleep, a producer that commits after this wakes us
+            control.consumerWaiting.store(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            size = record->size.load(std::memory_order_acquire);
+            if (!size)
+                break;
+            control.consumerWaiting.store(0, std::memory_order_relaxed);
+        }
+
+        // the other side can write anything here, a record that doesn't
+        // fit in what's left of the ring ends the channel
+        const uint32_t kind = record->kind;
+        const uint64_t total = kind == Record::Message ? (sizeof(Record) + static_cast<uint64_t>(size) + 7) & ~7ull : size;
+        if ((kind != Record::Message && kind != Record::Skip)
+            || (kind == Record::Message && size < sizeof(int))
+            || (total & 7) || total > mCapacity - offset) {
+            error("SharedMemoryChannel: invalid record of %u bytes, kind %u, closing the channel", size, kind);
+            close();
+            return;
+        }
+
+        std::shared_ptr<Message> message;
+        if (kind == Record::Message) {
+            // decoded straight out of the ring, past the size prefix
+            const char *frame = reinterpret_cast<const char *>(record + 1);
+            message = Message::create(mVersion, frame + sizeof(int), size - sizeof(int));
+            if (!message)
+                error("SharedMemoryChannel: couldn't decode message");
+        }
+        memset(static_cast<void *>(record), 0, total);
+        pos += total;
+        control.tail.store(pos, std::memory_order_release);
+        notifyRoom();
+        if (message)
+            mNewMessage(message, that);
+    }
+}
+
+void SharedMemoryChannel::close()
+{
+    if (!mBase)
+        return;
+    unlisten();
+    closeAll();
+    mClosed(shared_from_this());
+}
+
+void SharedMemoryChannel::notifyRoom()
+{
+    Control &control = layout(mBase)->rings[!mSide];
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (control.producerWaiting.load(std::memory_order_relaxed) && control.producerWaiting.exchange(0))
+        notify(mRoomFds[!mSide]);
+}
@@ -0,0 +1,101 @@
+#ifndef SHAREDMEMORYCHANNEL_H
+#define SHAREDMEMORYCHANNEL_H
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+
+#include <rct/Message.h>
+#include <rct/SignalSlot.h>
+#include <rct/String.h>
+
+// Messages between two processes through a ring buffer each way in shared
+// memory, for local IPC at rates where socket copies and syscalls add up.
+// A message is serialized straight into the ring and decoded straight out
+// of it, the only syscalls are wakeups of a side that ran out of messages
+// or room, an eventfd where there is one, a pipe otherwise:
+//
+//     SharedMemoryChannel::SharedPtr channel = SharedMemoryChannel::create();
+//     channel->setInheritable(true);
+//     process.start(worker, List<String>() << channel->handle());
+//     channel->setInheritable(false);
+//     channel->newMessage().connect([](const std::shared_ptr<Message> &message,
+//                                      const SharedMemoryChannel::SharedPtr &channel) { ... });
+//
+// and in the worker SharedMemoryChannel::open(argv[1]). Messages are
+// received on the loop of the thread that created or opened the channel.
+// With MultiProducer any number of processes can open the channel and
+// send to the creating side, which only receives. Messages are limited to
+// half of capacity().
+class SharedMemoryChannel : public std::enable_shared_from_this<SharedMemoryChannel>
+{
+public:
+    typedef std::shared_ptr<SharedMemoryChannel> SharedPtr;
+    typedef std::weak_ptr<SharedMemoryChannel> WeakPtr;
+
+    enum Mode { SingleProducer, MultiProducer };
+    enum { DefaultCapacity = 1024 * 1024 };
+
+    // capacity is rounded up to a power of two, null on failure
+    static SharedPtr create(size_t capacity = DefaultCapacity, Mode mode = SingleProducer, int version = 0);
+    // the other side, from handle()
+    static SharedPtr open(const String &handle, int version = 0);
+    ~SharedMemoryChannel();
+
+    Mode mode() const { return mMode; }
+    size_t capacity() const { return mCapacity; }
+
+    // The descriptors for open() in another process. They're passed on
+    // to processes started while they're inheritable, the channel closes
+    // them when it's destroyed.
+    String handle() const;
+    void setInheritable(bool inheritable);
+
+    // false when there's no room, writable() tells when there is. Safe
+    // from any thread with MultiProducer, from one at a time otherwise.
+    bool send(const Message &message);
+    // bytes sent and not yet received
+    size_t pending() const;
+
+    // Unmaps the rings and closes the descriptors, send() fails after
+    // this. It's done when the other side wrote something that isn't a
+    // valid record.
+    void close();
+    bool isOpen() const { return mBase != 0; }
+
+    Signal<std::function<void(const std::shared_ptr<Message> &, const SharedPtr &)> > &newMessage() { return mNewMessage; }
+    // after a send() failed for lack of room, once there is some
+    Signal<std::function<void(const SharedPtr &)> > &writable() { return mWritable; }
+    Signal<std::function<void(const SharedPtr &)> > &closed() { return mClosed; }
+
+private:
+    SharedMemoryChannel(int version);
+
+    bool map(int fd, size_t size);
+    bool listen();
+    void unlisten();
+    void receive();
+    void notifyRoom();
+    void waitForRoom();
+    void closeAll();
+
+    const int mVersion;
+    Mode mMode;
+    size_t mCapacity, mMappedSize;
+    int mMemory;
+    // one ring each way, we send on mSide and receive on the other
+    int mSide;
+    char *mBase;
+    // the read and write end of the notifier of each ring that its
+    // consumer waits on for data and its producers for room, one eventfd
+    // for both ends where there is one
+    int mDataFds[2][2], mRoomFds[2][2];
+    int mRetryTimer;
+    Signal<std::function<void(const std::shared_ptr<Message> &, const SharedPtr &)> > mNewMessage;
+    Signal<std::function<void(const SharedPtr &)> > mWritable, mClosed;
+
+    SharedMemoryChannel(const SharedMemoryChannel &) = delete;
+    SharedMemoryChannel &operator=(const SharedMemoryChannel &) = delete;
+};
+
+#endif
@@ -0,0 +1,136 @@
+#include "SharedMutex.h"
+
+#include <assert.h>
+#include <chrono>
+#include <thread>
+
+#include "rct/rct-config.h"
+#ifdef HAVE_SCHED_GETCPU
+#   include <sched.h>
+#endif
+
+SharedMutex::SharedMutex()
+    : mWriter(false)
+{
+    for (Slot &s : mSlots)
+        s.readers.store(0, std::memory_order_relaxed);
+}
+
+SharedMutex::Slot &SharedMutex::slot(Slot *slots)
+{
+#ifdef HAVE_SCHED_GETCPU
+    const int cpu = sched_getcpu();
+    if (cpu >= 0)
+        return slots[cpu % Slots];
+#endif
+    return slots[std::hash<std::thread::id>()(std::this_thread::get_id()) % Slots];
+}
+
+bool SharedMutex::readersGone() const
+{
+    long readers = 0;
+    for (const Slot &s : mSlots)
+        readers += s.readers.load();
+    assert(readers >= 0);
+    return !readers;
+}
+
+// Pairs with the writer setting mWriter before it sums the slots, with
+// sequentially consistent operations on both sides either the writer
+// sees this reader or the reader sees the writer.
+bool SharedMutex::tryRead(Slot &s)
+{
+    s.readers.fetch_add(1);
+    if (!mWriter.load())
+        return true;
+    s.readers.fetch_sub(1);
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCond.notify_all();
+    return false;
+}
+
+bool SharedMutex::lockForRead(int maxTime)
+{
+    if (tryRead(slot(mSlots)))
+        return true;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(maxTime);
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            while (mWriter.load()) {
+                if (maxTime <= 0) {
+                    mCond.wait(lock);
+                } else if (mCond.wait_until(lock, deadline) == std::cv_status::timeout && mWriter.load()) {
+                    return false;
+                }
+            }
+        }
+        if (tryRead(slot(mSlots)))
+            return true;
+    }
+}
+
+bool SharedMutex::tryLockForRead()
+{
+    return tryRead(slot(mSlots));
+}
+
+void SharedMutex::unlockRead()
+{
+    slot(mSlots).readers.fetch_sub(1);
+    if (mWriter.load()) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCond.notify_all();
+    }
+}
+
+bool SharedMutex::lockForWrite(int maxTime)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(maxTime);
+    if (maxTime <= 0) {
+        mWriterMutex.lock();
+    } else if (!mWriterMutex.try_lock_until(deadline)) {
+        return false;
+    }
+    mWriter.store(true);
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (!readersGone()) {
+        if (maxTime <= 0) {
+            mCond.wait(lock);
+        } else if (mCond.wait_until(lock, deadline) == std::cv_status::timeout && !readersGone()) {
+            mWriter.store(false);
+            mCond.notify_all();
+            lock.unlock();
+            mWriterMutex.unlock();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SharedMutex::tryLockForWrite()
+{
+    if (!mWriterMutex.try_lock())
+        return false;
+    mWriter.store(true);
+    if (readersGone())
+        return true;
+    mWriter.store(false);
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCond.notify_all();
+    }
+    mWriterMutex.unlock();
+    return false;
+}
+
+void SharedMutex::unlockWrite()
+{
+    assert(mWriter.load());
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mWriter.store(false);
+        mCond.notify_all();
+    }
+    mWriterMutex.unlock();
+}
@@ -0,0 +1,86 @@
+#ifndef SHAREDMUTEX_H
+#define SHAREDMUTEX_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+// A read/write lock for data that is read from many threads and rarely
+// written. Readers only touch a counter on their own cache line, picked
+// by the CPU they run on, so they don't contend with each other at all.
+// Writers pay for it: they wait for every slot to drain and the lock is
+// large, a few kilobytes. Writers have priority, readers arriving while
+// a writer waits hold off until it's done. Not recursive.
+class SharedMutex
+{
+public:
+    SharedMutex();
+
+    // maxTime in ms, 0 waits forever
+    bool lockForRead(int maxTime = 0);
+    bool tryLockForRead();
+    void unlockRead();
+
+    bool lockForWrite(int maxTime = 0);
+    bool tryLockForWrite();
+    void unlockWrite();
+
+    class ReadLocker
+    {
+    public:
+        ReadLocker(SharedMutex *lock)
+            : mLock(lock)
+        {
+            if (mLock && !mLock->lockForRead())
+                mLock = 0;
+        }
+        ~ReadLocker()
+        {
+            if (mLock)
+                mLock->unlockRead();
+        }
+    private:
+        SharedMutex *mLock;
+    };
+
+    class WriteLocker
+    {
+    public:
+        WriteLocker(SharedMutex *lock)
+            : mLock(lock)
+        {
+            if (mLock && !mLock->lockForWrite())
+                mLock = 0;
+        }
+        ~WriteLocker()
+        {
+            if (mLock)
+                mLock->unlockWrite();
+        }
+    private:
+        SharedMutex *mLock;
+    };
+
+private:
+    enum { Slots = 32, CacheLine = 64 };
+    // A reader may unlock on another CPU than it locked on, so single
+    // slots can go negative. Only the sum means anything.
+    struct alignas(CacheLine) Slot
+    {
+        std::atomic<long> readers;
+    };
+    static Slot &slot(Slot *slots);
+    bool readersGone() const;
+    bool tryRead(Slot &slot);
+
+    Slot mSlots[Slots];
+    alignas(CacheLine) std::atomic<bool> mWriter;
+    std::timed_mutex mWriterMutex;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+
+    SharedMutex(const SharedMutex &) = delete;
+    SharedMutex &operator=(const SharedMutex &) = delete;
+};
+
+#endif
@@ -2,11 +2,16 @@
 #define SIGNALSLOT_H
 
 #include <assert.h>
-#include <map>
+#include <memory>
 #include <mutex>
+#include <vector>
 
 #include <rct/EventLoop.h>
 
+// Slots are called in place, not copied per emission. A slot with state,
+// like a mutable lambda, keeps that state from one emission to the next,
+// and when several threads emit at once they call the same slot object
+// concurrently. Such slots have to do their own locking.
 template<typename Signature>
 class Signal
 {
@@ -20,16 +25,14 @@ public:
     Key connect(Call&& call)
     {
         std::lock_guard<std::mutex> locker(mutex);
-        connections.insert(std::make_pair(++id, std::forward<Call>(call)));
-        return id;
+        return add(Signature(std::forward<Call>(call)));
     }
 
     template<size_t Value, typename Call, typename std::enable_if<Value == EventLoop::Async, int>::type = 0>
     Key connect(Call&& call)
     {
         std::lock_guard<std::mutex> locker(mutex);
-        connections.insert(std::make_pair(++id, SignatureWrapper(std::forward<Call>(call))));
-        return id;
+        return add(SignatureWrapper(std::forward<Call>(call)));
     }
 
     // this connection type will std::move all the call arguments so if this type is used
@@ -38,22 +41,41 @@ public:
     Key connect(Call&& call)
     {
         std::lock_guard<std::mutex> locker(mutex);
-        assert(connections.empty());
-        connections.insert(std::make_pair(++id, SignatureMoveWrapper(std::forward<Call>(call))));
-        return id;
+        assert(!connections);
+        return add(SignatureMoveWrapper(std::forward<Call>(call)));
     }
 
     bool disconnect(Key key)
     {
         std::lock_guard<std::mutex> locker(mutex);
-        return connections.erase(key) == 1;
+        if (!connections)
+            return false;
+        for (size_t i = 0; i < connections->size(); ++i) {
+            if ((*connections)[i].first == key) {
+                if (connections->size() == 1) {
+                    connections.reset();
+                } else {
+                    std::shared_ptr<Connections> copy = std::make_shared<Connections>(*connections);
+                    copy->erase(copy->begin() + i);
+                    connections = std::move(copy);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool isEmpty() const
+    {
+        std::lock_guard<std::mutex> locker(mutex);
+        return !connections;
     }
 
     int disconnect()
     {
         std::lock_guard<std::mutex> locker(mutex);
-        const int ret = connections.size();
-        connections.clear();
+        const int ret = connections ? connections->size() : 0;
+        connections.reset();
         return ret;
     }
 
@@ -61,12 +83,14 @@ public:
     template<typename... Args>
     void operator()(Args&&... args)
     {
-        std::map<Key, Signature> conn;
-        {
-            std::lock_guard<std::mutex> locker(mutex);
-            conn = connections;
+        const std::shared_ptr<const Connections> conn = snapshot();
+        if (!conn)
+            return;
+        if (conn->size() == 1) {
+            conn->front().second(std::forward<Args>(args)...);
+            return;
         }
-        for (auto& connection : conn) {
+        for (auto& connection : *conn) {
             connection.second(std::forward<Args>(args)...);
         }
     }
@@ -74,12 +98,14 @@ public:
     template<typename... Args>
     void operator()(const Args&... args)
     {
-        std::map<Key, Signature> conn;
-        {
-            std::lock_guard<std::mutex> locker(mutex);
-            conn = connections;
+        const std::shared_ptr<const Connections> conn = snapshot();
+        if (!conn)
+            return;
+        if (conn->size() == 1) {
+            conn->front().second(args...);
+            return;
         }
-        for (auto& connection : conn) {
+        for (auto& connection : *conn) {
             connection.second(std::forward<const Args &>(args)...);
         }
     }
@@ -87,12 +113,10 @@ public:
     template<typename... Args>
     void operator()()
     {
-        std::map<Key, Signature> conn;
-        {
-            std::lock_guard<std::mutex> locker(mutex);
-            conn = connections;
-        }
-        for (auto& connection : conn) {
+        const std::shared_ptr<const Connections> conn = snapshot();
+        if (!conn)
+            return;
+        for (auto& connection : *conn) {
             connection.second();
         }
     }
@@ -102,7 +126,7 @@ private:
     {
     public:
         SignatureWrapper(Signature&& signature)
-            : loop(EventLoop::eventLoop()), call(std::move(signature))
+            : loop(EventLoop::weakEventLoop()), call(std::move(signature))
         {
         }
 
@@ -123,7 +147,7 @@ private:
     {
     public:
         SignatureMoveWrapper(Signature&& signature)
-            : loop(EventLoop::eventLoop()), call(std::move(signature))
+            : loop(EventLoop::weakEventLoop()), call(std::move(signature))
         {
         }
 
@@ -141,9 +165,32 @@ private:
     };
 
 private:
+    // Emitting only takes a reference to the current list, connecting and
+    // disconnecting replace it. Slots that disconnect during an emission
+    // still get that emission, the list they're in stays alive until it
+    // is done. Null when nothing is connected.
+    typedef std::vector<std::pair<Key, Signature> > Connections;
+
+    std::shared_ptr<const Connections> snapshot() const
+    {
+        std::lock_guard<std::mutex> locker(mutex);
+        return connections;
+    }
+
+    // called with mutex held
+    Key add(Signature&& call)
+    {
+        std::shared_ptr<Connections> copy = connections
+            ? std::make_shared<Connections>(*connections)
+            : std::make_shared<Connections>();
+        copy->emplace_back(++id, std::move(call));
+        connections = std::move(copy);
+        return id;
+    }
+
     Key id;
-    std::mutex mutex;
-    std::map<Key, Signature> connections;
+    mutable std::mutex mutex;
+    std::shared_ptr<const Connections> connections;
 };
 
 #endif
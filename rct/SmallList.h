@@ -0,0 +1,637 @@
+#ifndef SMALLLIST_H
+#define SMALLLIST_H
+
+#include <algorithm>
+#include <assert.h>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <new>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include <utility>
+
+#include <rct/List.h>
+#include <rct/Log.h>
+#include <rct/Serializer.h>
+#include <rct/Set.h>
+
+// A List that keeps up to N elements inside the object and only goes to
+// the heap when it grows beyond that. For short lists that are made and
+// thrown away a lot, like arguments or the components of a path:
+//
+//     SmallList<const char *, 16> args;
+//     args.append(command.constData());
+//
+// Has the API of List, converts to and from it and serializes the same
+// way, so one can be read as the other.
+template <typename T, size_t N = 8>
+class SmallList
+{
+    static_assert(N > 0, "SmallList needs room for at least one element");
+    // lists to take the elements of, as opposed to something that makes a T
+    template <typename Container>
+    using IfContainer = typename std::enable_if<!std::is_convertible<Container, T>::value>::type;
+public:
+    typedef T value_type;
+    typedef T *iterator;
+    typedef const T *const_iterator;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+
+    static const size_t npos = List<T>::npos;
+
+    explicit SmallList(size_t count = 0, const T &defaultValue = T())
+        : mData(inlineData()), mSize(0), mCapacity(N)
+    {
+        resize(count, defaultValue);
+    }
+
+    SmallList(std::initializer_list<T> list)
+        : SmallList(list.begin(), list.end())
+    {}
+
+    template <typename Iterator, typename = typename std::iterator_traits<Iterator>::iterator_category>
+    SmallList(Iterator first, Iterator last)
+        : mData(inlineData()), mSize(0), mCapacity(N)
+    {
+        for (; first != last; ++first)
+            append(*first);
+    }
+
+    SmallList(const std::vector<T> &other)
+        : SmallList(other.begin(), other.end())
+    {}
+
+    SmallList(const SmallList &other)
+        : SmallList(other.begin(), other.end())
+    {}
+
+    template <size_t M>
+    SmallList(const SmallList<T, M> &other)
+        : SmallList(other.begin(), other.end())
+    {}
+
+    SmallList(SmallList &&other)
+        : mData(inlineData()), mSize(0), mCapacity(N)
+    {
+        take(std::move(other));
+    }
+
+    ~SmallList()
+    {
+        clear();
+        release();
+    }
+
+    SmallList &operator=(const SmallList &other)
+    {
+        if (this != &other)
+            assign(other.begin(), other.end());
+        return *this;
+    }
+
+    SmallList &operator=(SmallList &&other)
+    {
+        if (this != &other) {
+            clear();
+            release();
+            take(std::move(other));
+        }
+        return *this;
+    }
+
+    SmallList &operator=(const std::vector<T> &other)
+    {
+        assign(other.begin(), other.end());
+        return *this;
+    }
+
+    template <typename Iterator>
+    void assign(Iterator first, Iterator last)
+    {
+        clear();
+        for (; first != last; ++first)
+            append(*first);
+    }
+
+    List<T> toList() const
+    {
+        List<T> ret;
+        ret.reserve(mSize);
+        for (const T &t : *this)
+            ret.append(t);
+        return ret;
+    }
+
+    operator List<T>() const
+    {
+        return toList();
+    }
+
+    Set<T> toSet() const
+    {
+        Set<T> ret;
+        for (const T &t : *this)
+            ret.insert(t);
+        return ret;
+    }
+
+    // whether the elements are inside the object
+    bool isInline() const { return mData == inlineData(); }
+    static constexpr size_t inlineCapacity() { return N; }
+
+    iterator begin() { return mData; }
+    iterator end() { return mData + mSize; }
+    const_iterator begin() const { return mData; }
+    const_iterator end() const { return mData + mSize; }
+    const_iterator constBegin() const { return mData; }
+    const_iterator constEnd() const { return mData + mSize; }
+
+    T *data() { return mData; }
+    const T *data() const { return mData; }
+    const T *constData() const { return mData; }
+
+    size_t size() const { return mSize; }
+    size_t capacity() const { return mCapacity; }
+    bool isEmpty() const { return !mSize; }
+    bool empty() const { return !mSize; }
+
+    void reserve(size_t capacity)
+    {
+        if (capacity > mCapacity)
+            reallocate(capacity);
+    }
+
+    void resize(size_t size, const T &defaultValue = T())
+    {
+        if (size < mSize) {
+            destroy(mData + size, mData + mSize);
+        } else if (size > mSize) {
+            reserve(size);
+            for (size_t i = mSize; i < size; ++i)
+                new (mData + i) T(defaultValue);
+        }
+        mSize = size;
+    }
+
+    void clear()
+    {
+        destroy(mData, mData + mSize);
+        mSize = 0;
+    }
+
+    // gives the heap memory back when everything fits inline
+    void squeeze()
+    {
+        if (!isInline() && mSize <= N)
+            reallocate(N);
+    }
+
+    T &operator[](size_t idx) { assert(idx < mSize); return mData[idx]; }
+    const T &operator[](size_t idx) const { assert(idx < mSize); return mData[idx]; }
+    T &at(size_t idx) { assert(idx < mSize); return mData[idx]; }
+    const T &at(size_t idx) const { assert(idx < mSize); return mData[idx]; }
+
+    T &first() { return at(0); }
+    const T &first() const { return at(0); }
+    T &last() { return at(mSize - 1); }
+    const T &last() const { return at(mSize - 1); }
+    T &front() { return first(); }
+    const T &front() const { return first(); }
+    T &back() { return last(); }
+    const T &back() const { return last(); }
+
+    T value(size_t idx, const T &defaultValue) const
+    {
+        return idx < mSize ? mData[idx] : defaultValue;
+    }
+
+    T value(size_t idx) const
+    {
+        return idx < mSize ? mData[idx] : T();
+    }
+
+    bool contains(const T &t) const
+    {
+        return std::find(begin(), end(), t) != end();
+    }
+
+    size_t indexOf(const T &t) const
+    {
+        const const_iterator it = std::find(begin(), end(), t);
+        return it == end() ? npos : it - begin();
+    }
+
+    size_t lastIndexOf(const T &t, int from = -1) const
+    {
+        if (!mSize)
+            return npos;
+        if (from < 0)
+            from += mSize;
+        from = std::min<int>(mSize - 1, from);
+        for (int i = from; i >= 0; --i) {
+            if (mData[i] == t)
+                return i;
+        }
+        return npos;
+    }
+
+    template <typename... Args>
+    T &emplace_back(Args &&...args)
+    {
+        if (mSize == mCapacity) {
+            // args may refer to an element
+            T t(std::forward<Args>(args)...);
+            grow(mSize + 1);
+            new (mData + mSize) T(std::move(t));
+        } else {
+            new (mData + mSize) T(std::forward<Args>(args)...);
+        }
+        return mData[mSize++];
+    }
+
+    void push_back(const T &t) { emplace_back(t); }
+    void push_back(T &&t) { emplace_back(std::move(t)); }
+    void pop_back() { removeLast(); }
+
+    void append(const T &t) { emplace_back(t); }
+    void append(T &&t) { emplace_back(std::move(t)); }
+
+    template <typename Container, typename = IfContainer<Container> >
+    void append(const Container &list)
+    {
+        if (static_cast<const void *>(&list) == this) {
+            append(SmallList(list));
+            return;
+        }
+        reserve(mSize + list.size());
+        for (const T &t : list)
+            emplace_back(t);
+    }
+
+    void append(std::initializer_list<T> list)
+    {
+        reserve(mSize + list.size());
+        for (const T &t : list)
+            emplace_back(t);
+    }
+
+    void prepend(const T &t) { insert(0, t); }
+    void prepend(T &&t) { insert(0, std::move(t)); }
+
+    void insert(size_t idx, const T &val)
+    {
+        insert(idx, T(val));
+    }
+
+    void insert(size_t idx, T &&val)
+    {
+        assert(idx <= mSize);
+        emplace_back(std::move(val));
+        std::rotate(mData + idx, mData + mSize - 1, mData + mSize);
+    }
+
+    template <typename Container, typename = IfContainer<Container> >
+    void insert(size_t idx, const Container &list)
+    {
+        assert(idx <= mSize);
+        const size_t old = mSize;
+        append(list);
+        std::rotate(mData + idx, mData + old, mData + mSize);
+    }
+
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        const size_t idx = first - begin();
+        remove(idx, last - first);
+        return begin() + idx;
+    }
+
+    iterator erase(const_iterator it)
+    {
+        return erase(it, it + 1);
+    }
+
+    size_t remove(const T &t)
+    {
+        const size_t old = mSize;
+        truncate(std::remove(begin(), end(), t) - begin());
+        return old - mSize;
+    }
+
+    size_t remove(std::function<bool(const T &t)> match)
+    {
+        const size_t old = mSize;
+        truncate(std::remove_if(begin(), end(), match) - begin());
+        return old - mSize;
+    }
+
+    void remove(size_t idx, size_t count)
+    {
+        assert(idx + count <= mSize);
+        std::move(mData + idx + count, mData + mSize, mData + idx);
+        chop(count);
+    }
+
+    void removeAt(size_t idx) { remove(idx, 1); }
+    void removeFirst() { remove(0, 1); }
+    void removeLast() { chop(1); }
+
+    T takeFirst()
+    {
+        T ret = std::move(first());
+        removeFirst();
+        return ret;
+    }
+
+    T takeLast()
+    {
+        T ret = std::move(last());
+        removeLast();
+        return ret;
+    }
+
+    void chop(size_t count)
+    {
+        assert(count <= mSize);
+        destroy(mData + mSize - count, mData + mSize);
+        mSize -= count;
+    }
+
+    size_t truncate(size_t count)
+    {
+        const size_t s = mSize;
+        if (s > count) {
+            chop(s - count);
+            return s - count;
+        }
+        return 0;
+    }
+
+    void deleteAll()
+    {
+        for (T &t : *this)
+            delete t;
+        clear();
+    }
+
+    void sort()
+    {
+        std::sort(begin(), end());
+    }
+
+    void sort(std::function<bool(const T &, const T &r)> func)
+    {
+        std::sort(begin(), end(), func);
+    }
+
+    SmallList mid(size_t from, int size = -1) const
+    {
+        if (from >= mSize)
+            return SmallList();
+        const size_t count = size < 0 ? mSize - from : std::min<size_t>(mSize - from, size);
+        return SmallList(begin() + from, begin() + from + count);
+    }
+
+    template <typename Container>
+    bool startsWith(const Container &t) const
+    {
+        return mSize >= t.size() && std::equal(t.begin(), t.end(), begin());
+    }
+
+    // like List, shorter lists come first
+    template <typename Container>
+    int compare(const Container &other) const
+    {
+        if (mSize != other.size())
+            return mSize < other.size() ? -1 : 1;
+        auto it = other.begin();
+        for (const T &t : *this) {
+            if (t < *it)
+                return -1;
+            if (*it < t)
+                return 1;
+            ++it;
+        }
+        return 0;
+    }
+
+    template <typename Container>
+    bool operator==(const Container &other) const
+    {
+        return mSize == other.size() && std::equal(begin(), end(), other.begin());
+    }
+
+    template <typename Container>
+    bool operator!=(const Container &other) const { return !operator==(other); }
+    template <typename Container>
+    bool operator<(const Container &other) const { return compare(other) < 0; }
+    template <typename Container>
+    bool operator>(const Container &other) const { return compare(other) > 0; }
+
+    SmallList operator+(const T &t) const
+    {
+        SmallList ret = *this;
+        ret.append(t);
+        return ret;
+    }
+
+    template <typename Container, typename = IfContainer<Container> >
+    SmallList operator+(const Container &t) const
+    {
+        SmallList ret = *this;
+        ret.append(t);
+        return ret;
+    }
+
+    SmallList &operator+=(const T &t)
+    {
+        append(t);
+        return *this;
+    }
+
+    template <typename Container, typename = IfContainer<Container> >
+    SmallList &operator+=(const Container &t)
+    {
+        append(t);
+        return *this;
+    }
+
+    SmallList &operator<<(const T &t)
+    {
+        append(t);
+        return *this;
+    }
+
+    template <typename Container, typename = IfContainer<Container> >
+    SmallList &operator<<(const Container &t)
+    {
+        append(t);
+        return *this;
+    }
+
+private:
+    T *inlineData() { return reinterpret_cast<T *>(&mInline); }
+    const T *inlineData() const { return reinterpret_cast<const T *>(&mInline); }
+
+    static void destroy(T *first, T *last)
+    {
+        for (; first != last; ++first)
+            first->~T();
+    }
+
+    void release()
+    {
+        if (!isInline())
+            ::operator delete(mData);
+        mData = inlineData();
+        mCapacity = N;
+    }
+
+    void grow(size_t minimum)
+    {
+        reallocate(std::max(minimum, mCapacity + mCapacity / 2));
+    }
+
+    // capacity N means back to the inline storage
+    void reallocate(size_t capacity)
+    {
+        assert(capacity >= mSize);
+        T *data = capacity <= N ? inlineData() : static_cast<T *>(::operator new(capacity * sizeof(T)));
+        if (data == mData)
+            return;
+        for (size_t i = 0; i < mSize; ++i) {
+            new (data + i) T(std::move(mData[i]));
+            mData[i].~T();
+        }
+        if (!isInline())
+            ::operator delete(mData);
+        mData = data;
+        mCapacity = std::max<size_t>(capacity, N);
+    }
+
+    // other is cleared, heap memory changes hands
+    void take(SmallList &&other)
+    {
+        if (other.isInline()) {
+            for (size_t i = 0; i < other.mSize; ++i)
+                new (mData + i) T(std::move(other.mData[i]));
+            mSize = other.mSize;
+            other.clear();
+        } else {
+            mData = other.mData;
+            mSize = other.mSize;
+            mCapacity = other.mCapacity;
+            other.mData = other.inlineData();
+            other.mSize = 0;
+            other.mCapacity = N;
+        }
+    }
+
+    T *mData;
+    size_t mSize, mCapacity;
+    typename std::aligned_storage<sizeof(T) * N, alignof(T)>::type mInline;
+};
+
+template <typename T, size_t N>
+void serializeElements(Serializer &s, const SmallList<T, N> &list, std::false_type)
+{
+    for (const T &t : list)
+        s << t;
+}
+
+template <typename T, size_t N>
+void serializeElements(Serializer &s, const SmallList<T, N> &list, std::true_type)
+{
+    s.write(list.data(), list.size() * sizeof(T));
+}
+
+template <typename T, size_t N>
+Serializer &operator<<(Serializer &s, const SmallList<T, N> &list)
+{
+    const uint32_t size = list.size();
+    s << size;
+    if (size)
+        serializeElements(s, list, std::integral_constant<bool, BulkSerializable<T>::value>());
+    return s;
+}
+
+template <typename T, size_t N>
+void deserializeElements(Deserializer &s, SmallList<T, N> &list, std::false_type)
+{
+    for (T &t : list)
+        s >> t;
+}
+
+template <typename T, size_t N>
+void deserializeElements(Deserializer &s, SmallList<T, N> &list, std::true_type)
+{
+    s.read(list.data(), list.size() * sizeof(T));
+}
+
+template <typename T, size_t N>
+Deserializer &operator>>(Deserializer &s, SmallList<T, N> &list)
+{
+    uint32_t size;
+    s >> size;
+    list.resize(size);
+    if (size)
+        deserializeElements(s, list, std::integral_constant<bool, BulkSerializable<T>::value>());
+    return s;
+}
+
+template <typename T, size_t N>
+size_t serializedElementsSize(const SmallList<T, N> &list, std::false_type)
+{
+    size_t size = 0;
+    for (const T &t : list)
+        size += serializedSize(t);
+    return size;
+}
+
+template <typename T, size_t N>
+size_t serializedElementsSize(const SmallList<T, N> &list, std::true_type)
+{
+    return list.size() * sizeof(T);
+}
+
+template <typename T, size_t N>
+size_t serializedSize(const SmallList<T, N> &list)
+{
+    return Serializer::sizeOf<uint32_t>()
+        + serializedElementsSize(list, std::integral_constant<bool, BulkSerializable<T>::value>());
+}
+
+template <typename T, size_t N>
+inline Log operator<<(Log stream, const SmallList<T, N> &list)
+{
+    bool old;
+    if (!(stream.flags() & LogOutput::NoTypename)) {
+        stream << "SmallList<";
+        old = stream.setSpacing(false);
+        stream << typeName<T>() << ">(";
+    } else {
+        old = stream.setSpacing(false);
+    }
+    bool first = true;
+    for (const T &t : list) {
+        if (first) {
+            stream.disableNextSpacing();
+            first = false;
+        } else {
+            stream << ", ";
+        }
+        stream.setSpacing(old);
+        stream << t;
+        old = stream.setSpacing(false);
+    }
+    if (!(stream.flags() & LogOutput::NoTypename))
+        stream << ")";
+    stream.setSpacing(old);
+    return stream;
+}
+
+#endif
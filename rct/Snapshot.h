@@ -0,0 +1,56 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <memory>
+
+// Read-copy-update for large structures that are read far more often
+// than they change, like an index or a parsed configuration. Readers
+// get a shared_ptr to an immutable version and keep using it for as
+// long as they like. Writers build a new version and swap it in, the
+// old one goes away with its last reader.
+//
+//     Snapshot<Map<String, Path> > paths;
+//     std::shared_ptr<const Map<String, Path> > current = paths.load();
+//     paths.update([&](Map<String, Path> &map) { map[name] = path; });
+//
+// load() and store() use the std::atomic_* overloads for shared_ptr,
+// which may be implemented with a small lock pool, but keep readers off
+// any lock that writers hold while they work.
+template <typename T>
+class Snapshot
+{
+public:
+    typedef std::shared_ptr<const T> Pointer;
+
+    Snapshot(Pointer value = Pointer())
+        : mValue(value ? std::move(value) : std::make_shared<const T>())
+    {}
+
+    Pointer load() const { return std::atomic_load(&mValue); }
+    void store(Pointer value) { std::atomic_store(&mValue, std::move(value)); }
+    void store(T &&value) { store(std::make_shared<const T>(std::move(value))); }
+
+    // Copies the current version, lets fn change the copy and publishes
+    // it. Retries with a fresh copy if another update got in first, so
+    // fn may run more than once and shouldn't have side effects.
+    template <typename F>
+    Pointer update(F &&fn)
+    {
+        Pointer current = load();
+        for (;;) {
+            std::shared_ptr<T> next = std::make_shared<T>(*current);
+            fn(*next);
+            Pointer replacement = std::move(next);
+            if (std::atomic_compare_exchange_weak(&mValue, &current, replacement))
+                return replacement;
+        }
+    }
+
+private:
+    Pointer mValue;
+
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+};
+
+#endif
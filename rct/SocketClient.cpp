@@ -1,22 +1,36 @@
 #include "SocketClient.h"
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <atomic>
 #include <fcntl.h>
+#include <limits.h>
+#include <mutex>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <set>
 #include <stdio.h>
 #include <string.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "EventLoop.h"
 #include "Log.h"
 #include "rct/rct-config.h"
 #include "Rct.h"
+#include "Timer.h"
+
+#ifdef HAVE_SENDFILE
+#  include <sys/sendfile.h>
+#endif
 
 #ifdef NDEBUG
 struct Null { template <typename T> Null operator<<(const T &) { return *this; } };
@@ -25,18 +39,163 @@ struct Null { template <typename T> Null operator<<(const T &) { return *this; }
 #define DEBUG() if (mLogsEnabled) debug()
 #endif
 
+// the head start of each connect() attempt, as RFC 8305 recommends
+enum { DefaultConnectDelay = 250 };
+// readyReadBatch() slots, room for a full ethernet frame each
+enum { DefaultDatagramCount = 32, DefaultDatagramSize = 2048 };
+
+// Only the socket's thread writes these, so plain loads and stores do and
+// other threads still read whole values
+template <typename T>
+static inline void bump(std::atomic<T> &value, T add)
+{
+    value.store(value.load(std::memory_order_relaxed) + add, std::memory_order_relaxed);
+}
+
+struct SocketClient::Counters
+{
+    struct Direction
+    {
+        enum { Window = 1000000 };
+
+        Direction()
+            : bytes(0), calls(0), windowStart(EventLoop::threadNow()), windowBytes(0), rate(0)
+        {}
+
+        void add(uint64_t count, uint64_t syscalls, uint64_t now)
+        {
+            bump(bytes, count);
+            bump(calls, syscalls);
+            bump(windowBytes, count);
+            const uint64_t start = windowStart.load(std::memory_order_relaxed);
+            if (now - start >= Window) {
+                rate.store(currentRate(now), std::memory_order_relaxed);
+                windowStart.store(now, std::memory_order_relaxed);
+                windowBytes.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        // the rate with the window so far folded in once it's a full one
+        double currentRate(uint64_t now) const
+        {
+            const double previous = rate.load(std::memory_order_relaxed);
+            const uint64_t elapsed = now - windowStart.load(std::memory_order_relaxed);
+            if (elapsed < Window)
+                return previous;
+            const double current = windowBytes.load(std::memory_order_relaxed) * 1000000.0 / elapsed;
+            return previous + (current - previous) * 0.3;
+        }
+
+        std::atomic<uint64_t> bytes, calls;
+        std::atomic<uint64_t> windowStart, windowBytes;
+        std::atomic<double> rate;
+    };
+
+    // buckets of latencies below 1, 2, 4 ... microseconds
+    enum { Buckets = 40 };
+
+    Counters()
+        : latencyCount(0), latencyMax(0)
+    {
+        for (auto &bucket : latencies)
+            bucket.store(0, std::memory_order_relaxed);
+    }
+
+    void latency(uint64_t us)
+    {
+        int bucket = 0;
+        while (bucket < Buckets - 1 && (1ull << bucket) <= us)
+            ++bucket;
+        bump(latencies[bucket], uint64_t(1));
+        bump(latencyCount, uint64_t(1));
+        if (us > latencyMax.load(std::memory_order_relaxed))
+            latencyMax.store(us, std::memory_order_relaxed);
+    }
+
+    uint64_t percentile(int percent) const
+    {
+        const uint64_t count = latencyCount.load(std::memory_order_relaxed);
+        if (!count)
+            return 0;
+        const uint64_t wanted = (count * percent + 99) / 100;
+        uint64_t seen = 0;
+        for (int i = 0; i < Buckets; ++i) {
+            seen += latencies[i].load(std::memory_order_relaxed);
+            if (seen >= wanted)
+                return std::min<uint64_t>(1ull << i, latencyMax.load(std::memory_order_relaxed));
+        }
+        return latencyMax.load(std::memory_order_relaxed);
+    }
+
+    Direction read, write;
+    std::atomic<uint64_t> latencies[Buckets];
+    std::atomic<uint64_t> latencyCount, latencyMax;
+};
+
+static std::mutex sRegistryMutex;
+static std::set<const SocketClient*> sRegistry;
+
+struct SocketClient::DatagramRing
+{
+    DatagramRing(size_t count, size_t size)
+        : data(new unsigned char[count * size]), datagrams(count), addresses(count)
+#ifdef HAVE_RECVMMSG
+        , headers(count), vectors(count)
+#endif
+    {
+        for (size_t i = 0; i < count; ++i) {
+            datagrams[i].address = reinterpret_cast<const sockaddr*>(&addresses[i]);
+            datagrams[i].data = data.get() + i * size;
+#ifdef HAVE_RECVMMSG
+            vectors[i].iov_base = data.get() + i * size;
+            vectors[i].iov_len = size;
+            memset(&headers[i], 0, sizeof(mmsghdr));
+            headers[i].msg_hdr.msg_name = &addresses[i];
+            headers[i].msg_hdr.msg_iov = &vectors[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+#endif
+        }
+    }
+
+    std::unique_ptr<unsigned char[]> data;
+    std::vector<Datagram> datagrams;
+    std::vector<sockaddr_storage> addresses;
+#ifdef HAVE_RECVMMSG
+    std::vector<mmsghdr> headers;
+    std::vector<iovec> vectors;
+#endif
+};
+
 SocketClient::SocketClient(unsigned int mode)
     : fd(-1), socketPort(0), socketState(Disconnected), socketMode(None),
-      wMode(Asynchronous), writeWait(false), mLogsEnabled(true), writeOffset(0)
+      wMode(Asynchronous), writeWait(false), mLogsEnabled(true), ioUring(false),
+      ioRead(0), ioWrite(0), ioWriteSize(0), connectId(0), connectDelay(DefaultConnectDelay),
+      writeOffset(0), readSize(BufferPool::MinimumSize * 4),
+      datagramCount(DefaultDatagramCount), datagramSize(DefaultDatagramSize),
+      writeQueueSize(0), writeBlock(0),
+      highWatermark(0), lowWatermark(0), blocked(false), batchDepth(0),
+      counters(new Counters)
 {
     blocking = (mode & Blocking);
+    std::lock_guard<std::mutex> lock(sRegistryMutex);
+    sRegistry.insert(this);
 }
 
 SocketClient::SocketClient(int f, unsigned int mode)
     : fd(f), socketPort(0), socketState(Connected), socketMode(mode),
-      wMode(Asynchronous), writeWait(false), mLogsEnabled(true), writeOffset(0)
+      wMode(Asynchronous), writeWait(false), mLogsEnabled(true), ioUring(false),
+      ioRead(0), ioWrite(0), ioWriteSize(0), connectId(0), connectDelay(DefaultConnectDelay),
+      writeOffset(0), readSize(BufferPool::MinimumSize * 4),
+      datagramCount(DefaultDatagramCount), datagramSize(DefaultDatagramSize),
+      writeQueueSize(0), writeBlock(0),
+      highWatermark(0), lowWatermark(0), blocked(false), batchDepth(0),
+      counters(new Counters)
 {
     assert(fd >= 0);
+    {
+        std::lock_guard<std::mutex> lock(sRegistryMutex);
+        sRegistry.insert(this);
+    }
 #ifdef HAVE_NOSIGPIPE
     int flags = 1;
     ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&flags, sizeof(int));
@@ -48,13 +207,17 @@ SocketClient::SocketClient(int f, unsigned int mode)
 
     if (!blocking) {
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-            loop->registerSocket(fd, EventLoop::SocketRead,
+            ioUring = loop->hasIoUring() && !(mode & Udp);
+            readPool = loop->bufferPool();
+            loop->registerSocket(fd, ioUring ? 0 : EventLoop::SocketRead,
                                  std::bind(&SocketClient::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
             if (!setFlags(fd, O_NONBLOCK, F_GETFL, F_SETFL)) {
                 signalError(shared_from_this(), InitializeError);
                 close();
                 return;
             }
+            if (ioUring)
+                submitRead();
         }
     }
 }
@@ -62,18 +225,35 @@ SocketClient::SocketClient(int f, unsigned int mode)
 SocketClient::~SocketClient()
 {
     close();
+    std::lock_guard<std::mutex> lock(sRegistryMutex);
+    sRegistry.erase(this);
 }
 
 void SocketClient::close()
 {
-    if (fd == -1)
+    const bool connecting = race != nullptr;
+    if (connecting)
+        endRace();
+    if (fd == -1 && !connecting)
         return;
     socketState = Disconnected;
-    if (!blocking) {
-        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+    if (fd != -1 && !blocking) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+            if (ioRead)
+                loop->cancelIo(ioRead);
+            if (ioWrite)
+                loop->cancelIo(ioWrite);
             loop->unregisterSocket(fd);
+        }
     }
-    ::close(fd);
+    ioRead = ioWrite = 0;
+    ioWriteSize = 0;
+    writeQueue.clear();
+    writeQueueSize = 0;
+    writeBlock = 0;
+    blocked = false;
+    if (fd != -1)
+        ::close(fd);
     socketPort = 0;
     address.clear();
     fd = -1;
@@ -84,114 +264,77 @@ class Resolver
 public:
     Resolver();
     Resolver(const String& host, uint16_t port, const SocketClient::SharedPtr& socket);
-    ~Resolver();
 
     void resolve(const String& host, uint16_t port, const SocketClient::SharedPtr& socket);
 
-    addrinfo* res;
+    DnsResolver::Address address;
     sockaddr* addr;
     size_t size;
 };
 
 Resolver::Resolver()
-    : res(0), addr(0), size(0)
+    : addr(0), size(0)
 {
 }
 
 Resolver::Resolver(const String& host, uint16_t port, const SocketClient::SharedPtr& socket)
-    : res(0), addr(0), size(0)
+    : addr(0), size(0)
 {
     resolve(host, port, socket);
 }
 
 void Resolver::resolve(const String& host, uint16_t port, const SocketClient::SharedPtr& socket)
 {
-    // first, see if this parses as an IP address
-    {
-        struct in_addr inaddr4;
-        struct in6_addr inaddr6;
-        struct { int af; void* dst; } addrs[2] = {
-            { AF_INET, &inaddr4 },
-            { AF_INET6, &inaddr6 }
-        };
-        for (int i = 0; i < 2; ++i) {
-            if (inet_pton(addrs[i].af, host.constData(), addrs[i].dst) == 1) {
-                // yes, use that
-                if (addrs[i].af == AF_INET) {
-                    sockaddr_in* newaddr = new sockaddr_in;
-                    memset(newaddr, '\0', sizeof(sockaddr_in));
-                    memcpy(&newaddr->sin_addr, &inaddr4, sizeof(struct in_addr));
-                    newaddr->sin_family = AF_INET;
-                    newaddr->sin_port = htons(port);
-                    addr = reinterpret_cast<sockaddr*>(newaddr);
-                    size = sizeof(sockaddr_in);
-                } else {
-                    assert(addrs[i].af == AF_INET6);
-                    sockaddr_in6* newaddr = new sockaddr_in6;
-                    memset(newaddr, '\0', sizeof(sockaddr_in6));
-                    memcpy(&newaddr->sin6_addr, &inaddr6, sizeof(struct in6_addr));
-                    newaddr->sin6_family = AF_INET6;
-                    newaddr->sin6_port = htons(port);
-                    addr = reinterpret_cast<sockaddr*>(newaddr);
-                    size = sizeof(sockaddr_in6);
-                }
-                return;
-            }
-        }
-    }
-
-    // not an ip address, try to resolve it
-    addrinfo hints, *p;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC; // AF_INET or AF_INET6 to force version
-    hints.ai_socktype = SOCK_STREAM;
-
-    if (getaddrinfo(host.constData(), NULL, &hints, &res) != 0) {
+    // the blocking connect and UDP paths still resolve synchronously, a
+    // name that isn't cached blocks in getaddrinfo
+    const DnsResolver::Addresses addresses = DnsResolver::instance()->resolveNow(host);
+    if (addresses.empty()) {
         // bad
         socket->signalError(socket, SocketClient::DnsError);
         socket->close();
         return;
     }
-
-    for (p = res; p; p = p->ai_next) {
-        if (p->ai_family == AF_INET) {
-            addr = p->ai_addr;
-            reinterpret_cast<sockaddr_in*>(addr)->sin_port = htons(port);
-            size = sizeof(sockaddr_in);
-            break;
-        } else if (p->ai_family == AF_INET6) {
-            addr = p->ai_addr;
-            reinterpret_cast<sockaddr_in6*>(addr)->sin6_port = htons(port);
-            size = sizeof(sockaddr_in6);
-            break;
-        }
-    }
-
-    if (!addr) {
-        socket->signalError(socket, SocketClient::DnsError);
-        socket->close();
-        freeaddrinfo(res);
-        res = 0;
-        return;
-    }
+    address = addresses.front();
+    address.setPort(port);
+    addr = address.addr();
+    size = address.size;
 }
 
-Resolver::~Resolver()
+struct SocketClient::ConnectRace
 {
-    if (res)
-        freeaddrinfo(res); // free the linked list
-    else if (addr) {
-        if (size == sizeof(sockaddr_in))
-            delete reinterpret_cast<sockaddr_in*>(addr);
-        else
-            delete reinterpret_cast<sockaddr_in6*>(addr);
-    }
-}
+    ConnectRace()
+        : next(0), timer(0)
+    {}
+
+    // the addresses to try, families interleaved
+    DnsResolver::Addresses addresses;
+    size_t next;
+    int timer;
+    // the attempts racing the one in fd and their modes
+    std::vector<std::pair<int, unsigned int> > attempts;
+};
 
 bool SocketClient::connect(const String& host, uint16_t port)
 {
     SocketClient::SharedPtr tcpSocket = shared_from_this();
+    if (!blocking && EventLoop::eventLoop()) {
+        if (race)
+            close();
+        race.reset(new ConnectRace);
+        socketMode = Tcp;
+        socketState = Connecting;
+        socketPort = port;
+        address = host;
+        const unsigned int id = ++connectId;
+        SocketClient::WeakPtr weak = tcpSocket;
+        DnsResolver::instance()->resolve(host, [weak, id](const String &, const DnsResolver::Addresses &addresses) {
+                SocketClient::SharedPtr client = weak.lock();
+                if (client && client->race && client->connectId == id)
+                    client->connectResolved(addresses);
+            });
+        return isConnected();
+    }
+
     Resolver resolver(host, port, tcpSocket);
     if (!resolver.addr)
         return false;
@@ -209,6 +352,8 @@ bool SocketClient::connect(const String& host, uint16_t port)
     address = host;
     if (e == 0) { // we're done
         socketState = Connected;
+        if (ioUring)
+            submitRead();
 
         signalConnected(tcpSocket);
     } else {
@@ -219,7 +364,7 @@ bool SocketClient::connect(const String& host, uint16_t port)
             return false;
         }
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-            loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+            loop->updateSocket(fd, writeWaitMode());
             writeWait = true;
         }
         socketState = Connecting;
@@ -228,6 +373,197 @@ bool SocketClient::connect(const String& host, uint16_t port)
     return true;
 }
 
+void SocketClient::connectResolved(const DnsResolver::Addresses &addresses)
+{
+    SocketClient::SharedPtr tcpSocket = shared_from_this();
+    if (addresses.empty()) {
+        signalError(tcpSocket, DnsError);
+        close();
+        return;
+    }
+
+    // alternate between the families, starting with the preferred one
+    DnsResolver::Addresses preferred, other;
+    for (const DnsResolver::Address &addr : addresses)
+        (addr.family() == addresses.front().family() ? preferred : other).push_back(addr);
+    for (size_t i = 0; i < std::max(preferred.size(), other.size()); ++i) {
+        if (i < preferred.size())
+            race->addresses.push_back(preferred[i]);
+        if (i < other.size())
+            race->addresses.push_back(other[i]);
+    }
+    for (DnsResolver::Address &addr : race->addresses)
+        addr.setPort(socketPort);
+
+    if (!raceNext()) {
+        signalError(tcpSocket, ConnectError);
+        close();
+    }
+}
+
+bool SocketClient::raceNext()
+{
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (race->timer) {
+        loop->unregisterTimer(race->timer);
+        race->timer = 0;
+    }
+    while (race->next < race->addresses.size()) {
+        const DnsResolver::Address &addr = race->addresses[race->next++];
+        const unsigned int mode = Tcp | (addr.family() == AF_INET6 ? IPv6 : 0);
+        int sock;
+        if (fd == -1) {
+            if (!init(mode))
+                continue;
+            sock = fd;
+        } else {
+            sock = ::socket(addr.family(), SOCK_STREAM, 0);
+            if (sock == -1)
+                continue;
+#ifdef HAVE_CLOEXEC
+            setFlags(sock, FD_CLOEXEC, F_GETFD, F_SETFD);
+#endif
+            if (!setFlags(sock, O_NONBLOCK, F_GETFL, F_SETFL)) {
+                ::close(sock);
+                continue;
+            }
+            race->attempts.push_back(std::make_pair(sock, mode));
+            loop->registerSocket(sock, EventLoop::SocketWrite | EventLoop::SocketOneShot,
+                                 std::bind(&SocketClient::raceCallback, this, std::placeholders::_1, std::placeholders::_2));
+        }
+
+        int e;
+        eintrwrap(e, ::connect(sock, addr.addr(), addr.size));
+        if (e == 0) {
+            connectFinished(sock);
+            return true;
+        }
+        if (errno != EINPROGRESS) {
+            dropAttempt(sock);
+            continue;
+        }
+        if (sock == fd) {
+            loop->updateSocket(fd, writeWaitMode());
+            writeWait = true;
+        }
+        if (race->next < race->addresses.size()) {
+            // give this one a head start before racing the next
+            race->timer = loop->registerTimer([this](int) {
+                    race->timer = 0;
+                    if (!raceNext()) {
+                        signalError(shared_from_this(), ConnectError);
+                        close();
+                    }
+                }, connectDelay, Timer::SingleShot);
+        }
+        return true;
+    }
+    return fd != -1 || !race->attempts.empty();
+}
+
+void SocketClient::raceCallback(int sock, int mode)
+{
+    int err = 0;
+    socklen_t size = sizeof(err);
+    if (mode & EventLoop::SocketError || ::getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &size) == -1 || err) {
+        dropAttempt(sock);
+        if (!raceNext()) {
+            signalError(shared_from_this(), ConnectError);
+            close();
+        }
+        return;
+    }
+    if (mode & EventLoop::SocketWrite)
+        connectFinished(sock);
+}
+
+bool SocketClient::raceFailed()
+{
+    dropAttempt(fd);
+    if (!race->attempts.empty()) {
+        // the oldest attempt still racing takes over
+        const std::pair<int, unsigned int> attempt = race->attempts.front();
+        race->attempts.erase(race->attempts.begin());
+        EventLoop::SharedPtr loop = EventLoop::eventLoop();
+        loop->unregisterSocket(attempt.first);
+        if (!adopt(attempt.first, attempt.second))
+            return raceFailed();
+        loop->updateSocket(fd, writeWaitMode());
+        writeWait = true;
+    }
+    return raceNext();
+}
+
+void SocketClient::dropAttempt(int sock)
+{
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (sock == fd) {
+        if (loop)
+            loop->unregisterSocket(fd);
+        fd = -1;
+        writeWait = false;
+        ioUring = false;
+    } else {
+        for (auto it = race->attempts.begin(); it != race->attempts.end(); ++it) {
+            if (it->first == sock) {
+                race->attempts.erase(it);
+                break;
+            }
+        }
+        if (loop)
+            loop->unregisterSocket(sock);
+    }
+    ::close(sock);
+}
+
+void SocketClient::connectFinished(int sock)
+{
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (sock != fd) {
+        unsigned int mode = Tcp;
+        for (auto it = race->attempts.begin(); it != race->attempts.end(); ++it) {
+            if (it->first == sock) {
+                mode = it->second;
+                race->attempts.erase(it);
+                break;
+            }
+        }
+        loop->unregisterSocket(sock);
+        if (fd != -1)
+            dropAttempt(fd);
+        if (!adopt(sock, mode)) {
+            signalError(shared_from_this(), ConnectError);
+            close();
+            return;
+        }
+    } else if (writeWait) {
+        loop->updateSocket(fd, ioUring ? 0 : EventLoop::SocketRead);
+        writeWait = false;
+    }
+    endRace();
+
+    SocketClient::SharedPtr tcpSocket = shared_from_this();
+    socketState = Connected;
+    if (ioUring)
+        submitRead();
+    signalConnected(tcpSocket);
+    // what was written while connecting
+    write(0, 0);
+}
+
+void SocketClient::endRace()
+{
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (loop && race->timer)
+        loop->unregisterTimer(race->timer);
+    for (const auto &attempt : race->attempts) {
+        if (loop)
+            loop->unregisterSocket(attempt.first);
+        ::close(attempt.first);
+    }
+    race.reset();
+}
+
 bool SocketClient::connect(const String& path)
 {
     if (!init(Unix))
@@ -248,6 +584,8 @@ bool SocketClient::connect(const String& path)
     address = path;
     if (e == 0) { // we're done
         socketState = Connected;
+        if (ioUring)
+            submitRead();
 
         signalConnected(unixSocket);
     } else {
@@ -258,7 +596,7 @@ bool SocketClient::connect(const String& path)
             return false;
         }
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-            loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+            loop->updateSocket(fd, writeWaitMode());
             writeWait = true;
         }
         socketState = Connecting;
@@ -310,6 +648,77 @@ bool SocketClient::bind(uint16_t port)
     return false;
 }
 
+bool SocketClient::writeTo(const sockaddr *addr, socklen_t addrSize, const unsigned char *data, unsigned int size)
+{
+#ifdef HAVE_NOSIGNAL
+    const int sendFlags = MSG_NOSIGNAL;
+#else
+    const int sendFlags = 0;
+#endif
+    int e;
+    eintrwrap(e, ::sendto(fd, data, size, sendFlags, addr, addrSize));
+    DEBUG() << "SENT(6)" << size << "BYTES" << e << errno;
+    if (e == -1)
+        return false;
+    bytesWritten(shared_from_this(), e);
+    return true;
+}
+
+int SocketClient::writeBatch(const Datagram *datagrams, size_t count)
+{
+#ifdef HAVE_NOSIGNAL
+    const int sendFlags = MSG_NOSIGNAL;
+#else
+    const int sendFlags = 0;
+#endif
+    SocketClient::SharedPtr socketPtr = shared_from_this();
+    size_t sent = 0;
+#ifdef HAVE_SENDMMSG
+    enum { MaxBatch = 64 };
+    mmsghdr headers[MaxBatch];
+    iovec vectors[MaxBatch];
+    while (sent < count) {
+        const size_t batch = std::min<size_t>(count - sent, MaxBatch);
+        size_t bytes = 0;
+        for (size_t i = 0; i < batch; ++i) {
+            const Datagram &datagram = datagrams[sent + i];
+            vectors[i].iov_base = const_cast<unsigned char*>(datagram.data);
+            vectors[i].iov_len = datagram.size;
+            memset(&headers[i], 0, sizeof(mmsghdr));
+            headers[i].msg_hdr.msg_name = const_cast<sockaddr*>(datagram.address);
+            headers[i].msg_hdr.msg_namelen = datagram.addressSize;
+            headers[i].msg_hdr.msg_iov = &vectors[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+        }
+        int e;
+        eintrwrap(e, ::sendmmsg(fd, headers, batch, sendFlags));
+        DEBUG() << "SENT(7)" << batch << "DATAGRAMS" << e << errno;
+        if (e == -1)
+            break;
+        for (int i = 0; i < e; ++i)
+            bytes += headers[i].msg_len;
+        sent += e;
+        if (bytes)
+            bytesWritten(socketPtr, bytes);
+        if (static_cast<size_t>(e) < batch)
+            break;
+    }
+#else
+    while (sent < count) {
+        const Datagram &datagram = datagrams[sent];
+        int e;
+        eintrwrap(e, ::sendto(fd, datagram.data, datagram.size, sendFlags, datagram.address, datagram.addressSize));
+        if (e == -1)
+            break;
+        bytesWritten(socketPtr, e);
+        ++sent;
+    }
+#endif
+    if (!sent && count && errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+    return sent;
+}
+
 bool SocketClient::addMembership(const String& ip)
 {
     struct ip_mreq mreq;
@@ -385,13 +794,40 @@ String SocketClient::sockName(uint16_t* port) const
 
 bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned char* data, unsigned int size)
 {
-    if (size) {
-        mWrites.append(size);
-    }
+    const bool ret = writeToSocket(host, port, data, size);
+    updateWriteState();
+    return ret;
+}
+
+bool SocketClient::writeToSocket(const String& host, uint16_t port, const unsigned char* data, unsigned int size)
+{
 
     assert((!size) == (!data));
     SocketClient::SharedPtr socketPtr = shared_from_this();
 
+    if (ioUring && !port && (wMode == Asynchronous || ioWrite)) {
+        // queue behind the write in flight, if any, the kernel picks it
+        // up with the loop's next submission
+        if (size)
+            appendWrite(data, size);
+        if (!writeWait && !ioWrite && !batchDepth && writeBuffer.size() > writeOffset)
+            submitWrite();
+        return fd != -1;
+    }
+
+    if (fd == -1 && race && !port) {
+        // still connecting, it's flushed once connected
+        if (size)
+            storeWrite(data, size);
+        return true;
+    }
+
+    if (batchDepth && !port && !(socketMode & Udp)) {
+        if (size)
+            storeWrite(data, size);
+        return fd != -1;
+    }
+
     Resolver resolver;
     if (port != 0)
         resolver.resolve(host, port, socketPtr);
@@ -439,7 +875,7 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
                         }
                         assert(!writeWait);
                         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                            loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+                            loop->updateSocket(fd, writeWaitMode());
                             writeWait = true;
                         }
                         break;
@@ -450,7 +886,7 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
                         return false;
                     }
                 }
-                signalBytesWritten(socketPtr, e);
+                bytesWritten(socketPtr, e);
                 total += e;
             }
             if (total) {
@@ -464,6 +900,9 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
             }
         }
 
+        if (writeBuffer.isEmpty() && !writeWait && !writeQueue.empty() && !flushQueue())
+            return false;
+
         if (fd == -1 || !data) {
             return fd != -1;
         }
@@ -471,7 +910,7 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
 
         assert(data != 0 && size > 0);
 
-        if (writeBuffer.isEmpty()) {
+        if (writeBuffer.isEmpty() && writeQueue.empty() && !writeWait) {
             for (;;) {
                 assert(size > total);
                 if (resolver.addr) {
@@ -486,11 +925,7 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
                         if (wMode == Synchronous) {
                             if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
                                 // store the rest
-                                const unsigned int rem = size - total;
-                                writeBuffer.reserve(writeBuffer.size() + rem);
-                                memcpy(writeBuffer.end(), data + total, rem);
-                                writeBuffer.resize(writeBuffer.size() + rem);
-                                assert(!writeOffset);
+                                storeWrite(data + total, size - total);
 
                                 (void)loop->processSocket(fd);
                                 return isConnected();
@@ -498,7 +933,7 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
                         }
                         assert(!writeWait);
                         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                            loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+                            loop->updateSocket(fd, writeWaitMode());
                             writeWait = true;
                         }
                         break;
@@ -509,7 +944,7 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
                         return false;
                     }
                 }
-                signalBytesWritten(socketPtr, e);
+                bytesWritten(socketPtr, e);
                 total += e;
                 assert(total <= size);
                 if (total == size) {
@@ -522,10 +957,7 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
 
     if (total < size) {
         // store the rest
-        const unsigned int rem = size - total;
-        writeBuffer.reserve(writeBuffer.size() + rem);
-        memcpy(writeBuffer.end(), data + total, rem);
-        writeBuffer.resize(writeBuffer.size() + rem);
+        storeWrite(data + total, size - total);
     }
     return true;
 }
@@ -535,6 +967,417 @@ bool SocketClient::write(const void *data, unsigned int size)
     return writeTo(String(), 0, reinterpret_cast<const unsigned char*>(data), size);
 }
 
+bool SocketClient::write(const iovec *vectors, int count)
+{
+    const bool ret = writeVectors(vectors, count);
+    updateWriteState();
+    return ret;
+}
+
+bool SocketClient::writeVectors(const iovec *vectors, int count)
+{
+    size_t size = 0;
+    for (int i = 0; i < count; ++i)
+        size += vectors[i].iov_len;
+    // write(0, 0) ends up here, flush what's queued
+    if (!size)
+        return writeTo(String(), 0, 0, 0);
+
+    if (ioUring && (wMode == Asynchronous || ioWrite)) {
+        for (int i = 0; i < count; ++i) {
+            if (vectors[i].iov_len)
+                appendWrite(vectors[i].iov_base, vectors[i].iov_len);
+        }
+        if (!writeWait && !ioWrite && !batchDepth && writeBuffer.size() > writeOffset)
+            submitWrite();
+        return fd != -1;
+    }
+
+    if ((batchDepth && !(socketMode & Udp)) || (fd == -1 && race)) {
+        for (int i = 0; i < count; ++i) {
+            if (vectors[i].iov_len)
+                storeWrite(vectors[i].iov_base, vectors[i].iov_len);
+        }
+        return isConnected();
+    }
+
+    if (!writeQueue.empty()) {
+        // the shared writes go first, if they don't all make it we
+        // have to queue behind them
+        if (!writeTo(String(), 0, 0, 0))
+            return false;
+        if (!writeQueue.empty()) {
+            for (int i = 0; i < count; ++i) {
+                if (vectors[i].iov_len)
+                    queueCopy(vectors[i].iov_base, vectors[i].iov_len);
+            }
+            return true;
+        }
+    }
+
+    // what's queued goes first, in the same call
+    const bool queued = writeBuffer.size() > writeOffset;
+    const int total = count + (queued ? 1 : 0);
+    enum { StackVectors = 8 };
+    iovec stackVectors[StackVectors];
+    std::unique_ptr<iovec[]> heapVectors;
+    if (total > StackVectors)
+        heapVectors.reset(new iovec[total]);
+    iovec *pending = heapVectors ? heapVectors.get() : stackVectors;
+    int first = 0;
+    if (queued) {
+        pending[0].iov_base = writeBuffer.data() + writeOffset;
+        pending[0].iov_len = writeBuffer.size() - writeOffset;
+    }
+    for (int i = 0; i < count; ++i)
+        pending[i + (queued ? 1 : 0)] = vectors[i];
+
+    SocketClient::SharedPtr socketPtr = shared_from_this();
+    bool wait = writeWait;
+    while (!wait && first < total) {
+        int e;
+        eintrwrap(e, ::writev(fd, pending + first, std::min(total - first, IOV_MAX)));
+        DEBUG() << "SENT(4)" << (total - first) << "VECTORS" << e << errno;
+        if (e == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                wait = true;
+                break;
+            }
+            // bad
+            signalError(socketPtr, WriteError);
+            close();
+            return false;
+        }
+        bytesWritten(socketPtr, e);
+        size_t written = e;
+        while (first < total && written >= pending[first].iov_len) {
+            written -= pending[first].iov_len;
+            ++first;
+        }
+        if (written) {
+            pending[first].iov_base = static_cast<char *>(pending[first].iov_base) + written;
+            pending[first].iov_len -= written;
+        }
+    }
+
+    // keep the rest, the write buffer itself only needs its offset moved
+    if (queued) {
+        if (first) {
+            writeOffset = 0;
+            writeBuffer.clear();
+        } else {
+            writeOffset = static_cast<unsigned char *>(pending[0].iov_base) - writeBuffer.data();
+            first = 1;
+        }
+    }
+    for (int i = first; i < total; ++i)
+        storeWrite(pending[i].iov_base, pending[i].iov_len);
+
+    if (wait && !writeWait && (writeBuffer.size() > writeOffset || !writeQueue.empty())) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+            if (wMode == Synchronous) {
+                (void)loop->processSocket(fd);
+                return isConnected();
+            }
+            loop->updateSocket(fd, writeWaitMode());
+            writeWait = true;
+        }
+    }
+    return fd != -1;
+}
+
+bool SocketClient::write(const std::shared_ptr<const void> &owner, const void *data, size_t size)
+{
+    if (ioUring || socketMode & Udp || !owner)
+        return write(data, size);
+    if (!size)
+        return isConnected();
+    if (!isConnected())
+        return false;
+    const QueuedWrite shared = { owner, static_cast<const char *>(data), size, -1, 0, Rct::monoUs() };
+    writeQueue.push_back(shared);
+    writeQueueSize += size;
+    writeBlock = 0;
+    return writeTo(String(), 0, 0, 0);
+}
+
+// keeps the file of a sendFile() open until the queue is done with it
+class OpenFile
+{
+public:
+    explicit OpenFile(int fd)
+        : mFd(fd)
+    {
+    }
+    ~OpenFile()
+    {
+        int ret;
+        eintrwrap(ret, ::close(mFd));
+    }
+
+private:
+    const int mFd;
+};
+
+bool SocketClient::sendFile(const Path &path, off_t offset, size_t length)
+{
+    if (!isConnected() || offset < 0)
+        return false;
+    int file;
+    eintrwrap(file, ::open(path.constData(), O_RDONLY));
+    if (file == -1)
+        return false;
+    std::shared_ptr<OpenFile> owner(new OpenFile(file));
+#ifdef HAVE_CLOEXEC
+    setFlags(file, FD_CLOEXEC, F_GETFD, F_SETFD);
+#endif
+    struct stat st;
+    if (::fstat(file, &st) == -1 || offset > st.st_size)
+        return false;
+    const size_t available = st.st_size - offset;
+    if (length == String::npos) {
+        length = available;
+    } else if (length > available) {
+        return false;
+    }
+    if (!length)
+        return true;
+
+    if (ioUring || socketMode & Udp) {
+        enum { ChunkSize = 64 * 1024 };
+        std::unique_ptr<char[]> chunk(new char[ChunkSize]);
+        while (length) {
+            ssize_t bytes;
+            eintrwrap(bytes, ::pread(file, chunk.get(), std::min<size_t>(length, ChunkSize), offset));
+            if (bytes <= 0 || !write(chunk.get(), bytes))
+                return false;
+            offset += bytes;
+            length -= bytes;
+        }
+        return true;
+    }
+
+    const QueuedWrite queued = { owner, 0, length, file, offset, Rct::monoUs() };
+    writeQueue.push_back(queued);
+    writeQueueSize += length;
+    writeBlock = 0;
+    return writeTo(String(), 0, 0, 0);
+}
+
+int SocketClient::writeFile(const QueuedWrite &queued)
+{
+    // bytesWritten() is an int
+    enum { MaxWrite = 1024 * 1024 };
+    const size_t size = std::min<size_t>(queued.size, MaxWrite);
+    int e;
+#if defined(HAVE_SENDFILE)
+    off_t offset = queued.offset;
+    eintrwrap(e, ::sendfile(fd, queued.file, &offset, size));
+    if (e != -1 || (errno != EINVAL && errno != ENOSYS))
+        return e;
+#elif defined(HAVE_DARWIN_SENDFILE)
+    for (;;) {
+        off_t written = size;
+        e = ::sendfile(queued.file, fd, queued.offset, &written, 0, 0);
+        // interrupted and would block sends may still have sent some
+        if (written > 0 || !e)
+            return written;
+        if (errno != EINTR)
+            break;
+    }
+    if (errno != EINVAL && errno != ENOTSUP && errno != EOPNOTSUPP && errno != ENOTSOCK)
+        return -1;
+#endif
+    // no sendfile() for this file
+    char buffer[16384];
+    ssize_t bytes;
+    eintrwrap(bytes, ::pread(queued.file, buffer, std::min(size, sizeof(buffer)), queued.offset));
+    if (bytes <= 0)
+        return bytes;
+    eintrwrap(e, ::write(fd, buffer, bytes));
+    return e;
+}
+
+void SocketClient::queueCopy(const void *data, size_t size)
+{
+    const char *in = static_cast<const char *>(data);
+    writeQueueSize += size;
+    while (size) {
+        size_t room = writeBlock ? WriteBlockSize - writeBlock->size() : 0;
+        if (!room) {
+            // big writes get a block of their own
+            std::shared_ptr<String> block(new String);
+            block->reserve(std::max<size_t>(size, WriteBlockSize));
+            const QueuedWrite queued = { block, block->constData(), 0, -1, 0, Rct::monoUs() };
+            writeQueue.push_back(queued);
+            writeBlock = block.get();
+            room = std::max<size_t>(size, WriteBlockSize);
+        }
+        // the block never grows past what was reserved, queued slices of
+        // it stay where they are
+        const size_t count = std::min(size, room);
+        QueuedWrite &back = writeQueue.back();
+        if (!back.size)
+            back.data = writeBlock->constData() + writeBlock->size();
+        writeBlock->append(in, count);
+        back.size += count;
+        if (writeBlock->size() >= WriteBlockSize)
+            writeBlock = 0;
+        in += count;
+        size -= count;
+    }
+}
+
+void SocketClient::endBatch()
+{
+    assert(batchDepth > 0);
+    if (!--batchDepth && fd != -1)
+        writeTo(String(), 0, 0, 0);
+}
+
+bool SocketClient::setTcpOption(int option, bool on)
+{
+    if (fd == -1 || !(socketMode & Tcp))
+        return false;
+    int value = on ? 1 : 0;
+    return !::setsockopt(fd, IPPROTO_TCP, option, &value, sizeof(value));
+}
+
+bool SocketClient::setNoDelay(bool on)
+{
+    return setTcpOption(TCP_NODELAY, on);
+}
+
+bool SocketClient::setCork(bool on)
+{
+#if defined(TCP_CORK)
+    return setTcpOption(TCP_CORK, on);
+#elif defined(TCP_NOPUSH)
+    return setTcpOption(TCP_NOPUSH, on);
+#else
+    (void)on;
+    return false;
+#endif
+}
+
+bool SocketClient::setBusyPoll(int us)
+{
+#ifdef SO_BUSY_POLL
+    if (fd == -1)
+        return false;
+    return !::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+#else
+    (void)us;
+    return false;
+#endif
+}
+
+bool SocketClient::pinToLoop(const EventLoop::SharedPtr &loop, int busyPollUs,
+                             std::function<void(const SocketClient::SharedPtr &)> &&callback)
+{
+    if (!loop || fd == -1 || race || blocking || ioUring || !(socketMode & (Tcp|Unix))
+        || pendingWrite() || batchDepth || !readBuffer.isEmpty()) {
+        return false;
+    }
+    if (busyPollUs > 0) {
+        // best effort, the loop spinning is most of the win
+        setBusyPoll(busyPollUs);
+        if (loop->busyPoll() < busyPollUs)
+            loop->setBusyPoll(busyPollUs);
+    }
+    if (EventLoop::SharedPtr current = EventLoop::eventLoop())
+        current->unregisterSocket(fd);
+    const int sock = fd;
+    const unsigned int mode = socketMode;
+    fd = -1;
+    socketState = Disconnected;
+    socketPort = 0;
+    address.clear();
+    loop->callLater([sock, mode, callback]() {
+            callback(SocketClient::SharedPtr(new SocketClient(sock, mode)));
+        });
+    return true;
+}
+
+void SocketClient::updateWriteState()
+{
+    if (!highWatermark)
+        return;
+    const size_t pending = pendingWrite();
+    if (!blocked) {
+        if (pending >= highWatermark && fd != -1) {
+            blocked = true;
+            signalWriteBlocked(shared_from_this());
+        }
+    } else if (pending <= lowWatermark) {
+        blocked = false;
+        signalWriteDrained(shared_from_this());
+    }
+}
+
+bool SocketClient::flushQueue()
+{
+    SocketClient::SharedPtr socketPtr = shared_from_this();
+    while (!writeQueue.empty() && !writeWait && fd != -1) {
+        int e;
+        if (!writeQueue.front().data) {
+            e = writeFile(writeQueue.front());
+            DEBUG() << "SENT(6)" << writeQueue.front().size << "FILE BYTES" << e << errno;
+            if (!e) {
+                // the file got shorter
+                signalError(socketPtr, WriteError);
+                close();
+                return false;
+            }
+        } else {
+            // file ranges are written on their own
+            enum { MaxVectors = 64 };
+            iovec vectors[MaxVectors];
+            int count = 0;
+            for (auto it = writeQueue.begin(); it != writeQueue.end() && it->data && count < MaxVectors; ++it, ++count) {
+                vectors[count].iov_base = const_cast<char *>(it->data);
+                vectors[count].iov_len = it->size;
+            }
+            eintrwrap(e, ::writev(fd, vectors, count));
+            DEBUG() << "SENT(5)" << count << "VECTORS" << e << errno;
+        }
+        if (e == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+                    loop->updateSocket(fd, writeWaitMode());
+                    writeWait = true;
+                }
+                break;
+            }
+            // bad
+            signalError(socketPtr, WriteError);
+            close();
+            return false;
+        }
+        writeQueueSize -= e;
+        size_t written = e;
+        while (written) {
+            QueuedWrite &front = writeQueue.front();
+            if (written < front.size) {
+                if (front.data) {
+                    front.data += written;
+                } else {
+                    front.offset += written;
+                }
+                front.size -= written;
+                break;
+            }
+            written -= front.size;
+            if (writeQueue.size() == 1)
+                writeBlock = 0;
+            counters->latency(Rct::monoUs() - front.time);
+            writeQueue.pop_front();
+        }
+        bytesWritten(socketPtr, e);
+    }
+    return fd != -1;
+}
+
 static String addrToString(const sockaddr* addr, bool IPv6)
 {
     String ip(INET6_ADDRSTRLEN, '\0');
@@ -556,6 +1399,89 @@ static uint16_t addrToPort(const sockaddr* addr, bool IPv6)
     return ntohs(reinterpret_cast<const sockaddr_in*>(addr)->sin_port);
 }
 
+String SocketClient::Datagram::host() const
+{
+    return addrToString(address, address->sa_family == AF_INET6);
+}
+
+uint16_t SocketClient::Datagram::port() const
+{
+    return addrToPort(address, address->sa_family == AF_INET6);
+}
+
+void SocketClient::setDatagramBatch(size_t count, size_t slotSize)
+{
+    datagramCount = std::max<size_t>(count, 1);
+    datagramSize = std::max<size_t>(slotSize, 1);
+    datagramRing.reset();
+}
+
+bool SocketClient::readDatagrams(const SocketClient::SharedPtr &socketPtr)
+{
+    if (!datagramRing)
+        datagramRing.reset(new DatagramRing(datagramCount, datagramSize));
+    DatagramRing &ring = *datagramRing;
+
+    for (;;) {
+        int received;
+#ifdef HAVE_RECVMMSG
+        for (size_t i = 0; i < datagramCount; ++i) {
+            ring.headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+            ring.headers[i].msg_hdr.msg_flags = 0;
+        }
+        eintrwrap(received, ::recvmmsg(fd, &ring.headers[0], datagramCount, MSG_DONTWAIT, 0));
+        for (int i = 0; i < received; ++i) {
+            Datagram &datagram = ring.datagrams[i];
+            datagram.addressSize = ring.headers[i].msg_hdr.msg_namelen;
+            datagram.size = ring.headers[i].msg_len;
+            datagram.truncated = ring.headers[i].msg_hdr.msg_flags & MSG_TRUNC;
+        }
+#else
+        received = 0;
+        while (static_cast<size_t>(received) < datagramCount) {
+            Datagram &datagram = ring.datagrams[received];
+            socklen_t size = sizeof(sockaddr_storage);
+            ssize_t e;
+            eintrwrap(e, ::recvfrom(fd, const_cast<unsigned char*>(datagram.data), datagramSize, 0,
+                                    reinterpret_cast<sockaddr*>(&ring.addresses[received]), &size));
+            if (e == -1) {
+                if (!received)
+                    received = -1;
+                break;
+            }
+            datagram.addressSize = size;
+            datagram.size = e;
+            // recvfrom() only tells if we ask for MSG_TRUNC
+            datagram.truncated = false;
+            ++received;
+        }
+#endif
+        DEBUG() << "RECEIVED(3)" << received << "DATAGRAMS" << errno;
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            signalError(socketPtr, ReadError);
+            close();
+            return false;
+        }
+        if (received) {
+            uint64_t bytes = 0;
+            for (int i = 0; i < received; ++i)
+                bytes += ring.datagrams[i].size;
+#ifdef HAVE_RECVMMSG
+            counters->read.add(bytes, 1, EventLoop::threadNow());
+#else
+            counters->read.add(bytes, received, EventLoop::threadNow());
+#endif
+            signalReadyReadBatch(socketPtr, &ring.datagrams[0], static_cast<size_t>(received));
+        }
+        if (fd == -1)
+            return false;
+        if (static_cast<size_t>(received) < datagramCount)
+            return true;
+    }
+}
+
 void SocketClient::socketCallback(int f, int mode)
 {
     assert(f == fd);
@@ -571,7 +1497,7 @@ void SocketClient::socketCallback(int f, int mode)
 
     if (writeWait && (mode & EventLoop::SocketWrite)) {
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-            loop->updateSocket(fd, EventLoop::SocketRead);
+            loop->updateSocket(fd, ioUring ? 0 : EventLoop::SocketRead);
             writeWait = false;
         }
     }
@@ -585,20 +1511,31 @@ void SocketClient::socketCallback(int f, int mode)
     socklen_t fromLen = 0;
     const bool isIPv6 = socketMode & IPv6;
 
-    if (mode & EventLoop::SocketRead) {
+    const bool datagramBatch = socketMode & Udp && !signalReadyReadBatch.isEmpty();
+    if (mode & EventLoop::SocketRead && datagramBatch) {
+        if (!readDatagrams(socketPtr))
+            return;
+        if (writeWait) {
+            if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+                loop->updateSocket(fd, writeWaitMode());
+            }
+        }
+    }
+
+    if (mode & EventLoop::SocketRead && !ioUring && !datagramBatch) {
 
-        enum { BlockSize = 1024, AllocateAt = 512 };
+        enum { AllocateAt = 512 };
         int e;
 
-        unsigned int total = 0;
+        // what no slot took from the last read is read behind
+        const size_t previous = readBuffer.size();
+        size_t total = previous, received = 0;
+        bool filled = false;
         for(;;) {
-            unsigned int rem = readBuffer.capacity() - readBuffer.size();
-            // printf("reading, remaining size %u\n", rem);
+            size_t rem = readBuffer.capacity() - readBuffer.size();
             if (rem <= AllocateAt) {
-                // printf("allocating more\n");
-                readBuffer.reserve(readBuffer.size() + BlockSize);
+                reserveRead();
                 rem = readBuffer.capacity() - readBuffer.size();
-                // printf("Rem is now %d\n", rem);
             }
             if (socketMode & Udp) {
                 if (isIPv6) {
@@ -612,6 +1549,8 @@ void SocketClient::socketCallback(int f, int mode)
                 eintrwrap(e, ::read(fd, readBuffer.end(), rem));
             }
             DEBUG() << "RECEIVED(2)" << rem << "BYTES" << e << errno;
+            if (e != -1)
+                counters->read.add(e, 1, EventLoop::threadNow());
             if (e == -1) {
                 if (errno == EAGAIN || errno == EWOULDBLOCK) {
                     break;
@@ -623,14 +1562,18 @@ void SocketClient::socketCallback(int f, int mode)
                 }
             } else if (e == 0) {
                 // socket closed
-                if (total) {
+                if (total > previous) {
                     if (!fromLen)
                         signalReadyRead(socketPtr, std::move(readBuffer));
                 }
                 signalDisconnected(socketPtr);
                 close();
                 return;
-            } else if (fromLen) {
+            }
+            received += e;
+            if (static_cast<size_t>(e) == rem)
+                filled = true;
+            if (fromLen) {
                 readBuffer.resize(e);
                 signalReadyReadFrom(socketPtr, addrToString(&fromAddr, isIPv6), addrToPort(&fromAddr, isIPv6), std::move(readBuffer));
                 readBuffer.clear();
@@ -640,12 +1583,16 @@ void SocketClient::socketCallback(int f, int mode)
             }
         }
         assert(total <= readBuffer.capacity());
-        if (!fromLen)
+        adaptReadSize(received, filled);
+        if (!fromLen && total > previous)
             signalReadyRead(socketPtr, std::move(readBuffer));
+        // don't hold on to memory while the socket is idle
+        if (readPool && readBuffer.isEmpty() && readBuffer.capacity())
+            readPool->release(std::move(readBuffer));
 
         if (writeWait) {
             if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+                loop->updateSocket(fd, writeWaitMode());
             }
         }
     }
@@ -662,10 +1609,17 @@ void SocketClient::socketCallback(int f, int mode)
             }
             if (!err) {
                 // connected
+                if (race)
+                    endRace();
                 socketState = Connected;
+                if (ioUring)
+                    submitRead();
                 signalConnected(socketPtr);
             } else {
-                // failed to connect
+                // failed to connect, unless another address is still
+                // being tried
+                if (race && raceFailed())
+                    return;
                 signalError(socketPtr, ConnectError);
                 close();
                 return;
@@ -694,11 +1648,17 @@ bool SocketClient::init(unsigned int mode)
         break;
     }
 
-    fd = ::socket(domain, type, 0);
-    if (fd < 0) {
+    const int sock = ::socket(domain, type, 0);
+    if (sock < 0) {
         // bad
         return false;
     }
+    return adopt(sock, mode);
+}
+
+bool SocketClient::adopt(int sock, unsigned int mode)
+{
+    fd = sock;
 #ifdef HAVE_NOSIGPIPE
     int flags = 1;
     ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&flags, sizeof(int));
@@ -708,7 +1668,9 @@ bool SocketClient::init(unsigned int mode)
 #endif
     if (!blocking) {
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-            loop->registerSocket(fd, EventLoop::SocketRead,
+            ioUring = loop->hasIoUring() && !(mode & Udp);
+            readPool = loop->bufferPool();
+            loop->registerSocket(fd, ioUring ? 0 : EventLoop::SocketRead,
                                  std::bind(&SocketClient::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
             if (!setFlags(fd, O_NONBLOCK, F_GETFL, F_SETFL)) {
                 close();
@@ -721,6 +1683,106 @@ bool SocketClient::init(unsigned int mode)
     return true;
 }
 
+void SocketClient::reserveRead()
+{
+    if (!readBuffer.capacity() && readPool) {
+        readBuffer = readPool->acquire(readSize);
+    } else {
+        readBuffer.reserve(readBuffer.size() + std::max(readSize, readBuffer.capacity()));
+    }
+}
+
+void SocketClient::adaptReadSize(size_t read, bool filled)
+{
+    if (filled) {
+        readSize = std::min<size_t>(readSize * 2, BufferPool::MaximumSize);
+    } else if (read < readSize / 4) {
+        readSize = std::max<size_t>(readSize / 2, BufferPool::MinimumSize);
+    }
+}
+
+void SocketClient::submitRead()
+{
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop)
+        return;
+    reserveRead();
+    ioRead = loop->submitRead(fd, std::move(readBuffer),
+                              std::bind(&SocketClient::readCompleted, this, std::placeholders::_1, std::placeholders::_2));
+    if (!ioRead) {
+        signalError(shared_from_this(), ReadError);
+        close();
+    }
+}
+
+void SocketClient::readCompleted(int result, Buffer &&buffer)
+{
+    ioRead = 0;
+    SocketClient::SharedPtr socketPtr = shared_from_this();
+    if (result < 0) {
+        signalError(socketPtr, ReadError);
+        close();
+        return;
+    }
+    assert(!readBuffer.capacity());
+    readBuffer = std::move(buffer);
+    DEBUG() << "RECEIVED(3)" << result << "BYTES";
+    counters->read.add(result, 1, EventLoop::threadNow());
+    if (!result) {
+        // socket closed
+        if (!readBuffer.isEmpty())
+            signalReadyRead(socketPtr, std::move(readBuffer));
+        signalDisconnected(socketPtr);
+        close();
+        return;
+    }
+    adaptReadSize(result, readBuffer.size() == readBuffer.capacity());
+    signalReadyRead(socketPtr, std::move(readBuffer));
+    if (fd != -1 && !ioRead)
+        submitRead();
+}
+
+void SocketClient::submitWrite()
+{
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop)
+        return;
+    const size_t offset = writeOffset;
+    writeOffset = 0;
+    ioWriteSize = writeBuffer.size() - offset;
+    ioWrite = loop->submitWrite(fd, std::move(writeBuffer), offset,
+                                std::bind(&SocketClient::writeCompleted, this, std::placeholders::_1, std::placeholders::_2));
+    if (!ioWrite) {
+        ioWriteSize = 0;
+        signalError(shared_from_this(), WriteError);
+        close();
+    }
+}
+
+void SocketClient::writeCompleted(int result, Buffer &&buffer)
+{
+    ioWrite = 0;
+    ioWriteSize = 0;
+    SocketClient::SharedPtr socketPtr = shared_from_this();
+    if (result < 0) {
+        signalError(socketPtr, WriteError);
+        close();
+        return;
+    }
+    DEBUG() << "SENT(3)" << result << "BYTES";
+    bytesWritten(socketPtr, result);
+    if (fd == -1 || ioWrite)
+        return;
+    if (!writeBuffer.isEmpty()) {
+        submitWrite();
+    } else if (!writeBuffer.capacity()) {
+        // hang on to the allocation for the next write
+        buffer.clear();
+        writeBuffer = std::move(buffer);
+    }
+    updateWriteState();
+}
+
 bool SocketClient::setFlags(int fd, int flag, int getcmd, int setcmd, FlagMode mode)
 {
     int flg = 0, e;
@@ -737,37 +1799,39 @@ bool SocketClient::setFlags(int fd, int flag, int getcmd, int setcmd, FlagMode m
 
 double SocketClient::mbpsWritten() const
 {
-    uint64_t bytes = 0, currentStart = 0, currentEnd = 0;
-    uint64_t elapsed = 0;
+    return stats().writeRate / (1024 * 1024);
+}
 
-    for (const auto &t : mWrites) {
-        // assert(t.isCompleted());
-        bytes += t.bytes;
-        if (t.startTime > currentEnd) {
-            elapsed += currentEnd - currentStart;
-            currentStart = t.startTime;
-        }
-        assert(currentEnd >= currentStart);
-        currentEnd = t.endTime;
-    }
-    elapsed += currentEnd - currentStart;
-    return ((static_cast<double>(bytes) / (1024 * 1024)) / (static_cast<double>(elapsed) / 1000.0));
+void SocketClient::bytesWritten(const SocketClient::SharedPtr &socket, int bytes)
+{
+    counters->write.add(bytes, 1, EventLoop::threadNow());
+    signalBytesWritten(socket, bytes);
 }
 
+SocketClient::Stats SocketClient::stats() const
+{
+    const uint64_t now = Rct::monoUs();
+    Stats ret;
+    ret.fd = fd;
+    ret.bytesRead = counters->read.bytes.load(std::memory_order_relaxed);
+    ret.bytesWritten = counters->write.bytes.load(std::memory_order_relaxed);
+    ret.readCalls = counters->read.calls.load(std::memory_order_relaxed);
+    ret.writeCalls = counters->write.calls.load(std::memory_order_relaxed);
+    ret.readRate = counters->read.currentRate(now);
+    ret.writeRate = counters->write.currentRate(now);
+    ret.queueLatency50 = counters->percentile(50);
+    ret.queueLatency90 = counters->percentile(90);
+    ret.queueLatency99 = counters->percentile(99);
+    ret.queueLatencyMax = counters->latencyMax.load(std::memory_order_relaxed);
+    return ret;
+}
 
-void SocketClient::bytesWritten(const SocketClient::SharedPtr &socket, uint64_t bytes)
+List<SocketClient::Stats> SocketClient::allStats()
 {
-    const uint64_t copy = bytes;
-    List<TimeData>::iterator it = mPendingWrites.begin();
-    while (bytes && it != mPendingWrites.end()) {
-        if (it->add(bytes)) {
-            mWrites.append(*it);
-            it = mPendingWrites.erase(it);
-        } else {
-            ++it;
-        }
-    }
-    assert(!bytes);
-    signalBytesWritten(socket, copy);
+    List<Stats> ret;
+    std::lock_guard<std::mutex> lock(sRegistryMutex);
+    for (const SocketClient *client : sRegistry)
+        ret.append(client->stats());
+    return ret;
 }
 
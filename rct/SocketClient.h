@@ -1,13 +1,22 @@
 #ifndef TCPSOCKET_H
 #define TCPSOCKET_H
 
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <deque>
 #include <memory>
+#include <vector>
 
 #include "Buffer.h"
+#include "List.h"
+#include "DnsResolver.h"
 #include "Rct.h"
 #include "SignalSlot.h"
 #include "String.h"
 
+class EventLoop;
+
 class SocketClient : public std::enable_shared_from_this<SocketClient>
 {
 public:
@@ -34,14 +43,22 @@ public:
     unsigned int mode() const { return socketMode; }
 
     bool connect(const String& path); // UNIX
+    // On an EventLoop the host is resolved through DnsResolver without
+    // blocking and its addresses are raced, IPv6 and IPv4 interleaved,
+    // starting the next attempt when one fails or hasn't connected within
+    // connectAttemptDelay() ms. The state is Connecting meanwhile and
+    // writes are queued until the first attempt connects.
     bool connect(const String& host, uint16_t port); // TCP
     bool bind(uint16_t port); // UDP
 
+    void setConnectAttemptDelay(int ms) { connectDelay = ms; }
+    int connectAttemptDelay() const { return connectDelay; }
+
     String hostName() const { return (socketMode & Tcp ? address : String()); }
     String path() const { return (socketMode & Unix ? address : String()); }
     uint16_t port() const { return socketPort; }
 
-    bool isConnected() const { return fd != -1; }
+    bool isConnected() const { return fd != -1 || race; }
     int socket() const { return fd; }
 
     enum WriteMode {
@@ -56,6 +73,70 @@ public:
     // TCP/UNIX
     bool write(const void *data, unsigned int num);
     bool write(const String &data) { return write(&data[0], data.size()); }
+    // gathers all of the vectors into as few writev() calls as it can,
+    // only what doesn't make it to the socket is copied
+    bool write(const iovec *vectors, int count);
+    // writes data owned by owner, which is kept alive instead of copying
+    // the data while it waits for the socket. Copies on io_uring and UDP.
+    bool write(const std::shared_ptr<const void> &owner, const void *data, size_t size);
+    // streams length bytes of the file from offset, everything after
+    // offset with npos, with sendfile() where there is one. Queued and
+    // reported through bytesWritten() like a write(), copies on io_uring
+    // and UDP. false if the file can't be opened or is too short
+    bool sendFile(const Path &path, off_t offset = 0, size_t length = String::npos);
+    // bytes passed to write() that haven't been written to the socket yet
+    size_t pendingWrite() const { return writeBuffer.size() - writeOffset + writeQueueSize + ioWriteSize; }
+    // writeBlocked() is emitted when pendingWrite() reaches high and
+    // writeDrained() once it's back down to low, high 0 turns it off
+    void setWriteWatermarks(size_t high, size_t low)
+    {
+        assert(low <= high);
+        highWatermark = high;
+        lowWatermark = low;
+    }
+    size_t writeHighWatermark() const { return highWatermark; }
+    size_t writeLowWatermark() const { return lowWatermark; }
+    bool isWriteBlocked() const { return blocked; }
+
+    // Holds back everything written to the client while it exists and
+    // writes it in as few calls as possible once the last Batch for it is
+    // gone, so a burst of small writes goes out in full segments
+    class Batch
+    {
+    public:
+        Batch(const SocketClient::SharedPtr &client)
+            : mClient(client)
+        {
+            ++mClient->batchDepth;
+        }
+        ~Batch() { mClient->endBatch(); }
+
+    private:
+        SocketClient::SharedPtr mClient;
+
+        Batch(const Batch &) = delete;
+        Batch &operator=(const Batch &) = delete;
+    };
+    bool isBatching() const { return batchDepth; }
+
+    // TCP_NODELAY and TCP_CORK (TCP_NOPUSH on BSD) for TCP sockets, false
+    // if the socket isn't one or the option isn't available
+    bool setNoDelay(bool on);
+    bool setCork(bool on);
+
+    // SO_BUSY_POLL, the kernel polls the device queue for up to us
+    // microseconds when a read finds nothing. Raising it past the
+    // net.core.busy_read sysctl needs CAP_NET_ADMIN. Linux only.
+    bool setBusyPoll(int us);
+    // Hands the connected stream socket over to loop for latency critical
+    // traffic, typically a loop of its own in an EventLoopGroup. With
+    // busyPollUs the socket gets SO_BUSY_POLL and loop busy polls for at
+    // least as long. callback is called on loop's thread with the
+    // SocketClient that now owns the socket, connect its signals there.
+    // This one is left disconnected. Fails while writes are pending,
+    // unread data is buffered or on io_uring.
+    bool pinToLoop(const std::shared_ptr<EventLoop> &loop, int busyPollUs,
+                   std::function<void(const SocketClient::SharedPtr &)> &&callback);
 
     String peerName(uint16_t* port = 0) const;
     String peerString() const
@@ -85,6 +166,33 @@ public:
         return writeTo(host, port, reinterpret_cast<const unsigned char*>(&data[0]), data.size());
     }
 
+    // A datagram and its peer. Those passed to readyReadBatch() point into
+    // the socket's receive slots and are only valid during the emission,
+    // truncated ones didn't fit in a slot.
+    struct Datagram
+    {
+        const sockaddr *address;
+        socklen_t addressSize;
+        const unsigned char *data;
+        size_t size;
+        bool truncated;
+
+        String host() const;
+        uint16_t port() const;
+    };
+    // Sent right away with sendto()/sendmmsg() and never queued, datagrams
+    // that would block are dropped. writeBatch() returns how many were
+    // sent or -1 on errors.
+    bool writeTo(const sockaddr *address, socklen_t addressSize, const unsigned char *data, unsigned int num);
+    int writeBatch(const Datagram *datagrams, size_t count);
+
+    // While readyReadBatch() has connections datagrams are received up to
+    // count at a time, with recvmmsg() where available, into count slots
+    // of slotSize bytes each. readyReadFrom() isn't emitted meanwhile.
+    void setDatagramBatch(size_t count, size_t slotSize);
+    size_t datagramBatchCount() const { return datagramCount; }
+    size_t datagramSlotSize() const { return datagramSize; }
+
     // UDP Multicast
     bool addMembership(const String& ip);
     bool dropMembership(const String& ip);
@@ -93,12 +201,18 @@ public:
 
     const Buffer& buffer() const { return readBuffer; }
     Buffer&& takeBuffer() { return std::move(readBuffer); }
+    // the pool of the loop the socket is on, readyRead() buffers come
+    // from it and can be given back with BufferPool::release()
+    const std::shared_ptr<BufferPool> &bufferPool() const { return readPool; }
 
     Signal<std::function<void(const SocketClient::SharedPtr&, Buffer&&)> >& readyRead() { return signalReadyRead; }
     Signal<std::function<void(const SocketClient::SharedPtr&, const String&, uint16_t, Buffer&&)> >& readyReadFrom() { return signalReadyReadFrom; }
+    Signal<std::function<void(const SocketClient::SharedPtr&, const Datagram*, size_t)> >& readyReadBatch() { return signalReadyReadBatch; }
     Signal<std::function<void(const SocketClient::SharedPtr&)> >& connected() { return signalConnected; }
     Signal<std::function<void(const SocketClient::SharedPtr&)> >& disconnected() { return signalDisconnected; }
     Signal<std::function<void(const SocketClient::SharedPtr&, int)> >& bytesWritten() { return signalBytesWritten; }
+    Signal<std::function<void(const SocketClient::SharedPtr&)> >& writeBlocked() { return signalWriteBlocked; }
+    Signal<std::function<void(const SocketClient::SharedPtr&)> >& writeDrained() { return signalWriteDrained; }
 
     enum Error {
         InitializeError,
@@ -114,11 +228,29 @@ public:
     enum FlagMode { FlagAppend, FlagOverwrite };
     static bool setFlags(int fd, int flag, int getcmd, int setcmd, FlagMode mode = FlagAppend);
 
+    // Kept in constant space and time as data moves, readable from any
+    // thread. Calls are the read and write syscalls that moved data,
+    // rates are exponentially weighted bytes per second. The latencies,
+    // in microseconds, are how long queued writes waited for the socket,
+    // percentiles are accurate to a power of two.
+    struct Stats
+    {
+        int fd;
+        uint64_t bytesRead, bytesWritten;
+        uint64_t readCalls, writeCalls;
+        double readRate, writeRate;
+        uint64_t queueLatency50, queueLatency90, queueLatency99, queueLatencyMax;
+    };
+    Stats stats() const;
+    // the stats of every SocketClient in the process
+    static List<Stats> allStats();
+
     double mbpsWritten() const;
     bool logsEnabled() const { return mLogsEnabled; }
     void setLogsEnabled(bool on) { mLogsEnabled = on; }
 private:
     bool init(unsigned int mode);
+    bool adopt(int sock, unsigned int mode);
 
     int fd;
     uint16_t socketPort;
@@ -129,54 +261,107 @@ private:
     String address;
     bool blocking;
     bool mLogsEnabled;
+    // stream sockets on an io_uring loop read and write through
+    // EventLoop::submitRead()/submitWrite(), these are the ids in flight
+    bool ioUring;
+    uint64_t ioRead, ioWrite;
+    size_t ioWriteSize;
+
+    // a connect(host, port) that's resolving or trying addresses
+    struct ConnectRace;
+    std::unique_ptr<ConnectRace> race;
+    unsigned int connectId;
+    int connectDelay;
+    void connectResolved(const DnsResolver::Addresses &addresses);
+    bool raceNext();
+    void raceCallback(int sock, int mode);
+    bool raceFailed();
+    void dropAttempt(int sock);
+    void connectFinished(int sock);
+    void endRace();
 
     Signal<std::function<void(const SocketClient::SharedPtr&, Buffer&&)> > signalReadyRead;
     Signal<std::function<void(const SocketClient::SharedPtr&, const String&, uint16_t, Buffer&&)> > signalReadyReadFrom;
+    Signal<std::function<void(const SocketClient::SharedPtr&, const Datagram*, size_t)> > signalReadyReadBatch;
     Signal<std::function<void(const SocketClient::SharedPtr&)> >signalConnected, signalDisconnected;
+    Signal<std::function<void(const SocketClient::SharedPtr&)> > signalWriteBlocked, signalWriteDrained;
     Signal<std::function<void(const SocketClient::SharedPtr&, Error)> > signalError;
     Signal<std::function<void(const SocketClient::SharedPtr&, int)> > signalBytesWritten;
-    void bytesWritten(const SocketClient::SharedPtr &socket, uint64_t bytes);
+    void bytesWritten(const SocketClient::SharedPtr &socket, int bytes);
     Buffer readBuffer, writeBuffer;
     size_t writeOffset;
-
-    int writeData(const unsigned char *data, int size);
-    void socketCallback(int, int);
-
-    struct TimeData {
-        TimeData(uint64_t b = 0)
-            : startTime(Rct::monoMs()), endTime(0), bytes(b), completed(0)
-        {}
-
-        bool add(uint64_t &available)
-        {
-            assert(completed < bytes);
-            const uint64_t needed = bytes - completed;
-            const uint64_t provided = std::min(needed, available);
-            completed += provided;
-            assert(available > provided);
-            available -= provided;
-            if (needed == provided) {
-                endTime = Rct::monoMs();
-                return true;
-            }
-            return false;
-        }
-
-        bool isCompleted() const
-        {
-            return bytes == completed;
-        }
-        uint64_t startTime, endTime, bytes, completed;
+    // reads go into buffers of readSize from readPool, doubled when a
+    // read fills the buffer and halved when reads stay small
+    std::shared_ptr<BufferPool> readPool;
+    size_t readSize;
+    void reserveRead();
+    void adaptReadSize(size_t read, bool filled);
+    // the receive slots of readyReadBatch(), allocated on the first read
+    struct DatagramRing;
+    std::unique_ptr<DatagramRing> datagramRing;
+    size_t datagramCount, datagramSize;
+    bool readDatagrams(const SocketClient::SharedPtr &socketPtr);
+    // what stream sockets couldn't write yet, slices of the shared
+    // write()s and of fixed size blocks the rest is copied into, or
+    // sendFile() ranges, which have no data. Only UDP and io_uring queue
+    // in writeBuffer.
+    struct QueuedWrite
+    {
+        std::shared_ptr<const void> owner;
+        const char *data;
+        size_t size;
+        int file;
+        off_t offset;
+        // when it was queued, in microseconds
+        uint64_t time;
     };
-
-    void compactWrites(size_t maxSize)
+    enum { WriteBlockSize = 64 * 1024 };
+    std::deque<QueuedWrite> writeQueue;
+    size_t writeQueueSize;
+    // the block at the back of the queue that still has room
+    String *writeBlock;
+    size_t highWatermark, lowWatermark;
+    bool blocked;
+    // Batch nesting, writes are queued while it's not 0
+    int batchDepth;
+    void endBatch();
+    // stats(), bounded no matter how much goes through
+    struct Counters;
+    std::unique_ptr<Counters> counters;
+    bool setTcpOption(int option, bool on);
+    void queueCopy(const void *data, size_t size);
+    bool flushQueue();
+    void storeWrite(const void *data, size_t size)
     {
-        if (mWrites.size() > maxSize) {
-            mWrites.remove(0, mWrites.size() - maxSize);
+        if (socketMode & Udp) {
+            appendWrite(data, size);
+        } else {
+            queueCopy(data, size);
         }
     }
+    void updateWriteState();
+    bool writeToSocket(const String& host, uint16_t port, const unsigned char* data, unsigned int num);
+    bool writeVectors(const iovec *vectors, int count);
+    int writeFile(const QueuedWrite &queued);
 
-    List<TimeData> mWrites, mPendingWrites;
+    int writeData(const unsigned char *data, int size);
+    void appendWrite(const void *data, size_t size)
+    {
+        if (writeBuffer.size() + size > writeBuffer.capacity())
+            writeBuffer.reserve(std::max(writeBuffer.size() + size, writeBuffer.capacity() * 2));
+        memcpy(writeBuffer.end(), data, size);
+        writeBuffer.resize(writeBuffer.size() + size);
+    }
+    void socketCallback(int, int);
+    void submitRead();
+    void submitWrite();
+    void readCompleted(int result, Buffer &&buffer);
+    void writeCompleted(int result, Buffer &&buffer);
+    unsigned int writeWaitMode() const
+    {
+        // reads don't go through the socket callback with io_uring
+        return (ioUring ? 0 : EventLoop::SocketRead) | EventLoop::SocketWrite | EventLoop::SocketOneShot;
+    }
 
     friend class Resolver;
 };
@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -12,12 +13,18 @@
 
 
 #include "EventLoop.h"
+#include "EventLoopGroup.h"
 #include "Log.h"
 #include "rct/rct-config.h"
 #include "Rct.h"
 
+enum { DefaultBacklog = 128, DefaultMaxAccepts = 64 };
+
 SocketServer::SocketServer()
-    : fd(-1), isIPv6(false)
+    : fd(-1), isIPv6(false), distribution(RoundRobin),
+      listenBacklog(DefaultBacklog), maxAccepts(DefaultMaxAccepts),
+      acceptedCount(0), backlogFullCount(0), rateStart(Rct::monoMs()), rateCount(0),
+      lastRate(0)
 {}
 
 SocketServer::~SocketServer()
@@ -29,9 +36,18 @@ void SocketServer::close()
 {
     if (fd == -1)
         return;
-    if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
-        loop->unregisterSocket(fd);
-    ::close(fd);
+    if (!listeners.empty()) {
+        for (const auto &listener : listeners) {
+            if (EventLoop::SharedPtr loop = listener.second.lock())
+                loop->unregisterSocket(listener.first);
+            ::close(listener.first);
+        }
+        listeners.clear();
+    } else {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+            loop->unregisterSocket(fd);
+        ::close(fd);
+    }
     fd = -1;
     if (!path.isEmpty()) {
         Path::rm(path);
@@ -45,35 +61,6 @@ bool SocketServer::listen(uint16_t port, Mode mode)
 
     isIPv6 = (mode & IPv6);
 
-    fd = ::socket(isIPv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        // bad
-        serverError(this, InitializeError);
-        return false;
-    }
-
-    int e;
-    int flags = 1;
-#ifdef HAVE_NOSIGPIPE
-    e = ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&flags, sizeof(int));
-    if (e == -1) {
-        serverError(this, InitializeError);
-        close();
-        return false;
-    }
-#endif
-    // turn on nodelay
-    flags = 1;
-    e = ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flags, sizeof(int));
-    if (e == -1) {
-        serverError(this, InitializeError);
-        close();
-        return false;
-    }
-#ifdef HAVE_CLOEXEC
-    SocketClient::setFlags(fd, FD_CLOEXEC, F_GETFD, F_SETFD);
-#endif
-
     // ### support specific interfaces
     union {
         sockaddr_in addr4;
@@ -95,9 +82,103 @@ bool SocketServer::listen(uint16_t port, Mode mode)
         addr4.sin_port = htons(port);
     }
 
+#ifdef HAVE_REUSEPORT
+    if (group && group->size() && distribution == ReusePort)
+        return listenReusePort(&addr, size);
+#endif
+
+    fd = tcpSocket(false);
+    if (fd == -1)
+        return false;
     return commonBindAndListen(&addr, size);
 }
 
+int SocketServer::tcpSocket(bool reusePort)
+{
+    const int sock = ::socket(isIPv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        // bad
+        serverError(this, InitializeError);
+        return -1;
+    }
+
+    int e;
+    int flags = 1;
+#ifdef HAVE_NOSIGPIPE
+    e = ::setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (void *)&flags, sizeof(int));
+    if (e == -1) {
+        serverError(this, InitializeError);
+        ::close(sock);
+        return -1;
+    }
+#endif
+    // turn on nodelay
+    flags = 1;
+    e = ::setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flags, sizeof(int));
+#ifdef HAVE_REUSEPORT
+    if (e != -1 && reusePort)
+        e = ::setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &flags, sizeof(int));
+#else
+    (void)reusePort;
+#endif
+    if (e == -1) {
+        serverError(this, InitializeError);
+        ::close(sock);
+        return -1;
+    }
+#ifdef HAVE_CLOEXEC
+    SocketClient::setFlags(sock, FD_CLOEXEC, F_GETFD, F_SETFD);
+#endif
+    return sock;
+}
+
+bool SocketServer::listenReusePort(sockaddr* addr, size_t size)
+{
+    for (size_t i = 0; i < group->size(); ++i) {
+        const int sock = tcpSocket(true);
+        if (sock == -1) {
+            close();
+            return false;
+        }
+        listeners.push_back(std::make_pair(sock, EventLoop::WeakPtr(group->loop(i))));
+        if (fd == -1)
+            fd = sock;
+
+        if (::bind(sock, addr, size) < 0) {
+            serverError(this, BindError);
+            close();
+            return false;
+        }
+        if (!i) {
+            // pick up the port in case we were asked for any
+            socklen_t len = size;
+            ::getsockname(sock, addr, &len);
+        }
+        if (::listen(sock, listenBacklog) < 0) {
+            fprintf(stderr, "::listen() failed with errno: %s\n",
+                    Rct::strerror().constData());
+
+            serverError(this, ListenError);
+            close();
+            return false;
+        }
+        if (!SocketClient::setFlags(sock, O_NONBLOCK, F_GETFL, F_SETFL)) {
+            serverError(this, InitializeError);
+            close();
+            return false;
+        }
+    }
+    // the loops may call back right away, listeners must be complete
+    for (const auto &listener : listeners) {
+        listener.second.lock()->registerSocket(listener.first, EventLoop::SocketRead | EventLoop::SocketLevelTriggered,
+                                               std::bind(&SocketServer::socketCallback,
+                                                         this,
+                                                         std::placeholders::_1,
+                                                         std::placeholders::_2));
+    }
+    return true;
+}
+
 bool SocketServer::listen(const Path &p)
 {
     close();
@@ -149,9 +230,7 @@ bool SocketServer::commonBindAndListen(sockaddr* addr, size_t size)
 
 bool SocketServer::commonListen()
 {
-    // ### should be able to customize the backlog
-    enum { Backlog = 128 };
-    if (::listen(fd, Backlog) < 0) {
+    if (::listen(fd, listenBacklog) < 0) {
         fprintf(stderr, "::listen() failed with errno: %s\n",
                 Rct::strerror().constData());
 
@@ -161,8 +240,8 @@ bool SocketServer::commonListen()
     }
 
     if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-        loop->registerSocket(fd, EventLoop::SocketRead,
-                             //|EventLoop::SocketWrite,
+        // level triggered, a capped wakeup leaves connections behind
+        loop->registerSocket(fd, EventLoop::SocketRead | EventLoop::SocketLevelTriggered,
                              std::bind(&SocketServer::socketCallback,
                                        this,
                                        std::placeholders::_1,
@@ -186,37 +265,130 @@ SocketClient::SharedPtr SocketServer::nextConnection()
     return SocketClient::SharedPtr(new SocketClient(sock, path.isEmpty() ? SocketClient::Tcp : SocketClient::Unix));
 }
 
-void SocketServer::socketCallback(int /*fd*/, int mode)
+void SocketServer::setEventLoopGroup(const std::shared_ptr<EventLoopGroup> &g, Distribution d)
+{
+    group = g;
+    distribution = d;
+}
+
+int SocketServer::acceptSocket(int socket)
 {
     union {
         sockaddr_in client4;
         sockaddr_in6 client6;
         sockaddr client;
     };
-    socklen_t size = 0;
-    if (isIPv6) {
-        size = sizeof(client6);
-    } else {
-        size = sizeof(client4);
-    }
+    socklen_t size = isIPv6 ? sizeof(client6) : sizeof(client4);
     int e;
+#ifdef HAVE_ACCEPT4
+    eintrwrap(e, ::accept4(socket, &client, &size, SOCK_NONBLOCK | SOCK_CLOEXEC));
+#else
+    eintrwrap(e, ::accept(socket, &client, &size));
+#endif
+    return e;
+}
+
+int SocketServer::listenQueue(int socket, int *max) const
+{
+#if defined(TCP_INFO) && defined(__linux__)
+    // for a listening socket the kernel reports the accept queue's length
+    // and limit in these two
+    if (path.isEmpty()) {
+        tcp_info info;
+        socklen_t size = sizeof(info);
+        if (!::getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &size)) {
+            if (max)
+                *max = info.tcpi_sacked;
+            return info.tcpi_unacked;
+        }
+    }
+#else
+    (void)socket;
+#endif
+    if (max)
+        *max = -1;
+    return -1;
+}
 
+void SocketServer::socketCallback(int socket, int mode)
+{
     if (!(mode & EventLoop::SocketRead))
         return;
 
-    for (;;) {
-        eintrwrap(e, ::accept(fd, &client, &size));
+    int max;
+    const int queue = listenQueue(socket, &max);
+    const bool backlogFull = max > 0 && queue >= max;
+
+    const bool dispatching = group && group->size();
+    int count = 0;
+    while (count < maxAccepts) {
+        const int e = acceptSocket(socket);
         if (e == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return;
-            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            recordAccepts(count, backlogFull);
+            if (count && !dispatching)
+                serverNewConnections(this, count);
             serverError(this, AcceptError);
             close();
             return;
         }
+        ++count;
+
+        if (dispatching) {
+            dispatch(e);
+            continue;
+        }
 
-        //EventLoop::eventLoop()->unregisterSocket( fd );
         accepted.push(e);
         serverNewConnection(this);
     }
+
+    recordAccepts(count, backlogFull);
+    if (count && !dispatching)
+        serverNewConnections(this, count);
+}
+
+void SocketServer::recordAccepts(int count, bool backlogFull)
+{
+    const uint64_t now = Rct::monoMs();
+    std::lock_guard<std::mutex> lock(statsMutex);
+    acceptedCount += count;
+    if (backlogFull)
+        ++backlogFullCount;
+    // the rate is that of the last window of at least a second
+    if (now - rateStart >= 1000) {
+        lastRate = rateCount * 1000. / (now - rateStart);
+        rateStart = now;
+        rateCount = 0;
+    }
+    rateCount += count;
+}
+
+SocketServer::AcceptStats SocketServer::acceptStats() const
+{
+    AcceptStats stats;
+    stats.queued = accepted.size();
+    stats.listenQueue = fd == -1 ? -1 : listenQueue(fd, 0);
+    const uint64_t now = Rct::monoMs();
+    std::lock_guard<std::mutex> lock(statsMutex);
+    stats.accepted = acceptedCount;
+    stats.backlogFull = backlogFullCount;
+    const uint64_t elapsed = now - rateStart;
+    stats.acceptsPerSecond = elapsed >= 1000 ? rateCount * 1000. / elapsed : lastRate;
+    return stats;
+}
+
+void SocketServer::dispatch(int socket)
+{
+    const unsigned int mode = path.isEmpty() ? SocketClient::Tcp : SocketClient::Unix;
+    if (!listeners.empty()) {
+        // accepted on the loop that gets the connection
+        serverNewClient(this, SocketClient::SharedPtr(new SocketClient(socket, mode)));
+        return;
+    }
+    const EventLoop::SharedPtr loop = distribution == LeastLoaded ? group->leastLoaded() : group->next();
+    loop->callLater([this, socket, mode]() {
+            serverNewClient(this, SocketClient::SharedPtr(new SocketClient(socket, mode)));
+        });
 }
@@ -2,13 +2,16 @@
 #define SOCKETSERVER_H
 
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <stdint.h>
+#include <vector>
 
 #include <rct/Path.h>
 #include <rct/SignalSlot.h>
 #include <rct/SocketClient.h>
 
+class EventLoopGroup;
 struct sockaddr;
 
 class SocketServer
@@ -22,30 +25,84 @@ public:
 
     enum Mode { IPv4, IPv6 };
 
+    // With a group connections are created on the group's loops and
+    // announced with newClient() on that loop's thread instead of
+    // newConnection(). ReusePort listens with one SO_REUSEPORT socket per
+    // loop and lets the kernel spread the connections, it's TCP only and
+    // falls back to RoundRobin otherwise. The other two accept on this
+    // thread and hand the fds over. Must be set before listening and the
+    // server has to outlive the group's loops.
+    enum Distribution { ReusePort, RoundRobin, LeastLoaded };
+    void setEventLoopGroup(const std::shared_ptr<EventLoopGroup> &group, Distribution distribution = RoundRobin);
+
     void close();
     bool listen(uint16_t port, Mode mode = IPv4); // TCP
     bool listen(const Path &path); // UNIX
     bool listenFD(int fd);         // UNIX
     bool isListening() const { return fd != -1; }
 
+    // The listen() backlog, must be set before listening
+    void setBacklog(int backlog) { listenBacklog = backlog; }
+    int backlog() const { return listenBacklog; }
+
+    // Connections accepted per wakeup, the rest are accepted on the
+    // loop's next iteration so a connection storm can't starve it
+    void setMaxAcceptsPerCallback(int max) { maxAccepts = max; }
+    int maxAcceptsPerCallback() const { return maxAccepts; }
+
+    struct AcceptStats
+    {
+        uint64_t accepted;
+        double acceptsPerSecond;
+        // accepted connections waiting for nextConnection()
+        size_t queued;
+        // connections waiting in the kernel's accept queue, -1 if unknown
+        int listenQueue;
+        // wakeups that found the kernel's accept queue full, connections
+        // beyond the backlog are dropped or refused meanwhile
+        uint64_t backlogFull;
+    };
+    AcceptStats acceptStats() const;
+
     SocketClient::SharedPtr nextConnection();
 
     Signal<std::function<void(SocketServer*)> >& newConnection() { return serverNewConnection; }
+    // Once per wakeup with the number of connections it queued
+    Signal<std::function<void(SocketServer*, int)> >& newConnections() { return serverNewConnections; }
+    Signal<std::function<void(SocketServer*, const SocketClient::SharedPtr&)> >& newClient() { return serverNewClient; }
 
     enum Error { InitializeError, BindError, ListenError, AcceptError };
     Signal<std::function<void(SocketServer*, Error)> >& error() { return serverError; }
 
 private:
-    void socketCallback(int fd, int mode);
+    void socketCallback(int socket, int mode);
+    int tcpSocket(bool reusePort);
+    bool listenReusePort(sockaddr* addr, size_t size);
     bool commonBindAndListen(sockaddr* addr, size_t size);
     bool commonListen();
+    void dispatch(int socket);
+    int acceptSocket(int socket);
+    int listenQueue(int socket, int *max) const;
+    void recordAccepts(int count, bool backlogFull);
 
 private:
     int fd;
     bool isIPv6;
     Path path;
     std::queue<int> accepted;
+    std::shared_ptr<EventLoopGroup> group;
+    Distribution distribution;
+    // ReusePort sockets and the loops they're registered with, fd is the
+    // first one
+    std::vector<std::pair<int, EventLoop::WeakPtr> > listeners;
+    int listenBacklog, maxAccepts;
+    // ReusePort listeners accept on their own loops
+    mutable std::mutex statsMutex;
+    uint64_t acceptedCount, backlogFullCount, rateStart, rateCount;
+    double lastRate;
     Signal<std::function<void(SocketServer*)> > serverNewConnection;
+    Signal<std::function<void(SocketServer*, int)> > serverNewConnections;
+    Signal<std::function<void(SocketServer*, const SocketClient::SharedPtr&)> > serverNewClient;
     Signal<std::function<void(SocketServer*, Error)> > serverError;
 };
 
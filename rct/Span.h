@@ -0,0 +1,58 @@
+#ifndef Span_h
+#define Span_h
+
+#include <assert.h>
+#include <stddef.h>
+#include <algorithm>
+#include <type_traits>
+
+#include <rct/List.h>
+
+// Non-owning reference to size consecutive Ts somewhere else, the data has
+// to outlive the span. Use Span<const T> for read only data.
+template <typename T>
+class Span
+{
+public:
+    Span()
+        : mData(0), mSize(0)
+    {}
+    Span(T *data, size_t size)
+        : mData(data), mSize(size)
+    {}
+    template <typename K>
+    Span(const List<K> &list)
+        : mData(list.data()), mSize(list.size())
+    {}
+
+    T *data() const { return mData; }
+    size_t size() const { return mSize; }
+    bool isEmpty() const { return !mSize; }
+
+    T *begin() const { return mData; }
+    T *end() const { return mData + mSize; }
+    T &at(size_t i) const { assert(i < mSize); return mData[i]; }
+    T &operator[](size_t i) const { return at(i); }
+    T &first() const { return at(0); }
+    T &last() const { return at(mSize - 1); }
+
+    Span mid(size_t from, size_t len = static_cast<size_t>(-1)) const
+    {
+        if (from >= mSize)
+            return Span();
+        return Span(mData + from, len < mSize - from ? len : mSize - from);
+    }
+
+    List<typename std::remove_const<T>::type> toList() const
+    {
+        List<typename std::remove_const<T>::type> ret(mSize);
+        std::copy(mData, mData + mSize, ret.begin());
+        return ret;
+    }
+
+private:
+    T *mData;
+    size_t mSize;
+};
+
+#endif
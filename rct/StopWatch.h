@@ -2,7 +2,6 @@
 #define StopWatch_h
 
 #include <stdint.h>
-#include <sys/time.h>
 
 #include <rct/Rct.h>
 
@@ -11,7 +10,8 @@ class StopWatch
 public:
     enum Precision {
         Millisecond,
-        Microsecond
+        Microsecond,
+        Nanosecond
     };
     StopWatch(Precision prec = Millisecond)
         : mPrecision(prec), mStart(current(prec))
@@ -28,15 +28,16 @@ public:
         return mStart;
     }
 
+    // monotonic, see Rct::monoNs()
     static unsigned long long current(Precision prec)
     {
-        timeval t;
-        Rct::gettime(&t); // monotonic
-        if (prec == Millisecond) {
-            return (t.tv_sec * 1000) + (t.tv_usec / 1000);
-        } else {
-            return (t.tv_sec * 1000000) + t.tv_usec;
+        const uint64_t ns = Rct::monoNs();
+        switch (prec) {
+        case Millisecond: return ns / 1000000;
+        case Microsecond: return ns / 1000;
+        case Nanosecond: break;
         }
+        return ns;
     }
 
     unsigned long long elapsed() const
@@ -46,8 +47,8 @@ public:
 
     unsigned long long restart()
     {
-        const long int cur = current(mPrecision);
-        const long int ret = cur - mStart;
+        const unsigned long long cur = current(mPrecision);
+        const unsigned long long ret = cur - mStart;
         mStart = cur;
         return ret;
     }
@@ -1,31 +1,307 @@
 #include "String.h"
 
+#include <memory>
+
 #ifdef RCT_HAVE_ZLIB
 #include <zlib.h>
+#endif
+#ifdef RCT_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef RCT_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define RCT_STRING_AVX2
+#endif
+
 enum { BufferSize = 1024 * 32 };
+
+// ASCII case folding kernels. Bytes are folded to lower case in
+// registers, 'A' - 'Z' is a signed compare after shifting the range to
+// the bottom. Substring searches look for the first and last byte of
+// the needle at once and only compare the candidates where both match.
+static size_t findFoldedScalar(const char *haystack, size_t size, char needle)
+{
+    for (size_t i = 0; i < size; ++i) {
+        if (String::foldCase(haystack[i]) == needle)
+            return i;
+    }
+    return String::npos;
+}
+
+static size_t findFoldedScalar(const char *haystack, size_t size, const char *lowered, size_t len, size_t from)
+{
+    for (size_t i = from; i + len <= size; ++i) {
+        if (String::equalsFolded(haystack + i, lowered, len))
+            return i;
+    }
+    return String::npos;
+}
+
+static void convertCaseScalar(char *data, size_t size, bool upper)
+{
+    const char first = upper ? 'a' : 'A';
+    for (size_t i = 0; i < size; ++i) {
+        if (static_cast<unsigned char>(data[i] - first) < 26)
+            data[i] ^= 0x20;
+    }
+}
+
+#if defined(__SSE2__)
+// the bytes of v that are in [first, first + 26)
+static inline __m128i inRange(__m128i v, char first)
+{
+    const __m128i shifted = _mm_sub_epi8(v, _mm_set1_epi8(static_cast<char>(first + 128)));
+    return _mm_cmplt_epi8(shifted, _mm_set1_epi8(-128 + 26));
+}
+
+static inline __m128i foldSSE2(__m128i v)
+{
+    return _mm_or_si128(v, _mm_and_si128(inRange(v, 'A'), _mm_set1_epi8(0x20)));
+}
+
+static size_t findFoldedSSE2(const char *haystack, size_t size, char needle)
+{
+    const __m128i n = _mm_set1_epi8(needle);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const __m128i v = foldSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(haystack + i)));
+        if (const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, n)))
+            return i + __builtin_ctz(mask);
+    }
+    const size_t ret = findFoldedScalar(haystack + i, size - i, needle);
+    return ret == String::npos ? ret : ret + i;
+}
+
+static size_t findFoldedSSE2(const char *haystack, size_t size, const char *lowered, size_t len)
+{
+    const __m128i first = _mm_set1_epi8(lowered[0]);
+    const __m128i last = _mm_set1_epi8(lowered[len - 1]);
+    size_t i = 0;
+    for (; i + len - 1 + 16 <= size; i += 16) {
+        const __m128i f = foldSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(haystack + i)));
+        const __m128i l = foldSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(haystack + i + len - 1)));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(f, first), _mm_cmpeq_epi8(l, last)));
+        while (mask) {
+            const unsigned int bit = __builtin_ctz(mask);
+            if (String::equalsFolded(haystack + i + bit + 1, lowered + 1, len - 2))
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return findFoldedScalar(haystack, size, lowered, len, i);
+}
+
+static void convertCaseSSE2(char *data, size_t size, bool upper)
+{
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i *p = reinterpret_cast<__m128i *>(data + i);
+        const __m128i v = _mm_loadu_si128(p);
+        const __m128i flip = _mm_and_si128(inRange(v, upper ? 'a' : 'A'), _mm_set1_epi8(0x20));
+        _mm_storeu_si128(p, _mm_xor_si128(v, flip));
+    }
+    convertCaseScalar(data + i, size - i, upper);
+}
 #endif
 
-String String::compress() const
+#ifdef RCT_STRING_AVX2
+__attribute__((target("avx2"))) static inline __m256i inRangeAVX2(__m256i v, char first)
 {
-#ifndef RCT_HAVE_ZLIB
-    assert(0 && "Rct configured without zlib support");
-    return String();
+    const __m256i shifted = _mm256_sub_epi8(v, _mm256_set1_epi8(static_cast<char>(first + 128)));
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), shifted);
+}
+
+__attribute__((target("avx2"))) static inline __m256i foldAVX2(__m256i v)
+{
+    return _mm256_or_si256(v, _mm256_and_si256(inRangeAVX2(v, 'A'), _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2"))) static size_t findFoldedAVX2(const char *haystack, size_t size, char needle)
+{
+    const __m256i n = _mm256_set1_epi8(needle);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        const __m256i v = foldAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(haystack + i)));
+        if (const unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, n)))
+            return i + __builtin_ctz(mask);
+    }
+    const size_t ret = findFoldedScalar(haystack + i, size - i, needle);
+    return ret == String::npos ? ret : ret + i;
+}
+
+__attribute__((target("avx2"))) static size_t findFoldedAVX2(const char *haystack, size_t size,
+                                                             const char *lowered, size_t len)
+{
+    const __m256i first = _mm256_set1_epi8(lowered[0]);
+    const __m256i last = _mm256_set1_epi8(lowered[len - 1]);
+    size_t i = 0;
+    for (; i + len - 1 + 32 <= size; i += 32) {
+        const __m256i f = foldAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(haystack + i)));
+        const __m256i l = foldAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(haystack + i + len - 1)));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(f, first),
+                                                                  _mm256_cmpeq_epi8(l, last)));
+        while (mask) {
+            const unsigned int bit = __builtin_ctz(mask);
+            if (String::equalsFolded(haystack + i + bit + 1, lowered + 1, len - 2))
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return findFoldedScalar(haystack, size, lowered, len, i);
+}
+
+__attribute__((target("avx2"))) static void convertCaseAVX2(char *data, size_t size, bool upper)
+{
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i *p = reinterpret_cast<__m256i *>(data + i);
+        const __m256i v = _mm256_loadu_si256(p);
+        const __m256i flip = _mm256_and_si256(inRangeAVX2(v, upper ? 'a' : 'A'), _mm256_set1_epi8(0x20));
+        _mm256_storeu_si256(p, _mm256_xor_si256(v, flip));
+    }
+    convertCaseScalar(data + i, size - i, upper);
+}
+#endif
+
+struct CaseKernels
+{
+    size_t (*findChar)(const char *, size_t, char);
+    size_t (*find)(const char *, size_t, const char *, size_t);
+    void (*convert)(char *, size_t, bool);
+};
+
+#if !defined(__SSE2__)
+static size_t findFoldedScalar(const char *haystack, size_t size, const char *lowered, size_t len)
+{
+    return findFoldedScalar(haystack, size, lowered, len, 0);
+}
+#endif
+
+static const CaseKernels &caseKernels()
+{
+    static const CaseKernels kernels = []() {
+#ifdef RCT_STRING_AVX2
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                const CaseKernels avx2 = { findFoldedAVX2, findFoldedAVX2, convertCaseAVX2 };
+                return avx2;
+            }
+#endif
+#if defined(__SSE2__)
+            const CaseKernels sse2 = { findFoldedSSE2, findFoldedSSE2, convertCaseSSE2 };
+            return sse2;
 #else
-    if (isEmpty())
-        return String();
+            const CaseKernels scalar = { findFoldedScalar, findFoldedScalar, convertCaseScalar };
+            return scalar;
+#endif
+        }();
+    return kernels;
+}
+
+String &String::appendFormat(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    appendFormat(format, args);
+    va_end(args);
+    return *this;
+}
+
+String &String::appendFormat(const char *format, va_list args)
+{
+    enum { MinimumRoom = 128 };
+    va_list copy;
+    va_copy(copy, args);
+    const size_t size = mString.size();
+    const size_t room = std::max<size_t>(mString.capacity() - size, MinimumRoom);
+    mString.resize(size + room);
+    // the terminator's slot is writable as long as it stays a 0
+    const int written = ::vsnprintf(&mString[size], room + 1, format, args);
+    if (written < 0) {
+        mString.resize(size);
+    } else if (static_cast<size_t>(written) <= room) {
+        mString.resize(size + written);
+    } else {
+        mString.resize(size + written);
+        ::vsnprintf(&mString[size], written + 1, format, copy);
+    }
+    va_end(copy);
+    return *this;
+}
+
+size_t String::findFolded(const char *haystack, size_t size, char needle)
+{
+    needle = foldCase(needle);
+    if (needle < 'a' || needle > 'z') {
+        const void *found = memchr(haystack, needle, size);
+        return found ? static_cast<const char *>(found) - haystack : npos;
+    }
+    return caseKernels().findChar(haystack, size, needle);
+}
+
+size_t String::findFolded(const char *haystack, size_t size, const char *needle, size_t len)
+{
+    if (!len || len > size)
+        return npos;
+    if (len == 1)
+        return findFolded(haystack, size, *needle);
+    char stack[64];
+    std::unique_ptr<char[]> heap;
+    char *lowered = stack;
+    if (len > sizeof(stack)) {
+        heap.reset(new char[len]);
+        lowered = heap.get();
+    }
+    for (size_t i = 0; i < len; ++i)
+        lowered[i] = foldCase(needle[i]);
+    return caseKernels().find(haystack, size, lowered, len);
+}
+
+void String::convertCase(char *data, size_t size, bool upper)
+{
+    caseKernels().convert(data, size, upper);
+}
+
+bool String::hasCodec(Codec codec)
+{
+    switch (codec) {
+#ifdef RCT_HAVE_ZLIB
+    case Zlib: return true;
+#endif
+#ifdef RCT_HAVE_LZ4
+    case Lz4: return true;
+#endif
+#ifdef RCT_HAVE_ZSTD
+    case Zstd: return true;
+#endif
+    default: break;
+    }
+    return false;
+}
+
+#ifdef RCT_HAVE_ZLIB
+static String zlibCompress(const char *data, size_t size)
+{
     z_stream stream;
     memset(&stream, 0, sizeof(stream));
 
     if (::deflateInit(&stream, Z_BEST_COMPRESSION) != Z_OK)
         return String();
 
-    stream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef *>(data()));
-    stream.avail_in = size();
+    stream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef *>(data));
+    stream.avail_in = size;
 
     char buffer[BufferSize];
 
     String out;
-    out.reserve(size() / 2);
+    out.reserve(size / 2);
 
     int error = 0;
     do {
@@ -45,19 +321,10 @@ String String::compress() const
     deflateEnd(&stream);
 
     return out;
-#endif
 }
 
-String String::uncompress(const char *data, size_t size)
+static String zlibUncompress(const std::pair<const char *, size_t> *chunks, size_t count, size_t size)
 {
-#ifndef RCT_HAVE_ZLIB
-    (void)data;
-    (void)size;
-    assert(0 && "Rct configured without zlib support");
-    return String();
-#else
-    if (!size)
-        return String();
     z_stream stream;
     memset(&stream, 0, sizeof(stream));
 
@@ -65,33 +332,199 @@ String String::uncompress(const char *data, size_t size)
         return String();
     }
 
-    stream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef *>(data));
-    stream.avail_in = size;
+    // inflate straight into the result
+    String out;
+    out.resize(std::max<size_t>(size * 2, BufferSize));
+    size_t written = 0;
+
+    int error = Z_OK;
+    for (size_t i = 0; i < count && error != Z_STREAM_END; ++i) {
+        stream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef *>(chunks[i].first));
+        stream.avail_in = chunks[i].second;
+        do {
+            if (written == out.size())
+                out.resize(out.size() * 2);
+            stream.next_out = reinterpret_cast<Bytef *>(out.data() + written);
+            stream.avail_out = out.size() - written;
+
+            error = ::inflate(&stream, Z_SYNC_FLUSH);
+            written = out.size() - stream.avail_out;
+            if (error == Z_BUF_ERROR && !stream.avail_in) {
+                // needs the next chunk
+                error = Z_OK;
+                break;
+            }
+            if (error != Z_OK && error != Z_STREAM_END) {
+                inflateEnd(&stream);
+                return String();
+            }
+        } while (error != Z_STREAM_END && (stream.avail_in || !stream.avail_out));
+    }
 
-    char buffer[BufferSize];
+    inflateEnd(&stream);
+    out.resize(written);
+    return out;
+}
+#endif
 
+#ifdef RCT_HAVE_LZ4
+// a block prefixed with the uncompressed size, lz4 doesn't store it
+static String lz4Compress(const char *data, size_t size)
+{
+    if (size > static_cast<size_t>(LZ4_MAX_INPUT_SIZE))
+        return String();
+    const uint32_t original = size;
     String out;
-    out.reserve(size * 2);
+    out.resize(sizeof(original) + LZ4_compressBound(size));
+    memcpy(out.data(), &original, sizeof(original));
+    const int compressed = LZ4_compress_default(data, out.data() + sizeof(original), size, out.size() - sizeof(original));
+    if (compressed <= 0)
+        return String();
+    out.resize(sizeof(original) + compressed);
+    return out;
+}
 
-    int error = 0;
-    do {
-        stream.next_out = reinterpret_cast<Bytef *>(buffer);
-        stream.avail_out = sizeof(buffer);
+static String lz4Uncompress(const std::pair<const char *, size_t> *chunks, size_t count, size_t size)
+{
+    // the block has to be contiguous
+    String joined;
+    const char *data = chunks[0].first;
+    if (count > 1) {
+        joined.reserve(size);
+        for (size_t i = 0; i < count; ++i)
+            joined.append(chunks[i].first, chunks[i].second);
+        data = joined.constData();
+    }
+    uint32_t original;
+    if (size < sizeof(original))
+        return String();
+    memcpy(&original, data, sizeof(original));
+    // lz4 can't shrink anything more than 255 times, the size is from
+    // the input and more than that is a lie
+    if (original > (size - sizeof(original)) * 255 + 16)
+        return String();
+    String out;
+    out.resize(original);
+    const int read = LZ4_decompress_safe(data + sizeof(original), out.data(), size - sizeof(original), original);
+    if (read != static_cast<int>(original))
+        return String();
+    return out;
+}
+#endif
+
+#ifdef RCT_HAVE_ZSTD
+static String zstdCompress(const char *data, size_t size)
+{
+    String out;
+    out.resize(ZSTD_compressBound(size));
+    const size_t compressed = ZSTD_compress(out.data(), out.size(), data, size, 1);
+    if (ZSTD_isError(compressed))
+        return String();
+    out.resize(compressed);
+    return out;
+}
 
-        error = ::inflate(&stream, Z_SYNC_FLUSH);
+static String zstdUncompress(const std::pair<const char *, size_t> *chunks, size_t count, size_t size)
+{
+    ZSTD_DCtx *context = ZSTD_createDCtx();
+    if (!context)
+        return String();
 
-        if (error != Z_OK && error != Z_STREAM_END) {
-            out.clear();
-            break;
+    // The frame usually knows how big it'll be. It comes with the input,
+    // so only as much is allocated up front as a plausible ratio gives,
+    // the output grows as it's actually written.
+    const unsigned long long contentSize = ZSTD_getFrameContentSize(chunks[0].first, chunks[0].second);
+    String out;
+    if (contentSize != ZSTD_CONTENTSIZE_UNKNOWN && contentSize != ZSTD_CONTENTSIZE_ERROR) {
+        out.resize(std::max<size_t>(std::min<unsigned long long>(contentSize, size * 32ull + BufferSize), 1));
+    } else {
+        out.resize(std::max<size_t>(size * 2, BufferSize));
+    }
+    size_t written = 0;
+
+    size_t ret = 1;
+    for (size_t i = 0; i < count && ret; ++i) {
+        ZSTD_inBuffer in = { chunks[i].first, chunks[i].second, 0 };
+        while (in.pos < in.size && ret) {
+            if (written == out.size())
+                out.resize(out.size() * 2);
+            ZSTD_outBuffer output = { out.data(), out.size(), written };
+            ret = ZSTD_decompressStream(context, &output, &in);
+            written = output.pos;
+            if (ZSTD_isError(ret)) {
+                ZSTD_freeDCtx(context);
+                return String();
+            }
         }
+    }
+    // the decoder may still hold data when the output was full
+    while (ret) {
+        if (written == out.size())
+            out.resize(out.size() * 2);
+        ZSTD_inBuffer in = { 0, 0, 0 };
+        ZSTD_outBuffer output = { out.data(), out.size(), written };
+        ret = ZSTD_decompressStream(context, &output, &in);
+        if (ZSTD_isError(ret) || output.pos == written) {
+            // truncated
+            ZSTD_freeDCtx(context);
+            return String();
+        }
+        written = output.pos;
+    }
 
-        const int processed = sizeof(buffer) - stream.avail_out;
-        out.append(buffer, processed);
-    } while (!stream.avail_out);
-
-    inflateEnd(&stream);
+    ZSTD_freeDCtx(context);
+    out.resize(written);
     return out;
+}
+#endif
+
+String String::compress(Codec codec) const
+{
+    if (isEmpty())
+        return String();
+    switch (codec) {
+#ifdef RCT_HAVE_ZLIB
+    case Zlib: return zlibCompress(constData(), size());
+#endif
+#ifdef RCT_HAVE_LZ4
+    case Lz4: return lz4Compress(constData(), size());
 #endif
+#ifdef RCT_HAVE_ZSTD
+    case Zstd: return zstdCompress(constData(), size());
+#endif
+    default: break;
+    }
+    assert(0 && "Rct configured without support for this codec");
+    return String();
+}
+
+String String::uncompress(const char *data, size_t size, Codec codec)
+{
+    const std::pair<const char *, size_t> chunk(data, size);
+    return uncompress(&chunk, 1, codec);
+}
+
+String String::uncompress(const std::pair<const char *, size_t> *chunks, size_t count, Codec codec)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i)
+        size += chunks[i].second;
+    if (!size)
+        return String();
+    switch (codec) {
+#ifdef RCT_HAVE_ZLIB
+    case Zlib: return zlibUncompress(chunks, count, size);
+#endif
+#ifdef RCT_HAVE_LZ4
+    case Lz4: return lz4Uncompress(chunks, count, size);
+#endif
+#ifdef RCT_HAVE_ZSTD
+    case Zstd: return zstdUncompress(chunks, count, size);
+#endif
+    default: break;
+    }
+    // the input may say it's from a codec we don't have, see hasCodec()
+    return String();
 }
 
 String String::toHex(const void *pAddressIn, size_t lSize)
@@ -77,14 +77,16 @@ public:
     {
         if (cs == CaseSensitive)
             return mString.rfind(ch, from == npos ? std::string::npos : size_t(from));
+        if (mString.empty())
+            return npos;
         const char *data = mString.c_str();
-        if (from == npos)
+        if (from == npos || from >= mString.size())
             from = mString.size() - 1;
-        ch = tolower(ch);
+        ch = foldCase(ch);
         int f = static_cast<int>(from);
         while (f >= 0) {
-            if (tolower(data[f]) == ch)
-                return from;
+            if (foldCase(data[f]) == ch)
+                return f;
             --f;
         }
         return npos;
@@ -94,15 +96,10 @@ public:
     {
         if (cs == CaseSensitive)
             return mString.find(ch, from);
-        const char *data = mString.c_str();
-        ch = tolower(ch);
-        const size_t size = mString.size();
-        while (from < size) {
-            if (tolower(data[from]) == ch)
-                return from;
-            ++from;
-        }
-        return npos;
+        if (from >= mString.size())
+            return npos;
+        const size_t idx = findFolded(mString.c_str() + from, mString.size() - from, ch);
+        return idx == npos ? npos : idx + from;
     }
 
     size_t lastIndexOf(const char *ch, size_t len, size_t from = npos, CaseSensitivity cs = CaseSensitive) const
@@ -113,20 +110,16 @@ public:
         default: {
             if (cs == CaseSensitive)
                 return mString.rfind(ch, from, len);
-            if (from == npos)
-                from = mString.size() - 1;
+            if (len > mString.size())
+                break;
+            if (from == npos || from > mString.size() - len)
+                from = mString.size() - len;
             String lowered(ch, len);
             lowered.lowerCase();
-            const size_t needleSize = lowered.size();
-            size_t matched = 0;
             int f = static_cast<int>(from);
             while (f >= 0) {
-                if (lowered.at(needleSize - matched - 1) != tolower(at(f))) {
-                    matched = 0;
-                } else if (++matched == needleSize) {
+                if (equalsFolded(mString.c_str() + f, lowered.constData(), len))
                     return f;
-                }
-
                 --f;
             }
             break; }
@@ -142,20 +135,11 @@ public:
         default: {
             if (cs == CaseSensitive)
                 return mString.find(ch, from, len);
-
-            String lowered(ch, len);
-            lowered.lowerCase();
-            const size_t count = size();
-            size_t matched = 0;
-
-            for (size_t i=from; i<count; ++i) {
-                if (lowered.at(matched) != tolower(at(i))) {
-                    matched = 0;
-                } else if (++matched == lowered.size()) {
-                    return i - matched + 1;
-                }
+            if (from >= mString.size())
+                break;
+            const size_t idx = findFolded(mString.c_str() + from, mString.size() - from, ch, len);
+            return idx == npos ? npos : idx + from;
             }
-            break; }
         }
         return npos;
     }
@@ -223,29 +207,51 @@ public:
         return operator[](size() - 1);
     }
 
+    // case conversion and the CaseInsensitive searches are ASCII only
     void lowerCase()
     {
-        std::transform(mString.begin(), mString.end(), mString.begin(), ::tolower);
+        if (!mString.empty())
+            convertCase(&mString[0], mString.size(), false);
     }
 
     String toLower() const
     {
-        std::string ret = mString;
-        std::transform(ret.begin(), ret.end(), ret.begin(), ::tolower);
+        String ret = *this;
+        ret.lowerCase();
         return ret;
     }
 
     String toUpper() const
     {
-        std::string ret = mString;
-        std::transform(ret.begin(), ret.end(), ret.begin(), ::toupper);
+        String ret = *this;
+        ret.upperCase();
         return ret;
     }
 
     void upperCase()
     {
-        std::transform(mString.begin(), mString.end(), mString.begin(), ::toupper);
+        if (!mString.empty())
+            convertCase(&mString[0], mString.size(), true);
+    }
+
+    static char foldCase(char ch)
+    {
+        return ch >= 'A' && ch <= 'Z' ? ch + ('a' - 'A') : ch;
+    }
+    // Searches with SSE2 or AVX2, whichever the CPU has, byte by byte on
+    // other architectures. needle is matched ignoring ASCII case.
+    static size_t findFolded(const char *haystack, size_t size, char needle);
+    static size_t findFolded(const char *haystack, size_t size, const char *needle, size_t len);
+    // whether len bytes of data equal lowered, which is in lower case
+    static bool equalsFolded(const char *data, const char *lowered, size_t len)
+    {
+        for (size_t i = 0; i < len; ++i) {
+            if (foldCase(data[i]) != lowered[i])
+                return false;
+        }
+        return true;
     }
+    static void convertCase(char *data, size_t size, bool upper);
 
     String trimmed(const String &trim = " \f\n\r\t\v") const
     {
@@ -404,9 +410,19 @@ public:
         mString.append(ba);
     }
 
-    String compress() const;
-    String uncompress() const { return uncompress(constData(), size()); }
-    static String uncompress(const char *data, size_t size);
+    // zlib compresses best, lz4 and zstd (level 1) are many times faster
+    enum Codec
+    {
+        Zlib,
+        Lz4,
+        Zstd
+    };
+    static bool hasCodec(Codec codec);
+    String compress(Codec codec = Zlib) const;
+    String uncompress(Codec codec = Zlib) const { return uncompress(constData(), size(), codec); }
+    static String uncompress(const char *data, size_t size, Codec codec = Zlib);
+    // input spread over several chunks, decompressed as one stream
+    static String uncompress(const std::pair<const char *, size_t> *chunks, size_t count, Codec codec = Zlib);
 
     void append(const char *str, size_t len = npos)
     {
@@ -593,10 +609,10 @@ public:
                 --i;
             }
         } else {
-            from = tolower(from);
+            from = foldCase(from);
             while (i >= 0) {
                 char &ch = operator[](i);
-                if (tolower(ch) == from) {
+                if (foldCase(ch) == from) {
                     ch = to;
                     ++count;
                 }
@@ -839,6 +855,12 @@ public:
     template <size_t StaticBufSize = 4096>
     static String format(const char *format, ...) RCT_PRINTF_WARNING(1, 2);
 
+    // printf style output formatted straight into the end of the string,
+    // into its spare capacity when that's big enough, so appending to a
+    // string that's reused takes one vsnprintf and no copies
+    String &appendFormat(const char *format, ...) RCT_PRINTF_WARNING(2, 3);
+    String &appendFormat(const char *format, va_list args);
+
     template <size_t StaticBufSize = 4096>
     static String format(const char *format, va_list args)
     {
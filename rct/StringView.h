@@ -0,0 +1,127 @@
+#ifndef StringView_h
+#define StringView_h
+
+#include <string.h>
+
+#include <rct/String.h>
+
+// Non-owning reference to size bytes of character data somewhere else, the
+// data has to outlive the view
+class StringView
+{
+public:
+    StringView()
+        : mData(0), mSize(0)
+    {}
+    StringView(const char *data, size_t size)
+        : mData(data), mSize(size)
+    {}
+    StringView(const char *data)
+        : mData(data), mSize(data ? strlen(data) : 0)
+    {}
+    StringView(const String &string)
+        : mData(string.constData()), mSize(string.size())
+    {}
+
+    const char *data() const { return mData; }
+    const char *constData() const { return mData; }
+    size_t size() const { return mSize; }
+    bool isEmpty() const { return !mSize; }
+
+    const char *begin() const { return mData; }
+    const char *end() const { return mData + mSize; }
+    char at(size_t i) const { assert(i < mSize); return mData[i]; }
+    char operator[](size_t i) const { return at(i); }
+
+    StringView mid(size_t from, size_t len = String::npos) const
+    {
+        if (from >= mSize)
+            return StringView();
+        return StringView(mData + from, std::min(len, mSize - from));
+    }
+    bool startsWith(const StringView &other) const
+    {
+        return mSize >= other.mSize && !memcmp(mData, other.mData, other.mSize);
+    }
+    bool endsWith(const StringView &other) const
+    {
+        return mSize >= other.mSize && !memcmp(mData + mSize - other.mSize, other.mData, other.mSize);
+    }
+
+    int compare(const StringView &other) const
+    {
+        const int cmp = memcmp(mData, other.mData, std::min(mSize, other.mSize));
+        if (cmp)
+            return cmp;
+        return mSize < other.mSize ? -1 : mSize > other.mSize ? 1 : 0;
+    }
+    bool operator==(const StringView &other) const
+    {
+        return mSize == other.mSize && !memcmp(mData, other.mData, mSize);
+    }
+    bool operator!=(const StringView &other) const { return !operator==(other); }
+    bool operator<(const StringView &other) const { return compare(other) < 0; }
+    bool operator>(const StringView &other) const { return compare(other) > 0; }
+
+    String toString() const { return String(mData, mSize); }
+
+    // String::split() without copying, the views point into this one's
+    // data. String::SkipEmpty and String::KeepSeparators apply.
+    List<StringView> split(char ch, unsigned int flags = String::NoSplitFlag) const
+    {
+        List<StringView> ret;
+        if (!mSize)
+            return ret;
+        const size_t add = flags & String::KeepSeparators ? 1 : 0;
+        const char *last = mData;
+        const char *end = mData + mSize;
+        while (const char *next = static_cast<const char *>(memchr(last, ch, end - last))) {
+            if (next > last || !(flags & String::SkipEmpty))
+                ret.append(StringView(last, next - last + add));
+            last = next + 1;
+        }
+        if (last < end || !(flags & String::SkipEmpty))
+            ret.append(StringView(last, end - last));
+        return ret;
+    }
+
+    List<StringView> split(const StringView &separator, unsigned int flags = String::NoSplitFlag) const
+    {
+        if (separator.mSize == 1)
+            return split(*separator.mData, flags & ~String::KeepSeparators);
+        List<StringView> ret;
+        size_t last = 0;
+        while (separator.mSize) {
+            const size_t next = indexOf(separator, last);
+            if (next == String::npos)
+                break;
+            if (next > last || !(flags & String::SkipEmpty))
+                ret.append(StringView(mData + last, next - last));
+            last = next + separator.mSize;
+        }
+        if (last < mSize || !(flags & String::SkipEmpty))
+            ret.append(StringView(mData + last, mSize - last));
+        return ret;
+    }
+
+    size_t indexOf(const StringView &needle, size_t from = 0) const
+    {
+        if (!needle.mSize || from + needle.mSize > mSize)
+            return String::npos;
+        const char *end = mData + mSize - needle.mSize + 1;
+        for (const char *p = mData + from; p < end; ++p) {
+            p = static_cast<const char *>(memchr(p, *needle.mData, end - p));
+            if (!p)
+                break;
+            if (!memcmp(p + 1, needle.mData + 1, needle.mSize - 1))
+                return p - mData;
+        }
+        return String::npos;
+    }
+
+private:
+    const char *mData;
+    size_t mSize;
+};
+
+#endif
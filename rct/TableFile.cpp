@@ -0,0 +1,508 @@
+#include "TableFile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <memory>
+#include <vector>
+
+#include "Rct.h"
+
+// blocks: per entry varints of the bytes shared with the key before, the
+// bytes that aren't and the value's size, then the key's bytes that
+// aren't shared and the value. The index: per block a varint sized first
+// key, its offset (u64), size and CRC32C (u32), then the offset of each
+// of those in the index (u32). The footer has where the index is and the
+// size of the bloom filter that follows it.
+
+static inline bool readVarint(const char *&pos, const char *end, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+        const unsigned char byte = *pos++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// the entry at pos, with key holding the key before. 0 if it's damaged.
+static inline const char *readEntry(const char *pos, const char *end, String &key, StringView &value)
+{
+    uint64_t shared, unshared, size;
+    if (!readVarint(pos, end, shared) || !readVarint(pos, end, unshared) || !readVarint(pos, end, size)
+        || shared > key.size() || unshared > static_cast<uint64_t>(end - pos)
+        || size > static_cast<uint64_t>(end - pos) - unshared) {
+        return 0;
+    }
+    key.resize(shared);
+    key.append(pos, unshared);
+    pos += unshared;
+    value = StringView(pos, size);
+    return pos + size;
+}
+
+TableFile::TableFile(const Path &path, int version)
+    : mPath(path), mVersion(version), mCount(0), mBlockCount(0), mIndex(0), mBlockOffsets(0),
+      mBloom(0), mBloomBits(0), mBloomHashes(0)
+{
+}
+
+bool TableFile::open()
+{
+    mCount = mBlockCount = 0;
+    if (!mFile.open(mPath)) {
+        mError = String::format<128>("Can't open %s (%d)", mPath.constData(), errno);
+        return false;
+    }
+    const char *data = mFile.data();
+    const uint64_t size = mFile.size();
+    if (size < HeaderSize + FooterSize) {
+        mError = "File is too small";
+        return false;
+    }
+    uint32_t header[3];
+    memcpy(header, data, sizeof(header));
+    if (header[0] != Magic || header[1] != Format) {
+        mError = String::format<64>("Wrong magic or format %x/%u", header[0], header[1]);
+        return false;
+    }
+    if (static_cast<int>(header[2]) != mVersion) {
+        mError = String::format<64>("Wrong version, expected %d, got %d", mVersion, static_cast<int>(header[2]));
+        return false;
+    }
+
+    uint64_t footer[4];
+    uint32_t tail[4];
+    memcpy(footer, data + size - FooterSize, sizeof(footer));
+    memcpy(tail, data + size - FooterSize + sizeof(footer), sizeof(tail));
+    const uint64_t indexOffset = footer[0], indexSize = footer[1], bloomSize = footer[2];
+    if (tail[3] != Magic || indexOffset < HeaderSize || indexOffset > size
+        || indexSize > size - indexOffset || bloomSize > size - indexOffset - indexSize
+        || indexOffset + indexSize + bloomSize + FooterSize != size
+        || static_cast<uint64_t>(tail[0]) * sizeof(uint32_t) > indexSize) {
+        mError = "Invalid footer";
+        return false;
+    }
+    if (Rct::crc32c(data + indexOffset, indexSize + bloomSize) != tail[2]) {
+        mError = "Index checksum mismatch";
+        return false;
+    }
+
+    mIndex = data + indexOffset;
+    mBlockCount = tail[0];
+    mBlockOffsets = mIndex + indexSize - mBlockCount * sizeof(uint32_t);
+    mBloom = reinterpret_cast<const unsigned char *>(mIndex + indexSize);
+    mBloomBits = bloomSize * 8;
+    mBloomHashes = tail[1];
+    // blocks are only checked when they're read, the index right away
+    const char *indexEnd = mBlockOffsets;
+    for (size_t i = 0; i < mBlockCount; ++i) {
+        uint32_t offset;
+        memcpy(&offset, mBlockOffsets + i * sizeof(uint32_t), sizeof(offset));
+        const char *pos = mIndex + offset;
+        uint64_t keySize;
+        if (offset >= indexSize || !readVarint(pos, indexEnd, keySize)
+            || keySize + 16 > static_cast<uint64_t>(indexEnd - pos)) {
+            mError = "Invalid index";
+            mBlockCount = 0;
+            return false;
+        }
+        uint64_t blockOffset;
+        uint32_t blockSize;
+        memcpy(&blockOffset, pos + keySize, sizeof(blockOffset));
+        memcpy(&blockSize, pos + keySize + 8, sizeof(blockSize));
+        if (blockOffset < HeaderSize || blockOffset > indexOffset || blockSize > indexOffset - blockOffset) {
+            mError = "Invalid index";
+            mBlockCount = 0;
+            return false;
+        }
+    }
+    mCount = footer[3];
+    return true;
+}
+
+uint64_t TableFile::hash(const StringView &key)
+{
+    // FNV-1a and a murmur finalizer
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < key.size(); ++i) {
+        h ^= static_cast<unsigned char>(key.data()[i]);
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+bool TableFile::mayContain(const StringView &key) const
+{
+    if (!mBloomBits)
+        return true;
+    uint64_t h = hash(key);
+    const uint64_t delta = (h >> 33) | (h << 31);
+    for (uint32_t i = 0; i < mBloomHashes; ++i) {
+        const uint64_t bit = h % mBloomBits;
+        if (!(mBloom[bit / 8] & (1 << (bit % 8))))
+            return false;
+        h += delta;
+    }
+    return true;
+}
+
+TableFile::Block TableFile::block(size_t idx) const
+{
+    uint32_t offset;
+    memcpy(&offset, mBlockOffsets + idx * sizeof(uint32_t), sizeof(offset));
+    const char *pos = mIndex + offset;
+    uint64_t keySize;
+    readVarint(pos, mBlockOffsets, keySize);
+    Block ret;
+    ret.firstKey = StringView(pos, keySize);
+    pos += keySize;
+    uint64_t blockOffset;
+    memcpy(&blockOffset, pos, sizeof(blockOffset));
+    memcpy(&ret.size, pos + 8, sizeof(ret.size));
+    memcpy(&ret.crc, pos + 12, sizeof(ret.crc));
+    ret.data = mFile.data() + blockOffset;
+    return ret;
+}
+
+int64_t TableFile::findBlock(const StringView &key) const
+{
+    // the last block whose first key isn't greater than key
+    size_t lo = 0, hi = mBlockCount;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (block(mid).firstKey.compare(key) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return static_cast<int64_t>(lo) - 1;
+}
+
+bool TableFile::find(const StringView &key, StringView &value) const
+{
+    if (!mayContain(key))
+        return false;
+    const int64_t idx = findBlock(key);
+    if (idx < 0)
+        return false;
+    const Block b = block(idx);
+    if (Rct::crc32c(b.data, b.size) != b.crc)
+        return false;
+    const char *pos = b.data;
+    const char *end = b.data + b.size;
+    String k;
+    while (pos < end) {
+        pos = readEntry(pos, end, k, value);
+        if (!pos)
+            return false;
+        const int cmp = StringView(k).compare(key);
+        if (!cmp)
+            return true;
+        if (cmp > 0)
+            break;
+    }
+    return false;
+}
+
+bool TableFile::contains(const StringView &key) const
+{
+    StringView value;
+    return find(key, value);
+}
+
+bool TableFile::read(const StringView &key, String &value) const
+{
+    StringView data;
+    if (!find(key, data))
+        return false;
+    value.assign(data.data(), data.size());
+    return true;
+}
+
+StringView TableFile::view(const StringView &key) const
+{
+    StringView ret;
+    if (!find(key, ret))
+        return StringView();
+    return ret;
+}
+
+bool TableFile::Iterator::load(size_t idx)
+{
+    while (idx < mTable->mBlockCount) {
+        const Block b = mTable->block(idx);
+        mBlock = idx;
+        mKey.clear();
+        if (Rct::crc32c(b.data, b.size) == b.crc && b.size) {
+            mPos = b.data;
+            mEnd = b.data + b.size;
+            return true;
+        }
+        // a damaged block is skipped
+        ++idx;
+    }
+    mTable = 0;
+    return false;
+}
+
+void TableFile::Iterator::next()
+{
+    if (!mTable)
+        return;
+    if (mPos == mEnd && !load(mBlock + 1))
+        return;
+    mPos = readEntry(mPos, mEnd, mKey, mValue);
+    if (!mPos) {
+        mPos = mEnd = 0;
+        next();
+    }
+}
+
+TableFile::Iterator TableFile::begin() const
+{
+    Iterator ret;
+    ret.mTable = this;
+    if (ret.load(0))
+        ret.next();
+    return ret;
+}
+
+TableFile::Iterator TableFile::lowerBound(const StringView &key) const
+{
+    Iterator ret;
+    ret.mTable = this;
+    const int64_t idx = findBlock(key);
+    if (ret.load(idx < 0 ? 0 : idx)) {
+        ret.next();
+        while (ret.isValid() && StringView(ret.key()) < key)
+            ret.next();
+    }
+    return ret;
+}
+
+bool TableFile::merge(const List<Path> &inputs, const Path &output, int version, String *error)
+{
+    std::vector<std::unique_ptr<TableFile> > tables;
+    std::vector<Iterator> iterators;
+    for (const Path &input : inputs) {
+        TableFile *table = new TableFile(input, version);
+        tables.push_back(std::unique_ptr<TableFile>(table));
+        if (!table->open()) {
+            if (error)
+                *error = input + ": " + table->error();
+            return false;
+        }
+        iterators.push_back(table->begin());
+    }
+
+    TableFileWriter writer(output, version);
+    if (!writer.open()) {
+        if (error)
+            *error = writer.error();
+        return false;
+    }
+    while (true) {
+        // a handful of inputs, a heap wouldn't pay off
+        int pick = -1;
+        for (size_t i = 0; i < iterators.size(); ++i) {
+            if (iterators[i].isValid()
+                && (pick == -1 || StringView(iterators[i].key()).compare(iterators[pick].key()) <= 0)) {
+                pick = i;
+            }
+        }
+        if (pick == -1)
+            break;
+        const String key = iterators[pick].key();
+        if (!writer.write(key, iterators[pick].value())) {
+            if (error)
+                *error = writer.error();
+            return false;
+        }
+        for (Iterator &it : iterators) {
+            if (it.isValid() && it.key() == key)
+                it.next();
+        }
+    }
+    if (!writer.commit()) {
+        if (error)
+            *error = writer.error();
+        return false;
+    }
+    return true;
+}
+
+TableFileWriter::TableFileWriter(const Path &path, int version)
+    : mPath(path), mVersion(version), mFd(-1), mPos(0), mBlockSize(DefaultBlockSize),
+      mBloomBitsPerKey(DefaultBloomBitsPerKey), mCount(0)
+{
+}
+
+TableFileWriter::~TableFileWriter()
+{
+    if (mFd != -1) {
+        ::close(mFd);
+        Path::rm(mTempFilePath);
+    }
+}
+
+void TableFileWriter::setError(const char *what)
+{
+    const int error = errno;
+    mError = String::format<128>("%s failure %d (%s)", what, error, Rct::strerror(error).constData());
+}
+
+bool TableFileWriter::writeData(const void *data, size_t size)
+{
+    const char *d = static_cast<const char *>(data);
+    while (size) {
+        const ssize_t w = ::write(mFd, d, size);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            setError("write");
+            return false;
+        }
+        d += w;
+        size -= w;
+        mPos += w;
+    }
+    return true;
+}
+
+bool TableFileWriter::open()
+{
+    if (!Path::mkdir(mPath.parentDir(), Path::Recursive)) {
+        setError("mkdir");
+        return false;
+    }
+    mTempFilePath = mPath + "XXXXXX";
+    mFd = mkostemp(&mTempFilePath[0], O_CLOEXEC);
+    if (mFd == -1) {
+        setError("mkstemp");
+        return false;
+    }
+    mPos = 0;
+    mCount = 0;
+    const uint32_t header[] = { TableFile::Magic, TableFile::Format, static_cast<uint32_t>(mVersion), 0 };
+    return writeData(header, sizeof(header));
+}
+
+bool TableFileWriter::write(const StringView &key, const StringView &value)
+{
+    if (mFd == -1) {
+        mError = "Not open";
+        return false;
+    }
+    if (mCount && StringView(mLastKey).compare(key) >= 0) {
+        mError = String::format<128>("Keys out of order at %s", String(key.data(), key.size()).constData());
+        return false;
+    }
+    size_t shared = 0;
+    if (mBlock.isEmpty()) {
+        mBlockFirstKey.assign(key.data(), key.size());
+    } else {
+        const size_t max = std::min(mLastKey.size(), key.size());
+        while (shared < max && mLastKey[shared] == key.data()[shared])
+            ++shared;
+    }
+    {
+        Serializer serializer(mBlock);
+        serializer.writeVarint(shared);
+        serializer.writeVarint(key.size() - shared);
+        serializer.writeVarint(value.size());
+        serializer.write(key.data() + shared, key.size() - shared);
+        serializer.write(value.data(), value.size());
+    }
+    mLastKey.assign(key.data(), key.size());
+    if (mBloomBitsPerKey > 0)
+        mHashes.append(TableFile::hash(key));
+    ++mCount;
+    if (mBlock.size() >= mBlockSize)
+        return flushBlock();
+    return true;
+}
+
+bool TableFileWriter::flushBlock()
+{
+    if (mBlock.isEmpty())
+        return true;
+    mIndexOffsets.append(mIndex.size());
+    {
+        Serializer serializer(mIndex);
+        serializer.writeVarint(mBlockFirstKey.size());
+        serializer.write(mBlockFirstKey.constData(), mBlockFirstKey.size());
+        const uint64_t offset = mPos;
+        const uint32_t sizes[] = { static_cast<uint32_t>(mBlock.size()), Rct::crc32c(mBlock.constData(), mBlock.size()) };
+        serializer.write(&offset, sizeof(offset));
+        serializer.write(sizes, sizeof(sizes));
+    }
+    const bool ret = writeData(mBlock.constData(), mBlock.size());
+    mBlock.clear();
+    return ret;
+}
+
+bool TableFileWriter::commit()
+{
+    if (mFd == -1) {
+        mError = "Not open";
+        return false;
+    }
+    if (!flushBlock())
+        return false;
+
+    const uint64_t indexOffset = mPos;
+    mIndex.append(reinterpret_cast<const char *>(mIndexOffsets.data()), mIndexOffsets.size() * sizeof(uint32_t));
+
+    String bloom;
+    uint32_t hashes = 0;
+    if (mBloomBitsPerKey > 0 && mCount) {
+        // about 1% false positives at 10 bits per key
+        const uint64_t bytes = std::max<uint64_t>(8, (mCount * mBloomBitsPerKey + 7) / 8);
+        const uint64_t bits = bytes * 8;
+        hashes = std::max(1, std::min(30, mBloomBitsPerKey * 69 / 100));
+        bloom.resize(bytes);
+        memset(&bloom[0], 0, bytes);
+        unsigned char *b = reinterpret_cast<unsigned char *>(&bloom[0]);
+        for (uint64_t h : mHashes) {
+            const uint64_t delta = (h >> 33) | (h << 31);
+            for (uint32_t i = 0; i < hashes; ++i) {
+                const uint64_t bit = h % bits;
+                b[bit / 8] |= 1 << (bit % 8);
+                h += delta;
+            }
+        }
+    }
+
+    uint32_t crc = Rct::crc32c(mIndex.constData(), mIndex.size());
+    crc = Rct::crc32c(bloom.constData(), bloom.size(), crc);
+    const uint64_t footer[] = { indexOffset, mIndex.size(), bloom.size(), mCount };
+    const uint32_t tail[] = { static_cast<uint32_t>(mIndexOffsets.size()), hashes, crc, TableFile::Magic };
+    static_assert(sizeof(footer) + sizeof(tail) == TableFile::FooterSize, "footer size");
+    if (!writeData(mIndex.constData(), mIndex.size()) || !writeData(bloom.constData(), bloom.size())
+        || !writeData(footer, sizeof(footer)) || !writeData(tail, sizeof(tail))) {
+        return false;
+    }
+
+    if (::close(mFd)) {
+        mFd = -1;
+        setError("close");
+        Path::rm(mTempFilePath);
+        return false;
+    }
+    mFd = -1;
+    if (rename(mTempFilePath.constData(), mPath.constData())) {
+        setError("rename");
+        Path::rm(mTempFilePath);
+        return false;
+    }
+    return true;
+}
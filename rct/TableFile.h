@@ -0,0 +1,221 @@
+#ifndef TableFile_h
+#define TableFile_h
+
+#include <stdint.h>
+
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/MappedFile.h>
+#include <rct/Path.h>
+#include <rct/Serializer.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+
+// An immutable file of sorted keys and values that are looked up in place
+// instead of loading all of it, for maps that are too big to deserialize
+// for every query. Keys are grouped in blocks of a few KB, each starting
+// with a full key and the rest storing what they don't share with the key
+// before. The index at the end has the first key of every block and a
+// bloom filter of all keys answers most lookups of missing keys without
+// touching a block, so a lookup reads the index and at most one block.
+//
+//     TableFileWriter writer(path, Version);
+//     if (writer.open() && writer.serialize(symbols))
+//         writer.commit();
+//
+//     TableFile table(path, Version);
+//     if (table.open())
+//         Symbol symbol = table.value<Symbol>(usr);
+//
+// Values are written with Serializer like DataFile does, in the compact
+// format if the version has Serializer::CompactVersion.
+class TableFile
+{
+public:
+    TableFile(const Path &path, int version);
+
+    Path path() const { return mPath; }
+    bool open();
+    String error() const { return mError; }
+
+    size_t size() const { return mCount; }
+    bool isEmpty() const { return !mCount; }
+
+    bool contains(const StringView &key) const;
+    // false if there's no such key or its block is damaged
+    bool read(const StringView &key, String &value) const;
+    // points into the mapping, an empty view if there's no such key
+    StringView view(const StringView &key) const;
+    template <typename T> bool deserialize(const StringView &key, T &t) const;
+    template <typename T> T value(const StringView &key, const T &defaultValue = T(), bool *ok = 0) const;
+
+    // walks the keys in order, from begin() or lowerBound()
+    class Iterator
+    {
+    public:
+        bool isValid() const { return mTable != 0; }
+        void next();
+        const String &key() const { return mKey; }
+        StringView value() const { return mValue; }
+        template <typename T> bool deserialize(T &t) const;
+
+    private:
+        friend class TableFile;
+        Iterator()
+            : mTable(0), mBlock(0), mPos(0), mEnd(0)
+        {}
+        bool load(size_t block);
+
+        const TableFile *mTable;
+        size_t mBlock;
+        const char *mPos, *mEnd;
+        String mKey;
+        StringView mValue;
+    };
+    Iterator begin() const;
+    // at the first key that isn't less than key
+    Iterator lowerBound(const StringView &key) const;
+
+    // writes the keys of all of inputs to output, for keys that are in
+    // more than one the value from the one that comes last in inputs
+    static bool merge(const List<Path> &inputs, const Path &output, int version, String *error = 0);
+
+private:
+    friend class TableFileWriter;
+    enum {
+        Magic = 0x54544352, // "RCTT"
+        Format = 1,
+        HeaderSize = 16,
+        FooterSize = 48
+    };
+    struct Block
+    {
+        StringView firstKey;
+        const char *data;
+        uint32_t size, crc;
+    };
+
+    static uint64_t hash(const StringView &key);
+    bool mayContain(const StringView &key) const;
+    // the block key would be in, -1 if it's before the first key
+    int64_t findBlock(const StringView &key) const;
+    Block block(size_t idx) const;
+    bool find(const StringView &key, StringView &value) const;
+
+    const Path mPath;
+    const int mVersion;
+    MappedFile mFile;
+    size_t mCount, mBlockCount;
+    const char *mIndex;
+    const char *mBlockOffsets;
+    const unsigned char *mBloom;
+    uint64_t mBloomBits;
+    uint32_t mBloomHashes;
+    String mError;
+
+    TableFile(const TableFile &) = delete;
+    TableFile &operator=(const TableFile &) = delete;
+};
+
+// Writes a TableFile to a temp file that replaces the old one on commit().
+// Keys have to be written in increasing order, like they come out of a Map.
+class TableFileWriter
+{
+public:
+    TableFileWriter(const Path &path, int version);
+    ~TableFileWriter();
+
+    enum {
+        DefaultBlockSize = 4096,
+        DefaultBloomBitsPerKey = 10
+    };
+    // before open(). 0 bits leaves the bloom filter out.
+    void setBlockSize(size_t size) { mBlockSize = size; }
+    void setBloomBitsPerKey(int bits) { mBloomBitsPerKey = bits; }
+
+    bool open();
+    String error() const { return mError; }
+
+    bool write(const StringView &key, const StringView &value);
+    template <typename T> bool serialize(const StringView &key, const T &t);
+    template <typename T> bool serialize(const Map<String, T> &map);
+    bool commit();
+
+private:
+    bool flushBlock();
+    bool writeData(const void *data, size_t size);
+    void setError(const char *what);
+
+    const Path mPath;
+    const int mVersion;
+    Path mTempFilePath;
+    int mFd;
+    uint64_t mPos;
+    size_t mBlockSize;
+    int mBloomBitsPerKey;
+    String mBlock, mBlockFirstKey, mLastKey, mIndex, mValue;
+    List<uint32_t> mIndexOffsets;
+    List<uint64_t> mHashes;
+    uint64_t mCount;
+    String mError;
+
+    TableFileWriter(const TableFileWriter &) = delete;
+    TableFileWriter &operator=(const TableFileWriter &) = delete;
+};
+
+template <typename T>
+inline bool TableFile::deserialize(const StringView &key, T &t) const
+{
+    StringView data;
+    if (!find(key, data))
+        return false;
+    Deserializer deserializer(data.data(), static_cast<int>(data.size()));
+    deserializer.setCompact(mVersion & Serializer::CompactVersion);
+    deserializer >> t;
+    return true;
+}
+
+template <typename T>
+inline T TableFile::value(const StringView &key, const T &defaultValue, bool *ok) const
+{
+    T ret;
+    const bool found = deserialize(key, ret);
+    if (ok)
+        *ok = found;
+    return found ? ret : defaultValue;
+}
+
+template <typename T>
+inline bool TableFile::Iterator::deserialize(T &t) const
+{
+    if (!mTable)
+        return false;
+    Deserializer deserializer(mValue.data(), static_cast<int>(mValue.size()));
+    deserializer.setCompact(mTable->mVersion & Serializer::CompactVersion);
+    deserializer >> t;
+    return true;
+}
+
+template <typename T>
+inline bool TableFileWriter::serialize(const StringView &key, const T &t)
+{
+    mValue.clear();
+    {
+        Serializer serializer(mValue);
+        serializer.setCompact(mVersion & Serializer::CompactVersion);
+        serializer << t;
+    }
+    return write(key, mValue);
+}
+
+template <typename T>
+inline bool TableFileWriter::serialize(const Map<String, T> &map)
+{
+    for (const auto &entry : map) {
+        if (!serialize(entry.first, entry.second))
+            return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,152 @@
+#include "TaskGraph.h"
+
+#include <assert.h>
+#include <limits.h>
+
+#include "EventLoop.h"
+#include "ThreadPool.h"
+
+TaskGraph::TaskGraph(ThreadPool *pool)
+    : mPool(pool ? pool : ThreadPool::instance()), mCancelled(false), mFinished(0), mResult(Pending)
+{
+}
+
+TaskGraph::TaskId TaskGraph::add(std::function<void()> &&fn, uint64_t cost, const std::shared_ptr<EventLoop> &loop)
+{
+    std::unique_ptr<Task> task(new Task);
+    task->fn = std::move(fn);
+    task->cost = cost;
+    task->rank = 0;
+    task->loop = loop;
+    task->dependencies = 0;
+    task->remaining.store(0);
+    mTasks.push_back(std::move(task));
+    return mTasks.size() - 1;
+}
+
+void TaskGraph::depend(TaskId task, TaskId on)
+{
+    assert(task < mTasks.size() && on < mTasks.size());
+    mTasks[on]->dependents.push_back(task);
+    ++mTasks[task]->dependencies;
+}
+
+bool TaskGraph::rankTasks()
+{
+    // Kahn's algorithm, what's left over is on a cycle
+    std::vector<TaskId> order;
+    order.reserve(mTasks.size());
+    std::vector<size_t> waiting(mTasks.size());
+    for (TaskId id = 0; id < mTasks.size(); ++id) {
+        waiting[id] = mTasks[id]->dependencies;
+        if (!waiting[id])
+            order.push_back(id);
+    }
+    for (size_t i = 0; i < order.size(); ++i) {
+        for (TaskId dependent : mTasks[order[i]]->dependents) {
+            if (!--waiting[dependent])
+                order.push_back(dependent);
+        }
+    }
+    if (order.size() != mTasks.size())
+        return false;
+
+    // the cost of the longest path from a task to the end of the graph
+    for (size_t i = order.size(); i > 0; --i) {
+        Task &task = *mTasks[order[i - 1]];
+        uint64_t longest = 0;
+        for (TaskId dependent : task.dependents)
+            longest = std::max(longest, mTasks[dependent]->rank);
+        task.rank = task.cost + longest;
+    }
+    return true;
+}
+
+TaskGraph::Result TaskGraph::run(std::function<void(Result)> &&done)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        assert(mResult == Pending && !mDone);
+        if (!rankTasks()) {
+            mResult = Cycle;
+            return Cycle;
+        }
+        mDone = std::move(done);
+        mDoneLoop = EventLoop::eventLoop();
+    }
+    if (mTasks.empty()) {
+        finish(mCancelled.load() ? Cancelled : Finished);
+        return result();
+    }
+    std::vector<TaskId> ready;
+    for (TaskId id = 0; id < mTasks.size(); ++id) {
+        Task &task = *mTasks[id];
+        task.remaining.store(task.dependencies);
+        if (!task.dependencies)
+            ready.push_back(id);
+    }
+    for (TaskId id : ready)
+        schedule(id);
+    return Pending;
+}
+
+void TaskGraph::schedule(TaskId id)
+{
+    Task &task = *mTasks[id];
+    SharedPtr graph = shared_from_this();
+    if (task.loop) {
+        task.loop->callLater([graph, id]() { graph->execute(id); });
+    } else {
+        const int priority = static_cast<int>(std::min<uint64_t>(task.rank, INT_MAX));
+        mPool->submit([graph, id]() { graph->execute(id); }, priority);
+    }
+}
+
+void TaskGraph::execute(TaskId id)
+{
+    Task &task = *mTasks[id];
+    if (!mCancelled.load())
+        task.fn();
+    // let go of what it captured
+    task.fn = std::function<void()>();
+    for (TaskId dependent : task.dependents) {
+        if (!--mTasks[dependent]->remaining)
+            schedule(dependent);
+    }
+    if (++mFinished == mTasks.size())
+        finish(mCancelled.load() ? Cancelled : Finished);
+}
+
+void TaskGraph::finish(Result result)
+{
+    std::function<void(Result)> done;
+    std::shared_ptr<EventLoop> loop;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mResult = result;
+        done = std::move(mDone);
+        loop = std::move(mDoneLoop);
+        mCondition.notify_all();
+    }
+    if (!done)
+        return;
+    if (loop) {
+        loop->callLater([done, result]() { done(result); });
+    } else {
+        done(result);
+    }
+}
+
+TaskGraph::Result TaskGraph::wait() const
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mResult == Pending)
+        mCondition.wait(lock);
+    return mResult;
+}
+
+TaskGraph::Result TaskGraph::result() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mResult;
+}
@@ -0,0 +1,99 @@
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+class EventLoop;
+class ThreadPool;
+
+// Tasks with dependencies run on a ThreadPool as soon as everything they
+// depend on has run, so the stages of a pipeline overlap instead of each
+// one draining before the next starts.
+//
+//     TaskGraph::SharedPtr graph = TaskGraph::create();
+//     const TaskGraph::TaskId parse = graph->add([&]() { ... }, 10);
+//     const TaskGraph::TaskId index = graph->add([&]() { ... }, 40);
+//     const TaskGraph::TaskId write = graph->add([&]() { ... }, 5, loop);
+//     graph->depend(index, parse);
+//     graph->depend(write, index);
+//     graph->run([](TaskGraph::Result result) { ... });
+//
+// Ready tasks are started with the pool priority of the cost of the
+// longest path from them to the end of the graph, so the critical path
+// goes first. Costs are in any unit as long as it's the same for all
+// tasks. Work-stealing pools only honour priorities in bands, there it
+// is merely a hint.
+class TaskGraph : public std::enable_shared_from_this<TaskGraph>
+{
+public:
+    typedef std::shared_ptr<TaskGraph> SharedPtr;
+    typedef size_t TaskId;
+
+    // pool is ThreadPool::instance() when null
+    static SharedPtr create(ThreadPool *pool = 0)
+    {
+        return SharedPtr(new TaskGraph(pool));
+    }
+
+    // A task that runs fn on the pool, or as a posted event on loop if
+    // one is given. Tasks and dependencies can only be added before
+    // run().
+    TaskId add(std::function<void()> &&fn, uint64_t cost = 1,
+               const std::shared_ptr<EventLoop> &loop = std::shared_ptr<EventLoop>());
+    // task runs after on
+    void depend(TaskId task, TaskId on);
+    size_t size() const { return mTasks.size(); }
+
+    enum Result { Pending, Finished, Cancelled, Cycle };
+    // Starts the tasks without dependencies. done is called with the
+    // outcome as a posted event on the loop of the calling thread, or
+    // on the thread that finished last if it has none. A graph with a
+    // cycle doesn't run at all.
+    Result run(std::function<void(Result)> &&done = std::function<void(Result)>());
+    // Tasks that haven't started yet won't, the running ones finish.
+    // Tasks can check isCancelled() to stop early.
+    void cancel() { mCancelled.store(true); }
+    bool isCancelled() const { return mCancelled.load(); }
+
+    // blocks until the graph is done, don't call it from a task
+    Result wait() const;
+    Result result() const;
+
+private:
+    TaskGraph(ThreadPool *pool);
+
+    struct Task
+    {
+        std::function<void()> fn;
+        uint64_t cost, rank;
+        std::shared_ptr<EventLoop> loop;
+        std::vector<TaskId> dependents;
+        size_t dependencies;
+        std::atomic<size_t> remaining;
+    };
+    bool rankTasks();
+    void schedule(TaskId id);
+    void execute(TaskId id);
+    void finish(Result result);
+
+    ThreadPool *const mPool;
+    std::vector<std::unique_ptr<Task> > mTasks;
+    std::atomic<bool> mCancelled;
+    std::atomic<size_t> mFinished;
+    std::function<void(Result)> mDone;
+    std::shared_ptr<EventLoop> mDoneLoop;
+    mutable std::mutex mMutex;
+    mutable std::condition_variable mCondition;
+    Result mResult;
+
+    TaskGraph(const TaskGraph &) = delete;
+    TaskGraph &operator=(const TaskGraph &) = delete;
+};
+
+#endif
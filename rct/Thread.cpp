@@ -1,5 +1,12 @@
 #include "Thread.h"
 
+#include <dirent.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rct/CpuUsage.h>
 #include <rct/EventLoop.h>
 #include <rct/Log.h>
 #include <rct/rct-config.h>
@@ -15,9 +22,30 @@ Thread::~Thread()
         pthread_cancel(mThread);
 }
 
+static void setOsName(pthread_t thread, const String &name)
+{
+#ifdef HAVE_PTHREAD_SETNAME
+#if defined(OS_Darwin)
+    // only for the calling thread
+    (void)thread;
+    pthread_setname_np(name.constData());
+#else
+    // longer names are refused rather than cut
+    pthread_setname_np(thread, name.left(15).constData());
+#endif
+#else
+    (void)thread;
+    (void)name;
+#endif
+}
+
 void* Thread::localStart(void* arg)
 {
     Thread* t = static_cast<Thread*>(arg);
+    const String name = t->name();
+    if (!name.isEmpty())
+        setOsName(pthread_self(), name);
+    CpuUsage::registerThread(name.isEmpty() ? String("Thread") : name);
     t->run();
     EventLoop::cleanupLocalEventLoop();
     if (t->isAutoDelete()) {
@@ -29,6 +57,21 @@ void* Thread::localStart(void* arg)
     return 0;
 }
 
+#ifdef HAVE_PTHREAD_SETAFFINITY
+static bool buildCpuSet(const List<int> &cpus, cpu_set_t &set)
+{
+    CPU_ZERO(&set);
+    bool any = false;
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+            any = true;
+        }
+    }
+    return any;
+}
+#endif
+
 static inline void initAttr(pthread_attr_t** pattr, pthread_attr_t* attr)
 {
     if (!*pattr) {
@@ -55,7 +98,19 @@ void Thread::start(Priority priority, size_t stackSize)
             error() << "pthread_attr_setstacksize failed";
         }
     }
-    mRunning = true;
+#ifdef HAVE_PTHREAD_SETAFFINITY
+    cpu_set_t set;
+    if (buildCpuSet(affinity(), set)) {
+        initAttr(&pattr, &attr);
+        if (pthread_attr_setaffinity_np(pattr, sizeof(set), &set) != 0) {
+            error() << "pthread_attr_setaffinity_np failed";
+        }
+    }
+#endif
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRunning = true;
+    }
     if (pthread_create(&mThread, pattr, localStart, this) != 0) {
         error() << "pthread_create failed";
     }
@@ -64,6 +119,88 @@ void Thread::start(Priority priority, size_t stackSize)
     }
 }
 
+bool Thread::setAffinity(const List<int> &cpus)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mAffinity = cpus;
+#ifdef HAVE_PTHREAD_SETAFFINITY
+    cpu_set_t set;
+    if (!buildCpuSet(cpus, set)) {
+        if (!cpus.isEmpty())
+            return false;
+        // back to every CPU the process has
+        if (!buildCpuSet(availableCpus(), set))
+            return true;
+    }
+    return !mRunning || pthread_setaffinity_np(mThread, sizeof(set), &set) == 0;
+#else
+    return cpus.isEmpty();
+#endif
+}
+
+void Thread::setName(const String &name)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mName = name;
+    if (mRunning) {
+#ifndef OS_Darwin
+        setOsName(mThread, name);
+#endif
+        CpuUsage::setThreadName(mThread, name);
+    }
+}
+
+String Thread::name() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mName;
+}
+
+List<int> Thread::affinity() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mAffinity;
+}
+
+List<int> Thread::availableCpus()
+{
+    List<int> cpus;
+#ifdef HAVE_PTHREAD_SETAFFINITY
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set))
+                cpus.append(cpu);
+        }
+        return cpus;
+    }
+#endif
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long cpu = 0; cpu < count; ++cpu)
+        cpus.append(static_cast<int>(cpu));
+    return cpus;
+}
+
+int Thread::cpuNode(int cpu)
+{
+    // sysfs has a nodeN link in the directory of every CPU
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0;
+    int node = 0;
+    while (dirent *entry = readdir(dir)) {
+        if (!strncmp(entry->d_name, "node", 4) && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
 bool Thread::join()
 {
     if (!mRunning)
@@ -5,6 +5,8 @@
 #include <pthread.h>
 
 #include <rct/EventLoop.h>
+#include <rct/List.h>
+#include <rct/String.h>
 
 class Thread
 {
@@ -30,6 +32,24 @@ public:
 
     pthread_t self() const { return mThread; }
 
+    // Shows in top, ps and debuggers, cut to 15 characters on Linux, and
+    // tags the thread in CpuUsage::threadUsage(). Takes effect when the
+    // thread starts or right away if it's running, except that Darwin
+    // only lets a thread name itself.
+    void setName(const String &name);
+    String name() const;
+
+    // The CPUs the thread may run on, empty for any. Takes effect when
+    // the thread starts or right away if it's running. false if the
+    // platform can't pin threads or none of the CPUs are usable.
+    bool setAffinity(const List<int> &cpus);
+    List<int> affinity() const;
+
+    // the CPUs this process may run on, in order
+    static List<int> availableCpus();
+    // the NUMA node a CPU belongs to, 0 when there's no NUMA information
+    static int cpuNode(int cpu);
+
 protected:
     virtual void run() = 0;
 
@@ -43,6 +63,8 @@ private:
     mutable std::mutex mMutex;
     pthread_t mThread;
     bool mRunning;
+    List<int> mAffinity;
+    String mName;
     EventLoop::WeakPtr mLoop;
 };
 
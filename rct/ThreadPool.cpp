@@ -2,6 +2,9 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <iterator>
+#include <pthread.h>
+#include <stdio.h>
 
 #include "rct/rct-config.h"
 #if defined (OS_FreeBSD) || defined (OS_NetBSD) || defined (OS_OpenBSD)
@@ -16,13 +19,78 @@
 #   include <windows.h>
 #endif
 
+#include "Allocations.h"
+#include "EventLoop.h"
 #include "Log.h"
+#include "Metrics.h"
+#include "Path.h"
+#include "StopWatch.h"
+#include "String.h"
 #include "Thread.h"
+#include "Trace.h"
 
 using std::shared_ptr;
 
 ThreadPool* ThreadPool::sInstance = 0;
 
+void FutureStateBase::finish()
+{
+    mReady.store(true);
+    if (mWaiters.load()) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCond.notify_all();
+    }
+}
+
+void FutureStateBase::wait() const
+{
+    if (isReady())
+        return;
+    std::unique_lock<std::mutex> lock(mMutex);
+    ++mWaiters;
+    while (!mReady.load())
+        mCond.wait(lock);
+    --mWaiters;
+}
+
+bool FutureStateBase::waitFor(int ms) const
+{
+    if (isReady())
+        return true;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    std::unique_lock<std::mutex> lock(mMutex);
+    ++mWaiters;
+    while (!mReady.load()) {
+        if (mCond.wait_until(lock, deadline) == std::cv_status::timeout)
+            break;
+    }
+    --mWaiters;
+    return mReady.load();
+}
+
+void ThreadPool::post(const std::shared_ptr<EventLoop> &loop, std::function<void()> &&func)
+{
+    loop->callLater(std::move(func));
+}
+
+struct ThreadPool::WorkQueue
+{
+    explicit WorkQueue(ThreadPool *p)
+        : pool(p), node(-1)
+    {}
+
+    ThreadPool *const pool;
+    // of the thread that has it, -1 if unknown
+    std::atomic<int> node;
+    std::mutex mutex;
+    // the owner pushes and pops at the back, thieves take from the front
+    std::deque<std::shared_ptr<Job> > jobs[Bands];
+};
+
+// the WorkQueue of the pool thread we're on, if any
+static pthread_key_t sWorkQueueKey;
+static std::once_flag sWorkQueueOnce;
+
 class ThreadPoolThread : public Thread
 {
 public:
@@ -35,19 +103,27 @@ protected:
     virtual void run() override;
 
 private:
+    void runShared();
+    void runStealing();
+
     std::shared_ptr<ThreadPool::Job> mJob;
     ThreadPool* mPool;
-    bool mStopped;
+    std::atomic<bool> mStopped;
+    // where ThreadPool::place() put us
+    std::atomic<int> mNode;
+    std::atomic<ThreadPool::WorkQueue*> mQueue;
+
+    friend class ThreadPool;
 };
 
 ThreadPoolThread::ThreadPoolThread(ThreadPool* pool)
-    : mPool(pool), mStopped(false)
+    : mPool(pool), mStopped(false), mNode(-1), mQueue(0)
 {
     setAutoDelete(false);
 }
 
 ThreadPoolThread::ThreadPoolThread(const std::shared_ptr<ThreadPool::Job> &job)
-    : mJob(job), mPool(0), mStopped(false)
+    : mJob(job), mPool(0), mStopped(false), mNode(-1), mQueue(0)
 {
     setAutoDelete(false);
 }
@@ -62,11 +138,22 @@ void ThreadPoolThread::stop()
 void ThreadPoolThread::run()
 {
     if (mJob) {
+        RCT_TRACE_FLOW_SCOPE("ThreadPool", "job", mJob->mTraceFlow);
+        RCT_ALLOCATION_SCOPE(Allocations::ThreadPoolSubsystem);
         mJob->mMutex.lock();
         mJob->run();
         mJob->mMutex.unlock();
         return;
     }
+    if (mPool->mScheduling == ThreadPool::WorkStealing) {
+        runStealing();
+    } else {
+        runShared();
+    }
+}
+
+void ThreadPoolThread::runShared()
+{
     bool first = true;
     for (;;) {
         std::unique_lock<std::mutex> lock(mPool->mMutex);
@@ -79,43 +166,155 @@ void ThreadPoolThread::run()
             mPool->mCond.wait(lock);
         if (mStopped)
             break;
-        std::deque<std::shared_ptr<ThreadPool::Job> >::iterator item = mPool->mJobs.begin();
+        std::map<ThreadPool::JobKey, std::shared_ptr<ThreadPool::Job> >::iterator item = mPool->mJobs.begin();
         assert(item != mPool->mJobs.end());
-        std::shared_ptr<ThreadPool::Job> job = *item;
+        std::shared_ptr<ThreadPool::Job> job = std::move(item->second);
         mPool->mJobs.erase(item);
-        {
-            std::lock_guard<std::mutex> joblock(job->mMutex);
-            job->mState = ThreadPool::Job::Running;
-        }
+        job->mState.store(ThreadPool::Job::Running, std::memory_order_release);
         ++mPool->mBusyThreads;
         lock.unlock();
-        job->run();
-        {
-            std::lock_guard<std::mutex> joblock(job->mMutex);
-            job->mState = ThreadPool::Job::Finished;
+        mPool->runJob(job);
+        job->mState.store(ThreadPool::Job::Finished, std::memory_order_release);
+    }
+}
+
+void ThreadPoolThread::runStealing()
+{
+    ThreadPool::WorkQueue *own = mPool->attach();
+    pthread_setspecific(sWorkQueueKey, own);
+    if (own) {
+        own->node.store(mNode.load());
+        mQueue.store(own);
+    }
+    unsigned int seed = static_cast<unsigned int>(reinterpret_cast<uintptr_t>(this) >> 4);
+    while (!mStopped.load(std::memory_order_relaxed)) {
+        std::shared_ptr<ThreadPool::Job> job = mPool->take(own, seed);
+        if (!job) {
+            // start() only takes the lock to wake us if it sees a
+            // sleeper, so count ourselves before looking again
+            std::unique_lock<std::mutex> lock(mPool->mMutex);
+            ++mPool->mSleepers;
+            while (!mPool->hasPending() && !mStopped)
+                mPool->mCond.wait(lock);
+            --mPool->mSleepers;
+            continue;
         }
+        job->mState.store(ThreadPool::Job::Running, std::memory_order_release);
+        ++mPool->mBusyThreads;
+        mPool->runJob(job);
+        --mPool->mBusyThreads;
+        job->mState.store(ThreadPool::Job::Finished, std::memory_order_release);
     }
+    pthread_setspecific(sWorkQueueKey, 0);
+    if (own) {
+        mQueue.store(0);
+        own->node.store(-1);
+    }
+    mPool->detach(own);
 }
 
-ThreadPool::ThreadPool(int concurrentJobs, Thread::Priority priority, size_t threadStackSize)
-    : mConcurrentJobs(concurrentJobs), mBusyThreads(0),
-      mPriority(priority), mThreadStackSize(threadStackSize)
+ThreadPool::ThreadPool(int concurrentJobs, Thread::Priority priority, size_t threadStackSize,
+                       Scheduling scheduling)
+    : mConcurrentJobs(concurrentJobs), mSequence(0), mBusyThreads(0),
+      mPriority(priority), mThreadStackSize(threadStackSize), mScheduling(scheduling),
+      mQueueCount(0), mSleepers(0), mPlacement(Unpinned), mNodeNext(0), mName("ThreadPool"),
+      mInstrumentation(false), mPerType(false), mPeakBacklog(0), mStatistics(),
+      mSlowWaitThreshold(0), mMetricsCollector(0)
 {
     if (!sInstance)
         sInstance = this;
+    for (int i = 0; i < Bands; ++i)
+        mPending[i].store(0);
+    if (mScheduling == WorkStealing) {
+        std::call_once(sWorkQueueOnce, []() { pthread_key_create(&sWorkQueueKey, 0); });
+        mQueues.reset(new std::atomic<WorkQueue*>[MaxQueues]);
+        for (int i = 0; i < MaxQueues; ++i)
+            mQueues[i].store(0, std::memory_order_relaxed);
+    }
     for (int i = 0; i < mConcurrentJobs; ++i) {
         mThreads.push_back(new ThreadPoolThread(this));
+        mThreads.back()->setName(mName);
         mThreads.back()->start(mPriority, mThreadStackSize);
     }
+    mMetricsCollector = Metrics::instance().addCollector([this](List<Metrics::Sample> &samples) {
+            const Metrics::Labels labels = { { "pool", name() } };
+            samples.append(Metrics::sample("rct_threadpool_threads", Metrics::GaugeType, this->concurrentJobs(), labels));
+            samples.append(Metrics::sample("rct_threadpool_backlog", Metrics::GaugeType, backlogSize(), labels));
+            samples.append(Metrics::sample("rct_threadpool_busy_threads", Metrics::GaugeType, busyThreads(), labels));
+            const Statistics stats = statistics();
+            samples.append(Metrics::sample("rct_threadpool_jobs_started_total", Metrics::CounterType, stats.started, labels));
+            samples.append(Metrics::sample("rct_threadpool_jobs_finished_total", Metrics::CounterType, stats.finished, labels));
+            samples.append(Metrics::sample("rct_threadpool_slow_waits_total", Metrics::CounterType, stats.slowWaits, labels));
+            if (stats.all.run.count) {
+                samples.append(Metrics::histogramSample("rct_threadpool_job_wait_us", stats.all.wait, Statistics::BucketCount, labels));
+                samples.append(Metrics::histogramSample("rct_threadpool_job_run_us", stats.all.run, Statistics::BucketCount, labels));
+            }
+        });
+}
+
+void ThreadPool::setName(const String &name)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mName = name;
+    for (ThreadPoolThread *thread : mThreads)
+        thread->setName(name);
+}
+
+String ThreadPool::name() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mName;
+}
+
+void ThreadPool::setPlacement(Placement placement)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mPlacement = placement;
+    size_t index = 0;
+    for (ThreadPoolThread *thread : mThreads)
+        place(thread, index++);
+}
+
+ThreadPool::Placement ThreadPool::placement() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mPlacement;
+}
+
+void ThreadPool::place(ThreadPoolThread *thread, size_t index)
+{
+    List<int> cpus;
+    int node = -1;
+    if (mPlacement != Unpinned) {
+        const List<int> available = Thread::availableCpus();
+        if (!available.isEmpty()) {
+            if (mPlacement == PinPerCore) {
+                const int cpu = available[index % available.size()];
+                cpus.append(cpu);
+                node = Thread::cpuNode(cpu);
+            } else {
+                std::map<int, List<int> > nodes;
+                for (int cpu : available)
+                    nodes[Thread::cpuNode(cpu)].append(cpu);
+                std::map<int, List<int> >::const_iterator it = nodes.begin();
+                std::advance(it, index % nodes.size());
+                node = it->first;
+                cpus = it->second;
+            }
+        }
+    }
+    thread->setAffinity(cpus);
+    thread->mNode.store(node);
+    if (WorkQueue *queue = thread->mQueue.load())
+        queue->node.store(node);
 }
 
 ThreadPool::~ThreadPool()
 {
+    Metrics::instance().removeCollector(mMetricsCollector);
     if (sInstance == this)
         sInstance = 0;
-    std::unique_lock<std::mutex> lock(mMutex);
-    mJobs.clear();
-    lock.unlock();
+    clearBackLog();
     for (List<ThreadPoolThread*>::iterator it = mThreads.begin();
          it != mThreads.end(); ++it) {
         ThreadPoolThread* t = *it;
@@ -123,6 +322,9 @@ ThreadPool::~ThreadPool()
         t->join();
         delete t;
     }
+    const int queues = mQueueCount.load();
+    for (int i = 0; i < queues; ++i)
+        delete mQueues[i].load();
 }
 
 void ThreadPool::setConcurrentJobs(int concurrentJobs)
@@ -133,6 +335,9 @@ void ThreadPool::setConcurrentJobs(int concurrentJobs)
         std::lock_guard<std::mutex> lock(mMutex);
         for (int i = mConcurrentJobs; i < concurrentJobs; ++i) {
             mThreads.push_back(new ThreadPoolThread(this));
+            if (mPlacement != Unpinned)
+                place(mThreads.back(), i);
+            mThreads.back()->setName(mName);
             mThreads.back()->start(mPriority, mThreadStackSize);
         }
         mConcurrentJobs = concurrentJobs;
@@ -151,46 +356,100 @@ void ThreadPool::setConcurrentJobs(int concurrentJobs)
     }
 }
 
-bool ThreadPool::jobLessThan(const std::shared_ptr<Job> &l, const std::shared_ptr<Job> &r)
-{
-    return static_cast<unsigned>(l->mPriority) > static_cast<unsigned>(r->mPriority);
-}
-
 void ThreadPool::start(const std::shared_ptr<Job> &job, int priority)
 {
+    RCT_TRACE_SCOPE("ThreadPool", "start");
+    job->mTraceFlow = RCT_TRACE_FLOW_START();
     job->mPriority = priority;
     if (priority == Guaranteed) {
         ThreadPoolThread *t = new ThreadPoolThread(job);
+        t->setName(name());
         t->start(mPriority, mThreadStackSize);
         return;
     }
+    if (mScheduling == WorkStealing) {
+        push(job);
+        return;
+    }
 
     std::lock_guard<std::mutex> lock(mMutex);
-    if (mJobs.empty()) {
-        mJobs.push_back(job);
-    } else {
-        if (mJobs.at(mJobs.size() - 1)->mPriority >= priority) {
-            mJobs.push_back(job);
-        } else if (mJobs.at(0)->mPriority < priority) {
-            mJobs.push_front(job);
-        } else {
-            mJobs.push_back(job);
-            std::sort(mJobs.begin(), mJobs.end(), jobLessThan);
-        }
-    }
+    job->mSequence = ++mSequence;
+    const JobKey key = { priority, job->mSequence };
+    mJobs.insert(mJobs.end(), std::make_pair(key, job));
+    queued(job, mJobs.size());
     mCond.notify_one();
 }
 
 bool ThreadPool::remove(const std::shared_ptr<Job> &job)
 {
+    if (mScheduling == WorkStealing) {
+        const int b = band(job->mPriority);
+        {
+            std::lock_guard<std::mutex> lock(mInjectMutex);
+            std::deque<std::shared_ptr<Job> > &jobs = mInjected[b];
+            std::deque<std::shared_ptr<Job> >::iterator it = std::find(jobs.begin(), jobs.end(), job);
+            if (it != jobs.end()) {
+                jobs.erase(it);
+                --mPending[b];
+                return true;
+            }
+        }
+        const int queues = mQueueCount.load(std::memory_order_acquire);
+        for (int i = 0; i < queues; ++i) {
+            WorkQueue *queue = mQueues[i].load(std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            std::deque<std::shared_ptr<Job> > &jobs = queue->jobs[b];
+            std::deque<std::shared_ptr<Job> >::iterator it = std::find(jobs.begin(), jobs.end(), job);
+            if (it != jobs.end()) {
+                jobs.erase(it);
+                --mPending[b];
+                return true;
+            }
+        }
+        return false;
+    }
     std::lock_guard<std::mutex> lock(mMutex);
-    std::deque<std::shared_ptr<Job> >::iterator it = std::find(mJobs.begin(), mJobs.end(), job);
-    if (it == mJobs.end())
+    const JobKey key = { job->mPriority, job->mSequence };
+    std::map<JobKey, std::shared_ptr<Job> >::iterator it = mJobs.find(key);
+    if (it == mJobs.end() || it->second != job)
         return false;
     mJobs.erase(it);
     return true;
 }
 
+#if defined (OS_Linux)
+// CPUs worth of time the process' cgroup may use, rounded up, 0 for no
+// limit
+static int cgroupCpuQuota()
+{
+    // cgroup v2 has "0::/path" in /proc/self/cgroup, and "max 100000"
+    // or "<quota> <period>" in cpu.max
+    String cgroup = Path("/proc/self/cgroup").readAll();
+    String dir = "/sys/fs/cgroup";
+    for (const String &line : cgroup.split('\n')) {
+        if (line.startsWith("0::/")) {
+            dir += line.mid(3);
+            break;
+        }
+    }
+    long long quota = -1, period = 0;
+    String max = Path(dir + "/cpu.max").readAll();
+    if (max.isEmpty())
+        max = Path("/sys/fs/cgroup/cpu.max").readAll();
+    if (!max.isEmpty()) {
+        if (!max.startsWith("max"))
+            sscanf(max.constData(), "%lld %lld", &quota, &period);
+    } else {
+        // cgroup v1
+        quota = Path("/sys/fs/cgroup/cpu/cpu.cfs_quota_us").readAll().toLongLong();
+        period = Path("/sys/fs/cgroup/cpu/cpu.cfs_period_us").readAll().toLongLong();
+    }
+    if (quota <= 0 || period <= 0)
+        return 0;
+    return static_cast<int>((quota + period - 1) / period);
+}
+#endif
+
 int ThreadPool::idealThreadCount()
 {
 #if defined (OS_FreeBSD) || defined (OS_NetBSD) || defined (OS_OpenBSD)
@@ -203,7 +462,11 @@ int ThreadPool::idealThreadCount()
         return 1;
     return cores;
 #elif defined (OS_Linux)
-    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int count = std::max<int>(Thread::availableCpus().size(), 1);
+    const int quota = cgroupCpuQuota();
+    if (quota > 0)
+        count = std::min(count, quota);
+    return count;
 #elif defined (OS_Darwin)
     int cores;
     size_t len = sizeof(cores);
@@ -261,24 +524,293 @@ ThreadPool* ThreadPool::instance()
 }
 
 ThreadPool::Job::Job()
-    : mPriority(0), mState(NotStarted)
+    : mPriority(0), mSequence(0), mQueuedAt(0), mTraceFlow(0), mState(NotStarted)
 {
 }
 
 void ThreadPool::clearBackLog()
 {
+    if (mScheduling == WorkStealing) {
+        clearQueues();
+        return;
+    }
     std::lock_guard<std::mutex> lock(mMutex);
     mJobs.clear();
 }
 
 int ThreadPool::busyThreads() const
 {
-    std::lock_guard<std::mutex> lock(mMutex);
-    return mBusyThreads;
+    return mBusyThreads.load();
 }
 
 int ThreadPool::backlogSize() const
 {
+    if (mScheduling == WorkStealing) {
+        int pending = 0;
+        for (int i = 0; i < Bands; ++i)
+            pending += mPending[i].load();
+        return std::max(pending, 0);
+    }
     std::lock_guard<std::mutex> lock(mMutex);
     return mJobs.size();
 }
+
+void ThreadPool::queued(const std::shared_ptr<Job> &job, size_t backlog)
+{
+    if (!mInstrumentation.load(std::memory_order_relaxed)) {
+        job->mQueuedAt = 0;
+        return;
+    }
+    job->mQueuedAt = StopWatch::current(StopWatch::Microsecond);
+    size_t peak = mPeakBacklog.load(std::memory_order_relaxed);
+    while (backlog > peak && !mPeakBacklog.compare_exchange_weak(peak, backlog, std::memory_order_relaxed)) {
+    }
+}
+
+void ThreadPool::runJob(const std::shared_ptr<Job> &job)
+{
+    RCT_TRACE_FLOW_SCOPE("ThreadPool", "job", job->mTraceFlow);
+    RCT_ALLOCATION_SCOPE(Allocations::ThreadPoolSubsystem);
+    // jobs queued before instrumentation was enabled aren't counted
+    if (!job->mQueuedAt || !mInstrumentation.load(std::memory_order_relaxed)) {
+        job->run();
+        return;
+    }
+    const uint64_t started = StopWatch::current(StopWatch::Microsecond);
+    const uint64_t waited = started > job->mQueuedAt ? started - job->mQueuedAt : 0;
+    SlowWaitHandler handler;
+    {
+        std::lock_guard<std::mutex> lock(mStatisticsMutex);
+        ++mStatistics.started;
+        if (mSlowWaitThreshold > 0 && waited >= mSlowWaitThreshold * 1000ULL) {
+            ++mStatistics.slowWaits;
+            handler = mSlowWaitHandler;
+        }
+    }
+    if (handler)
+        handler(job, waited);
+    job->run();
+    record(job, waited, StopWatch::current(StopWatch::Microsecond) - started);
+}
+
+static inline void addSample(ThreadPool::Statistics::Histogram &histogram, uint64_t us)
+{
+    int bucket = 0;
+    while (bucket < ThreadPool::Statistics::BucketCount - 1 && us >= (1ULL << bucket))
+        ++bucket;
+    ++histogram.count;
+    histogram.totalUs += us;
+    histogram.maxUs = std::max(histogram.maxUs, us);
+    ++histogram.buckets[bucket];
+}
+
+void ThreadPool::record(const std::shared_ptr<Job> &job, uint64_t waitUs, uint64_t runUs)
+{
+    const bool perType = mPerType.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mStatisticsMutex);
+    ++mStatistics.finished;
+    addSample(mStatistics.all.wait, waitUs);
+    addSample(mStatistics.all.run, runUs);
+    if (perType && !job->mStatisticsName.isEmpty()) {
+        Statistics::Timing &timing = mStatistics.types.insert(std::make_pair(job->mStatisticsName, Statistics::Timing())).first->second;
+        addSample(timing.wait, waitUs);
+        addSample(timing.run, runUs);
+    }
+}
+
+void ThreadPool::setSlowWaitHandler(int ms, SlowWaitHandler &&handler)
+{
+    std::lock_guard<std::mutex> lock(mStatisticsMutex);
+    mSlowWaitThreshold = ms;
+    mSlowWaitHandler = std::move(handler);
+}
+
+ThreadPool::Statistics ThreadPool::statistics() const
+{
+    std::lock_guard<std::mutex> lock(mStatisticsMutex);
+    Statistics ret = mStatistics;
+    ret.peakBacklog = mPeakBacklog.load(std::memory_order_relaxed);
+    return ret;
+}
+
+void ThreadPool::resetStatistics()
+{
+    std::lock_guard<std::mutex> lock(mStatisticsMutex);
+    mStatistics = Statistics();
+    mPeakBacklog.store(0, std::memory_order_relaxed);
+}
+
+ThreadPool::WorkQueue *ThreadPool::attach()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const int queues = mQueueCount.load(std::memory_order_relaxed);
+    for (int i = 0; i < queues; ++i) {
+        if (!mQueueUsed[i]) {
+            mQueueUsed[i] = true;
+            return mQueues[i].load(std::memory_order_relaxed);
+        }
+    }
+    if (queues == MaxQueues)
+        return 0;
+    WorkQueue *queue = new WorkQueue(this);
+    mQueues[queues].store(queue, std::memory_order_relaxed);
+    mQueueUsed.push_back(true);
+    mQueueCount.store(queues + 1, std::memory_order_release);
+    return queue;
+}
+
+void ThreadPool::detach(WorkQueue *queue)
+{
+    // what's left in it is stolen by the others
+    std::lock_guard<std::mutex> lock(mMutex);
+    const int queues = mQueueCount.load(std::memory_order_relaxed);
+    for (int i = 0; i < queues; ++i) {
+        if (mQueues[i].load(std::memory_order_relaxed) == queue) {
+            mQueueUsed[i] = false;
+            break;
+        }
+    }
+}
+
+void ThreadPool::startOnNode(const std::shared_ptr<Job> &job, int node, int priority)
+{
+    if (mScheduling != WorkStealing || priority == Guaranteed || node < 0) {
+        start(job, priority);
+        return;
+    }
+    RCT_TRACE_SCOPE("ThreadPool", "start");
+    job->mTraceFlow = RCT_TRACE_FLOW_START();
+    job->mPriority = priority;
+    const int queues = mQueueCount.load(std::memory_order_acquire);
+    int count = 0;
+    for (int i = 0; i < queues; ++i) {
+        if (mQueues[i].load(std::memory_order_relaxed)->node.load(std::memory_order_relaxed) == node)
+            ++count;
+    }
+    // round robin over the node's threads
+    WorkQueue *target = 0;
+    if (count) {
+        int wanted = mNodeNext++ % count;
+        for (int i = 0; i < queues && !target; ++i) {
+            WorkQueue *queue = mQueues[i].load(std::memory_order_relaxed);
+            if (queue->node.load(std::memory_order_relaxed) == node && !wanted--)
+                target = queue;
+        }
+    }
+    push(job, target);
+}
+
+void ThreadPool::push(const std::shared_ptr<Job> &job, WorkQueue *target)
+{
+    const int b = band(job->mPriority);
+    WorkQueue *own = target;
+    if (!own) {
+        own = static_cast<WorkQueue*>(pthread_getspecific(sWorkQueueKey));
+        if (own && own->pool != this)
+            own = 0;
+    }
+    // stamped before it's published, it can be taken right away
+    queued(job, backlogSize() + 1);
+    if (own) {
+        std::lock_guard<std::mutex> lock(own->mutex);
+        own->jobs[b].push_back(job);
+    } else {
+        std::lock_guard<std::mutex> lock(mInjectMutex);
+        mInjected[b].push_back(job);
+    }
+    ++mPending[b];
+    if (mSleepers.load()) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCond.notify_one();
+    }
+}
+
+std::shared_ptr<ThreadPool::Job> ThreadPool::take(WorkQueue *own, unsigned int &seed)
+{
+    std::shared_ptr<Job> job;
+    for (int b = 0; b < Bands; ++b) {
+        if (mPending[b].load(std::memory_order_relaxed) <= 0)
+            continue;
+        if (own) {
+            std::lock_guard<std::mutex> lock(own->mutex);
+            std::deque<std::shared_ptr<Job> > &jobs = own->jobs[b];
+            if (!jobs.empty()) {
+                job = std::move(jobs.back());
+                jobs.pop_back();
+            }
+        }
+        if (!job) {
+            // take a few at once so the injection queue isn't hit for
+            // every job, the rest can be stolen from us
+            std::lock_guard<std::mutex> lock(mInjectMutex);
+            std::deque<std::shared_ptr<Job> > &injected = mInjected[b];
+            if (!injected.empty()) {
+                job = std::move(injected.front());
+                injected.pop_front();
+                if (own && !injected.empty()) {
+                    const size_t count = std::min<size_t>(injected.size(), InjectBatch - 1);
+                    std::lock_guard<std::mutex> ownLock(own->mutex);
+                    // popped from the back, so oldest last
+                    for (size_t i = count; i > 0; --i)
+                        own->jobs[b].push_back(std::move(injected[i - 1]));
+                    injected.erase(injected.begin(), injected.begin() + count);
+                }
+            }
+        }
+        if (!job) {
+            const int queues = mQueueCount.load(std::memory_order_acquire);
+            if (queues) {
+                seed = seed * 1103515245 + 12345;
+                const int first = (seed >> 16) % queues;
+                for (int i = 0; i < queues && !job; ++i) {
+                    WorkQueue *victim = mQueues[(first + i) % queues].load(std::memory_order_relaxed);
+                    if (victim == own)
+                        continue;
+                    // someone else is at it, try the next one
+                    std::unique_lock<std::mutex> lock(victim->mutex, std::try_to_lock);
+                    if (!lock.owns_lock())
+                        continue;
+                    std::deque<std::shared_ptr<Job> > &jobs = victim->jobs[b];
+                    if (!jobs.empty()) {
+                        job = std::move(jobs.front());
+                        jobs.pop_front();
+                    }
+                }
+            }
+        }
+        if (job) {
+            --mPending[b];
+            return job;
+        }
+    }
+    return job;
+}
+
+bool ThreadPool::hasPending() const
+{
+    for (int i = 0; i < Bands; ++i) {
+        if (mPending[i].load() > 0)
+            return true;
+    }
+    return false;
+}
+
+void ThreadPool::clearQueues()
+{
+    {
+        std::lock_guard<std::mutex> lock(mInjectMutex);
+        for (int b = 0; b < Bands; ++b) {
+            mPending[b] -= static_cast<int>(mInjected[b].size());
+            mInjected[b].clear();
+        }
+    }
+    const int queues = mQueueCount.load(std::memory_order_acquire);
+    for (int i = 0; i < queues; ++i) {
+        WorkQueue *queue = mQueues[i].load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        for (int b = 0; b < Bands; ++b) {
+            mPending[b] -= static_cast<int>(queue->jobs[b].size());
+            queue->jobs[b].clear();
+        }
+    }
+}
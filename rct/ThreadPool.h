@@ -1,25 +1,148 @@
 #ifndef ThreadPool_h
 #define ThreadPool_h
 
+#include <atomic>
 #include <condition_variable>
 #include <deque>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
 
 #include <rct/List.h>
+#include <rct/String.h>
 #include <rct/Thread.h>
 
+class EventLoop;
 class ThreadPoolThread;
 
+// What Future waits on. Completing doesn't take the mutex unless someone
+// is waiting.
+class FutureStateBase
+{
+public:
+    FutureStateBase() : mReady(false), mWaiters(0) {}
+
+    bool isReady() const { return mReady.load(std::memory_order_acquire); }
+    void wait() const;
+    // false if it timed out
+    bool waitFor(int ms) const;
+
+protected:
+    void finish();
+
+private:
+    std::atomic<bool> mReady;
+    mutable std::atomic<int> mWaiters;
+    mutable std::mutex mMutex;
+    mutable std::condition_variable mCond;
+};
+
+template<typename T>
+class FutureState : public FutureStateBase
+{
+public:
+    ~FutureState()
+    {
+        if (isReady())
+            reinterpret_cast<T*>(&mStorage)->~T();
+    }
+
+    T &value() { return *reinterpret_cast<T*>(&mStorage); }
+
+    template<typename F>
+    void run(F &f)
+    {
+        new (&mStorage) T(f());
+        finish();
+    }
+
+private:
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type mStorage;
+};
+
+template<>
+class FutureState<void> : public FutureStateBase
+{
+public:
+    void value() {}
+
+    template<typename F>
+    void run(F &f)
+    {
+        f();
+        finish();
+    }
+};
+
+// The result of ThreadPool::submit(). Copies share the result.
+template<typename T>
+class Future
+{
+public:
+    Future() {}
+    explicit Future(const std::shared_ptr<FutureState<T> > &state) : mState(state) {}
+
+    bool isValid() const { return mState != nullptr; }
+    bool isReady() const { return mState->isReady(); }
+    void wait() const { mState->wait(); }
+    bool waitFor(int ms) const { return mState->waitFor(ms); }
+    // waits for the task, the result lives as long as a Future of it or
+    // the completion callback
+    typename std::add_lvalue_reference<T>::type get()
+    {
+        mState->wait();
+        return mState->value();
+    }
+
+private:
+    std::shared_ptr<FutureState<T> > mState;
+};
+
 class ThreadPool
 {
 public:
+    enum Scheduling {
+        // one queue in priority order that all threads take jobs from
+        SharedQueue,
+        // a queue per thread that idle threads steal from, jobs started
+        // from outside the pool go through a separate injection queue.
+        // Priorities are only kept apart in bands, above, at and below
+        // 0, and jobs started from a job may run before older ones of
+        // their band.
+        WorkStealing
+    };
+
     ThreadPool(int concurrentJobs,
                Thread::Priority priority = Thread::Normal,
-               size_t stackSize = 0);
+               size_t stackSize = 0,
+               Scheduling scheduling = SharedQueue);
     ~ThreadPool();
 
+    Scheduling scheduling() const { return mScheduling; }
+
+    enum Placement {
+        Unpinned,
+        // thread i runs on the i-th CPU the process may use
+        PinPerCore,
+        // threads go round robin over the NUMA nodes and may run on any
+        // CPU of theirs
+        PinPerNode
+    };
+    // applies to running threads too
+    void setPlacement(Placement placement);
+    Placement placement() const;
+
+    // the name of the threads, "ThreadPool" unless it's set, see
+    // Thread::setName(). Applies to running threads too.
+    void setName(const String &name);
+    String name() const;
+
     void setConcurrentJobs(int concurrentJobs);
+    int concurrentJobs() const { return mConcurrentJobs; }
     void clearBackLog();
     int backlogSize() const;
 
@@ -34,14 +157,27 @@ public:
             Running,
             Finished
         };
-        State state() const { std::lock_guard<std::mutex> lock(mMutex); return mState; }
+        State state() const { return mState.load(std::memory_order_acquire); }
+
+        // jobs with a name get their own timings in
+        // ThreadPool::Statistics::types
+        void setStatisticsName(const String &name) { mStatisticsName = name; }
+        const String &statisticsName() const { return mStatisticsName; }
     protected:
         virtual void run() = 0;
+        // held while a Guaranteed job runs
         std::mutex &mutex() const { return mMutex; }
 
     private:
         int mPriority;
-        State mState;
+        // where it is in a SharedQueue pool's mJobs
+        uint64_t mSequence;
+        // when it was started, in us, while the pool is instrumented
+        uint64_t mQueuedAt;
+        // from start() to run() while tracing
+        uint64_t mTraceFlow;
+        String mStatisticsName;
+        std::atomic<State> mState;
         mutable std::mutex mMutex;
 
         friend class ThreadPool;
@@ -51,29 +187,195 @@ public:
     enum { Guaranteed = -1 };
 
     void start(const std::shared_ptr<Job> &job, int priority = 0);
+    // Prefers a thread pinned to node, e.g. the one whose memory the job
+    // works on. Idle threads elsewhere may still steal it. Only
+    // WorkStealing pools with a placement have threads on a node,
+    // otherwise it's start().
+    void startOnNode(const std::shared_ptr<Job> &job, int node, int priority = 0);
+
+    // Runs f() on the pool without a Job subclass. The task, its result
+    // and the shared state are a single allocation.
+    template<typename F>
+    Future<typename std::result_of<typename std::decay<F>::type()>::type> submit(F &&f, int priority = 0)
+    {
+        typedef typename std::decay<F>::type Function;
+        typedef typename std::result_of<Function()>::type Result;
+        std::shared_ptr<FunctionJob<Function, Result> > job = std::make_shared<FunctionJob<Function, Result> >(std::forward<F>(f));
+        start(job, priority);
+        return Future<Result>(std::shared_ptr<FutureState<Result> >(job, job.get()));
+    }
+    // Also calls done with the result, or without arguments for void,
+    // from a posted event on loop
+    template<typename F, typename D>
+    Future<typename std::result_of<typename std::decay<F>::type()>::type> submit(F &&f, const std::shared_ptr<EventLoop> &loop,
+                                                                                D &&done, int priority = 0)
+    {
+        typedef typename std::decay<F>::type Function;
+        typedef typename std::result_of<Function()>::type Result;
+        std::shared_ptr<FunctionJob<Function, Result> > job = std::make_shared<FunctionJob<Function, Result> >(std::forward<F>(f));
+        job->mLoop = loop;
+        job->mDone = std::forward<D>(done);
+        start(job, priority);
+        return Future<Result>(std::shared_ptr<FutureState<Result> >(job, job.get()));
+    }
 
     bool remove(const std::shared_ptr<Job> &job);
 
+    // the CPUs the process may use, capped by a cgroup CPU quota
     static int idealThreadCount();
     static ThreadPool* instance();
 
     int busyThreads() const;
+
+    // Optional instrumentation. While enabled every job is timed from
+    // start() until a thread picks it up and from there until it
+    // returns. When disabled it costs a branch per job. Long waits with
+    // short runs and a high peak backlog call for more concurrent jobs,
+    // waits near zero for fewer.
+    struct Statistics
+    {
+        // bucket i counts jobs that took less than 2^i us, the last one
+        // everything slower
+        enum { BucketCount = 24 };
+        struct Histogram
+        {
+            uint64_t count, totalUs, maxUs;
+            uint64_t buckets[BucketCount];
+        };
+        struct Timing
+        {
+            Histogram wait, run;
+        };
+        Timing all;
+        // by Job::statisticsName(), with setPerTypeStatistics()
+        std::map<String, Timing> types;
+        uint64_t started, finished;
+        size_t peakBacklog;
+        // jobs that waited longer than the slow wait threshold
+        uint64_t slowWaits;
+    };
+    void setInstrumentationEnabled(bool enabled) { mInstrumentation.store(enabled, std::memory_order_relaxed); }
+    bool isInstrumentationEnabled() const { return mInstrumentation.load(std::memory_order_relaxed); }
+    void setPerTypeStatistics(bool enabled) { mPerType.store(enabled, std::memory_order_relaxed); }
+    // Called on the pool thread, before the job runs, when an
+    // instrumented job waited ms or longer. 0 disables it.
+    typedef std::function<void(const std::shared_ptr<Job> &job, uint64_t waitUs)> SlowWaitHandler;
+    void setSlowWaitHandler(int ms, SlowWaitHandler &&handler);
+    // safe to call from any thread, also exported by Metrics::instance()
+    // with the pool's name as a label
+    Statistics statistics() const;
+    void resetStatistics();
 private:
-    static bool jobLessThan(const std::shared_ptr<Job> &l, const std::shared_ptr<Job> &r);
+    template<typename T>
+    struct Completion
+    {
+        typedef std::function<void(const T &)> Callback;
+        static void call(const Callback &callback, FutureState<T> &state) { callback(state.value()); }
+    };
+
+    template<typename F, typename T>
+    class FunctionJob : public Job, public FutureState<T>,
+                        public std::enable_shared_from_this<FunctionJob<F, T> >
+    {
+    public:
+        explicit FunctionJob(F &&f) : mFunction(std::move(f)) {}
+        explicit FunctionJob(const F &f) : mFunction(f) {}
+
+        std::shared_ptr<EventLoop> mLoop;
+        typename Completion<T>::Callback mDone;
+
+    protected:
+        virtual void run() override
+        {
+            FutureState<T>::run(mFunction);
+            if (mLoop) {
+                std::shared_ptr<FunctionJob<F, T> > self = this->shared_from_this();
+                post(mLoop, [self]() { Completion<T>::call(self->mDone, *self); });
+            }
+        }
+
+    private:
+        F mFunction;
+    };
+    static void post(const std::shared_ptr<EventLoop> &loop, std::function<void()> &&func);
+
+    // SharedQueue orders jobs by priority, highest first, and in start()
+    // order within a priority
+    struct JobKey
+    {
+        int priority;
+        uint64_t sequence;
+
+        bool operator<(const JobKey &other) const
+        {
+            if (priority != other.priority)
+                return priority > other.priority;
+            return sequence < other.sequence;
+        }
+    };
+
+    // WorkStealing
+    enum { Bands = 3, MaxQueues = 1024, InjectBatch = 16 };
+    struct WorkQueue;
+    static int band(int priority) { return priority > 0 ? 0 : (priority == 0 ? 1 : 2); }
+    WorkQueue *attach();
+    void detach(WorkQueue *queue);
+    void push(const std::shared_ptr<Job> &job, WorkQueue *target = 0);
+    void place(ThreadPoolThread *thread, size_t index);
+    std::shared_ptr<Job> take(WorkQueue *own, unsigned int &seed);
+    bool hasPending() const;
+    void clearQueues();
+
+    void queued(const std::shared_ptr<Job> &job, size_t backlog);
+    void runJob(const std::shared_ptr<Job> &job);
+    void record(const std::shared_ptr<Job> &job, uint64_t waitUs, uint64_t runUs);
 
 private:
     int mConcurrentJobs;
+    // with WorkStealing it only guards the threads and idle ones sleeping
     mutable std::mutex mMutex;
     std::condition_variable mCond;
-    std::deque<std::shared_ptr<Job> > mJobs;
+    std::map<JobKey, std::shared_ptr<Job> > mJobs;
+    uint64_t mSequence;
     List<ThreadPoolThread*> mThreads;
-    int mBusyThreads;
+    std::atomic<int> mBusyThreads;
     const Thread::Priority mPriority;
     const size_t mThreadStackSize;
+    const Scheduling mScheduling;
+
+    // the queues of current and past threads, kept until the pool is
+    // destroyed so thieves never see one go away
+    std::unique_ptr<std::atomic<WorkQueue*>[]> mQueues;
+    std::atomic<int> mQueueCount;
+    std::vector<bool> mQueueUsed;
+    std::mutex mInjectMutex;
+    std::deque<std::shared_ptr<Job> > mInjected[Bands];
+    std::atomic<int> mPending[Bands];
+    std::atomic<int> mSleepers;
+
+    Placement mPlacement;
+    std::atomic<unsigned int> mNodeNext;
+    String mName;
+
+    std::atomic<bool> mInstrumentation, mPerType;
+    std::atomic<size_t> mPeakBacklog;
+    mutable std::mutex mStatisticsMutex;
+    Statistics mStatistics;
+    int mSlowWaitThreshold;
+    SlowWaitHandler mSlowWaitHandler;
+    // of Metrics::instance()
+    int mMetricsCollector;
 
     static ThreadPool* sInstance;
 
     friend class ThreadPoolThread;
 };
 
+template<>
+struct ThreadPool::Completion<void>
+{
+    typedef std::function<void()> Callback;
+    static void call(const Callback &callback, FutureState<void> &) { callback(); }
+};
+
 #endif
@@ -3,12 +3,12 @@
 #include "EventLoop.h"
 
 Timer::Timer()
-    : timerId(0)
+    : timerId(0), timerFlags(0)
 {
 }
 
 Timer::Timer(int interval, int flags)
-    : timerId(0)
+    : timerId(0), timerFlags(0)
 {
     restart(interval, flags);
 }
@@ -27,6 +27,7 @@ void Timer::restart(int interval, int flags, const std::shared_ptr<EventLoop> &l
             loop->unregisterTimer(timerId);
         timerId = loop->registerTimer(std::bind(&Timer::timerFired, this, std::placeholders::_1),
                                       interval, flags);
+        timerFlags = flags;
     }
 }
 
@@ -42,5 +43,8 @@ void Timer::stop()
 
 void Timer::timerFired(int /*id*/)
 {
+    // the event loop may hand out the id of a fired single shot timer again
+    if (timerFlags & SingleShot)
+        timerId = 0;
     signalTimeout(this);
 }
@@ -27,7 +27,7 @@ private:
     void timerFired(int id);
 
 private:
-    int timerId;
+    int timerId, timerFlags;
     Signal<std::function<void(Timer*)> > signalTimeout;
 };
 
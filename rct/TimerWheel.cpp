@@ -0,0 +1,260 @@
+#include "TimerWheel.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+TimerWheel::TimerWheel(uint64_t now)
+    : mTime(now), mCount(0), mFree(0)
+{
+    for (int i = 0; i < TotalSlots; ++i) {
+        mSlots[i] = 0;
+        mTails[i] = &mSlots[i];
+    }
+    memset(mOccupied, 0, sizeof(mOccupied));
+}
+
+TimerWheel::~TimerWheel()
+{
+}
+
+int TimerWheel::add(uint64_t when, unsigned int flags, uint64_t interval, std::function<void(int)> &&callback)
+{
+    if (!mFree) {
+        const uint32_t first = mChunks.size() * ChunkSize;
+        if (first + ChunkSize > IndexMask) {
+            fprintf(stderr, "Too many timers registered (%u)\n", first);
+            return 0;
+        }
+        Node *chunk = new Node[ChunkSize];
+        mChunks.push_back(std::unique_ptr<Node[]>(chunk));
+        for (int i = ChunkSize - 1; i >= 0; --i) {
+            Node *n = chunk + i;
+            n->index = first + i;
+            n->id = n->index + 1;
+            n->slot = NoSlot;
+            n->next = mFree;
+            mFree = n;
+        }
+    }
+    Node *n = mFree;
+    mFree = n->next;
+    n->when = when;
+    n->flags = flags;
+    n->interval = interval;
+    n->callback = std::move(callback);
+    insert(n);
+    ++mCount;
+    return n->id;
+}
+
+bool TimerWheel::remove(int id)
+{
+    const uint32_t index = static_cast<uint32_t>(id & IndexMask) - 1;
+    if (index >= mChunks.size() * ChunkSize)
+        return false;
+    Node *n = node(index);
+    if (n->id != id || n->slot == NoSlot)
+        return false;
+    unlink(n);
+    release(n);
+    return true;
+}
+
+void TimerWheel::readd(Node *n)
+{
+    assert(n->slot == NoSlot);
+    insert(n);
+}
+
+void TimerWheel::release(Node *n)
+{
+    assert(mCount);
+    n->callback = std::function<void(int)>();
+    // bump the generation so stale ids don't match
+    const int generation = ((n->id >> IndexBits) + 1) & GenerationMask;
+    n->id = (generation << IndexBits) | (n->index + 1);
+    n->slot = NoSlot;
+    n->next = mFree;
+    mFree = n;
+    --mCount;
+}
+
+void TimerWheel::advance(uint64_t now)
+{
+    if (!mCount) {
+        mTime = std::max(mTime, now);
+        return;
+    }
+    while (mTime < now) {
+        if (!((mTime + 1) & SlotMask)) {
+            // crossing into a new level 0 round
+            ++mTime;
+            cascade(mTime);
+            moveSlot(mTime & SlotMask, DueSlot);
+            continue;
+        }
+        const uint64_t limit = std::min<uint64_t>(now, mTime | SlotMask);
+        unsigned int from = (mTime + 1) & SlotMask;
+        const unsigned int to = limit & SlotMask;
+        int slot;
+        while (from <= to && (slot = findSlot(0, from, to)) != -1) {
+            moveSlot(slot, DueSlot);
+            from = slot + 1;
+        }
+        mTime = limit;
+    }
+    moveSlot(ExpiredSlot, DueSlot);
+}
+
+TimerWheel::Node *TimerWheel::takeDue()
+{
+    Node *n = mSlots[DueSlot];
+    if (n) {
+        unlink(n);
+        n->slot = NoSlot;
+    }
+    return n;
+}
+
+int TimerWheel::nextTimeout(uint64_t now) const
+{
+    if (!mCount)
+        return -1;
+    if (mSlots[ExpiredSlot] || mSlots[DueSlot])
+        return 0;
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < Levels; ++level) {
+        const unsigned int shift = level * Bits;
+        const unsigned int current = (mTime >> shift) & SlotMask;
+        int slot = current < SlotMask ? findSlot(level, current + 1, SlotMask) : -1;
+        if (slot == -1)
+            slot = findSlot(level, 0, current);
+        if (slot == -1)
+            continue;
+        unsigned int distance = (slot - current) & SlotMask;
+        if (!distance)
+            distance = SlotCount;
+        // level 0 slots fire at that time, higher levels cascade at the
+        // start of the slot which is never later than the timers in it
+        next = std::min(next, ((mTime >> shift) + distance) << shift);
+    }
+    if (next == UINT64_MAX)
+        return -1;
+    if (next <= now)
+        return 0;
+    return static_cast<int>(std::min<uint64_t>(next - now, INT_MAX));
+}
+
+void TimerWheel::clear()
+{
+    for (int i = 0; i < TotalSlots; ++i) {
+        mSlots[i] = 0;
+        mTails[i] = &mSlots[i];
+    }
+    memset(mOccupied, 0, sizeof(mOccupied));
+    mChunks.clear();
+    mFree = 0;
+    mCount = 0;
+}
+
+void TimerWheel::insert(Node *n)
+{
+    if (n->when <= mTime) {
+        link(n, ExpiredSlot);
+        return;
+    }
+    const uint64_t delta = n->when - mTime;
+    for (int level = 0; level < Levels; ++level) {
+        const unsigned int shift = level * Bits;
+        if (delta < (1ULL << (shift + Bits))) {
+            link(n, level * SlotCount + ((n->when >> shift) & SlotMask));
+            return;
+        }
+    }
+    // further out than the wheel covers, park it in the last slot of the
+    // top level and let it cascade back in
+    const unsigned int shift = (Levels - 1) * Bits;
+    link(n, (Levels - 1) * SlotCount + (((mTime >> shift) - 1) & SlotMask));
+}
+
+void TimerWheel::link(Node *n, unsigned int slot)
+{
+    n->next = 0;
+    n->prev = mTails[slot];
+    *mTails[slot] = n;
+    mTails[slot] = &n->next;
+    n->slot = slot;
+    if (slot < ExpiredSlot)
+        mOccupied[slot / SlotCount][(slot & SlotMask) / 64] |= (1ULL << (slot % 64));
+}
+
+void TimerWheel::unlink(Node *n)
+{
+    const unsigned int slot = n->slot;
+    assert(slot < TotalSlots);
+    *n->prev = n->next;
+    if (n->next) {
+        n->next->prev = n->prev;
+    } else {
+        mTails[slot] = n->prev;
+    }
+    if (slot < ExpiredSlot && !mSlots[slot])
+        mOccupied[slot / SlotCount][(slot & SlotMask) / 64] &= ~(1ULL << (slot % 64));
+}
+
+void TimerWheel::moveSlot(unsigned int from, unsigned int to)
+{
+    Node *head = mSlots[from];
+    if (!head)
+        return;
+    *mTails[to] = head;
+    head->prev = mTails[to];
+    mTails[to] = mTails[from];
+    for (Node *n = head; n; n = n->next)
+        n->slot = to;
+    mSlots[from] = 0;
+    mTails[from] = &mSlots[from];
+    if (from < ExpiredSlot)
+        mOccupied[from / SlotCount][(from & SlotMask) / 64] &= ~(1ULL << (from % 64));
+}
+
+void TimerWheel::cascade(uint64_t time)
+{
+    for (int level = 1; level < Levels; ++level) {
+        const unsigned int index = (time >> (level * Bits)) & SlotMask;
+        const unsigned int slot = level * SlotCount + index;
+        Node *n = mSlots[slot];
+        if (n) {
+            mSlots[slot] = 0;
+            mTails[slot] = &mSlots[slot];
+            mOccupied[level][index / 64] &= ~(1ULL << (index % 64));
+            while (n) {
+                Node *next = n->next;
+                insert(n);
+                n = next;
+            }
+        }
+        if (index)
+            break;
+    }
+}
+
+int TimerWheel::findSlot(unsigned int level, unsigned int from, unsigned int to) const
+{
+    assert(from <= to && to < SlotCount);
+    const uint64_t *words = mOccupied[level];
+    unsigned int word = from / 64;
+    uint64_t bits = words[word] & (~0ULL << (from % 64));
+    for (;;) {
+        if (bits) {
+            const unsigned int slot = word * 64 + __builtin_ctzll(bits);
+            return slot <= to ? static_cast<int>(slot) : -1;
+        }
+        if (++word > to / 64)
+            return -1;
+        bits = words[word];
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <functional>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+// Hierarchical timer wheel used by EventLoop when initialized with
+// EventLoop::EnableTimerWheel. Four levels of 256 slots with a
+// resolution of one tick, a millisecond or a microsecond with
+// EventLoop::EnableHighResTimers. Insert and remove are O(1), nodes come
+// from a pool and timer ids encode the pool index so no lookup table is
+// needed. Not thread safe, EventLoop does the locking.
+class TimerWheel
+{
+public:
+    TimerWheel(uint64_t now);
+    ~TimerWheel();
+
+    struct Node
+    {
+        uint64_t when;
+        int id;
+        unsigned int flags;
+        uint64_t interval;
+        std::function<void(int)> callback;
+
+    private:
+        Node *next, **prev;
+        uint32_t index;
+        uint16_t slot;
+
+        friend class TimerWheel;
+    };
+
+    int add(uint64_t when, unsigned int flags, uint64_t interval, std::function<void(int)> &&callback);
+    bool remove(int id);
+    // reschedules a node returned by takeDue()
+    void readd(Node *node);
+    // releases a node returned by takeDue()
+    void release(Node *node);
+
+    // moves all timers that expire at or before now to the due list
+    void advance(uint64_t now);
+    Node *takeDue();
+
+    // ticks until the wheel needs to be advanced, -1 for never
+    int nextTimeout(uint64_t now) const;
+
+    size_t size() const { return mCount; }
+    void clear();
+
+private:
+    enum {
+        Bits = 8,
+        SlotCount = 1 << Bits,
+        SlotMask = SlotCount - 1,
+        Levels = 4,
+        ExpiredSlot = Levels * SlotCount,
+        DueSlot = ExpiredSlot + 1,
+        TotalSlots = DueSlot + 1,
+        NoSlot = 0xffff,
+        IndexBits = 20,
+        IndexMask = (1 << IndexBits) - 1,
+        GenerationMask = (1 << (31 - IndexBits)) - 1,
+        ChunkBits = 8,
+        ChunkSize = 1 << ChunkBits
+    };
+
+    Node *node(uint32_t index) const { return mChunks[index >> ChunkBits].get() + (index & (ChunkSize - 1)); }
+    void insert(Node *node);
+    void link(Node *node, unsigned int slot);
+    void unlink(Node *node);
+    void moveSlot(unsigned int from, unsigned int to);
+    void cascade(uint64_t time);
+    int findSlot(unsigned int level, unsigned int from, unsigned int to) const;
+
+    uint64_t mTime;
+    size_t mCount;
+    Node *mSlots[TotalSlots];
+    Node **mTails[TotalSlots];
+    uint64_t mOccupied[Levels][SlotCount / 64];
+    std::vector<std::unique_ptr<Node[]> > mChunks;
+    Node *mFree;
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+};
+
+#endif
@@ -0,0 +1,221 @@
+#include "Trace.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "JSONWriter.h"
+
+struct TraceRecord
+{
+    const char *category, *name;
+    uint64_t start, duration;
+    // a slice the flow ends in, or where it starts if there's no name
+    uint64_t flow;
+};
+
+// written by its thread, read by write()
+struct TraceBuffer
+{
+    TraceBuffer()
+        : next(0), count(0), generation(0), tid(0)
+    {}
+    std::mutex mutex;
+    // the last records.size() records, oldest at next once it's full
+    std::vector<TraceRecord> records;
+    size_t next, count;
+    // of the start() the records are from
+    unsigned int generation;
+    int tid;
+    String name;
+};
+
+std::atomic<bool> Trace::sEnabled(false);
+static std::mutex sBuffersMutex;
+static std::vector<std::shared_ptr<TraceBuffer> > sBuffers;
+static int sNextTid = 1;
+static std::atomic<size_t> sCapacity(0);
+static std::atomic<unsigned int> sGeneration(0);
+static std::atomic<uint64_t> sStarted(0);
+static std::atomic<uint64_t> sNextFlow(1);
+// kept in sBuffers after the thread is gone so what it did is still there
+static thread_local std::shared_ptr<TraceBuffer> tBuffer;
+
+static TraceBuffer *buffer()
+{
+    if (!tBuffer) {
+        tBuffer = std::make_shared<TraceBuffer>();
+        std::lock_guard<std::mutex> lock(sBuffersMutex);
+        tBuffer->tid = sNextTid++;
+        sBuffers.push_back(tBuffer);
+    }
+    return tBuffer.get();
+}
+
+static void add(const TraceRecord &record)
+{
+    TraceBuffer *b = buffer();
+    std::lock_guard<std::mutex> lock(b->mutex);
+    const unsigned int generation = sGeneration.load(std::memory_order_acquire);
+    if (b->generation != generation) {
+        b->generation = generation;
+        b->records.assign(sCapacity.load(std::memory_order_relaxed), TraceRecord());
+        b->next = b->count = 0;
+    }
+    const size_t size = b->records.size();
+    if (!size)
+        return;
+    b->records[b->next] = record;
+    if (++b->next == size)
+        b->next = 0;
+    if (b->count < size)
+        ++b->count;
+}
+
+void Trace::start(size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(sBuffersMutex);
+    // the buffers of threads that are gone are dropped now
+    for (size_t i = 0; i < sBuffers.size(); ) {
+        if (sBuffers[i].use_count() == 1) {
+            sBuffers.erase(sBuffers.begin() + i);
+        } else {
+            ++i;
+        }
+    }
+    sCapacity.store(capacity, std::memory_order_relaxed);
+    sStarted.store(now(), std::memory_order_relaxed);
+    sGeneration.fetch_add(1, std::memory_order_release);
+    sEnabled.store(true);
+}
+
+void Trace::stop()
+{
+    sEnabled.store(false);
+}
+
+uint64_t Trace::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::complete(const char *category, const char *name, uint64_t start, uint64_t flow)
+{
+    if (!isEnabled())
+        return;
+    const TraceRecord record = { category, name, start, now() - start, flow };
+    add(record);
+}
+
+uint64_t Trace::flowStart()
+{
+    if (!isEnabled())
+        return 0;
+    const uint64_t flow = sNextFlow.fetch_add(1, std::memory_order_relaxed);
+    const TraceRecord record = { 0, 0, now(), 0, flow };
+    add(record);
+    return flow;
+}
+
+void Trace::setThreadName(const String &name)
+{
+    TraceBuffer *b = buffer();
+    std::lock_guard<std::mutex> lock(b->mutex);
+    b->name = name;
+}
+
+void Trace::write(JSONWriter &writer)
+{
+    std::vector<std::shared_ptr<TraceBuffer> > buffers;
+    {
+        std::lock_guard<std::mutex> lock(sBuffersMutex);
+        buffers = sBuffers;
+    }
+    const unsigned int generation = sGeneration.load(std::memory_order_acquire);
+    const uint64_t started = sStarted.load(std::memory_order_relaxed);
+    const int pid = getpid();
+    // us since start()
+    auto timestamp = [started](uint64_t time) {
+        return time > started ? (time - started) / 1000.0 : 0.0;
+    };
+    auto flowEvent = [&](const char *phase, uint64_t flow, uint64_t time, int tid) {
+        writer.beginObject();
+        writer.key("name").value("flow");
+        writer.key("cat").value("flow");
+        writer.key("ph").value(phase);
+        writer.key("id").value(static_cast<unsigned long long>(flow));
+        writer.key("ts").value(timestamp(time));
+        writer.key("pid").value(pid);
+        writer.key("tid").value(tid);
+        // the slice it's in rather than the next one
+        if (*phase == 'f')
+            writer.key("bp").value("e");
+        writer.endObject();
+    };
+
+    writer.beginObject();
+    writer.key("traceEvents").beginArray();
+    std::vector<TraceRecord> records;
+    for (const auto &buffer : buffers) {
+        String name;
+        int tid;
+        {
+            // copied so the thread isn't held up while this is written
+            std::lock_guard<std::mutex> lock(buffer->mutex);
+            if (buffer->generation != generation || !buffer->count)
+                continue;
+            const size_t size = buffer->records.size();
+            const size_t first = (buffer->next + size - buffer->count) % size;
+            records.clear();
+            for (size_t i = 0; i < buffer->count; ++i)
+                records.push_back(buffer->records[(first + i) % size]);
+            name = buffer->name;
+            tid = buffer->tid;
+        }
+        if (!name.isEmpty()) {
+            writer.beginObject();
+            writer.key("name").value("thread_name");
+            writer.key("ph").value("M");
+            writer.key("pid").value(pid);
+            writer.key("tid").value(tid);
+            writer.key("args").beginObject().key("name").value(name).endObject();
+            writer.endObject();
+        }
+        for (const TraceRecord &record : records) {
+            if (!record.name) {
+                flowEvent("s", record.flow, record.start, tid);
+                continue;
+            }
+            writer.beginObject();
+            writer.key("name").value(record.name);
+            writer.key("cat").value(record.category);
+            writer.key("ph").value("X");
+            writer.key("ts").value(timestamp(record.start));
+            writer.key("dur").value(record.duration / 1000.0);
+            writer.key("pid").value(pid);
+            writer.key("tid").value(tid);
+            writer.endObject();
+            if (record.flow)
+                flowEvent("f", record.flow, record.start, tid);
+        }
+    }
+    writer.endArray();
+    writer.endObject();
+}
+
+bool Trace::save(const Path &path)
+{
+    FILE *f = fopen(path.constData(), "w");
+    if (!f)
+        return false;
+    bool ok;
+    {
+        JSONWriter writer(f);
+        write(writer);
+        ok = writer.flush() && !writer.hasError();
+    }
+    return !fclose(f) && ok;
+}
@@ -0,0 +1,91 @@
+#ifndef Trace_h
+#define Trace_h
+
+#include <stdint.h>
+#include <atomic>
+
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <rct/rct-config.h>
+
+class JSONWriter;
+
+// Records where threads spend their time while it's started, to be looked
+// at in chrome://tracing or ui.perfetto.dev:
+//
+//     Trace::start();
+//     ...
+//     Trace::save("/tmp/trace.json");
+//
+// Slices come from scopes with RCT_TRACE_SCOPE(category, name). A flow
+// connects the slice that posts work somewhere, RCT_TRACE_FLOW_START(),
+// to the slice that runs it, RCT_TRACE_FLOW_SCOPE(), like EventLoop does
+// for posted events and ThreadPool for jobs. Every thread writes to a
+// buffer of its own that keeps its last capacity slices, so tracing a
+// long run keeps what happened last.
+//
+// Categories and names aren't copied, they have to be literals. The
+// macros compile to nothing without RCT_TRACE and cost a load and a
+// branch while not started.
+class Trace
+{
+public:
+    static void start(size_t capacity = 65536);
+    static void stop();
+    static bool isEnabled() { return sEnabled.load(std::memory_order_relaxed); }
+
+    // what's been recorded since start(), in the Chrome trace event
+    // format that Perfetto reads too
+    static void write(JSONWriter &writer);
+    static bool save(const Path &path);
+
+    // names the calling thread in the trace
+    static void setThreadName(const String &name);
+
+    // ns, monotonic
+    static uint64_t now();
+    // records a slice that started at start
+    static void complete(const char *category, const char *name, uint64_t start, uint64_t flow = 0);
+    // starts a flow from the current slice, 0 when not enabled
+    static uint64_t flowStart();
+
+private:
+    static std::atomic<bool> sEnabled;
+};
+
+class TraceScope
+{
+public:
+    // flow ends in this slice if it's not 0
+    TraceScope(const char *category, const char *name, uint64_t flow = 0)
+        : mCategory(category), mName(name), mFlow(flow), mStart(Trace::isEnabled() ? Trace::now() : 0)
+    {}
+    ~TraceScope()
+    {
+        if (mStart)
+            Trace::complete(mCategory, mName, mStart, mFlow);
+    }
+
+private:
+    const char *mCategory, *mName;
+    const uint64_t mFlow, mStart;
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+};
+
+#define RCT_TRACE_CONCAT_(a, b) a##b
+#define RCT_TRACE_CONCAT(a, b) RCT_TRACE_CONCAT_(a, b)
+#ifdef RCT_TRACE
+#define RCT_TRACE_SCOPE(category, name)                                 \
+    TraceScope RCT_TRACE_CONCAT(rctTraceScope, __LINE__)(category, name)
+#define RCT_TRACE_FLOW_SCOPE(category, name, flow)                      \
+    TraceScope RCT_TRACE_CONCAT(rctTraceScope, __LINE__)(category, name, flow)
+#define RCT_TRACE_FLOW_START() Trace::flowStart()
+#else
+#define RCT_TRACE_SCOPE(category, name)
+#define RCT_TRACE_FLOW_SCOPE(category, name, flow) (void)(flow)
+#define RCT_TRACE_FLOW_START() static_cast<uint64_t>(0)
+#endif
+
+#endif
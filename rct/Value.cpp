@@ -1,18 +1,28 @@
 #include "Value.h"
 
-#include "../cJSON/cJSON.h"
+#include <limits.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <condition_variable>
+#include <mutex>
+
+#include "Allocations.h"
+#include "JSONWriter.h"
+#include "ThreadPool.h"
 
 void Value::clear()
 {
     switch (mType) {
     case Type_String:
-        stringPtr()->~String();
+        deref(mData.string);
         break;
     case Type_Map:
-        mapPtr()->~Map<String, Value>();
+        deref(mData.map);
         break;
     case Type_List:
-        listPtr()->~List<Value>();
+        deref(mData.list);
         break;
     case Type_Custom:
         customPtr()->~shared_ptr<Custom>();
@@ -26,17 +36,18 @@ void Value::clear()
 
 void Value::copy(const Value &other)
 {
+    RCT_ALLOCATION_SCOPE(Allocations::ValueSubsystem);
     assert(isNull());
     mType = other.mType;
     switch (mType) {
     case Type_String:
-        new (mData.stringBuf) String(*other.stringPtr());
+        mData.string = share(other.mData.string);
         break;
     case Type_Map:
-        new (mData.mapBuf) Map<String, Value>(*other.mapPtr());
+        mData.map = share(other.mData.map);
         break;
     case Type_List:
-        new (mData.listBuf) List<Value>(*other.listPtr());
+        mData.list = share(other.mData.list);
         break;
     case Type_Custom:
         new (mData.customBuf) std::shared_ptr<Custom>(*other.customPtr());
@@ -47,86 +58,678 @@ void Value::copy(const Value &other)
     }
 }
 
-static Value fromCJSON(const cJSON *object)
+void Value::move(Value &other)
 {
-    assert(object);
-    switch (object->type) {
-    case cJSON_False:
-        return Value(false);
-    case cJSON_True:
-        return Value(true);
-    case cJSON_NULL:
-        break;
-    case cJSON_Number:
-        if (object->valueint == object->valuedouble)
-            return Value(object->valueint);
-        return Value(object->valuedouble);
-    case cJSON_String:
-        return Value(String(object->valuestring));
-    case cJSON_Array: {
-        List<Value> values;
-        for (const cJSON *child = object->child; child; child = child->next) {
-            values.append(fromCJSON(child));
-        }
-        return values; }
-    case cJSON_Object: {
-        Map<String, Value> values;
-        for (const cJSON *child = object->child; child; child = child->next)
-            values[child->string] = fromCJSON(child);
-        return values; }
+    assert(isNull());
+    if (other.mType == Type_Custom) {
+        mType = Type_Custom;
+        new (mData.customBuf) std::shared_ptr<Custom>(std::move(*other.customPtr()));
+        other.clear();
+        return;
     }
-    return Value();
+    // the rest is plain data or pointers to shared storage
+    mType = other.mType;
+    memcpy(&mData, &other.mData, sizeof(mData));
+    other.mType = Type_Invalid;
 }
 
-Value Value::fromJSON(const char *json, bool *ok)
+// Builds the Values straight from the text in one pass. Elements of
+// arrays are collected on a stack shared by all levels and moved into
+// a List of the right size once the array ends, strings without escapes
+// are copied once.
+class JSONParser
 {
-    cJSON *obj = cJSON_Parse(json);
-    if (!obj) {
-        if (ok)
-            *ok = false;
-        return Value();
+public:
+    JSONParser(const char *json, size_t size)
+        : mBegin(json), mPos(json), mEnd(json + size), mDepth(0), mError(0), mErrorPos(0)
+    {}
+    // [pos, end) of the document starting at begin, in the top level array
+    JSONParser(const char *begin, const char *pos, const char *end)
+        : mBegin(begin), mPos(pos), mEnd(end), mDepth(1), mError(0), mErrorPos(0)
+    {}
+
+    bool parse(Value &value)
+    {
+        skipWhitespace();
+        if (!parseValue(value))
+            return false;
+        skipWhitespace();
+        if (mPos != mEnd)
+            return fail("Unexpected trailing characters");
+        return true;
+    }
+
+    // the elements of a top level array in [pos, end), up to a ',' or
+    // ']' the caller found
+    bool parseElements(List<Value> &out)
+    {
+        skipWhitespace();
+        while (true) {
+            Value element;
+            if (!parseValue(element))
+                return false;
+            out.append(std::move(element));
+            skipWhitespace();
+            if (mPos == mEnd)
+                return true;
+            if (*mPos != ',')
+                return fail("Expected ',' or ']'");
+            ++mPos;
+            skipWhitespace();
+        }
+    }
+
+    String error() const
+    {
+        if (!mError)
+            return String();
+        int line = 1;
+        const char *lineStart = mBegin;
+        for (const char *ch = mBegin; ch < mErrorPos; ++ch) {
+            if (*ch == '\n') {
+                ++line;
+                lineStart = ch + 1;
+            }
+        }
+        return String::format<128>("%s at line %d, column %d", mError,
+                                   line, static_cast<int>(mErrorPos - lineStart) + 1);
+    }
+
+private:
+    enum { MaxDepth = 1024 };
+
+    bool fail(const char *error)
+    {
+        mError = error;
+        mErrorPos = mPos;
+        return false;
+    }
+
+    static bool isWhitespace(char ch)
+    {
+        return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t';
+    }
+
+    void skipWhitespace()
+    {
+        if (mPos == mEnd || !isWhitespace(*mPos))
+            return;
+        ++mPos;
+#if defined(__SSE2__)
+        // indentation in pretty printed files comes in long runs
+        while (mEnd - mPos >= 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mPos));
+            const __m128i space = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                                            _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+                                               _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+                                                            _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))));
+            const unsigned int mask = ~_mm_movemask_epi8(space) & 0xffff;
+            if (mask) {
+                mPos += __builtin_ctz(mask);
+                return;
+            }
+            mPos += 16;
+        }
+#endif
+        while (mPos != mEnd && isWhitespace(*mPos))
+            ++mPos;
+    }
+
+    // the next '"' or '\\' from mPos, or mEnd
+    const char *findStringSpecial() const
+    {
+        const char *ch = mPos;
+#if defined(__SSE2__)
+        while (mEnd - ch >= 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ch));
+            const int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                                            _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+            if (mask)
+                return ch + __builtin_ctz(mask);
+            ch += 16;
+        }
+#endif
+        while (ch != mEnd && *ch != '"' && *ch != '\\')
+            ++ch;
+        return ch;
+    }
+
+    bool consume(const char *literal, size_t len)
+    {
+        if (static_cast<size_t>(mEnd - mPos) < len || memcmp(mPos, literal, len))
+            return fail("Invalid literal");
+        mPos += len;
+        return true;
+    }
+
+    bool parseValue(Value &value)
+    {
+        if (mPos == mEnd)
+            return fail("Unexpected end of input");
+        switch (*mPos) {
+        case '{':
+            return parseObject(value);
+        case '[':
+            return parseArray(value);
+        case '"': {
+            String string;
+            if (!parseString(string))
+                return false;
+            value = Value(std::move(string));
+            return true; }
+        case 't':
+            if (!consume("true", 4))
+                return false;
+            value = Value(true);
+            return true;
+        case 'f':
+            if (!consume("false", 5))
+                return false;
+            value = Value(false);
+            return true;
+        case 'n':
+            if (!consume("null", 4))
+                return false;
+            value.clear();
+            return true;
+        case '-': case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            return parseNumber(value);
+        }
+        return fail("Unexpected character");
+    }
+
+    bool parseObject(Value &value)
+    {
+        if (++mDepth > MaxDepth)
+            return fail("Too deeply nested");
+        ++mPos;
+        Map<String, Value> map;
+        skipWhitespace();
+        if (mPos != mEnd && *mPos == '}') {
+            ++mPos;
+        } else {
+            while (true) {
+                if (mPos == mEnd || *mPos != '"')
+                    return fail("Expected string");
+                String key;
+                if (!parseString(key))
+                    return false;
+                skipWhitespace();
+                if (mPos == mEnd || *mPos != ':')
+                    return fail("Expected ':'");
+                ++mPos;
+                skipWhitespace();
+                // keys usually come sorted or close to it, the last one wins
+                auto it = map.emplace_hint(map.end(), std::move(key), Value());
+                if (!parseValue(it->second))
+                    return false;
+                skipWhitespace();
+                if (mPos != mEnd && *mPos == ',') {
+                    ++mPos;
+                    skipWhitespace();
+                    continue;
+                }
+                if (mPos != mEnd && *mPos == '}') {
+                    ++mPos;
+                    break;
+                }
+                return fail("Expected ',' or '}'");
+            }
+        }
+        value = Value(std::move(map));
+        --mDepth;
+        return true;
+    }
+
+    bool parseArray(Value &value)
+    {
+        if (++mDepth > MaxDepth)
+            return fail("Too deeply nested");
+        ++mPos;
+        const size_t start = mStack.size();
+        skipWhitespace();
+        if (mPos != mEnd && *mPos == ']') {
+            ++mPos;
+        } else {
+            while (true) {
+                Value element;
+                if (!parseValue(element))
+                    return false;
+                mStack.append(std::move(element));
+                skipWhitespace();
+                if (mPos != mEnd && *mPos == ',') {
+                    ++mPos;
+                    skipWhitespace();
+                    continue;
+                }
+                if (mPos != mEnd && *mPos == ']') {
+                    ++mPos;
+                    break;
+                }
+                return fail("Expected ',' or ']'");
+            }
+        }
+        List<Value> list;
+        list.reserve(mStack.size() - start);
+        for (size_t i = start; i < mStack.size(); ++i)
+            list.append(std::move(mStack[i]));
+        mStack.resize(start);
+        value = Value(std::move(list));
+        --mDepth;
+        return true;
+    }
+
+    static int hexValue(char ch)
+    {
+        if (ch >= '0' && ch <= '9')
+            return ch - '0';
+        if (ch >= 'a' && ch <= 'f')
+            return ch - 'a' + 10;
+        if (ch >= 'A' && ch <= 'F')
+            return ch - 'A' + 10;
+        return -1;
+    }
+
+    // the four hex digits after "\u" at mPos
+    bool parseHex4(unsigned int &code)
+    {
+        if (mEnd - mPos < 6 || mPos[1] != 'u')
+            return fail("Invalid \\u escape");
+        code = 0;
+        for (int i = 2; i < 6; ++i) {
+            const int digit = hexValue(mPos[i]);
+            if (digit == -1)
+                return fail("Invalid \\u escape");
+            code = (code << 4) | digit;
+        }
+        mPos += 6;
+        return true;
     }
 
-    const Value ret = ::fromCJSON(obj);
+    static void appendUtf8(String &out, unsigned int code)
+    {
+        char buf[4];
+        int len;
+        if (code < 0x80) {
+            buf[0] = static_cast<char>(code);
+            len = 1;
+        } else if (code < 0x800) {
+            buf[0] = static_cast<char>(0xc0 | (code >> 6));
+            buf[1] = static_cast<char>(0x80 | (code & 0x3f));
+            len = 2;
+        } else if (code < 0x10000) {
+            buf[0] = static_cast<char>(0xe0 | (code >> 12));
+            buf[1] = static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            buf[2] = static_cast<char>(0x80 | (code & 0x3f));
+            len = 3;
+        } else {
+            buf[0] = static_cast<char>(0xf0 | (code >> 18));
+            buf[1] = static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+            buf[2] = static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            buf[3] = static_cast<char>(0x80 | (code & 0x3f));
+            len = 4;
+        }
+        out.append(buf, len);
+    }
+
+    bool parseEscape(String &out)
+    {
+        if (mEnd - mPos < 2)
+            return fail("Unterminated string");
+        char ch;
+        switch (mPos[1]) {
+        case '"': ch = '"'; break;
+        case '\\': ch = '\\'; break;
+        case '/': ch = '/'; break;
+        case 'b': ch = '\b'; break;
+        case 'f': ch = '\f'; break;
+        case 'n': ch = '\n'; break;
+        case 'r': ch = '\r'; break;
+        case 't': ch = '\t'; break;
+        case 'u': {
+            unsigned int code;
+            if (!parseHex4(code))
+                return false;
+            if (code >= 0xdc00 && code <= 0xdfff)
+                return fail("Invalid surrogate pair");
+            if (code >= 0xd800 && code <= 0xdbff) {
+                unsigned int low;
+                if (mPos == mEnd || *mPos != '\\' || !parseHex4(low) || low < 0xdc00 || low > 0xdfff)
+                    return fail("Invalid surrogate pair");
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+            }
+            appendUtf8(out, code);
+            return true; }
+        default:
+            return fail("Invalid escape");
+        }
+        out.append(ch);
+        mPos += 2;
+        return true;
+    }
+
+    bool parseString(String &out)
+    {
+        ++mPos;
+        const char *special = findStringSpecial();
+        if (special != mEnd && *special == '"') {
+            out.assign(mPos, special - mPos);
+            mPos = special + 1;
+            return true;
+        }
+        while (true) {
+            if (special == mEnd) {
+                mPos = mEnd;
+                return fail("Unterminated string");
+            }
+            out.append(mPos, special - mPos);
+            mPos = special;
+            if (*special == '"') {
+                ++mPos;
+                return true;
+            }
+            if (!parseEscape(out))
+                return false;
+            special = findStringSpecial();
+        }
+    }
+
+    static bool isDigit(char ch)
+    {
+        return ch >= '0' && ch <= '9';
+    }
+
+    bool parseNumber(Value &value)
+    {
+        const char *start = mPos;
+        const bool negative = *mPos == '-';
+        if (negative)
+            ++mPos;
+        if (mPos == mEnd || !isDigit(*mPos))
+            return fail("Invalid number");
+        unsigned long long integer = 0;
+        int digits = 0;
+        if (*mPos == '0') {
+            ++mPos;
+        } else {
+            while (mPos != mEnd && isDigit(*mPos)) {
+                integer = integer * 10 + (*mPos++ - '0');
+                ++digits;
+            }
+        }
+        bool isInteger = true;
+        if (mPos != mEnd && *mPos == '.') {
+            ++mPos;
+            if (mPos == mEnd || !isDigit(*mPos))
+                return fail("Invalid number");
+            while (mPos != mEnd && isDigit(*mPos))
+                ++mPos;
+            isInteger = false;
+        }
+        if (mPos != mEnd && (*mPos == 'e' || *mPos == 'E')) {
+            ++mPos;
+            if (mPos != mEnd && (*mPos == '+' || *mPos == '-'))
+                ++mPos;
+            if (mPos == mEnd || !isDigit(*mPos))
+                return fail("Invalid number");
+            while (mPos != mEnd && isDigit(*mPos))
+                ++mPos;
+            isInteger = false;
+        }
+
+        // numbers that are whole and fit in an int are integers, the
+        // rest are doubles, same as what cJSON gave us
+        if (isInteger && digits <= 10) {
+            const long long signedInteger = negative ? -static_cast<long long>(integer) : integer;
+            if (signedInteger >= INT_MIN && signedInteger <= INT_MAX) {
+                value = Value(static_cast<int>(signedInteger));
+                return true;
+            }
+        }
+        // the text isn't necessarily terminated right after the number
+        char buf[64];
+        String copy;
+        const size_t len = mPos - start;
+        const char *number;
+        if (len < sizeof(buf)) {
+            memcpy(buf, start, len);
+            buf[len] = '\0';
+            number = buf;
+        } else {
+            copy.assign(start, len);
+            number = copy.constData();
+        }
+        const double dbl = strtod(number, 0);
+        if (dbl >= INT_MIN && dbl <= INT_MAX && dbl == static_cast<int>(dbl)) {
+            value = Value(static_cast<int>(dbl));
+        } else {
+            value = Value(dbl);
+        }
+        return true;
+    }
+
+    const char *mBegin, *mPos, *mEnd;
+    int mDepth;
+    const char *mError;
+    const char *mErrorPos;
+    List<Value> mStack;
+};
+
+static Value parseJSON(const char *json, size_t size, bool *ok, String *error)
+{
+    JSONParser parser(json, size);
+    Value ret;
+    const bool parsed = parser.parse(ret);
+    if (!parsed)
+        ret.clear();
     if (ok)
-        *ok = true;
-    cJSON_Delete(obj);
+        *ok = parsed;
+    if (error)
+        *error = parser.error();
     return ret;
 }
 
-cJSON *Value::toCJSON(const Value &value)
+// Runs work(0) to work(count - 1) on the calling thread and pool's. The
+// caller takes chunks too and doesn't wait for helpers that haven't
+// started, so it's safe from one of pool's own jobs.
+static void runChunks(ThreadPool *pool, size_t count, const std::function<void(size_t)> &work)
 {
-    switch (value.type()) {
-    case Value::Type_Boolean: return value.toBool() ? cJSON_CreateTrue() : cJSON_CreateFalse();
-    case Value::Type_Date:
-    case Value::Type_Integer: return cJSON_CreateNumber(value.toInteger());
-    case Value::Type_Double: return cJSON_CreateNumber(value.toDouble());
-    case Value::Type_String: return cJSON_CreateString(value.toString().constData());
-    case Value::Type_List: {
-        cJSON *array = cJSON_CreateArray();
-        for (const auto &v : *value.listPtr())
-            cJSON_AddItemToArray(array, toCJSON(v));
-        return array; }
-    case Value::Type_Map: {
-        cJSON *object = cJSON_CreateObject();
-        for (const auto &v : *value.mapPtr())
-            cJSON_AddItemToObject(object, v.first.constData(), v.second.toCJSON(v.second));
-        return object; }
-    case Value::Type_Invalid:
-        break;
-    case Value::Type_Undefined:
-        break;
-    case Value::Type_Custom:
-        if (std::shared_ptr<Value::Custom> custom = value.toCustom()) {
-            cJSON *ret = cJSON_CreateString(custom->toString().constData());
-            if (ret) {
-                ret->type = cJSON_RawString;
-                return ret;
+    struct State
+    {
+        State(size_t c, const std::function<void(size_t)> &w)
+            : count(c), next(0), done(0), work(w)
+        {}
+
+        // returns when there's nothing left to take
+        void help()
+        {
+            size_t idx;
+            while ((idx = next.fetch_add(1, std::memory_order_relaxed)) < count) {
+                work(idx);
+                if (done.fetch_add(1, std::memory_order_acq_rel) + 1 == count) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    cond.notify_all();
+                }
             }
         }
-        break;
+
+        const size_t count;
+        std::atomic<size_t> next, done;
+        // only called while the caller is waiting
+        const std::function<void(size_t)> &work;
+        std::mutex mutex;
+        std::condition_variable cond;
+    };
+    std::shared_ptr<State> state = std::make_shared<State>(count, work);
+    const size_t helpers = std::min<size_t>(count, pool->concurrentJobs()) - 1;
+    for (size_t i = 0; i < helpers; ++i)
+        pool->submit([state]() { state->help(); });
+    state->help();
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cond.wait(lock, [&state]() { return state->done.load(std::memory_order_acquire) == state->count; });
+}
+
+enum {
+    // smaller documents and chunks aren't worth the threads
+    ParallelMinimumSize = 1024 * 1024,
+    ParallelChunkSize = 256 * 1024,
+    ParallelChunkElements = 512
+};
+
+// The next '"', '[', ']', '{', '}' or ',' from ch, or end.
+static const char *findStructural(const char *ch, const char *end)
+{
+#if defined(__SSE2__)
+    while (end - ch >= 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ch));
+        // '[' and ']', '{' and '}' only differ in 0x04
+        const __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x04));
+        const __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                                       _mm_cmpeq_epi8(v, _mm_set1_epi8(','))),
+                                          _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8(']')),
+                                                       _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))));
+        if (const int mask = _mm_movemask_epi8(hits))
+            return ch + __builtin_ctz(mask);
+        ch += 16;
     }
-    return cJSON_CreateNull();
+#endif
+    while (ch != end && *ch != '"' && *ch != ',' && *ch != '[' && *ch != ']' && *ch != '{' && *ch != '}')
+        ++ch;
+    return ch;
+}
+
+// Splits the top level array in [json, end) at ',' about every chunkSize
+// bytes. starts gets where each chunk begins and close where the array
+// ends. False if it isn't a well formed top level array, the parser says
+// what's wrong then.
+static bool splitJSONArray(const char *json, const char *end, size_t chunkSize,
+                           List<const char *> &starts, const char *&close)
+{
+    const char *ch = json;
+    while (ch != end && (*ch == ' ' || *ch == '\n' || *ch == '\r' || *ch == '\t'))
+        ++ch;
+    if (ch == end || *ch != '[')
+        return false;
+    starts.append(++ch);
+    const char *next = ch + chunkSize;
+    int depth = 1;
+    while ((ch = findStructural(ch, end)) != end) {
+        switch (*ch) {
+        case '"':
+            // to the '"' that doesn't have an odd number of '\\' before it
+            for (const char *quote = ch + 1;; ++quote) {
+                quote = static_cast<const char *>(memchr(quote, '"', end - quote));
+                if (!quote)
+                    return false;
+                const char *backslash = quote;
+                while (backslash[-1] == '\\')
+                    --backslash;
+                if (!((quote - backslash) & 1)) {
+                    ch = quote;
+                    break;
+                }
+            }
+            break;
+        case '[':
+        case '{':
+            ++depth;
+            break;
+        case ']':
+        case '}':
+            if (!--depth) {
+                close = ch;
+                return *ch == ']';
+            }
+            break;
+        case ',':
+            if (depth == 1 && ch >= next) {
+                starts.append(ch + 1);
+                next = ch + chunkSize;
+            }
+            break;
+        }
+        ++ch;
+    }
+    return false;
+}
+
+Value Value::fromJSONParallel(const String &json, ThreadPool *pool, bool *ok, String *error)
+{
+    RCT_ALLOCATION_SCOPE(Allocations::ValueSubsystem);
+    if (!pool)
+        pool = ThreadPool::instance();
+    const char *begin = json.constData();
+    const char *end = begin + json.size();
+    List<const char *> starts;
+    const char *close = 0;
+    if (json.size() < ParallelMinimumSize || pool->concurrentJobs() < 2
+        || !splitJSONArray(begin, end, std::max<size_t>(json.size() / (pool->concurrentJobs() * 4), ParallelChunkSize),
+                           starts, close)
+        || starts.size() < 2) {
+        return parseJSON(begin, json.size(), ok, error);
+    }
+    // trailing garbage and such
+    for (const char *ch = close + 1; ch != end; ++ch) {
+        if (*ch != ' ' && *ch != '\n' && *ch != '\r' && *ch != '\t')
+            return parseJSON(begin, json.size(), ok, error);
+    }
+
+    struct Chunk
+    {
+        List<Value> elements;
+        String error;
+        bool ok;
+    };
+    List<Chunk> chunks(starts.size());
+    runChunks(pool, starts.size(), [&](size_t idx) {
+            // each one ends at the ',' before the next
+            const char *chunkEnd = idx + 1 < starts.size() ? starts.at(idx + 1) - 1 : close;
+            JSONParser parser(begin, starts.at(idx), chunkEnd);
+            Chunk &chunk = chunks[idx];
+            chunk.ok = parser.parseElements(chunk.elements);
+            if (!chunk.ok)
+                chunk.error = parser.error();
+        });
+
+    size_t count = 0;
+    for (const Chunk &chunk : chunks) {
+        if (!chunk.ok) {
+            if (ok)
+                *ok = false;
+            if (error)
+                *error = chunk.error;
+            return Value();
+        }
+        count += chunk.elements.size();
+    }
+    List<Value> list;
+    list.reserve(count);
+    for (Chunk &chunk : chunks) {
+        for (Value &element : chunk.elements)
+            list.append(std::move(element));
+    }
+    if (ok)
+        *ok = true;
+    if (error)
+        error->clear();
+    return Value(std::move(list));
+}
+
+Value Value::fromJSON(const String &json, bool *ok, String *error)
+{
+    return parseJSON(json.constData(), json.size(), ok, error);
+}
+
+Value Value::fromJSON(const char *json, bool *ok, String *error)
+{
+    return parseJSON(json, json ? strlen(json) : 0, ok, error);
+}
+
+Value Value::fromJSON(const char *json, size_t size, bool *ok, String *error)
+{
+    RCT_ALLOCATION_SCOPE(Allocations::ValueSubsystem);
+    return parseJSON(json, size, ok, error);
 }
 
 class JSONFormatter : public Value::Formatter
@@ -157,7 +760,7 @@ public:
             output(buf, w);
             break; }
         case Value::Type_String:
-            Rct::jsonEscape(value.toString(), output);
+            Rct::jsonEscape(value.stringRef(), output);
             break;
         case Value::Type_Custom:
             Rct::jsonEscape(value.toCustom()->toString(), output);
@@ -201,11 +804,57 @@ public:
 
 String Value::toJSON(bool pretty) const
 {
-    cJSON *json = toCJSON(*this);
-    char *formatted = (pretty ? cJSON_Print(json) : cJSON_PrintUnformatted(json));
-    cJSON_Delete(json);
-    const String ret = formatted;
-    free(formatted);
+    RCT_ALLOCATION_SCOPE(Allocations::ValueSubsystem);
+    String ret;
+    JSONWriter writer(ret);
+    writer.setPretty(pretty);
+    writer.value(*this);
+    writer.flush();
+    return ret;
+}
+
+String Value::toJSONParallel(bool pretty, ThreadPool *pool) const
+{
+    RCT_ALLOCATION_SCOPE(Allocations::ValueSubsystem);
+    if (!pool)
+        pool = ThreadPool::instance();
+    const List<Value> &list = listRef();
+    const size_t chunkCount = std::min<size_t>(list.size() / ParallelChunkElements, pool->concurrentJobs() * 4);
+    if (chunkCount < 2 || pool->concurrentJobs() < 2)
+        return toJSON(pretty);
+
+    // each chunk is written as an array of its own, what's between the
+    // brackets is pasted together
+    List<String> chunks(chunkCount);
+    runChunks(pool, chunkCount, [&](size_t idx) {
+            const size_t from = list.size() * idx / chunkCount;
+            const size_t to = list.size() * (idx + 1) / chunkCount;
+            String &out = chunks[idx];
+            JSONWriter writer(out);
+            writer.setPretty(pretty);
+            writer.beginArray();
+            for (size_t i = from; i < to; ++i)
+                writer.value(list.at(i));
+            writer.endArray();
+            writer.flush();
+            // the '\n' before ']' too when it's pretty
+            out.remove(out.size() - (pretty ? 2 : 1), pretty ? 2 : 1);
+        });
+
+    size_t size = 2;
+    for (const String &chunk : chunks)
+        size += chunk.size();
+    String ret;
+    ret.reserve(size + chunkCount + 1);
+    ret.append('[');
+    for (size_t i = 0; i < chunkCount; ++i) {
+        if (i)
+            ret.append(',');
+        ret.append(chunks.at(i).constData() + 1, chunks.at(i).size() - 1);
+    }
+    if (pretty)
+        ret.append('\n');
+    ret.append(']');
     return ret;
 }
 
@@ -284,5 +933,6 @@ public:
 
 String Value::format() const
 {
+    RCT_ALLOCATION_SCOPE(Allocations::ValueSubsystem);
     return StringFormatter().toString(*this);
 }
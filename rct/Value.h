@@ -1,6 +1,7 @@
 #ifndef Value_h
 #define Value_h
 
+#include <atomic>
 #include <cmath>
 
 #include <rct/Date.h>
@@ -10,14 +11,15 @@
 #include <rct/Serializer.h>
 #include <rct/String.h>
 
-struct cJSON;
+class ThreadPool;
+
 class Value
 {
 public:
     struct Custom;
     inline Value() : mType(Type_Invalid) {}
-    inline Value(int i) : mType(Type_Integer) { mData.integer = i; }
-    inline Value(unsigned int i) : mType(Type_Integer) { mData.integer = i; }
+    inline Value(int i) : mType(Type_Integer) { mData.llong = i; }
+    inline Value(unsigned int i) : mType(Type_Integer) { mData.llong = i; }
     inline Value(long i) : mType(Type_Integer) { mData.llong = i; }
     inline Value(unsigned long i) : mType(Type_Integer) { mData.llong = i; }
     inline Value(long long i) : mType(Type_Integer) { mData.llong = i; }
@@ -26,7 +28,8 @@ public:
     inline Value(double d) : mType(Type_Double) { mData.dbl = d; }
     inline Value(bool b) : mType(Type_Boolean) { mData.boolean = b; }
     inline Value(const std::shared_ptr<Custom> &custom) : mType(Type_Custom) { new (mData.customBuf) std::shared_ptr<Custom>(custom); }
-    inline Value(const String &string) : mType(Type_String) { new (mData.stringBuf) String(string); }
+    inline Value(const String &string) : mType(Type_String) { mData.string = new Shared<String>(string); }
+    inline Value(String &&string) : mType(Type_String) { mData.string = new Shared<String>(std::move(string)); }
     inline Value(const Date &date) : mType(Type_Date) { mData.llong = date.time(); }
 
     struct Custom : std::enable_shared_from_this<Custom>
@@ -44,26 +47,28 @@ public:
     {
         if (len == -1)
             len = strlen(str);
-        new (mData.stringBuf) String(str, len);
+        mData.string = new Shared<String>(str, len);
     }
     inline Value(const Value &other) : mType(Type_Invalid) { copy(other); }
-    inline Value(const Map<String, Value> &map) : mType(Type_Map) { new (mData.mapBuf) Map<String, Value>(map); }
+    inline Value(const Map<String, Value> &map) : mType(Type_Map) { mData.map = new Shared<Map<String, Value> >(map); }
+    inline Value(Map<String, Value> &&map) : mType(Type_Map) { mData.map = new Shared<Map<String, Value> >(std::move(map)); }
     template <typename T> inline Value(const List<T> &list)
         : mType(Type_List)
     {
-        new (mData.listBuf) List<Value>(list.size());
+        mData.list = new Shared<List<Value> >(list.size());
         int i = 0;
         List<Value> *l = listPtr();
 
         for (const T &t : list)
             (*l)[i++] = t;
     }
-    inline Value(const List<Value> &list) : mType(Type_List) { new (mData.listBuf) List<Value>(list); }
-    Value(Value &&other);
+    inline Value(const List<Value> &list) : mType(Type_List) { mData.list = new Shared<List<Value> >(list); }
+    inline Value(List<Value> &&list) : mType(Type_List) { mData.list = new Shared<List<Value> >(std::move(list)); }
+    Value(Value &&other) noexcept;
     ~Value() { clear(); }
 
-    inline Value &operator=(const Value &other) { clear(); copy(other); return *this; }
-    Value & operator=(Value&& other);
+    Value &operator=(const Value &other);
+    Value & operator=(Value&& other) noexcept;
 
     inline bool isNull() const { return mType == Type_Invalid; }
     inline bool isValid() const { return mType != Type_Invalid; }
@@ -105,6 +110,28 @@ public:
     template <typename T>
     inline List<T> toList() const;
     inline List<Value> toList() const;
+    // Strings, maps and lists are shared between copies of a Value until
+    // one of them is changed, these return the shared one without copying
+    // it, or an empty one if the Value is something else. Good until the
+    // Value is changed.
+    inline const String &stringRef() const;
+    inline const Map<String, Value> &mapRef() const;
+    inline const List<Value> &listRef() const;
+    // The value if it's stored as a T, null if it isn't, without
+    // converting or copying. T is one of bool, long long (integers and
+    // dates), double, String, Map<String, Value>, List<Value> and
+    // std::shared_ptr<Custom>. getMutable() makes a shared one ours first.
+    // Like the non-const operator[], it hands out something that can be
+    // written to later, so copies of the Value made after that copy the
+    // contents instead of sharing them.
+    template <typename T> inline const T *get() const { invalidType(T()); return 0; }
+    template <typename T> inline T *getMutable() { invalidType(T()); return 0; }
+    // convert() for a Value that's about to go away. A String, map or
+    // list is taken out of it, and moved rather than copied when no other
+    // Value shares it, which leaves the Value invalid:
+    //
+    //     const String name = std::move(value).take<String>();
+    template <typename T> inline T take(bool *ok = 0) && { return convert<T>(ok); }
     Map<String, Value>::const_iterator begin() const;
     Map<String, Value>::const_iterator end() const;
     List<Value>::const_iterator listBegin() const;
@@ -128,9 +155,18 @@ public:
     inline Value convert(Type type, bool *ok) const;
     template <typename T> static Value create(const T &t) { return Value(t); }
     void clear();
-    static Value fromJSON(const String &json, bool *ok = 0) { return fromJSON(json.constData(), ok); }
-    static Value fromJSON(const char *json, bool *ok = 0);
+    // error, if given, says what was wrong and where, like "Expected ':' at line 3, column 12"
+    static Value fromJSON(const String &json, bool *ok = 0, String *error = 0);
+    static Value fromJSON(const char *json, bool *ok = 0, String *error = 0);
+    static Value fromJSON(const char *json, size_t size, bool *ok, String *error = 0);
     String toJSON(bool pretty = false) const;
+    // For big top level arrays, like one entry per file, the array is
+    // split in chunks that are parsed or written on the threads of pool,
+    // ThreadPool::instance() by default, and the calling one. The result
+    // is the same as with fromJSON() and toJSON(), which anything else
+    // or anything small goes through.
+    static Value fromJSONParallel(const String &json, ThreadPool *pool = 0, bool *ok = 0, String *error = 0);
+    String toJSONParallel(bool pretty = false, ThreadPool *pool = 0) const;
     String format() const;
     static Value undefined() { return Value(Type_Undefined); }
 
@@ -151,6 +187,65 @@ public:
 private:
     explicit Value(Type type) : mType(type) {}
 
+    template <typename T>
+    struct Shared
+    {
+        template <typename... Args>
+        Shared(Args &&...args)
+            : refs(1), unsharable(false), data(std::forward<Args>(args)...)
+        {}
+
+        std::atomic<int> refs;
+        // a reference into data was handed out, copies can't share it
+        std::atomic<bool> unsharable;
+        T data;
+    };
+
+    template <typename T>
+    static void ref(Shared<T> *shared)
+    {
+        shared->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    template <typename T>
+    static void deref(Shared<T> *shared)
+    {
+        if (shared->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete shared;
+    }
+    // the data of shared, moved out if nobody else has it
+    template <typename T>
+    static T release(Shared<T> *shared)
+    {
+        if (shared->refs.load(std::memory_order_acquire) == 1) {
+            T ret(std::move(shared->data));
+            delete shared;
+            return ret;
+        }
+        T ret(shared->data);
+        deref(shared);
+        return ret;
+    }
+    // shared itself, or a copy of it if it's unsharable
+    template <typename T>
+    static Shared<T> *share(Shared<T> *shared)
+    {
+        if (shared->unsharable.load(std::memory_order_relaxed))
+            return new Shared<T>(shared->data);
+        ref(shared);
+        return shared;
+    }
+    // makes shared ours alone before it's changed
+    template <typename T>
+    static T *detach(Shared<T> *&shared)
+    {
+        if (shared->refs.load(std::memory_order_acquire) != 1) {
+            Shared<T> *copy = new Shared<T>(shared->data);
+            deref(shared);
+            shared = copy;
+        }
+        return &shared->data;
+    }
+
     template <typename T> T *pun() const
     {
         union {
@@ -161,46 +256,65 @@ private:
         return ret;
     }
 
-    static cJSON *toCJSON(const Value &value);
     void copy(const Value &other);
-    String *stringPtr() { return pun<String>(); }
-    const String *stringPtr() const { return pun<const String>(); }
-    Map<String, Value> *mapPtr() { return pun<Map<String, Value> >(); }
-    const Map<String, Value> *mapPtr() const { return pun<const Map<String, Value> >(); }
-    List<Value> *listPtr() { return pun<List<Value> >(); }
-    const List<Value> *listPtr() const { return pun<const List<Value> >(); }
+    void move(Value &other);
+    // makes shared ours alone for good, for a reference into it that
+    // may be written to after the Value is copied
+    template <typename T>
+    static T *leak(Shared<T> *&shared)
+    {
+        T *ret = detach(shared);
+        shared->unsharable.store(true, std::memory_order_relaxed);
+        return ret;
+    }
+
+    // the non-const ones detach
+    String *stringPtr() { return detach(mData.string); }
+    const String *stringPtr() const { return &mData.string->data; }
+    Map<String, Value> *mapPtr() { return detach(mData.map); }
+    const Map<String, Value> *mapPtr() const { return &mData.map->data; }
+    List<Value> *listPtr() { return detach(mData.list); }
+    const List<Value> *listPtr() const { return &mData.list->data; }
     std::shared_ptr<Custom> *customPtr() { return pun<std::shared_ptr<Custom> >(); }
     const std::shared_ptr<Custom> *customPtr() const { return pun<const std::shared_ptr<Custom> >(); }
 
     Type mType;
     union {
-        int integer;
         long long llong;
         unsigned long long ullong;
         double dbl;
         bool boolean;
-        char stringBuf[sizeof(String)];
-        char mapBuf[sizeof(Map<String, Value>)];
-        char listBuf[sizeof(List<Value>)];
+        Shared<String> *string;
+        Shared<Map<String, Value> > *map;
+        Shared<List<Value> > *list;
         char customBuf[sizeof(std::shared_ptr<Custom>)];
         void *voidPtr;
     } mData;
 };
 
-inline Value::Value(Value &&other)
+inline Value &Value::operator=(const Value &other)
+{
+    if (this != &other) {
+        // other might live in what this holds
+        Value copy(other);
+        clear();
+        move(copy);
+    }
+    return *this;
+}
+
+inline Value::Value(Value &&other) noexcept
     : mType(Type_Invalid)
 {
-    copy(other);
-    memset(&other.mData, '\0', sizeof(mData));
-    other.mType = Type_Invalid;
+    move(other);
 }
 
-inline Value &Value::operator=(Value &&other)
+inline Value &Value::operator=(Value &&other) noexcept
 {
-    clear();
-    copy(other);
-    memset(&other.mData, '\0', sizeof(mData));
-    other.mType = Type_Invalid;
+    if (this != &other) {
+        clear();
+        move(other);
+    }
     return *this;
 }
 
@@ -227,7 +341,7 @@ template <> inline int Value::convert<int>(bool *ok) const
         *ok = true;
     switch (mType) {
     case Type_Date: return static_cast<int>(mData.llong);
-    case Type_Integer: return mData.integer;
+    case Type_Integer: return static_cast<int>(mData.llong);
     case Type_Double: return static_cast<int>(round(mData.dbl));
     case Type_Boolean: return mData.boolean;
     case Type_String: {
@@ -327,7 +441,7 @@ template <> inline bool Value::convert<bool>(bool *ok) const
 
     switch (mType) {
     case Type_Date: break;
-    case Type_Integer: return mData.integer;
+    case Type_Integer: return mData.llong != 0;
     case Type_Double: return mData.dbl;
     case Type_Boolean: return mData.boolean;
     case Type_String: {
@@ -358,7 +472,7 @@ template <> inline double Value::convert<double>(bool *ok) const
 
     switch (mType) {
     case Type_Date: return static_cast<double>(mData.llong);
-    case Type_Integer: return mData.integer;
+    case Type_Integer: return static_cast<double>(mData.llong);
     case Type_Double: return mData.dbl;
     case Type_Boolean: return mData.boolean;
     case Type_String: {
@@ -386,7 +500,7 @@ template <> inline String Value::convert<String>(bool *ok) const
 
     switch (mType) {
     case Type_Date: return String::number(mData.llong);
-    case Type_Integer: return String::number(mData.integer);
+    case Type_Integer: return String::number(mData.llong);
     case Type_Double: return String::number(mData.dbl);
     case Type_Boolean: return mData.boolean ? "true" : "false";
     case Type_String: return *stringPtr();
@@ -487,6 +601,97 @@ inline List<T> Value::toList() const
     return ret;
 }
 
+inline const String &Value::stringRef() const
+{
+    if (mType != Type_String) {
+        static const String empty;
+        return empty;
+    }
+    return *stringPtr();
+}
+
+inline const Map<String, Value> &Value::mapRef() const
+{
+    if (mType != Type_Map) {
+        static const Map<String, Value> empty;
+        return empty;
+    }
+    return *mapPtr();
+}
+
+inline const List<Value> &Value::listRef() const
+{
+    if (mType != Type_List) {
+        static const List<Value> empty;
+        return empty;
+    }
+    return *listPtr();
+}
+
+template <> inline const bool *Value::get<bool>() const { return mType == Type_Boolean ? &mData.boolean : 0; }
+template <> inline const long long *Value::get<long long>() const
+{
+    return mType == Type_Integer || mType == Type_Date ? &mData.llong : 0;
+}
+template <> inline const double *Value::get<double>() const { return mType == Type_Double ? &mData.dbl : 0; }
+template <> inline const String *Value::get<String>() const { return mType == Type_String ? stringPtr() : 0; }
+template <> inline const Map<String, Value> *Value::get<Map<String, Value> >() const
+{
+    return mType == Type_Map ? mapPtr() : 0;
+}
+template <> inline const List<Value> *Value::get<List<Value> >() const { return mType == Type_List ? listPtr() : 0; }
+template <> inline const std::shared_ptr<Value::Custom> *Value::get<std::shared_ptr<Value::Custom> >() const
+{
+    return mType == Type_Custom ? customPtr() : 0;
+}
+
+template <> inline bool *Value::getMutable<bool>() { return mType == Type_Boolean ? &mData.boolean : 0; }
+template <> inline long long *Value::getMutable<long long>()
+{
+    return mType == Type_Integer || mType == Type_Date ? &mData.llong : 0;
+}
+template <> inline double *Value::getMutable<double>() { return mType == Type_Double ? &mData.dbl : 0; }
+template <> inline String *Value::getMutable<String>() { return mType == Type_String ? leak(mData.string) : 0; }
+template <> inline Map<String, Value> *Value::getMutable<Map<String, Value> >()
+{
+    return mType == Type_Map ? leak(mData.map) : 0;
+}
+template <> inline List<Value> *Value::getMutable<List<Value> >() { return mType == Type_List ? leak(mData.list) : 0; }
+template <> inline std::shared_ptr<Value::Custom> *Value::getMutable<std::shared_ptr<Value::Custom> >()
+{
+    return mType == Type_Custom ? customPtr() : 0;
+}
+
+template <> inline String Value::take<String>(bool *ok) &&
+{
+    if (mType != Type_String)
+        return convert<String>(ok);
+    if (ok)
+        *ok = true;
+    mType = Type_Invalid;
+    return release(mData.string);
+}
+
+template <> inline Map<String, Value> Value::take<Map<String, Value> >(bool *ok) &&
+{
+    if (mType != Type_Map)
+        return convert<Map<String, Value> >(ok);
+    if (ok)
+        *ok = true;
+    mType = Type_Invalid;
+    return release(mData.map);
+}
+
+template <> inline List<Value> Value::take<List<Value> >(bool *ok) &&
+{
+    if (mType != Type_List)
+        return convert<List<Value> >(ok);
+    if (ok)
+        *ok = true;
+    mType = Type_Invalid;
+    return release(mData.list);
+}
+
 inline Value Value::value(int idx, const Value &defaultValue) const
 {
     return mType == Type_List ? listPtr()->value(idx, defaultValue) : defaultValue;
@@ -495,7 +700,11 @@ inline Value Value::value(int idx, const Value &defaultValue) const
 template <typename T>
 inline T Value::value(int idx, const T &defaultValue, bool *ok) const
 {
-    return value(idx, Value(defaultValue)).convert<T>(ok);
+    if (mType == Type_List && idx >= 0 && static_cast<size_t>(idx) < listPtr()->size())
+        return listPtr()->at(idx).convert<T>(ok);
+    if (ok)
+        *ok = true;
+    return defaultValue;
 }
 
 inline Value Value::value(const String &key, const Value &defaultValue) const
@@ -506,7 +715,15 @@ inline Value Value::value(const String &key, const Value &defaultValue) const
 template <typename T>
 inline T Value::value(const String &key, const T &defaultValue, bool *ok) const
 {
-    return value(key, Value(defaultValue)).convert<T>(ok);
+    if (mType == Type_Map) {
+        const Map<String, Value> &map = *mapPtr();
+        const auto it = map.find(key);
+        if (it != map.end())
+            return it->second.convert<T>(ok);
+    }
+    if (ok)
+        *ok = true;
+    return defaultValue;
 }
 
 inline Map<String, Value>::const_iterator Value::begin() const
@@ -564,7 +781,7 @@ inline bool Value::contains(const String &key) const
 inline void Value::arrayReserve(size_t size)
 {
     if (mType == Type_Invalid) {
-        new (mData.listBuf) List<Value>;
+        mData.list = new Shared<List<Value> >();
         mType = Type_List;
     }
     assert(mType == Type_List);
@@ -585,18 +802,18 @@ inline const Value &Value::operator[](int idx) const
 inline Value &Value::operator[](int idx)
 {
     if (mType == Type_Invalid) {
-        new (mData.listBuf) List<Value>;
+        mData.list = new Shared<List<Value> >();
         mType = Type_List;
     } else {
         assert(mType == Type_List);
     }
-    return (*listPtr())[idx];
+    return (*leak(mData.list))[idx];
 }
 
 inline void Value::push_back(const Value &val)
 {
     if (mType == Type_Invalid) {
-        new (mData.listBuf) List<Value>;
+        mData.list = new Shared<List<Value> >();
         mType = Type_List;
     } else {
         assert(mType == Type_List);
@@ -613,12 +830,12 @@ inline const Value &Value::operator[](const String &key) const
 inline Value &Value::operator[](const String &key)
 {
     if (mType == Type_Invalid) {
-        new (mData.mapBuf) Map<String, Value>;
+        mData.map = new Shared<Map<String, Value> >();
         mType = Type_Map;
     } else {
         assert(mType == Type_Map);
     }
-    return (*mapPtr())[key];
+    return (*leak(mData.map))[key];
 }
 template <typename T>
 inline T Value::operator[](int idx) const
@@ -644,7 +861,7 @@ inline Log operator<<(Log log, const Value &value)
         case Value::Type_Integer: l << value.toInteger(); break;
         case Value::Type_Double: l << value.toDouble(); break;
         case Value::Type_Boolean: l << value.toBool(); break;
-        case Value::Type_String: l << value.toString(); break;
+        case Value::Type_String: l << value.stringRef(); break;
         case Value::Type_Invalid: l << "(invalid)"; break;
         case Value::Type_Undefined: l << "(undefined)"; break;
         case Value::Type_Custom: {
@@ -655,8 +872,8 @@ inline Log operator<<(Log log, const Value &value)
                 l << "Custom(0)";
             }
             break; }
-        case Value::Type_List: l << value.toList(); break;
-        case Value::Type_Map: l << value.toMap(); break;
+        case Value::Type_List: l << value.listRef(); break;
+        case Value::Type_Map: l << value.mapRef(); break;
         }
     }
     log << String::format<128>("Value(%s: %s)", Value::typeToString(value.type()),
@@ -666,17 +883,40 @@ inline Log operator<<(Log log, const Value &value)
 
 inline Serializer& operator<<(Serializer& serializer, const Value &value)
 {
-    serializer << static_cast<int>(value.type());
+    if (serializer.isCompact()) {
+        // all of the integer, and repeated map keys once
+        serializer << static_cast<uint8_t>(value.type());
+        switch (value.type()) {
+        case Value::Type_Date:
+        case Value::Type_Integer: serializer << value.toLongLong(); break;
+        case Value::Type_Map: {
+            const Map<String, Value> &map = value.mapRef();
+            serializer << static_cast<uint32_t>(map.size());
+            for (const auto &entry : map) {
+                serializer.writeKey(entry.first);
+                serializer << entry.second;
+            }
+            return serializer; }
+        default: break;
+        }
+    } else {
+        serializer << static_cast<int>(value.type());
+        switch (value.type()) {
+        case Value::Type_Date: serializer << value.toLongLong(); break;
+        case Value::Type_Integer: serializer << value.toInteger(); break;
+        default: break;
+        }
+    }
     switch (value.type()) {
-    case Value::Type_Date: serializer << value.toLongLong(); break;
-    case Value::Type_Integer: serializer << value.toInteger(); break;
     case Value::Type_Double: serializer << value.toDouble(); break;
     case Value::Type_Boolean: serializer << value.toBool(); break;
-    case Value::Type_String: serializer << value.toString(); break;
-    case Value::Type_Map: serializer << value.toMap(); break;
-    case Value::Type_List: serializer << value.toList(); break;
+    case Value::Type_String: serializer << value.stringRef(); break;
+    case Value::Type_Map: serializer << value.mapRef(); break;
+    case Value::Type_List: serializer << value.listRef(); break;
     case Value::Type_Custom: error() << "Trying to serialize pointer"; break;
-    case Value::Type_Invalid: break;
+    case Value::Type_Date:
+    case Value::Type_Integer:
+    case Value::Type_Invalid:
     case Value::Type_Undefined: break;
     }
     return serializer;
@@ -684,17 +924,40 @@ inline Serializer& operator<<(Serializer& serializer, const Value &value)
 
 inline Deserializer& operator>>(Deserializer& deserializer, Value &value)
 {
-    int t;
-    deserializer >> t;
-    Value::Type type = static_cast<Value::Type>(t);
+    Value::Type type;
+    if (deserializer.isCompact()) {
+        uint8_t t;
+        deserializer >> t;
+        type = static_cast<Value::Type>(t);
+        switch (type) {
+        case Value::Type_Date:
+        case Value::Type_Integer: { long long v; deserializer >> v; value = v; return deserializer; }
+        case Value::Type_Map: {
+            uint32_t size;
+            deserializer >> size;
+            Map<String, Value> map;
+            String key;
+            for (uint32_t i = 0; i < size; ++i) {
+                deserializer.readKey(key);
+                deserializer >> map[key];
+            }
+            value = std::move(map);
+            return deserializer; }
+        default: break;
+        }
+    } else {
+        int t;
+        deserializer >> t;
+        type = static_cast<Value::Type>(t);
+    }
     switch (type) {
     case Value::Type_Date: { long long v; deserializer >> v; value = v; break; }
     case Value::Type_Integer: { int v; deserializer >> v; value = v; break; }
     case Value::Type_Double: { double v; deserializer >> v; value = v; break; }
     case Value::Type_Boolean: { bool v; deserializer >> v; value = v; break; }
-    case Value::Type_String: { String v; deserializer >> v; value = v; break; }
-    case Value::Type_Map: { Map<String, Value> v; deserializer >> v; value = v; break; }
-    case Value::Type_List: { List<Value> v; deserializer >> v; value = v; break; }
+    case Value::Type_String: { String v; deserializer >> v; value = std::move(v); break; }
+    case Value::Type_Map: { Map<String, Value> v; deserializer >> v; value = std::move(v); break; }
+    case Value::Type_List: { List<Value> v; deserializer >> v; value = std::move(v); break; }
     case Value::Type_Custom: value.clear(); error() << "Trying to deserialize pointer"; break;
     case Value::Type_Invalid: value.clear(); break;
     case Value::Type_Undefined: value = Value::undefined(); break;
@@ -0,0 +1,330 @@
+#ifndef VALUEBINDER_H
+#define VALUEBINDER_H
+
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+
+#include <rct/JSONWriter.h>
+#include <rct/List.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+#include <rct/Value.h>
+#include <rct/ValueView.h>
+
+// Specialize with a bind() that lists the members of a struct to convert
+// it to and from Value maps and JSON objects with ValueBinder:
+//
+//     struct Job { String name; int priority; List<String> args; };
+//     template <> struct ValueBinding<Job>
+//     {
+//         static void bind(ValueBinder<Job> &binder)
+//         {
+//             binder.field("name", &Job::name);
+//             binder.field("priority", &Job::priority);
+//             binder.field("args", &Job::args);
+//         }
+//     };
+//
+//     Job job;
+//     ValueBinder<Job>::fromJSON(json, job);
+//
+// Members can be numbers, bools, Strings, Values, other bound structs
+// and Lists of those.
+template <typename T> struct ValueBinding {};
+
+template <typename T> class ValueBinder;
+
+class ValueBinderBase
+{
+protected:
+    template <typename T>
+    struct IsBound
+    {
+        template <typename U> static char test(decltype(&ValueBinding<U>::bind));
+        template <typename U> static long test(...);
+        enum { value = sizeof(test<T>(0)) == 1 };
+    };
+
+    template <typename T>
+    struct IsArithmetic
+    {
+        enum { value = std::is_arithmetic<T>::value };
+    };
+
+    // the number types convert() has
+    template <typename T>
+    static typename std::enable_if<IsArithmetic<T>::value, bool>::type read(const Value &value, T &t)
+    {
+        bool ok;
+        if (std::is_same<T, bool>::value) {
+            t = value.convert<bool>(&ok);
+        } else if (std::is_floating_point<T>::value) {
+            t = static_cast<T>(value.convert<double>(&ok));
+        } else if (std::is_unsigned<T>::value) {
+            t = static_cast<T>(value.convert<unsigned long long>(&ok));
+        } else {
+            t = static_cast<T>(value.convert<long long>(&ok));
+        }
+        return ok;
+    }
+    static bool read(const Value &value, String &string)
+    {
+        bool ok;
+        string = value.convert<String>(&ok);
+        return ok && value.type() != Value::Type_Invalid;
+    }
+    static bool read(const Value &value, Value &t)
+    {
+        t = value;
+        return true;
+    }
+    template <typename T>
+    static bool read(const Value &value, List<T> &list)
+    {
+        const List<Value> *values = value.get<List<Value> >();
+        if (!values)
+            return false;
+        list.clear();
+        list.reserve(values->size());
+        for (const Value &v : *values) {
+            T t = T();
+            if (!read(v, t))
+                return false;
+            list.append(std::move(t));
+        }
+        return true;
+    }
+    template <typename T>
+    static typename std::enable_if<IsBound<T>::value, bool>::type read(const Value &value, T &t)
+    {
+        return ValueBinder<T>::fromValue(value, t);
+    }
+
+    // JSON scalars go straight into the member, anything else through a Value
+    template <typename T>
+    static typename std::enable_if<IsArithmetic<T>::value, bool>::type read(const ValueView &view, T &t)
+    {
+        switch (view.type()) {
+        case Value::Type_Boolean:
+            t = static_cast<T>(view.toBool());
+            return true;
+        case Value::Type_Integer:
+            t = static_cast<T>(view.toLongLong());
+            return true;
+        case Value::Type_Double:
+            if (std::is_floating_point<T>::value) {
+                t = static_cast<T>(view.toDouble());
+            } else {
+                t = static_cast<T>(view.toLongLong());
+            }
+            return true;
+        default:
+            break;
+        }
+        return read(view.toValue(), t);
+    }
+    static bool read(const ValueView &view, String &string)
+    {
+        if (!view.isString())
+            return read(view.toValue(), string);
+        string = view.toString();
+        return true;
+    }
+    static bool read(const ValueView &view, Value &value)
+    {
+        value = view.toValue();
+        return true;
+    }
+    template <typename T>
+    static bool read(const ValueView &view, List<T> &list)
+    {
+        if (!view.isList())
+            return false;
+        list.clear();
+        bool ok = true;
+        view.forEach([&list, &ok](const StringView &, const ValueView &element) {
+                T t = T();
+                if ((ok = read(element, t)))
+                    list.append(std::move(t));
+                return ok;
+            });
+        return ok;
+    }
+    template <typename T>
+    static typename std::enable_if<IsBound<T>::value, bool>::type read(const ValueView &view, T &t)
+    {
+        return ValueBinder<T>::fromView(view, t);
+    }
+
+    template <typename T>
+    static typename std::enable_if<!IsBound<T>::value, Value>::type toValue(const T &t)
+    {
+        return Value(t);
+    }
+    template <typename T>
+    static Value toValue(const List<T> &list)
+    {
+        List<Value> values;
+        values.reserve(list.size());
+        for (const T &t : list)
+            values.append(toValue(t));
+        return Value(std::move(values));
+    }
+    template <typename T>
+    static typename std::enable_if<IsBound<T>::value, Value>::type toValue(const T &t)
+    {
+        return ValueBinder<T>::toValue(t);
+    }
+
+    template <typename T>
+    static typename std::enable_if<!IsBound<T>::value>::type write(JSONWriter &writer, const T &t)
+    {
+        writer.value(t);
+    }
+    template <typename T>
+    static void write(JSONWriter &writer, const List<T> &list)
+    {
+        writer.beginArray();
+        for (const T &t : list)
+            write(writer, t);
+        writer.endArray();
+    }
+    template <typename T>
+    static typename std::enable_if<IsBound<T>::value>::type write(JSONWriter &writer, const T &t)
+    {
+        ValueBinder<T>::toJSON(t, writer);
+    }
+};
+
+// The members of T, listed once by ValueBinding<T>::bind() and kept sorted
+// by key. Conversions match each key once, a Value map against the
+// members in one pass since both are sorted.
+//
+// Members that aren't in the map or the object are left alone, keys that
+// aren't members are ignored. The conversions return false if what they
+// got isn't a map or an object, or a member can't be converted.
+template <typename T>
+class ValueBinder : private ValueBinderBase
+{
+public:
+    template <typename M>
+    ValueBinder &field(const char *key, M T::*member)
+    {
+        Field f;
+        f.key = key;
+        f.fromValue = [member](T &t, const Value &value) { return read(value, t.*member); };
+        f.fromView = [member](T &t, const ValueView &view) { return read(view, t.*member); };
+        f.toValue = [member](const T &t) { return ValueBinderBase::toValue(t.*member); };
+        f.toJSON = [member](const T &t, JSONWriter &writer) { write(writer, t.*member); };
+        mFields.append(std::move(f));
+        return *this;
+    }
+
+    static bool fromValue(const Value &value, T &t)
+    {
+        const Map<String, Value> *map = value.get<Map<String, Value> >();
+        if (!map)
+            return false;
+        const List<Field> &fields = instance().mFields;
+        auto field = fields.begin();
+        auto entry = map->begin();
+        while (field != fields.end() && entry != map->end()) {
+            const int cmp = field->key.compare(entry->first);
+            if (cmp < 0) {
+                ++field;
+            } else if (cmp > 0) {
+                ++entry;
+            } else {
+                if (!field->fromValue(t, entry->second))
+                    return false;
+                ++field;
+                ++entry;
+            }
+        }
+        return true;
+    }
+
+    static bool fromView(const ValueView &view, T &t)
+    {
+        if (!view.isMap())
+            return false;
+        const ValueBinder &binder = instance();
+        bool ok = true;
+        view.forEach([&binder, &t, &ok](const StringView &key, const ValueView &member) {
+                if (const Field *field = binder.find(key))
+                    ok = field->fromView(t, member);
+                return ok;
+            });
+        return ok;
+    }
+
+    // decodes straight into t, without a Value in between
+    static bool fromJSON(const char *json, size_t size, T &t) { return fromView(ValueView::fromJSON(json, size), t); }
+    static bool fromJSON(const String &json, T &t) { return fromJSON(json.constData(), json.size(), t); }
+
+    static Value toValue(const T &t)
+    {
+        Map<String, Value> map;
+        for (const Field &field : instance().mFields)
+            map.emplace_hint(map.end(), field.key, field.toValue(t));
+        return Value(std::move(map));
+    }
+
+    static void toJSON(const T &t, JSONWriter &writer)
+    {
+        writer.beginObject();
+        for (const Field &field : instance().mFields) {
+            writer.key(field.key);
+            field.toJSON(t, writer);
+        }
+        writer.endObject();
+    }
+
+    static String toJSON(const T &t)
+    {
+        String ret;
+        {
+            JSONWriter writer(ret);
+            toJSON(t, writer);
+        }
+        return ret;
+    }
+
+private:
+    struct Field
+    {
+        String key;
+        std::function<bool(T &, const Value &)> fromValue;
+        std::function<bool(T &, const ValueView &)> fromView;
+        std::function<Value(const T &)> toValue;
+        std::function<void(const T &, JSONWriter &)> toJSON;
+    };
+
+    ValueBinder() {}
+
+    static const ValueBinder &instance()
+    {
+        static const ValueBinder binder = []() {
+                ValueBinder ret;
+                ValueBinding<T>::bind(ret);
+                std::stable_sort(ret.mFields.begin(), ret.mFields.end(), [](const Field &a, const Field &b) {
+                        return a.key < b.key;
+                    });
+                return ret;
+            }();
+        return binder;
+    }
+
+    const Field *find(const StringView &key) const
+    {
+        auto it = std::lower_bound(mFields.begin(), mFields.end(), key, [](const Field &field, const StringView &k) {
+                return StringView(field.key) < k;
+            });
+        return it != mFields.end() && StringView(it->key) == key ? &*it : 0;
+    }
+
+    List<Field> mFields;
+};
+
+#endif
@@ -0,0 +1,557 @@
+#include "ValueView.h"
+
+#include <algorithm>
+#include <limits.h>
+#include <math.h>
+
+static inline bool isJSONWhitespace(char ch)
+{
+    return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t';
+}
+
+// true if there are size bytes at pos
+static inline bool has(const char *pos, const char *end, size_t size)
+{
+    return pos && static_cast<size_t>(end - pos) >= size;
+}
+
+template <typename T>
+static inline T readRaw(const char *pos)
+{
+    T ret;
+    memcpy(&ret, pos, sizeof(T));
+    return ret;
+}
+
+ValueView ValueView::fromJSON(const char *json, size_t size)
+{
+    std::shared_ptr<Source> source = std::make_shared<Source>();
+    source->end = json + size;
+    source->format = JSON;
+    ValueView ret(source, json);
+    const char *pos = ret.skipWhitespace(json);
+    if (pos == source->end)
+        return ValueView();
+    ret.mPos = pos;
+    return ret;
+}
+
+ValueView ValueView::fromBinary(const char *data, size_t size, bool compact, const List<String> &keys)
+{
+    if (!size)
+        return ValueView();
+    std::shared_ptr<Source> source = std::make_shared<Source>();
+    source->end = data + size;
+    source->format = compact ? CompactBinary : Binary;
+    source->initialKeys = keys;
+    return ValueView(source, data);
+}
+
+const char *ValueView::skipWhitespace(const char *pos) const
+{
+    while (pos != mSource->end && isJSONWhitespace(*pos))
+        ++pos;
+    return pos;
+}
+
+bool ValueView::readVarint(const char *&pos, uint64_t &value) const
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < mSource->end; shift += 7) {
+        const unsigned char byte = *pos++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+Value::Type ValueView::type() const
+{
+    if (!mPos)
+        return Value::Type_Invalid;
+    switch (mSource->format) {
+    case JSON:
+        switch (*mPos) {
+        case '{': return Value::Type_Map;
+        case '[': return Value::Type_List;
+        case '"': return Value::Type_String;
+        case 't':
+        case 'f': return Value::Type_Boolean;
+        case '-': case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9': {
+            double value;
+            bool integer;
+            if (jsonNumber(value, integer))
+                return integer ? Value::Type_Integer : Value::Type_Double;
+            break; }
+        }
+        break;
+    case Binary:
+        if (has(mPos, mSource->end, sizeof(int)))
+            return static_cast<Value::Type>(readRaw<int>(mPos));
+        break;
+    case CompactBinary:
+        return static_cast<Value::Type>(static_cast<unsigned char>(*mPos));
+    }
+    return Value::Type_Invalid;
+}
+
+const char *ValueView::skip(const char *pos) const
+{
+    return mSource->format == JSON ? skipJSON(pos) : skipBinary(pos);
+}
+
+const char *ValueView::skipJSON(const char *pos) const
+{
+    const char *end = mSource->end;
+    if (pos == end)
+        return 0;
+    switch (*pos) {
+    case '"': {
+        const char *quote = pos + 1;
+        while ((quote = static_cast<const char *>(memchr(quote, '"', end - quote)))) {
+            // escaped if there's an odd number of backslashes before it
+            const char *backslash = quote;
+            while (backslash > pos + 1 && backslash[-1] == '\\')
+                --backslash;
+            if (!((quote - backslash) & 1))
+                return quote + 1;
+            ++quote;
+        }
+        return 0; }
+    case '{':
+    case '[': {
+        int depth = 0;
+        while (pos != end) {
+            switch (*pos) {
+            case '"':
+                pos = skipJSON(pos);
+                if (!pos)
+                    return 0;
+                continue;
+            case '{':
+            case '[':
+                ++depth;
+                break;
+            case '}':
+            case ']':
+                if (!--depth)
+                    return pos + 1;
+                break;
+            }
+            ++pos;
+        }
+        return 0; }
+    }
+    // numbers and literals
+    const char *start = pos;
+    while (pos != end && !isJSONWhitespace(*pos) && *pos != ',' && *pos != ']' && *pos != '}' && *pos != ':')
+        ++pos;
+    return pos == start ? 0 : pos;
+}
+
+void ValueView::recordKey(const char *pos, const StringView &key) const
+{
+    List<std::pair<const char *, StringView> > &keys = mSource->keys;
+    // nearly always the last one, they're found in order
+    if (keys.isEmpty() || keys.last().first < pos) {
+        keys.append(std::make_pair(pos, key));
+        return;
+    }
+    auto it = std::lower_bound(keys.begin(), keys.end(), pos,
+                               [](const std::pair<const char *, StringView> &entry, const char *p) {
+                                   return entry.first < p;
+                               });
+    if (it == keys.end() || it->first != pos)
+        keys.insert(it - keys.begin(), std::make_pair(pos, key));
+}
+
+const char *ValueView::readKey(const char *pos, StringView &key) const
+{
+    const char *end = mSource->end;
+    if (mSource->format == Binary) {
+        if (!has(pos, end, sizeof(uint32_t)))
+            return 0;
+        const uint32_t size = readRaw<uint32_t>(pos);
+        pos += sizeof(uint32_t);
+        if (!has(pos, end, size))
+            return 0;
+        key = StringView(pos, size);
+        return pos + size;
+    }
+    const char *definition = pos;
+    uint64_t index;
+    if (!readVarint(pos, index))
+        return 0;
+    if (!index) {
+        uint64_t size;
+        if (!readVarint(pos, size) || !has(pos, end, size))
+            return 0;
+        key = StringView(pos, size);
+        recordKey(definition, key);
+        return pos + size;
+    }
+    const List<String> &initialKeys = mSource->initialKeys;
+    if (index <= initialKeys.size()) {
+        key = initialKeys.at(index - 1);
+        return pos;
+    }
+    index -= initialKeys.size();
+    if (index > mSource->keys.size())
+        return 0;
+    key = mSource->keys.at(index - 1).second;
+    return pos;
+}
+
+const char *ValueView::skipBinary(const char *pos) const
+{
+    const char *end = mSource->end;
+    const bool compact = mSource->format == CompactBinary;
+    Value::Type type;
+    if (compact) {
+        if (!has(pos, end, 1))
+            return 0;
+        type = static_cast<Value::Type>(static_cast<unsigned char>(*pos++));
+    } else {
+        if (!has(pos, end, sizeof(int)))
+            return 0;
+        type = static_cast<Value::Type>(readRaw<int>(pos));
+        pos += sizeof(int);
+    }
+
+    // length of a string, count of a list or a map
+    auto readSize = [this, compact, end](const char *&p, uint64_t &size) {
+        if (compact)
+            return readVarint(p, size);
+        if (!has(p, end, sizeof(uint32_t)))
+            return false;
+        size = readRaw<uint32_t>(p);
+        p += sizeof(uint32_t);
+        return true;
+    };
+
+    uint64_t size;
+    switch (type) {
+    case Value::Type_Invalid:
+    case Value::Type_Undefined:
+    case Value::Type_Custom:
+        return pos;
+    case Value::Type_Boolean:
+        return has(pos, end, 1) ? pos + 1 : 0;
+    case Value::Type_Double:
+        return has(pos, end, sizeof(double)) ? pos + sizeof(double) : 0;
+    case Value::Type_Integer:
+    case Value::Type_Date:
+        if (compact)
+            return readVarint(pos, size) ? pos : 0;
+        size = type == Value::Type_Integer ? sizeof(int) : sizeof(long long);
+        return has(pos, end, size) ? pos + size : 0;
+    case Value::Type_String:
+        if (!readSize(pos, size) || !has(pos, end, size))
+            return 0;
+        return pos + size;
+    case Value::Type_List:
+        if (!readSize(pos, size))
+            return 0;
+        while (size-- && pos)
+            pos = skipBinary(pos);
+        return pos;
+    case Value::Type_Map:
+        if (!readSize(pos, size))
+            return 0;
+        while (size-- && pos) {
+            StringView key;
+            pos = readKey(pos, key);
+            if (pos)
+                pos = skipBinary(pos);
+        }
+        return pos;
+    }
+    return 0;
+}
+
+const char *ValueView::walk(const std::function<bool(const StringView &key, bool escaped, const char *value)> &visitor) const
+{
+    const char *end = mSource->end;
+    if (mSource->format != JSON) {
+        const Value::Type t = type();
+        if (t != Value::Type_Map && t != Value::Type_List)
+            return 0;
+        const char *pos = mPos;
+        uint64_t size;
+        if (mSource->format == CompactBinary) {
+            ++pos;
+            if (!readVarint(pos, size))
+                return 0;
+        } else {
+            pos += sizeof(int);
+            if (!has(pos, end, sizeof(uint32_t)))
+                return 0;
+            size = readRaw<uint32_t>(pos);
+            pos += sizeof(uint32_t);
+        }
+        while (size--) {
+            StringView key;
+            if (t == Value::Type_Map && !(pos = readKey(pos, key)))
+                return 0;
+            if (!visitor(key, false, pos))
+                return pos;
+            if (!(pos = skipBinary(pos)))
+                return 0;
+        }
+        return pos;
+    }
+
+    if (!mPos || (*mPos != '{' && *mPos != '['))
+        return 0;
+    const bool object = *mPos == '{';
+    const char close = object ? '}' : ']';
+    const char *pos = skipWhitespace(mPos + 1);
+    if (pos != end && *pos == close)
+        return pos + 1;
+    while (pos != end) {
+        StringView key;
+        bool escaped = false;
+        if (object) {
+            if (*pos != '"')
+                return 0;
+            const char *keyEnd = skipJSON(pos);
+            if (!keyEnd)
+                return 0;
+            key = StringView(pos + 1, keyEnd - pos - 2);
+            escaped = memchr(key.data(), '\\', key.size());
+            pos = skipWhitespace(keyEnd);
+            if (pos == end || *pos != ':')
+                return 0;
+            pos = skipWhitespace(pos + 1);
+        }
+        if (!visitor(key, escaped, pos))
+            return pos;
+        pos = skipJSON(pos);
+        if (!pos)
+            return 0;
+        pos = skipWhitespace(pos);
+        if (pos == end)
+            return 0;
+        if (*pos == close)
+            return pos + 1;
+        if (*pos != ',')
+            return 0;
+        pos = skipWhitespace(pos + 1);
+    }
+    return 0;
+}
+
+// keys with escapes, the quotes are right around them
+static String unescapeKey(const StringView &key)
+{
+    return Value::fromJSON(key.data() - 1, key.size() + 2, 0).toString();
+}
+
+int ValueView::count() const
+{
+    int count = 0;
+    if (!walk([&count](const StringView &, bool, const char *) { ++count; return true; }))
+        return 0;
+    return count;
+}
+
+ValueView ValueView::value(const String &key) const
+{
+    const char *found = 0;
+    if (type() != Value::Type_Map)
+        return ValueView();
+    walk([&key, &found](const StringView &k, bool escaped, const char *value) {
+            if (escaped ? unescapeKey(k) == key : k == StringView(key)) {
+                // the last one wins, like in fromJSON() and Map
+                found = value;
+            }
+            return true;
+        });
+    return found ? ValueView(mSource, found) : ValueView();
+}
+
+ValueView ValueView::at(int idx) const
+{
+    if (idx < 0 || type() != Value::Type_List)
+        return ValueView();
+    const char *found = 0;
+    int i = 0;
+    walk([idx, &i, &found](const StringView &, bool, const char *value) {
+            if (i++ < idx)
+                return true;
+            found = value;
+            return false;
+        });
+    return found ? ValueView(mSource, found) : ValueView();
+}
+
+List<String> ValueView::keys() const
+{
+    List<String> ret;
+    if (type() != Value::Type_Map)
+        return ret;
+    walk([&ret](const StringView &key, bool escaped, const char *) {
+            ret.append(escaped ? unescapeKey(key) : key.toString());
+            return true;
+        });
+    return ret;
+}
+
+void ValueView::forEach(const std::function<bool(const StringView &key, const ValueView &value)> &visitor) const
+{
+    walk([this, &visitor](const StringView &key, bool escaped, const char *value) {
+            if (escaped) {
+                const String unescaped = unescapeKey(key);
+                return visitor(unescaped, ValueView(mSource, value));
+            }
+            return visitor(key, ValueView(mSource, value));
+        });
+}
+
+void ValueView::visit(const std::function<bool(const String &key, const ValueView &value)> &visitor) const
+{
+    const bool map = type() == Value::Type_Map;
+    walk([this, map, &visitor](const StringView &key, bool escaped, const char *value) {
+            return visitor(!map ? String() : escaped ? unescapeKey(key) : key.toString(), ValueView(mSource, value));
+        });
+}
+
+size_t ValueView::encodedSize() const
+{
+    if (!mPos)
+        return 0;
+    const char *end = skip(mPos);
+    return end ? end - mPos : 0;
+}
+
+bool ValueView::jsonNumber(double &value, bool &integer) const
+{
+    const char *end = skipJSON(mPos);
+    // the source isn't necessarily terminated after the number
+    char buf[64];
+    const size_t len = end ? end - mPos : 0;
+    if (!len || len >= sizeof(buf))
+        return false;
+    for (size_t i = 0; i < len; ++i) {
+        const char ch = mPos[i];
+        if ((ch < '0' || ch > '9') && ch != '-' && ch != '+' && ch != '.' && ch != 'e' && ch != 'E')
+            return false;
+    }
+    memcpy(buf, mPos, len);
+    buf[len] = '\0';
+    char *numberEnd;
+    if (!memchr(buf, '.', len) && !memchr(buf, 'e', len) && !memchr(buf, 'E', len)) {
+        const long long ll = strtoll(buf, &numberEnd, 10);
+        if (!*numberEnd && ll >= INT_MIN && ll <= INT_MAX) {
+            value = static_cast<double>(ll);
+            integer = true;
+            return true;
+        }
+    }
+    value = strtod(buf, &numberEnd);
+    if (*numberEnd)
+        return false;
+    // whole ones that fit in an int are integers, like in fromJSON()
+    integer = value >= INT_MIN && value <= INT_MAX && value == static_cast<int>(value);
+    return true;
+}
+
+bool ValueView::toBool() const
+{
+    if (mPos && mSource->format == JSON && (*mPos == 't' || *mPos == 'f')) {
+        const char *end = skipJSON(mPos);
+        if (end - mPos == 4 && !memcmp(mPos, "true", 4))
+            return true;
+        if (end - mPos == 5 && !memcmp(mPos, "false", 5))
+            return false;
+    }
+    return toValue().toBool();
+}
+
+int ValueView::toInteger() const
+{
+    double value;
+    bool integer;
+    if (mPos && mSource->format == JSON && jsonNumber(value, integer))
+        return static_cast<int>(integer ? value : round(value));
+    return toValue().toInteger();
+}
+
+long long ValueView::toLongLong() const
+{
+    double value;
+    bool integer;
+    if (mPos && mSource->format == JSON && jsonNumber(value, integer))
+        return static_cast<long long>(integer ? value : round(value));
+    return toValue().toLongLong();
+}
+
+double ValueView::toDouble() const
+{
+    double value;
+    bool integer;
+    if (mPos && mSource->format == JSON && jsonNumber(value, integer))
+        return value;
+    return toValue().toDouble();
+}
+
+String ValueView::toString() const
+{
+    if (mPos && mSource->format == JSON && *mPos == '"') {
+        const char *end = skipJSON(mPos);
+        if (end && !memchr(mPos + 1, '\\', end - mPos - 2))
+            return String(mPos + 1, end - mPos - 2);
+    }
+    return toValue().toString();
+}
+
+Value ValueView::toValue() const
+{
+    if (!mPos)
+        return Value();
+    const char *end = skip(mPos);
+    if (!end)
+        return Value();
+    if (mSource->format == JSON)
+        return Value::fromJSON(mPos, end - mPos, 0);
+
+    Deserializer deserializer(mPos, end - mPos);
+    if (mSource->format == CompactBinary) {
+        deserializer.setCompact(true);
+        // the keys defined before the view, which its maps can refer to
+        for (const String &key : mSource->initialKeys)
+            deserializer.addKey(key);
+        for (const auto &key : mSource->keys) {
+            if (key.first >= mPos)
+                break;
+            deserializer.addKey(key.second.toString());
+        }
+    }
+    Value ret;
+    deserializer >> ret;
+    return ret;
+}
+
+Deserializer &operator>>(Deserializer &deserializer, ValueView &view)
+{
+    const int available = deserializer.length() - deserializer.pos();
+    if (available <= 0) {
+        view = ValueView();
+        return deserializer;
+    }
+    const char *data = deserializer.peekView(available);
+    view = ValueView::fromBinary(data, available, deserializer.isCompact(), deserializer.keys());
+    const char *end = view.skip(data);
+    if (!end) {
+        view = ValueView();
+        return deserializer;
+    }
+    view.mSource->end = end;
+    // what follows can refer to the keys defined in the value
+    for (const auto &key : view.mSource->keys)
+        deserializer.addKey(key.second.toString());
+    deserializer.view(end - data);
+    return deserializer;
+}
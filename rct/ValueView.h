@@ -0,0 +1,119 @@
+#ifndef VALUEVIEW_H
+#define VALUEVIEW_H
+
+#include <functional>
+#include <memory>
+
+#include <rct/List.h>
+#include <rct/Serializer.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+#include <rct/Value.h>
+
+// A read only Value over JSON text or the binary Value encoding, decoded
+// as it's used. Looking up a member or an element steps over the ones
+// before it without decoding or allocating anything, scalars are decoded
+// when they're read, so taking two fields out of a big document costs
+// about as much as finding them:
+//
+//     const ValueView config = ValueView::fromJSON(contents);
+//     const int jobs = config["build"]["jobs"].toInteger();
+//
+// Views point into the source, which has to outlive them and every view
+// taken from them. Views of the same source share some state and
+// aren't thread safe. Malformed data reads as invalid views.
+class ValueView
+{
+public:
+    ValueView()
+        : mPos(0)
+    {}
+
+    static ValueView fromJSON(const char *json, size_t size);
+    static ValueView fromJSON(const String &json) { return fromJSON(json.constData(), json.size()); }
+    // what operator<<(Serializer &, const Value &) wrote, in the compact
+    // format with compact, keys are the map keys the serializer had
+    // written before, see Deserializer::keys()
+    static ValueView fromBinary(const char *data, size_t size, bool compact = false,
+                                const List<String> &keys = List<String>());
+
+    bool isValid() const { return mPos != 0; }
+    Value::Type type() const;
+    bool isMap() const { return type() == Value::Type_Map; }
+    bool isList() const { return type() == Value::Type_List; }
+    bool isString() const { return type() == Value::Type_String; }
+
+    // JSON strings, numbers and booleans are read straight from the
+    // text, the rest like the Value would be
+    bool toBool() const;
+    int toInteger() const;
+    long long toLongLong() const;
+    double toDouble() const;
+    String toString() const;
+    // decodes everything under the view
+    Value toValue() const;
+
+    // members of a map or elements of a list
+    int count() const;
+    // an invalid view if there's no such member or element
+    ValueView operator[](const String &key) const { return value(key); }
+    ValueView value(const String &key) const;
+    ValueView at(int idx) const;
+    bool contains(const String &key) const { return value(key).isValid(); }
+    List<String> keys() const;
+    // calls visitor with every member of a map, with an empty key for the
+    // elements of a list, until it returns false
+    void visit(const std::function<bool(const String &key, const ValueView &value)> &visitor) const;
+    // visit() without copying the keys, they're only good during the call
+    void forEach(const std::function<bool(const StringView &key, const ValueView &value)> &visitor) const;
+
+    // bytes of the source the view covers
+    size_t encodedSize() const;
+
+private:
+    enum Format {
+        JSON,
+        Binary,
+        CompactBinary
+    };
+    struct Source
+    {
+        const char *end;
+        Format format;
+        // For the compact format, the keys the serializer had before and
+        // the ones defined in the source, by position. Everything before
+        // a view has been stepped over by the time the view exists, so the
+        // ones defined before it are all here.
+        List<String> initialKeys;
+        List<std::pair<const char *, StringView> > keys;
+    };
+
+    ValueView(const std::shared_ptr<Source> &source, const char *pos)
+        : mSource(source), mPos(pos)
+    {}
+
+    // calls visitor with the key and position of each member or element,
+    // returns where the container ends or 0 if it's malformed
+    const char *walk(const std::function<bool(const StringView &key, bool escaped, const char *value)> &visitor) const;
+    const char *skip(const char *pos) const;
+    const char *skipJSON(const char *pos) const;
+    const char *skipBinary(const char *pos) const;
+    const char *readKey(const char *pos, StringView &key) const;
+    void recordKey(const char *pos, const StringView &key) const;
+    bool readVarint(const char *&pos, uint64_t &value) const;
+    const char *skipWhitespace(const char *pos) const;
+    // the JSON number at mPos, integer if it's one the way fromJSON() sees it
+    bool jsonNumber(double &value, bool &integer) const;
+
+    std::shared_ptr<Source> mSource;
+    const char *mPos;
+
+    friend Deserializer &operator>>(Deserializer &deserializer, ValueView &view);
+};
+
+// The Value at the deserializer's position, which is stepped over. The
+// view points into the deserializer's data, or its storage when that isn't
+// contiguous, and can't outlive it.
+Deserializer &operator>>(Deserializer &deserializer, ValueView &view);
+
+#endif
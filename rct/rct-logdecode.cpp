@@ -0,0 +1,77 @@
+// Prints the messages of binary logs, see BinaryLog.h
+//
+//     rct-logdecode [--utc] [--no-location] file...
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "BinaryLog.h"
+
+static const char *levelName(LogLevel level)
+{
+    if (level == LogLevel::Error)
+        return "error";
+    if (level == LogLevel::Warning)
+        return "warning";
+    if (level == LogLevel::Debug)
+        return "debug";
+    if (level == LogLevel::VerboseDebug)
+        return "verbose";
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bool utc = false, location = true;
+    int files = 0, ret = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--utc")) {
+            utc = true;
+            continue;
+        } else if (!strcmp(argv[i], "--no-location")) {
+            location = false;
+            continue;
+        } else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+            printf("Usage: %s [--utc] [--no-location] file...\n", argv[0]);
+            return 0;
+        }
+        ++files;
+        BinaryLogReader reader;
+        if (!reader.open(argv[i])) {
+            fprintf(stderr, "%s\n", reader.error().constData());
+            ret = 1;
+            continue;
+        }
+        BinaryLogReader::Entry entry;
+        while (reader.next(entry)) {
+            const time_t seconds = entry.time / 1000000000;
+            struct tm tm;
+            if (utc) {
+                gmtime_r(&seconds, &tm);
+            } else {
+                localtime_r(&seconds, &tm);
+            }
+            char date[32];
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+            printf("%s.%06u [%u]", date, static_cast<unsigned>(entry.time % 1000000000 / 1000), entry.thread);
+            if (const char *level = levelName(entry.level))
+                printf(" %s", level);
+            if (location && !entry.file.isEmpty())
+                printf(" %s:%d", entry.file.constData(), entry.line);
+            printf(": ");
+            fwrite(entry.message.constData(), entry.message.size(), 1, stdout);
+            if (!entry.message.endsWith('\n'))
+                fputc('\n', stdout);
+        }
+        if (!reader.error().isEmpty()) {
+            fprintf(stderr, "%s: %s\n", argv[i], reader.error().constData());
+            ret = 1;
+        }
+    }
+    if (!files) {
+        fprintf(stderr, "Usage: %s [--utc] [--no-location] file...\n", argv[0]);
+        return 1;
+    }
+    return ret;
+}
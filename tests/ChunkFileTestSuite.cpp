@@ -0,0 +1,224 @@
+#include <ChunkFileTestSuite.h>
+#include <algorithm>
+#include <stdlib.h>
+#include <unistd.h>
+#include <rct/ChunkFile.h>
+#include <rct/Map.h>
+#include <rct/String.h>
+
+enum { Version = 3 };
+
+void ChunkFileTestSuite::setUp()
+{
+    char dir[] = "/tmp/rct-chunkfile-XXXXXX";
+    CPPUNIT_ASSERT(mkdtemp(dir));
+    mDir = Path(dir).ensureTrailingSlash();
+    mPath = mDir + "chunks";
+}
+
+void ChunkFileTestSuite::tearDown()
+{
+    Path::rmdir(mDir);
+}
+
+static bool equal(const List<uint32_t> &l, const List<uint32_t> &r)
+{
+    return l.size() == r.size() && std::equal(l.begin(), l.end(), r.begin());
+}
+
+static String contents(const ChunkFile &file, uint32_t id)
+{
+    String data;
+    return file.read(id, data) ? data : String("<missing>");
+}
+
+void ChunkFileTestSuite::testRoundTrip()
+{
+    Map<String, int> map;
+    map["one"] = 1;
+    map["two"] = 2;
+    {
+        ChunkFile file(mPath, Version);
+        CPPUNIT_ASSERT(file.open(ChunkFile::Write));
+        CPPUNIT_ASSERT(file.write(1, String("first chunk")));
+        CPPUNIT_ASSERT(file.write(7, String()));
+        CPPUNIT_ASSERT(file.serialize(9, map));
+        // nothing is in place before the commit
+        CPPUNIT_ASSERT(!mPath.exists());
+        CPPUNIT_ASSERT(file.commit());
+        CPPUNIT_ASSERT(mPath.exists());
+    }
+
+    ChunkFile file(mPath, Version);
+    CPPUNIT_ASSERT(file.open(ChunkFile::Read));
+    CPPUNIT_ASSERT(equal(file.chunks(), List<uint32_t>() << 1 << 7 << 9));
+    CPPUNIT_ASSERT(contents(file, 1) == "first chunk");
+    CPPUNIT_ASSERT(file.view(1) == "first chunk");
+    CPPUNIT_ASSERT_EQUAL(static_cast<int64_t>(11), file.chunkSize(1));
+    CPPUNIT_ASSERT(contents(file, 7).isEmpty());
+    CPPUNIT_ASSERT_EQUAL(static_cast<int64_t>(-1), file.chunkSize(8));
+    CPPUNIT_ASSERT(!file.contains(8));
+    String data;
+    CPPUNIT_ASSERT(!file.read(8, data));
+    Map<String, int> read;
+    CPPUNIT_ASSERT(file.deserialize(9, read));
+    CPPUNIT_ASSERT(read == map);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(0), file.wastedSize());
+}
+
+void ChunkFileTestSuite::testAppend()
+{
+    {
+        ChunkFile file(mPath, Version);
+        CPPUNIT_ASSERT(file.open(ChunkFile::Append));
+        CPPUNIT_ASSERT(file.write(1, String("one")));
+        CPPUNIT_ASSERT(file.write(2, String("two")));
+        CPPUNIT_ASSERT(file.write(3, String("three")));
+        CPPUNIT_ASSERT(file.commit());
+    }
+    const int64_t size = mPath.fileSize();
+    {
+        ChunkFile file(mPath, Version);
+        CPPUNIT_ASSERT(file.open(ChunkFile::Append));
+        CPPUNIT_ASSERT(contents(file, 2) == "two");
+        CPPUNIT_ASSERT(file.write(2, String("TWO")));
+        CPPUNIT_ASSERT(file.remove(3));
+        CPPUNIT_ASSERT(!file.remove(3));
+        // the destructor commits
+    }
+    // appended, not rewritten
+    CPPUNIT_ASSERT(mPath.fileSize() > size);
+
+    ChunkFile file(mPath, Version);
+    CPPUNIT_ASSERT(file.open(ChunkFile::Read));
+    CPPUNIT_ASSERT(equal(file.chunks(), List<uint32_t>() << 1 << 2));
+    CPPUNIT_ASSERT(contents(file, 1) == "one");
+    CPPUNIT_ASSERT(contents(file, 2) == "TWO");
+    CPPUNIT_ASSERT(file.wastedSize() > 0);
+}
+
+void ChunkFileTestSuite::testCompact()
+{
+    const String big(4096, 'x');
+    {
+        ChunkFile file(mPath, Version);
+        CPPUNIT_ASSERT(file.open(ChunkFile::Write));
+        for (uint32_t id = 0; id < 10; ++id)
+            CPPUNIT_ASSERT(file.write(id, big + String::number(id)));
+        CPPUNIT_ASSERT(file.commit());
+        for (uint32_t id = 0; id < 10; id += 2)
+            CPPUNIT_ASSERT(file.remove(id));
+        CPPUNIT_ASSERT(file.write(1, String("small")));
+        CPPUNIT_ASSERT(file.commit());
+        CPPUNIT_ASSERT(file.wastedSize() > 5 * big.size());
+        CPPUNIT_ASSERT(file.compact());
+        CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(0), file.wastedSize());
+        // still appendable afterwards
+        CPPUNIT_ASSERT(file.write(20, String("after")));
+        CPPUNIT_ASSERT(file.commit());
+    }
+    CPPUNIT_ASSERT(mPath.fileSize() < static_cast<int64_t>(5 * big.size() + 1024));
+
+    ChunkFile file(mPath, Version);
+    CPPUNIT_ASSERT(file.open(ChunkFile::Read));
+    CPPUNIT_ASSERT(equal(file.chunks(), List<uint32_t>() << 1 << 3 << 5 << 7 << 9 << 20));
+    CPPUNIT_ASSERT(contents(file, 1) == "small");
+    CPPUNIT_ASSERT(contents(file, 7) == big + "7");
+    CPPUNIT_ASSERT(contents(file, 20) == "after");
+}
+
+void ChunkFileTestSuite::testUnfinishedCommit()
+{
+    uint64_t committed;
+    {
+        ChunkFile file(mPath, Version);
+        CPPUNIT_ASSERT(file.open(ChunkFile::Write));
+        CPPUNIT_ASSERT(file.write(1, String("old")));
+        CPPUNIT_ASSERT(file.commit());
+        committed = file.fileSize();
+        CPPUNIT_ASSERT(file.write(1, String("new")));
+        CPPUNIT_ASSERT(file.write(2, String("added")));
+        CPPUNIT_ASSERT(file.commit());
+    }
+    // cut into the last end record, like a crash in the middle of writing it
+    CPPUNIT_ASSERT(!truncate(mPath.constData(), mPath.fileSize() - 5));
+    {
+        ChunkFile file(mPath, Version);
+        CPPUNIT_ASSERT(file.open(ChunkFile::Read));
+        CPPUNIT_ASSERT(equal(file.chunks(), List<uint32_t>() << 1));
+        CPPUNIT_ASSERT(contents(file, 1) == "old");
+    }
+    {
+        // appending drops the tail
+        ChunkFile file(mPath, Version);
+        CPPUNIT_ASSERT(file.open(ChunkFile::Append));
+        CPPUNIT_ASSERT_EQUAL(committed, file.fileSize());
+        CPPUNIT_ASSERT_EQUAL(committed, static_cast<uint64_t>(mPath.fileSize()));
+        CPPUNIT_ASSERT(file.write(3, String("three")));
+        CPPUNIT_ASSERT(file.commit());
+    }
+    ChunkFile file(mPath, Version);
+    CPPUNIT_ASSERT(file.open(ChunkFile::Read));
+    CPPUNIT_ASSERT(equal(file.chunks(), List<uint32_t>() << 1 << 3));
+    CPPUNIT_ASSERT(contents(file, 3) == "three");
+
+    // a file with no complete commit at all
+    String data = mPath.readAll();
+    CPPUNIT_ASSERT(Path::write(mPath, data.left(40)));
+    ChunkFile torn(mPath, Version);
+    CPPUNIT_ASSERT(!torn.open(ChunkFile::Read));
+    CPPUNIT_ASSERT(!torn.error().isEmpty());
+}
+
+void ChunkFileTestSuite::testCorruptChunk()
+{
+    {
+        ChunkFile file(mPath, Version);
+        CPPUNIT_ASSERT(file.open(ChunkFile::Write));
+        CPPUNIT_ASSERT(file.write(1, String("intact payload")));
+        CPPUNIT_ASSERT(file.write(2, String("damaged payload")));
+        CPPUNIT_ASSERT(file.commit());
+    }
+    String data = mPath.readAll();
+    const size_t pos = data.indexOf("damaged");
+    CPPUNIT_ASSERT(pos != String::npos);
+    data[pos] = 'D';
+    CPPUNIT_ASSERT(Path::write(mPath, data));
+
+    ChunkFile file(mPath, Version);
+    CPPUNIT_ASSERT(file.open(ChunkFile::Read));
+    CPPUNIT_ASSERT(file.contains(2));
+    String chunk;
+    CPPUNIT_ASSERT(!file.read(2, chunk));
+    CPPUNIT_ASSERT(file.view(2).isEmpty());
+    CPPUNIT_ASSERT(contents(file, 1) == "intact payload");
+
+    // a damaged table makes the commit unusable
+    data = mPath.readAll();
+    data[data.size() - 30] ^= 1;
+    CPPUNIT_ASSERT(Path::write(mPath, data));
+    ChunkFile table(mPath, Version);
+    CPPUNIT_ASSERT(!table.open(ChunkFile::Read));
+}
+
+void ChunkFileTestSuite::testInvalidFile()
+{
+    ChunkFile missing(mPath, Version);
+    CPPUNIT_ASSERT(!missing.open(ChunkFile::Read));
+    CPPUNIT_ASSERT(missing.error().isEmpty());
+
+    CPPUNIT_ASSERT(Path::write(mPath, String("not a chunk file at all, just text")));
+    ChunkFile text(mPath, Version);
+    CPPUNIT_ASSERT(!text.open(ChunkFile::Read));
+    CPPUNIT_ASSERT(text.error().contains("is not a chunk file"));
+    CPPUNIT_ASSERT(!text.open(ChunkFile::Append));
+
+    {
+        ChunkFile file(mPath, Version);
+        CPPUNIT_ASSERT(file.open(ChunkFile::Write));
+        CPPUNIT_ASSERT(file.write(1, String("data")));
+    }
+    ChunkFile other(mPath, Version + 1);
+    CPPUNIT_ASSERT(!other.open(ChunkFile::Read));
+    CPPUNIT_ASSERT(other.error().startsWith("Wrong database version"));
+}
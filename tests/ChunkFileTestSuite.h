@@ -0,0 +1,33 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include <rct/Path.h>
+
+class ChunkFileTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(ChunkFileTestSuite);
+
+    CPPUNIT_TEST(testRoundTrip);
+    CPPUNIT_TEST(testAppend);
+    CPPUNIT_TEST(testCompact);
+    CPPUNIT_TEST(testUnfinishedCommit);
+    CPPUNIT_TEST(testCorruptChunk);
+    CPPUNIT_TEST(testInvalidFile);
+
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp() override;
+    void tearDown() override;
+
+protected:
+    void testRoundTrip();
+    void testAppend();
+    void testCompact();
+    void testUnfinishedCommit();
+    void testCorruptChunk();
+    void testInvalidFile();
+
+private:
+    Path mDir, mPath;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(ChunkFileTestSuite);
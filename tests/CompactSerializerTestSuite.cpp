@@ -0,0 +1,166 @@
+#include <CompactSerializerTestSuite.h>
+#include <rct/List.h>
+#include <rct/Serializer.h>
+#include <rct/String.h>
+#include <rct/Value.h>
+
+#include <limits>
+
+template <typename T>
+static String encode(const T &t, bool compact = true)
+{
+    String data;
+    Serializer serializer(data);
+    serializer.setCompact(compact);
+    serializer << t;
+    return data;
+}
+
+template <typename T>
+static T decode(const String &data, bool compact = true)
+{
+    T t = T();
+    Deserializer deserializer(data);
+    deserializer.setCompact(compact);
+    deserializer >> t;
+    CPPUNIT_ASSERT(deserializer.atEnd());
+    return t;
+}
+
+template <typename T>
+static void roundTrip(T t)
+{
+    CPPUNIT_ASSERT_EQUAL(t, decode<T>(encode(t)));
+}
+
+void CompactSerializerTestSuite::testVarintSizes()
+{
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), encode<uint32_t>(0).size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), encode<uint32_t>(127).size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), encode<uint32_t>(128).size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(5), encode<uint32_t>(0xffffffff).size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(10), encode<uint64_t>(std::numeric_limits<uint64_t>::max()).size());
+    CPPUNIT_ASSERT(encode<uint32_t>(300) == String("\xac\x02", 2));
+
+    // signed ones are zigzagged, small negative numbers stay small
+    CPPUNIT_ASSERT(encode<int>(-1) == String("\x01", 1));
+    CPPUNIT_ASSERT(encode<int>(1) == String("\x02", 1));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), encode<int64_t>(-64).size());
+
+    // bytes and floating point are written as they are
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), encode<char>('x').size());
+    CPPUNIT_ASSERT_EQUAL(sizeof(double), encode<double>(1.0).size());
+
+    // and nothing changes without setCompact()
+    CPPUNIT_ASSERT_EQUAL(Serializer::sizeOf<uint32_t>(), encode<uint32_t>(1, false).size());
+}
+
+void CompactSerializerTestSuite::testIntegerRoundTrip()
+{
+    roundTrip<int16_t>(std::numeric_limits<int16_t>::min());
+    roundTrip<uint16_t>(std::numeric_limits<uint16_t>::max());
+    roundTrip<int>(std::numeric_limits<int>::min());
+    roundTrip<int>(std::numeric_limits<int>::max());
+    roundTrip<int>(0);
+    roundTrip<unsigned int>(std::numeric_limits<unsigned int>::max());
+    roundTrip<int64_t>(std::numeric_limits<int64_t>::min());
+    roundTrip<int64_t>(std::numeric_limits<int64_t>::max());
+    roundTrip<uint64_t>(std::numeric_limits<uint64_t>::max());
+    roundTrip<double>(-0.125);
+    for (int i = -100000; i < 100000; i += 37)
+        roundTrip<int>(i);
+}
+
+void CompactSerializerTestSuite::testStringsAndLists()
+{
+    // the length is a varint too
+    const String text = "hello";
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(6), encode(text).size());
+    CPPUNIT_ASSERT(decode<String>(encode(text)) == text);
+    const String longText(1000, 'x');
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1002), encode(longText).size());
+    CPPUNIT_ASSERT(decode<String>(encode(longText)) == longText);
+
+    // lists of native types stay one raw block after the count
+    List<int> ints;
+    for (int i = 0; i < 100; ++i)
+        ints.append(i - 50);
+    CPPUNIT_ASSERT_EQUAL(1 + 100 * sizeof(int), encode(ints).size());
+    const List<int> intsBack = decode<List<int> >(encode(ints));
+    CPPUNIT_ASSERT(std::equal(ints.begin(), ints.end(), intsBack.begin()));
+
+    List<String> strings;
+    strings << "a" << "" << "ccc";
+    const List<String> stringsBack = decode<List<String> >(encode(strings));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), stringsBack.size());
+    CPPUNIT_ASSERT(stringsBack[2] == "ccc");
+}
+
+void CompactSerializerTestSuite::testValueRoundTrip()
+{
+    Value value;
+    value["small"] = 1;
+    // the default format truncates integers to int, the compact one doesn't
+    value["big"] = static_cast<long long>(1) << 40;
+    value["negative"] = -(static_cast<long long>(1) << 50);
+    value["double"] = 2.5;
+    value["bool"] = false;
+    value["string"] = String("text");
+    value["list"] = List<Value>() << Value(1) << Value(String("two"));
+    value["map"]["nested"] = 3;
+
+    const Value back = decode<Value>(encode(value));
+    CPPUNIT_ASSERT(back.toJSON() == value.toJSON());
+    CPPUNIT_ASSERT_EQUAL(static_cast<long long>(1) << 40, back["big"].toLongLong());
+    CPPUNIT_ASSERT_EQUAL(-(static_cast<long long>(1) << 50), back["negative"].toLongLong());
+    CPPUNIT_ASSERT(back["list"].isList());
+    CPPUNIT_ASSERT_EQUAL(3, back["map"]["nested"].toInteger());
+}
+
+void CompactSerializerTestSuite::testSharedKeys()
+{
+    List<Value> list;
+    for (int i = 0; i < 200; ++i) {
+        Value entry;
+        entry["directory"] = String("/src");
+        entry["file"] = String::format<32>("file%d.cpp", i);
+        entry["id"] = i;
+        list.append(entry);
+    }
+    const Value value(list);
+    const String compact = encode(value);
+    const String fixed = encode(value, false);
+    // each key is written once, after that by index
+    const String key("directory");
+    CPPUNIT_ASSERT(compact.indexOf(key) != String::npos);
+    CPPUNIT_ASSERT_EQUAL(compact.indexOf(key), compact.lastIndexOf(key));
+    CPPUNIT_ASSERT(compact.size() * 2 < fixed.size());
+
+    const Value back = decode<Value>(compact);
+    CPPUNIT_ASSERT(back.toJSON() == value.toJSON());
+    CPPUNIT_ASSERT(decode<Value>(fixed, false).toJSON() == value.toJSON());
+}
+
+void CompactSerializerTestSuite::testMalformed()
+{
+    // a varint that runs past the end stops there
+    const String truncated("\xff\xff", 2);
+    Deserializer deserializer(truncated);
+    deserializer.setCompact(true);
+    uint64_t value = 0;
+    deserializer >> value;
+    CPPUNIT_ASSERT(deserializer.atEnd());
+
+    // a key index that wasn't defined reads as an empty key
+    String data;
+    {
+        Serializer serializer(data);
+        serializer.setCompact(true);
+        serializer.writeVarint(5);
+    }
+    Deserializer keys(data);
+    keys.setCompact(true);
+    String key = "stale";
+    keys.readKey(key);
+    CPPUNIT_ASSERT(key.isEmpty());
+}
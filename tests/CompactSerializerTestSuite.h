@@ -0,0 +1,25 @@
+#include <cppunit/extensions/HelperMacros.h>
+
+class CompactSerializerTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(CompactSerializerTestSuite);
+
+    CPPUNIT_TEST(testVarintSizes);
+    CPPUNIT_TEST(testIntegerRoundTrip);
+    CPPUNIT_TEST(testStringsAndLists);
+    CPPUNIT_TEST(testValueRoundTrip);
+    CPPUNIT_TEST(testSharedKeys);
+    CPPUNIT_TEST(testMalformed);
+
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    void testVarintSizes();
+    void testIntegerRoundTrip();
+    void testStringsAndLists();
+    void testValueRoundTrip();
+    void testSharedKeys();
+    void testMalformed();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CompactSerializerTestSuite);
@@ -0,0 +1,161 @@
+#include <FlatHashTestSuite.h>
+#include <rct/FlatHash.h>
+#include <rct/Hash.h>
+#include <rct/String.h>
+
+void FlatHashTestSuite::testInsertAndFind()
+{
+    FlatHash<String, int> hash;
+    CPPUNIT_ASSERT(hash.isEmpty());
+    CPPUNIT_ASSERT(hash.insert("one", 1));
+    CPPUNIT_ASSERT(hash.insert("two", 2));
+    CPPUNIT_ASSERT(!hash.insert("one", 3));
+    hash["three"] = 3;
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), hash.size());
+    CPPUNIT_ASSERT_EQUAL(1, hash.value("one"));
+    CPPUNIT_ASSERT_EQUAL(3, hash.value("three"));
+    CPPUNIT_ASSERT(hash.find("two") != hash.end());
+    CPPUNIT_ASSERT(hash.find("four") == hash.end());
+    bool ok = true;
+    CPPUNIT_ASSERT_EQUAL(-1, hash.value("four", -1, &ok));
+    CPPUNIT_ASSERT(!ok);
+}
+
+void FlatHashTestSuite::testRehashKeepsEntries()
+{
+    FlatHash<int, int> hash;
+    size_t capacity = hash.capacity();
+    int rehashes = 0;
+    for (int i = 0; i < 10000; ++i) {
+        hash[i] = i * 2;
+        if (hash.capacity() != capacity) {
+            capacity = hash.capacity();
+            ++rehashes;
+        }
+    }
+    CPPUNIT_ASSERT(rehashes > 1);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(10000), hash.size());
+    for (int i = 0; i < 10000; ++i)
+        CPPUNIT_ASSERT_EQUAL(i * 2, hash.value(i, -1));
+
+    size_t count = 0;
+    long long sum = 0;
+    for (const auto &entry : hash) {
+        ++count;
+        sum += entry.first;
+    }
+    CPPUNIT_ASSERT_EQUAL(hash.size(), count);
+    CPPUNIT_ASSERT_EQUAL(9999LL * 10000 / 2, sum);
+
+    FlatHash<int, int> reserved;
+    reserved.reserve(1000);
+    capacity = reserved.capacity();
+    for (int i = 0; i < 1000; ++i)
+        reserved[i] = i;
+    CPPUNIT_ASSERT_EQUAL(capacity, reserved.capacity());
+}
+
+void FlatHashTestSuite::testEraseAndReinsert()
+{
+    FlatHash<int, String> hash;
+    for (int i = 0; i < 1000; ++i)
+        hash[i] = String::number(i);
+    for (int i = 0; i < 1000; i += 2)
+        CPPUNIT_ASSERT(hash.remove(i));
+    CPPUNIT_ASSERT(!hash.remove(0));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(500), hash.size());
+    for (int i = 0; i < 1000; ++i)
+        CPPUNIT_ASSERT_EQUAL(i % 2 == 1, hash.contains(i));
+
+    // erased slots are reused without losing entries probing past them
+    for (int round = 0; round < 20; ++round) {
+        for (int i = 0; i < 1000; i += 2)
+            hash[i] = "again";
+        for (int i = 0; i < 1000; i += 2)
+            CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), hash.erase(i));
+    }
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(500), hash.size());
+    for (int i = 1; i < 1000; i += 2)
+        CPPUNIT_ASSERT(hash.value(i) == String::number(i));
+
+    bool ok = false;
+    CPPUNIT_ASSERT(hash.take(1, &ok) == "1");
+    CPPUNIT_ASSERT(ok);
+    CPPUNIT_ASSERT(!hash.contains(1));
+
+    hash.clear();
+    CPPUNIT_ASSERT(hash.isEmpty());
+    CPPUNIT_ASSERT(hash.begin() == hash.end());
+}
+
+void FlatHashTestSuite::testRemoveMatching()
+{
+    FlatHash<int, int> hash;
+    for (int i = 0; i < 100; ++i)
+        hash[i] = i;
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(34), hash.remove([](const int &key) { return key % 3 == 0; }));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(66), hash.size());
+    for (const auto &entry : hash)
+        CPPUNIT_ASSERT(entry.first % 3 != 0);
+}
+
+void FlatHashTestSuite::testCopyIsIndependent()
+{
+    FlatHash<String, int> hash;
+    for (int i = 0; i < 100; ++i)
+        hash[String::number(i)] = i;
+    FlatHash<String, int> copy = hash;
+    copy["0"] = -1;
+    copy.remove("1");
+    hash["100"] = 100;
+
+    CPPUNIT_ASSERT_EQUAL(0, hash.value("0"));
+    CPPUNIT_ASSERT(hash.contains("1"));
+    CPPUNIT_ASSERT(!copy.contains("100"));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(101), hash.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(99), copy.size());
+
+    FlatHash<String, int> moved = std::move(copy);
+    CPPUNIT_ASSERT_EQUAL(-1, moved.value("0"));
+    CPPUNIT_ASSERT(copy.isEmpty());
+
+    moved.unite(hash);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(101), moved.size());
+    CPPUNIT_ASSERT_EQUAL(0, moved.value("0"));
+    moved.subtract(hash);
+    CPPUNIT_ASSERT(moved.isEmpty());
+}
+
+void FlatHashTestSuite::testSerializeRoundTrip()
+{
+    FlatHash<String, int> hash;
+    for (int i = 0; i < 500; ++i)
+        hash[String::number(i)] = i * i;
+
+    String data;
+    {
+        Serializer serializer(data);
+        serializer << hash;
+    }
+    CPPUNIT_ASSERT_EQUAL(serializedSize(hash), data.size());
+
+    FlatHash<String, int> back;
+    back["stale"] = 1;
+    {
+        Deserializer deserializer(data);
+        deserializer >> back;
+    }
+    CPPUNIT_ASSERT_EQUAL(hash.size(), back.size());
+    for (const auto &entry : hash)
+        CPPUNIT_ASSERT_EQUAL(entry.second, back.value(entry.first, -1));
+
+    // the format is Hash's
+    Hash<String, int> other;
+    {
+        Deserializer deserializer(data);
+        deserializer >> other;
+    }
+    CPPUNIT_ASSERT_EQUAL(hash.size(), other.size());
+    CPPUNIT_ASSERT_EQUAL(49 * 49, other.value("49"));
+}
@@ -0,0 +1,25 @@
+#include <cppunit/extensions/HelperMacros.h>
+
+class FlatHashTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(FlatHashTestSuite);
+
+    CPPUNIT_TEST(testInsertAndFind);
+    CPPUNIT_TEST(testRehashKeepsEntries);
+    CPPUNIT_TEST(testEraseAndReinsert);
+    CPPUNIT_TEST(testRemoveMatching);
+    CPPUNIT_TEST(testCopyIsIndependent);
+    CPPUNIT_TEST(testSerializeRoundTrip);
+
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    void testInsertAndFind();
+    void testRehashKeepsEntries();
+    void testEraseAndReinsert();
+    void testRemoveMatching();
+    void testCopyIsIndependent();
+    void testSerializeRoundTrip();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(FlatHashTestSuite);
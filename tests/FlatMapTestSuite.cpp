@@ -0,0 +1,189 @@
+#include <FlatMapTestSuite.h>
+#include <rct/FlatMap.h>
+#include <rct/FlatSet.h>
+#include <rct/Map.h>
+#include <rct/String.h>
+
+template <typename T>
+static bool equal(const List<T> &l, const List<T> &r)
+{
+    return l.size() == r.size() && std::equal(l.begin(), l.end(), r.begin());
+}
+
+void FlatMapTestSuite::testFromUnsorted()
+{
+    List<std::pair<int, String> > entries;
+    entries.append(std::make_pair(3, String("c")));
+    entries.append(std::make_pair(1, String("a")));
+    entries.append(std::make_pair(2, String("b")));
+    entries.append(std::make_pair(1, String("last")));
+    const FlatMap<int, String> map = FlatMap<int, String>::fromUnsorted(std::move(entries));
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), map.size());
+    CPPUNIT_ASSERT(equal(map.keys(), List<int>() << 1 << 2 << 3));
+    // of entries with the same key the last one wins
+    CPPUNIT_ASSERT(map.value(1) == "last");
+    CPPUNIT_ASSERT(map.value(3) == "c");
+    CPPUNIT_ASSERT(!map.contains(4));
+}
+
+void FlatMapTestSuite::testInsertSorted()
+{
+    Map<int, int> source;
+    for (int i = 0; i < 100; i += 2)
+        source[i] = i;
+    FlatMap<int, int> map;
+    map.insertSorted(source.begin(), source.end());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(50), map.size());
+
+    // merged into the middle, replacing what's there
+    Map<int, int> more;
+    for (int i = 51; i < 60; ++i)
+        more[i] = -i;
+    map.insertSorted(more.begin(), more.end());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(55), map.size());
+    CPPUNIT_ASSERT_EQUAL(-52, map.value(52));
+    CPPUNIT_ASSERT_EQUAL(-53, map.value(53));
+    CPPUNIT_ASSERT_EQUAL(60, map.value(60));
+
+    int previous = -1;
+    for (const auto &entry : map) {
+        CPPUNIT_ASSERT(entry.first > previous);
+        previous = entry.first;
+    }
+}
+
+void FlatMapTestSuite::testInsertAndRemove()
+{
+    FlatMap<String, int> map;
+    CPPUNIT_ASSERT(map.insert("b", 2));
+    CPPUNIT_ASSERT(map.insert("a", 1));
+    CPPUNIT_ASSERT(!map.insert("a", 3));
+    map["c"] = 3;
+    CPPUNIT_ASSERT(equal(map.keys(), List<String>() << "a" << "b" << "c"));
+    CPPUNIT_ASSERT_EQUAL(1, map.value("a"));
+
+    int value = 0;
+    CPPUNIT_ASSERT(map.remove("b", &value));
+    CPPUNIT_ASSERT_EQUAL(2, value);
+    CPPUNIT_ASSERT(!map.remove("b"));
+    CPPUNIT_ASSERT(map.find("b") == map.end());
+    CPPUNIT_ASSERT(map.lower_bound("b")->first == "c");
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), map.remove([](const String &key) { return key == "a"; }));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), map.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), map.values().size());
+}
+
+void FlatMapTestSuite::testUnite()
+{
+    FlatMap<int, int> map = { { 1, 1 }, { 2, 2 }, { 3, 3 } };
+    const FlatMap<int, int> other = { { 2, 20 }, { 4, 4 } };
+    size_t count = 0;
+    map.unite(other, &count);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), count);
+    CPPUNIT_ASSERT(equal(map.keys(), List<int>() << 1 << 2 << 3 << 4));
+    CPPUNIT_ASSERT_EQUAL(20, map.value(2));
+
+    // with itself nothing changes
+    count = 0;
+    map.unite(map, &count);
+    map += map;
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), count);
+    CPPUNIT_ASSERT(equal(map.keys(), List<int>() << 1 << 2 << 3 << 4));
+    CPPUNIT_ASSERT(equal(map.values(), List<int>() << 1 << 20 << 3 << 4));
+
+    map -= other;
+    CPPUNIT_ASSERT(equal(map.keys(), List<int>() << 1 << 3));
+}
+
+void FlatMapTestSuite::testSerializeRoundTrip()
+{
+    FlatMap<String, int> map;
+    for (int i = 0; i < 100; ++i)
+        map[String::number(i)] = i;
+    String data;
+    {
+        Serializer serializer(data);
+        serializer << map;
+    }
+    CPPUNIT_ASSERT_EQUAL(serializedSize(map), data.size());
+
+    FlatMap<String, int> back;
+    back["stale"] = 1;
+    {
+        Deserializer deserializer(data);
+        deserializer >> back;
+    }
+    CPPUNIT_ASSERT(equal(back.keys(), map.keys()));
+    CPPUNIT_ASSERT(equal(back.values(), map.values()));
+
+    // a writer with another order is sorted on the way in
+    FlatMap<int, int, std::greater<int> > reversed = { { 1, 10 }, { 2, 20 }, { 3, 30 } };
+    data.clear();
+    {
+        Serializer serializer(data);
+        serializer << reversed;
+    }
+    FlatMap<int, int> ascending;
+    {
+        Deserializer deserializer(data);
+        deserializer >> ascending;
+    }
+    CPPUNIT_ASSERT(equal(ascending.keys(), List<int>() << 1 << 2 << 3));
+    CPPUNIT_ASSERT_EQUAL(30, ascending.value(3));
+}
+
+void FlatMapTestSuite::testSet()
+{
+    FlatSet<int> set = { 5, 1, 3, 1 };
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), set.size());
+    CPPUNIT_ASSERT(set.insert(2));
+    CPPUNIT_ASSERT(!set.insert(2));
+    CPPUNIT_ASSERT(set.remove(5));
+    CPPUNIT_ASSERT(equal(set.toList(), List<int>() << 1 << 2 << 3));
+
+    size_t count = 0;
+    set.unite(FlatSet<int>({ 3, 4, 6 }), &count);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), count);
+    set.unite(set, &count);
+    set << set;
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), count);
+    CPPUNIT_ASSERT(equal(set.toList(), List<int>() << 1 << 2 << 3 << 4 << 6));
+
+    CPPUNIT_ASSERT(set.intersects(FlatSet<int>({ 0, 6 })));
+    CPPUNIT_ASSERT(!set.intersects(FlatSet<int>({ 0, 5 })));
+    CPPUNIT_ASSERT(equal(set.intersected(FlatSet<int>({ 2, 5, 6 })).toList(), List<int>() << 2 << 6));
+    set.subtract(FlatSet<int>({ 1, 2 }), &count);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), count);
+    CPPUNIT_ASSERT(set == FlatSet<int>({ 3, 4, 6 }));
+}
+
+void FlatMapTestSuite::testSetSerializesLikeList()
+{
+    const List<int> list = List<int>() << 9 << 3 << 3 << 7;
+    String data;
+    {
+        Serializer serializer(data);
+        serializer << list;
+    }
+    FlatSet<int> set;
+    {
+        Deserializer deserializer(data);
+        deserializer >> set;
+    }
+    CPPUNIT_ASSERT(equal(set.toList(), List<int>() << 3 << 7 << 9));
+
+    data.clear();
+    {
+        Serializer serializer(data);
+        serializer << set;
+    }
+    CPPUNIT_ASSERT_EQUAL(serializedSize(set), data.size());
+    List<int> back;
+    {
+        Deserializer deserializer(data);
+        deserializer >> back;
+    }
+    CPPUNIT_ASSERT(equal(back, set.toList()));
+}
@@ -0,0 +1,27 @@
+#include <cppunit/extensions/HelperMacros.h>
+
+class FlatMapTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(FlatMapTestSuite);
+
+    CPPUNIT_TEST(testFromUnsorted);
+    CPPUNIT_TEST(testInsertSorted);
+    CPPUNIT_TEST(testInsertAndRemove);
+    CPPUNIT_TEST(testUnite);
+    CPPUNIT_TEST(testSerializeRoundTrip);
+    CPPUNIT_TEST(testSet);
+    CPPUNIT_TEST(testSetSerializesLikeList);
+
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    void testFromUnsorted();
+    void testInsertSorted();
+    void testInsertAndRemove();
+    void testUnite();
+    void testSerializeRoundTrip();
+    void testSet();
+    void testSetSerializesLikeList();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(FlatMapTestSuite);
@@ -0,0 +1,203 @@
+#include <JSONTestSuite.h>
+#include <rct/String.h>
+#include <rct/ThreadPool.h>
+#include <rct/Value.h>
+
+static Value parse(const char *json)
+{
+    bool ok = false;
+    String error;
+    const Value value = Value::fromJSON(json, &ok, &error);
+    CPPUNIT_ASSERT_MESSAGE(error.constData(), ok);
+    CPPUNIT_ASSERT(error.isEmpty());
+    return value;
+}
+
+static String parseError(const char *json)
+{
+    bool ok = true;
+    String error;
+    const Value value = Value::fromJSON(json, &ok, &error);
+    CPPUNIT_ASSERT_MESSAGE(json, !ok);
+    CPPUNIT_ASSERT(!error.isEmpty());
+    return error;
+}
+
+void JSONTestSuite::testScalars()
+{
+    CPPUNIT_ASSERT(parse("true").isBoolean());
+    CPPUNIT_ASSERT(parse(" true ").toBool());
+    CPPUNIT_ASSERT(!parse("false").toBool());
+    CPPUNIT_ASSERT(!parse("null").isValid());
+    CPPUNIT_ASSERT(parse("\"text\"").toString() == "text");
+}
+
+void JSONTestSuite::testNumbers()
+{
+    Value value = parse("42");
+    CPPUNIT_ASSERT(value.isInteger());
+    CPPUNIT_ASSERT_EQUAL(42, value.toInteger());
+    CPPUNIT_ASSERT_EQUAL(-2147483647 - 1, parse("-2147483648").toInteger());
+    CPPUNIT_ASSERT_EQUAL(0, parse("-0").toInteger());
+
+    // whole numbers that don't fit an int are doubles
+    value = parse("2147483648");
+    CPPUNIT_ASSERT(value.isDouble());
+    CPPUNIT_ASSERT_EQUAL(2147483648.0, value.toDouble());
+    value = parse("12345678901234567890");
+    CPPUNIT_ASSERT(value.isDouble());
+
+    // and whole doubles are integers
+    value = parse("1.0e2");
+    CPPUNIT_ASSERT(value.isInteger());
+    CPPUNIT_ASSERT_EQUAL(100, value.toInteger());
+
+    CPPUNIT_ASSERT_EQUAL(0.1, parse("0.1").toDouble());
+    CPPUNIT_ASSERT_EQUAL(-1.5e-10, parse("-1.5E-10").toDouble());
+    CPPUNIT_ASSERT_EQUAL(2.5, parse("[2.5]").toList()[0].toDouble());
+}
+
+void JSONTestSuite::testStrings()
+{
+    CPPUNIT_ASSERT(parse("\"a\\\"b\\\\c\\/d\"").toString() == "a\"b\\c/d");
+    CPPUNIT_ASSERT(parse("\"\\b\\f\\n\\r\\t\"").toString() == "\b\f\n\r\t");
+    CPPUNIT_ASSERT(parse("\"\\u0041\\u00e9\\u20ac\"").toString() == "A\xc3\xa9\xe2\x82\xac");
+    // a surrogate pair is one code point
+    CPPUNIT_ASSERT(parse("\"\\ud83d\\ude00\"").toString() == "\xf0\x9f\x98\x80");
+    CPPUNIT_ASSERT(parse("\"\"").toString().isEmpty());
+
+    // long enough for the vectorized scan, with the escape at the end
+    String longString(100, 'x');
+    const String json = "\"" + longString + "\\n\"";
+    CPPUNIT_ASSERT(Value::fromJSON(json).toString() == longString + "\n");
+}
+
+void JSONTestSuite::testContainers()
+{
+    const Value value = parse("{ \"list\": [1, \"two\", [3], {}], \"map\": {\"a\": null}, \"empty\": [] }");
+    CPPUNIT_ASSERT(value.isMap());
+    CPPUNIT_ASSERT_EQUAL(3, value.count());
+
+    const List<Value> list = value["list"].toList();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), list.size());
+    CPPUNIT_ASSERT_EQUAL(1, list[0].toInteger());
+    CPPUNIT_ASSERT(list[1].toString() == "two");
+    CPPUNIT_ASSERT_EQUAL(3, list[2].toList()[0].toInteger());
+    CPPUNIT_ASSERT(list[3].isMap());
+    CPPUNIT_ASSERT_EQUAL(0, list[3].count());
+
+    CPPUNIT_ASSERT(value["map"].contains("a"));
+    CPPUNIT_ASSERT(value["empty"].isList());
+    CPPUNIT_ASSERT_EQUAL(0, value["empty"].count());
+
+    // of duplicate keys the last one wins
+    CPPUNIT_ASSERT_EQUAL(2, parse("{\"k\": 1, \"k\": 2}")["k"].toInteger());
+}
+
+void JSONTestSuite::testRoundTrip()
+{
+    Value value;
+    value["int"] = 7;
+    value["double"] = 0.25;
+    value["bool"] = true;
+    value["string"] = String("quote \" backslash \\ newline \n tab \t");
+    List<Value> list;
+    list.append(1);
+    list.append(String("x"));
+    list.append(List<Value>());
+    value["list"] = list;
+    value["nested"]["deeper"]["deepest"] = String("bottom");
+
+    for (int pretty = 0; pretty < 2; ++pretty) {
+        const String json = value.toJSON(pretty);
+        const Value back = Value::fromJSON(json);
+        CPPUNIT_ASSERT(back.toJSON() == value.toJSON());
+        CPPUNIT_ASSERT_EQUAL(7, back["int"].toInteger());
+        CPPUNIT_ASSERT_EQUAL(0.25, back["double"].toDouble());
+        CPPUNIT_ASSERT(back["string"].toString() == value["string"].toString());
+        CPPUNIT_ASSERT(back["nested"]["deeper"]["deepest"].toString() == "bottom");
+    }
+}
+
+void JSONTestSuite::testMalformed()
+{
+    const char *inputs[] = {
+        "",
+        "   ",
+        "{",
+        "[1, 2",
+        "[1 2]",
+        "[1,]",
+        "{\"a\" 1}",
+        "{\"a\": 1,}",
+        "{a: 1}",
+        "\"unterminated",
+        "\"bad escape \\q\"",
+        "\"\\u12\"",
+        "\"\\ud83d\"",
+        "\"\\ude00\"",
+        "tru",
+        "nul",
+        "01x",
+        "-",
+        "1.",
+        "1e",
+        ".5",
+        "[1] garbage",
+        "{} {}"
+    };
+    for (const char *input : inputs)
+        parseError(input);
+
+    bool ok = true;
+    CPPUNIT_ASSERT(!Value::fromJSON("[1,", &ok).isValid());
+    CPPUNIT_ASSERT(!ok);
+    CPPUNIT_ASSERT(!Value::fromJSON(static_cast<const char *>(0), &ok).isValid());
+    CPPUNIT_ASSERT(!ok);
+}
+
+void JSONTestSuite::testErrorPosition()
+{
+    CPPUNIT_ASSERT(parseError("{\n  \"a\": 1,\n  \"b\" 2\n}") == "Expected ':' at line 3, column 7");
+    CPPUNIT_ASSERT(parseError("[1,]") == "Unexpected character at line 1, column 4");
+    CPPUNIT_ASSERT(parseError("[1] x") == "Unexpected trailing characters at line 1, column 5");
+}
+
+void JSONTestSuite::testDepthLimit()
+{
+    String deep(1024, '[');
+    deep += String(1024, ']');
+    CPPUNIT_ASSERT(parse(deep.constData()).isList());
+
+    String tooDeep(1025, '[');
+    tooDeep += String(1025, ']');
+    CPPUNIT_ASSERT(parseError(tooDeep.constData()).startsWith("Too deeply nested"));
+}
+
+void JSONTestSuite::testParallel()
+{
+    String json = "[";
+    for (int i = 0; i < 30000; ++i) {
+        if (i)
+            json += ",\n";
+        json += String::format<128>("{\"file\": \"/src/file%d.cpp\", \"id\": %d, \"list\": [%d, \"]\"]}", i, i, i);
+    }
+    json += "]";
+
+    ThreadPool pool(4);
+    bool ok = false;
+    String error;
+    const Value value = Value::fromJSONParallel(json, &pool, &ok, &error);
+    CPPUNIT_ASSERT_MESSAGE(error.constData(), ok);
+    CPPUNIT_ASSERT(value.toJSON() == Value::fromJSON(json).toJSON());
+    CPPUNIT_ASSERT_EQUAL(30000, value.count());
+    CPPUNIT_ASSERT(json.size() > 1024 * 1024);
+    CPPUNIT_ASSERT_EQUAL(29999, value.toList()[29999]["id"].toInteger());
+
+    // an error in any chunk fails the whole parse
+    json.insert(json.indexOf(String("\"id\": "), json.size() / 2) + 6, "x");
+    ok = true;
+    CPPUNIT_ASSERT(!Value::fromJSONParallel(json, &pool, &ok, &error).isValid());
+    CPPUNIT_ASSERT(!ok);
+    CPPUNIT_ASSERT(!error.isEmpty());
+}
@@ -0,0 +1,31 @@
+#include <cppunit/extensions/HelperMacros.h>
+
+class JSONTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(JSONTestSuite);
+
+    CPPUNIT_TEST(testScalars);
+    CPPUNIT_TEST(testNumbers);
+    CPPUNIT_TEST(testStrings);
+    CPPUNIT_TEST(testContainers);
+    CPPUNIT_TEST(testRoundTrip);
+    CPPUNIT_TEST(testMalformed);
+    CPPUNIT_TEST(testErrorPosition);
+    CPPUNIT_TEST(testDepthLimit);
+    CPPUNIT_TEST(testParallel);
+
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    void testScalars();
+    void testNumbers();
+    void testStrings();
+    void testContainers();
+    void testRoundTrip();
+    void testMalformed();
+    void testErrorPosition();
+    void testDepthLimit();
+    void testParallel();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(JSONTestSuite);
@@ -0,0 +1,169 @@
+#include <LRUCacheTestSuite.h>
+#include <rct/LRUCache.h>
+#include <rct/String.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+template <typename T>
+static bool equal(const List<T> &l, const List<T> &r)
+{
+    return l.size() == r.size() && std::equal(l.begin(), l.end(), r.begin());
+}
+
+void LRUCacheTestSuite::testEvictionOrder()
+{
+    LRUCache<int, String> cache(3);
+    cache.insert(1, "one");
+    cache.insert(2, "two");
+    cache.insert(3, "three");
+    CPPUNIT_ASSERT(equal(cache.keys(), List<int>() << 3 << 2 << 1));
+
+    cache.insert(4, "four");
+    CPPUNIT_ASSERT(!cache.contains(1));
+    CPPUNIT_ASSERT(equal(cache.keys(), List<int>() << 4 << 3 << 2));
+
+    // replacing makes it the most recent without evicting anything
+    cache.insert(2, "TWO");
+    CPPUNIT_ASSERT(equal(cache.keys(), List<int>() << 2 << 4 << 3));
+    CPPUNIT_ASSERT(*cache.peek(2) == "TWO");
+
+    cache.setMaxCount(1);
+    CPPUNIT_ASSERT(equal(cache.keys(), List<int>() << 2));
+
+    CPPUNIT_ASSERT(cache.take(2) == "TWO");
+    CPPUNIT_ASSERT(cache.isEmpty());
+}
+
+void LRUCacheTestSuite::testFindRefreshes()
+{
+    LRUCache<int, int> cache(3);
+    for (int i = 1; i <= 3; ++i)
+        cache.insert(i, i * 10);
+
+    // peek doesn't count as a use, find does
+    CPPUNIT_ASSERT_EQUAL(10, *cache.peek(1));
+    cache.insert(4, 40);
+    CPPUNIT_ASSERT(!cache.contains(1));
+
+    CPPUNIT_ASSERT_EQUAL(20, *cache.find(2));
+    cache.insert(5, 50);
+    CPPUNIT_ASSERT(cache.contains(2));
+    CPPUNIT_ASSERT(!cache.contains(3));
+
+    bool ok = true;
+    CPPUNIT_ASSERT_EQUAL(-1, cache.value(3, -1, &ok));
+    CPPUNIT_ASSERT(!ok);
+    CPPUNIT_ASSERT(equal(cache.keys(), List<int>() << 5 << 2 << 4));
+}
+
+void LRUCacheTestSuite::testCost()
+{
+    LRUCache<String, String> cache(0, 100);
+    CPPUNIT_ASSERT(cache.insert("a", "a", 40));
+    CPPUNIT_ASSERT(cache.insert("b", "b", 40));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(80), cache.cost());
+
+    // too big on its own, nothing is dropped for it
+    CPPUNIT_ASSERT(!cache.insert("huge", "huge", 101));
+    CPPUNIT_ASSERT(!cache.contains("huge"));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), cache.size());
+
+    // drops the oldest until it fits
+    CPPUNIT_ASSERT(cache.insert("c", "c", 90));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), cache.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(90), cache.cost());
+
+    // a replaced entry's cost goes with it
+    cache.insert("c", "c", 10);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(10), cache.cost());
+    cache.remove("c");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), cache.cost());
+}
+
+void LRUCacheTestSuite::testEvictionHandler()
+{
+    LRUCache<int, int> cache(2);
+    List<int> evicted;
+    cache.setEvictionHandler([&evicted](const int &key, int &value) {
+            CPPUNIT_ASSERT_EQUAL(key * 10, value);
+            evicted.append(key);
+        });
+    for (int i = 1; i <= 5; ++i)
+        cache.insert(i, i * 10);
+    CPPUNIT_ASSERT(equal(evicted, List<int>() << 1 << 2 << 3));
+
+    // not for entries that are removed, replaced or cleared
+    cache.remove(4);
+    cache.insert(5, 50);
+    cache.clear();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), evicted.size());
+}
+
+void LRUCacheTestSuite::testStatistics()
+{
+    LRUCache<int, int> cache(2);
+    cache.insert(1, 1);
+    cache.insert(2, 2);
+    cache.insert(3, 3);
+    cache.find(1);
+    cache.find(2);
+    cache.find(3);
+    cache.peek(3);
+
+    const LRUCache<int, int>::Statistics &statistics = cache.statistics();
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(2), statistics.hits);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1), statistics.misses);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(3), statistics.insertions);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1), statistics.evictions);
+    cache.resetStatistics();
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(0), cache.statistics().hits);
+}
+
+void LRUCacheTestSuite::testSharded()
+{
+    ShardedLRUCache<int, int, std::hash<int>, 4> cache(100);
+    for (int i = 0; i < 1000; ++i)
+        cache.insert(i, i);
+    // each shard keeps a quarter
+    CPPUNIT_ASSERT(cache.size() <= 100);
+    CPPUNIT_ASSERT(cache.size() > 50);
+    CPPUNIT_ASSERT(cache.contains(999));
+
+    int value = 0;
+    CPPUNIT_ASSERT(cache.find(999, &value));
+    CPPUNIT_ASSERT_EQUAL(999, value);
+    CPPUNIT_ASSERT_EQUAL(-1, cache.value(0, -1));
+
+    const ShardedLRUCache<int, int>::Statistics statistics = cache.statistics();
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1000), statistics.insertions);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1000 - cache.size()), statistics.evictions);
+
+    cache.clear();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), cache.size());
+}
+
+void LRUCacheTestSuite::testShardedThreads()
+{
+    ShardedLRUCache<int, int> *cache = new ShardedLRUCache<int, int>(0, 1000000);
+    std::atomic<int> wrong(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([cache, t, &wrong]() {
+                for (int i = 0; i < 10000; ++i) {
+                    const int key = t * 10000 + i;
+                    cache->insert(key, key, 10);
+                    int value = -1;
+                    if (cache->find(key - 5, &value) && value != key - 5)
+                        ++wrong;
+                }
+            });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    CPPUNIT_ASSERT_EQUAL(0, wrong.load());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(40000), cache->size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(400000), cache->cost());
+    delete cache;
+}
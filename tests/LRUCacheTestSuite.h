@@ -0,0 +1,27 @@
+#include <cppunit/extensions/HelperMacros.h>
+
+class LRUCacheTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(LRUCacheTestSuite);
+
+    CPPUNIT_TEST(testEvictionOrder);
+    CPPUNIT_TEST(testFindRefreshes);
+    CPPUNIT_TEST(testCost);
+    CPPUNIT_TEST(testEvictionHandler);
+    CPPUNIT_TEST(testStatistics);
+    CPPUNIT_TEST(testSharded);
+    CPPUNIT_TEST(testShardedThreads);
+
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    void testEvictionOrder();
+    void testFindRefreshes();
+    void testCost();
+    void testEvictionHandler();
+    void testStatistics();
+    void testSharded();
+    void testShardedThreads();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(LRUCacheTestSuite);
@@ -0,0 +1,151 @@
+#include <SmallListTestSuite.h>
+#include <rct/SmallList.h>
+#include <rct/String.h>
+
+namespace {
+// counts the live instances
+struct Counted
+{
+    Counted(int v = 0) : value(v) { ++live; }
+    Counted(const Counted &other) : value(other.value) { ++live; }
+    ~Counted() { --live; }
+    Counted &operator=(const Counted &other) = default;
+
+    int value;
+    static int live;
+};
+int Counted::live = 0;
+}
+
+void SmallListTestSuite::testInlineToHeap()
+{
+    SmallList<int, 4> list;
+    CPPUNIT_ASSERT(list.isInline());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), list.capacity());
+    for (int i = 0; i < 4; ++i)
+        list.append(i);
+    CPPUNIT_ASSERT(list.isInline());
+    list.append(4);
+    CPPUNIT_ASSERT(!list.isInline());
+    CPPUNIT_ASSERT(list.capacity() >= 5);
+    for (int i = 0; i < 5; ++i)
+        CPPUNIT_ASSERT_EQUAL(i, list[i]);
+
+    list.chop(2);
+    list.squeeze();
+    CPPUNIT_ASSERT(list.isInline());
+    CPPUNIT_ASSERT(list == List<int>() << 0 << 1 << 2);
+    list.clear();
+    CPPUNIT_ASSERT(list.isEmpty());
+}
+
+void SmallListTestSuite::testCopyAndMove()
+{
+    SmallList<String, 2> small = { "a", "b" };
+    SmallList<String, 2> big = { "a", "b", "c", "d" };
+
+    SmallList<String, 2> copy = big;
+    copy[0] = "changed";
+    CPPUNIT_ASSERT(big[0] == "a");
+
+    SmallList<String, 2> moved = std::move(small);
+    CPPUNIT_ASSERT(moved.isInline());
+    CPPUNIT_ASSERT(moved == List<String>() << "a" << "b");
+    CPPUNIT_ASSERT(small.isEmpty());
+
+    const String *data = big.data();
+    moved = std::move(big);
+    // heap memory is handed over, not copied
+    CPPUNIT_ASSERT(moved.data() == data);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), moved.size());
+    CPPUNIT_ASSERT(big.isEmpty());
+    CPPUNIT_ASSERT(big.isInline());
+
+    // other inline sizes and List
+    const SmallList<String, 8> wider(moved);
+    CPPUNIT_ASSERT(wider.isInline());
+    CPPUNIT_ASSERT(wider == moved);
+    const List<String> list = moved;
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), list.size());
+    CPPUNIT_ASSERT(list[3] == "d");
+}
+
+void SmallListTestSuite::testInsertAndRemove()
+{
+    SmallList<int, 3> list = { 1, 4 };
+    list.insert(1, 2);
+    list.insert(2, 3);
+    list.prepend(0);
+    CPPUNIT_ASSERT(list == List<int>() << 0 << 1 << 2 << 3 << 4);
+
+    list.removeAt(0);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), list.remove(3));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), list.remove([](const int &i) { return i == 4; }));
+    CPPUNIT_ASSERT(list == List<int>() << 1 << 2);
+    CPPUNIT_ASSERT_EQUAL(2, list.takeLast());
+    CPPUNIT_ASSERT_EQUAL(1, list.takeFirst());
+    CPPUNIT_ASSERT(list.isEmpty());
+}
+
+void SmallListTestSuite::testAppendOwnElement()
+{
+    SmallList<String, 2> list = { "first", "second" };
+    // the element is copied before the storage moves to the heap
+    list.append(list[0]);
+    list.append(list.last());
+    CPPUNIT_ASSERT(list == List<String>() << "first" << "second" << "first" << "first");
+}
+
+void SmallListTestSuite::testElementLifetimes()
+{
+    {
+        SmallList<Counted, 2> list;
+        for (int i = 0; i < 10; ++i)
+            list.append(Counted(i));
+        CPPUNIT_ASSERT_EQUAL(10, Counted::live);
+        list.remove(2, 3);
+        CPPUNIT_ASSERT_EQUAL(7, Counted::live);
+        CPPUNIT_ASSERT_EQUAL(5, list[2].value);
+        list.resize(1);
+        list.squeeze();
+        CPPUNIT_ASSERT_EQUAL(1, Counted::live);
+        SmallList<Counted, 2> copy = list;
+        CPPUNIT_ASSERT_EQUAL(2, Counted::live);
+    }
+    CPPUNIT_ASSERT_EQUAL(0, Counted::live);
+}
+
+void SmallListTestSuite::testSerializeRoundTrip()
+{
+    // native elements go as one block, others one by one
+    SmallList<int, 4> ints;
+    for (int i = 0; i < 10; ++i)
+        ints.append(i * i);
+    SmallList<String, 2> strings = { "a", "", "ccc" };
+
+    String data;
+    {
+        Serializer serializer(data);
+        serializer << ints << strings;
+    }
+    CPPUNIT_ASSERT_EQUAL(serializedSize(ints) + serializedSize(strings), data.size());
+
+    SmallList<int, 4> intsBack;
+    SmallList<String, 2> stringsBack;
+    {
+        Deserializer deserializer(data);
+        deserializer >> intsBack >> stringsBack;
+    }
+    CPPUNIT_ASSERT(intsBack == ints);
+    CPPUNIT_ASSERT(stringsBack == strings);
+
+    // the format is List's
+    List<int> list;
+    List<String> stringList;
+    {
+        Deserializer deserializer(data);
+        deserializer >> list >> stringList;
+    }
+    CPPUNIT_ASSERT(ints == list);
+    CPPUNIT_ASSERT(strings == stringList);
+}
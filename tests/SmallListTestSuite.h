@@ -0,0 +1,25 @@
+#include <cppunit/extensions/HelperMacros.h>
+
+class SmallListTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(SmallListTestSuite);
+
+    CPPUNIT_TEST(testInlineToHeap);
+    CPPUNIT_TEST(testCopyAndMove);
+    CPPUNIT_TEST(testInsertAndRemove);
+    CPPUNIT_TEST(testAppendOwnElement);
+    CPPUNIT_TEST(testElementLifetimes);
+    CPPUNIT_TEST(testSerializeRoundTrip);
+
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    void testInlineToHeap();
+    void testCopyAndMove();
+    void testInsertAndRemove();
+    void testAppendOwnElement();
+    void testElementLifetimes();
+    void testSerializeRoundTrip();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(SmallListTestSuite);
@@ -0,0 +1,265 @@
+#include <TableFileTestSuite.h>
+#include <stdlib.h>
+#include <rct/Map.h>
+#include <rct/String.h>
+#include <rct/TableFile.h>
+
+enum {
+    Version = 5,
+    Count = 2000
+};
+
+void TableFileTestSuite::setUp()
+{
+    char dir[] = "/tmp/rct-tablefile-XXXXXX";
+    CPPUNIT_ASSERT(mkdtemp(dir));
+    mDir = Path(dir).ensureTrailingSlash();
+    mPath = mDir + "table";
+}
+
+void TableFileTestSuite::tearDown()
+{
+    Path::rmdir(mDir);
+}
+
+static String key(int i)
+{
+    return String::format<32>("key-%05d", i);
+}
+
+static String value(int i)
+{
+    return String::format<32>("value-%05d", i);
+}
+
+// the even keys below Count in small blocks, so there are a lot of them
+static bool writeTable(const Path &path, int bloomBitsPerKey = TableFileWriter::DefaultBloomBitsPerKey)
+{
+    TableFileWriter writer(path, Version);
+    writer.setBlockSize(256);
+    writer.setBloomBitsPerKey(bloomBitsPerKey);
+    if (!writer.open())
+        return false;
+    for (int i = 0; i < Count; i += 2) {
+        if (!writer.write(key(i), value(i)))
+            return false;
+    }
+    return writer.commit();
+}
+
+void TableFileTestSuite::testLookup()
+{
+    for (int bits = 0; bits <= TableFileWriter::DefaultBloomBitsPerKey; bits += TableFileWriter::DefaultBloomBitsPerKey) {
+        CPPUNIT_ASSERT(writeTable(mPath, bits));
+        TableFile table(mPath, Version);
+        CPPUNIT_ASSERT(table.open());
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(Count / 2), table.size());
+        int wrong = 0;
+        for (int i = 0; i < Count; ++i) {
+            String data;
+            const bool found = table.read(key(i), data);
+            if (found != !(i % 2) || (found && data != value(i)) || table.contains(key(i)) != found)
+                ++wrong;
+        }
+        CPPUNIT_ASSERT_EQUAL(0, wrong);
+        CPPUNIT_ASSERT(table.view(key(100)) == value(100));
+        CPPUNIT_ASSERT(table.view(key(101)).isEmpty());
+        // before the first key, after the last one and prefixes of keys
+        CPPUNIT_ASSERT(!table.contains(String("a")));
+        CPPUNIT_ASSERT(!table.contains(String("zzz")));
+        CPPUNIT_ASSERT(!table.contains(String("key-")));
+        CPPUNIT_ASSERT(!table.contains(String()));
+    }
+}
+
+void TableFileTestSuite::testIterate()
+{
+    CPPUNIT_ASSERT(writeTable(mPath));
+    TableFile table(mPath, Version);
+    CPPUNIT_ASSERT(table.open());
+
+    int i = 0, wrong = 0;
+    for (TableFile::Iterator it = table.begin(); it.isValid(); it.next()) {
+        if (it.key() != key(i) || it.value() != value(i))
+            ++wrong;
+        i += 2;
+    }
+    CPPUNIT_ASSERT_EQUAL(0, wrong);
+    CPPUNIT_ASSERT_EQUAL(static_cast<int>(Count), i);
+
+    TableFile::Iterator it = table.lowerBound(key(500));
+    CPPUNIT_ASSERT(it.isValid() && it.key() == key(500));
+    it = table.lowerBound(key(501));
+    CPPUNIT_ASSERT(it.isValid() && it.key() == key(502));
+    it.next();
+    CPPUNIT_ASSERT(it.key() == key(504));
+    it = table.lowerBound(String("a"));
+    CPPUNIT_ASSERT(it.isValid() && it.key() == key(0));
+    CPPUNIT_ASSERT(!table.lowerBound(key(Count)).isValid());
+}
+
+void TableFileTestSuite::testSerialize()
+{
+    Map<String, List<String> > map;
+    map["b"] = List<String>() << "one" << "two";
+    map["a"] = List<String>();
+    map["c"] = List<String>() << String(10000, 'c');
+    for (int compact = 0; compact < 2; ++compact) {
+        const int version = compact ? Version | Serializer::CompactVersion : Version;
+        {
+            TableFileWriter writer(mPath, version);
+            CPPUNIT_ASSERT(writer.open());
+            CPPUNIT_ASSERT(writer.serialize(map));
+            CPPUNIT_ASSERT(writer.commit());
+        }
+        TableFile table(mPath, version);
+        CPPUNIT_ASSERT(table.open());
+        for (const auto &entry : map) {
+            bool ok = false;
+            CPPUNIT_ASSERT(table.value<List<String> >(entry.first, List<String>(), &ok) == entry.second);
+            CPPUNIT_ASSERT(ok);
+        }
+        bool ok = true;
+        CPPUNIT_ASSERT(table.value<List<String> >(String("d"), List<String>() << "default", &ok)
+                       == List<String>() << "default");
+        CPPUNIT_ASSERT(!ok);
+        List<String> list;
+        TableFile::Iterator it = table.lowerBound(String("b"));
+        CPPUNIT_ASSERT(it.deserialize(list));
+        CPPUNIT_ASSERT(list == map["b"]);
+    }
+}
+
+void TableFileTestSuite::testEmpty()
+{
+    {
+        TableFileWriter writer(mPath, Version);
+        CPPUNIT_ASSERT(writer.open());
+        CPPUNIT_ASSERT(writer.commit());
+    }
+    TableFile table(mPath, Version);
+    CPPUNIT_ASSERT(table.open());
+    CPPUNIT_ASSERT(table.isEmpty());
+    CPPUNIT_ASSERT(!table.begin().isValid());
+    CPPUNIT_ASSERT(!table.lowerBound(String("a")).isValid());
+    CPPUNIT_ASSERT(!table.contains(String("a")));
+}
+
+void TableFileTestSuite::testWriteOrder()
+{
+    {
+        TableFileWriter writer(mPath, Version);
+        CPPUNIT_ASSERT(!writer.write(String("a"), String("1")));
+        CPPUNIT_ASSERT(writer.open());
+        CPPUNIT_ASSERT(writer.write(String("b"), String("1")));
+        CPPUNIT_ASSERT(!writer.write(String("b"), String("2")));
+        CPPUNIT_ASSERT(!writer.write(String("a"), String("3")));
+        CPPUNIT_ASSERT(writer.error().startsWith("Keys out of order"));
+        // nothing replaces the file without a commit
+    }
+    CPPUNIT_ASSERT(!mPath.exists());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), mDir.files().size());
+}
+
+void TableFileTestSuite::testMerge()
+{
+    const Path first = mDir + "first", second = mDir + "second";
+    CPPUNIT_ASSERT(writeTable(first));
+    {
+        TableFileWriter writer(second, Version);
+        CPPUNIT_ASSERT(writer.open());
+        for (int i = 0; i < Count; i += 3)
+            CPPUNIT_ASSERT(writer.write(key(i), String("second")));
+        CPPUNIT_ASSERT(writer.commit());
+    }
+    String error;
+    CPPUNIT_ASSERT(TableFile::merge(List<Path>() << first << second, mPath, Version, &error));
+    CPPUNIT_ASSERT(error.isEmpty());
+
+    TableFile table(mPath, Version);
+    CPPUNIT_ASSERT(table.open());
+    int expected = 0, wrong = 0;
+    for (int i = 0; i < Count; ++i) {
+        String data;
+        const bool found = table.read(key(i), data);
+        if (!(i % 3)) {
+            wrong += !found || data != "second";
+        } else if (!(i % 2)) {
+            wrong += !found || data != value(i);
+        } else {
+            wrong += found;
+        }
+        expected += !(i % 2) || !(i % 3);
+    }
+    CPPUNIT_ASSERT_EQUAL(0, wrong);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(expected), table.size());
+
+    CPPUNIT_ASSERT(!TableFile::merge(List<Path>() << first << mDir + "missing", mPath, Version, &error));
+    CPPUNIT_ASSERT(error.startsWith(mDir + "missing"));
+}
+
+void TableFileTestSuite::testCorruptBlock()
+{
+    CPPUNIT_ASSERT(writeTable(mPath));
+    String data = mPath.readAll();
+    const size_t pos = data.indexOf(value(1000));
+    CPPUNIT_ASSERT(pos != String::npos);
+    data[pos] = 'V';
+    CPPUNIT_ASSERT(Path::write(mPath, data));
+
+    TableFile table(mPath, Version);
+    CPPUNIT_ASSERT(table.open());
+    String value;
+    CPPUNIT_ASSERT(!table.read(key(1000), value));
+    CPPUNIT_ASSERT(table.read(key(0), value));
+    CPPUNIT_ASSERT(table.read(key(Count - 2), value));
+
+    // the damaged block is skipped, the rest is still in order
+    int seen = 0;
+    String last;
+    bool ordered = true;
+    for (TableFile::Iterator it = table.begin(); it.isValid(); it.next()) {
+        ordered = ordered && last < it.key();
+        last = it.key();
+        CPPUNIT_ASSERT(it.key() != key(1000));
+        ++seen;
+    }
+    CPPUNIT_ASSERT(ordered);
+    CPPUNIT_ASSERT(seen > 0 && seen < Count / 2);
+}
+
+void TableFileTestSuite::testInvalidFile()
+{
+    TableFile missing(mPath, Version);
+    CPPUNIT_ASSERT(!missing.open());
+    CPPUNIT_ASSERT(missing.error().startsWith("Can't open"));
+
+    CPPUNIT_ASSERT(Path::write(mPath, String("short")));
+    TableFile small(mPath, Version);
+    CPPUNIT_ASSERT(!small.open());
+    CPPUNIT_ASSERT(small.error() == "File is too small");
+
+    CPPUNIT_ASSERT(Path::write(mPath, String(256, 'x')));
+    TableFile text(mPath, Version);
+    CPPUNIT_ASSERT(!text.open());
+    CPPUNIT_ASSERT(text.error().startsWith("Wrong magic"));
+
+    CPPUNIT_ASSERT(writeTable(mPath));
+    TableFile other(mPath, Version + 1);
+    CPPUNIT_ASSERT(!other.open());
+    CPPUNIT_ASSERT(other.error().startsWith("Wrong version"));
+
+    const String data = mPath.readAll();
+    CPPUNIT_ASSERT(Path::write(mPath, data.left(data.size() - 1)));
+    TableFile truncated(mPath, Version);
+    CPPUNIT_ASSERT(!truncated.open());
+    CPPUNIT_ASSERT(truncated.error() == "Invalid footer");
+
+    // a byte of the bloom filter, just before the footer
+    String damaged = data;
+    damaged[damaged.size() - 49] ^= 1;
+    CPPUNIT_ASSERT(Path::write(mPath, damaged));
+    TableFile index(mPath, Version);
+    CPPUNIT_ASSERT(!index.open());
+    CPPUNIT_ASSERT(index.error() == "Index checksum mismatch");
+}
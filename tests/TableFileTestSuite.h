@@ -0,0 +1,37 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include <rct/Path.h>
+
+class TableFileTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TableFileTestSuite);
+
+    CPPUNIT_TEST(testLookup);
+    CPPUNIT_TEST(testIterate);
+    CPPUNIT_TEST(testSerialize);
+    CPPUNIT_TEST(testEmpty);
+    CPPUNIT_TEST(testWriteOrder);
+    CPPUNIT_TEST(testMerge);
+    CPPUNIT_TEST(testCorruptBlock);
+    CPPUNIT_TEST(testInvalidFile);
+
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp() override;
+    void tearDown() override;
+
+protected:
+    void testLookup();
+    void testIterate();
+    void testSerialize();
+    void testEmpty();
+    void testWriteOrder();
+    void testMerge();
+    void testCorruptBlock();
+    void testInvalidFile();
+
+private:
+    Path mDir, mPath;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(TableFileTestSuite);
@@ -0,0 +1,104 @@
+#include <ThreadPoolTestSuite.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <rct/ThreadPool.h>
+
+enum {
+    Parents = 50,
+    Children = 20
+};
+
+// starts Children jobs of its own from the pool thread, with WorkStealing
+// those go through the thread's own queue and may be stolen
+class StatisticsJob : public ThreadPool::Job
+{
+public:
+    StatisticsJob(ThreadPool *pool, std::atomic<int> *ran, bool parent)
+        : mPool(pool), mRan(ran), mParent(parent)
+    {
+        setStatisticsName(parent ? "parent" : "child");
+    }
+
+protected:
+    virtual void run() override
+    {
+        if (mParent) {
+            for (int i = 0; i < Children; ++i)
+                mPool->start(std::make_shared<StatisticsJob>(mPool, mRan, false));
+        }
+        ++*mRan;
+    }
+
+private:
+    ThreadPool *mPool;
+    std::atomic<int> *mRan;
+    const bool mParent;
+};
+
+// runs the jobs and waits until they're all recorded, which is after
+// they've run
+static ThreadPool::Statistics runJobs(ThreadPool &pool)
+{
+    std::atomic<int> ran(0);
+    for (int i = 0; i < Parents; ++i)
+        pool.start(std::make_shared<StatisticsJob>(&pool, &ran, true));
+    const uint64_t total = Parents * (Children + 1);
+    ThreadPool::Statistics statistics;
+    for (int i = 0; i < 1000; ++i) {
+        statistics = pool.statistics();
+        if (ran == static_cast<int>(total) && (!pool.isInstrumentationEnabled() || statistics.finished == total))
+            break;
+        usleep(10000);
+    }
+    CPPUNIT_ASSERT_EQUAL(static_cast<int>(total), ran.load());
+    return statistics;
+}
+
+static void checkStatistics(ThreadPool &pool)
+{
+    pool.setInstrumentationEnabled(true);
+    pool.setPerTypeStatistics(true);
+    const ThreadPool::Statistics statistics = runJobs(pool);
+    const uint64_t total = Parents * (Children + 1);
+    CPPUNIT_ASSERT_EQUAL(total, statistics.started);
+    CPPUNIT_ASSERT_EQUAL(total, statistics.finished);
+    CPPUNIT_ASSERT_EQUAL(total, statistics.all.wait.count);
+    CPPUNIT_ASSERT_EQUAL(total, statistics.all.run.count);
+    uint64_t bucketed = 0;
+    for (int i = 0; i < ThreadPool::Statistics::BucketCount; ++i)
+        bucketed += statistics.all.wait.buckets[i];
+    CPPUNIT_ASSERT_EQUAL(total, bucketed);
+    CPPUNIT_ASSERT(statistics.all.wait.maxUs <= statistics.all.wait.totalUs);
+    CPPUNIT_ASSERT(statistics.peakBacklog >= 1);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), statistics.types.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(Parents), statistics.types.at("parent").run.count);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(Parents * Children), statistics.types.at("child").wait.count);
+
+    pool.resetStatistics();
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(0), pool.statistics().started);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), pool.statistics().peakBacklog);
+}
+
+void ThreadPoolTestSuite::testStatistics()
+{
+    ThreadPool pool(4);
+    checkStatistics(pool);
+}
+
+void ThreadPoolTestSuite::testWorkStealingStatistics()
+{
+    ThreadPool pool(4, Thread::Normal, 0, ThreadPool::WorkStealing);
+    checkStatistics(pool);
+}
+
+void ThreadPoolTestSuite::testStatisticsDisabled()
+{
+    for (int scheduling = ThreadPool::SharedQueue; scheduling <= ThreadPool::WorkStealing; ++scheduling) {
+        ThreadPool pool(4, Thread::Normal, 0, static_cast<ThreadPool::Scheduling>(scheduling));
+        runJobs(pool);
+        const ThreadPool::Statistics statistics = pool.statistics();
+        CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(0), statistics.started);
+        CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(0), statistics.all.run.count);
+    }
+}
@@ -0,0 +1,19 @@
+#include <cppunit/extensions/HelperMacros.h>
+
+class ThreadPoolTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(ThreadPoolTestSuite);
+
+    CPPUNIT_TEST(testStatistics);
+    CPPUNIT_TEST(testWorkStealingStatistics);
+    CPPUNIT_TEST(testStatisticsDisabled);
+
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    void testStatistics();
+    void testWorkStealingStatistics();
+    void testStatisticsDisabled();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(ThreadPoolTestSuite);
@@ -0,0 +1,71 @@
+#include <ValueTestSuite.h>
+#include <rct/Value.h>
+
+void ValueTestSuite::testCopyIsShared()
+{
+    Value value;
+    value["a"] = 1;
+    Value copy = value;
+    copy["a"] = 2;
+    value["b"] = 3;
+
+    CPPUNIT_ASSERT_EQUAL(1, value.value<int>("a"));
+    CPPUNIT_ASSERT_EQUAL(3, value.value<int>("b"));
+    CPPUNIT_ASSERT_EQUAL(2, copy.value<int>("a"));
+    CPPUNIT_ASSERT(!copy.contains("b"));
+}
+
+void ValueTestSuite::testCopyAfterMapReference()
+{
+    Value value;
+    Value &ref = value["a"];
+    ref = 1;
+    const Value copy = value;
+    ref = 5;
+
+    CPPUNIT_ASSERT_EQUAL(5, value.value<int>("a"));
+    CPPUNIT_ASSERT_EQUAL(1, copy.value<int>("a"));
+}
+
+void ValueTestSuite::testCopyAfterListReference()
+{
+    Value value;
+    value.push_back(1);
+    Value &ref = value[0];
+    const Value copy = value;
+    ref = 7;
+
+    CPPUNIT_ASSERT_EQUAL(7, value.value<int>(0));
+    CPPUNIT_ASSERT_EQUAL(1, copy.value<int>(0));
+}
+
+void ValueTestSuite::testCopyAfterGetMutable()
+{
+    Value value(List<Value>() << 1 << 2);
+    List<Value> *list = value.getMutable<List<Value> >();
+    const Value copy = value;
+    list->append(3);
+
+    CPPUNIT_ASSERT_EQUAL(3, value.count());
+    CPPUNIT_ASSERT_EQUAL(2, copy.count());
+
+    Value string(String("abc"));
+    String *str = string.getMutable<String>();
+    const Value stringCopy = string;
+    str->append("def");
+
+    CPPUNIT_ASSERT(string.toString() == "abcdef");
+    CPPUNIT_ASSERT(stringCopy.toString() == "abc");
+}
+
+void ValueTestSuite::testNestedReference()
+{
+    Value value;
+    Value &inner = value["outer"]["inner"];
+    inner = 1;
+    const Value copy = value;
+    inner = 2;
+
+    CPPUNIT_ASSERT_EQUAL(2, value["outer"].value<int>("inner"));
+    CPPUNIT_ASSERT_EQUAL(1, copy["outer"].value<int>("inner"));
+}
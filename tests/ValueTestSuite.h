@@ -0,0 +1,23 @@
+#include <cppunit/extensions/HelperMacros.h>
+
+class ValueTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(ValueTestSuite);
+
+    CPPUNIT_TEST(testCopyIsShared);
+    CPPUNIT_TEST(testCopyAfterMapReference);
+    CPPUNIT_TEST(testCopyAfterListReference);
+    CPPUNIT_TEST(testCopyAfterGetMutable);
+    CPPUNIT_TEST(testNestedReference);
+
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    void testCopyIsShared();
+    void testCopyAfterMapReference();
+    void testCopyAfterListReference();
+    void testCopyAfterGetMutable();
+    void testNestedReference();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(ValueTestSuite);
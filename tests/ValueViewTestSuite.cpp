@@ -0,0 +1,185 @@
+#include <ValueViewTestSuite.h>
+#include <rct/Serializer.h>
+#include <rct/String.h>
+#include <rct/Value.h>
+#include <rct/ValueView.h>
+
+static Value sample()
+{
+    Value value;
+    value["name"] = String("rct \"quoted\"");
+    value["jobs"] = 8;
+    value["ratio"] = 0.5;
+    value["enabled"] = true;
+    value["nothing"] = Value();
+    value["list"] = List<Value>() << Value(1) << Value(String("two")) << Value(List<Value>() << Value(3));
+    value["build"]["flags"] = List<Value>() << Value(String("-O2")) << Value(String("-g"));
+    value["build"]["jobs"] = 4;
+    return value;
+}
+
+static String encode(const Value &value, bool compact)
+{
+    String data;
+    Serializer serializer(data);
+    serializer.setCompact(compact);
+    serializer << value;
+    return data;
+}
+
+void ValueViewTestSuite::testJSONLookup()
+{
+    const Value value = sample();
+    const String json = value.toJSON(true);
+    const ValueView view = ValueView::fromJSON(json);
+
+    CPPUNIT_ASSERT(view.isMap());
+    CPPUNIT_ASSERT_EQUAL(value.count(), view.count());
+    CPPUNIT_ASSERT_EQUAL(4, view["build"]["jobs"].toInteger());
+    CPPUNIT_ASSERT(view["build"]["flags"].at(1).toString() == "-g");
+    CPPUNIT_ASSERT_EQUAL(3, view["list"].at(2).at(0).toInteger());
+    CPPUNIT_ASSERT(view.contains("nothing"));
+    CPPUNIT_ASSERT(!view.contains("missing"));
+    CPPUNIT_ASSERT(!view["missing"]["deeper"].isValid());
+    CPPUNIT_ASSERT(!view["list"].at(3).isValid());
+    CPPUNIT_ASSERT(!view["list"].at(-1).isValid());
+    CPPUNIT_ASSERT(view.keys() == value.toMap().keys());
+
+    // the whole thing and a subtree decode like fromJSON() does
+    CPPUNIT_ASSERT(view.toValue().toJSON() == value.toJSON());
+    CPPUNIT_ASSERT(view["build"].toValue().toJSON() == value["build"].toJSON());
+    CPPUNIT_ASSERT_EQUAL(json.size(), view.encodedSize());
+}
+
+void ValueViewTestSuite::testJSONScalars()
+{
+    // a view points into the JSON, which has to outlive it
+    const String json("{\"s\": \"a\\nb\\u00e9\", \"i\": -12, \"d\": 1.5e3, "
+                      "\"big\": 12345678901, \"t\": true, \"n\": null}");
+    const ValueView view = ValueView::fromJSON(json);
+    CPPUNIT_ASSERT(view["s"].isString());
+    CPPUNIT_ASSERT(view["s"].toString() == "a\nb\xc3\xa9");
+    CPPUNIT_ASSERT_EQUAL(Value::Type_Integer, view["i"].type());
+    CPPUNIT_ASSERT_EQUAL(-12, view["i"].toInteger());
+    CPPUNIT_ASSERT_EQUAL(1500, view["d"].toInteger());
+    CPPUNIT_ASSERT_EQUAL(Value::Type_Double, view["big"].type());
+    CPPUNIT_ASSERT_EQUAL(12345678901.0, view["big"].toDouble());
+    CPPUNIT_ASSERT(view["t"].toBool());
+    CPPUNIT_ASSERT(view["n"].isValid());
+    CPPUNIT_ASSERT(!view["n"].toValue().isValid());
+}
+
+void ValueViewTestSuite::testBinaryMatchesValue()
+{
+    const Value value = sample();
+    const String data = encode(value, false);
+    const ValueView view = ValueView::fromBinary(data.constData(), data.size());
+
+    CPPUNIT_ASSERT(view.isMap());
+    CPPUNIT_ASSERT(view["name"].toString() == value["name"].toString());
+    CPPUNIT_ASSERT_EQUAL(8, view["jobs"].toInteger());
+    CPPUNIT_ASSERT_EQUAL(0.5, view["ratio"].toDouble());
+    CPPUNIT_ASSERT(view["enabled"].toBool());
+    CPPUNIT_ASSERT(view["build"]["flags"].at(0).toString() == "-O2");
+    CPPUNIT_ASSERT(view.toValue().toJSON() == value.toJSON());
+    CPPUNIT_ASSERT_EQUAL(data.size(), view.encodedSize());
+}
+
+void ValueViewTestSuite::testCompactBinary()
+{
+    Value value = sample();
+    value["huge"] = static_cast<long long>(1) << 40;
+    const String data = encode(value, true);
+    const ValueView view = ValueView::fromBinary(data.constData(), data.size(), true);
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<long long>(1) << 40, view["huge"].toLongLong());
+    // "jobs" is defined at the top and referred to by index in "build"
+    CPPUNIT_ASSERT_EQUAL(4, view["build"]["jobs"].toInteger());
+    CPPUNIT_ASSERT(view.toValue().toJSON() == value.toJSON());
+}
+
+void ValueViewTestSuite::testDeserializer()
+{
+    Value first;
+    first["key"] = 1;
+    Value second;
+    second["key"] = 2;
+    second["other"] = String("x");
+
+    for (int compact = 0; compact < 2; ++compact) {
+        String data;
+        {
+            Serializer serializer(data);
+            serializer.setCompact(compact);
+            serializer << first << second << 42;
+        }
+        Deserializer deserializer(data);
+        deserializer.setCompact(compact);
+        ValueView a, b;
+        int after = 0;
+        deserializer >> a >> b >> after;
+        CPPUNIT_ASSERT_EQUAL(42, after);
+        CPPUNIT_ASSERT(deserializer.atEnd());
+        CPPUNIT_ASSERT_EQUAL(1, a["key"].toInteger());
+        // in the compact format "key" is defined by the first one
+        CPPUNIT_ASSERT_EQUAL(2, b["key"].toInteger());
+        CPPUNIT_ASSERT(b["other"].toString() == "x");
+    }
+}
+
+void ValueViewTestSuite::testVisit()
+{
+    const String json = sample().toJSON();
+    const ValueView view = ValueView::fromJSON(json);
+    List<String> keys;
+    view.visit([&keys](const String &key, const ValueView &) {
+            keys.append(key);
+            return keys.size() < 3;
+        });
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), keys.size());
+
+    int elements = 0;
+    view["list"].forEach([&elements](const StringView &key, const ValueView &value) {
+            CPPUNIT_ASSERT(key.isEmpty());
+            CPPUNIT_ASSERT(value.isValid());
+            ++elements;
+            return true;
+        });
+    CPPUNIT_ASSERT_EQUAL(3, elements);
+}
+
+void ValueViewTestSuite::testMalformed()
+{
+    const char *inputs[] = {
+        "",
+        "{",
+        "{\"a\": }",
+        "{\"a\" 1}",
+        "[1, 2",
+        "\"unterminated"
+    };
+    for (const char *input : inputs) {
+        const String json(input);
+        const ValueView view = ValueView::fromJSON(json);
+        // only what's looked at is checked, decoding all of it fails
+        CPPUNIT_ASSERT(!view.toValue().isValid());
+        CPPUNIT_ASSERT(!view["a"].toValue().isValid());
+        CPPUNIT_ASSERT(!view.at(5).isValid());
+    }
+
+    // a binary encoding cut short anywhere doesn't read past the end
+    const String data = encode(sample(), false);
+    for (size_t size = 0; size < data.size(); ++size) {
+        const String truncated = data.left(size);
+        const ValueView view = ValueView::fromBinary(truncated.constData(), truncated.size());
+        view.toValue();
+        view["build"]["flags"].at(1).toString();
+    }
+    const String compact = encode(sample(), true);
+    for (size_t size = 0; size < compact.size(); ++size) {
+        const String truncated = compact.left(size);
+        const ValueView view = ValueView::fromBinary(truncated.constData(), truncated.size(), true);
+        view.toValue();
+        view["build"]["jobs"].toInteger();
+    }
+}
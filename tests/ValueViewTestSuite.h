@@ -0,0 +1,27 @@
+#include <cppunit/extensions/HelperMacros.h>
+
+class ValueViewTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(ValueViewTestSuite);
+
+    CPPUNIT_TEST(testJSONLookup);
+    CPPUNIT_TEST(testJSONScalars);
+    CPPUNIT_TEST(testBinaryMatchesValue);
+    CPPUNIT_TEST(testCompactBinary);
+    CPPUNIT_TEST(testDeserializer);
+    CPPUNIT_TEST(testVisit);
+    CPPUNIT_TEST(testMalformed);
+
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    void testJSONLookup();
+    void testJSONScalars();
+    void testBinaryMatchesValue();
+    void testCompactBinary();
+    void testDeserializer();
+    void testVisit();
+    void testMalformed();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(ValueViewTestSuite);